@@ -74,6 +74,8 @@
 struct cprotect;
 #endif
 
+struct hfs_free_index;
+
 /*
  *	Just reported via MIG interface.
  */
@@ -241,6 +243,9 @@ typedef struct hfsmount {
 	
 	u_int32_t 			scan_var;			/* For initializing the summary table */
 
+	/* Free extent index, built by the bitmap scan; protected by the bitmap lock */
+	struct hfs_free_index	*hfs_free_index;
+
 
 	u_int32_t		reserveBlocks;		/* free block reserve */
 	u_int32_t		loanedBlocks;		/* blocks on loan for delayed allocations */
@@ -93,11 +93,20 @@ OSStatus SetBTreeBlockSize(FileReference vp, ByteCount blockSize, __unused ItemC
 }
 
 
+/*
+ * Tag that PrefetchBTreeBlock leaves in a buffer's fs-private field.  The
+ * node in such a buffer is in disk order and has never been checked, even
+ * though the buffer is found in the cache.
+ */
+static int btree_prefetch_tag;
+#define BTREE_PREFETCHED	((void *)&btree_prefetch_tag)
+
 OSStatus GetBTreeBlock(FileReference vp, u_int32_t blockNum, GetBlockOptions options, BlockDescriptor *block)
 {
     OSStatus	 retval = E_NONE;
     struct buf   *bp = NULL;
-	u_int8_t     allow_empty_node;	  
+	u_int8_t     allow_empty_node;
+	int          prefetched = 0;	  
 
 	/* If the btree block is being read using hint, it is 
 	 * fine for the swap code to find zeroed out nodes. 
@@ -125,10 +134,21 @@ OSStatus GetBTreeBlock(FileReference vp, u_int32_t blockNum, GetBlockOptions opt
         retval = -1;	//XXX need better error
 
     if (retval == E_NONE) {
+		/*
+		 * A prefetched node is handled as if it had just been read
+		 * from disk, so it is swapped and validated before first use.
+		 * The tag is cleared on every path so a stale one can't follow
+		 * the buffer to a node that is already in native order.
+		 */
+		if (buf_fsprivate(bp) == BTREE_PREFETCHED) {
+			buf_setfsprivate(bp, NULL);
+			prefetched = !(options & kGetEmptyBlock);
+		}
+
         block->blockHeader = bp;
         block->buffer = (char *)buf_dataptr(bp);
     	block->blockNum = buf_lblkno(bp);
-        block->blockReadFromDisk = (buf_fromcache(bp) == 0);	/* not found in cache ==> came from disk */
+        block->blockReadFromDisk = (buf_fromcache(bp) == 0) || prefetched;	/* not found in cache ==> came from disk */
 
 		// XXXdbg 
 		block->isModified = 0;
@@ -211,6 +231,40 @@ OSStatus GetBTreeBlock(FileReference vp, u_int32_t blockNum, GetBlockOptions opt
 }
 
 
+/*
+ * Start reading a b-tree node into the buffer cache without waiting for it,
+ * so that a later GetBTreeBlock for the node finds it there.  The node is
+ * left in disk order and tagged, so that GetBTreeBlock swaps and validates
+ * it when it picks it up from the cache.
+ */
+void PrefetchBTreeBlock(FileReference vp, u_int32_t blockNum, ByteCount blockSize)
+{
+	struct buf *bp;
+
+	/* Nothing to do if it's already in core */
+	bp = buf_getblk(vp, (daddr64_t)blockNum, blockSize, 0, 0, BLK_META | BLK_ONLYVALID);
+	if (bp) {
+		buf_brelse(bp);
+		return;
+	}
+
+	bp = buf_getblk(vp, (daddr64_t)blockNum, blockSize, 0, 0, BLK_META);
+	if (bp == NULL)
+		return;
+
+	if (buf_valid(bp)) {
+		/* Someone else read it in while we were looking */
+		buf_brelse(bp);
+		return;
+	}
+
+	/* The buffer is released when the read completes */
+	buf_setfsprivate(bp, BTREE_PREFETCHED);
+	buf_setflags(bp, B_READ | B_ASYNC);
+	(void) VNOP_STRATEGY(bp);
+}
+
+
 void ModifyBlockStart(FileReference vp, BlockDescPtr blockPtr)
 {
 	struct hfsmount	*hfsmp = VTOHFS(vp);
@@ -721,6 +775,7 @@ again:
 	btcb->getBlockProc      = GetBTreeBlock;
 	btcb->releaseBlockProc  = ReleaseBTreeBlock;
 	btcb->setEndOfForkProc  = ExtendBTreeFile;
+	btcb->prefetchBlockProc = PrefetchBTreeBlock;
 	btcb->keyCompareProc    = (KeyCompareProcPtr)hfs_attrkeycompare;
 	VTOF(vp)->fcbBTCBPtr    = btcb;
 
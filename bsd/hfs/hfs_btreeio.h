@@ -50,6 +50,8 @@ extern OSStatus ExtendBTreeFile(FileReference vp, FSSize minEOF, FSSize maxEOF);
 
 extern void ModifyBlockStart(FileReference vp, BlockDescPtr blockPtr);
 
+extern void PrefetchBTreeBlock(FileReference vp, u_int32_t blockNum, ByteCount blockSize);
+
 int hfs_create_attr_btree(struct hfsmount *hfsmp, u_int32_t nodesize, u_int32_t nodecnt);
 
 u_int16_t get_btree_nodesize(struct vnode *vp);
@@ -38,7 +38,9 @@ enum {
 	HFSDBG_SYNCER        		= HFSDBG_CODE(21),	/* 0x03080054 */
 	HFSDBG_SYNCER_TIMED   		= HFSDBG_CODE(22),	/* 0x03080058 */
 	HFSDBG_UNMAP_SCAN    		= HFSDBG_CODE(23),	/* 0x0308005C */	
-	HFSDBG_UNMAP_SCAN_TRIM   	= HFSDBG_CODE(24)	/* 0x03080060 */
+	HFSDBG_UNMAP_SCAN_TRIM   	= HFSDBG_CODE(24),	/* 0x03080060 */
+	HFSDBG_UNMAP_SCAN_RANGE		= HFSDBG_CODE(25),	/* 0x03080064 */
+	HFSDBG_UNMAP_SCAN_STATS		= HFSDBG_CODE(26)	/* 0x03080068 */
 };
 
 /*
@@ -79,4 +81,6 @@ enum {
     22      HFSDBG_SYNCER_TIMED         now, last_write_completed, hfs_mp->mnt_last_write_issued_timestamp, mnt_pending_write_size, 0 ... now, mnt_last_write_completed_timestamp, mnt_last_write_issued_timestamp, hfs_mp->mnt_pending_write_size, 0 
     23      HFSDBG_UNMAP_SCAN           hfs_raw_dev, 0, 0, 0, 0 ... hfs_raw_dev, error, 0, 0, 0
     24      HFSDBG_UNMAP_TRIM           hfs_raw_dev, 0, 0, 0, 0 ... hfs_raw_dev, error, 0, 0, 0  
+    25      HFSDBG_UNMAP_SCAN_RANGE     hfs_raw_dev, startBlock, endBlock, 0, 0 ... error, freeExtents, read_usecs, scan_usecs, 0
+    26      HFSDBG_UNMAP_SCAN_STATS     hfs_raw_dev, nthreads, scan_usecs, unmap_usecs, freeExtents
 */
@@ -49,6 +49,8 @@
 #include <sys/kauth.h>
 #include <sys/vnode_internal.h>
 #include <sys/mount_internal.h>
+#include <sys/sysctl.h>
+#include <machine/machine_routines.h>
 
 #if CONFIG_MACF
 #include <security/mac_framework.h>
@@ -103,8 +105,29 @@ struct searchinfospec
 };
 typedef struct searchinfospec searchinfospec_t;
 
+/* Arguments for SearchFilter, shared by all of the scanner's workers. */
+struct searchfilter
+{
+	ExtendedVCB		*vcb;
+	u_long			options;
+	struct attrlist		*searchattrs;
+	searchinfospec_t	*searchInfo1;
+	searchinfospec_t	*searchInfo2;
+	vfs_context_t		context;
+};
+
+/*
+ * Number of threads evaluating the search criteria in parallel.  Set
+ * to 1 to walk the catalog on the calling thread only.
+ */
+static int hfs_search_threads = 4;
+SYSCTL_DECL(_vfs_generic_hfs);
+SYSCTL_INT(_vfs_generic_hfs, OID_AUTO, search_threads, CTLFLAG_RW|CTLFLAG_LOCKED, &hfs_search_threads, 0, "Threads used to scan the catalog for searchfs");
+
 static void ResolveHardlink(struct hfsmount *hfsmp, HFSPlusCatalogFile *recp);
 
+static int SearchFilter(void *arg, void *key, void *data, u_int32_t dataSize);
+
 
 static int UnpackSearchAttributeBlock(struct hfsmount *hfsmp, struct attrlist *alist,
 		searchinfospec_t *searchInfo, void *attributeBuffer, int firstblock);
@@ -188,11 +211,12 @@ hfs_vnop_search(ap)
 	u_int32_t eachReturnBufferSize;
 	struct proc *p = current_proc();
 	int err = E_NONE;
-	int isHFSPlus;
 	CatalogKey * myCurrentKeyPtr;
 	CatalogRecord * myCurrentDataPtr;
 	CatPosition * myCatPositionPtr;
 	BTScanState myBTScanState;
+	struct searchfilter myFilter;
+	u_int32_t workerCount;
 	user_addr_t user_start = 0;
 	user_size_t user_len = 0;
 	int32_t searchTime;
@@ -255,7 +279,6 @@ hfs_vnop_search(ap)
 		return (EINVAL);
 	}
 
-	isHFSPlus = (vcb->vcbSigWord == kHFSPlusSigWord);
 	hfsmp = VTOHFS(ap->a_vp);
 	
 	searchTime = kMaxMicroSecsInKernel;
@@ -353,6 +376,26 @@ hfs_vnop_search(ap)
 	if (err)
 		goto ExitThisRoutine;
 
+	myFilter.vcb = vcb;
+	myFilter.options = ap->a_options;
+	myFilter.searchattrs = ap->a_searchattrs;
+	myFilter.searchInfo1 = &searchInfo1;
+	myFilter.searchInfo2 = &searchInfo2;
+	myFilter.context = ap->a_context;
+
+	/*
+	 * Let worker threads read the catalog and check the search criteria
+	 * ahead of us.  The matches still come back in catalog order, so the
+	 * access checks and copyout below are unchanged.  If the workers can't
+	 * be started, just scan the catalog on this thread.
+	 */
+	workerCount = (hfs_search_threads > 0) ? (u_int32_t)hfs_search_threads : 1;
+	workerCount = MIN(workerCount, (u_int32_t)ml_get_max_cpus());
+	if (workerCount > 1) {
+		(void) BTScanStartWorkers(&myBTScanState, workerCount, kCatSearchChunkSize,
+					SearchFilter, &myFilter);
+	}
+
 	if (throttle_get_io_policy(&ut) == IOPOL_THROTTLE)
 		needThrottle = TRUE;
 	/*
@@ -369,12 +412,9 @@ hfs_vnop_search(ap)
 		if (err)
 			break;
 
-		/* Resolve any hardlinks */
-		if (isHFSPlus && (ap->a_options & SRCHFS_SKIPLINKS) == 0) {
-			ResolveHardlink(vcb, (HFSPlusCatalogFile *)myCurrentDataPtr);
-		}
-		if (CheckCriteria( vcb, ap->a_options, ap->a_searchattrs, myCurrentDataPtr,
-				myCurrentKeyPtr, &searchInfo1, &searchInfo2, ap->a_context )
+		/* The workers only hand back records that met the criteria */
+		if ((myBTScanState.workers != NULL ||
+		     SearchFilter(&myFilter, myCurrentKeyPtr, myCurrentDataPtr, 0))
 		&&  CheckAccess(vcb, ap->a_options, myCurrentKeyPtr, ap->a_context)) {
 			err = InsertMatch(hfsmp, ap->a_uio, myCurrentDataPtr, 
 					myCurrentKeyPtr, ap->a_returnattrs,
@@ -487,6 +527,25 @@ ResolveHardlink(struct hfsmount *hfsmp, HFSPlusCatalogFile *recp)
 }
 
 
+/*
+ * Check a catalog record against the search criteria, resolving
+ * hardlinks first.  This is also the parallel scanner's filter, so
+ * it may run on several threads at once.
+ */
+static int
+SearchFilter(void *arg, void *key, void *data, __unused u_int32_t dataSize)
+{
+	struct searchfilter *filter = (struct searchfilter *)arg;
+
+	if (filter->vcb->vcbSigWord == kHFSPlusSigWord &&
+	    (filter->options & SRCHFS_SKIPLINKS) == 0) {
+		ResolveHardlink(filter->vcb, (HFSPlusCatalogFile *)data);
+	}
+	return (CheckCriteria(filter->vcb, filter->options, filter->searchattrs,
+			(CatalogRecord *)data, (CatalogKey *)key,
+			filter->searchInfo1, filter->searchInfo2, filter->context));
+}
+
 static Boolean
 CompareMasked(const u_int32_t *thisValue, const u_int32_t *compareData,
 		const u_int32_t *compareMask, u_int32_t count)
@@ -116,6 +116,7 @@
 
 #include "hfscommon/headers/FileMgrInternal.h"
 #include "hfscommon/headers/BTreesInternal.h"
+#include "hfscommon/headers/FreeExtentIndex.h"
 
 #if CONFIG_PROTECT
 #include <sys/cprotect.h>
@@ -371,6 +372,18 @@ hfs_mount(struct mount *mp, vnode_t devvp, user_addr_t data, vfs_context_t conte
 				}
 			}
 
+			if (hfsmp->hfs_free_index) {
+				int err = 0;
+				/* A read-only volume won't allocate, so drop the free extent index */
+				if (hfsmp->hfs_allocation_vp) {
+					err = hfs_lock (VTOC(hfsmp->hfs_allocation_vp), HFS_EXCLUSIVE_LOCK, HFS_LOCK_DEFAULT);
+				}
+				ReleaseFreeExtentIndex(hfsmp);
+				if (err == 0 && hfsmp->hfs_allocation_vp){
+					hfs_unlock (VTOC(hfsmp->hfs_allocation_vp));
+				}
+			}
+
 			hfsmp->hfs_downgrading_thread = NULL;
 		}
 
@@ -2057,6 +2070,18 @@ hfs_unmount(struct mount *mp, int mntflags, vfs_context_t context)
 
 		}
 	}
+
+	if (hfsmp->hfs_free_index) {
+		int err = 0;
+		/* Take the bitmap lock to serialize against a concurrent bitmap scan */
+		if (hfsmp->hfs_allocation_vp) {
+			err = hfs_lock (VTOC(hfsmp->hfs_allocation_vp), HFS_EXCLUSIVE_LOCK, HFS_LOCK_DEFAULT);
+		}
+		ReleaseFreeExtentIndex(hfsmp);
+		if (err == 0 && hfsmp->hfs_allocation_vp){
+			hfs_unlock (VTOC(hfsmp->hfs_allocation_vp));
+		}
+	}
 	
 	/*
 	 * Flush out the b-trees, volume bitmap and Volume Header
@@ -2706,12 +2731,15 @@ hfs_init(__unused struct vfsconf *vfsp)
 	hfs_converterinit();
 
 	BTReserveSetup();
+	hfs_free_index_init();
 	
 	hfs_lock_attr    = lck_attr_alloc_init();
 	hfs_group_attr   = lck_grp_attr_alloc_init();
 	hfs_mutex_group  = lck_grp_alloc_init("hfs-mutex", hfs_group_attr);
 	hfs_rwlock_group = lck_grp_alloc_init("hfs-rwlock", hfs_group_attr);
 	hfs_spinlock_group = lck_grp_alloc_init("hfs-spinlock", hfs_group_attr);
+
+	BTScanPoolSetup();
 	
 #if HFS_COMPRESSION
 	decmpfs_init();
@@ -222,6 +222,7 @@ OSStatus BTOpenPath(FCB *filePtr, KeyCompareProcPtr keyCompareProc)
 	btreePtr->getBlockProc		= GetBTreeBlock;
 	btreePtr->releaseBlockProc	= ReleaseBTreeBlock;
 	btreePtr->setEndOfForkProc	= ExtendBTreeFile;
+	btreePtr->prefetchBlockProc	= PrefetchBTreeBlock;
 	btreePtr->keyCompareProc	= keyCompareProc;
 
 	/////////////////////////// Read Header Node ////////////////////////////////
@@ -297,6 +298,10 @@ OSStatus BTOpenPath(FCB *filePtr, KeyCompareProcPtr keyCompareProc)
 	btreePtr->flags				= 0;
 	btreePtr->writeCount		= 1;
 
+	if ( (FTOC(filePtr)->c_fileid == kHFSCatalogFileID) &&
+		 (FCBTOVCB(filePtr)->vcbSigWord == kHFSPlusSigWord) )
+		btreePtr->flags |= kBTCatalogKeys;
+
 	/////////////////////////// Check Header Node ///////////////////////////////
 
 	// set kBadClose attribute bit, and UpdateNode
@@ -827,6 +832,9 @@ OSStatus	BTIterateRecord		(FCB						*filePtr,
 			node		 = right;
 			right.buffer = nil;
 			index		 = 0;
+
+			// Iterating forward across nodes; start reading the next one
+			PrefetchNode(btreePtr, ((NodeDescPtr) node.buffer)->fLink);
 		}
 	}
 	else // operation == kBTreeCurrentRecord
@@ -1138,6 +1146,9 @@ BTIterateRecords(FCB *filePtr, BTreeIterationOperation operation, BTreeIterator
 			node	     = right;
 			right.buffer = nil;
 			index	     = 0;
+
+			// Iterating forward across nodes; start reading the next one
+			PrefetchNode(btreePtr, ((NodeDescPtr)node.buffer)->fLink);
 		}
 	}
 	else // operation == kBTreeCurrentRecord
@@ -1160,6 +1171,10 @@ ProcessData:
 		goto ErrorExit;
 	}
 	
+	// Callers iterating forward usually run off the end of this node
+	if ((operation == kBTreeFirstRecord) || (operation == kBTreeNextRecord))
+		PrefetchNode(btreePtr, ((NodeDescPtr)node.buffer)->fLink);
+
 	while (err == 0) {
 		if (callBackProc(keyPtr, recordPtr, callBackState) == 0)
 			break;
@@ -1188,6 +1203,9 @@ ProcessData:
 			node	     = right;
 			right.buffer = nil;
 			index	     = 0;
+
+			// Iterating forward across nodes; start reading the next one
+			PrefetchNode(btreePtr, ((NodeDescPtr)node.buffer)->fLink);
 		}
 		err = GetRecordByIndex(btreePtr, node.buffer, index,
 						&keyPtr, &recordPtr, &len);
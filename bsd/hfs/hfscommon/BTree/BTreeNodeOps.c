@@ -107,12 +107,14 @@
 */
 
 #include "../headers/BTreesPrivate.h"
+#include "../headers/HFSUnicodeWrappers.h"
 
 
 
 ///////////////////////// BTree Module Node Operations //////////////////////////
 //
 //	GetNode 			- Call FS Agent to get node
+//	PrefetchNode		- Call FS Agent to start reading a node ahead of use
 //	GetNewNode			- Call FS Agent to get a new node
 //	ReleaseNode			- Call FS Agent to release node obtained by GetNode.
 //	UpdateNode			- Mark a node as dirty and call FS Agent to release it.
@@ -239,6 +241,35 @@ ErrorExit:
 
 
 
+/*-------------------------------------------------------------------------------
+
+Routine:	PrefetchNode	-	Ask FS Agent to start reading a node
+
+Function:	Starts an asynchronous read of a node that the caller expects to
+			need shortly (the next leaf while iterating), so that the later
+			GetNode finds it in the cache.  Errors are ignored.
+
+Input:		btreePtr	- pointer to BTree control block
+			nodeNum		- number of node to read ahead; 0 means none
+
+Result:		none
+-------------------------------------------------------------------------------*/
+
+void	PrefetchNode	(BTreeControlBlockPtr	 btreePtr,
+						 u_int32_t				 nodeNum )
+{
+	if ( nodeNum == 0 || nodeNum >= btreePtr->totalNodes )
+		return;
+
+	if ( btreePtr->prefetchBlockProc == nil )
+		return;
+
+	btreePtr->prefetchBlockProc (btreePtr->fileRefNum, nodeNum, btreePtr->nodeSize);
+	++btreePtr->numPrefetchNodes;
+}
+
+
+
 /*-------------------------------------------------------------------------------
 
 Routine:	GetNewNode	-	Call FS Agent to get a new node
@@ -704,6 +735,9 @@ Function:	Returns the record index for the record that matches the search key.
 			of where the record should go is returned instead.
 
 Algorithm:	A binary search algorithm is used to find the specified key.
+			In the HFS Plus catalog, each probe first compares parent IDs and
+			a packed prefix of the name, and only calls keyCompareProc when
+			both match.
 
 Input:		btreePtr	- pointer to BTree control block
 			node		- pointer to node that contains the record
@@ -727,6 +761,24 @@ SearchNode( BTreeControlBlockPtr btreePtr,
 	KeyPtr		trialKey;
 	u_int16_t	*offset;
 	KeyCompareProcPtr compareProc = btreePtr->keyCompareProc;
+	u_int64_t	(*prefixProc)(ConstUniCharArrayPtr, ItemCount) = NULL;
+	HFSPlusCatalogKey *searchCatKey = NULL;
+	HFSPlusCatalogKey *trialCatKey;
+	u_int64_t	searchPrefix = 0;
+	u_int64_t	trialPrefix;
+
+	if (btreePtr->flags & kBTCatalogKeys) {
+		/*
+		 * Decode the search key once.  Most probes can then be decided
+		 * by parent ID or name prefix without a full Unicode compare.
+		 */
+		if (VTOHFS(btreePtr->fileRefNum)->hfs_flags & HFS_CASE_SENSITIVE)
+			prefixProc = UnicodeBinaryPrefix;
+		else
+			prefixProc = FastUnicodePrefix;
+		searchCatKey = (HFSPlusCatalogKey *)searchKey;
+		searchPrefix = prefixProc(&searchCatKey->nodeName.unicode[0], searchCatKey->nodeName.length);
+	}
 
 	lowerBound = 0;
 	upperBound = node->numRecords - 1;
@@ -737,7 +789,20 @@ SearchNode( BTreeControlBlockPtr btreePtr,
 
 		trialKey = (KeyPtr) ((u_int8_t *)node + *(offset - index));
 		
-		result = compareProc(searchKey, trialKey);
+		if (searchCatKey != NULL) {
+			trialCatKey = (HFSPlusCatalogKey *)trialKey;
+			if (searchCatKey->parentID != trialCatKey->parentID) {
+				result = (searchCatKey->parentID > trialCatKey->parentID) ? 1 : -1;
+			} else {
+				trialPrefix = prefixProc(&trialCatKey->nodeName.unicode[0], trialCatKey->nodeName.length);
+				if (searchPrefix != trialPrefix)
+					result = (searchPrefix > trialPrefix) ? 1 : -1;
+				else
+					result = compareProc(searchKey, trialKey);
+			}
+		} else {
+			result = compareProc(searchKey, trialKey);
+		}
 
 		if (result <  0) {
 			upperBound = index - 1;	  /* search < trial */
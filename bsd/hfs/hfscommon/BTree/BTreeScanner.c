@@ -28,12 +28,115 @@
  *	@(#)BTreeScanner.c
  */
 #include <sys/kernel.h>
+#include <sys/malloc.h>
+#include <sys/queue.h>
+#include <sys/systm.h>
+#include <kern/locks.h>
+#include <kern/task.h>
+#include <kern/thread.h>
 #include "../../hfs_endian.h"
 
 #include "../headers/BTreeScanner.h"
 
+extern lck_attr_t *  hfs_lock_attr;
+extern lck_grp_t *  hfs_mutex_group;
+
+/*
+ * Parallel scans split the node range into fixed size chunks.  Worker threads
+ * claim chunks in node order, read each one with large sequential I/Os and run
+ * the filter over its leaf records.  BTScanNextRecord consumes the chunks in
+ * order, so matches come back in catalog order no matter which worker found
+ * them.  Workers never run more than a window of chunks ahead of the consumer.
+ *
+ * searchfs resumes the scan on every call, so the worker threads and chunk
+ * buffers outlive a single scan.  Idle workers park in a pool, and the chunk
+ * buffers of the last scan are kept for the next one.  Both are released once
+ * the pool has been idle for kBTScanIdleSeconds.  Workers take on the I/O
+ * tier of the thread that started the scan, so a throttled searchfs stays
+ * throttled.
+ */
+struct BTScanMatch {
+	u_int32_t		nodeIndex;		// node within the chunk
+	u_int32_t		recordNum;		// record within the node
+	u_int32_t		recordsBefore;	// leaf records ahead of this one in the chunk
+	u_int32_t		dataSize;
+	void *			key;			// points into the chunk buffer
+	void *			data;
+};
+
+enum {
+	kBTScanChunkFree	= 0,
+	kBTScanChunkBusy	= 1,
+	kBTScanChunkDone	= 2
+};
+
+struct BTScanChunk {
+	int					state;
+	int					error;
+	u_int32_t			firstNode;
+	u_int32_t			nodeCount;
+	u_int32_t			firstRecord;	// only non-zero for the first chunk of a resumed scan
+	u_int32_t			leafRecords;	// leaf records seen in this chunk
+	u_int8_t *			buffer;
+	struct BTScanMatch *matches;
+	u_int32_t			matchCount;
+	u_int32_t			matchMax;
+	u_int32_t			nextMatch;		// next match to hand to the consumer
+};
+
+struct BTScanWorkers {
+	lck_mtx_t *			lock;
+	TAILQ_ENTRY(BTScanWorkers) pendingLink;	// on btscan_pending while wanted != 0
+	u_int32_t			wanted;			// pool threads still to join the scan
+	int					ioTier;			// I/O policy of the thread that started the scan
+	int					ioPassive;
+	u_int32_t			bufferSize;		// size of each chunk buffer
+	BTreeControlBlock *	btcb;
+	BTScanFilterProcPtr	filterProc;
+	void *				filterArg;
+	u_int32_t			nodesPerChunk;
+	u_int32_t			startNode;
+	u_int32_t			startRecord;
+	u_int32_t			chunkCount;		// chunks covering [startNode, totalNodes)
+	u_int32_t			nextChunk;		// next chunk for a worker to claim
+	u_int32_t			consumeChunk;	// next chunk for the consumer
+	u_int32_t			chunkBase;		// leaf records seen before consumeChunk
+	u_int32_t			running;		// worker threads still alive
+	int					stopping;
+	u_int32_t			slotCount;
+	struct BTScanChunk	slots[1];		// slotCount entries
+};
+
 static int FindNextLeafNode(	BTScanState *scanState, Boolean avoidIO );
 static int ReadMultipleNodes( 	BTScanState *scanState );
+static int NextParallelRecord(	BTScanState *scanState, Boolean avoidIO, void **key,
+								void **data, u_int32_t *dataSize );
+static void ScanPoolThread(		void *arg, wait_result_t wr );
+static void ScanWorker(			struct BTScanWorkers *workers );
+static void StopWorkers(		BTScanState *scanState );
+
+enum {
+	kBTScanIdleSeconds	= 60
+};
+
+static lck_mtx_t *			btscan_pool_lock;
+static TAILQ_HEAD(, BTScanWorkers) btscan_pending = TAILQ_HEAD_INITIALIZER(btscan_pending);
+static u_int32_t			btscan_threads;		// pool threads alive
+static u_int32_t			btscan_idle_threads;	// pool threads waiting for a scan
+static struct BTScanWorkers *	btscan_cached;		// chunk buffers of the last scan
+
+
+//_________________________________________________________________________________
+//
+//	Routine:	BTScanPoolSetup
+//
+//	Purpose:	Set up the worker pool for parallel scans.  Called once from hfs_init.
+//_________________________________________________________________________________
+
+void BTScanPoolSetup( void )
+{
+	btscan_pool_lock = lck_mtx_alloc_init( hfs_mutex_group, hfs_lock_attr );
+}
 
 
 //_________________________________________________________________________________
@@ -73,6 +176,9 @@ int BTScanNextRecord(	BTScanState *	scanState,
 	
 	err = noErr;
 
+	if ( scanState->workers != NULL )
+		return NextParallelRecord( scanState, avoidIO, key, data, dataSize );
+
 	//
 	//	If this is the first call, there won't be any nodes in the buffer, so go
 	//	find the first first leaf node (if any).
@@ -363,6 +469,7 @@ int		BTScanInitialize(	const FCB *		btreeFile,
 	scanState->currentNodePtr		= NULL;
 	scanState->nodesLeftInBuffer	= 0;		// no nodes currently in buffer
 	scanState->recordsFound			= recordsFound;
+	scanState->workers				= NULL;
 	microuptime(&scanState->startTime);			// initialize our throttle
 		
 	return noErr;
@@ -391,6 +498,9 @@ int	 BTScanTerminate(	BTScanState *		scanState,
 						u_int32_t *			startingRecord,
 						u_int32_t *			recordsFound	)
 {
+	if ( scanState->workers != NULL )
+		StopWorkers( scanState );
+
 	*startingNode	= scanState->nodeNum;
 	*startingRecord	= scanState->recordNum;
 	*recordsFound	= scanState->recordsFound;
@@ -408,3 +518,544 @@ int	 BTScanTerminate(	BTScanState *		scanState,
 } /* BTScanTerminate */
 
 
+
+//_________________________________________________________________________________
+//
+//	Routine:	BTScanStartWorkers
+//
+//	Purpose:	Switch a freshly initialized scan over to worker threads.
+//
+//	Inputs:
+//		scanState		Scanner's state, as set up by BTScanInitialize
+//		workerCount		Number of worker threads to start
+//		chunkSize		Size (in bytes) of the node range each worker reads at a time
+//		filterProc		Called by the workers for every leaf record
+//		filterArg		Passed through to filterProc
+//
+//	Result:
+//		noErr			Workers are running
+//		paramErr		Scan can't be run in parallel; keep scanning sequentially
+//		memFullErr		Couldn't allocate the chunk buffers
+//
+//	Notes:
+//		Once the workers are running, BTScanNextRecord only returns the records
+//		accepted by filterProc, still in B-tree order, and leaves the scan's
+//		node, record and recordsFound positioned just past the returned record.
+//		A scan terminated at that point resumes correctly with either scanner.
+//
+//		Records come from private chunk buffers, so the caller may keep using
+//		them until the next call to BTScanNextRecord or BTScanTerminate.
+//_________________________________________________________________________________
+
+static void FreeWorkers( struct BTScanWorkers *workers )
+{
+	u_int32_t	i;
+
+	for ( i = 0; i < workers->slotCount; ++i )
+	{
+		if ( workers->slots[i].buffer != NULL )
+			FREE( workers->slots[i].buffer, M_TEMP );
+		if ( workers->slots[i].matches != NULL )
+			FREE( workers->slots[i].matches, M_TEMP );
+	}
+	if ( workers->lock != NULL )
+		lck_mtx_free( workers->lock, hfs_mutex_group );
+	FREE( workers, M_TEMP );
+}
+
+int	BTScanStartWorkers(	BTScanState *			scanState,
+						u_int32_t				workerCount,
+						u_int32_t				chunkSize,
+						BTScanFilterProcPtr		filterProc,
+						void *					filterArg	)
+{
+	BTreeControlBlock *		btcb;
+	struct BTScanWorkers *	workers;
+	u_int32_t				nodesPerChunk;
+	u_int32_t				slotCount;
+	u_int32_t				i;
+	size_t					size;
+	u_int32_t				bufferSize;
+	thread_t				thread;
+
+	btcb = scanState->btcb;
+	if ( workerCount == 0 || chunkSize < btcb->nodeSize || filterProc == NULL )
+		return paramErr;
+	if ( scanState->workers != NULL || scanState->nodesLeftInBuffer != 0 )
+		return paramErr;
+	if ( scanState->nodeNum >= btcb->totalNodes )
+		return paramErr;
+
+	nodesPerChunk = chunkSize / btcb->nodeSize;
+	slotCount = workerCount * 2;
+	bufferSize = nodesPerChunk * btcb->nodeSize;
+
+	//	Reuse the chunk buffers of the last scan if they fit
+	lck_mtx_lock( btscan_pool_lock );
+	workers = btscan_cached;
+	btscan_cached = NULL;
+	lck_mtx_unlock( btscan_pool_lock );
+
+	if ( workers != NULL
+	&&  (workers->slotCount != slotCount || workers->bufferSize != bufferSize) )
+	{
+		FreeWorkers( workers );
+		workers = NULL;
+	}
+
+	if ( workers == NULL )
+	{
+		size = sizeof(struct BTScanWorkers) + (slotCount - 1) * sizeof(struct BTScanChunk);
+		MALLOC( workers, struct BTScanWorkers *, size, M_TEMP, M_WAITOK );
+		if ( workers == NULL )
+			return memFullErr;
+		bzero( workers, size );
+		workers->slotCount	= slotCount;
+		workers->bufferSize	= bufferSize;
+
+		for ( i = 0; i < slotCount; ++i )
+		{
+			MALLOC( workers->slots[i].buffer, u_int8_t *, bufferSize, M_TEMP, M_WAITOK );
+			if ( workers->slots[i].buffer == NULL )
+			{
+				FreeWorkers( workers );
+				return memFullErr;
+			}
+		}
+		workers->lock = lck_mtx_alloc_init( hfs_mutex_group, hfs_lock_attr );
+	}
+	else
+	{
+		for ( i = 0; i < slotCount; ++i )
+			workers->slots[i].state = kBTScanChunkFree;
+		workers->nextChunk		= 0;
+		workers->consumeChunk	= 0;
+		workers->running		= 0;
+		workers->stopping		= 0;
+	}
+
+	workers->ioTier			= proc_get_effective_thread_policy( current_thread(), TASK_POLICY_IO );
+	workers->ioPassive		= proc_get_effective_thread_policy( current_thread(), TASK_POLICY_PASSIVE_IO );
+	workers->btcb			= btcb;
+	workers->filterProc		= filterProc;
+	workers->filterArg		= filterArg;
+	workers->nodesPerChunk	= nodesPerChunk;
+	workers->startNode		= scanState->nodeNum;
+	workers->startRecord	= scanState->recordNum;
+	workers->chunkCount		= howmany( btcb->totalNodes - scanState->nodeNum, nodesPerChunk );
+	workers->chunkBase		= scanState->recordsFound;
+
+	//	Hand the scan to the pool, starting threads for whatever the idle ones can't cover
+	lck_mtx_lock( btscan_pool_lock );
+	workers->wanted = workerCount;
+	TAILQ_INSERT_TAIL( &btscan_pending, workers, pendingLink );
+	wakeup( &btscan_pending );
+	for ( i = MIN(btscan_idle_threads, workerCount); i < workerCount; ++i )
+	{
+		if ( kernel_thread_start( ScanPoolThread, NULL, &thread ) != KERN_SUCCESS )
+			break;
+		thread_deallocate( thread );
+		++btscan_threads;
+	}
+	if ( btscan_threads == 0 )
+	{
+		TAILQ_REMOVE( &btscan_pending, workers, pendingLink );
+		lck_mtx_unlock( btscan_pool_lock );
+		FreeWorkers( workers );
+		return paramErr;
+	}
+	lck_mtx_unlock( btscan_pool_lock );
+
+	scanState->workers = workers;
+	return noErr;
+
+} /* BTScanStartWorkers */
+
+
+//_________________________________________________________________________________
+//
+//	Routine:	StopWorkers
+//
+//	Purpose:	Wait for a parallel scan's workers to leave it and keep its chunk
+//				buffers for the next scan.  The scan's position is left where the
+//				consumer stopped.
+//_________________________________________________________________________________
+
+static void StopWorkers( BTScanState *scanState )
+{
+	struct BTScanWorkers *workers = scanState->workers;
+	struct BTScanWorkers *stale;
+
+	//	No more pool threads may join once the scan is off the pending list
+	lck_mtx_lock( btscan_pool_lock );
+	if ( workers->wanted != 0 )
+	{
+		TAILQ_REMOVE( &btscan_pending, workers, pendingLink );
+		workers->wanted = 0;
+	}
+	lck_mtx_unlock( btscan_pool_lock );
+
+	lck_mtx_lock( workers->lock );
+	workers->stopping = 1;
+	wakeup( &workers->nextChunk );
+	while ( workers->running > 0 )
+		(void) msleep( &workers->running, workers->lock, PINOD, "BTScanStop", NULL );
+	lck_mtx_unlock( workers->lock );
+
+	//	Keep the newest buffers; they are freed when the pool goes idle
+	lck_mtx_lock( btscan_pool_lock );
+	if ( btscan_threads != 0 )
+	{
+		stale = btscan_cached;
+		btscan_cached = workers;
+	}
+	else
+		stale = workers;
+	lck_mtx_unlock( btscan_pool_lock );
+
+	if ( stale != NULL )
+		FreeWorkers( stale );
+	scanState->workers = NULL;
+
+} /* StopWorkers */
+
+
+//_________________________________________________________________________________
+//
+//	Routine:	AddMatch
+//
+//	Purpose:	Remember a record accepted by the filter, growing the chunk's
+//				match array as needed.
+//_________________________________________________________________________________
+
+static int AddMatch( struct BTScanChunk *chunk, u_int32_t nodeIndex, u_int32_t recordNum,
+					 void *key, void *data, u_int32_t dataSize )
+{
+	struct BTScanMatch *	newMatches;
+	struct BTScanMatch *	match;
+	u_int32_t				newMax;
+
+	if ( chunk->matchCount == chunk->matchMax )
+	{
+		newMax = (chunk->matchMax != 0) ? chunk->matchMax * 2 : 64;
+		MALLOC( newMatches, struct BTScanMatch *, newMax * sizeof(struct BTScanMatch), M_TEMP, M_WAITOK );
+		if ( newMatches == NULL )
+			return memFullErr;
+		if ( chunk->matches != NULL )
+		{
+			bcopy( chunk->matches, newMatches, chunk->matchCount * sizeof(struct BTScanMatch) );
+			FREE( chunk->matches, M_TEMP );
+		}
+		chunk->matches = newMatches;
+		chunk->matchMax = newMax;
+	}
+
+	match = &chunk->matches[chunk->matchCount++];
+	match->nodeIndex		= nodeIndex;
+	match->recordNum		= recordNum;
+	match->recordsBefore	= chunk->leafRecords;
+	match->dataSize			= dataSize;
+	match->key				= key;
+	match->data				= data;
+
+	return noErr;
+
+} /* AddMatch */
+
+
+//_________________________________________________________________________________
+//
+//	Routine:	ScanChunk
+//
+//	Purpose:	Read a chunk of B-tree nodes and run the filter over its leaf
+//				records.  Errors are left in chunk->error for the consumer.
+//_________________________________________________________________________________
+
+static void ScanChunk( struct BTScanWorkers *workers, struct BTScanChunk *chunk )
+{
+	BTreeControlBlock *	btcb = workers->btcb;
+	BTNodeDescriptor *	nodePtr;
+	BlockDescriptor		block;
+	struct buf *		bp;
+	struct vnode *		devvp;
+	daddr64_t			blkno;
+	unsigned int		blockRun;
+	u_int32_t			nodesRead;
+	u_int32_t			count;
+	u_int32_t			i;
+	u_int32_t			recordNum;
+	u_int16_t			dataSize;
+	void *				key;
+	void *				data;
+	int					err = E_NONE;
+
+	//	Read the chunk one contiguous extent of the B-tree file at a time
+	nodesRead = 0;
+	while ( nodesRead < chunk->nodeCount )
+	{
+		err = hfs_bmap( btcb->fileRefNum, chunk->firstNode + nodesRead, &devvp, &blkno, &blockRun );
+		if ( err != E_NONE )
+			break;
+
+		count = MIN( blockRun + 1, chunk->nodeCount - nodesRead );
+		bp = NULL;
+		err = (int)buf_meta_bread( devvp, blkno, count * btcb->nodeSize, NOCRED, &bp );
+		if ( err != E_NONE )
+		{
+			if ( bp != NULL )
+				buf_brelse( bp );
+			break;
+		}
+
+		count = MIN( count, buf_count(bp) / btcb->nodeSize );
+		bcopy( (void *)buf_dataptr(bp), chunk->buffer + nodesRead * btcb->nodeSize,
+			   count * btcb->nodeSize );
+		buf_markinvalid( bp );
+		buf_brelse( bp );
+
+		if ( count == 0 )
+		{
+			err = EIO;
+			break;
+		}
+		nodesRead += count;
+	}
+	if ( err != E_NONE )
+	{
+		chunk->error = err;
+		return;
+	}
+
+	for ( i = 0; i < chunk->nodeCount; ++i )
+	{
+		nodePtr = (BTNodeDescriptor *)(chunk->buffer + i * btcb->nodeSize);
+
+		block.blockHeader = NULL;
+		block.buffer = nodePtr;
+		block.blockNum = chunk->firstNode + i;
+		block.blockSize = btcb->nodeSize;
+		block.blockReadFromDisk = 1;
+		block.isModified = 0;
+
+		if ( hfs_swap_BTNode(&block, btcb->fileRefNum, kSwapBTNodeBigToHost, true) != noErr )
+		{
+			printf("hfs: ScanChunk: Error from hfs_swap_BTNode (node %u)\n", chunk->firstNode + i);
+			continue;
+		}
+		if ( nodePtr->kind != kBTLeafNode )
+			continue;
+
+		recordNum = (i == 0) ? chunk->firstRecord : 0;
+		while ( GetRecordByIndex(btcb, nodePtr, recordNum, (KeyPtr *) &key,
+								 (u_int8_t **) &data, &dataSize) == noErr )
+		{
+			if ( workers->filterProc(workers->filterArg, key, data, dataSize) )
+			{
+				err = AddMatch( chunk, i, recordNum, key, data, dataSize );
+				if ( err != noErr )
+				{
+					chunk->error = err;
+					return;
+				}
+			}
+			++chunk->leafRecords;
+			++recordNum;
+		}
+	}
+
+} /* ScanChunk */
+
+
+//_________________________________________________________________________________
+//
+//	Routine:	ScanPoolThread
+//
+//	Purpose:	Body of a pool thread.  Joins pending scans until the pool has
+//				been idle for kBTScanIdleSeconds.  The last thread to leave
+//				frees the cached chunk buffers.
+//_________________________________________________________________________________
+
+static void ScanPoolThread( __unused void *arg, __unused wait_result_t wr )
+{
+	struct BTScanWorkers *	workers;
+	struct timespec			ts;
+	int						err;
+
+	lck_mtx_lock( btscan_pool_lock );
+	for ( ;; )
+	{
+		workers = TAILQ_FIRST( &btscan_pending );
+		if ( workers == NULL )
+		{
+			ts.tv_sec = kBTScanIdleSeconds;
+			ts.tv_nsec = 0;
+			++btscan_idle_threads;
+			err = msleep( &btscan_pending, btscan_pool_lock, PINOD, "BTScanIdle", &ts );
+			--btscan_idle_threads;
+			if ( err == EWOULDBLOCK && TAILQ_EMPTY(&btscan_pending) )
+				break;
+			continue;
+		}
+
+		if ( --workers->wanted == 0 )
+			TAILQ_REMOVE( &btscan_pending, workers, pendingLink );
+		lck_mtx_lock( workers->lock );
+		++workers->running;
+		lck_mtx_unlock( workers->lock );
+		lck_mtx_unlock( btscan_pool_lock );
+
+		ScanWorker( workers );
+
+		lck_mtx_lock( btscan_pool_lock );
+	}
+
+	workers = NULL;
+	if ( --btscan_threads == 0 )
+	{
+		workers = btscan_cached;
+		btscan_cached = NULL;
+	}
+	lck_mtx_unlock( btscan_pool_lock );
+
+	if ( workers != NULL )
+		FreeWorkers( workers );
+
+} /* ScanPoolThread */
+
+
+//_________________________________________________________________________________
+//
+//	Routine:	ScanWorker
+//
+//	Purpose:	Claim chunks in node order and scan them until the node range
+//				is covered or the scan is stopped.  The caller has already
+//				counted this thread in workers->running.
+//
+//	Notes:		The reads are issued at the scan owner's I/O tier.  A kernel
+//				thread never returns to user space, where throttled threads are
+//				normally delayed, so the worker takes the delay itself between
+//				chunks.
+//_________________________________________________________________________________
+
+static void ScanWorker( struct BTScanWorkers *workers )
+{
+	struct BTScanChunk *	chunk;
+	u_int32_t				chunkNum;
+	u_int32_t				totalNodes = workers->btcb->totalNodes;
+
+	proc_set_task_policy( current_task(), current_thread(), TASK_POLICY_INTERNAL,
+						  TASK_POLICY_IO, workers->ioTier );
+	proc_set_task_policy( current_task(), current_thread(), TASK_POLICY_INTERNAL,
+						  TASK_POLICY_PASSIVE_IO, workers->ioPassive );
+
+	lck_mtx_lock( workers->lock );
+	while ( !workers->stopping && workers->nextChunk < workers->chunkCount )
+	{
+		//	Don't run more than one window of chunks ahead of the consumer
+		if ( workers->nextChunk >= workers->consumeChunk + workers->slotCount )
+		{
+			(void) msleep( &workers->nextChunk, workers->lock, PINOD, "BTScanWorker", NULL );
+			continue;
+		}
+
+		chunkNum = workers->nextChunk++;
+		chunk = &workers->slots[chunkNum % workers->slotCount];
+		chunk->state		= kBTScanChunkBusy;
+		chunk->error		= 0;
+		chunk->firstNode	= workers->startNode + chunkNum * workers->nodesPerChunk;
+		chunk->nodeCount	= MIN( workers->nodesPerChunk, totalNodes - chunk->firstNode );
+		chunk->firstRecord	= (chunkNum == 0) ? workers->startRecord : 0;
+		chunk->leafRecords	= 0;
+		chunk->matchCount	= 0;
+		chunk->nextMatch	= 0;
+		lck_mtx_unlock( workers->lock );
+
+		ScanChunk( workers, chunk );
+		(void) throttle_lowpri_io( 1 );
+
+		lck_mtx_lock( workers->lock );
+		chunk->state = kBTScanChunkDone;
+		wakeup( chunk );
+	}
+	if ( --workers->running == 0 )
+		wakeup( &workers->running );
+	lck_mtx_unlock( workers->lock );
+
+} /* ScanWorker */
+
+
+//_________________________________________________________________________________
+//
+//	Routine:	NextParallelRecord
+//
+//	Purpose:	BTScanNextRecord for a scan with worker threads.  Hands back the
+//				filtered records chunk by chunk, in node order.
+//
+//	Result:
+//		noErr			Found a matching record
+//		btNotFound		No more records
+//		fsBTTimeOutErr	Next chunk isn't ready yet, and avoidIO is set
+//_________________________________________________________________________________
+
+static int NextParallelRecord(	BTScanState *	scanState,
+								Boolean			avoidIO,
+								void * *		key,
+								void * *		data,
+								u_int32_t *		dataSize  )
+{
+	struct BTScanWorkers *	workers = scanState->workers;
+	struct BTScanChunk *	chunk;
+	struct BTScanMatch *	match;
+
+	while ( workers->consumeChunk < workers->chunkCount )
+	{
+		chunk = &workers->slots[workers->consumeChunk % workers->slotCount];
+
+		lck_mtx_lock( workers->lock );
+		while ( chunk->state != kBTScanChunkDone )
+		{
+			if ( avoidIO )
+			{
+				lck_mtx_unlock( workers->lock );
+				return fsBTTimeOutErr;
+			}
+			(void) msleep( chunk, workers->lock, PINOD, "BTScanNext", NULL );
+		}
+		lck_mtx_unlock( workers->lock );
+
+		//	Leave the position at the start of the chunk so a retry reads it again
+		if ( chunk->error != 0 )
+			return chunk->error;
+
+		if ( chunk->nextMatch < chunk->matchCount )
+		{
+			match = &chunk->matches[chunk->nextMatch++];
+			scanState->nodeNum		= chunk->firstNode + match->nodeIndex;
+			scanState->recordNum	= match->recordNum + 1;
+			scanState->recordsFound	= workers->chunkBase + match->recordsBefore + 1;
+			*key = match->key;
+			*data = match->data;
+			if ( dataSize != NULL )
+				*dataSize = match->dataSize;
+			return noErr;
+		}
+
+		//	Done with this chunk; let a worker reuse its slot
+		workers->chunkBase		+= chunk->leafRecords;
+		scanState->nodeNum		= chunk->firstNode + chunk->nodeCount;
+		scanState->recordNum	= 0;
+		scanState->recordsFound	= workers->chunkBase;
+
+		lck_mtx_lock( workers->lock );
+		chunk->state = kBTScanChunkFree;
+		++workers->consumeChunk;
+		wakeup( &workers->nextChunk );
+		lck_mtx_unlock( workers->lock );
+
+		if ( scanState->recordsFound >= scanState->btcb->leafRecords )
+			break;
+	}
+
+	return btNotFound;
+
+} /* NextParallelRecord */
@@ -0,0 +1,442 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+/*
+	File:		FreeExtentIndex.c
+
+	Contains:	In-memory index of free extents for the HFS+ allocator.
+
+	The index mirrors the volume bitmap as a set of maximal free extents.
+	It is built by hfs_alloc_scan_range() while ScanUnmapBlocks() walks the
+	bitmap, and kept current by BlockMarkAllocatedInternal() and
+	BlockMarkFreeInternal().  BlockAllocateContig() consults it to find a
+	best-fit extent without scanning the bitmap.
+
+	Nodes come from a dedicated, exhaustible zone.  If the zone runs dry,
+	or if the index ever disagrees with a bitmap update, the caller throws
+	the index away and the allocator falls back to scanning the bitmap.
+*/
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/errno.h>
+#include <kern/zalloc.h>
+
+#include "../headers/FreeExtentIndex.h"
+
+/* Upper bound on the number of extents indexed across all volumes */
+#define FREE_EXTENT_MAX_NODES	(1024 * 1024)
+
+/*
+ * Number of candidate extents hfs_free_index_find() will examine and reject
+ * (because they fall inside the excluded region or past allocLimit) before
+ * telling the caller to search the bitmap instead.
+ */
+#define FREE_EXTENT_MAX_PROBES	32
+
+static zone_t free_extent_zone;
+
+static int free_extent_offset_cmp(struct free_extent_node *a, struct free_extent_node *b);
+static int free_extent_size_cmp(struct free_extent_node *a, struct free_extent_node *b);
+
+RB_PROTOTYPE_SC(static, free_extent_offset_tree, free_extent_node, fen_offset_link, free_extent_offset_cmp);
+RB_PROTOTYPE_SC_PREV(static, free_extent_size_tree, free_extent_node, fen_size_link, free_extent_size_cmp);
+
+RB_GENERATE(free_extent_offset_tree, free_extent_node, fen_offset_link, free_extent_offset_cmp);
+RB_GENERATE_PREV(free_extent_size_tree, free_extent_node, fen_size_link, free_extent_size_cmp);
+
+static int
+free_extent_offset_cmp(struct free_extent_node *a, struct free_extent_node *b)
+{
+	if (a->fen_start < b->fen_start)
+		return -1;
+	if (a->fen_start > b->fen_start)
+		return 1;
+	return 0;
+}
+
+static int
+free_extent_size_cmp(struct free_extent_node *a, struct free_extent_node *b)
+{
+	if (a->fen_count < b->fen_count)
+		return -1;
+	if (a->fen_count > b->fen_count)
+		return 1;
+	return free_extent_offset_cmp(a, b);
+}
+
+void
+hfs_free_index_init(void)
+{
+	if (free_extent_zone != NULL)
+		return;
+
+	free_extent_zone = zinit(sizeof(struct free_extent_node),
+	    FREE_EXTENT_MAX_NODES * sizeof(struct free_extent_node),
+	    PAGE_SIZE, "hfs free extents");
+	if (free_extent_zone == NULL) {
+		panic("%s: zinit failed", __func__);
+	}
+	zone_change(free_extent_zone, Z_EXHAUST, TRUE);
+	zone_change(free_extent_zone, Z_CALLERACCT, FALSE);
+}
+
+struct hfs_free_index *
+hfs_free_index_create(void)
+{
+	struct hfs_free_index *fip;
+
+	MALLOC(fip, struct hfs_free_index *, sizeof(*fip), M_TEMP, M_WAITOK | M_ZERO);
+	if (fip == NULL)
+		return NULL;
+
+	RB_INIT(&fip->fi_offset_tree);
+	RB_INIT(&fip->fi_size_tree);
+
+	return fip;
+}
+
+void
+hfs_free_index_destroy(struct hfs_free_index *fip)
+{
+	struct free_extent_node *node;
+
+	if (fip == NULL)
+		return;
+
+	while ((node = RB_MIN(free_extent_offset_tree, &fip->fi_offset_tree)) != NULL) {
+		RB_REMOVE(free_extent_offset_tree, &fip->fi_offset_tree, node);
+		RB_REMOVE(free_extent_size_tree, &fip->fi_size_tree, node);
+		zfree(free_extent_zone, node);
+	}
+	FREE(fip, M_TEMP);
+}
+
+/*
+ * Return the extent with the largest start block that is <= block, or
+ * NULL if every extent starts after it.
+ */
+static struct free_extent_node *
+free_extent_lookup(struct hfs_free_index *fip, u_int32_t block)
+{
+	struct free_extent_node *node, *found = NULL;
+
+	node = RB_ROOT(&fip->fi_offset_tree);
+	while (node != NULL) {
+		if (node->fen_start <= block) {
+			found = node;
+			node = RB_RIGHT(node, fen_offset_link);
+		} else {
+			node = RB_LEFT(node, fen_offset_link);
+		}
+	}
+	return found;
+}
+
+static struct free_extent_node *
+free_extent_alloc(struct hfs_free_index *fip, u_int32_t start, u_int32_t count)
+{
+	struct free_extent_node *node;
+
+	node = (struct free_extent_node *)zalloc(free_extent_zone);
+	if (node == NULL)
+		return NULL;
+	node->fen_start = start;
+	node->fen_count = count;
+	RB_INSERT(free_extent_offset_tree, &fip->fi_offset_tree, node);
+	RB_INSERT(free_extent_size_tree, &fip->fi_size_tree, node);
+	fip->fi_extents++;
+
+	return node;
+}
+
+static void
+free_extent_free(struct hfs_free_index *fip, struct free_extent_node *node)
+{
+	RB_REMOVE(free_extent_offset_tree, &fip->fi_offset_tree, node);
+	RB_REMOVE(free_extent_size_tree, &fip->fi_size_tree, node);
+	fip->fi_extents--;
+	zfree(free_extent_zone, node);
+}
+
+/*
+ * Record that [start, start+count) is now free, merging it with any free
+ * extent that it abuts.
+ *
+ * Returns 0 on success, EINVAL if the range overlaps an extent that is
+ * already free (the index and bitmap disagree), or ENOMEM.
+ */
+int
+hfs_free_index_add(struct hfs_free_index *fip, u_int32_t start, u_int32_t count)
+{
+	struct free_extent_node *prev, *next;
+	u_int32_t end = start + count;
+
+	if (count == 0)
+		return 0;
+
+	prev = free_extent_lookup(fip, start);
+	if (prev != NULL) {
+		next = RB_NEXT(free_extent_offset_tree, &fip->fi_offset_tree, prev);
+		if (prev->fen_start + prev->fen_count > start)
+			return EINVAL;
+		if (prev->fen_start + prev->fen_count != start)
+			prev = NULL;
+	} else {
+		next = RB_MIN(free_extent_offset_tree, &fip->fi_offset_tree);
+	}
+
+	if (next != NULL) {
+		if (next->fen_start < end)
+			return EINVAL;
+		if (next->fen_start != end)
+			next = NULL;
+	}
+
+	if (prev != NULL) {
+		/* Grow the previous extent forward, absorbing the next one too */
+		RB_REMOVE(free_extent_size_tree, &fip->fi_size_tree, prev);
+		prev->fen_count += count;
+		if (next != NULL) {
+			prev->fen_count += next->fen_count;
+			free_extent_free(fip, next);
+		}
+		RB_INSERT(free_extent_size_tree, &fip->fi_size_tree, prev);
+	} else if (next != NULL) {
+		/*
+		 * Grow the next extent backward.  Moving its start down can't
+		 * reorder it in the offset tree since nothing lies in between.
+		 */
+		RB_REMOVE(free_extent_size_tree, &fip->fi_size_tree, next);
+		next->fen_start = start;
+		next->fen_count += count;
+		RB_INSERT(free_extent_size_tree, &fip->fi_size_tree, next);
+	} else if (free_extent_alloc(fip, start, count) == NULL) {
+		return ENOMEM;
+	}
+
+	fip->fi_free_blocks += count;
+	return 0;
+}
+
+/*
+ * Record that [start, start+count) has been allocated.  The range must lie
+ * entirely within a single free extent, which is trimmed or split.
+ *
+ * Returns 0 on success, EINVAL if the range is not free in the index, or
+ * ENOMEM if splitting an extent required a node that could not be had.
+ */
+int
+hfs_free_index_remove(struct hfs_free_index *fip, u_int32_t start, u_int32_t count)
+{
+	struct free_extent_node *node;
+	u_int32_t end = start + count;
+	u_int32_t node_end;
+
+	if (count == 0)
+		return 0;
+
+	node = free_extent_lookup(fip, start);
+	if (node == NULL)
+		return EINVAL;
+	node_end = node->fen_start + node->fen_count;
+	if (node_end < end)
+		return EINVAL;
+
+	if (node->fen_start == start && node_end == end) {
+		free_extent_free(fip, node);
+	} else {
+		RB_REMOVE(free_extent_size_tree, &fip->fi_size_tree, node);
+		if (node->fen_start == start) {
+			/* Trim the front; the offset order is unchanged */
+			node->fen_start = end;
+			node->fen_count -= count;
+		} else {
+			node->fen_count = start - node->fen_start;
+			if (node_end != end &&
+			    free_extent_alloc(fip, end, node_end - end) == NULL) {
+				RB_INSERT(free_extent_size_tree, &fip->fi_size_tree, node);
+				return ENOMEM;
+			}
+		}
+		RB_INSERT(free_extent_size_tree, &fip->fi_size_tree, node);
+	}
+
+	fip->fi_free_blocks -= count;
+	return 0;
+}
+
+/*
+ * Clip a free extent to the part an allocation may use: at or after floor,
+ * below allocLimit and, if there is an excluded region, the larger of the
+ * pieces on either side of it.  Returns the usable length and its start in
+ * *startp.
+ */
+static u_int32_t
+free_extent_clip(struct free_extent_node *node, const struct free_extent_limits *limits,
+		u_int32_t floor, u_int32_t *startp)
+{
+	u_int32_t start = node->fen_start;
+	u_int32_t end = node->fen_start + node->fen_count;
+
+	if (start < floor)
+		start = floor;
+	if (end > limits->fel_alloc_limit)
+		end = limits->fel_alloc_limit;
+
+	if (limits->fel_exclude_end != 0 &&
+	    start <= limits->fel_exclude_end && end > limits->fel_exclude_start) {
+		u_int32_t lo_len = (limits->fel_exclude_start > start) ? limits->fel_exclude_start - start : 0;
+		u_int32_t hi_start = limits->fel_exclude_end + 1;
+		u_int32_t hi_len = (end > hi_start) ? end - hi_start : 0;
+
+		if (hi_len >= lo_len) {
+			start = hi_start;
+		} else {
+			end = start + lo_len;
+		}
+	}
+
+	*startp = start;
+	return (end > start) ? end - start : 0;
+}
+
+/*
+ * Find a free extent for a contiguous allocation of at least minBlocks and
+ * ideally maxBlocks.
+ *
+ * Like the bitmap scan, the search starts at the caller's hint so that a
+ * file's blocks stay together: the first extent at or after startingBlock
+ * (wrapping around once) that holds maxBlocks wins.  If none does within a
+ * few probes, the smallest extent anywhere that holds maxBlocks is taken
+ * (best fit).  Failing that, the first extent after the hint that holds
+ * minBlocks, else the largest such extent.  The index is not modified; the
+ * caller marks the blocks allocated, which in turn updates the index.
+ *
+ * Returns 0 with *startBlock and *blockCount set, ENOSPC if no indexed
+ * extent can satisfy the request, or EAGAIN if too many candidates had to
+ * be skipped because of the limits and the caller should search the bitmap.
+ */
+int
+hfs_free_index_find(struct hfs_free_index *fip, u_int32_t startingBlock, u_int32_t minBlocks,
+		u_int32_t maxBlocks, const struct free_extent_limits *limits, u_int32_t *startBlock,
+		u_int32_t *blockCount)
+{
+	struct free_extent_node *node, *first, *lower = NULL;
+	u_int32_t start, len, floor;
+	u_int32_t near_start = 0, near_len = 0;
+	int probes = 0, wrapped = 0;
+
+	if (minBlocks == 0 || maxBlocks < minBlocks)
+		return EINVAL;
+
+	/*
+	 * First fit from the hint, in block order.  Only the extent holding
+	 * the hint is clipped to it; its front part is looked at last, once
+	 * the walk has wrapped around.
+	 */
+	first = free_extent_lookup(fip, startingBlock);
+	if (first != NULL && first->fen_start + first->fen_count <= startingBlock)
+		first = RB_NEXT(free_extent_offset_tree, &fip->fi_offset_tree, first);
+	node = first;
+	floor = startingBlock;
+	if (node == NULL) {
+		/* Nothing at or after the hint; walk from the beginning */
+		node = RB_MIN(free_extent_offset_tree, &fip->fi_offset_tree);
+		floor = 0;
+		wrapped = 1;
+	}
+	while (node != NULL && probes++ < FREE_EXTENT_MAX_PROBES) {
+		len = free_extent_clip(node, limits, floor, &start);
+		floor = 0;
+		if (len >= maxBlocks) {
+			*startBlock = start;
+			*blockCount = maxBlocks;
+			return 0;
+		}
+		if (len >= minBlocks && near_len == 0) {
+			near_start = start;
+			near_len = len;
+		}
+		if (wrapped && node == first)
+			break;
+		node = RB_NEXT(free_extent_offset_tree, &fip->fi_offset_tree, node);
+		if (node == NULL && !wrapped) {
+			node = RB_MIN(free_extent_offset_tree, &fip->fi_offset_tree);
+			wrapped = 1;
+		}
+	}
+	probes = 0;
+
+	/* Lower bound in the size tree: the smallest extent with >= maxBlocks */
+	node = RB_ROOT(&fip->fi_size_tree);
+	while (node != NULL) {
+		if (node->fen_count >= maxBlocks) {
+			lower = node;
+			node = RB_LEFT(node, fen_size_link);
+		} else {
+			node = RB_RIGHT(node, fen_size_link);
+		}
+	}
+
+	for (node = lower; node != NULL;
+	     node = RB_NEXT(free_extent_size_tree, &fip->fi_size_tree, node)) {
+		len = free_extent_clip(node, limits, 0, &start);
+		if (len >= maxBlocks) {
+			*startBlock = start;
+			*blockCount = maxBlocks;
+			return 0;
+		}
+		if (++probes > FREE_EXTENT_MAX_PROBES)
+			return EAGAIN;
+	}
+
+	/*
+	 * Nothing holds maxBlocks; settle for the extent near the hint, else
+	 * the largest with >= minBlocks.
+	 */
+	if (near_len != 0) {
+		*startBlock = near_start;
+		*blockCount = MIN(near_len, maxBlocks);
+		return 0;
+	}
+	for (node = RB_MAX(free_extent_size_tree, &fip->fi_size_tree);
+	     node != NULL && node->fen_count >= minBlocks;
+	     node = RB_PREV(free_extent_size_tree, &fip->fi_size_tree, node)) {
+		len = free_extent_clip(node, limits, 0, &start);
+		if (len >= minBlocks) {
+			*startBlock = start;
+			*blockCount = MIN(len, maxBlocks);
+			return 0;
+		}
+		if (++probes > FREE_EXTENT_MAX_PROBES)
+			return EAGAIN;
+	}
+
+	return ENOSPC;
+}
@@ -165,7 +165,10 @@ Optimization Routines
 #include <sys/ubc.h>
 #include <sys/uio.h>
 #include <kern/kalloc.h>
+#include <kern/clock.h>
+#include <kern/thread.h>
 #include <sys/malloc.h>
+#include <machine/machine_routines.h>
 
 /* For VM Page size */
 #include <libkern/libkern.h>
@@ -176,6 +179,7 @@ Optimization Routines
 #include "../../hfs_endian.h"
 #include "../../hfs_macos_defs.h"
 #include "../headers/FileMgrInternal.h"
+#include "../headers/FreeExtentIndex.h"
 #include "../../hfs_kdebug.h"
 
 /* Headers for unmap-on-mount support */
@@ -198,6 +202,21 @@ SYSCTL_DECL(_vfs_generic);
 SYSCTL_NODE(_vfs_generic, OID_AUTO, hfs, CTLFLAG_RW|CTLFLAG_LOCKED, 0, "HFS file system");
 SYSCTL_NODE(_vfs_generic_hfs, OID_AUTO, kdebug, CTLFLAG_RW|CTLFLAG_LOCKED, 0, "HFS kdebug");
 SYSCTL_INT(_vfs_generic_hfs_kdebug, OID_AUTO, allocation, CTLFLAG_RW|CTLFLAG_LOCKED, &hfs_kdebug_allocation, 0, "Enable kdebug logging for HFS allocations");
+
+/*
+ * Use sysctl vfs.generic.hfs.free_index to control whether the bitmap scan
+ * at mount time builds the in-memory free extent index that contiguous
+ * allocations are satisfied from.  Takes effect on the next scan.
+ */
+static int hfs_free_index_enabled = 1;
+SYSCTL_INT(_vfs_generic_hfs, OID_AUTO, free_index, CTLFLAG_RW|CTLFLAG_LOCKED, &hfs_free_index_enabled, 0, "Index free extents for contiguous allocations");
+
+/*
+ * Use sysctl vfs.generic.hfs.scan_threads to control how many threads
+ * ScanUnmapBlocks splits the bitmap scan across.  1 scans serially.
+ */
+static int hfs_scan_threads = 4;
+SYSCTL_INT(_vfs_generic_hfs, OID_AUTO, scan_threads, CTLFLAG_RW|CTLFLAG_LOCKED, &hfs_scan_threads, 0, "Threads used to scan the allocation bitmap at mount");
 enum {
 	/*
 	 * HFSDBG_ALLOC_ENABLED: Log calls to BlockAllocate and
@@ -303,7 +322,10 @@ static OSErr BlockMarkFreeInternal(
 
 
 static OSErr ReadBitmapRange (struct hfsmount *hfsmp, uint32_t offset, uint32_t iosize,
-		uint32_t **buffer, struct buf **blockRef);
+		uint32_t ra_offset, uint32_t ra_iosize, uint32_t **buffer, struct buf **blockRef);
+
+static OSErr ReadBitmapRangeInternal (struct hfsmount *hfsmp, uint32_t offset, uint32_t iosize,
+		uint32_t ra_offset, uint32_t ra_iosize, uint32_t **buffer, struct buf **blockRef);
 
 static OSErr ReleaseScanBitmapRange( struct buf *bp );
 
@@ -312,12 +334,49 @@ static int hfs_track_unmap_blocks (struct hfsmount *hfsmp, u_int32_t offset,
 
 static int hfs_issue_unmap (struct hfsmount *hfsmp, struct jnl_trim_list *list);
 
+/*
+ * State for one slice of the bitmap scanned by ScanUnmapBlocks.  Slices
+ * start and end on MAXBSIZE (and summary table byte) boundaries in the
+ * bitmap file, so no two scanners ever share a buffer or a summary byte.
+ */
+struct bitmap_scan_ctl;
+
+struct bitmap_scan_range {
+	struct hfsmount		*hfsmp;
+	struct bitmap_scan_ctl	*ctl;
+	u_int32_t		start;		/* first allocation block to scan */
+	u_int32_t		end;		/* scanning stops before this block */
+	struct jnl_trim_list	trimlist;	/* free extents not yet unmapped */
+	u_int32_t		ra_offset;	/* bitmap byte offset of pending read-ahead */
+	u_int32_t		ra_iosize;	/* size of pending read-ahead, 0 if none */
+	u_int32_t		free_extents;
+	u_int64_t		read_time;	/* abstime spent waiting on the bitmap */
+	u_int64_t		scan_time;
+	int			error;
+};
+
+struct bitmap_scan_ctl {
+	lck_mtx_t		*lock;		/* serializes free index updates and 'running' */
+	int			running;	/* scanner threads not yet finished */
+};
+
 static int hfs_alloc_scan_range(struct hfsmount *hfsmp, 
 		u_int32_t startbit, 
 		u_int32_t *bitToScan,
-		struct jnl_trim_list *list);
+		struct bitmap_scan_range *range);
 
 static int hfs_scan_range_size (struct hfsmount* hfsmp, uint32_t start, uint32_t *iosize);
+static int hfs_scan_chunk_size (struct hfsmount *hfsmp, uint32_t start, uint32_t end, uint32_t *iosize);
+static void hfs_scan_bitmap_range (struct bitmap_scan_range *range);
+static void hfs_scan_range_thread (struct bitmap_scan_range *range);
+static void hfs_scan_record_free (struct hfsmount *hfsmp, struct bitmap_scan_range *range,
+		u_int32_t offset, u_int32_t numBlocks, int readwrite);
+static void hfs_merge_trim_lists (struct hfsmount *hfsmp, struct bitmap_scan_range *ranges,
+		u_int32_t nranges);
+static u_int32_t hfs_scan_usecs (u_int64_t abstime);
+
+extern lck_attr_t *  hfs_lock_attr;
+extern lck_grp_t *  hfs_mutex_group;
 static uint32_t CheckUnmappedBytes (struct hfsmount *hfsmp, uint64_t blockno, uint64_t numblocks, int *recent, uint32_t *next);
 
 /* Bitmap Re-use Detection */
@@ -354,6 +413,10 @@ void hfs_validate_summary (struct hfsmount *hfsmp);
 
 /* Functions for manipulating free extent cache */
 static void remove_free_extent_cache(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount);
+static void update_free_extent_index(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount, Boolean allocated);
+static OSErr BlockFindIndexed(struct hfsmount *hfsmp, u_int32_t startingBlock, u_int32_t minBlocks,
+		u_int32_t maxBlocks, Boolean useMetaZone, u_int32_t *actualStartBlock, u_int32_t *actualNumBlocks);
+static void RebuildFreeExtentIndex(struct hfsmount *hfsmp);
 static Boolean add_free_extent_cache(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount);
 static void sanity_check_free_ext(struct hfsmount *hfsmp, int check_allocated);
 
@@ -760,6 +823,10 @@ CheckUnmappedBytes (struct hfsmount *hfsmp, uint64_t blockno, uint64_t numblocks
  ;				associated with the bitmap vnode before calling this 
  ; 				function.  If the buffers are not invalidated, it can 
  ;				cause but_t collision and potential data corruption.
+ ;
+ ;				Large bitmaps are split into slices that are scanned
+ ;				concurrently (see vfs.generic.hfs.scan_threads); the
+ ;				TRIMs they generate are merged before being issued.
  ;  
  ; Input Arguments:
  ;	hfsmp			- The volume containing the allocation blocks.
@@ -769,13 +836,24 @@ CheckUnmappedBytes (struct hfsmount *hfsmp, uint64_t blockno, uint64_t numblocks
 __private_extern__
 u_int32_t ScanUnmapBlocks (struct hfsmount *hfsmp) 
 {
-	u_int32_t blocks_scanned = 0;
+	struct bitmap_scan_range single_range;
+	struct bitmap_scan_range *ranges = &single_range;
+	struct bitmap_scan_ctl ctl;
+	u_int64_t blocks_per_unit;
+	u_int64_t units;
+	u_int64_t units_per_range;
+	u_int64_t start_time;
+	u_int64_t scan_time;
+	u_int32_t nranges;
+	u_int32_t free_extents = 0;
+	u_int32_t i;
+	int do_unmap;
 	int error = 0;
-	struct jnl_trim_list trimlist;
 
 	if (hfs_kdebug_allocation & HFSDBG_UNMAP_ENABLED) {
 		KERNEL_DEBUG_CONSTANT(HFSDBG_UNMAP_SCAN | DBG_FUNC_START, hfsmp->hfs_raw_dev, 0, 0, 0, 0);
 	}
+	start_time = mach_absolute_time();
 
 	/*
 	 *struct jnl_trim_list {
@@ -797,39 +875,123 @@ u_int32_t ScanUnmapBlocks (struct hfsmount *hfsmp)
 	 * 
 	 * We also avoid sending TRIMs down to the underlying media if the mount is read-only.
 	 */
+	do_unmap = ((hfsmp->hfs_flags & HFS_UNMAP) && 
+			((hfsmp->hfs_flags & HFS_READ_ONLY) == 0));
+
+	/*
+	 * Split the bitmap into slices, one per scanner thread.  Each slice
+	 * starts on a MAXBSIZE boundary in the bitmap file so that scanners
+	 * never issue overlapping I/Os, and on a byte boundary in the summary
+	 * table so that they never update the same summary byte.
+	 */
+	blocks_per_unit = (u_int64_t)MAX(MAXBSIZE, hfsmp->vcbVBMIOSize * kBitsPerByte) * kBitsPerByte;
+	units = (hfsmp->totalBlocks + blocks_per_unit - 1) / blocks_per_unit;
+
+	nranges = (hfs_scan_threads > 0) ? (u_int32_t)hfs_scan_threads : 1;
+	nranges = MIN(nranges, (u_int32_t)ml_get_max_cpus());
+	if (nranges > units) {
+		nranges = (u_int32_t)units;
+	}
+	if (nranges == 0) {
+		nranges = 1;
+	}
+	units_per_range = (units + nranges - 1) / nranges;
+	if (units_per_range) {
+		nranges = (u_int32_t)((units + units_per_range - 1) / units_per_range);
+	}
 
-	if ((hfsmp->hfs_flags & HFS_UNMAP) && 
-			((hfsmp->hfs_flags & HFS_READ_ONLY) == 0)) {
-		/* If the underlying device supports unmap and the mount is read-write, initialize */
-		int alloc_count = PAGE_SIZE / sizeof(dk_extent_t);
-		void *extents = kalloc (alloc_count * sizeof(dk_extent_t));
-		if (extents == NULL) {
-			return ENOMEM;
+	if (nranges > 1) {
+		ranges = kalloc (nranges * sizeof(struct bitmap_scan_range));
+		if (ranges == NULL) {
+			/* Just do it the slow way */
+			ranges = &single_range;
+			nranges = 1;
 		}
-		bzero (&trimlist, sizeof(trimlist));
-		trimlist.extents = (dk_extent_t*)extents;
-		trimlist.allocated_count = alloc_count;
-		trimlist.extent_count = 0;
 	}
+	bzero (ranges, nranges * sizeof(struct bitmap_scan_range));
 
-	while ((blocks_scanned < hfsmp->totalBlocks) && (error == 0)){
+	for (i = 0; i < nranges; i++) {
+		u_int64_t end = (u_int64_t)(i + 1) * units_per_range * blocks_per_unit;
 
-		error = hfs_alloc_scan_range (hfsmp, blocks_scanned, &blocks_scanned, &trimlist);
+		ranges[i].hfsmp = hfsmp;
+		ranges[i].ctl = (nranges > 1) ? &ctl : NULL;
+		ranges[i].start = (u_int32_t)(i * units_per_range * blocks_per_unit);
+		ranges[i].end = (nranges == 1 || end > hfsmp->totalBlocks) ? hfsmp->totalBlocks : (u_int32_t)end;
 
-		if (error) {
-			printf("HFS: bitmap scan range error: %d on vol=%s\n", error, hfsmp->vcbVN);
-			break;
+		if (do_unmap) {
+			/* If the underlying device supports unmap and the mount is read-write, initialize */
+			int alloc_count = PAGE_SIZE / sizeof(dk_extent_t);
+			void *extents = kalloc (alloc_count * sizeof(dk_extent_t));
+			if (extents == NULL) {
+				error = ENOMEM;
+				goto out;
+			}
+			ranges[i].trimlist.extents = (dk_extent_t*)extents;
+			ranges[i].trimlist.allocated_count = alloc_count;
+			ranges[i].trimlist.extent_count = 0;
 		}
 	}
 
-	if ((hfsmp->hfs_flags & HFS_UNMAP) && 
-			((hfsmp->hfs_flags & HFS_READ_ONLY) == 0)) {
-		if (error == 0) {
-			hfs_issue_unmap(hfsmp, &trimlist);
+	/*
+	 * Rebuild the free extent index from scratch as we go.  Read-only
+	 * mounts never allocate, so they don't need one.
+	 */
+	ReleaseFreeExtentIndex(hfsmp);
+	if (hfs_free_index_enabled && ((hfsmp->hfs_flags & HFS_READ_ONLY) == 0)) {
+		hfsmp->hfs_free_index = hfs_free_index_create();
+	}
+
+	if (nranges > 1) {
+		/*
+		 * We hold the bitmap lock on behalf of the scanners; this thread
+		 * takes the first slice itself and waits for the others below.
+		 * The scanners read the bitmap with ReadBitmapRangeInternal,
+		 * which doesn't check for a lock they don't own.
+		 */
+		REQUIRE_FILE_LOCK(hfsmp->hfs_allocation_vp, false);
+		ctl.lock = lck_mtx_alloc_init(hfs_mutex_group, hfs_lock_attr);
+		ctl.running = nranges - 1;
+
+		for (i = 1; i < nranges; i++) {
+			thread_t scanner;
+
+			if (kernel_thread_start((thread_continue_t)hfs_scan_range_thread, &ranges[i], &scanner) != KERN_SUCCESS) {
+				lck_mtx_lock(ctl.lock);
+				ctl.running--;
+				lck_mtx_unlock(ctl.lock);
+				hfs_scan_bitmap_range(&ranges[i]);
+				continue;
+			}
+			thread_deallocate(scanner);
 		}
-		if (trimlist.extents) {
-			kfree (trimlist.extents, (trimlist.allocated_count * sizeof(dk_extent_t)));
+	}
+
+	hfs_scan_bitmap_range(&ranges[0]);
+
+	if (nranges > 1) {
+		lck_mtx_lock(ctl.lock);
+		while (ctl.running) {
+			(void) msleep(&ctl.running, ctl.lock, PRIBIO, "hfs_scan_bitmap", NULL);
 		}
+		lck_mtx_unlock(ctl.lock);
+		lck_mtx_free(ctl.lock, hfs_mutex_group);
+	}
+
+	for (i = 0; i < nranges; i++) {
+		if (error == 0) {
+			error = ranges[i].error;
+		}
+		free_extents += ranges[i].free_extents;
+	}
+	scan_time = mach_absolute_time() - start_time;
+
+	if (error) {
+		/* A partial index would hide free space from the allocator */
+		ReleaseFreeExtentIndex(hfsmp);
+	}
+
+	if (do_unmap && (error == 0)) {
+		hfs_merge_trim_lists(hfsmp, ranges, nranges);
 	}
 
 	/* 
@@ -845,6 +1007,22 @@ u_int32_t ScanUnmapBlocks (struct hfsmount *hfsmp)
 	}
 #endif
 
+	if (hfs_kdebug_allocation & HFSDBG_UNMAP_ENABLED) {
+		KERNEL_DEBUG_CONSTANT(HFSDBG_UNMAP_SCAN_STATS | DBG_FUNC_NONE, hfsmp->hfs_raw_dev, nranges,
+				hfs_scan_usecs(scan_time), hfs_scan_usecs(mach_absolute_time() - start_time - scan_time),
+				free_extents);
+	}
+
+out:
+	for (i = 0; i < nranges; i++) {
+		if (ranges[i].trimlist.extents) {
+			kfree (ranges[i].trimlist.extents, (ranges[i].trimlist.allocated_count * sizeof(dk_extent_t)));
+		}
+	}
+	if (ranges != &single_range) {
+		kfree (ranges, nranges * sizeof(struct bitmap_scan_range));
+	}
+
 	if (hfs_kdebug_allocation & HFSDBG_UNMAP_ENABLED) {
 		KERNEL_DEBUG_CONSTANT(HFSDBG_UNMAP_SCAN | DBG_FUNC_END, error, hfsmp->hfs_raw_dev, 0, 0, 0);
 	}
@@ -852,6 +1030,125 @@ u_int32_t ScanUnmapBlocks (struct hfsmount *hfsmp)
 	return error;
 }
 
+/*
+ * Scan one slice of the bitmap, from range->start up to range->end.
+ */
+static void hfs_scan_bitmap_range (struct bitmap_scan_range *range)
+{
+	struct hfsmount *hfsmp = range->hfsmp;
+	u_int32_t blocks_scanned = range->start;
+	u_int64_t start_time = mach_absolute_time();
+
+	if (hfs_kdebug_allocation & HFSDBG_UNMAP_ENABLED) {
+		KERNEL_DEBUG_CONSTANT(HFSDBG_UNMAP_SCAN_RANGE | DBG_FUNC_START, hfsmp->hfs_raw_dev, range->start, range->end, 0, 0);
+	}
+
+	while ((blocks_scanned < range->end) && (range->error == 0)) {
+
+		range->error = hfs_alloc_scan_range (hfsmp, blocks_scanned, &blocks_scanned, range);
+
+		if (range->error) {
+			printf("HFS: bitmap scan range error: %d on vol=%s\n", range->error, hfsmp->vcbVN);
+			break;
+		}
+	}
+
+	if (range->error && range->ra_iosize) {
+		/* Don't leave an oversized read-ahead buffer behind in the cache */
+		(void) buf_invalblkno(hfsmp->hfs_allocation_vp,
+				(daddr64_t)(range->ra_offset / hfsmp->vcbVBMIOSize), BUF_WAIT);
+		range->ra_iosize = 0;
+	}
+
+	range->scan_time = mach_absolute_time() - start_time;
+
+	if (hfs_kdebug_allocation & HFSDBG_UNMAP_ENABLED) {
+		KERNEL_DEBUG_CONSTANT(HFSDBG_UNMAP_SCAN_RANGE | DBG_FUNC_END, range->error, range->free_extents,
+				hfs_scan_usecs(range->read_time), hfs_scan_usecs(range->scan_time), 0);
+	}
+}
+
+static void hfs_scan_range_thread (struct bitmap_scan_range *range)
+{
+	struct bitmap_scan_ctl *ctl = range->ctl;
+
+	hfs_scan_bitmap_range (range);
+
+	lck_mtx_lock(ctl->lock);
+	if (--ctl->running == 0) {
+		wakeup(&ctl->running);
+	}
+	lck_mtx_unlock(ctl->lock);
+}
+
+/*
+ * Note a run of free blocks found by the scan: queue it for TRIM and add it
+ * to the free extent cache and index.  The cache has its own lock, but the
+ * index is only protected by the bitmap lock, which the scanners share.
+ */
+static void hfs_scan_record_free (struct hfsmount *hfsmp, struct bitmap_scan_range *range,
+		u_int32_t offset, u_int32_t numBlocks, int readwrite)
+{
+	if (readwrite) {
+		hfs_track_unmap_blocks (hfsmp, offset, numBlocks, &range->trimlist);
+	}
+	add_free_extent_cache (hfsmp, offset, numBlocks);
+
+	if (range->ctl) {
+		lck_mtx_lock(range->ctl->lock);
+	}
+	update_free_extent_index (hfsmp, offset, numBlocks, false);
+	if (range->ctl) {
+		lck_mtx_unlock(range->ctl->lock);
+	}
+
+	range->free_extents++;
+}
+
+/*
+ * Gather the TRIMs still queued by each scanner, in bitmap order, into
+ * the first list and issue them.  Free extents that were split at a
+ * slice boundary are joined back together on the way.
+ */
+static void hfs_merge_trim_lists (struct hfsmount *hfsmp, struct bitmap_scan_range *ranges,
+		u_int32_t nranges)
+{
+	struct jnl_trim_list *list = &ranges[0].trimlist;
+	struct jnl_trim_list *src;
+	dk_extent_t *last;
+	u_int32_t i, j;
+
+	for (i = 1; i < nranges; i++) {
+		src = &ranges[i].trimlist;
+
+		for (j = 0; j < src->extent_count; j++) {
+			if (list->extent_count) {
+				last = &list->extents[list->extent_count - 1];
+				if ((last->offset + last->length) == src->extents[j].offset) {
+					last->length += src->extents[j].length;
+					continue;
+				}
+			}
+			list->extents[list->extent_count++] = src->extents[j];
+			if (list->extent_count == list->allocated_count) {
+				hfs_issue_unmap (hfsmp, list);
+			}
+		}
+		src->extent_count = 0;
+	}
+
+	hfs_issue_unmap (hfsmp, list);
+}
+
+static u_int32_t hfs_scan_usecs (u_int64_t abstime)
+{
+	clock_sec_t secs;
+	clock_usec_t usecs;
+
+	absolutetime_to_microtime(abstime, &secs, &usecs);
+	return (u_int32_t)(secs * USEC_PER_SEC + usecs);
+}
+
 /*
  ;________________________________________________________________________________
  ;
@@ -1488,6 +1785,8 @@ static OSErr ReadBitmapBlock(
 ;	hfsmp		--	Pointer to hfs mount
 ;	offset		--	byte offset into the bitmap file 
 ;	size		--  How much I/O to generate against the bitmap file.
+;	ra_offset	--	byte offset of a range to read ahead asynchronously
+;	ra_iosize	--	size of the read-ahead, or 0 for none
 ;
 ; Outputs:
 ;	buffer		--	Pointer to bitmap block data corresonding to "block"
@@ -1495,7 +1794,26 @@ static OSErr ReadBitmapBlock(
 ;_______________________________________________________________________
 */
 static OSErr ReadBitmapRange(struct hfsmount *hfsmp, uint32_t offset,
-		uint32_t iosize, uint32_t **buffer, struct buf **blockRef)
+		uint32_t iosize, uint32_t ra_offset, uint32_t ra_iosize,
+		uint32_t **buffer, struct buf **blockRef)
+{
+	/*
+	 * volume bitmap blocks are protected by the allocation file lock
+	 */
+	REQUIRE_FILE_LOCK(hfsmp->hfs_allocation_vp, false);
+
+	return ReadBitmapRangeInternal(hfsmp, offset, iosize, ra_offset, ra_iosize, buffer, blockRef);
+}
+
+/*
+ * ReadBitmapRange without the lock assertion, for the bitmap scanner
+ * threads started by ScanUnmapBlocks.  The allocation file lock is held
+ * on their behalf by the thread that started them, so it is not theirs
+ * to assert.
+ */
+static OSErr ReadBitmapRangeInternal(struct hfsmount *hfsmp, uint32_t offset,
+		uint32_t iosize, uint32_t ra_offset, uint32_t ra_iosize,
+		uint32_t **buffer, struct buf **blockRef)
 {
 
 	OSErr			err;
@@ -1512,11 +1830,6 @@ static OSErr ReadBitmapRange(struct hfsmount *hfsmp, uint32_t offset,
 		KERNEL_DEBUG_CONSTANT(HFSDBG_READ_BITMAP_RANGE | DBG_FUNC_START, offset, iosize, 0, 0, 0);
 	}
 
-	/*
-	 * volume bitmap blocks are protected by the allocation file lock
-	 */
-	REQUIRE_FILE_LOCK(vcb->hfs_allocation_vp, false);	
-
 	vp = hfsmp->hfs_allocation_vp;	/* use allocation file vnode */
 
 	/*
@@ -1535,7 +1848,20 @@ static OSErr ReadBitmapRange(struct hfsmount *hfsmp, uint32_t offset,
 	 */
 	block = (daddr64_t)(offset / hfsmp->vcbVBMIOSize);
 
-	err = (int) buf_meta_bread(vp, block, iosize, NOCRED, &bp);
+	if (ra_iosize) {
+		/*
+		 * Start the next range on its way while we scan this one.  It
+		 * stays in the cache until our caller reads it with the same
+		 * offset and size, and is invalidated on release like any
+		 * other range.
+		 */
+		daddr64_t ra_block = (daddr64_t)(ra_offset / hfsmp->vcbVBMIOSize);
+		int ra_size = (int)ra_iosize;
+
+		err = (int) buf_meta_breadn(vp, block, iosize, &ra_block, &ra_size, 1, NOCRED, &bp);
+	} else {
+		err = (int) buf_meta_bread(vp, block, iosize, NOCRED, &bp);
+	}
 
 	if (bp) {
 		if (err) {
@@ -1691,6 +2017,34 @@ static OSErr BlockAllocateContig(
 	if (hfs_kdebug_allocation & HFSDBG_ALLOC_ENABLED)
 		KERNEL_DEBUG_CONSTANT(HFSDBG_ALLOC_CONTIG_BITMAP | DBG_FUNC_START, startingBlock, minBlocks, maxBlocks, useMetaZone, 0);
 
+	/*
+	 * If the free extent index is live, look for an extent there, starting
+	 * at the hint, rather than scanning the bitmap.  If it finds nothing,
+	 * can't give a definite answer, or the extent it picked would require
+	 * a journal flush to reuse, fall back to the bitmap scan below, which
+	 * knows how to step around such extents.
+	 */
+	if (hfsmp->hfs_free_index != NULL) {
+		retval = BlockFindIndexed(hfsmp, startingBlock, minBlocks, maxBlocks, useMetaZone,
+				&foundStart, &foundCount);
+		if (retval == noErr && hfsmp->jnl && !allowReuse) {
+			uint32_t nextStart;
+
+			err = CheckUnmappedBytes (hfsmp, (uint64_t)foundStart,
+					(uint64_t) foundCount, &recently_deleted, &nextStart);
+			if (err == 0 && recently_deleted != 0) {
+				retval = EAGAIN;
+			}
+			recently_deleted = 0;
+		}
+		if (retval == noErr) {
+			goto bailout;
+		}
+		retval = noErr;
+		foundStart = 0;
+		foundCount = 0;
+	}
+
 	while ((retval == noErr) && (foundStart == 0) && (foundCount == 0)) {
 
 		/* Try and find something that works. */
@@ -2312,6 +2666,8 @@ OSErr BlockMarkAllocatedInternal (
 	uintptr_t  blockRef;
 	u_int32_t  bitsPerBlock;
 	u_int32_t  wordsPerBlock;
+	u_int32_t  startingBlock_in = startingBlock;
+	u_int32_t  numBlocks_in = numBlocks;
 	// XXXdbg
 	struct hfsmount *hfsmp = VCBTOHFS(vcb);
 
@@ -2469,6 +2825,13 @@ Exit:
 	if (buffer)
 		(void)ReleaseBitmapBlock(vcb, blockRef, true);
 
+	if (err == noErr) {
+		update_free_extent_index(hfsmp, startingBlock_in, numBlocks_in, true);
+	} else {
+		/* Some of the bits may have been set; we can't tell which */
+		ReleaseFreeExtentIndex(hfsmp);
+	}
+
 	if (hfs_kdebug_allocation & HFSDBG_BITMAP_ENABLED)
 		KERNEL_DEBUG_CONSTANT(HFSDBG_MARK_ALLOC_BITMAP | DBG_FUNC_END, err, 0, 0, 0, 0);
 
@@ -2818,6 +3181,9 @@ Exit:
 
 	if (err == noErr) {
 		hfs_unmap_free_extent(vcb, unmapStart, unmapCount);
+		update_free_extent_index(hfsmp, startingBlock_in, numBlocks_in, false);
+	} else {
+		ReleaseFreeExtentIndex(hfsmp);
 	}
 
 	if (hfs_kdebug_allocation & HFSDBG_BITMAP_ENABLED)
@@ -4165,7 +4531,7 @@ void hfs_validate_summary (struct hfsmount *hfsmp) {
 		int saw_free_bits = 0;
 
 		/* Get the block */
-		if ((err = ReadBitmapRange (hfsmp, byte_offset, hfsmp->vcbVBMIOSize, &block_data,  &bp))) {
+		if ((err = ReadBitmapRange (hfsmp, byte_offset, hfsmp->vcbVBMIOSize, 0, 0, &block_data,  &bp))) {
 			panic ("HFS Summary: error (%d) in ReadBitmapRange!", err);
 		}
 
@@ -4218,6 +4584,9 @@ void hfs_validate_summary (struct hfsmount *hfsmp) {
  * 		1) Bitmap lock is held during the duration of the call (exclusive)
  * 		2) There are no pages in the buffer cache for any of the bitmap 
  * 		blocks that we may encounter.  It *MUST* be completely empty.
+ *
+ * Several threads may call this at once for disjoint ranges; the bitmap lock
+ * is held on their behalf by the thread running ScanUnmapBlocks.
  * 
  * The expected use case is when we are scanning the bitmap in full while we are 
  * still mounting the filesystem in order to issue TRIMs or build up the summary 
@@ -4236,7 +4605,8 @@ void hfs_validate_summary (struct hfsmount *hfsmp) {
  *		hfsmp 		- hfs mount data structure
  * 		startbit 	- allocation block # to start our scan. It must be aligned
  *					on a vcbVBMIOsize boundary.
- *		list		- journal trim list data structure for issuing TRIMs
+ *		range		- the slice of the bitmap being scanned; supplies the
+ *					end of the scan, the TRIM list and read-ahead state.
  *
  * Output Args:
  *		bitToScan 	- Return the next bit to scan if this function is called again. 
@@ -4245,7 +4615,7 @@ void hfs_validate_summary (struct hfsmount *hfsmp) {
  */
 
 static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit, 
-		u_int32_t *bitToScan, struct jnl_trim_list *list) {
+		u_int32_t *bitToScan, struct bitmap_scan_range *range) {
 
 	int error;
 	int readwrite = 1;
@@ -4260,6 +4630,9 @@ static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit,
 	u_int32_t last_bitmap_block;
 	u_int32_t current_word;	
 	u_int32_t word_index = 0;	
+	u_int32_t ra_iosize = 0;
+	u_int64_t next_bit;
+	u_int64_t read_start;
 
 	/* summary table building */
 	uint32_t summary_bit = 0;
@@ -4276,7 +4649,7 @@ static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit,
 	 * converted into a byte offset into the bitmap file,
 	 * is aligned on a VBMIOSize boundary. 
 	 */
-	error = hfs_scan_range_size (hfsmp, startbit, &iosize);
+	error = hfs_scan_chunk_size (hfsmp, startbit, range->end, &iosize);
 	if (error) {
 		if (ALLOC_DEBUG) {
 			panic ("hfs_alloc_scan_range: hfs_scan_range_size error %d\n", error);
@@ -4313,7 +4686,23 @@ static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit,
 	 * done scanning, so this shouldn't cause any coherency issues.
 	 */
 
-	error = ReadBitmapRange(hfsmp, byte_off, iosize, &buffer, &blockRef);
+	/*
+	 * If there's more of our range left after this I/O, have it read
+	 * ahead so that the disk stays busy while we scan this buffer.
+	 */
+	next_bit = (u_int64_t)startbit + ((u_int64_t)iosize * kBitsPerByte);
+	if (next_bit < range->end) {
+		if (hfs_scan_chunk_size (hfsmp, (u_int32_t)next_bit, range->end, &ra_iosize)) {
+			ra_iosize = 0;
+		}
+	}
+
+	read_start = mach_absolute_time();
+	error = ReadBitmapRangeInternal(hfsmp, byte_off, iosize, (u_int32_t)(next_bit / kBitsPerByte),
+			ra_iosize, &buffer, &blockRef);
+	range->read_time += mach_absolute_time() - read_start;
+	range->ra_offset = (u_int32_t)(next_bit / kBitsPerByte);
+	range->ra_iosize = ra_iosize;
 	if (error) {
 		if (ALLOC_DEBUG) {
 			panic ("hfs_alloc_scan_range: start %d iosize %d ReadBitmapRange error %d\n", startbit, iosize, error);
@@ -4330,9 +4719,9 @@ static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit,
 	last_bitmap_block = completed_size * kBitsPerByte;
 	last_bitmap_block = last_bitmap_block + startbit;
 
-	/* Cap the last block to the total number of blocks if required */
-	if (last_bitmap_block > hfsmp->totalBlocks) {
-		last_bitmap_block = hfsmp->totalBlocks;
+	/* Cap the last block to the end of our range if required */
+	if (last_bitmap_block > range->end) {
+		last_bitmap_block = range->end;
 	}	
 
 	/* curAllocBlock represents the logical block we're analyzing. */
@@ -4418,11 +4807,8 @@ static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit,
 
 			if (allocated) { 
 				if (size != 0) {
-					if (readwrite) {
-						/* Insert the previously tracked range of free blocks to the trim list */
-						hfs_track_unmap_blocks (hfsmp, free_offset, size, list);
-					}
-					add_free_extent_cache (hfsmp, free_offset, size);
+					/* Insert the previously tracked range of free blocks */
+					hfs_scan_record_free (hfsmp, range, free_offset, size, readwrite);
 					size = 0;
 					free_offset = 0;
 				}
@@ -4487,10 +4873,7 @@ static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit,
 	 * table management even though they are closely linked.
 	 */
 	if (size != 0) {
-		if (readwrite) {
-			hfs_track_unmap_blocks (hfsmp, free_offset, size, list);
-		}
-		add_free_extent_cache (hfsmp, free_offset, size);
+		hfs_scan_record_free (hfsmp, range, free_offset, size, readwrite);
 	}
 
 	/* 
@@ -4506,6 +4889,27 @@ static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit,
 
 
 
+/*
+ * Like hfs_scan_range_size, but never let the I/O run past 'end' so that it
+ * can't overlap the buffers of the scanner working on the next slice.
+ * Interior slice ends are MAXBSIZE aligned, so the clipped size remains a
+ * multiple of vcbVBMIOSize.
+ */
+static int hfs_scan_chunk_size (struct hfsmount *hfsmp, uint32_t start, uint32_t end, uint32_t *iosize) {
+	uint32_t remaining;
+	int error;
+
+	error = hfs_scan_range_size (hfsmp, start, iosize);
+	if ((error == 0) && (end < hfsmp->totalBlocks)) {
+		remaining = (end - start) / kBitsPerByte;
+		if (*iosize > remaining) {
+			*iosize = remaining;
+		}
+	}
+
+	return error;
+}
+
 /*
  * Compute the maximum I/O size to generate against the bitmap file
  * Will attempt to generate at LEAST VBMIOsize I/Os for interior ranges of the bitmap. 
@@ -4720,6 +5124,167 @@ void ResetVCBFreeExtCache(struct hfsmount *hfsmp)
 	return;
 }
 
+/*
+ * Throw away the free extent index, if any.  Contiguous allocations go back
+ * to scanning the bitmap until the index is rebuilt by ScanUnmapBlocks or
+ * a resize.
+ *
+ * The bitmap lock must be held (or the volume otherwise quiesced).
+ */
+void ReleaseFreeExtentIndex(struct hfsmount *hfsmp)
+{
+	if (hfsmp->hfs_free_index) {
+		hfs_free_index_destroy(hfsmp->hfs_free_index);
+		hfsmp->hfs_free_index = NULL;
+	}
+}
+
+/*
+ * Build a new free extent index by walking the bitmap, for when the volume
+ * changes size under the old one.  Unlike the scan at mount this can't
+ * assume the bitmap is absent from the buffer cache, so it reads through
+ * it one bitmap block at a time.  The whole bitmap is indexed; allocations
+ * are kept below allocLimit when the index is searched.
+ *
+ * The bitmap lock must be held.
+ */
+static void RebuildFreeExtentIndex(struct hfsmount *hfsmp)
+{
+	u_int32_t *buffer = NULL;
+	uintptr_t blockRef = 0;
+	u_int32_t bitsPerBlock = hfsmp->vcbVBMIOSize * kBitsPerByte;
+	u_int32_t endBlock = hfsmp->totalBlocks;
+	u_int32_t block, bit, blockEnd, word;
+	u_int32_t freeStart = 0;
+	Boolean inFree = false;
+	int error = 0;
+
+	ReleaseFreeExtentIndex(hfsmp);
+	if (!hfs_free_index_enabled || (hfsmp->hfs_flags & HFS_READ_ONLY)) {
+		return;
+	}
+	hfsmp->hfs_free_index = hfs_free_index_create();
+	if (hfsmp->hfs_free_index == NULL) {
+		return;
+	}
+
+	for (block = 0; block < endBlock && error == 0; block += bitsPerBlock) {
+		error = ReadBitmapBlock(hfsmp, block, &buffer, &blockRef);
+		if (error) {
+			break;
+		}
+		blockEnd = MIN(endBlock, block + bitsPerBlock);
+		for (bit = block; bit < blockEnd && error == 0; ) {
+			word = SWAP_BE32(buffer[(bit - block) / kBitsPerWord]);
+
+			/* Skip whole words that don't end or start a free run */
+			if ((bit & kBitsWithinWordMask) == 0 && bit + kBitsPerWord <= blockEnd &&
+			    word == (inFree ? 0 : kAllBitsSetInWord)) {
+				bit += kBitsPerWord;
+				continue;
+			}
+			if (word & (kHighBitInWordMask >> (bit & kBitsWithinWordMask))) {
+				if (inFree) {
+					error = hfs_free_index_add(hfsmp->hfs_free_index, freeStart, bit - freeStart);
+					inFree = false;
+				}
+			} else if (!inFree) {
+				freeStart = bit;
+				inFree = true;
+			}
+			bit++;
+		}
+		(void) ReleaseBitmapBlock(hfsmp, blockRef, false);
+	}
+	if (error == 0 && inFree) {
+		error = hfs_free_index_add(hfsmp->hfs_free_index, freeStart, endBlock - freeStart);
+	}
+
+	if (error) {
+		printf ("hfs: could not rebuild free extent index on %s (error %d)\n", hfsmp->vcbVN, error);
+		ReleaseFreeExtentIndex(hfsmp);
+	}
+}
+
+/*
+ * Keep the free extent index in step with a change to the bitmap.  If the
+ * index can't absorb the change (it ran out of nodes, or disagrees with the
+ * bitmap) it is discarded rather than left stale.
+ */
+static void update_free_extent_index(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount, Boolean allocated)
+{
+	int error;
+
+	if (hfsmp->hfs_free_index == NULL) {
+		return;
+	}
+
+	if (allocated) {
+		error = hfs_free_index_remove(hfsmp->hfs_free_index, startBlock, blockCount);
+	} else {
+		error = hfs_free_index_add(hfsmp->hfs_free_index, startBlock, blockCount);
+	}
+
+	if (error) {
+		if (ALLOC_DEBUG && error == EINVAL) {
+			panic ("hfs: free extent index out of sync at %u (count %u, allocated %d)\n", startBlock, blockCount, allocated);
+		}
+		printf ("hfs: dropping free extent index on %s (error %d at block %u)\n", hfsmp->vcbVN, error, startBlock);
+		ReleaseFreeExtentIndex(hfsmp);
+	}
+}
+
+/*
+ * Find a contiguous free extent of at least minBlocks (ideally maxBlocks)
+ * using the free extent index, starting at startingBlock and honoring
+ * allocLimit and the metadata zone the same way BlockFindContiguous does.
+ *
+ * Returns noErr with the extent, or EAGAIN if the caller should search
+ * the bitmap instead.  A miss in the index is not taken as proof that the
+ * volume is full; the bitmap remains the authority.
+ */
+static OSErr BlockFindIndexed(struct hfsmount *hfsmp, u_int32_t startingBlock, u_int32_t minBlocks,
+		u_int32_t maxBlocks, Boolean useMetaZone, u_int32_t *actualStartBlock, u_int32_t *actualNumBlocks)
+{
+	struct free_extent_limits limits;
+	int error;
+
+	limits.fel_alloc_limit = hfsmp->allocLimit;
+	if (!useMetaZone && (hfsmp->hfs_flags & HFS_METADATA_ZONE)) {
+		limits.fel_exclude_start = hfsmp->hfs_metazone_start;
+		limits.fel_exclude_end = hfsmp->hfs_metazone_end;
+		/* Steer user data past the metadata zone, as the bitmap scan does */
+		if (startingBlock <= hfsmp->hfs_metazone_end) {
+			startingBlock = hfsmp->hfs_metazone_end + 1;
+		}
+	} else {
+		limits.fel_exclude_start = 0;
+		limits.fel_exclude_end = 0;
+	}
+	if (startingBlock >= hfsmp->allocLimit) {
+		startingBlock = 0;
+	}
+
+	error = hfs_free_index_find(hfsmp->hfs_free_index, startingBlock, minBlocks, maxBlocks,
+			&limits, actualStartBlock, actualNumBlocks);
+	if (error) {
+		return EAGAIN;
+	}
+
+	/* Block 0 is never free and doubles as "not found" for our callers */
+	if (*actualStartBlock == 0) {
+		return EAGAIN;
+	}
+
+	if (ALLOC_DEBUG) {
+		if (hfs_isallocated(hfsmp, *actualStartBlock, *actualNumBlocks)) {
+			panic ("BlockFindIndexed: index vended allocated blocks %u (count %u)\n", *actualStartBlock, *actualNumBlocks);
+		}
+	}
+
+	return noErr;
+}
+
 /*
  * This function is used to inform the allocator if we have to effectively shrink
  * or grow the total number of allocation blocks via hfs_truncatefs or hfs_extendfs. 
@@ -4752,6 +5317,13 @@ u_int32_t UpdateAllocLimit (struct hfsmount *hfsmp, u_int32_t new_end_block) {
 	 */
 	ResetVCBFreeExtCache(hfsmp);
 
+	/* 
+	 * Rebuild the free extent index.  The blocks gained or lost by the
+	 * resize don't pass through BlockMarkFree/BlockMarkAllocated, so the
+	 * old index no longer matches the bitmap.
+	 */
+	RebuildFreeExtentIndex(hfsmp);
+
 	/* Force a rebuild of the summary table. */
 	(void) hfs_rebuild_summary (hfsmp);
 
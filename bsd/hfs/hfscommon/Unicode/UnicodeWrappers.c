@@ -482,6 +482,67 @@ int32_t UnicodeBinaryCompare (register ConstUniCharArrayPtr str1, register ItemC
 	return result;
 }
 
+/*
+ * FastUnicodePrefix
+ * Pack the first four characters of a string, as FastUnicodeCompare sees
+ * them (case folded, ignorables skipped), into a 64-bit value.
+ *
+ * Comparing the prefixes of two strings as integers gives the same result
+ * as FastUnicodeCompare whenever the prefixes differ.  When they are equal
+ * the strings must still be compared in full.
+ */
+u_int64_t FastUnicodePrefix (register ConstUniCharArrayPtr str, register ItemCount length)
+{
+	register u_int16_t		c;
+	register u_int16_t		temp;
+	register u_int16_t*	lowerCaseTable;
+	u_int64_t				prefix = 0;
+	int						i;
+
+	lowerCaseTable = (u_int16_t*) gLowerCaseTable;
+
+	for (i = 0; i < 4; i++) {
+		c = 0;
+
+		/* Same as FastUnicodeCompare: next non-ignorable char, or zero if no more */
+		while (length && c == 0) {
+			c = *(str++);
+			--length;
+			if (c < 0x0100) {
+				c = gLatinCaseFold[c];
+				break;
+			}
+			if ((temp = lowerCaseTable[c>>8]) != 0)
+				c = lowerCaseTable[temp + (c & 0x00FF)];
+		}
+
+		/* FastUnicodeCompare stops at the first zero, so we do too */
+		if (c == 0)
+			break;
+
+		prefix |= (u_int64_t)c << (48 - (16 * i));
+	}
+
+	return prefix;
+}
+
+/*
+ * UnicodeBinaryPrefix
+ * Pack the first four characters of a string into a 64-bit value that
+ * orders like UnicodeBinaryCompare whenever two prefixes differ.
+ */
+u_int64_t UnicodeBinaryPrefix (register ConstUniCharArrayPtr str, register ItemCount length)
+{
+	u_int64_t	prefix = 0;
+	int			i;
+
+	for (i = 0; i < 4 && length; i++, length--) {
+		prefix |= (u_int64_t)*(str++) << (48 - (16 * i));
+	}
+
+	return prefix;
+}
+
 
 OSErr
 ConvertUnicodeToUTF8Mangled(ByteCount srcLen, ConstUniCharArrayPtr srcStr, ByteCount maxDstLen,
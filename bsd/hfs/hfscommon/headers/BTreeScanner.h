@@ -48,6 +48,10 @@ enum { kMaxMicroSecsInKernel = (1000 * 100) };	// 1 tenth of a second
 // in Mac OS 9
 enum { kCatSearchBufferSize = (32 * 1024) };
 
+// parallel scanner chunk size.  each worker reads this many bytes of the btree
+// file at a time, so a worker handles 256 nodes per chunk at a 4K node size
+enum { kCatSearchChunkSize = (1024 * 1024) };
+
 
 /*
  * ============ W A R N I N G ! ============
@@ -68,6 +72,17 @@ struct CatPosition
 typedef struct CatPosition              CatPosition;
 
 
+/*
+	BTScanFilterProcPtr - Called by the parallel scanner's worker threads for
+	each leaf record they find.  Returns non-zero if the record should be
+	handed back to the caller of BTScanNextRecord.  The filter may modify the
+	record data in place, and must be safe to call from several threads.
+*/
+typedef int (* BTScanFilterProcPtr)(void *arg, void *key, void *data, u_int32_t dataSize);
+
+struct BTScanWorkers;
+
+
 /*
 	BTScanState - This structure is used to keep track of the current state
 	of a BTree scan.  It contains both the dynamic state information (like
@@ -93,6 +108,7 @@ struct BTScanState
 	u_int32_t			nodesLeftInBuffer;	// number of valid nodes still in the buffer
 	u_int32_t			recordsFound;		// number of leaf records seen so far
 	struct timeval		startTime;			// time we started catalog search
+	struct BTScanWorkers *	workers;		// parallel scan state, or NULL
 };
 typedef struct BTScanState BTScanState;
 
@@ -112,6 +128,12 @@ int BTScanNextRecord(	BTScanState *	scanState,
 						void * *		data,
 						u_int32_t *		dataSize  );
 
+int	BTScanStartWorkers(	BTScanState *			scanState,
+						u_int32_t				workerCount,
+						u_int32_t				chunkSize,
+						BTScanFilterProcPtr		filterProc,
+						void *					filterArg	);
+
 int	BTScanTerminate(	BTScanState *	scanState,
 						u_int32_t *		startingNode,
 						u_int32_t *		startingRecord,
@@ -187,6 +187,10 @@ typedef	OSStatus	(* SetBlockSizeProcPtr)	(FileReference				 fileRefNum,
 											 ByteCount					 blockSize,
 											 ItemCount					 minBlockCount );
 
+typedef	void		(* PrefetchBlockProcPtr)(FileReference				 fileRefNum,
+											 u_int32_t					 blockNum,
+											 ByteCount					 blockSize );
+
 OSStatus		SetEndOfForkProc ( FileReference fileRefNum, FSSize minEOF, FSSize maxEOF );
 
 
@@ -363,6 +367,9 @@ extern int  BTReleaseReserve(FCB *file, void * data);
 
 extern int  BTZeroUnusedNodes(FCB *file);
 
+/* Parallel B-tree scanner worker pool. */
+extern void BTScanPoolSetup(void);
+
 #endif /* __APPLE_API_PRIVATE */
 #endif /* KERNEL */
 #endif // __BTREESINTERNAL__
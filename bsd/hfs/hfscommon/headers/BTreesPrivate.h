@@ -217,6 +217,7 @@ typedef struct BTreeControlBlock {					// fields specific to BTree CBs
 	GetBlockProcPtr			 	 getBlockProc;
 	ReleaseBlockProcPtr			 releaseBlockProc;
 	SetEndOfForkProcPtr			 setEndOfForkProc;
+	PrefetchBlockProcPtr		 prefetchBlockProc;
 
 	// statistical information
 	u_int32_t					 numGetNodes;
@@ -227,6 +228,7 @@ typedef struct BTreeControlBlock {					// fields specific to BTree CBs
 	u_int32_t					 numHintChecks;
 	u_int32_t					 numPossibleHints;	// Looks like a formated hint
 	u_int32_t					 numValidHints;		// Hint used to find correct record.
+	u_int32_t					 numPrefetchNodes;	// sibling nodes read ahead while iterating
 	u_int32_t					reservedNodes;
 	BTreeIterator   iterator; // useable when holding exclusive b-tree lock
 } BTreeControlBlock, *BTreeControlBlockPtr;
@@ -241,7 +243,8 @@ u_int32_t KeyLength(const BTreeControlBlock *btcb, const BTreeKey *key);
 
 
 typedef enum {
-					kBTHeaderDirty	= 0x00000001
+					kBTHeaderDirty	= 0x00000001,
+					kBTCatalogKeys	= 0x00000002	// HFS Plus catalog; SearchNode screens keys by prefix
 }	BTreeFlags;
 
 
@@ -387,6 +390,9 @@ OSStatus	GetRightSiblingNode		(BTreeControlBlockPtr	 btreePtr,
 
 #define		GetRightSiblingNode(btree,node,right)		GetNode ((btree), ((NodeDescPtr)(node))->fLink, 0, (right))
 
+void		PrefetchNode			(BTreeControlBlockPtr	 btreePtr,
+									 u_int32_t				 nodeNum );
+
 
 OSStatus	GetNewNode				(BTreeControlBlockPtr	 btreePtr,
 									 u_int32_t				 nodeNum,
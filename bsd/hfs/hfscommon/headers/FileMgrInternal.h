@@ -234,6 +234,9 @@ BlockDeallocate					(ExtendedVCB *			vcb,
 EXTERN_API_C ( void )
 ResetVCBFreeExtCache(struct hfsmount *hfsmp);
 
+EXTERN_API_C ( void )
+ReleaseFreeExtentIndex(struct hfsmount *hfsmp);
+
 EXTERN_API_C( OSErr )
 BlockMarkAllocated(ExtendedVCB *vcb, u_int32_t startingBlock, u_int32_t numBlocks);
 
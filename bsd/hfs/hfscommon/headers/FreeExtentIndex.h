@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef	_FREEEXTENTINDEX_H_
+#define _FREEEXTENTINDEX_H_
+
+#include <sys/appleapiopts.h>
+
+#ifdef KERNEL
+#ifdef __APPLE_API_PRIVATE
+
+#include <sys/types.h>
+#include <libkern/tree.h>
+
+/*
+ * In-memory index of the free extents described by the volume bitmap.
+ *
+ * Every free extent lives in two red-black trees at once: one ordered by
+ * starting block, used to merge and split extents as the bitmap changes,
+ * and one ordered by length (then start), used to find the best-fitting
+ * extent for a contiguous allocation in O(log n).
+ *
+ * The index is built from the bitmap scan at mount time and is protected
+ * by the bitmap (allocation file) lock, like the bitmap itself.
+ */
+struct free_extent_node {
+	RB_ENTRY(free_extent_node)	fen_offset_link;
+	RB_ENTRY(free_extent_node)	fen_size_link;
+	u_int32_t			fen_start;
+	u_int32_t			fen_count;
+};
+
+RB_HEAD(free_extent_offset_tree, free_extent_node);
+RB_HEAD(free_extent_size_tree, free_extent_node);
+
+struct hfs_free_index {
+	struct free_extent_offset_tree	fi_offset_tree;
+	struct free_extent_size_tree	fi_size_tree;
+	u_int32_t			fi_extents;	/* number of extents in the index */
+	u_int64_t			fi_free_blocks;	/* sum of all extent lengths */
+};
+
+/*
+ * Region that an allocation must stay out of (the metadata zone), and
+ * the first block that may not be allocated (allocLimit).
+ */
+struct free_extent_limits {
+	u_int32_t	fel_exclude_start;
+	u_int32_t	fel_exclude_end;	/* inclusive; 0 if nothing excluded */
+	u_int32_t	fel_alloc_limit;
+};
+
+extern void	hfs_free_index_init(void);
+
+extern struct hfs_free_index *hfs_free_index_create(void);
+extern void	hfs_free_index_destroy(struct hfs_free_index *fip);
+
+extern int	hfs_free_index_add(struct hfs_free_index *fip, u_int32_t start, u_int32_t count);
+extern int	hfs_free_index_remove(struct hfs_free_index *fip, u_int32_t start, u_int32_t count);
+
+extern int	hfs_free_index_find(struct hfs_free_index *fip, u_int32_t startingBlock, u_int32_t minBlocks,
+			u_int32_t maxBlocks, const struct free_extent_limits *limits, u_int32_t *startBlock,
+			u_int32_t *blockCount);
+
+#endif /* __APPLE_API_PRIVATE */
+#endif /* KERNEL */
+#endif /* !_FREEEXTENTINDEX_H_ */
@@ -109,6 +109,10 @@ extern int32_t FastUnicodeCompare(register ConstUniCharArrayPtr str1, register I
 extern int32_t UnicodeBinaryCompare (register ConstUniCharArrayPtr str1, register ItemCount length1,
 								 register ConstUniCharArrayPtr str2, register ItemCount length2);
 
+extern u_int64_t FastUnicodePrefix (register ConstUniCharArrayPtr str, register ItemCount length);
+
+extern u_int64_t UnicodeBinaryPrefix (register ConstUniCharArrayPtr str, register ItemCount length);
+
 extern int32_t FastRelString( ConstStr255Param str1, ConstStr255Param str2 );
 
 
@@ -19,6 +19,10 @@ typedef struct xnu_test {
 #define DEFINE_XNU_TEST(func) { func, #func }
 
 xnu_test_t xnu_tests[] = {
+#if PF
+	DEFINE_XNU_TEST(pf_purge_test),
+	DEFINE_XNU_TEST(pf_rule_index_test),
+#endif /* PF */
 };
 
 #define NUM_XNU_TESTS (sizeof(xnu_tests) / sizeof(xnu_test_t))
@@ -102,10 +102,18 @@
 /*
  * This code create half duplex pipe buffers for facilitating file like
  * operations on pipes. The initial buffer is very small, but this can
- * dynamically change to larger sizes based on usage. The buffer size is never
- * reduced. The total amount of kernel memory used is governed by maxpipekva.
- * In case of dynamic expansion limit is reached, the output thread is blocked
- * until the pipe buffer empties enough to continue. 
+ * dynamically change to larger sizes based on usage. A writer that finds the
+ * buffer full keeps growing it, up to kern.ipc.pipe_maxlagsize, for as long
+ * as the reader lags behind; only that extra space is given back once the
+ * reader has caught up. The total amount of kernel memory used is governed
+ * by maxpipekva. In case of dynamic expansion limit is reached, the output
+ * thread is blocked until the pipe buffer empties enough to continue. 
+ *
+ * Blocking writes of at least kern.ipc.pipe_mindirect bytes don't go through
+ * the buffer at all: the writer's pages are mapped into the kernel and the
+ * reader copies straight out of them, so the data is only copied once.
+ * The wired mapping counts against maxpipekva just like buffer space does;
+ * a write that would exceed it goes through the buffer instead.
  *
  * In order to limit the resource use of pipes, two sysctls exist:
  *
@@ -137,6 +145,7 @@
 #include <sys/pipe.h>
 #include <sys/sysproto.h>
 #include <sys/proc_info.h>
+#include <sys/sysctl.h>
 
 #include <security/audit/audit.h>
 
@@ -145,6 +154,7 @@
 #include <kern/zalloc.h>
 #include <kern/kalloc.h>
 #include <vm/vm_kern.h>
+#include <vm/vm_map.h>
 #include <libkern/OSAtomic.h>
 
 #define f_flag f_fglob->fg_flag
@@ -203,6 +213,17 @@ static int amountpipekva; /* total memory used by pipes */
 
 int maxpipekva __attribute__((used)) = PIPE_KVAMAX;  /* allowing 16MB max. */
 
+/* smallest write done directly, never below PIPE_MINDIRECT */
+static int pipe_mindirect = BIG_PIPE_SIZE;
+/* largest buffer grown for a lagging reader */
+static int pipe_maxlagsize = BIG_PIPE_SIZE * 8;
+
+SYSCTL_DECL(_kern_ipc);
+SYSCTL_INT(_kern_ipc, OID_AUTO, pipe_mindirect, CTLFLAG_RW|CTLFLAG_LOCKED,
+	   &pipe_mindirect, 0, "Smallest pipe write copied from the writer's pages");
+SYSCTL_INT(_kern_ipc, OID_AUTO, pipe_maxlagsize, CTLFLAG_RW|CTLFLAG_LOCKED,
+	   &pipe_maxlagsize, 0, "Largest pipe buffer grown for a lagging reader");
+
 #if PIPE_SYSCTLS
 SYSCTL_DECL(_kern_ipc);
 
@@ -226,6 +247,9 @@ static int pipe_create(struct pipe **cpipep);
 static int pipespace(struct pipe *cpipe, int size);
 static int choose_pipespace(unsigned long current, unsigned long expected);
 static int expand_pipespace(struct pipe *p, int target_size);
+static int pipe_lag_expand(struct pipe *wpipe);
+static void pipe_lag_shrink(struct pipe *rpipe);
+static int pipe_direct_write(struct pipe *wpipe, struct uio *uio);
 static void pipeselwakeup(struct pipe *cpipe, struct pipe *spipe);
 static __inline int pipeio_lock(struct pipe *cpipe, int catch);
 static __inline void pipeio_unlock(struct pipe *cpipe);
@@ -241,6 +265,12 @@ static zone_t pipe_zone;
 
 #define MAX_PIPESIZE(pipe)  		( MAX(PIPE_SIZE, (pipe)->pipe_buffer.size) )
 
+/* largest size picked at write time, see pipesize_blocks[] */
+#define	PIPE_BLOCKS_MAX			(PIPE_SIZE * 4)
+
+/* largest chunk of a direct write mapped at once */
+#define	PIPE_DIRECT_MAX			(1024 * 1024)
+
 #define	PIPE_GARBAGE_AGE_LIMIT		5000	/* In milliseconds */
 #define PIPE_GARBAGE_QUEUE_LIMIT	32000
 
@@ -317,7 +347,7 @@ pipe_touch(struct pipe *tpipe, int touch)
 	}
 }
 
-static const unsigned int pipesize_blocks[] = {128,256,1024,2048,4096, 4096 * 2, PIPE_SIZE , PIPE_SIZE * 4 };
+static const unsigned int pipesize_blocks[] = {128,256,1024,2048,4096, 4096 * 2, PIPE_SIZE , PIPE_BLOCKS_MAX };
 
 /* 
  * finds the right size from possible sizes in pipesize_blocks 
@@ -384,6 +414,50 @@ expand_pipespace(struct pipe *p, int target_size)
 	return 0;
 }
 
+/*
+ * Called by a writer that found the buffer full, i.e. the reader is a
+ * whole buffer behind.  Rather than sleeping, double the buffer while
+ * it is below pipe_maxlagsize; pipe_lag_shrink() gives the space back
+ * once the reader keeps up again.
+ * Required: PIPE_LOCK to be held by caller.
+ * returns 0 if there is room to write now
+ */
+static int
+pipe_lag_expand(struct pipe *wpipe)
+{
+	int error;
+
+	if (wpipe->pipe_buffer.cnt < wpipe->pipe_buffer.size ||
+	    wpipe->pipe_buffer.size < PIPE_BLOCKS_MAX ||
+	    wpipe->pipe_buffer.size * 2 > (u_int)pipe_maxlagsize ||
+	    amountpipekva >= maxpipekva)
+		return (ENOSPC);
+
+	if ((error = pipeio_lock(wpipe, 1)) != 0)
+		return (error);
+	error = expand_pipespace(wpipe, wpipe->pipe_buffer.size * 2);
+	pipeio_unlock(wpipe);
+
+	return (error);
+}
+
+/*
+ * Called by the reader once it has drained the buffer.  pipe_lag tracks
+ * the peak amount of data buffered, halving at each drain; a buffer
+ * grown by pipe_lag_expand() is halved in turn when that peak fits in a
+ * quarter of it.
+ * Required: PIPE_LOCK and io lock to be held by caller.
+ */
+static void
+pipe_lag_shrink(struct pipe *rpipe)
+{
+	u_int size = rpipe->pipe_buffer.size;
+
+	if (size > PIPE_BLOCKS_MAX && rpipe->pipe_lag < size / 4)
+		(void) pipespace(rpipe, size / 2);
+	rpipe->pipe_lag /= 2;
+}
+
 /*
  * The pipe system call for the DTYPE_PIPE type of pipes
  * 
@@ -769,6 +843,37 @@ pipe_read(struct fileproc *fp, struct uio *uio, __unused int flags,
 			if (rpipe->pipe_buffer.cnt == 0) {
 				rpipe->pipe_buffer.in = 0;
 				rpipe->pipe_buffer.out = 0;
+				pipe_lag_shrink(rpipe);
+			}
+			nread += size;
+		} else if (rpipe->pipe_map.cnt > 0) {
+			/*
+			 * direct write in progress, copy straight out of
+			 * the writer's pages
+			 */
+			size = rpipe->pipe_map.cnt;
+			// LP64todo - fix this!
+			if (size > (u_int) uio_resid(uio))
+				size = (u_int) uio_resid(uio);
+
+			PIPE_UNLOCK(rpipe); /* we still hold io lock.*/
+			error = uiomove(
+			    (caddr_t)(rpipe->pipe_map.kva + rpipe->pipe_map.pos),
+			    size, uio);
+			PIPE_LOCK(rpipe);
+			if (error)
+				break;
+
+			rpipe->pipe_map.pos += size;
+			rpipe->pipe_map.cnt -= size;
+
+			/*
+			 * The writer waits for the whole mapping to be read.
+			 */
+			if (rpipe->pipe_map.cnt == 0 &&
+			    (rpipe->pipe_state & PIPE_WANTW)) {
+				rpipe->pipe_state &= ~PIPE_WANTW;
+				wakeup(rpipe);
 			}
 			nread += size;
 		} else {
@@ -852,6 +957,119 @@ unlocked_error:
 	return (error);
 }
 
+/*
+ * Direct write: rather than copying the data through the pipe buffer,
+ * map (copy on write) the next chunk of the writer's current iovec into
+ * the kernel, hand it to the reader and wait until it has been read.
+ * Called with PIPE_LOCK held and the buffer empty.  The wired mapping
+ * is charged to amountpipekva for as long as it exists.  Returns 0
+ * without moving anything if data got buffered in the meantime, or
+ * EJUSTRETURN if the chunk can't be mapped, or mapping it would take
+ * pipes past maxpipekva, and the write should go through the buffer
+ * instead.
+ */
+static int
+pipe_direct_write(struct pipe *wpipe, struct uio *uio)
+{
+	vm_map_copy_t copy;
+	vm_map_address_t addr = 0;
+	vm_map_offset_t start;
+	vm_map_size_t size;
+	user_addr_t uaddr;
+	user_size_t len, done;
+	kern_return_t kr;
+	int error;
+
+	if ((error = pipeio_lock(wpipe, 1)) != 0)
+		return (error);
+	if (wpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF)) {
+		pipeio_unlock(wpipe);
+		return (EPIPE);
+	}
+	if (wpipe->pipe_buffer.cnt != 0 ||
+	    (wpipe->pipe_state & PIPE_DIRECTW)) {
+		pipeio_unlock(wpipe);
+		return (0);
+	}
+
+	uaddr = uio_curriovbase(uio);
+	len = MIN(uio_curriovlen(uio), PIPE_DIRECT_MAX);
+	start = vm_map_trunc_page(uaddr, PAGE_MASK);
+	size = vm_map_round_page(uaddr + len, PAGE_MASK) - start;
+
+	if (OSAddAtomic((int)size, &amountpipekva) + (int)size > maxpipekva) {
+		OSAddAtomic(-(int)size, &amountpipekva);
+		pipeio_unlock(wpipe);
+		return (EJUSTRETURN);
+	}
+
+	/* we still hold io lock, so nobody writes ahead of us */
+	PIPE_UNLOCK(wpipe);
+	kr = vm_map_copyin(current_map(), start, size, FALSE, &copy);
+	if (kr == KERN_SUCCESS) {
+		kr = vm_map_copyout(kernel_map, &addr, copy);
+		if (kr != KERN_SUCCESS)
+			vm_map_copy_discard(copy);
+	}
+	if (kr == KERN_SUCCESS) {
+		kr = vm_map_wire(kernel_map, addr, addr + size,
+		    VM_PROT_READ, FALSE);
+		if (kr != KERN_SUCCESS)
+			(void) vm_map_remove(kernel_map, addr, addr + size,
+			    VM_MAP_NO_FLAGS);
+	}
+	PIPE_LOCK(wpipe);
+	if (kr != KERN_SUCCESS) {
+		OSAddAtomic(-(int)size, &amountpipekva);
+		pipeio_unlock(wpipe);
+		return (EJUSTRETURN);
+	}
+
+	wpipe->pipe_map.kva = (vm_offset_t)addr;
+	wpipe->pipe_map.size = size;
+	wpipe->pipe_map.pos = (vm_size_t)(uaddr & PAGE_MASK);
+	wpipe->pipe_map.cnt = len;
+	wpipe->pipe_state |= PIPE_DIRECTW;
+	pipeio_unlock(wpipe);
+
+	if (wpipe->pipe_state & PIPE_WANTR) {
+		wpipe->pipe_state &= ~PIPE_WANTR;
+		wakeup(wpipe);
+	}
+	pipeselwakeup(wpipe, wpipe);
+
+	while (wpipe->pipe_map.cnt > 0) {
+		if (wpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF)) {
+			error = EPIPE;
+			break;
+		}
+		wpipe->pipe_state |= PIPE_WANTW;
+		error = msleep(wpipe, PIPE_MTX(wpipe), PRIBIO | PCATCH,
+		    "pipdww", 0);
+		if (error != 0)
+			break;
+	}
+
+	/*
+	 * A reader may still be copying from the mapping; wait for it
+	 * to let go of the io lock before taking the mapping down.
+	 */
+	(void) pipeio_lock(wpipe, 0);
+	done = len - wpipe->pipe_map.cnt;
+	wpipe->pipe_state &= ~PIPE_DIRECTW;
+	bzero(&wpipe->pipe_map, sizeof (wpipe->pipe_map));
+	pipeio_unlock(wpipe);
+
+	PIPE_UNLOCK(wpipe);
+	(void) vm_map_remove(kernel_map, addr, addr + size,
+	    VM_MAP_REMOVE_KUNWIRE);
+	OSAddAtomic(-(int)size, &amountpipekva);
+	PIPE_LOCK(wpipe);
+
+	uio_update(uio, done);
+	return (done == len ? 0 : error);
+}
+
 /*
  * perform a write of n bytes into the read side of buffer. Since 
  * pipes are unidirectional a write is meant to be read by the otherside only.
@@ -863,6 +1081,7 @@ pipe_write(struct fileproc *fp, struct uio *uio, __unused int flags,
 	int error = 0;
 	int orig_resid;
 	int pipe_size;
+	boolean_t directok;
 	struct pipe *wpipe, *rpipe;
 	// LP64todo - fix this!
 	orig_resid = uio_resid(uio);
@@ -904,6 +1123,10 @@ pipe_write(struct fileproc *fp, struct uio *uio, __unused int flags,
 
 	        pipe_size = choose_pipespace(wpipe->pipe_buffer.size, wpipe->pipe_buffer.cnt + orig_resid);
 	}
+	/* never reallocate to the same size, nor shrink a grown buffer */
+	if (pipe_size && wpipe->pipe_buffer.buffer != 0 &&
+	    (unsigned)pipe_size <= wpipe->pipe_buffer.size)
+		pipe_size = 0;
 	if (pipe_size) {
 	        /*
 		 * need to do initial allocation or resizing of pipe
@@ -937,8 +1160,28 @@ pipe_write(struct fileproc *fp, struct uio *uio, __unused int flags,
 		}
 	}
 
+	directok = !(fp->f_flag & FNONBLOCK) && uio_isuserspace(uio);
+
 	while (uio_resid(uio)) {
 
+		/*
+		 * Large writes go straight from the writer's pages once
+		 * everything buffered ahead of them has been read.
+		 */
+		if (directok && wpipe->pipe_buffer.cnt == 0 &&
+		    !(wpipe->pipe_state & PIPE_DIRECTW) &&
+		    uio_curriovlen(uio) >=
+		    (user_size_t)MAX(pipe_mindirect, PIPE_MINDIRECT)) {
+			error = pipe_direct_write(wpipe, uio);
+			if (error == EJUSTRETURN) {
+				directok = FALSE;
+				error = 0;
+			}
+			if (error)
+				break;
+			continue;
+		}
+
 	retrywrite:
 		space = wpipe->pipe_buffer.size - wpipe->pipe_buffer.cnt;
 
@@ -946,6 +1189,10 @@ pipe_write(struct fileproc *fp, struct uio *uio, __unused int flags,
 		if ((space < uio_resid(uio)) && (orig_resid <= PIPE_BUF))
 			space = 0;
 
+		/* Nothing goes ahead of a direct write in progress. */
+		if (wpipe->pipe_state & PIPE_DIRECTW)
+			space = 0;
+
 		if (space > 0) {
 
 			if ((error = pipeio_lock(wpipe,1)) == 0) {
@@ -1033,6 +1280,10 @@ pipe_write(struct fileproc *fp, struct uio *uio, __unused int flags,
 					if (wpipe->pipe_buffer.cnt >
 					    wpipe->pipe_buffer.size)
 						panic("Pipe buffer overflow");
+					if (wpipe->pipe_buffer.cnt >
+					    wpipe->pipe_lag)
+						wpipe->pipe_lag =
+						    wpipe->pipe_buffer.cnt;
 				
 				}
 				pipeio_unlock(wpipe);
@@ -1066,6 +1317,14 @@ pipe_write(struct fileproc *fp, struct uio *uio, __unused int flags,
 				break;
 			}	
 
+			/*
+			 * The reader is lagging a whole buffer behind; give
+			 * it more room rather than waiting for it.
+			 */
+			if (!(wpipe->pipe_state & PIPE_DIRECTW) &&
+			    pipe_lag_expand(wpipe) == 0)
+				goto retrywrite;
+
 			/*
 			 * We have no more space and have something to offer,
 			 * wake up select/poll.
@@ -1149,7 +1408,7 @@ pipe_ioctl(struct fileproc *fp, u_long cmd, caddr_t data,
 		return (0);
 
 	case FIONREAD:
-		*(int *)data = mpipe->pipe_buffer.cnt;
+		*(int *)data = mpipe->pipe_buffer.cnt + mpipe->pipe_map.cnt;
 		PIPE_UNLOCK(mpipe);
 		return (0);
 
@@ -1441,7 +1700,7 @@ filt_piperead(struct knote *kn, long hint)
 	        PIPE_LOCK(rpipe);
 
 	wpipe = rpipe->pipe_peer;
-	kn->kn_data = rpipe->pipe_buffer.cnt;
+	kn->kn_data = rpipe->pipe_buffer.cnt + rpipe->pipe_map.cnt;
 	if ((rpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF)) ||
 	    (wpipe == NULL) || (wpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF))) {
 		kn->kn_flags |= EV_EOF;
@@ -1489,7 +1748,10 @@ filt_pipewrite(struct knote *kn, long hint)
 		        PIPE_UNLOCK(rpipe);
 		return (1);
 	}
-	kn->kn_data = MAX_PIPESIZE(wpipe) - wpipe->pipe_buffer.cnt;
+	if (wpipe->pipe_state & PIPE_DIRECTW)
+		kn->kn_data = 0;
+	else
+		kn->kn_data = MAX_PIPESIZE(wpipe) - wpipe->pipe_buffer.cnt;
 
 	int64_t lowwat = PIPE_BUF;
 	if (kn->kn_sfflags & NOTE_LOWAT) {
@@ -569,6 +569,31 @@ extern u_int32_t high_sb_max;
 #define	MBIGCL_LOWAT	MINBIGCL
 #define	M16KCL_LOWAT	MIN16KCL
 
+/*
+ * Per-CPU slab freelists.
+ *
+ * Each rudimentary class keeps a small freelist of objects per CPU, in
+ * between the mcache bucket layer and the slabs.  Objects on these lists
+ * are still accounted as allocated from their slabs, so bucket refills
+ * and purges that the local CPU's list can absorb never take mbuf_mlock.
+ * A CPU whose list runs dry tries to take objects from the other CPUs
+ * before falling back to the slabs; that is the only time another CPU's
+ * lock is taken.  The lists are bypassed while there are waiters and
+ * are flushed back to the slabs whenever memory is reclaimed or drained.
+ * They are not used when auditing is enabled, since audited objects must
+ * go through slab_alloc() and slab_free() on every trip.
+ */
+typedef struct {
+	decl_lck_mtx_data(, mp_lock);	/* protects this CPU's list */
+	mcache_obj_t	*mp_list;	/* objects taken out of the slabs */
+	u_int32_t	mp_cnt;		/* # of objects on mp_list */
+	u_int32_t	mp_alloc_cnt;	/* # of objects allocated from mp_list */
+	u_int32_t	mp_free_cnt;	/* # of objects freed to mp_list */
+} __attribute__((aligned(MAX_CPU_CACHE_LINE_SIZE))) mcl_pcpu_t;
+
+#define	MB_PCPU_BYTES	(128 * 1024)	/* per-CPU freelist size per class */
+#define	MB_PCPU_MIN	8		/* but at least this many objects */
+
 typedef struct {
 	mbuf_class_t	mtbl_class;	/* class type */
 	mcache_t	*mtbl_cache;	/* mcache for this buffer class */
@@ -580,6 +605,11 @@ typedef struct {
 	int		mtbl_maxlimit;	/* maximum allowed */
 	u_int32_t	mtbl_wantpurge;	/* purge during next reclaim */
 	uint32_t	mtbl_avgtotal;  /* average total on iOS */
+	mcl_pcpu_t	*mtbl_pcpu;	/* per-CPU slab freelists */
+	u_int32_t	mtbl_pcpu_max;	/* objects allowed on each freelist */
+	volatile u_int32_t mtbl_pcpu_cnt; /* objects on all per-CPU freelists */
+	u_int64_t	mtbl_refill_time; /* total refill time (abs time) */
+	u_int64_t	mtbl_refill_max; /* longest refill (abs time) */
 } mbuf_table_t;
 
 #define	m_class(c)	mbuf_table[c].mtbl_class
@@ -591,6 +621,11 @@ typedef struct {
 #define	m_maxlimit(c)	mbuf_table[c].mtbl_maxlimit
 #define	m_wantpurge(c)	mbuf_table[c].mtbl_wantpurge
 #define	m_avgtotal(c)	mbuf_table[c].mtbl_avgtotal
+#define	m_pcpu(c)	mbuf_table[c].mtbl_pcpu
+#define	m_pcpu_max(c)	mbuf_table[c].mtbl_pcpu_max
+#define	m_pcpu_cnt(c)	mbuf_table[c].mtbl_pcpu_cnt
+#define	m_refill_time(c) mbuf_table[c].mtbl_refill_time
+#define	m_refill_max(c)	mbuf_table[c].mtbl_refill_max
 #define	m_cname(c)	mbuf_table[c].mtbl_stats->mbcl_cname
 #define	m_size(c)	mbuf_table[c].mtbl_stats->mbcl_size
 #define	m_total(c)	mbuf_table[c].mtbl_stats->mbcl_total
@@ -605,6 +640,8 @@ typedef struct {
 #define	m_ctotal(c)	mbuf_table[c].mtbl_stats->mbcl_ctotal
 #define	m_peak(c)	mbuf_table[c].mtbl_stats->mbcl_peak_reported
 #define	m_release_cnt(c) mbuf_table[c].mtbl_stats->mbcl_release_cnt
+#define	m_contended(c)	mbuf_table[c].mtbl_stats->mbcl_slab_contended
+#define	m_refill_cnt(c)	mbuf_table[c].mtbl_stats->mbcl_refill_cnt
 
 static mbuf_table_t mbuf_table[] = {
 	/*
@@ -689,6 +726,12 @@ static unsigned int mbuf_slab_alloc(void *, mcache_obj_t ***,
 static void mbuf_slab_free(void *, mcache_obj_t *, int);
 static void mbuf_slab_audit(void *, mcache_obj_t *, boolean_t);
 static void mbuf_slab_notify(void *, u_int32_t);
+static void mbuf_pcpu_init(void);
+static unsigned int mbuf_pcpu_alloc(mbuf_class_t, mcache_obj_t ***,
+    unsigned int);
+static mcache_obj_t *mbuf_pcpu_free(mbuf_class_t, mcache_obj_t *);
+static void mbuf_pcpu_reclaim(mbuf_class_t);
+static void mbuf_pcpu_flush(void);
 static unsigned int cslab_alloc(mbuf_class_t, mcache_obj_t ***,
     unsigned int);
 static unsigned int cslab_free(mbuf_class_t, mcache_obj_t *, int);
@@ -882,6 +925,7 @@ static boolean_t mbuf_report_usage(mbuf_class_t);
  * that allows for a more accurate view of the state of the allocator.
  */
 struct mb_stat *mb_stat;
+static struct mb_stat *mb_stat_out;	/* mb_stat as reported to userland */
 struct omb_stat *omb_stat;	/* For backwards compatibility */
 
 #define	MB_STAT_SIZE(n) \
@@ -977,9 +1021,16 @@ static int
 mbstat_sysctl SYSCTL_HANDLER_ARGS
 {
 #pragma unused(oidp, arg1, arg2)
+	struct mbstat stat;
+
 	mbuf_mtypes_sync(FALSE);
 
-	return (SYSCTL_OUT(req, &mbstat, sizeof (mbstat)));
+	/* Objects on the per-CPU slab freelists are free as well */
+	bcopy(&mbstat, &stat, sizeof (stat));
+	stat.m_clfree += m_pcpu_cnt(MC_CL);
+	stat.m_bigclfree += m_pcpu_cnt(MC_BIGCL);
+
+	return (SYSCTL_OUT(req, &stat, sizeof (stat)));
 }
 
 static void
@@ -987,7 +1038,9 @@ mbuf_stat_sync(void)
 {
 	mb_class_stat_t *sp;
 	mcache_cpu_t *ccp;
+	mcl_pcpu_t *mp;
 	mcache_t *cp;
+	u_int64_t ns;
 	int k, m, bktsize;
 
 	lck_mtx_assert(mbuf_mlock, LCK_MTX_ASSERT_OWNED);
@@ -1016,8 +1069,33 @@ mbuf_stat_sync(void)
 				sp->mbcl_mc_cached += ccp->cc_pobjs;
 		}
 		sp->mbcl_mc_cached += (cp->mc_full.bl_total * bktsize);
+
+		/*
+		 * Fold the per-CPU freelist counters into the class's;
+		 * objects on those lists are neither active nor in the
+		 * slabs' freelists.
+		 */
+		sp->mbcl_pc_cached = 0;
+		for (m = 0; m_pcpu(k) != NULL && m < ncpu; m++) {
+			mp = &m_pcpu(k)[m];
+			lck_mtx_lock(&mp->mp_lock);
+			sp->mbcl_pc_cached += mp->mp_cnt;
+			sp->mbcl_alloc_cnt += mp->mp_alloc_cnt;
+			sp->mbcl_free_cnt += mp->mp_free_cnt;
+			mp->mp_alloc_cnt = 0;
+			mp->mp_free_cnt = 0;
+			lck_mtx_unlock(&mp->mp_lock);
+		}
 		sp->mbcl_active = sp->mbcl_total - sp->mbcl_mc_cached -
-		    sp->mbcl_infree;
+		    sp->mbcl_infree - sp->mbcl_pc_cached;
+
+		if (m_refill_cnt(k) > 0) {
+			absolutetime_to_nanoseconds(m_refill_time(k) /
+			    m_refill_cnt(k), &ns);
+			sp->mbcl_refill_avg = (u_int32_t)(ns / NSEC_PER_USEC);
+			absolutetime_to_nanoseconds(m_refill_max(k), &ns);
+			sp->mbcl_refill_max = (u_int32_t)(ns / NSEC_PER_USEC);
+		}
 
 		sp->mbcl_mc_waiter_cnt = cp->mc_waiter_cnt;
 		sp->mbcl_mc_wretry_cnt = cp->mc_wretry_cnt;
@@ -1076,7 +1154,7 @@ mb_stat_sysctl SYSCTL_HANDLER_ARGS
 			oc->mbcl_size = c->mbcl_size;
 			oc->mbcl_total = c->mbcl_total;
 			oc->mbcl_active = c->mbcl_active;
-			oc->mbcl_infree = c->mbcl_infree;
+			oc->mbcl_infree = c->mbcl_infree + c->mbcl_pc_cached;
 			oc->mbcl_slab_cnt = c->mbcl_slab_cnt;
 			oc->mbcl_alloc_cnt = c->mbcl_alloc_cnt;
 			oc->mbcl_free_cnt = c->mbcl_free_cnt;
@@ -1094,8 +1172,17 @@ mb_stat_sysctl SYSCTL_HANDLER_ARGS
 		statp = omb_stat;
 		statsz = OMB_STAT_SIZE(NELEM(mbuf_table));
 	} else {
-		statp = mb_stat;
+		/*
+		 * mb_stat holds the live slab counters; report the objects
+		 * on the per-CPU slab freelists as free in a copy of it.
+		 */
 		statsz = MB_STAT_SIZE(NELEM(mbuf_table));
+		bcopy(mb_stat, mb_stat_out, statsz);
+		for (k = 0; k < mb_stat_out->mbs_cnt; k++) {
+			mb_stat_out->mbs_class[k].mbcl_infree +=
+			    mb_stat_out->mbs_class[k].mbcl_pc_cached;
+		}
+		statp = mb_stat_out;
 	}
 
 	lck_mtx_unlock(mbuf_mlock);
@@ -1188,6 +1275,10 @@ mbuf_table_init(void)
 	    M_TEMP, M_WAITOK | M_ZERO);
 	VERIFY(mb_stat != NULL);
 
+	MALLOC(mb_stat_out, mb_stat_t *, MB_STAT_SIZE(NELEM(mbuf_table)),
+	    M_TEMP, M_WAITOK | M_ZERO);
+	VERIFY(mb_stat_out != NULL);
+
 	mb_stat->mbs_cnt = NELEM(mbuf_table);
 	for (m = 0; m < NELEM(mbuf_table); m++)
 		mbuf_table[m].mtbl_stats = &mb_stat->mbs_class[m];
@@ -1612,6 +1703,8 @@ mbinit(void)
 	    CPU_CACHE_LINE_SIZE);
 	bzero(mbuf_mtypes, MBUF_MTYPES_SIZE(ncpu));
 
+	mbuf_pcpu_init();
+
 	/*
 	 * Set the max limit on sb_max to be 1/16 th of the size of
 	 * memory allocated for mbuf clusters.
@@ -1981,24 +2074,192 @@ slab_free(mbuf_class_t class, mcache_obj_t *buf)
 		slab_insert(sp, class);
 }
 
+/*
+ * Acquire mbuf_mlock on behalf of a class, counting the times we had
+ * to wait for it.
+ */
+static inline void
+mbuf_slab_lock(mbuf_class_t class)
+{
+	if (!lck_mtx_try_lock(mbuf_mlock)) {
+		lck_mtx_lock(mbuf_mlock);
+		m_contended(class)++;
+	}
+}
+
+/*
+ * Set up the per-CPU slab freelists of the rudimentary classes.
+ */
+static void
+mbuf_pcpu_init(void)
+{
+	mbuf_class_t class;
+	void *buf;
+	int m;
+
+	if (mclaudit != NULL)
+		return;
+
+	for (class = MBUF_CLASS_MIN; class <= MBUF_CLASS_LAST; class++) {
+		if (class == MC_16KCL && njcl == 0)
+			continue;
+
+		MALLOC(buf, void *, ncpu * sizeof (mcl_pcpu_t) +
+		    CPU_CACHE_LINE_SIZE, M_TEMP, M_WAITOK | M_ZERO);
+		VERIFY(buf != NULL);
+
+		m_pcpu(class) = (mcl_pcpu_t *)P2ROUNDUP((intptr_t)buf,
+		    CPU_CACHE_LINE_SIZE);
+		m_pcpu_max(class) = MAX(MB_PCPU_BYTES / m_maxsize(class),
+		    MB_PCPU_MIN);
+		for (m = 0; m < ncpu; m++) {
+			lck_mtx_init(&m_pcpu(class)[m].mp_lock,
+			    mbuf_mlock_grp, mbuf_mlock_attr);
+		}
+	}
+}
+
+/*
+ * Take up to num objects off this CPU's slab freelist, helping ourselves
+ * to the other CPUs' lists if the local one runs dry.  Returns the number
+ * of objects obtained and advances *plist past them.
+ */
+static unsigned int
+mbuf_pcpu_alloc(mbuf_class_t class, mcache_obj_t ***plist, unsigned int num)
+{
+	mcache_obj_t **list = *plist;
+	unsigned int need = num, got;
+	mcl_pcpu_t *mp;
+	int cpu, m;
+
+	cpu = cpu_number();
+	for (m = 0; m < ncpu && need > 0; m++) {
+		mp = &m_pcpu(class)[(cpu + m) % ncpu];
+		if (m == 0) {
+			lck_mtx_lock(&mp->mp_lock);
+		} else if (mp->mp_cnt == 0 ||
+		    !lck_mtx_try_lock(&mp->mp_lock)) {
+			/* Don't wait on other CPUs; the slabs are next */
+			continue;
+		}
+
+		for (got = 0; need > 0 && mp->mp_list != NULL; got++) {
+			*list = mp->mp_list;
+			mp->mp_list = (*list)->obj_next;
+			(*list)->obj_next = NULL;
+			list = *plist = &(*list)->obj_next;
+			--need;
+		}
+		mp->mp_cnt -= got;
+		mp->mp_alloc_cnt += got;
+		atomic_add_32(&m_pcpu_cnt(class), -got);
+		lck_mtx_unlock(&mp->mp_lock);
+	}
+
+	return (num - need);
+}
+
+/*
+ * Place objects on this CPU's slab freelist, up to its limit.  Returns
+ * whatever didn't fit, which the caller hands back to the slabs.
+ */
+static mcache_obj_t *
+mbuf_pcpu_free(mbuf_class_t class, mcache_obj_t *list)
+{
+	mcl_pcpu_t *mp = &m_pcpu(class)[cpu_number()];
+	mcache_obj_t *nlist;
+	u_int32_t cnt = 0;
+
+	lck_mtx_lock(&mp->mp_lock);
+	while (list != NULL && mp->mp_cnt < m_pcpu_max(class)) {
+		nlist = list->obj_next;
+		list->obj_next = mp->mp_list;
+		mp->mp_list = list;
+		mp->mp_cnt++;
+		mp->mp_free_cnt++;
+		list = nlist;
+		cnt++;
+	}
+	atomic_add_32(&m_pcpu_cnt(class), cnt);
+	lck_mtx_unlock(&mp->mp_lock);
+
+	return (list);
+}
+
+/*
+ * Return the objects on every CPU's slab freelist of a class to their
+ * slabs.  Unlike mbuf_pcpu_alloc(), this waits for the other CPUs' locks.
+ */
+static void
+mbuf_pcpu_reclaim(mbuf_class_t class)
+{
+	mcache_obj_t *list, *nlist;
+	mcl_pcpu_t *mp;
+	int m;
+
+	lck_mtx_assert(mbuf_mlock, LCK_MTX_ASSERT_OWNED);
+
+	if (m_pcpu(class) == NULL)
+		return;
+
+	for (m = 0; m < ncpu; m++) {
+		mp = &m_pcpu(class)[m];
+		lck_mtx_lock(&mp->mp_lock);
+		list = mp->mp_list;
+		mp->mp_list = NULL;
+		atomic_add_32(&m_pcpu_cnt(class), -mp->mp_cnt);
+		mp->mp_cnt = 0;
+		lck_mtx_unlock(&mp->mp_lock);
+
+		for (; list != NULL; list = nlist) {
+			nlist = list->obj_next;
+			list->obj_next = NULL;
+			slab_free(class, list);
+		}
+	}
+}
+
+/*
+ * Return the objects on every per-CPU slab freelist to their slabs, so
+ * that they show up as free for reclaim, drain and sleeping allocators.
+ */
+static void
+mbuf_pcpu_flush(void)
+{
+	mbuf_class_t class;
+
+	for (class = MBUF_CLASS_MIN; class <= MBUF_CLASS_LAST; class++)
+		mbuf_pcpu_reclaim(class);
+}
+
 /*
  * Common allocator for rudimentary objects called by the CPU cache layer
  * during an allocation request whenever there is no available element in the
- * bucket layer.  It returns one or more elements from the appropriate global
- * freelist.  If the freelist is empty, it will attempt to populate it and
- * retry the allocation.
+ * bucket layer.  It returns one or more elements from this CPU's slab
+ * freelist, or else from the appropriate global freelist.  If the freelist
+ * is empty, it will attempt to populate it and retry the allocation.
  */
 static unsigned int
 mbuf_slab_alloc(void *arg, mcache_obj_t ***plist, unsigned int num, int wait)
 {
 	mbuf_class_t class = (mbuf_class_t)arg;
-	unsigned int need = num;
-	mcache_obj_t **list = *plist;
+	unsigned int need = num, got = 0;
+	mcache_obj_t **list;
+	u_int64_t start, elapsed;
 
 	ASSERT(MBUF_CLASS_VALID(class) && !MBUF_CLASS_COMPOSITE(class));
 	ASSERT(need > 0);
 
-	lck_mtx_lock(mbuf_mlock);
+	if (m_pcpu(class) != NULL) {
+		got = mbuf_pcpu_alloc(class, plist, num);
+		if (got == num)
+			return (num);
+		need -= got;
+	}
+	list = *plist;
+
+	start = mach_absolute_time();
+	mbuf_slab_lock(class);
 
 	for (;;) {
 		if ((*list = slab_alloc(class, wait)) != NULL) {
@@ -2022,6 +2283,18 @@ mbuf_slab_alloc(void *arg, mcache_obj_t ***plist, unsigned int num, int wait)
 		} else {
 			VERIFY(m_infree(class) == 0 || class == MC_CL);
 
+			/*
+			 * Before growing the freelist, sleeping or failing,
+			 * take back what the other CPUs have parked on their
+			 * slab freelists; mbuf_pcpu_alloc() skipped any it
+			 * couldn't lock without waiting.
+			 */
+			if (m_pcpu_cnt(class) > 0) {
+				mbuf_pcpu_reclaim(class);
+				if (m_infree(class) > 0)
+					continue;
+			}
+
 			(void) freelist_populate(class, 1,
 			    (wait & MCR_NOSLEEP) ? M_DONTWAIT : M_WAIT);
 
@@ -2059,7 +2332,13 @@ mbuf_slab_alloc(void *arg, mcache_obj_t ***plist, unsigned int num, int wait)
 		}
 	}
 
-	m_alloc_cnt(class) += num - need;
+	m_alloc_cnt(class) += num - got - need;
+
+	elapsed = mach_absolute_time() - start;
+	m_refill_cnt(class)++;
+	m_refill_time(class) += elapsed;
+	if (elapsed > m_refill_max(class))
+		m_refill_max(class) = elapsed;
 	lck_mtx_unlock(mbuf_mlock);
 
 	return (num - need);
@@ -2068,10 +2347,11 @@ mbuf_slab_alloc(void *arg, mcache_obj_t ***plist, unsigned int num, int wait)
 /*
  * Common de-allocator for rudimentary objects called by the CPU cache
  * layer when one or more elements need to be returned to the appropriate
- * global freelist.
+ * global freelist.  Unless the cache is being purged or someone is waiting
+ * for memory, as many as fit go to this CPU's slab freelist instead.
  */
 static void
-mbuf_slab_free(void *arg, mcache_obj_t *list, __unused int purged)
+mbuf_slab_free(void *arg, mcache_obj_t *list, int purged)
 {
 	mbuf_class_t class = (mbuf_class_t)arg;
 	mcache_obj_t *nlist;
@@ -2080,7 +2360,12 @@ mbuf_slab_free(void *arg, mcache_obj_t *list, __unused int purged)
 
 	ASSERT(MBUF_CLASS_VALID(class) && !MBUF_CLASS_COMPOSITE(class));
 
-	lck_mtx_lock(mbuf_mlock);
+	if (m_pcpu(class) != NULL && !purged && mb_waiters == 0) {
+		if ((list = mbuf_pcpu_free(class, list)) == NULL)
+			return;
+	}
+
+	mbuf_slab_lock(class);
 
 	for (;;) {
 		nlist = list->obj_next;
@@ -2397,7 +2682,7 @@ mbuf_cslab_alloc(void *arg, mcache_obj_t ***plist, unsigned int needed,
 	    m_slablist(class).tqh_first == NULL &&
 	    m_slablist(class).tqh_last == NULL);
 
-	lck_mtx_lock(mbuf_mlock);
+	mbuf_slab_lock(class);
 
 	/* Try using the freelist first */
 	num = cslab_alloc(class, plist, needed);
@@ -2576,7 +2861,7 @@ mbuf_cslab_free(void *arg, mcache_obj_t *list, int purged)
 
 	ASSERT(MBUF_CLASS_VALID(class) && MBUF_CLASS_COMPOSITE(class));
 
-	lck_mtx_lock(mbuf_mlock);
+	mbuf_slab_lock(class);
 
 	num = cslab_free(class, list, purged);
 	m_free_cnt(class) += num;
@@ -3179,6 +3464,9 @@ m_reclaim(mbuf_class_t class, unsigned int num, boolean_t comp)
 	VERIFY(m_total(MC_BIGCL) <= m_maxlimit(MC_BIGCL));
 	VERIFY(m_total(MC_16KCL) <= m_maxlimit(MC_16KCL));
 
+	/* Make the objects parked on the per-CPU freelists available */
+	mbuf_pcpu_flush();
+
 	/*
 	 * This logic can be made smarter; for now, simply mark
 	 * all other related classes as potential victims.
@@ -3582,6 +3870,19 @@ m_mclhasreference(struct mbuf *m)
 	return ((MEXT_FLAGS(m) & EXTF_READONLY) ? 1 : 0);
 }
 
+/*
+ * Mark the external buffer of an mbuf read-only, as if it were shared,
+ * so that nothing writes into it or extends data into its free space.
+ */
+__private_extern__ void
+m_set_ext_readonly(struct mbuf *m)
+{
+	VERIFY(m->m_flags & M_EXT);
+	ASSERT(MEXT_RFA(m) != NULL);
+
+	(void) OSBitOrAtomic(EXTF_READONLY, &MEXT_FLAGS(m));
+}
+
 __private_extern__ caddr_t
 m_bigalloc(int wait)
 {
@@ -5208,10 +5509,12 @@ m_howmany(int num, size_t bufsize)
 	m_16kclusters = m_total(MC_16KCL);
 	sumclusters = m_mbclusters + m_clusters + m_bigclusters;
 
-	m_mbfree = m_infree(MC_MBUF) >> NMBPCLSHIFT;
-	m_clfree = m_infree(MC_CL);
-	m_bigclfree = m_infree(MC_BIGCL) << NCLPBGSHIFT;
-	m_16kclfree = m_infree(MC_16KCL);
+	/* Objects on the per-CPU slab freelists are free as well */
+	m_mbfree = (m_infree(MC_MBUF) + m_pcpu_cnt(MC_MBUF)) >> NMBPCLSHIFT;
+	m_clfree = m_infree(MC_CL) + m_pcpu_cnt(MC_CL);
+	m_bigclfree = (m_infree(MC_BIGCL) + m_pcpu_cnt(MC_BIGCL)) <<
+	    NCLPBGSHIFT;
+	m_16kclfree = m_infree(MC_16KCL) + m_pcpu_cnt(MC_16KCL);
 	freeclusters = m_mbfree + m_clfree + m_bigclfree;
 
 	/* Bail if we've maxed out the mbuf memory map */
@@ -7424,6 +7727,11 @@ m_drain(void)
 		lck_mtx_unlock(mbuf_mlock);
 		return;
 	}
+	/*
+	 * Return the per-CPU slab freelists to the slabs, so that
+	 * their slabs can be freed below.
+	 */
+	mbuf_pcpu_flush();
 	/*
 	 * Purge all the caches.  This effectively disables
 	 * caching for a few seconds, but the mbuf worker thread will
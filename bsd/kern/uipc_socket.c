@@ -213,6 +213,24 @@ SYSCTL_INT(_kern_ipc, OID_AUTO, sosendminchain,
 SYSCTL_INT(_kern_ipc, OID_AUTO, sorecvmincopy,
 	CTLFLAG_RW | CTLFLAG_LOCKED, &sorecvmincopy, 0, "");
 
+/*
+ * Set to map page-backed data copy on write into the reader's buffer
+ * rather than copying it, where the two line up; see soreceive_uiomove().
+ * The counters cover the data of external mbufs that was considered.
+ */
+static int soreceive_zerocopy = 1;
+SYSCTL_INT(_kern_ipc, OID_AUTO, soreceive_zerocopy,
+	CTLFLAG_RW | CTLFLAG_LOCKED, &soreceive_zerocopy, 0, "");
+static int soreceive_mapmin = 16 * 1024;	/* shortest run mapped */
+SYSCTL_INT(_kern_ipc, OID_AUTO, soreceive_mapmin,
+	CTLFLAG_RW | CTLFLAG_LOCKED, &soreceive_mapmin, 0, "");
+static u_int64_t soreceive_mapped;
+SYSCTL_QUAD(_kern_ipc, OID_AUTO, soreceive_mapped,
+	CTLFLAG_RD | CTLFLAG_LOCKED, &soreceive_mapped, "");
+static u_int64_t soreceive_copied;
+SYSCTL_QUAD(_kern_ipc, OID_AUTO, soreceive_copied,
+	CTLFLAG_RD | CTLFLAG_LOCKED, &soreceive_copied, "");
+
 /*
  * Set to enable jumbo clusters (if available) for large writes when
  * the socket is marked with SOF_MULTIPAGES; see below.
@@ -271,6 +289,8 @@ static struct zone *se_zone;			/* zone for sockaddr_entry */
 vm_size_t	so_cache_zone_element_size;
 
 static int sodelayed_copy(struct socket *, struct uio *, struct mbuf **, user_ssize_t *);
+static int soreceive_run(struct mbuf *, struct mbuf **);
+static int soreceive_uiomove(struct mbuf *, int, int, struct uio *);
 static void cached_sock_alloc(struct socket **, int);
 static void cached_sock_free(struct socket *);
 
@@ -351,6 +371,9 @@ socketinit(void)
 #if MULTIPATH
 	mp_pcbinit();
 #endif /* MULTIPATH */
+#if SENDFILE
+	sendfile_init();
+#endif /* SENDFILE */
 }
 
 static void
@@ -1897,6 +1920,20 @@ sosend(struct socket *so, struct sockaddr *addr, struct uio *uio,
 
 				socket_unlock(so, 0);
 
+				/*
+				 * Large writes on AF_UNIX stream sockets may
+				 * be mapped rather than copied.
+				 */
+				if (SOCK_DOM(so) == PF_LOCAL && top == NULL &&
+				    (top = unp_sosend_map(so, uio,
+				    bytes_to_copy)) != NULL) {
+					space -= top->m_pkthdr.len;
+					resid = uio_resid(uio);
+					if (resid <= 0 && (flags & MSG_EOR))
+						top->m_flags |= M_EOR;
+					goto mapped;
+				}
+
 				do {
 					int num_needed;
 					int hdrs_needed = (top == NULL) ? 1 : 0;
@@ -2043,7 +2080,7 @@ sosend(struct socket *so, struct sockaddr *addr, struct uio *uio,
 				} while (space > 0 &&
 				    (chainlength < sosendmaxchain || atomic ||
 				    resid < MINCLSIZE));
-
+mapped:
 				socket_lock(so, 0);
 
 				if (error)
@@ -2174,7 +2211,7 @@ sosend_list(struct socket *so, struct sockaddr *addr, struct uio **uioarray,
      u_int uiocnt, struct mbuf *top, struct mbuf *control, int flags)
 {
 	struct mbuf *m, *freelist = NULL;
-	user_ssize_t len, resid;
+	user_ssize_t len, resid, maxdgram;
 	int clen = 0, error, dontroute, mlen;
 	int atomic = sosendallatonce(so) || top;
 	int sblocked = 0;
@@ -2201,10 +2238,13 @@ sosend_list(struct socket *so, struct sockaddr *addr, struct uio **uioarray,
 		error = EINVAL;
 		goto out;
 	}
-	if (uioarray != NULL)
+	if (uioarray != NULL) {
 		resid = uio_array_resid(uioarray, uiocnt);
-	else
+		maxdgram = uio_array_maxresid(uioarray, uiocnt);
+	} else {
 		resid = mbuf_pkt_list_len(top);
+		maxdgram = mbuf_pkt_list_maxlen(top);
+	}
 
 	/*
 	 * In theory resid should be unsigned.
@@ -2251,7 +2291,11 @@ sosend_list(struct socket *so, struct sockaddr *addr, struct uio **uioarray,
 	if (control != NULL)
 		clen = control->m_len;
 
-	error = sosendcheck(so, addr, resid, clen, atomic, flags,
+	/*
+	 * Each datagram of the list is sent on its own, so it is the
+	 * largest one rather than the total that has to fit.
+	 */
+	error = sosendcheck(so, addr, maxdgram, clen, atomic, flags,
 	    &sblocked, control);
 	if (error)
 		goto release;
@@ -3113,8 +3157,8 @@ dontblock:
 					}
 				}
 				socket_unlock(so, 0);
-				error = uiomove(mtod(m, caddr_t) + moff,
-				    (int)len, uio);
+				error = soreceive_uiomove(m, moff, (int)len,
+				    uio);
 				socket_lock(so, 0);
 
 				if (error)
@@ -3412,8 +3456,12 @@ sodelayed_copy(struct socket *so, struct uio *uio, struct mbuf **free_list,
 	socket_unlock(so, 0);
 
 	while (m != NULL && error == 0) {
-		error = uiomove(mtod(m, caddr_t), (int)m->m_len, uio);
-		m = m->m_next;
+		struct mbuf *n;
+		int len;
+
+		len = soreceive_run(m, &n);
+		error = soreceive_uiomove(m, 0, len, uio);
+		m = n;
 	}
 	m_freem_list(*free_list);
 
@@ -3425,6 +3473,53 @@ sodelayed_copy(struct socket *so, struct uio *uio, struct mbuf **free_list,
 	return (error);
 }
 
+/*
+ * Return how many bytes starting at m sodelayed_copy() can hand to
+ * soreceive_uiomove() at once, and the mbuf that follows them: a whole
+ * run of page mbufs backed by the same mapping, or else just m.
+ */
+static int
+soreceive_run(struct mbuf *m, struct mbuf **next)
+{
+#if SENDFILE
+	if (soreceive_zerocopy)
+		return (sf_map_run(m, next));
+#endif /* SENDFILE */
+	*next = m->m_next;
+	return (m->m_len);
+}
+
+/*
+ * Copy len bytes at off in m out to the uio, on behalf of soreceive();
+ * len may cover a run of mbufs, see soreceive_run().  Reads of at least
+ * soreceive_mapmin bytes of external mbufs into user space go through
+ * sf_map_uiomove(), which maps runs of whole pages that long copy on
+ * write into the reader's buffer where it can; below that, remapping
+ * costs more than the copy it saves.  That takes pageable page mbufs,
+ * such as those of LOCAL_SINGLECOPY writes.  Cluster pages are wired
+ * and owned by the mbuf allocator, so their data is always copied.
+ */
+static int
+soreceive_uiomove(struct mbuf *m, int off, int len, struct uio *uio)
+{
+#if SENDFILE
+	int error, mapped;
+
+	if (soreceive_zerocopy && len >= soreceive_mapmin &&
+	    (m->m_flags & M_EXT) && uio_isuserspace(uio)) {
+		error = sf_map_uiomove(m, off, len, uio, soreceive_mapmin,
+		    &mapped);
+		if (error == 0) {
+			if (mapped > 0)
+				atomic_add_64(&soreceive_mapped, mapped);
+			atomic_add_64(&soreceive_copied, len - mapped);
+		}
+		return (error);
+	}
+#endif /* SENDFILE */
+	return (uiomove(mtod(m, caddr_t) + off, len, uio));
+}
+
 int
 soreceive_list(struct socket *so, struct sockaddr **psa, struct uio **uioarray,
 	u_int uiocnt, struct mbuf **mp0, struct mbuf **controlp, int *flagsp)
@@ -3574,17 +3669,18 @@ restart:
 	}
 	sblocked = 1;
 
+next:
 	/*
 	 * Skip empty uio
 	 */
-	auio = uioarray[i];
-	while (uio_resid(auio) == 0) {
+	while (uio_resid(uioarray[i]) == 0) {
 		i++;
 		if (i >= uiocnt) {
 			error = 0;
 			goto release;
 		}
 	}
+	auio = uioarray[i];
 
 	m = so->so_rcv.sb_mb;
 	/*
@@ -3836,10 +3932,11 @@ restart:
 	if (i < uiocnt && error == 0 &&
 	    (flags & (MSG_RCVMORE | MSG_TRUNC)) == 0 
 	    && (so->so_state & SS_CANTRCVMORE) == 0) {
-		sbunlock(&so->so_rcv, TRUE);	/* keep socket locked */
-		sblocked = 0;
-
-		goto restart;
+		/*
+		 * Keep the receive buffer locked while the rest of the
+		 * batch is dequeued; we only block for the first datagram.
+		 */
+		goto next;
 	}
 
 release:
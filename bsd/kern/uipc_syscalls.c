@@ -89,6 +89,11 @@
 #include <sys/kauth.h>
 #include <kern/task.h>
 #include <sys/priv.h>
+#include <sys/sysctl.h>
+#include <sys/ubc_internal.h>
+#include <kern/thread_call.h>
+#include <vm/vm_map.h>
+#include <vm/vm_kern.h>
 
 #include <security/audit/audit.h>
 
@@ -98,9 +103,9 @@
 #include <net/route.h>
 #include <netinet/in_pcb.h>
 
-#if CONFIG_MACF_SOCKET_SUBSET
+#if CONFIG_MACF_SOCKET_SUBSET || CONFIG_MACF
 #include <security/mac_framework.h>
-#endif /* MAC_SOCKET_SUBSET */
+#endif /* MAC_SOCKET_SUBSET || CONFIG_MACF */
 
 #define	f_flag f_fglob->fg_flag
 #define	f_type f_fglob->fg_ops->fo_type
@@ -143,6 +148,17 @@ static int getsockaddr_s(struct socket *, struct sockaddr_storage *,
 static int getsockaddrlist(struct socket *, struct sockaddr_list **,
     user_addr_t, socklen_t, boolean_t);
 #if SENDFILE
+struct sf_map;
+static void sf_map_rele(struct sf_map *, SInt32);
+static void sf_map_free(caddr_t, u_int, caddr_t);
+static void sf_map_reap(thread_call_param_t, thread_call_param_t);
+static struct mbuf *sendfile_map(vfs_context_t, struct vnode *, off_t,
+    off_t);
+static void sendfile_prefetch(struct vnode *, off_t, off_t, off_t);
+static int sendfile_hdtr(struct proc *, user_addr_t, int, struct mbuf **,
+    user_ssize_t *);
+static void sendfile_cat(struct mbuf *, struct mbuf *);
+static int sendfile_send(struct socket *, struct proc *, int, struct mbuf *);
 static void alloc_sendpkt(int, size_t, unsigned int *, struct mbuf **,
     boolean_t);
 #endif /* SENDFILE */
@@ -2762,6 +2778,21 @@ uio_array_resid(struct uio **uiop, u_int count)
 	return (len);
 }
 
+__private_extern__ user_ssize_t
+uio_array_maxresid(struct uio **uiop, u_int count)
+{
+	user_ssize_t len = 0;
+	u_int i;
+
+	for (i = 0; i < count; i++) {
+		struct uio *auio = uiop[i];
+
+		if (auio != NULL && uio_resid(auio) > len)
+			len = uio_resid(auio);
+	}
+	return (len);
+}
+
 int
 uio_array_is_valid(struct uio **uiop, u_int count)
 {
@@ -2844,6 +2875,611 @@ alloc_sendpkt(int how, size_t pktlen, unsigned int *maxchunks,
 	*maxchunks = needed;
 }
 
+/*
+ * Zero-copy sendfile.  Rather than reading file data into mbuf clusters,
+ * the range being sent is mapped read-only into the kernel map and wired,
+ * and each page is attached to an external mbuf.  The mapping stays in
+ * place until the last of those mbufs (and any copies made of them by
+ * the protocol) is freed; since that can happen in any context, the
+ * unmapping itself is deferred to a thread call.  The same machinery
+ * backs large writes on AF_UNIX stream sockets; see sf_map_uio().
+ *
+ * The page mbufs are marked read-only, so nothing downstream writes into
+ * them or grows them in place.  The file is held in use for as long as
+ * it is mapped, and the amount of file data wired this way is capped by
+ * kern.ipc.sendfile_maxwired; past that, sendfile copies.
+ *
+ * Only used for sockets without filters, as a filter may want to modify
+ * the data in place, which the read-only mapping won't allow.
+ */
+struct sf_map {
+	SLIST_ENTRY(sf_map) sfm_link;	/* link on reap list */
+	vm_map_offset_t	sfm_addr;	/* kernel address of the mapping */
+	vm_map_size_t	sfm_size;	/* size of the mapping */
+	volatile SInt32	sfm_refcnt;	/* number of page mbufs outstanding */
+	u_int32_t	sfm_flags;	/* see below */
+	struct vnode	*sfm_vp;	/* file held in use, if any */
+};
+
+#define	SFM_PAGEABLE	0x1	/* not wired, may be mapped copy on write */
+
+SYSCTL_DECL(_kern_ipc);
+
+static int sendfile_zerocopy = 1;
+SYSCTL_INT(_kern_ipc, OID_AUTO, sendfile_zerocopy,
+	CTLFLAG_RW | CTLFLAG_LOCKED, &sendfile_zerocopy, 0,
+	"Send file pages without copying them into mbuf clusters");
+
+static int sendfile_prefetch_enable = 1;
+SYSCTL_INT(_kern_ipc, OID_AUTO, sendfile_prefetch,
+	CTLFLAG_RW | CTLFLAG_LOCKED, &sendfile_prefetch_enable, 0,
+	"Start reading the next range of the file while sending");
+
+static int sendfile_maxwired = 64 * 1024 * 1024;
+SYSCTL_INT(_kern_ipc, OID_AUTO, sendfile_maxwired,
+	CTLFLAG_RW | CTLFLAG_LOCKED, &sendfile_maxwired, 0,
+	"Most bytes of file pages kept wired by sendfile");
+
+static SInt32 sendfile_wired;
+SYSCTL_INT(_kern_ipc, OID_AUTO, sendfile_wired,
+	CTLFLAG_RD | CTLFLAG_LOCKED, &sendfile_wired, 0, "");
+
+static int singlecopy_maxmapped = 64 * 1024 * 1024;
+SYSCTL_INT(_kern_ipc, OID_AUTO, singlecopy_maxmapped,
+	CTLFLAG_RW | CTLFLAG_LOCKED, &singlecopy_maxmapped, 0,
+	"Most bytes of user pages kept mapped by AF_UNIX single-copy writes");
+
+static SInt32 singlecopy_mapped;
+SYSCTL_INT(_kern_ipc, OID_AUTO, singlecopy_mapped,
+	CTLFLAG_RD | CTLFLAG_LOCKED, &singlecopy_mapped, 0, "");
+
+static decl_lck_mtx_data(, sf_map_lock);
+static lck_grp_t *sf_map_lock_grp;
+static SLIST_HEAD(, sf_map) sf_map_reap_head =
+    SLIST_HEAD_INITIALIZER(sf_map_reap_head);
+static thread_call_t sf_map_tcall;
+
+void
+sendfile_init(void)
+{
+	lck_grp_attr_t *grp_attr;
+	lck_attr_t *lck_attr;
+
+	grp_attr = lck_grp_attr_alloc_init();
+	sf_map_lock_grp = lck_grp_alloc_init("sendfile", grp_attr);
+	lck_grp_attr_free(grp_attr);
+	lck_attr = lck_attr_alloc_init();
+	lck_mtx_init(&sf_map_lock, sf_map_lock_grp, lck_attr);
+	lck_attr_free(lck_attr);
+
+	sf_map_tcall = thread_call_allocate(sf_map_reap, NULL);
+	if (sf_map_tcall == NULL) {
+		panic("%s: thread_call_allocate failed\n", __func__);
+		/* NOTREACHED */
+	}
+}
+
+/*
+ * Remove a mapping and give back what it was holding.
+ */
+static void
+sf_map_remove(vm_map_offset_t addr, vm_map_size_t size, u_int32_t flags,
+    struct vnode *vp)
+{
+	(void) vm_map_remove(kernel_map, addr, addr + size,
+	    VM_MAP_REMOVE_KUNWIRE);
+	if (flags & SFM_PAGEABLE)
+		OSAddAtomic(-(SInt32)size, &singlecopy_mapped);
+	else
+		OSAddAtomic(-(SInt32)size, &sendfile_wired);
+	if (vp != NULL)
+		vnode_rele(vp);
+}
+
+/*
+ * Drop cnt references to a mapping; the last one schedules its removal.
+ */
+static void
+sf_map_rele(struct sf_map *sfm, SInt32 cnt)
+{
+	SInt32 old;
+
+	old = OSAddAtomic(-cnt, &sfm->sfm_refcnt);
+	VERIFY(old >= cnt);
+	if (old != cnt)
+		return;
+
+	lck_mtx_lock_spin(&sf_map_lock);
+	SLIST_INSERT_HEAD(&sf_map_reap_head, sfm, sfm_link);
+	lck_mtx_unlock(&sf_map_lock);
+	thread_call_enter(sf_map_tcall);
+}
+
+/*
+ * External free routine of the page mbufs.
+ */
+static void
+sf_map_free(caddr_t buf, u_int size, caddr_t arg)
+{
+#pragma unused(buf, size)
+	sf_map_rele((struct sf_map *)(void *)arg, 1);
+}
+
+static void
+sf_map_reap(thread_call_param_t arg0, thread_call_param_t arg1)
+{
+#pragma unused(arg0, arg1)
+	struct sf_map *sfm;
+
+	for (;;) {
+		lck_mtx_lock_spin(&sf_map_lock);
+		if ((sfm = SLIST_FIRST(&sf_map_reap_head)) != NULL)
+			SLIST_REMOVE_HEAD(&sf_map_reap_head, sfm_link);
+		lck_mtx_unlock(&sf_map_lock);
+		if (sfm == NULL)
+			break;
+
+		sf_map_remove(sfm->sfm_addr, sfm->sfm_size, sfm->sfm_flags,
+		    sfm->sfm_vp);
+		FREE(sfm, M_TEMP);
+	}
+}
+
+/*
+ * Build a packet of external mbufs pointing at [pgoff, pgoff + len) of
+ * the wired kernel mapping at addr, which it takes ownership of along
+ * with the use count on vp, if any: the mapping is removed once the last
+ * mbuf is freed, or right away if the packet can't be built, in which
+ * case NULL is returned.
+ */
+static struct mbuf *
+sf_map_attach(vm_map_offset_t addr, vm_map_size_t size, size_t pgoff,
+    size_t len, u_int32_t flags, struct vnode *vp)
+{
+	struct sf_map *sfm;
+	struct mbuf *m0 = NULL, *m, **mp = &m0;
+	size_t resid;
+	SInt32 npages, i;
+
+	npages = (SInt32)atop_64(size);
+
+	MALLOC(sfm, struct sf_map *, sizeof (*sfm), M_TEMP, M_WAITOK | M_ZERO);
+	if (sfm == NULL) {
+		sf_map_remove(addr, size, flags, vp);
+		return (NULL);
+	}
+	sfm->sfm_addr = addr;
+	sfm->sfm_size = size;
+	sfm->sfm_refcnt = npages;
+	sfm->sfm_flags = flags;
+	sfm->sfm_vp = vp;
+
+	for (i = 0, resid = len; i < npages; i++) {
+		caddr_t page = (caddr_t)(uintptr_t)(addr + ptoa_64(i));
+		size_t off = (i == 0) ? pgoff : 0;
+		size_t mlen = MIN(PAGE_SIZE - off, resid);
+
+		m = NULL;
+		if (i != 0 && (m = m_get(M_WAIT, MT_DATA)) == NULL)
+			goto fail;
+		/*
+		 * The external buffer covers just the data, so that no
+		 * leading or trailing space in the read-only mapping is
+		 * ever offered to sbcompress() or M_PREPEND().
+		 */
+		m = m_clattach(m, MT_DATA, page + off, sf_map_free, mlen,
+		    (caddr_t)sfm, M_WAIT);
+		if (m == NULL)
+			goto fail;
+		m_set_ext_readonly(m);
+		m->m_len = mlen;
+		*mp = m;
+		mp = &m->m_next;
+		resid -= mlen;
+	}
+	VERIFY(resid == 0);
+	m0->m_pkthdr.len = len;
+	m0->m_pkthdr.rcvif = NULL;
+
+	return (m0);
+
+fail:
+	/* Drop the references of the pages that didn't get an mbuf */
+	sf_map_rele(sfm, npages - i);
+	if (m0 != NULL)
+		m_freem(m0);
+	return (NULL);
+}
+
+/*
+ * Build a packet of external mbufs pointing at the file pages backing
+ * [off, off + len).  Returns NULL if the range can't be mapped, if that
+ * would wire more than sendfile_maxwired, or if the read would not be
+ * authorized, in which case the caller falls back to copying through
+ * fo_read(), which reports the latter.
+ */
+static struct mbuf *
+sendfile_map(vfs_context_t ctx, struct vnode *vp, off_t off, off_t len)
+{
+	memory_object_control_t control;
+	vm_map_offset_t addr = 0;
+	vm_object_offset_t start;
+	vm_map_size_t size;
+	kern_return_t kr;
+
+	start = trunc_page_64(off);
+	size = round_page_64(off + len) - start;
+
+	if (OSAddAtomic((SInt32)size, &sendfile_wired) + (SInt32)size >
+	    sendfile_maxwired)
+		goto unaccount;
+
+	if (vnode_getwithref(vp) != 0)
+		goto unaccount;
+#if CONFIG_MACF
+	/* The same check vn_read() makes */
+	if (mac_vnode_check_read(ctx, vfs_context_ucred(ctx), vp) != 0)
+		goto put;
+#else
+#pragma unused(ctx)
+#endif /* CONFIG_MACF */
+	control = ubc_getobject(vp, UBC_FLAGS_NONE);
+	if (control == MEMORY_OBJECT_CONTROL_NULL)
+		goto put;
+	/* Keep the file in use for as long as its pages are mapped */
+	if (vnode_ref(vp) != 0)
+		goto put;
+
+	kr = vm_map_enter_mem_object_control(kernel_map, &addr, size, 0,
+	    VM_FLAGS_ANYWHERE, control, start, FALSE, VM_PROT_READ,
+	    VM_PROT_READ, VM_INHERIT_NONE);
+	if (kr != KERN_SUCCESS)
+		goto rele;
+
+	/* Fault the pages in and keep them resident while in flight */
+	kr = vm_map_wire(kernel_map, addr, addr + size, VM_PROT_READ, FALSE);
+	if (kr != KERN_SUCCESS) {
+		(void) vm_map_remove(kernel_map, addr, addr + size,
+		    VM_MAP_NO_FLAGS);
+		goto rele;
+	}
+	vnode_put(vp);
+
+	return (sf_map_attach(addr, size, (size_t)(off & PAGE_MASK_64),
+	    (size_t)len, 0, vp));
+
+rele:
+	vnode_rele(vp);
+put:
+	vnode_put(vp);
+unaccount:
+	OSAddAtomic(-(SInt32)size, &sendfile_wired);
+	return (NULL);
+}
+
+/*
+ * Build a packet of external mbufs holding the next len bytes of the
+ * current iovec of a user space uio, and advance the uio past them.
+ * The user pages are copied on write into the kernel map rather than
+ * into mbuf clusters, so the sender may reuse its buffer as soon as
+ * this returns while the data itself is copied at most once, by
+ * whoever consumes the mbufs.  The mapping is left pageable, so it
+ * must only be consumed in thread context; in exchange soreceive()
+ * can map it on into the reader (see sf_map_uiomove()).  Returns NULL,
+ * with the uio untouched, if the range can't be mapped or if that would
+ * keep more than singlecopy_maxmapped bytes mapped.
+ */
+struct mbuf *
+sf_map_uio(struct uio *uio, size_t len)
+{
+	vm_map_copy_t copy;
+	vm_map_address_t addr;
+	vm_map_offset_t start;
+	vm_map_size_t size;
+	user_addr_t uaddr;
+	struct mbuf *m;
+	kern_return_t kr;
+
+	VERIFY(uio_isuserspace(uio));
+	VERIFY(len > 0 && len <= uio_curriovlen(uio));
+
+	uaddr = uio_curriovbase(uio);
+	start = vm_map_trunc_page(uaddr, PAGE_MASK);
+	size = vm_map_round_page(uaddr + len, PAGE_MASK) - start;
+
+	if (OSAddAtomic((SInt32)size, &singlecopy_mapped) + (SInt32)size >
+	    singlecopy_maxmapped)
+		goto unaccount;
+
+	kr = vm_map_copyin(current_map(), start, size, FALSE, &copy);
+	if (kr != KERN_SUCCESS)
+		goto unaccount;
+	kr = vm_map_copyout(kernel_map, &addr, copy);
+	if (kr != KERN_SUCCESS) {
+		vm_map_copy_discard(copy);
+		goto unaccount;
+	}
+
+	m = sf_map_attach(addr, size, (size_t)(uaddr & PAGE_MASK), len,
+	    SFM_PAGEABLE, NULL);
+	if (m != NULL)
+		uio_update(uio, len);
+
+	return (m);
+
+unaccount:
+	OSAddAtomic(-(SInt32)size, &singlecopy_mapped);
+	return (NULL);
+}
+
+/*
+ * Receive side of sf_map_uio(): copy [off, off + len) of m out to a
+ * user space uio, except that where the data and the destination sit
+ * at the same offset within a page, runs of at least minmap bytes of
+ * whole pages are mapped copy on write over the destination, with a
+ * single copyin for each run, rather than copied.  len may extend past
+ * m into the mbufs that follow it in the same mapping; see sf_map_run().
+ * Only pageable mappings qualify; other mbufs, shorter runs and the
+ * partial pages at either end are copied.  Sets *mapped to the number
+ * of bytes mapped.
+ */
+int
+sf_map_uiomove(struct mbuf *m, int off, int len, struct uio *uio,
+    int minmap, int *mapped)
+{
+	vm_map_copy_t copy;
+	vm_map_offset_t kaddr;
+	user_addr_t uaddr;
+	user_size_t n;
+	int error = 0;
+
+	*mapped = 0;
+	if (!(m->m_flags & M_EXT) || m->m_ext.ext_free != sf_map_free ||
+	    !(((struct sf_map *)(void *)m->m_ext.ext_arg)->sfm_flags &
+	    SFM_PAGEABLE) || !uio_isuserspace(uio))
+		return (uiomove(mtod(m, caddr_t) + off, len, uio));
+
+	while (len > 0) {
+		kaddr = (vm_map_offset_t)(uintptr_t)(mtod(m, caddr_t) + off);
+		uaddr = uio_curriovbase(uio);
+		n = MIN((user_size_t)len, uio_curriovlen(uio));
+
+		if (n >= (user_size_t)MAX(minmap, (int)PAGE_SIZE) &&
+		    (kaddr & PAGE_MASK) == 0 && (uaddr & PAGE_MASK) == 0) {
+			n = trunc_page_64(n);
+			if (vm_map_copyin(kernel_map, kaddr, n, FALSE,
+			    &copy) != KERN_SUCCESS)
+				break;
+			if (vm_map_copy_overwrite(current_map(), uaddr, copy,
+			    FALSE) != KERN_SUCCESS) {
+				vm_map_copy_discard(copy);
+				break;
+			}
+			uio_update(uio, n);
+			*mapped += n;
+		} else {
+			/*
+			 * Copy up to the page boundary where both line up,
+			 * unless the run is already there and just too short.
+			 */
+			if (n == 0 || ((kaddr ^ uaddr) & PAGE_MASK) != 0 ||
+			    (kaddr & PAGE_MASK) == 0)
+				break;
+			n = MIN(n, PAGE_SIZE - (kaddr & PAGE_MASK));
+			error = uiomove((caddr_t)(uintptr_t)kaddr, (int)n, uio);
+			if (error != 0)
+				return (error);
+		}
+		off += n;
+		len -= n;
+	}
+
+	/* Whatever can't be mapped is copied */
+	if (len > 0)
+		error = uiomove(mtod(m, caddr_t) + off, len, uio);
+
+	return (error);
+}
+
+/*
+ * Return the number of bytes, starting with m's data, that sit back to
+ * back in the same pageable mapping, following m_next; sf_map_attach()
+ * gives each page its own mbuf, so this lets sf_map_uiomove() take the
+ * whole run at once.  Sets *next to the first mbuf past the run.  For
+ * any other mbuf, that's just m_len and m_next.
+ */
+int
+sf_map_run(struct mbuf *m, struct mbuf **next)
+{
+	caddr_t arg;
+	int len = m->m_len;
+
+	if ((m->m_flags & M_EXT) && m->m_ext.ext_free == sf_map_free &&
+	    (((struct sf_map *)(void *)m->m_ext.ext_arg)->sfm_flags &
+	    SFM_PAGEABLE)) {
+		arg = m->m_ext.ext_arg;
+		while (m->m_next != NULL &&
+		    (m->m_next->m_flags & M_EXT) &&
+		    m->m_next->m_ext.ext_free == sf_map_free &&
+		    m->m_next->m_ext.ext_arg == arg &&
+		    mtod(m->m_next, caddr_t) == mtod(m, caddr_t) + m->m_len) {
+			m = m->m_next;
+			len += m->m_len;
+		}
+	}
+	*next = m->m_next;
+
+	return (len);
+}
+
+/*
+ * Start an asynchronous read of the range following the one being sent,
+ * so that it is resident by the time we get around to it.
+ */
+static void
+sendfile_prefetch(struct vnode *vp, off_t file_size, off_t off, off_t resid)
+{
+	if (!sendfile_prefetch_enable || off >= file_size)
+		return;
+
+	resid = MIN(resid, file_size - off);
+	resid = MIN(resid, SENDFILE_MAX_BYTES);
+	if (resid > 0)
+		(void) advisory_read(vp, file_size, off, (int)resid);
+}
+
+/*
+ * Copy the headers or trailers described by a user iovec array into a
+ * packet, so they can be sent along with the file data.  Leaves *mp NULL
+ * but sets *lenp if there is more than fits in a single send, in which
+ * case the caller writes them out separately.
+ */
+static int
+sendfile_hdtr(struct proc *p, user_addr_t iovp, int iovcnt,
+    struct mbuf **mp, user_ssize_t *lenp)
+{
+	int spacetype = IS_64BIT_PROCESS(p) ? UIO_USERSPACE64 : UIO_USERSPACE32;
+	struct user_iovec *iov;
+	struct mbuf *m0 = NULL, *m;
+	uio_t auio;
+	user_ssize_t len;
+	int error;
+
+	*mp = NULL;
+	*lenp = 0;
+
+	if (iovcnt <= 0 || iovcnt > UIO_MAXIOV)
+		return (EINVAL);
+
+	auio = uio_create(iovcnt, 0, spacetype, UIO_WRITE);
+	if (auio == NULL)
+		return (ENOMEM);
+	if ((iov = uio_iovsaddr(auio)) == NULL) {
+		error = ENOMEM;
+		goto done;
+	}
+	error = copyin_user_iovec_array(iovp, spacetype, iovcnt, iov);
+	if (error != 0)
+		goto done;
+	error = uio_calculateresid(auio);
+	if (error != 0)
+		goto done;
+
+	*lenp = len = uio_resid(auio);
+	if (len == 0 || len > SENDFILE_MAX_BYTES)
+		goto done;
+
+	error = mbuf_allocpacket(MBUF_WAITOK, (size_t)len, NULL, &m0);
+	if (error != 0)
+		goto done;
+	for (m = m0; m != NULL && uio_resid(auio) > 0; m = m->m_next) {
+		size_t mlen = MIN(mbuf_maxlen(m), (size_t)uio_resid(auio));
+
+		error = uiomove(mtod(m, caddr_t), (int)mlen, auio);
+		if (error != 0) {
+			m_freem(m0);
+			goto done;
+		}
+		m->m_len = mlen;
+	}
+	m0->m_pkthdr.len = len;
+	*mp = m0;
+done:
+	uio_free(auio);
+	return (error);
+}
+
+/*
+ * Append packet n to packet m.
+ */
+static void
+sendfile_cat(struct mbuf *m, struct mbuf *n)
+{
+	m->m_pkthdr.len += n->m_pkthdr.len;
+	n->m_flags &= ~M_PKTHDR;
+	m_last(m)->m_next = n;
+}
+
+/*
+ * Wait for room in the send buffer and hand a packet to the protocol.
+ * Called with the socket locked and the send buffer held; the packet is
+ * consumed in all cases.
+ */
+static int
+sendfile_send(struct socket *so, struct proc *p, int s, struct mbuf *m0)
+{
+	struct mbuf *control = NULL;
+	int error;
+
+retry_space:
+	/*
+	 * Make sure that the socket is still able to take more data.
+	 * CANTSENDMORE being true usually means that the connection
+	 * was closed. so_error is true when an error was sensed after
+	 * a previous send.
+	 * The state is checked after the page mapping and buffer
+	 * allocation done by the caller since those operations may block
+	 * and make any socket checks stale. From this point forward,
+	 * nothing blocks before the pru_send (or more accurately, any
+	 * blocking results in a loop back to here to re-check).
+	 */
+	if ((so->so_state & SS_CANTSENDMORE) || so->so_error) {
+		if (so->so_state & SS_CANTSENDMORE) {
+			error = EPIPE;
+		} else {
+			error = so->so_error;
+			so->so_error = 0;
+		}
+		m_freem(m0);
+		return (error);
+	}
+	/*
+	 * Wait for socket space to become available. We do this just
+	 * after checking the connection state above in order to avoid
+	 * a race condition with sbwait().
+	 */
+	if (sbspace(&so->so_snd) < (long)so->so_snd.sb_lowat) {
+		if (so->so_state & SS_NBIO) {
+			m_freem(m0);
+			return (EAGAIN);
+		}
+		KERNEL_DEBUG_CONSTANT((DBG_FNC_SENDFILE_WAIT |
+		    DBG_FUNC_START), s, 0, 0, 0, 0);
+		error = sbwait(&so->so_snd);
+		KERNEL_DEBUG_CONSTANT((DBG_FNC_SENDFILE_WAIT|
+		    DBG_FUNC_END), s, 0, 0, 0, 0);
+		/*
+		 * An error from sbwait usually indicates that we've
+		 * been interrupted by a signal. If we've sent anything
+		 * then return bytes sent, otherwise return the error.
+		 */
+		if (error) {
+			m_freem(m0);
+			return (error);
+		}
+		goto retry_space;
+	}
+
+	/*
+	 * Socket filter processing
+	 */
+	error = sflt_data_out(so, NULL, &m0, &control, 0);
+	if (error) {
+		if (error == EJUSTRETURN)
+			error = 0;
+		return (error);
+	}
+
+	KERNEL_DEBUG_CONSTANT((DBG_FNC_SENDFILE_SEND | DBG_FUNC_START),
+	    s, 0, 0, 0, 0);
+	error = (*so->so_proto->pr_usrreqs->pru_send)(so, 0, m0,
+	    0, control, p);
+	KERNEL_DEBUG_CONSTANT((DBG_FNC_SENDFILE_SEND | DBG_FUNC_END),
+	    s, 0, 0, 0, 0);
+
+	return (error);
+}
+
 /*
  * sendfile(2).
  * int sendfile(int fd, int s, off_t offset, off_t *nbytes,
@@ -2867,6 +3503,8 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 	struct user64_sf_hdtr user64_hdtr;
 	off_t off, xfsize;
 	off_t nbytes = 0, sbytes = 0;
+	struct mbuf *hdr = NULL, *trl = NULL;
+	user_ssize_t hdrlen = 0, trllen = 0;
 	int error = 0;
 	size_t sizeof_hdtr;
 	off_t file_size;
@@ -2977,9 +3615,32 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 		}
 
 		/*
-		 * Send any headers. Wimp out and use writev(2).
+		 * Pick up any headers and trailers; unless they are unusually
+		 * large they go out in the same packets as the first and last
+		 * ranges of file data, rather than as separate writes.
 		 */
 		if (user_hdtr.headers != USER_ADDR_NULL) {
+			error = sendfile_hdtr(p, user_hdtr.headers,
+			    user_hdtr.hdr_cnt, &hdr, &hdrlen);
+			if (error) {
+				ENXIO_10146739_DBG("%s: sendfile_hdtr error. %s");
+				goto done2;
+			}
+		}
+		if (user_hdtr.trailers != USER_ADDR_NULL) {
+			error = sendfile_hdtr(p, user_hdtr.trailers,
+			    user_hdtr.trl_cnt, &trl, &trllen);
+			if (error) {
+				ENXIO_10146739_DBG("%s: sendfile_hdtr error. %s");
+				goto done2;
+			}
+		}
+
+		/*
+		 * Send any headers too large to coalesce. Wimp out and use
+		 * writev(2).
+		 */
+		if (hdrlen > SENDFILE_MAX_BYTES) {
 			bzero(&nuap, sizeof (struct writev_args));
 			nuap.fd = uap->s;
 			nuap.iovp = user_hdtr.headers;
@@ -3004,9 +3665,9 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 	}
 
 	/*
-	 * Simply read file data into a chain of mbufs that used with scatter
-	 * gather reads. We're not (yet?) setup to use zero copy external
-	 * mbufs that point to the file pages.
+	 * Hand the file pages to the socket as external mbufs when we can;
+	 * otherwise read file data into a chain of mbufs that used with
+	 * scatter gather reads.
 	 */
 	socket_lock(so, 1);
 	error = sblock(&so->so_snd, SBL_WAIT);
@@ -3020,8 +3681,8 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 		uio_t	auio;
 		char	uio_buf[UIO_SIZEOF(SFUIOBUFS)]; /* 1 KB !!! */
 		size_t	uiolen;
-		user_ssize_t	rlen;
-		off_t	pgoff;
+		user_ssize_t	rlen, hdrsent = 0, trlsent = 0;
+		off_t	pgoff, hdrpend;
 		size_t	pktlen;
 		boolean_t jumbocl;
 
@@ -3052,8 +3713,9 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 		pgoff = off & PAGE_MASK_64;
 		if (pgoff > 0 && PAGE_SIZE - pgoff < xfsize)
 			xfsize = PAGE_SIZE_64 - pgoff;
-		if (nbytes && xfsize > (nbytes - sbytes))
-			xfsize = nbytes - sbytes;
+		hdrpend = (hdr != NULL) ? hdrlen : 0;
+		if (nbytes && xfsize > (nbytes - sbytes - hdrpend))
+			xfsize = nbytes - sbytes - hdrpend;
 		if (xfsize <= 0)
 			break;
 		if (off + xfsize > file_size)
@@ -3061,6 +3723,16 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 		if (xfsize <= 0)
 			break;
 
+		socket_unlock(so, 0);
+		if (sendfile_zerocopy && so->so_filt == NULL &&
+		    (m0 = sendfile_map(&context, vp, off, xfsize)) != NULL) {
+			sendfile_prefetch(vp, file_size, off + xfsize,
+			    nbytes ? nbytes - sbytes - hdrpend - xfsize :
+			    SENDFILE_MAX_BYTES);
+			socket_lock(so, 0);
+			goto mapped;
+		}
+
 		/*
 		 * Attempt to use larger than system page-size clusters for
 		 * large writes only if there is a jumbo cluster pool and
@@ -3069,7 +3741,6 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 		jumbocl = sosendjcl && njcl > 0 &&
 		    ((so->so_flags & SOF_MULTIPAGES) || sosendjcl_ignore_capab);
 
-		socket_unlock(so, 0);
 		alloc_sendpkt(M_WAIT, xfsize, &nbufs, &m0, jumbocl);
 		pktlen = mbuf_pkthdr_maxlen(m0);
 		if (pktlen < (size_t)xfsize)
@@ -3107,6 +3778,11 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 		    uap->s, (unsigned int)((xfsize >> 32) & 0x0ffffffff),
 		    (unsigned int)(xfsize & 0x0ffffffff), 0, 0);
 		error = fo_read(fp, auio, FOF_OFFSET, &context);
+		if (error == 0) {
+			sendfile_prefetch(vp, file_size, off + xfsize,
+			    nbytes ? nbytes - sbytes - hdrpend - xfsize :
+			    SENDFILE_MAX_BYTES);
+		}
 		socket_lock(so, 0);
 		if (error != 0) {
 			if (uio_resid(auio) != xfsize && (error == ERESTART ||
@@ -3125,6 +3801,7 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 
 		if (xfsize == 0) {
 			//printf("sendfile: fo_read 0 bytes, EOF\n");
+			mbuf_freem(m0);
 			break;
 		}
 		if (xfsize + off > file_size)
@@ -3143,93 +3820,66 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 		}
 		mbuf_pkthdr_setlen(m0, xfsize);
 
-retry_space:
+mapped:
 		/*
-		 * Make sure that the socket is still able to take more data.
-		 * CANTSENDMORE being true usually means that the connection
-		 * was closed. so_error is true when an error was sensed after
-		 * a previous send.
-		 * The state is checked after the page mapping and buffer
-		 * allocation above since those operations may block and make
-		 * any socket checks stale. From this point forward, nothing
-		 * blocks before the pru_send (or more accurately, any blocking
-		 * results in a loop back to here to re-check).
+		 * Put the headers in front of the first range, and the
+		 * trailers behind the last one.
 		 */
-		if ((so->so_state & SS_CANTSENDMORE) || so->so_error) {
-			if (so->so_state & SS_CANTSENDMORE) {
-				error = EPIPE;
-			} else {
-				error = so->so_error;
-				so->so_error = 0;
-			}
-			m_freem(m0);
-			ENXIO_10146739_DBG("%s: Unexpected socket error. %s");
-			goto done3;
+		if (hdr != NULL) {
+			sendfile_cat(hdr, m0);
+			m0 = hdr;
+			hdr = NULL;
+			hdrsent = hdrlen;
 		}
-		/*
-		 * Wait for socket space to become available. We do this just
-		 * after checking the connection state above in order to avoid
-		 * a race condition with sbwait().
-		 */
-		if (sbspace(&so->so_snd) < (long)so->so_snd.sb_lowat) {
-			if (so->so_state & SS_NBIO) {
-				m_freem(m0);
-				error = EAGAIN;
-				goto done3;
-			}
-			KERNEL_DEBUG_CONSTANT((DBG_FNC_SENDFILE_WAIT |
-			    DBG_FUNC_START), uap->s, 0, 0, 0, 0);
-			error = sbwait(&so->so_snd);
-			KERNEL_DEBUG_CONSTANT((DBG_FNC_SENDFILE_WAIT|
-			    DBG_FUNC_END), uap->s, 0, 0, 0, 0);
-			/*
-			 * An error from sbwait usually indicates that we've
-			 * been interrupted by a signal. If we've sent anything
-			 * then return bytes sent, otherwise return the error.
-			 */
-			if (error) {
-				m_freem(m0);
-				goto done3;
-			}
-			goto retry_space;
+		if (trl != NULL && (off + xfsize >= file_size ||
+		    (nbytes && sbytes + hdrsent + xfsize >= nbytes))) {
+			sendfile_cat(m0, trl);
+			trl = NULL;
+			trlsent = trllen;
 		}
 
-		struct mbuf *control = NULL;
-		{
-			/*
-			 * Socket filter processing
-			 */
+		error = sendfile_send(so, p, uap->s, m0);
+		if (error) {
+			ENXIO_10146739_DBG("%s: sendfile_send error. %s");
+			goto done3;
+		}
+		sbytes += hdrsent + trlsent;
+	}
 
-			error = sflt_data_out(so, NULL, &m0, &control, 0);
-			if (error) {
-				if (error == EJUSTRETURN) {
-					error = 0;
-					continue;
-				}
-				ENXIO_10146739_DBG("%s: sflt_data_out error. %s");
-				goto done3;
+	/*
+	 * Whatever headers and trailers didn't ride along with file data
+	 * (e.g. there was no data left to send) go out on their own.
+	 */
+	if (hdr != NULL || trl != NULL) {
+		mbuf_t m0;
+		user_ssize_t len;
+
+		if (hdr != NULL) {
+			m0 = hdr;
+			len = hdrlen;
+			if (trl != NULL) {
+				sendfile_cat(m0, trl);
+				len += trllen;
 			}
-			/*
-			 * End Socket filter processing
-			 */
+		} else {
+			m0 = trl;
+			len = trllen;
 		}
-		KERNEL_DEBUG_CONSTANT((DBG_FNC_SENDFILE_SEND | DBG_FUNC_START),
-		    uap->s, 0, 0, 0, 0);
-		error = (*so->so_proto->pr_usrreqs->pru_send)(so, 0, m0,
-		    0, control, p);
-		KERNEL_DEBUG_CONSTANT((DBG_FNC_SENDFILE_SEND | DBG_FUNC_START),
-		    uap->s, 0, 0, 0, 0);
+		hdr = trl = NULL;
+
+		error = sendfile_send(so, p, uap->s, m0);
 		if (error) {
-			ENXIO_10146739_DBG("%s: pru_send error. %s");
+			ENXIO_10146739_DBG("%s: sendfile_send error. %s");
 			goto done3;
 		}
+		sbytes += len;
 	}
 	sbunlock(&so->so_snd, FALSE);	/* will unlock socket */
 	/*
-	 * Send trailers. Wimp out and use writev(2).
+	 * Send any trailers too large to coalesce. Wimp out and use
+	 * writev(2).
 	 */
-	if (uap->hdtr != USER_ADDR_NULL &&
-	    user_hdtr.trailers != USER_ADDR_NULL) {
+	if (trllen > SENDFILE_MAX_BYTES) {
 		bzero(&nuap, sizeof (struct writev_args));
 		nuap.fd = uap->s;
 		nuap.iovp = user_hdtr.trailers;
@@ -3242,6 +3892,10 @@ retry_space:
 		sbytes += writev_retval;
 	}
 done2:
+	if (hdr != NULL)
+		m_freem(hdr);
+	if (trl != NULL)
+		m_freem(trl);
 	file_drop(uap->s);
 done1:
 	file_drop(uap->fd);
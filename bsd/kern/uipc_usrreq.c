@@ -132,6 +132,17 @@ static	struct unp_head unp_shead, unp_dhead;
 
 static int unpst_tracemdns;	/* enable tracing */
 
+/*
+ * LOCAL_SINGLECOPY tunables.  sosend() hands unp_sosend_map() at most
+ * sbspace(&so->so_snd) bytes at a time, and the default PIPSIZ send
+ * buffer would keep every chunk below the point where remapping beats
+ * copying; setting the option therefore grows the send buffer to
+ * unpst_singlecopy_space, so that several chunks of singlecopy_min
+ * bytes or more fit.
+ */
+static int unpst_singlecopy_min = 32 * 1024;	/* smallest chunk mapped */
+static u_int32_t unpst_singlecopy_space = 256 * 1024;
+
 #define	MDNS_IPC_MSG_HDR_VERSION_1	1
 
 struct mdns_ipc_msg_hdr {
@@ -764,6 +775,34 @@ uipc_ctloutput(struct socket *so, struct sockopt *sopt)
 		}
 		break;
 	case SOPT_SET:
+		switch (sopt->sopt_name) {
+		case LOCAL_SINGLECOPY: {
+			int optval;
+
+			if (so->so_type != SOCK_STREAM) {
+				error = EOPNOTSUPP;
+				break;
+			}
+			error = sooptcopyin(sopt, &optval, sizeof (optval),
+			    sizeof (optval));
+			if (error != 0)
+				break;
+			if (optval) {
+				unp->unp_flags |= UNP_SINGLECOPY;
+				/* Best effort; small chunks get copied anyway */
+				if (so->so_snd.sb_hiwat < unpst_singlecopy_space)
+					(void) sbreserve(&so->so_snd,
+					    unpst_singlecopy_space);
+			} else {
+				unp->unp_flags &= ~UNP_SINGLECOPY;
+			}
+			break;
+		}
+		default:
+			error = EOPNOTSUPP;
+			break;
+		}
+		break;
 	default:
 		error = EOPNOTSUPP;
 		break;
@@ -772,6 +811,45 @@ uipc_ctloutput(struct socket *so, struct sockopt *sopt)
 	return (error);
 }
 
+/*
+ * Called by sosend() with the socket unlocked, before it copies the
+ * next len bytes of uio into mbufs; len is bounded by the room left
+ * in the send buffer.  On a stream socket marked with LOCAL_SINGLECOPY,
+ * a chunk of at least unpst_singlecopy_min bytes from user space is
+ * instead mapped into external mbufs that get appended to the peer's
+ * receive buffer as usual, so the only copy of the data is the one
+ * soreceive() makes into the receiver's buffer.  The mbufs are charged
+ * to the socket buffers like any other, and the mappings behind them
+ * are capped globally by kern.ipc.singlecopy_maxmapped.  Returns NULL
+ * if the chunk doesn't qualify or can't be mapped, in which case the
+ * caller copies it.
+ */
+struct mbuf *
+unp_sosend_map(struct socket *so, struct uio *uio, int len)
+{
+#if SENDFILE
+	struct unpcb *unp = sotounpcb(so);
+	user_size_t iovlen;
+
+	/* Filters may want to modify the data, which is read-only here */
+	if (so->so_type != SOCK_STREAM || unp == NULL ||
+	    !(unp->unp_flags & UNP_SINGLECOPY) || so->so_filt != NULL ||
+	    !uio_isuserspace(uio))
+		return (NULL);
+
+	iovlen = uio_curriovlen(uio);
+	if (iovlen < (user_size_t)len)
+		len = (int)iovlen;
+	if (len <= 0 || len < unpst_singlecopy_min)
+		return (NULL);
+
+	return (sf_map_uio(uio, (size_t)len));
+#else /* !SENDFILE */
+#pragma unused(so, uio, len)
+	return (NULL);
+#endif /* !SENDFILE */
+}
+
 /*
  * Both send and receive buffers are allocated PIPSIZ bytes of buffering
  * for stream sockets, although the total for sender and receiver is
@@ -798,6 +876,12 @@ SYSCTL_INT(_net_local_stream, OID_AUTO, recvspace, CTLFLAG_RW | CTLFLAG_LOCKED,
    &unpst_recvspace, 0, "");
 SYSCTL_INT(_net_local_stream, OID_AUTO, tracemdns, CTLFLAG_RW | CTLFLAG_LOCKED,
    &unpst_tracemdns, 0, "");
+SYSCTL_INT(_net_local_stream, OID_AUTO, singlecopy_min,
+   CTLFLAG_RW | CTLFLAG_LOCKED, &unpst_singlecopy_min, 0,
+   "Smallest chunk mapped rather than copied on LOCAL_SINGLECOPY sockets");
+SYSCTL_UINT(_net_local_stream, OID_AUTO, singlecopy_space,
+   CTLFLAG_RW | CTLFLAG_LOCKED, &unpst_singlecopy_space, 0,
+   "Send buffer size given to LOCAL_SINGLECOPY sockets");
 SYSCTL_DECL(_net_local_dgram);
 SYSCTL_INT(_net_local_dgram, OID_AUTO, maxdgram, CTLFLAG_RW | CTLFLAG_LOCKED,
    &unpdg_sendspace, 0, "");
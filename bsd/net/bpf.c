@@ -127,6 +127,13 @@
 #include <kern/locks.h>
 #include <kern/thread_call.h>
 
+#include <mach/vm_map.h>
+#include <mach/mach_vm.h>
+#include <vm/vm_kern.h>
+#include <vm/vm_map.h>
+#include <vm/vm_protos.h>
+#include <libkern/OSAtomic.h>
+
 #if CONFIG_MACF_NET
 #include <security/mac_framework.h>
 #endif /* MAC_NET */
@@ -151,6 +158,30 @@ SYSCTL_INT(_debug, OID_AUTO, bpf_maxbufsize, CTLFLAG_RW | CTLFLAG_LOCKED,
 static unsigned int bpf_maxdevices = 256;
 SYSCTL_UINT(_debug, OID_AUTO, bpf_maxdevices, CTLFLAG_RW | CTLFLAG_LOCKED,
 	&bpf_maxdevices, 0, "");
+/*
+ * bpf_maxringblocks limits the number of blocks in a capture ring
+ * set up with BIOCSRING; each block is at most bpf_maxbufsize bytes.
+ */
+static unsigned int bpf_maxringblocks = 64;
+SYSCTL_UINT(_debug, OID_AUTO, bpf_maxringblocks, CTLFLAG_RW | CTLFLAG_LOCKED,
+	&bpf_maxringblocks, 0, "");
+/*
+ * bpf_maxringmem limits the wired memory held by all capture rings
+ * together; bpf_ringmem is the amount currently held.
+ */
+static unsigned int bpf_maxringmem = 64 * 1024 * 1024;
+SYSCTL_UINT(_debug, OID_AUTO, bpf_maxringmem, CTLFLAG_RW | CTLFLAG_LOCKED,
+	&bpf_maxringmem, 0, "");
+static unsigned int bpf_ringmem = 0;
+SYSCTL_UINT(_debug, OID_AUTO, bpf_ringmem, CTLFLAG_RD | CTLFLAG_LOCKED,
+	&bpf_ringmem, 0, "");
+/*
+ * bpf_compile controls whether filters are compiled by bpf_compile()
+ * when they are set; otherwise bpf_filter() interprets them.
+ */
+static unsigned int bpf_compile_filters = 1;
+SYSCTL_UINT(_debug, OID_AUTO, bpf_compile, CTLFLAG_RW | CTLFLAG_LOCKED,
+	&bpf_compile_filters, 0, "");
 /*
  * bpf_wantpktap controls the defaul visibility of DLT_PKTAP
  * For OS X is off by default so process need to use the ioctl BPF_WANT_PKTAP
@@ -190,6 +221,11 @@ static mbuf_tag_id_t bpf_mtag_id;
 #endif /* __APPLE__ */
 
 static int	bpf_allocbufs(struct bpf_d *);
+static int	bpf_ring_alloc(struct bpf_d *, struct bpf_ring *);
+static void	bpf_ring_free(struct bpf_d *);
+static int	bpf_ring_ready(struct bpf_d *);
+static void	bpf_ring_rotate(struct bpf_d *);
+static int	bpf_ring_avail(struct bpf_d *);
 static errno_t	bpf_attachd(struct bpf_d *d, struct bpf_if *bp);
 static void	bpf_detachd(struct bpf_d *d);
 static void	bpf_freed(struct bpf_d *);
@@ -867,6 +903,14 @@ bpfread(dev_t dev, struct uio *uio, int ioflag)
 		return (ENXIO);
 	}
 
+	/*
+	 * Packets captured into a ring are only handed over through it.
+	 */
+	if (d->bd_ring != NULL) {
+		lck_mtx_unlock(bpf_mlock);
+		return (EOPNOTSUPP);
+	}
+
 	/*
 	 * Restrict application to use a buffer the same size as
 	 * as kernel buffers.
@@ -1143,8 +1187,12 @@ bpf_timed_out(void *arg, __unused void *dummy)
 		 * now stuff to read, wake it up.
 		 */
 		d->bd_state = BPF_TIMED_OUT;
-		if (d->bd_slen != 0)
+		if (d->bd_slen != 0) {
+			/* hand the partly filled ring block to the reader */
+			if (d->bd_ring != NULL)
+				bpf_ring_rotate(d);
 			bpf_wakeup(d);
+		}
 	} else if (d->bd_state == BPF_DRAINING) {
 		/*
 		 * A close is waiting for this to finish.
@@ -1282,6 +1330,8 @@ reset_d(struct bpf_d *d)
 	d->bd_hlen = 0;
 	d->bd_rcount = 0;
 	d->bd_dcount = 0;
+	d->bd_ringpkts = 0;
+	d->bd_ringdrops = 0;
 }
 
 /*
@@ -1306,6 +1356,7 @@ reset_d(struct bpf_d *d)
  *  BIOCSETTC		Set traffic class.
  *  BIOCGETTC		Get traffic class.
  *  BIOCSEXTHDR		Set "extended header" flag
+ *  BIOCSRING		Set up a capture ring shared with the reader.
  */
 /* ARGSUSED */
 int
@@ -1342,6 +1393,11 @@ bpfioctl(dev_t dev, u_long cmd, caddr_t addr, __unused int flags,
 		{
 			int n;
 
+			if (d->bd_ring != NULL) {
+				n = bpf_ring_avail(d);
+				bcopy(&n, addr, sizeof (n));
+				break;
+			}
 			n = d->bd_slen;
 			if (d->bd_hbuf && d->bd_hbuf_read == 0)
 				n += d->bd_hlen;
@@ -1374,7 +1430,7 @@ bpfioctl(dev_t dev, u_long cmd, caddr_t addr, __unused int flags,
 	 * Set buffer length.
 	 */
 	case BIOCSBLEN:			/* u_int */
-		if (d->bd_bif != 0)
+		if (d->bd_bif != 0 || d->bd_ring != NULL)
 			error = EINVAL;
 		else {
 			u_int size;
@@ -1733,6 +1789,24 @@ bpfioctl(dev_t dev, u_long cmd, caddr_t addr, __unused int flags,
                 else
                         d->bd_flags &= ~BPF_WANT_PKTAP;
 		break;
+
+	case BIOCSRING: {		/* struct bpf_ring */
+		struct bpf_ring br;
+
+		/*
+		 * The ring replaces the read buffers, so it has to be
+		 * set up before the descriptor is bound to an interface.
+		 */
+		if (d->bd_sbuf != NULL || d->bd_ring != NULL) {
+			error = EINVAL;
+			break;
+		}
+		bcopy(addr, &br, sizeof (br));
+		error = bpf_ring_alloc(d, &br);
+		if (error == 0)
+			bcopy(&br, addr, sizeof (br));
+		break;
+	}
 #endif
 	}
 
@@ -1749,6 +1823,7 @@ static int
 bpf_setf(struct bpf_d *d, u_int bf_len, user_addr_t bf_insns, dev_t dev, u_long cmd)
 {
 	struct bpf_insn *fcode, *old;
+	struct bpf_cprog *cold;
 	u_int flen, size;
 
 	while (d->bd_hbuf_read) 
@@ -1759,13 +1834,17 @@ bpf_setf(struct bpf_d *d, u_int bf_len, user_addr_t bf_insns, dev_t dev, u_long
 		return (ENXIO);
 	
 	old = d->bd_filter;
+	cold = d->bd_cfilter;
 	if (bf_insns == USER_ADDR_NULL) {
 		if (bf_len != 0)
 			return (EINVAL);
 		d->bd_filter = NULL;
+		d->bd_cfilter = NULL;
 		reset_d(d);
 		if (old != 0)
 			FREE((caddr_t)old, M_DEVBUF);
+		if (cold != NULL)
+			bpf_cfree(cold);
 		return (0);
 	}
 	flen = bf_len;
@@ -1781,12 +1860,17 @@ bpf_setf(struct bpf_d *d, u_int bf_len, user_addr_t bf_insns, dev_t dev, u_long
 	if (copyin(bf_insns, (caddr_t)fcode, size) == 0 &&
 	    bpf_validate(fcode, (int)flen)) {
 		d->bd_filter = fcode;
+		/* Without a compiled filter, bpf_filter() runs fcode */
+		d->bd_cfilter = bpf_compile_filters ?
+		    bpf_compile(fcode, (int)flen) : NULL;
 	
 		if (cmd == BIOCSETF32 || cmd == BIOCSETF64)
 			reset_d(d);
 	
 		if (old != 0)
 			FREE((caddr_t)old, M_DEVBUF);
+		if (cold != NULL)
+			bpf_cfree(cold);
 
 		return (0);
 	}
@@ -1833,7 +1917,7 @@ bpf_setif(struct bpf_d *d, ifnet_t theywant, u_int32_t dlt, dev_t dev)
 		 * If we're already attached to requested interface,
 		 * just flush the buffer.
 		 */
-		if (d->bd_sbuf == 0) {
+		if (d->bd_sbuf == 0 && d->bd_ring == NULL) {
 			error = bpf_allocbufs(d);
 			if (error != 0)
 				return (error);
@@ -2016,11 +2100,13 @@ bpfselect(dev_t dev, int which, void * wql, struct proc *p)
 
 	switch (which) {
 		case FREAD:
-			if (d->bd_hlen != 0 ||
+			if (d->bd_ring != NULL)
+				ret = (bpf_ring_avail(d) != 0);
+			else if (d->bd_hlen != 0 ||
 					((d->bd_immediate || d->bd_state == BPF_TIMED_OUT) &&
 					 d->bd_slen != 0))
 				ret = 1; /* read has data to return */
-			else {
+			if (ret == 0) {
 				/*
 				 * Read has no data to return.
 				 * Make the select wait, and start a timer if
@@ -2110,7 +2196,14 @@ filt_bpfread(struct knote *kn, long hint)
 	if (hint == 0)
 		lck_mtx_lock(bpf_mlock);
 	
-	if (d->bd_immediate) {
+	if (d->bd_ring != NULL) {
+		/*
+		 * The reader is ready once a block has been handed
+		 * over; kn_data is the length of the latest one.
+		 */
+		kn->kn_data = bpf_ring_avail(d);
+		ready = (kn->kn_data > 0);
+	} else if (d->bd_immediate) {
 		/*
 		 * If there's data in the hold buffer, it's the 
 		 * amount of data a read will return.
@@ -2258,7 +2351,12 @@ bpf_tap_imp(
 			if (outbound && !d->bd_seesent)
 				continue;
 			++d->bd_rcount;
-			slen = bpf_filter(d->bd_filter, (u_char *)m, pktlen, 0);
+			if (d->bd_cfilter != NULL)
+				slen = bpf_cfilter(d->bd_cfilter,
+				    (u_char *)m, pktlen, 0);
+			else
+				slen = bpf_filter(d->bd_filter,
+				    (u_char *)m, pktlen, 0);
 			if (slen != 0) {
 #if CONFIG_MACF_NET
 				if (mac_bpfdesc_check_receive(d, bp->bif_ifp) != 0)
@@ -2325,6 +2423,16 @@ catchpacket(struct bpf_d *d, u_char *pkt, struct mbuf *m, u_int pktlen,
 	struct m_tag *mt = NULL;
 	struct bpf_mtag *bt = NULL;
 
+	/*
+	 * With a capture ring, drop the packet if the reader hasn't
+	 * given back the block we are due to fill next.
+	 */
+	if (d->bd_ring != NULL && !bpf_ring_ready(d)) {
+		++d->bd_dcount;
+		++d->bd_ringdrops;
+		return;
+	}
+
 	hdrlen = (d->bd_flags & BPF_EXTENDED_HDR) ? d->bd_bif->bif_exthdrlen :
 	    d->bd_bif->bif_hdrlen;
 	/*
@@ -2347,15 +2455,24 @@ catchpacket(struct bpf_d *d, u_char *pkt, struct mbuf *m, u_int pktlen,
 		 * Rotate the buffers if we can, then wakeup any
 		 * pending reads.
 		 */
-		if (d->bd_fbuf == NULL) {
+		if (d->bd_ring != NULL) {
+			bpf_ring_rotate(d);
+			if (!bpf_ring_ready(d)) {
+				++d->bd_dcount;
+				++d->bd_ringdrops;
+				bpf_wakeup(d);
+				return;
+			}
+		} else if (d->bd_fbuf == NULL) {
 			/*
 			 * We haven't completed the previous read yet,
 			 * so drop the packet.
 			 */
 			++d->bd_dcount;
 			return;
+		} else {
+			ROTATE_BUFFERS(d);
 		}
-		ROTATE_BUFFERS(d);
 		do_wakeup = 1;
 		curlen = 0;
 	}
@@ -2392,8 +2509,13 @@ catchpacket(struct bpf_d *d, u_char *pkt, struct mbuf *m, u_int pktlen,
 				ehp->bh_flags |= BPF_HDR_EXT_FLAGS_DIR_IN;
 			m_tag_delete(m, mt);
 		} else if (outbound) {
-			/* only do lookups on non-raw INPCB */
-			if ((m->m_pkthdr.pkt_flags & (PKTF_FLOW_ID|
+			/*
+			 * only do lookups on non-raw INPCB; bpfread turns the
+			 * flow into a pid and clears it, which can't be done
+			 * for a ring, so leave it out there.
+			 */
+			if (d->bd_ring == NULL &&
+			    (m->m_pkthdr.pkt_flags & (PKTF_FLOW_ID|
 			    PKTF_FLOW_LOCALSRC|PKTF_FLOW_RAWSOCK)) ==
 			    (PKTF_FLOW_ID|PKTF_FLOW_LOCALSRC) &&
 			    m->m_pkthdr.pkt_flowsrc == FLOWSRC_INPCB) {
@@ -2421,6 +2543,17 @@ catchpacket(struct bpf_d *d, u_char *pkt, struct mbuf *m, u_int pktlen,
 	 */
 	(*cpfn)(pkt, payload, caplen);
 	d->bd_slen = curlen + totlen;
+	if (d->bd_ring != NULL) {
+		d->bd_ringpkts++;
+		/*
+		 * Where a read would rotate the buffers, hand the block
+		 * over now; the reader can't ask for it.
+		 */
+		if (d->bd_immediate || d->bd_state == BPF_TIMED_OUT) {
+			bpf_ring_rotate(d);
+			do_wakeup = 1;
+		}
+	}
 
 	if (do_wakeup)
 		bpf_wakeup(d);
@@ -2446,6 +2579,159 @@ bpf_allocbufs(struct bpf_d *d)
 	return (0);
 }
 
+#define	BPF_RING_BLOCK(d, i) \
+	((struct bpf_block_hdr *)(void *)((d)->bd_ring + \
+	    (size_t)(i) * (d)->bd_ringblksize))
+
+/*
+ * Set up a capture ring for BIOCSRING.  The blocks are allocated wired
+ * so catchpacket can fill them under bpf_mlock, and the same pages are
+ * mapped into the calling process.
+ */
+static int
+bpf_ring_alloc(struct bpf_d *d, struct bpf_ring *br)
+{
+	vm_offset_t kaddr;
+	vm_size_t size;
+	memory_object_size_t entry_size;
+	mach_vm_address_t uaddr = 0;
+	ipc_port_t entry = IPC_PORT_NULL;
+	u_int32_t blksize, nblocks;
+	kern_return_t kr;
+
+	blksize = MIN(br->br_blksize, bpf_maxbufsize);
+	blksize = MAX(round_page(blksize), PAGE_SIZE);
+	nblocks = MIN(br->br_nblocks, bpf_maxringblocks);
+	nblocks = MAX(nblocks, 2);
+	size = (vm_size_t)blksize * nblocks;
+
+	if (size > bpf_maxringmem - MIN(bpf_ringmem, bpf_maxringmem))
+		return (ENOBUFS);
+	if (kmem_alloc(kernel_map, &kaddr, size) != KERN_SUCCESS)
+		return (ENOMEM);
+	bzero((void *)kaddr, size);
+
+	entry_size = size;
+	kr = mach_make_memory_entry_64(kernel_map, &entry_size,
+	    (memory_object_offset_t)kaddr, VM_PROT_READ | VM_PROT_WRITE,
+	    &entry, IPC_PORT_NULL);
+	if (kr != KERN_SUCCESS)
+		goto fail;
+	kr = mach_vm_map(current_map(), &uaddr, size, 0, VM_FLAGS_ANYWHERE,
+	    entry, 0, FALSE, VM_PROT_READ | VM_PROT_WRITE,
+	    VM_PROT_READ | VM_PROT_WRITE, VM_INHERIT_NONE);
+	if (kr != KERN_SUCCESS)
+		goto fail;
+
+	bpf_ringmem += size;
+	d->bd_ring = (caddr_t)kaddr;
+	d->bd_ringentry = entry;
+	d->bd_ringblksize = blksize;
+	d->bd_ringblocks = nblocks;
+	d->bd_ringcur = 0;
+	d->bd_ringpkts = 0;
+	d->bd_ringdrops = 0;
+	d->bd_ringlast = 0;
+	d->bd_ringseq = 0;
+	d->bd_bufsize = blksize - BPF_RING_HDRLEN;
+	d->bd_sbuf = d->bd_ring + BPF_RING_HDRLEN;
+	d->bd_slen = 0;
+
+	br->br_blksize = blksize;
+	br->br_nblocks = nblocks;
+	br->br_addr = uaddr;
+	return (0);
+
+fail:
+	if (entry != IPC_PORT_NULL)
+		mach_memory_entry_port_release(entry);
+	kmem_free(kernel_map, kaddr, size);
+	return (ENOMEM);
+}
+
+/*
+ * Release the kernel's hold on the capture ring.  The reader's mapping
+ * keeps the pages around until it is unmapped.
+ */
+static void
+bpf_ring_free(struct bpf_d *d)
+{
+	vm_size_t size = (vm_size_t)d->bd_ringblksize * d->bd_ringblocks;
+
+	mach_memory_entry_port_release(d->bd_ringentry);
+	kmem_free(kernel_map, (vm_offset_t)d->bd_ring, size);
+	bpf_ringmem -= size;
+	d->bd_ring = NULL;
+	d->bd_ringentry = IPC_PORT_NULL;
+	d->bd_sbuf = NULL;
+}
+
+/*
+ * Make sure there is a ring block to store into.  Returns 0 if the
+ * reader hasn't given back the block that is due to be filled next.
+ * Only the status word is read from the shared block; everything the
+ * kernel relies on is kept in the descriptor.
+ */
+static int
+bpf_ring_ready(struct bpf_d *d)
+{
+	struct bpf_block_hdr *bh;
+
+	if (d->bd_sbuf != NULL)
+		return (1);
+	bh = BPF_RING_BLOCK(d, d->bd_ringcur);
+	if (bh->bbh_status != BPF_BLOCK_KERNEL)
+		return (0);
+	bh->bbh_len = 0;
+	bh->bbh_npkts = 0;
+	bh->bbh_drops = d->bd_ringdrops;
+	d->bd_ringdrops = 0;
+	d->bd_ringpkts = 0;
+	d->bd_sbuf = (caddr_t)bh + BPF_RING_HDRLEN;
+	d->bd_slen = 0;
+	return (1);
+}
+
+/*
+ * Hand the block being filled over to the reader and move on to the
+ * next one, which bpf_ring_ready claims once the reader gives it back.
+ */
+static void
+bpf_ring_rotate(struct bpf_d *d)
+{
+	struct bpf_block_hdr *bh;
+
+	bh = BPF_RING_BLOCK(d, d->bd_ringcur);
+	bh->bbh_len = d->bd_slen;
+	bh->bbh_npkts = d->bd_ringpkts;
+	bh->bbh_seq = d->bd_ringseq++;
+	/* the records and header must be visible before the status */
+	OSMemoryBarrier();
+	bh->bbh_status = BPF_BLOCK_USER;
+
+	d->bd_ringlast = d->bd_slen;
+	d->bd_ringcur = (d->bd_ringcur + 1) % d->bd_ringblocks;
+	d->bd_sbuf = NULL;
+	d->bd_slen = 0;
+	d->bd_ringpkts = 0;
+}
+
+/*
+ * Return the length of the last block handed over to the reader, or 0
+ * if the reader has already given it back.  This only looks; partly
+ * filled blocks are handed over by catchpacket and bpf_timed_out.
+ */
+static int
+bpf_ring_avail(struct bpf_d *d)
+{
+	u_int32_t prev;
+
+	prev = (d->bd_ringcur + d->bd_ringblocks - 1) % d->bd_ringblocks;
+	if (BPF_RING_BLOCK(d, prev)->bbh_status != BPF_BLOCK_USER)
+		return (0);
+	return (d->bd_ringlast);
+}
+
 /*
  * Free buffers currently in use by a descriptor.
  * Called on close.
@@ -2461,7 +2747,9 @@ bpf_freed(struct bpf_d *d)
 	if (d->bd_hbuf_read)
 		panic("bpf buffer freed during read");
 
-	if (d->bd_sbuf != 0) {
+	if (d->bd_ring != NULL) {
+		bpf_ring_free(d);
+	} else if (d->bd_sbuf != 0) {
 		FREE(d->bd_sbuf, M_DEVBUF);
 		if (d->bd_hbuf != 0) 
 			FREE(d->bd_hbuf, M_DEVBUF);
@@ -2470,6 +2758,8 @@ bpf_freed(struct bpf_d *d)
 	}
 	if (d->bd_filter)
 		FREE((caddr_t)d->bd_filter, M_DEVBUF);
+	if (d->bd_cfilter != NULL)
+		bpf_cfree(d->bd_cfilter);
 }
 
 /*
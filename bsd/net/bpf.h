@@ -209,6 +209,7 @@ struct bpf_version {
 #ifdef PRIVATE
 #define	BIOCGWANTPKTAP	_IOR('B', 127, u_int)
 #define	BIOCSWANTPKTAP	_IOWR('B', 127, u_int)
+#define	BIOCSRING	_IOWR('B', 128, struct bpf_ring)
 #endif /* PRIVATE */
 /*
  * Structure prepended to each packet.
@@ -260,6 +261,44 @@ struct bpf_mtag {
 #define	BPF_MTAG_DIR_IN		0
 #define	BPF_MTAG_DIR_OUT	1
 };
+
+/*
+ * Capture ring set up by BIOCSRING, in place of read().  The kernel
+ * allocates br_nblocks blocks of br_blksize bytes and maps them into
+ * the caller at br_addr.  Each block begins with a struct bpf_block_hdr
+ * and is followed, at BPF_RING_HDRLEN, by bbh_len bytes of packet
+ * records laid out exactly as read() returns them.
+ *
+ * The kernel fills the blocks in order.  When a block is full, or
+ * when a read would have returned it (immediate mode or read timeout),
+ * its status is set to BPF_BLOCK_USER and the descriptor becomes
+ * readable for select/kevent.  The reader consumes blocks in the same
+ * order and gives each one back by setting its status to
+ * BPF_BLOCK_KERNEL.  Packets that arrive while the reader owns the
+ * next block are dropped and counted in bbh_drops of the block that
+ * is eventually filled after them.
+ *
+ * The rings of all descriptors together are limited to
+ * debug.bpf_maxringmem bytes of wired memory; past that BIOCSRING
+ * fails with ENOBUFS.
+ */
+struct bpf_ring {
+	bpf_u_int32	br_blksize;	/* in/out: size of each block */
+	bpf_u_int32	br_nblocks;	/* in/out: number of blocks */
+	u_int64_t	br_addr;	/* out: address of the ring */
+};
+
+struct bpf_block_hdr {
+	volatile bpf_u_int32 bbh_status;	/* owner of the block */
+#define	BPF_BLOCK_KERNEL	0
+#define	BPF_BLOCK_USER		1
+	bpf_u_int32	bbh_len;	/* length of the packet records */
+	bpf_u_int32	bbh_npkts;	/* number of packet records */
+	bpf_u_int32	bbh_drops;	/* packets dropped before this block */
+	u_int64_t	bbh_seq;	/* sequence number of the block */
+};
+
+#define	BPF_RING_HDRLEN		BPF_WORDALIGN(sizeof (struct bpf_block_hdr))
 #endif /* PRIVATE */
 
 /*
@@ -1291,6 +1330,11 @@ extern int	bpf_validate(const struct bpf_insn *, int);
 extern void	bpfdetach(struct ifnet *);
 extern void	bpfilterattach(int);
 extern u_int	bpf_filter(const struct bpf_insn *, u_char *, u_int, u_int);
+
+struct bpf_cprog;
+extern struct bpf_cprog *bpf_compile(const struct bpf_insn *, int);
+extern u_int	bpf_cfilter(const struct bpf_cprog *, u_char *, u_int, u_int);
+extern void	bpf_cfree(struct bpf_cprog *);
 #endif /* KERNEL_PRIVATE */
 
 #ifdef KERNEL
@@ -69,6 +69,9 @@
 
 #include <sys/param.h>
 #include <string.h>
+#ifndef KERNEL
+#include <stdlib.h>
+#endif
 
 #ifdef sun
 #include <netinet/in.h>
@@ -659,3 +662,623 @@ bpf_validate(const struct bpf_insn *f, int len)
 		return BPF_CLASS(f[len - 1].code) == BPF_RET;
 }
 #endif
+
+/*
+ * Compiled filter programs.
+ *
+ * bpf_compile() translates a validated program into a form that is
+ * cheaper to run than the instruction stream bpf_filter() interprets:
+ *
+ *   - opcodes are renumbered densely, and combinations bpf_filter()
+ *     rejects at run time are turned into "return 0" up front;
+ *   - jump offsets become absolute instruction indexes, and jumps to
+ *     unconditional jumps are threaded through to their final target;
+ *   - a packet load followed by a "jeq #k" is fused into a single
+ *     instruction, the pattern tcpdump generates for every protocol
+ *     and port test;
+ *   - the scratch memory is only cleared for programs that read it.
+ *
+ * bpf_cfilter() runs a compiled program.  When it is handed an mbuf
+ * chain, loads that fall within the first mbuf read it directly instead
+ * of walking the chain, which covers the headers of nearly all packets.
+ * The results are identical to bpf_filter() on the same program and
+ * packet, including its handling of loads past the end of the packet.
+ *
+ * The kernel has no facility for generating executable code at run
+ * time, so programs are compiled to this pre-decoded form rather than
+ * to native instructions.
+ *
+ * Like bpf_filter(), the compiler and bpf_cfilter() also build outside
+ * the kernel, where only contiguous buffers are supported, so that they
+ * can be checked against bpf_filter() from user space.
+ */
+enum {
+	BPF_C_RET_K = 0,
+	BPF_C_RET_A,
+	BPF_C_LD_W_ABS,
+	BPF_C_LD_H_ABS,
+	BPF_C_LD_B_ABS,
+	BPF_C_LD_W_ABS_JEQ,
+	BPF_C_LD_H_ABS_JEQ,
+	BPF_C_LD_B_ABS_JEQ,
+	BPF_C_LD_W_IND,
+	BPF_C_LD_H_IND,
+	BPF_C_LD_B_IND,
+	BPF_C_LD_LEN,
+	BPF_C_LDX_LEN,
+	BPF_C_LDX_MSH,
+	BPF_C_LD_IMM,
+	BPF_C_LDX_IMM,
+	BPF_C_LD_MEM,
+	BPF_C_LDX_MEM,
+	BPF_C_ST,
+	BPF_C_STX,
+	BPF_C_JA,
+	BPF_C_JGT_K,
+	BPF_C_JGE_K,
+	BPF_C_JEQ_K,
+	BPF_C_JSET_K,
+	BPF_C_JGT_X,
+	BPF_C_JGE_X,
+	BPF_C_JEQ_X,
+	BPF_C_JSET_X,
+	BPF_C_ADD_X,
+	BPF_C_SUB_X,
+	BPF_C_MUL_X,
+	BPF_C_DIV_X,
+	BPF_C_AND_X,
+	BPF_C_OR_X,
+	BPF_C_LSH_X,
+	BPF_C_RSH_X,
+	BPF_C_ADD_K,
+	BPF_C_SUB_K,
+	BPF_C_MUL_K,
+	BPF_C_DIV_K,
+	BPF_C_AND_K,
+	BPF_C_OR_K,
+	BPF_C_LSH_K,
+	BPF_C_RSH_K,
+	BPF_C_NEG,
+	BPF_C_TAX,
+	BPF_C_TXA
+};
+
+struct bpf_cinsn {
+	u_int16_t	op;	/* BPF_C_* */
+	u_int16_t	jt;	/* index of the next insn if true, or for JA */
+	u_int16_t	jf;	/* index of the next insn if false */
+	u_int16_t	pad;
+	u_int32_t	k;	/* operand */
+	u_int32_t	k2;	/* comparand of a fused load and jeq */
+};
+
+struct bpf_cprog {
+	u_int32_t	bc_len;		/* number of instructions */
+	u_int32_t	bc_usesmem;	/* program reads scratch memory */
+	struct bpf_cinsn bc_insns[1];	/* bc_len entries */
+};
+
+static u_int16_t
+bpf_cop(u_int16_t code)
+{
+	switch (code) {
+	case BPF_RET|BPF_K:		return (BPF_C_RET_K);
+	case BPF_RET|BPF_A:		return (BPF_C_RET_A);
+	case BPF_LD|BPF_W|BPF_ABS:	return (BPF_C_LD_W_ABS);
+	case BPF_LD|BPF_H|BPF_ABS:	return (BPF_C_LD_H_ABS);
+	case BPF_LD|BPF_B|BPF_ABS:	return (BPF_C_LD_B_ABS);
+	case BPF_LD|BPF_W|BPF_IND:	return (BPF_C_LD_W_IND);
+	case BPF_LD|BPF_H|BPF_IND:	return (BPF_C_LD_H_IND);
+	case BPF_LD|BPF_B|BPF_IND:	return (BPF_C_LD_B_IND);
+	case BPF_LD|BPF_W|BPF_LEN:	return (BPF_C_LD_LEN);
+	case BPF_LDX|BPF_W|BPF_LEN:	return (BPF_C_LDX_LEN);
+	case BPF_LDX|BPF_MSH|BPF_B:	return (BPF_C_LDX_MSH);
+	case BPF_LD|BPF_IMM:		return (BPF_C_LD_IMM);
+	case BPF_LDX|BPF_IMM:		return (BPF_C_LDX_IMM);
+	case BPF_LD|BPF_MEM:		return (BPF_C_LD_MEM);
+	case BPF_LDX|BPF_MEM:		return (BPF_C_LDX_MEM);
+	case BPF_ST:			return (BPF_C_ST);
+	case BPF_STX:			return (BPF_C_STX);
+	case BPF_JMP|BPF_JA:		return (BPF_C_JA);
+	case BPF_JMP|BPF_JGT|BPF_K:	return (BPF_C_JGT_K);
+	case BPF_JMP|BPF_JGE|BPF_K:	return (BPF_C_JGE_K);
+	case BPF_JMP|BPF_JEQ|BPF_K:	return (BPF_C_JEQ_K);
+	case BPF_JMP|BPF_JSET|BPF_K:	return (BPF_C_JSET_K);
+	case BPF_JMP|BPF_JGT|BPF_X:	return (BPF_C_JGT_X);
+	case BPF_JMP|BPF_JGE|BPF_X:	return (BPF_C_JGE_X);
+	case BPF_JMP|BPF_JEQ|BPF_X:	return (BPF_C_JEQ_X);
+	case BPF_JMP|BPF_JSET|BPF_X:	return (BPF_C_JSET_X);
+	case BPF_ALU|BPF_ADD|BPF_X:	return (BPF_C_ADD_X);
+	case BPF_ALU|BPF_SUB|BPF_X:	return (BPF_C_SUB_X);
+	case BPF_ALU|BPF_MUL|BPF_X:	return (BPF_C_MUL_X);
+	case BPF_ALU|BPF_DIV|BPF_X:	return (BPF_C_DIV_X);
+	case BPF_ALU|BPF_AND|BPF_X:	return (BPF_C_AND_X);
+	case BPF_ALU|BPF_OR|BPF_X:	return (BPF_C_OR_X);
+	case BPF_ALU|BPF_LSH|BPF_X:	return (BPF_C_LSH_X);
+	case BPF_ALU|BPF_RSH|BPF_X:	return (BPF_C_RSH_X);
+	case BPF_ALU|BPF_ADD|BPF_K:	return (BPF_C_ADD_K);
+	case BPF_ALU|BPF_SUB|BPF_K:	return (BPF_C_SUB_K);
+	case BPF_ALU|BPF_MUL|BPF_K:	return (BPF_C_MUL_K);
+	case BPF_ALU|BPF_DIV|BPF_K:	return (BPF_C_DIV_K);
+	case BPF_ALU|BPF_AND|BPF_K:	return (BPF_C_AND_K);
+	case BPF_ALU|BPF_OR|BPF_K:	return (BPF_C_OR_K);
+	case BPF_ALU|BPF_LSH|BPF_K:	return (BPF_C_LSH_K);
+	case BPF_ALU|BPF_RSH|BPF_K:	return (BPF_C_RSH_K);
+	case BPF_ALU|BPF_NEG:		return (BPF_C_NEG);
+	case BPF_MISC|BPF_TAX:		return (BPF_C_TAX);
+	case BPF_MISC|BPF_TXA:		return (BPF_C_TXA);
+	default:
+		/* bpf_filter() rejects the packet when it gets here */
+		return ((u_int16_t)-1);
+	}
+}
+
+/*
+ * Follow a chain of unconditional jumps starting at instruction i.
+ */
+static u_int
+bpf_ctarget(const struct bpf_insn *f, u_int i)
+{
+	while (f[i].code == (BPF_JMP|BPF_JA))
+		i = i + 1 + f[i].k;
+	return (i);
+}
+
+/*
+ * Compile a program that has passed bpf_validate().  Returns NULL if
+ * memory is short, in which case the caller keeps using bpf_filter().
+ */
+struct bpf_cprog *
+bpf_compile(const struct bpf_insn *f, int len)
+{
+	struct bpf_cprog *prog;
+	struct bpf_cinsn *ci;
+	u_int i, op;
+
+	if (len < 1 || len > BPF_MAXINSNS)
+		return (NULL);
+
+#ifdef KERNEL
+	prog = (struct bpf_cprog *)_MALLOC(sizeof (*prog) +
+	    (len - 1) * sizeof (struct bpf_cinsn), M_DEVBUF, M_WAIT);
+#else
+	prog = (struct bpf_cprog *)malloc(sizeof (*prog) +
+	    (len - 1) * sizeof (struct bpf_cinsn));
+#endif
+	if (prog == NULL)
+		return (NULL);
+	bzero(prog, sizeof (*prog) + (len - 1) * sizeof (struct bpf_cinsn));
+	prog->bc_len = len;
+
+	for (i = 0; i < (u_int)len; i++) {
+		ci = &prog->bc_insns[i];
+		op = bpf_cop(f[i].code);
+		ci->k = f[i].k;
+
+		switch (op) {
+		case (u_int16_t)-1:
+			ci->op = BPF_C_RET_K;
+			ci->k = 0;
+			break;
+
+		case BPF_C_JA:
+			ci->op = op;
+			ci->jt = bpf_ctarget(f, i + 1 + f[i].k);
+			break;
+
+		case BPF_C_JGT_K:
+		case BPF_C_JGE_K:
+		case BPF_C_JEQ_K:
+		case BPF_C_JSET_K:
+		case BPF_C_JGT_X:
+		case BPF_C_JGE_X:
+		case BPF_C_JEQ_X:
+		case BPF_C_JSET_X:
+			ci->op = op;
+			ci->jt = bpf_ctarget(f, i + 1 + f[i].jt);
+			ci->jf = bpf_ctarget(f, i + 1 + f[i].jf);
+			break;
+
+		case BPF_C_LD_W_ABS:
+		case BPF_C_LD_H_ABS:
+		case BPF_C_LD_B_ABS:
+			ci->op = op;
+			/*
+			 * Fuse with a following jeq #k.  The jeq stays in
+			 * place for any other jumps that land on it.
+			 */
+			if (i + 1 < (u_int)len &&
+			    f[i + 1].code == (BPF_JMP|BPF_JEQ|BPF_K)) {
+				ci->op = op - BPF_C_LD_W_ABS + BPF_C_LD_W_ABS_JEQ;
+				ci->k2 = f[i + 1].k;
+				ci->jt = bpf_ctarget(f, i + 2 + f[i + 1].jt);
+				ci->jf = bpf_ctarget(f, i + 2 + f[i + 1].jf);
+			}
+			break;
+
+		case BPF_C_LD_MEM:
+		case BPF_C_LDX_MEM:
+			prog->bc_usesmem = 1;
+			ci->op = op;
+			break;
+
+		default:
+			ci->op = op;
+			break;
+		}
+	}
+
+	return (prog);
+}
+
+void
+bpf_cfree(struct bpf_cprog *prog)
+{
+#ifdef KERNEL
+	FREE((caddr_t)prog, M_DEVBUF);
+#else
+	free(prog);
+#endif
+}
+
+/*
+ * Run a compiled program; the arguments are as for bpf_filter().
+ */
+u_int
+bpf_cfilter(const struct bpf_cprog *prog, u_char *p, u_int wirelen,
+    u_int buflen)
+{
+	const struct bpf_cinsn *insns = prog->bc_insns;
+	const struct bpf_cinsn *pc = insns;
+	u_int32_t A = 0, X = 0;
+	bpf_u_int32 k;
+	int32_t mem[BPF_MEMWORDS];
+#ifdef KERNEL
+	struct mbuf *m = NULL;
+	int merr;
+#endif
+	u_char *data;
+	u_int len;
+
+	if (prog->bc_usesmem)
+		bzero(mem, sizeof(mem));
+
+	/*
+	 * data and len describe the bytes that can be loaded directly:
+	 * the whole buffer, or the first mbuf of a chain.
+	 */
+#ifdef KERNEL
+	if (buflen == 0) {
+		m = (struct mbuf *)(void *)p;
+		data = mtod(m, u_char *);
+		len = m->m_len;
+	} else
+#endif
+	{
+		data = p;
+		len = buflen;
+	}
+
+	while (1) {
+		switch (pc->op) {
+
+		case BPF_C_RET_K:
+			return (u_int)pc->k;
+
+		case BPF_C_RET_A:
+			return (u_int)A;
+
+		case BPF_C_LD_W_ABS:
+		case BPF_C_LD_W_ABS_JEQ:
+			k = pc->k;
+			if (k <= len && sizeof(int32_t) <= len - k) {
+				A = EXTRACT_LONG(&data[k]);
+			} else {
+#ifdef KERNEL
+				if (m == NULL)
+					return 0;
+				A = m_xword(m, k, &merr);
+				if (merr != 0)
+					return 0;
+#else
+				return 0;
+#endif
+			}
+			break;
+
+		case BPF_C_LD_H_ABS:
+		case BPF_C_LD_H_ABS_JEQ:
+			k = pc->k;
+			if (k <= len && sizeof(int16_t) <= len - k) {
+				A = EXTRACT_SHORT(&data[k]);
+			} else {
+#ifdef KERNEL
+				if (m == NULL)
+					return 0;
+				/* bpf_filter() ignores errors here */
+				A = m_xhalf(m, k, &merr);
+#else
+				return 0;
+#endif
+			}
+			break;
+
+		case BPF_C_LD_B_ABS:
+		case BPF_C_LD_B_ABS_JEQ:
+			k = pc->k;
+			if (k < len) {
+				A = data[k];
+			} else {
+#ifdef KERNEL
+				register struct mbuf *n = m;
+
+				if (n == NULL)
+					return 0;
+				MINDEX(n, k);
+				A = mtod(n, u_char *)[k];
+#else
+				return 0;
+#endif
+			}
+			break;
+
+		case BPF_C_LD_W_IND:
+			k = X + pc->k;
+			if (pc->k <= len && X <= len - pc->k &&
+			    sizeof(int32_t) <= len - k) {
+				A = EXTRACT_LONG(&data[k]);
+			} else {
+#ifdef KERNEL
+				if (m == NULL)
+					return 0;
+				A = m_xword(m, k, &merr);
+				if (merr != 0)
+					return 0;
+#else
+				return 0;
+#endif
+			}
+			pc++;
+			continue;
+
+		case BPF_C_LD_H_IND:
+			k = X + pc->k;
+			if (X <= len && pc->k <= len - X &&
+			    sizeof(int16_t) <= len - k) {
+				A = EXTRACT_SHORT(&data[k]);
+			} else {
+#ifdef KERNEL
+				if (m == NULL)
+					return 0;
+				A = m_xhalf(m, k, &merr);
+				if (merr != 0)
+					return 0;
+#else
+				return 0;
+#endif
+			}
+			pc++;
+			continue;
+
+		case BPF_C_LD_B_IND:
+			k = X + pc->k;
+			if (pc->k < len && X < len - pc->k) {
+				A = data[k];
+			} else {
+#ifdef KERNEL
+				register struct mbuf *n = m;
+
+				if (n == NULL)
+					return 0;
+				MINDEX(n, k);
+				A = mtod(n, u_char *)[k];
+#else
+				return 0;
+#endif
+			}
+			pc++;
+			continue;
+
+		case BPF_C_LDX_MSH:
+			k = pc->k;
+			if (k < len) {
+				X = (data[k] & 0xf) << 2;
+			} else {
+#ifdef KERNEL
+				register struct mbuf *n = m;
+
+				if (n == NULL)
+					return 0;
+				MINDEX(n, k);
+				X = (mtod(n, u_char *)[k] & 0xf) << 2;
+#else
+				return 0;
+#endif
+			}
+			pc++;
+			continue;
+
+		case BPF_C_LD_LEN:
+			A = wirelen;
+			pc++;
+			continue;
+
+		case BPF_C_LDX_LEN:
+			X = wirelen;
+			pc++;
+			continue;
+
+		case BPF_C_LD_IMM:
+			A = pc->k;
+			pc++;
+			continue;
+
+		case BPF_C_LDX_IMM:
+			X = pc->k;
+			pc++;
+			continue;
+
+		case BPF_C_LD_MEM:
+			A = mem[pc->k];
+			pc++;
+			continue;
+
+		case BPF_C_LDX_MEM:
+			X = mem[pc->k];
+			pc++;
+			continue;
+
+		case BPF_C_ST:
+			mem[pc->k] = A;
+			pc++;
+			continue;
+
+		case BPF_C_STX:
+			mem[pc->k] = X;
+			pc++;
+			continue;
+
+		case BPF_C_JA:
+			pc = &insns[pc->jt];
+			continue;
+
+		case BPF_C_JGT_K:
+			pc = &insns[(A > pc->k) ? pc->jt : pc->jf];
+			continue;
+
+		case BPF_C_JGE_K:
+			pc = &insns[(A >= pc->k) ? pc->jt : pc->jf];
+			continue;
+
+		case BPF_C_JEQ_K:
+			pc = &insns[(A == pc->k) ? pc->jt : pc->jf];
+			continue;
+
+		case BPF_C_JSET_K:
+			pc = &insns[(A & pc->k) ? pc->jt : pc->jf];
+			continue;
+
+		case BPF_C_JGT_X:
+			pc = &insns[(A > X) ? pc->jt : pc->jf];
+			continue;
+
+		case BPF_C_JGE_X:
+			pc = &insns[(A >= X) ? pc->jt : pc->jf];
+			continue;
+
+		case BPF_C_JEQ_X:
+			pc = &insns[(A == X) ? pc->jt : pc->jf];
+			continue;
+
+		case BPF_C_JSET_X:
+			pc = &insns[(A & X) ? pc->jt : pc->jf];
+			continue;
+
+		case BPF_C_ADD_X:
+			A += X;
+			pc++;
+			continue;
+
+		case BPF_C_SUB_X:
+			A -= X;
+			pc++;
+			continue;
+
+		case BPF_C_MUL_X:
+			A *= X;
+			pc++;
+			continue;
+
+		case BPF_C_DIV_X:
+			if (X == 0)
+				return 0;
+			A /= X;
+			pc++;
+			continue;
+
+		case BPF_C_AND_X:
+			A &= X;
+			pc++;
+			continue;
+
+		case BPF_C_OR_X:
+			A |= X;
+			pc++;
+			continue;
+
+		case BPF_C_LSH_X:
+			A <<= X;
+			pc++;
+			continue;
+
+		case BPF_C_RSH_X:
+			A >>= X;
+			pc++;
+			continue;
+
+		case BPF_C_ADD_K:
+			A += pc->k;
+			pc++;
+			continue;
+
+		case BPF_C_SUB_K:
+			A -= pc->k;
+			pc++;
+			continue;
+
+		case BPF_C_MUL_K:
+			A *= pc->k;
+			pc++;
+			continue;
+
+		case BPF_C_DIV_K:
+			A /= pc->k;
+			pc++;
+			continue;
+
+		case BPF_C_AND_K:
+			A &= pc->k;
+			pc++;
+			continue;
+
+		case BPF_C_OR_K:
+			A |= pc->k;
+			pc++;
+			continue;
+
+		case BPF_C_LSH_K:
+			A <<= pc->k;
+			pc++;
+			continue;
+
+		case BPF_C_RSH_K:
+			A >>= pc->k;
+			pc++;
+			continue;
+
+		case BPF_C_NEG:
+			A = -A;
+			pc++;
+			continue;
+
+		case BPF_C_TAX:
+			X = A;
+			pc++;
+			continue;
+
+		case BPF_C_TXA:
+			A = X;
+			pc++;
+			continue;
+
+		default:
+			return 0;
+		}
+
+		/* Packet loads by absolute offset end up here */
+		if (pc->op >= BPF_C_LD_W_ABS_JEQ && pc->op <= BPF_C_LD_B_ABS_JEQ)
+			pc = &insns[(A == pc->k2) ? pc->jt : pc->jf];
+		else
+			pc++;
+	}
+}
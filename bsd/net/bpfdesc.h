@@ -104,6 +104,7 @@ struct bpf_d {
 	struct bpf_if  *bd_bif;		/* interface descriptor */
 	u_int32_t		bd_rtout;	/* Read timeout in 'ticks' */
 	struct bpf_insn *bd_filter; 	/* filter code */
+	struct bpf_cprog *bd_cfilter;	/* compiled filter code, or NULL */
 	u_int32_t		bd_rcount;	/* number of packets received */
 	u_int32_t		bd_dcount;	/* number of packets dropped */
 
@@ -135,6 +136,22 @@ struct bpf_d {
 #endif
 	int		bd_traffic_class; /* traffic service class */
 	int		bd_flags;	/* flags */
+
+	/*
+	 * Capture ring (BIOCSRING).  When bd_ring is set, bd_sbuf points
+	 * into block bd_ringcur, or is NULL while the reader still owns
+	 * that block, and bd_bufsize is the room left after the block
+	 * header.  The hold and free slots are not used.
+	 */
+	caddr_t		bd_ring;	/* kernel address of the ring */
+	u_int32_t	bd_ringblksize;	/* size of each block */
+	u_int32_t	bd_ringblocks;	/* number of blocks */
+	u_int32_t	bd_ringcur;	/* block being filled */
+	u_int32_t	bd_ringpkts;	/* packets in block being filled */
+	u_int32_t	bd_ringdrops;	/* drops since last block was taken */
+	u_int32_t	bd_ringlast;	/* length of last block handed over */
+	u_int64_t	bd_ringseq;	/* next block sequence number */
+	ipc_port_t	bd_ringentry;	/* memory entry shared with reader */
 };
 
 /* Values for bd_state */
@@ -81,7 +81,8 @@ typedef enum classq_type {
 	Q_RED,
 	Q_RIO,
 	Q_BLUE,
-	Q_SFB
+	Q_SFB,
+	Q_FQ_CODEL
 } classq_type_t;
 
 /*
@@ -132,6 +133,7 @@ typedef struct _class_queue_ {
 #define	q_is_rio(q)	(qtype(q) == Q_RIO)	/* Is the queue a RIO queue */
 #define	q_is_blue(q)	(qtype(q) == Q_BLUE)	/* Is the queue a BLUE queue */
 #define	q_is_sfb(q)	(qtype(q) == Q_SFB)	/* Is the queue a SFB queue */
+#define	q_is_fq_codel(q) (qtype(q) == Q_FQ_CODEL) /* Is it a FQ-CoDel queue */
 #define	q_is_red_or_rio(q) (qtype(q) == Q_RED || qtype(q) == Q_RIO)
 #define	q_is_suspended(q) (qstate(q) == QS_SUSPENDED)
 
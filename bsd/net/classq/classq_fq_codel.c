@@ -0,0 +1,764 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#include <sys/cdefs.h>
+#include <sys/param.h>
+#include <sys/mbuf.h>
+#include <sys/socket.h>
+#include <sys/systm.h>
+#include <sys/sysctl.h>
+#include <sys/syslog.h>
+#include <sys/errno.h>
+#include <sys/kernel.h>
+
+#include <kern/zalloc.h>
+
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/dlil.h>
+#include <net/ethernet.h>
+
+#include <net/classq/classq_fq_codel.h>
+#include <net/flowhash.h>
+#include <net/net_osdep.h>
+#include <dev/random/randomdev.h>
+
+/*
+ * Flow Queue CoDel
+ *
+ * RFC 8290, "The Flow Queue CoDel Packet Scheduler and Active Queue
+ * Management Algorithm"; CoDel itself is described in RFC 8289.
+ *
+ * Packets are hashed on their flow ID into FQ_CODEL_FLOWS queues, which
+ * are served by deficit round robin.  Flows that just became active are
+ * kept on a separate list and served ahead of the others, so that sparse
+ * flows (DNS, RPC, interactive traffic) do not wait behind bulk transfers.
+ * Each flow queue runs its own instance of CoDel, which drops (or marks)
+ * packets at dequeue time once their sojourn time has stayed above the
+ * target delay for at least one interval.
+ *
+ * All packets remain accounted to the class queue, so the scheduler sees
+ * the usual qlen and qsize; the packets themselves live in the per-flow
+ * queues and the class queue's own mbuf list stays empty.
+ */
+
+/*
+ * Use Murmur3A_x86_32 for the flow hash, as SFB does; the 32-bit flow ID
+ * is already well mixed, this only adds a per-queue perturbation.
+ */
+#define	FQ_CODEL_HASH		net_flowhash_mh3_x86_32
+#define	FQ_CODEL_FLOWMASK	(FQ_CODEL_FLOWS - 1)
+
+#define	FQ_CODEL_FLOW(_fqc, _i)	(&(*(_fqc)->fqc_flows)[_i])
+
+#define	FQ_CODEL_TARGET_DEFAULT		(5ULL * 1000 * 1000)	/* 5ms */
+#define	FQ_CODEL_INTERVAL_DEFAULT	(100ULL * 1000 * 1000)	/* 100ms */
+
+#define	FQ_CODEL_ZONE_MAX	32			/* maximum elements in zone */
+#define	FQ_CODEL_ZONE_NAME	"classq_fq_codel"	/* zone name */
+
+#define	FQ_CODEL_FLOWS_ZONE_MAX		32		/* maximum elements in zone */
+#define	FQ_CODEL_FLOWS_ZONE_NAME	"classq_fq_codel_flows"	/* zone name */
+
+static unsigned int fq_codel_size;		/* size of zone element */
+static struct zone *fq_codel_zone;		/* zone for fq_codel */
+
+static unsigned int fq_codel_flows_size;	/* size of zone element */
+static struct zone *fq_codel_flows_zone;	/* zone for fq_codel_flows */
+
+/* internal function prototypes */
+static u_int64_t fq_codel_now(void);
+static void fq_codel_resetq(struct fq_codel *, cqev_t);
+static u_int64_t fq_codel_isqrt(u_int64_t);
+static u_int64_t fq_codel_control_law(struct fq_codel *, u_int64_t,
+    u_int32_t);
+static struct mbuf *fq_codel_flow_getq(struct fq_codel *,
+    struct fq_codel_flow *);
+static void fq_codel_drop(struct fq_codel *, class_queue_t *, struct mbuf *);
+static boolean_t fq_codel_mark(struct fq_codel *, struct mbuf *);
+static boolean_t fq_codel_should_drop(struct fq_codel *,
+    struct fq_codel_flow *, struct mbuf *, u_int64_t);
+static struct mbuf *fq_codel_flow_dequeue(struct fq_codel *, class_queue_t *,
+    struct fq_codel_flow *, u_int64_t);
+static struct mbuf *fq_codel_dequeue(struct fq_codel *, class_queue_t *);
+static void fq_codel_drop_fattest(struct fq_codel *, class_queue_t *);
+
+SYSCTL_NODE(_net_classq, OID_AUTO, fq_codel, CTLFLAG_RW|CTLFLAG_LOCKED, 0,
+    "FQ-CoDel");
+
+static u_int64_t fq_codel_target = FQ_CODEL_TARGET_DEFAULT;
+SYSCTL_QUAD(_net_classq_fq_codel, OID_AUTO, target_qdelay,
+    CTLFLAG_RW|CTLFLAG_LOCKED, &fq_codel_target,
+    "FQ-CoDel target queue delay in nanoseconds");
+
+static u_int64_t fq_codel_interval = FQ_CODEL_INTERVAL_DEFAULT;
+SYSCTL_QUAD(_net_classq_fq_codel, OID_AUTO, interval,
+    CTLFLAG_RW|CTLFLAG_LOCKED, &fq_codel_interval,
+    "FQ-CoDel interval in nanoseconds");
+
+static u_int32_t fq_codel_quantum = 0;	/* 0 means "automatic" */
+SYSCTL_UINT(_net_classq_fq_codel, OID_AUTO, quantum,
+    CTLFLAG_RW|CTLFLAG_LOCKED, &fq_codel_quantum, 0,
+    "FQ-CoDel DRR quantum in bytes");
+
+void
+fq_codel_init(void)
+{
+	_CASSERT(FQCF_ECN4 == CLASSQF_ECN4);
+	_CASSERT(FQCF_ECN6 == CLASSQF_ECN6);
+
+	fq_codel_size = sizeof (struct fq_codel);
+	fq_codel_zone = zinit(fq_codel_size,
+	    FQ_CODEL_ZONE_MAX * fq_codel_size, 0, FQ_CODEL_ZONE_NAME);
+	if (fq_codel_zone == NULL) {
+		panic("%s: failed allocating %s", __func__,
+		    FQ_CODEL_ZONE_NAME);
+		/* NOTREACHED */
+	}
+	zone_change(fq_codel_zone, Z_EXPAND, TRUE);
+	zone_change(fq_codel_zone, Z_CALLERACCT, TRUE);
+
+	fq_codel_flows_size = sizeof (*((struct fq_codel *)0)->fqc_flows);
+	fq_codel_flows_zone = zinit(fq_codel_flows_size,
+	    FQ_CODEL_FLOWS_ZONE_MAX * fq_codel_flows_size, 0,
+	    FQ_CODEL_FLOWS_ZONE_NAME);
+	if (fq_codel_flows_zone == NULL) {
+		panic("%s: failed allocating %s", __func__,
+		    FQ_CODEL_FLOWS_ZONE_NAME);
+		/* NOTREACHED */
+	}
+	zone_change(fq_codel_flows_zone, Z_EXPAND, TRUE);
+	zone_change(fq_codel_flows_zone, Z_CALLERACCT, TRUE);
+}
+
+static u_int64_t
+fq_codel_now(void)
+{
+	struct timespec now;
+	u_int64_t ns;
+
+	nanouptime(&now);
+	net_timernsec(&now, &ns);
+	return (ns);
+}
+
+struct fq_codel *
+fq_codel_alloc(struct ifnet *ifp, u_int32_t qid, u_int32_t flags)
+{
+	struct fq_codel *fqc;
+
+	VERIFY(ifp != NULL);
+
+	fqc = zalloc(fq_codel_zone);
+	if (fqc == NULL) {
+		log(LOG_ERR, "%s: FQ-CoDel unable to allocate\n",
+		    if_name(ifp));
+		return (NULL);
+	}
+	bzero(fqc, fq_codel_size);
+
+	if ((fqc->fqc_flows = zalloc(fq_codel_flows_zone)) == NULL) {
+		log(LOG_ERR, "%s: FQ-CoDel unable to allocate flows\n",
+		    if_name(ifp));
+		fq_codel_destroy(fqc);
+		return (NULL);
+	}
+
+	fqc->fqc_ifp = ifp;
+	fqc->fqc_qid = qid;
+	fqc->fqc_flags = (flags & FQCF_USERFLAGS);
+#if !PF_ECN
+	if (fqc->fqc_flags & FQCF_ECN) {
+		fqc->fqc_flags &= ~FQCF_ECN;
+		log(LOG_ERR, "%s: FQ-CoDel qid=%d, ECN not available; "
+		    "ignoring FQCF_ECN flag!\n", if_name(ifp), fqc->fqc_qid);
+	}
+#endif /* !PF_ECN */
+
+	fq_codel_resetq(fqc, -1);
+
+	return (fqc);
+}
+
+void
+fq_codel_destroy(struct fq_codel *fqc)
+{
+	VERIFY(fqc->fqc_next == NULL && fqc->fqc_backlog == 0);
+
+	if (fqc->fqc_flows != NULL) {
+		zfree(fq_codel_flows_zone, fqc->fqc_flows);
+		fqc->fqc_flows = NULL;
+	}
+	zfree(fq_codel_zone, fqc);
+}
+
+/*
+ * Reset the parameters and, unless packets are queued, the flow state.
+ */
+static void
+fq_codel_resetq(struct fq_codel *fqc, cqev_t ev)
+{
+	struct ifnet *ifp = fqc->fqc_ifp;
+	struct fq_codel_flow *fl;
+	int i;
+
+	VERIFY(ifp != NULL);
+
+	fqc->fqc_quantum = ((fq_codel_quantum == 0) ?
+	    (ifp->if_mtu + ifp->if_hdrlen) : fq_codel_quantum);
+	if (fqc->fqc_quantum == 0)
+		fqc->fqc_quantum = ETHERMTU;
+	if (fqc->fqc_maxpkt < fqc->fqc_quantum)
+		fqc->fqc_maxpkt = fqc->fqc_quantum;
+	fqc->fqc_target = fq_codel_target;
+	fqc->fqc_interval = fq_codel_interval;
+	if (fqc->fqc_target == 0)
+		fqc->fqc_target = FQ_CODEL_TARGET_DEFAULT;
+	if (fqc->fqc_interval == 0)
+		fqc->fqc_interval = FQ_CODEL_INTERVAL_DEFAULT;
+
+	if (fqc->fqc_backlog == 0 && fqc->fqc_next == NULL) {
+		fqc->fqc_fudge = RandomULong();
+		STAILQ_INIT(&fqc->fqc_new);
+		STAILQ_INIT(&fqc->fqc_old);
+		bzero(fqc->fqc_flows, fq_codel_flows_size);
+		for (i = 0; i < FQ_CODEL_FLOWS; i++) {
+			fl = FQ_CODEL_FLOW(fqc, i);
+			MBUFQ_INIT(&fl->fl_mbufq);
+		}
+	} else {
+		/* start CoDel afresh, keeping the queued packets */
+		for (i = 0; i < FQ_CODEL_FLOWS; i++) {
+			fl = FQ_CODEL_FLOW(fqc, i);
+			fl->fl_flags &= ~FQCFLF_DROPPING;
+			fl->fl_first_above = 0;
+			fl->fl_count = fl->fl_lastcount = 0;
+		}
+	}
+
+	if (ev == CLASSQ_EV_LINK_DOWN || !classq_verbose)
+		return;
+
+	log(LOG_DEBUG, "%s: FQ-CoDel qid=%d, flows=%d, quantum=%d, "
+	    "target=%llu nsec, interval=%llu nsec, flags=0x%x\n",
+	    if_name(ifp), fqc->fqc_qid, FQ_CODEL_FLOWS, fqc->fqc_quantum,
+	    fqc->fqc_target, fqc->fqc_interval, fqc->fqc_flags);
+}
+
+void
+fq_codel_getstats(struct fq_codel *fqc, struct fq_codel_stats *sps)
+{
+	struct fq_codel_flow *fl;
+	int i;
+
+	sps->flows = FQ_CODEL_FLOWS;
+	sps->quantum = fqc->fqc_quantum;
+	sps->target_qdelay = fqc->fqc_target;
+	sps->interval = fqc->fqc_interval;
+	sps->flags = fqc->fqc_flags;
+	sps->new_flowcnt = sps->old_flowcnt = sps->dropping = 0;
+	for (i = 0; i < FQ_CODEL_FLOWS; i++) {
+		fl = FQ_CODEL_FLOW(fqc, i);
+		if (fl->fl_flags & FQCFLF_NEW)
+			sps->new_flowcnt++;
+		else if (fl->fl_flags & FQCFLF_OLD)
+			sps->old_flowcnt++;
+		if (fl->fl_flags & FQCFLF_DROPPING)
+			sps->dropping++;
+	}
+	*(&(sps->fqcodelstats)) = *(&(fqc->fqc_stats));
+}
+
+/* integer square root */
+static u_int64_t
+fq_codel_isqrt(u_int64_t x)
+{
+	u_int64_t r = 0, b = 1ULL << 62;
+
+	while (b > x)
+		b >>= 2;
+	while (b != 0) {
+		if (x >= r + b) {
+			x -= r + b;
+			r = (r >> 1) + b;
+		} else {
+			r >>= 1;
+		}
+		b >>= 2;
+	}
+	return (r);
+}
+
+/*
+ * CoDel control law: the next drop is due interval/sqrt(count) after t.
+ * The square root is computed in 16.16 fixed point.
+ */
+static u_int64_t
+fq_codel_control_law(struct fq_codel *fqc, u_int64_t t, u_int32_t count)
+{
+	VERIFY(count > 0);
+	return (t + (fqc->fqc_interval << 16) /
+	    fq_codel_isqrt((u_int64_t)count << 32));
+}
+
+/* remove the packet at the head of a flow queue */
+static struct mbuf *
+fq_codel_flow_getq(struct fq_codel *fqc, struct fq_codel_flow *fl)
+{
+	struct mbuf *m;
+	u_int32_t len;
+
+	MBUFQ_DEQUEUE(&fl->fl_mbufq, m);
+	if (m == NULL) {
+		VERIFY(fl->fl_bytes == 0);
+		return (NULL);
+	}
+	len = m_pktlen(m);
+	VERIFY(fl->fl_bytes >= len && fqc->fqc_backlog >= len);
+	fl->fl_bytes -= len;
+	fqc->fqc_backlog -= len;
+
+	return (m);
+}
+
+/*
+ * Free a packet that has already been taken off its flow queue.  The
+ * scheduler has counted it as queued, so account for it as a drop here.
+ */
+static void
+fq_codel_drop(struct fq_codel *fqc, class_queue_t *q, struct mbuf *m)
+{
+	struct ifclassq *ifq = &fqc->fqc_ifp->if_snd;
+	u_int32_t len = m_pktlen(m);
+
+	VERIFY(qlen(q) > 0);
+	qlen(q)--;
+	/* qsize is an approximation, so adjust if necessary */
+	if (((int)qsize(q) - len) > 0)
+		qsize(q) -= len;
+	else if (qsize(q) != 0)
+		qsize(q) = 0;
+
+	VERIFY(IFCQ_LEN(ifq) > 0);
+	IFCQ_DEC_LEN(ifq);
+	IFCQ_DROP_ADD(ifq, 1, len);
+
+	IFCQ_CONVERT_LOCK(ifq);
+	m_freem(m);
+}
+
+static boolean_t
+fq_codel_mark(struct fq_codel *fqc, struct mbuf *m)
+{
+#if PF_ECN
+	if ((fqc->fqc_flags & FQCF_ECN) &&
+	    mark_ecn(m, m_pftag(m), fqc->fqc_flags)) {
+		fqc->fqc_stats.marked_packets++;
+		return (TRUE);
+	}
+#else /* !PF_ECN */
+#pragma unused(fqc, m)
+#endif /* !PF_ECN */
+	return (FALSE);
+}
+
+/*
+ * The sojourn time must have been above target for a whole interval.
+ * Nothing is dropped while the whole class holds no more than one
+ * packet's worth of data, which also guarantees that a dequeue never
+ * comes back empty handed while the class queue is not empty.
+ */
+static boolean_t
+fq_codel_should_drop(struct fq_codel *fqc, struct fq_codel_flow *fl,
+    struct mbuf *m, u_int64_t now)
+{
+	u_int64_t sojourn = 0;
+
+	if (now > m->m_pkthdr.pkt_enqueue_ts)
+		sojourn = now - m->m_pkthdr.pkt_enqueue_ts;
+	if (sojourn > fqc->fqc_stats.max_sojourn)
+		fqc->fqc_stats.max_sojourn = sojourn;
+
+	if (sojourn < fqc->fqc_target ||
+	    fqc->fqc_backlog <= fqc->fqc_maxpkt) {
+		fl->fl_first_above = 0;
+		return (FALSE);
+	}
+	if (fl->fl_first_above == 0) {
+		fl->fl_first_above = now + fqc->fqc_interval;
+		return (FALSE);
+	}
+	return (now >= fl->fl_first_above);
+}
+
+/*
+ * CoDel dequeue for one flow; returns NULL once the flow is empty.
+ */
+static struct mbuf *
+fq_codel_flow_dequeue(struct fq_codel *fqc, class_queue_t *q,
+    struct fq_codel_flow *fl, u_int64_t now)
+{
+	struct mbuf *m;
+	boolean_t drop;
+	u_int32_t delta;
+
+	if ((m = fq_codel_flow_getq(fqc, fl)) == NULL) {
+		fl->fl_flags &= ~FQCFLF_DROPPING;
+		return (NULL);
+	}
+
+	drop = fq_codel_should_drop(fqc, fl, m, now);
+	if (fl->fl_flags & FQCFLF_DROPPING) {
+		if (!drop) {
+			/* sojourn time below target; leave dropping state */
+			fl->fl_flags &= ~FQCFLF_DROPPING;
+			return (m);
+		}
+		while (now >= fl->fl_drop_next) {
+			fl->fl_count++;
+			if (fq_codel_mark(fqc, m)) {
+				fl->fl_drop_next = fq_codel_control_law(fqc,
+				    fl->fl_drop_next, fl->fl_count);
+				break;
+			}
+			fqc->fqc_stats.drop_codel++;
+			fq_codel_drop(fqc, q, m);
+			if ((m = fq_codel_flow_getq(fqc, fl)) == NULL ||
+			    !fq_codel_should_drop(fqc, fl, m, now)) {
+				fl->fl_flags &= ~FQCFLF_DROPPING;
+				break;
+			}
+			fl->fl_drop_next = fq_codel_control_law(fqc,
+			    fl->fl_drop_next, fl->fl_count);
+		}
+	} else if (drop) {
+		if (fq_codel_mark(fqc, m)) {
+			/* deliver the marked packet */
+		} else {
+			fqc->fqc_stats.drop_codel++;
+			fq_codel_drop(fqc, q, m);
+			m = fq_codel_flow_getq(fqc, fl);
+			if (m != NULL)
+				(void) fq_codel_should_drop(fqc, fl, m, now);
+		}
+		fl->fl_flags |= FQCFLF_DROPPING;
+		/*
+		 * If we were dropping not long ago, resume at the
+		 * rate we were at rather than starting over.
+		 */
+		delta = fl->fl_count - fl->fl_lastcount;
+		if (delta > 1 && now - fl->fl_drop_next <
+		    16 * fqc->fqc_interval)
+			fl->fl_count = delta;
+		else
+			fl->fl_count = 1;
+		fl->fl_lastcount = fl->fl_count;
+		fl->fl_drop_next = fq_codel_control_law(fqc, now,
+		    fl->fl_count);
+	}
+	return (m);
+}
+
+/*
+ * Deficit round robin over the new flows, then the old ones.
+ */
+static struct mbuf *
+fq_codel_dequeue(struct fq_codel *fqc, class_queue_t *q)
+{
+	struct fq_codel_flowq *head;
+	struct fq_codel_flow *fl;
+	struct mbuf *m;
+	u_int64_t now;
+
+	if (fqc->fqc_backlog == 0)
+		return (NULL);
+
+	now = fq_codel_now();
+	for (;;) {
+		if ((fl = STAILQ_FIRST(&fqc->fqc_new)) != NULL) {
+			head = &fqc->fqc_new;
+		} else if ((fl = STAILQ_FIRST(&fqc->fqc_old)) != NULL) {
+			head = &fqc->fqc_old;
+		} else {
+			return (NULL);
+		}
+
+		if (fl->fl_deficit <= 0) {
+			fl->fl_deficit += fqc->fqc_quantum;
+			STAILQ_REMOVE_HEAD(head, fl_link);
+			STAILQ_INSERT_TAIL(&fqc->fqc_old, fl, fl_link);
+			fl->fl_flags &= ~FQCFLF_NEW;
+			fl->fl_flags |= FQCFLF_OLD;
+			continue;
+		}
+
+		if ((m = fq_codel_flow_dequeue(fqc, q, fl, now)) == NULL) {
+			/*
+			 * An emptied new flow goes to the back of the old
+			 * list, so that it cannot starve the old flows by
+			 * coming back as a new flow right away.
+			 */
+			STAILQ_REMOVE_HEAD(head, fl_link);
+			fl->fl_flags &= ~(FQCFLF_NEW | FQCFLF_OLD);
+			if (head == &fqc->fqc_new &&
+			    !STAILQ_EMPTY(&fqc->fqc_old)) {
+				STAILQ_INSERT_TAIL(&fqc->fqc_old, fl, fl_link);
+				fl->fl_flags |= FQCFLF_OLD;
+			}
+			continue;
+		}
+
+		fl->fl_deficit -= m_pktlen(m);
+		return (m);
+	}
+}
+
+/*
+ * The class queue is full: drop from the head of the flow holding the
+ * most bytes, which is where the traffic causing the overload is.
+ */
+static void
+fq_codel_drop_fattest(struct fq_codel *fqc, class_queue_t *q)
+{
+	struct fq_codel_flow *fl, *fat = NULL;
+	struct mbuf *m;
+	int i;
+
+	for (i = 0; i < FQ_CODEL_FLOWS; i++) {
+		fl = FQ_CODEL_FLOW(fqc, i);
+		if (fat == NULL || fl->fl_bytes > fat->fl_bytes)
+			fat = fl;
+	}
+	if (fat != NULL && (m = fq_codel_flow_getq(fqc, fat)) != NULL) {
+		fqc->fqc_stats.drop_overlimit++;
+		fq_codel_drop(fqc, q, m);
+	}
+}
+
+int
+fq_codel_addq(struct fq_codel *fqc, class_queue_t *q, struct mbuf *m,
+    struct pf_mtag *t)
+{
+#pragma unused(t)
+	struct pkthdr *pkt = &m->m_pkthdr;
+	struct fq_codel_flow *fl;
+	u_int32_t len = m_pktlen(m);
+
+	if (fqc->fqc_flags & FQCF_SUSPENDED) {
+		fqc->fqc_stats.drop_suspended++;
+		IFCQ_CONVERT_LOCK(&fqc->fqc_ifp->if_snd);
+		m_freem(m);
+		return (CLASSQEQ_DROPPED_SP);
+	}
+
+	if (qlen(q) >= qlimit(q))
+		fq_codel_drop_fattest(fqc, q);
+
+	if (pkt->pkt_flowid == 0)
+		fqc->fqc_stats.null_flowid++;
+	fl = FQ_CODEL_FLOW(fqc, FQ_CODEL_HASH(&pkt->pkt_flowid,
+	    sizeof (pkt->pkt_flowid), fqc->fqc_fudge) & FQ_CODEL_FLOWMASK);
+
+	pkt->pkt_enqueue_ts = fq_codel_now();
+	MBUFQ_ENQUEUE(&fl->fl_mbufq, m);
+	fl->fl_bytes += len;
+	fqc->fqc_backlog += len;
+	if (len > fqc->fqc_maxpkt) {
+		fqc->fqc_maxpkt = len;
+		fqc->fqc_stats.max_packet = len;
+	}
+
+	/* keep the class queue accounting of the scheduler */
+	qlen(q)++;
+	VERIFY(qlen(q) != 0);
+	qsize(q) += len;
+
+	if (!(fl->fl_flags & (FQCFLF_NEW | FQCFLF_OLD))) {
+		STAILQ_INSERT_TAIL(&fqc->fqc_new, fl, fl_link);
+		fl->fl_flags |= FQCFLF_NEW;
+		fl->fl_deficit = fqc->fqc_quantum;
+		fqc->fqc_stats.new_flows++;
+	}
+
+	/* successfully queued */
+	return (CLASSQEQ_SUCCESS);
+}
+
+struct mbuf *
+fq_codel_getq(struct fq_codel *fqc, class_queue_t *q)
+{
+	struct mbuf *m;
+	u_int32_t len;
+
+	if (fqc->fqc_flags & FQCF_SUSPENDED)
+		return (NULL);
+
+	if ((m = fqc->fqc_next) != NULL)
+		fqc->fqc_next = NULL;
+	else if ((m = fq_codel_dequeue(fqc, q)) == NULL)
+		return (NULL);
+
+	len = m_pktlen(m);
+	VERIFY(qlen(q) > 0);
+	qlen(q)--;
+	/* qsize is an approximation, so adjust if necessary */
+	if (((int)qsize(q) - len) > 0)
+		qsize(q) -= len;
+	else if (qsize(q) != 0)
+		qsize(q) = 0;
+
+	return (m);
+}
+
+/*
+ * Return the packet the next fq_codel_getq() will return.  Picking it
+ * may involve CoDel drops, so it is taken off its flow queue now and
+ * kept aside until then.
+ */
+struct mbuf *
+fq_codel_pollq(struct fq_codel *fqc, class_queue_t *q)
+{
+	if (fqc->fqc_flags & FQCF_SUSPENDED)
+		return (NULL);
+
+	if (fqc->fqc_next == NULL)
+		fqc->fqc_next = fq_codel_dequeue(fqc, q);
+
+	return (fqc->fqc_next);
+}
+
+void
+fq_codel_purgeq(struct fq_codel *fqc, class_queue_t *q, u_int32_t flow,
+    u_int32_t *packets, u_int32_t *bytes)
+{
+	struct fq_codel_flow *fl;
+	struct mbuf *m, *m_tmp;
+	u_int32_t cnt = 0, len = 0, l;
+	int i, first, last;
+
+	IFCQ_CONVERT_LOCK(&fqc->fqc_ifp->if_snd);
+
+	if ((m = fqc->fqc_next) != NULL &&
+	    (flow == 0 || m->m_pkthdr.pkt_flowid == flow)) {
+		fqc->fqc_next = NULL;
+		cnt++;
+		len += m_pktlen(m);
+		m_freem(m);
+	}
+
+	/* flow of 0 means all flows */
+	if (flow == 0) {
+		first = 0;
+		last = FQ_CODEL_FLOWS - 1;
+	} else {
+		first = last = FQ_CODEL_HASH(&flow, sizeof (flow),
+		    fqc->fqc_fudge) & FQ_CODEL_FLOWMASK;
+	}
+	for (i = first; i <= last; i++) {
+		fl = FQ_CODEL_FLOW(fqc, i);
+		MBUFQ_FOREACH_SAFE(m, &fl->fl_mbufq, m_tmp) {
+			if (flow != 0 && m->m_pkthdr.pkt_flowid != flow)
+				continue;
+			MBUFQ_REMOVE(&fl->fl_mbufq, m);
+			MBUFQ_NEXT(m) = NULL;
+			l = m_pktlen(m);
+			fl->fl_bytes -= l;
+			fqc->fqc_backlog -= l;
+			cnt++;
+			len += l;
+			m_freem(m);
+		}
+	}
+
+	/* an emptied flow leaves its list on the next dequeue */
+	VERIFY(qlen(q) >= cnt);
+	qlen(q) -= cnt;
+	if (qlen(q) == 0 || ((int)qsize(q) - len) <= 0)
+		qsize(q) = 0;
+	else
+		qsize(q) -= len;
+	if (flow == 0)
+		VERIFY(qlen(q) == 0 && fqc->fqc_backlog == 0);
+
+	if (packets != NULL)
+		*packets = cnt;
+	if (bytes != NULL)
+		*bytes = len;
+}
+
+void
+fq_codel_updateq(struct fq_codel *fqc, cqev_t ev)
+{
+	struct ifnet *ifp = fqc->fqc_ifp;
+
+	VERIFY(ifp != NULL);
+
+	switch (ev) {
+	case CLASSQ_EV_LINK_MTU:
+	case CLASSQ_EV_LINK_UP:
+	case CLASSQ_EV_LINK_DOWN:
+		if (classq_verbose) {
+			log(LOG_DEBUG, "%s: FQ-CoDel qid=%d, resetting due "
+			    "to event %s\n", if_name(ifp), fqc->fqc_qid,
+			    ifclassq_ev2str(ev));
+		}
+		fq_codel_resetq(fqc, ev);
+		break;
+
+	case CLASSQ_EV_LINK_BANDWIDTH:
+	case CLASSQ_EV_LINK_LATENCY:
+	default:
+		break;
+	}
+}
+
+int
+fq_codel_suspendq(struct fq_codel *fqc, class_queue_t *q, boolean_t on)
+{
+#pragma unused(q)
+	struct ifnet *ifp = fqc->fqc_ifp;
+
+	VERIFY(ifp != NULL);
+
+	if ((on && (fqc->fqc_flags & FQCF_SUSPENDED)) ||
+	    (!on && !(fqc->fqc_flags & FQCF_SUSPENDED)))
+		return (0);
+
+	if (classq_verbose) {
+		log(LOG_DEBUG, "%s: FQ-CoDel qid=%d, setting state to %s",
+		    if_name(ifp), fqc->fqc_qid,
+		    (on ? "SUSPENDED" : "RUNNING"));
+	}
+
+	if (on)
+		fqc->fqc_flags |= FQCF_SUSPENDED;
+	else
+		fqc->fqc_flags &= ~FQCF_SUSPENDED;
+
+	return (0);
+}
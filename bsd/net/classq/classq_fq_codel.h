@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _NET_CLASSQ_CLASSQ_FQ_CODEL_H_
+#define	_NET_CLASSQ_CLASSQ_FQ_CODEL_H_
+
+#ifdef PRIVATE
+#ifdef BSD_KERNEL_PRIVATE
+#include <sys/queue.h>
+#include <net/classq/if_classq.h>
+#endif /* BSD_KERNEL_PRIVATE */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define	FQ_CODEL_FLOWS_SHIFT	8
+#define	FQ_CODEL_FLOWS		(1 << FQ_CODEL_FLOWS_SHIFT)
+
+struct fqcodelstats {
+	u_int64_t		drop_overlimit;	/* dropped from fattest flow */
+	u_int64_t		drop_codel;	/* dropped by CoDel */
+	u_int64_t		drop_suspended;	/* dropped while suspended */
+	u_int64_t		marked_packets;	/* ECN marked by CoDel */
+	u_int64_t		new_flows;	/* flows becoming active */
+	u_int64_t		null_flowid;	/* packets without flow id */
+	u_int64_t		max_sojourn;	/* max queueing delay (nsec) */
+	u_int64_t		max_packet;	/* largest packet seen */
+};
+
+struct fq_codel_stats {
+	u_int32_t		flows;		/* number of flow queues */
+	u_int32_t		quantum;	/* DRR quantum (bytes) */
+	u_int64_t		target_qdelay;	/* CoDel target (nsec) */
+	u_int64_t		interval;	/* CoDel interval (nsec) */
+	u_int32_t		flags;
+	u_int32_t		new_flowcnt;	/* flows on new list */
+	u_int32_t		old_flowcnt;	/* flows on old list */
+	u_int32_t		dropping;	/* flows in dropping state */
+	struct fqcodelstats	fqcodelstats;
+};
+
+#ifdef BSD_KERNEL_PRIVATE
+/* per-flow state */
+struct fq_codel_flow {
+	MBUFQ_HEAD(fq_codel_mq)	fl_mbufq;	/* packets of this flow */
+	STAILQ_ENTRY(fq_codel_flow) fl_link;	/* new or old flow list */
+	int32_t			fl_deficit;	/* DRR deficit (bytes) */
+	u_int32_t		fl_bytes;	/* bytes queued */
+	u_int32_t		fl_flags;	/* FQCFLF_* */
+	u_int32_t		fl_count;	/* CoDel drops in this cycle */
+	u_int32_t		fl_lastcount;	/* count at last cycle */
+	u_int64_t		fl_first_above;	/* when delay went above target */
+	u_int64_t		fl_drop_next;	/* next CoDel drop deadline */
+};
+
+/* flow flags */
+#define	FQCFLF_NEW		0x1	/* on the new flow list */
+#define	FQCFLF_OLD		0x2	/* on the old flow list */
+#define	FQCFLF_DROPPING		0x4	/* CoDel is in dropping state */
+
+STAILQ_HEAD(fq_codel_flowq, fq_codel_flow);
+
+/* FQ-CoDel flags */
+#define	FQCF_ECN4	0x01	/* use packet marking for IPv4 packets */
+#define	FQCF_ECN6	0x02	/* use packet marking for IPv6 packets */
+#define	FQCF_ECN	(FQCF_ECN4 | FQCF_ECN6)
+#define	FQCF_SUSPENDED	0x1000	/* queue is suspended */
+
+#define	FQCF_USERFLAGS	(FQCF_ECN4 | FQCF_ECN6)
+
+typedef struct fq_codel {
+	u_int32_t	fqc_flags;	/* FQ-CoDel flags */
+	u_int32_t	fqc_qid;
+	u_int32_t	fqc_quantum;	/* DRR quantum (bytes) */
+	u_int32_t	fqc_maxpkt;	/* largest packet seen */
+	u_int32_t	fqc_fudge;	/* flow hash seed */
+	u_int32_t	fqc_backlog;	/* bytes in the flow queues */
+	u_int64_t	fqc_target;	/* CoDel target delay (nsec) */
+	u_int64_t	fqc_interval;	/* CoDel interval (nsec) */
+	struct ifnet	*fqc_ifp;	/* back pointer to ifnet */
+
+	/*
+	 * Packet picked by a poll; it is still counted in the class
+	 * queue and is returned by the next dequeue.
+	 */
+	struct mbuf	*fqc_next;
+
+	struct fq_codel_flowq fqc_new;	/* flows that just became active */
+	struct fq_codel_flowq fqc_old;	/* flows that used their quantum */
+	struct fq_codel_flow (*fqc_flows)[FQ_CODEL_FLOWS];
+
+	/* statistics */
+	struct fqcodelstats fqc_stats __attribute__((aligned(8)));
+} fq_codel_t;
+
+extern void fq_codel_init(void);
+extern struct fq_codel *fq_codel_alloc(struct ifnet *, u_int32_t, u_int32_t);
+extern void fq_codel_destroy(struct fq_codel *);
+extern int fq_codel_addq(struct fq_codel *, class_queue_t *, struct mbuf *,
+    struct pf_mtag *);
+extern struct mbuf *fq_codel_getq(struct fq_codel *, class_queue_t *);
+extern struct mbuf *fq_codel_pollq(struct fq_codel *, class_queue_t *);
+extern void fq_codel_purgeq(struct fq_codel *, class_queue_t *, u_int32_t,
+    u_int32_t *, u_int32_t *);
+extern void fq_codel_getstats(struct fq_codel *, struct fq_codel_stats *);
+extern void fq_codel_updateq(struct fq_codel *, cqev_t);
+extern int fq_codel_suspendq(struct fq_codel *, class_queue_t *, boolean_t);
+#endif /* BSD_KERNEL_PRIVATE */
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* PRIVATE */
+#endif /* _NET_CLASSQ_CLASSQ_FQ_CODEL_H_ */
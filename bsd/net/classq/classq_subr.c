@@ -49,6 +49,7 @@
 #include <net/classq/classq_blue.h>
 #endif /* CLASSQ_BLUE */
 #include <net/classq/classq_sfb.h>
+#include <net/classq/classq_fq_codel.h>
 #include <net/pktsched/pktsched.h>
 
 #include <libkern/libkern.h>
@@ -58,8 +59,8 @@
 #endif /* PF_ALTQ */
 
 static errno_t ifclassq_dequeue_common(struct ifclassq *, mbuf_svc_class_t,
-    u_int32_t, struct mbuf **, struct mbuf **, u_int32_t *, u_int32_t *,
-    boolean_t);
+    u_int32_t, u_int32_t, struct mbuf **, struct mbuf **, u_int32_t *,
+    u_int32_t *, boolean_t);
 static struct mbuf *ifclassq_poll_common(struct ifclassq *,
     mbuf_svc_class_t, boolean_t);
 static struct mbuf *ifclassq_tbr_dequeue_common(struct ifclassq *, int,
@@ -82,6 +83,7 @@ classq_init(void)
 	blue_init();
 #endif /* CLASSQ_BLUE */
 	sfb_init();
+	fq_codel_init();
 }
 
 int
@@ -292,30 +294,34 @@ ifclassq_enqueue(struct ifclassq *ifq, struct mbuf *m)
 }
 
 errno_t
-ifclassq_dequeue(struct ifclassq *ifq, u_int32_t limit, struct mbuf **head,
-    struct mbuf **tail, u_int32_t *cnt, u_int32_t *len)
+ifclassq_dequeue(struct ifclassq *ifq, u_int32_t pkt_limit,
+    u_int32_t byte_limit, struct mbuf **head, struct mbuf **tail,
+    u_int32_t *cnt, u_int32_t *len)
 {
-	return (ifclassq_dequeue_common(ifq, MBUF_SC_UNSPEC, limit, head, tail,
-	    cnt, len, FALSE));
+	return (ifclassq_dequeue_common(ifq, MBUF_SC_UNSPEC, pkt_limit,
+	    byte_limit, head, tail, cnt, len, FALSE));
 }
 
 errno_t
 ifclassq_dequeue_sc(struct ifclassq *ifq, mbuf_svc_class_t sc,
-    u_int32_t limit, struct mbuf **head, struct mbuf **tail, u_int32_t *cnt,
-    u_int32_t *len)
+    u_int32_t pkt_limit, u_int32_t byte_limit, struct mbuf **head,
+    struct mbuf **tail, u_int32_t *cnt, u_int32_t *len)
 {
-	return (ifclassq_dequeue_common(ifq, sc, limit, head, tail,
-	    cnt, len, TRUE));
+	return (ifclassq_dequeue_common(ifq, sc, pkt_limit, byte_limit,
+	    head, tail, cnt, len, TRUE));
 }
 
 static errno_t
 ifclassq_dequeue_common(struct ifclassq *ifq, mbuf_svc_class_t sc,
-    u_int32_t limit, struct mbuf **head, struct mbuf **tail, u_int32_t *cnt,
-    u_int32_t *len, boolean_t drvmgt)
+    u_int32_t pkt_limit, u_int32_t byte_limit, struct mbuf **head,
+    struct mbuf **tail, u_int32_t *cnt, u_int32_t *len, boolean_t drvmgt)
 {
 	struct ifnet *ifp = ifq->ifcq_ifp;
 	u_int32_t i = 0, l = 0;
 	struct mbuf **first, *last;
+#if !PF_ALTQ && MEASURE_BW
+	struct mbuf *m;
+#endif /* !PF_ALTQ && MEASURE_BW */
 #if PF_ALTQ
 	struct ifaltq *altq = IFCQ_ALTQ(ifq);
 	boolean_t draining;
@@ -330,7 +336,26 @@ ifclassq_dequeue_common(struct ifclassq *ifq, mbuf_svc_class_t sc,
 	ifq = &ifp->if_snd;
 	IFCQ_LOCK_SPIN(ifq);
 
-	while (i < limit) {
+#if !PF_ALTQ
+	/*
+	 * If the scheduler can hand over a whole chain, let it do so;
+	 * the token bucket regulator needs to meter one packet at a time.
+	 */
+	if (ifq->ifcq_dequeue_multi != NULL && !IFCQ_TBR_IS_ENABLED(ifq)) {
+		IFCQ_DEQUEUE_MULTI(ifq, sc, pkt_limit, byte_limit, *head,
+		    last, i, l);
+#if MEASURE_BW
+		for (m = *head; m != NULL; m = m->m_nextpkt) {
+			m->m_pkthdr.pkt_bwseq =
+			    atomic_add_64_ov(&(ifp->if_bw.cur_seq),
+			    m->m_pkthdr.len);
+		}
+#endif /* MEASURE_BW */
+		goto done;
+	}
+#endif /* !PF_ALTQ */
+
+	while (i < pkt_limit && l < byte_limit) {
 		u_int64_t pktlen;
 #if PF_ALTQ
 		u_int32_t qlen;
@@ -394,6 +419,9 @@ ifclassq_dequeue_common(struct ifclassq *ifq, mbuf_svc_class_t sc,
 		i++;
 	}
 
+#if !PF_ALTQ
+done:
+#endif /* !PF_ALTQ */
 	IFCQ_UNLOCK(ifq);
 
 	if (tail != NULL)
@@ -482,7 +510,8 @@ ifclassq_update(struct ifclassq *ifq, cqev_t ev)
 int
 ifclassq_attach(struct ifclassq *ifq, u_int32_t type, void *discipline,
     ifclassq_enq_func enqueue, ifclassq_deq_func dequeue,
-    ifclassq_deq_sc_func dequeue_sc, ifclassq_req_func request)
+    ifclassq_deq_sc_func dequeue_sc, ifclassq_deq_multi_func dequeue_multi,
+    ifclassq_req_func request)
 {
 	IFCQ_LOCK_ASSERT_HELD(ifq);
 
@@ -496,6 +525,7 @@ ifclassq_attach(struct ifclassq *ifq, u_int32_t type, void *discipline,
 	ifq->ifcq_enqueue = enqueue;
 	ifq->ifcq_dequeue = dequeue;
 	ifq->ifcq_dequeue_sc = dequeue_sc;
+	ifq->ifcq_dequeue_multi = dequeue_multi;
 	ifq->ifcq_request = request;
 
 	return (0);
@@ -513,6 +543,7 @@ ifclassq_detach(struct ifclassq *ifq)
 	ifq->ifcq_enqueue = NULL;
 	ifq->ifcq_dequeue = NULL;
 	ifq->ifcq_dequeue_sc = NULL;
+	ifq->ifcq_dequeue_multi = NULL;
 	ifq->ifcq_request = NULL;
 
 	return (0);
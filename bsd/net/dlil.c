@@ -611,6 +611,11 @@ SYSCTL_UINT(_net_link_generic_system, OID_AUTO, delaybased_queue,
     CTLFLAG_RW | CTLFLAG_LOCKED, &if_delaybased_queue, 1,
     "enable delay based dynamic queue sizing");
 
+static u_int32_t if_fq_codel = 0;
+SYSCTL_UINT(_net_link_generic_system, OID_AUTO, fq_codel,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &if_fq_codel, 0,
+    "use FQ-CoDel instead of SFB on newly attached interfaces");
+
 static uint64_t hwcksum_in_invalidated = 0;
 SYSCTL_QUAD(_net_link_generic_system, OID_AUTO,
     hwcksum_in_invalidated, CTLFLAG_RD | CTLFLAG_LOCKED,
@@ -2963,7 +2968,8 @@ ifnet_dequeue(struct ifnet *ifp, struct mbuf **mp)
 		return (ENXIO);
 	if (!ifnet_is_attached(ifp, 1))
 		return (ENXIO);
-	rc = ifclassq_dequeue(&ifp->if_snd, 1, mp, NULL, NULL, NULL);
+	rc = ifclassq_dequeue(&ifp->if_snd, 1, CLASSQ_DEQUEUE_MAX_BYTE_LIMIT,
+	    mp, NULL, NULL, NULL);
 	ifnet_decr_iorefcnt(ifp);
 
 	return (rc);
@@ -2982,7 +2988,8 @@ ifnet_dequeue_service_class(struct ifnet *ifp, mbuf_svc_class_t sc,
 	if (!ifnet_is_attached(ifp, 1))
 		return (ENXIO);
 	
-	rc = ifclassq_dequeue_sc(&ifp->if_snd, sc, 1, mp, NULL, NULL, NULL);
+	rc = ifclassq_dequeue_sc(&ifp->if_snd, sc, 1,
+	    CLASSQ_DEQUEUE_MAX_BYTE_LIMIT, mp, NULL, NULL, NULL);
 	ifnet_decr_iorefcnt(ifp);
 	return (rc);
 }
@@ -3000,7 +3007,27 @@ ifnet_dequeue_multi(struct ifnet *ifp, u_int32_t limit, struct mbuf **head,
 	if (!ifnet_is_attached(ifp, 1))
 		return (ENXIO);
 	
-	rc = ifclassq_dequeue(&ifp->if_snd, limit, head, tail, cnt, len);
+	rc = ifclassq_dequeue(&ifp->if_snd, limit, CLASSQ_DEQUEUE_MAX_BYTE_LIMIT,
+	    head, tail, cnt, len);
+	ifnet_decr_iorefcnt(ifp);
+	return (rc);
+}
+
+errno_t
+ifnet_dequeue_multi_bytes(struct ifnet *ifp, u_int32_t byte_limit,
+    struct mbuf **head, struct mbuf **tail, u_int32_t *cnt, u_int32_t *len)
+{
+	errno_t rc;
+	if (ifp == NULL || head == NULL || byte_limit < 1)
+		return (EINVAL);
+	else if (!(ifp->if_eflags & IFEF_TXSTART) ||
+	    (ifp->if_output_sched_model != IFNET_SCHED_MODEL_NORMAL))
+		return (ENXIO);
+	if (!ifnet_is_attached(ifp, 1))
+		return (ENXIO);
+
+	rc = ifclassq_dequeue(&ifp->if_snd, CLASSQ_DEQUEUE_MAX_PKT_LIMIT,
+	    byte_limit, head, tail, cnt, len);
 	ifnet_decr_iorefcnt(ifp);
 	return (rc);
 }
@@ -3018,8 +3045,8 @@ ifnet_dequeue_service_class_multi(struct ifnet *ifp, mbuf_svc_class_t sc,
 		return (ENXIO);
 	if (!ifnet_is_attached(ifp, 1))
 		return (ENXIO);
-	rc = ifclassq_dequeue_sc(&ifp->if_snd, sc, limit, head,
-	    tail, cnt, len);
+	rc = ifclassq_dequeue_sc(&ifp->if_snd, sc, limit,
+	    CLASSQ_DEQUEUE_MAX_BYTE_LIMIT, head, tail, cnt, len);
 	ifnet_decr_iorefcnt(ifp);
 	return (rc);
 }
@@ -3781,6 +3808,29 @@ preout_again:
 #endif
 
 	do {
+#if INET
+		/*
+		 * A TSO packet for an interface that can't do TSO is cut
+		 * into segments here, so that the layers above handled it
+		 * only once; the segments go through the rest one by one.
+		 */
+		if (raw == 0 && proto_family == PF_INET &&
+		    TSO_IPV4_NOTOK(ifp, m)) {
+			if ((m = ip_gso_segment(m, ifp)) == NULL) {
+				retval = ENOBUFS;
+				goto next;
+			}
+			if (m->m_nextpkt != NULL) {
+				mbuf_t n = m->m_nextpkt;
+
+				while (n->m_nextpkt != NULL)
+					n = n->m_nextpkt;
+				n->m_nextpkt = packetlist;
+				packetlist = m->m_nextpkt;
+				m->m_nextpkt = NULL;
+			}
+		}
+#endif /* INET */
 #if CONFIG_DTRACE
 		if (!raw && proto_family == PF_INET) {
 			struct ip *ip = mtod(m, struct ip*);
@@ -4998,7 +5048,7 @@ ifnet_attach(ifnet_t ifp, const struct sockaddr_dl *ll_addr)
 	    ifp->if_output_sched_model == IFNET_SCHED_MODEL_DRIVER_MANAGED);
 
 	/* By default, use SFB and enable flow advisory */
-	sflags = PKTSCHEDF_QALG_SFB;
+	sflags = (if_fq_codel ? PKTSCHEDF_QALG_FQ_CODEL : PKTSCHEDF_QALG_SFB);
 	if (if_flowadv)
 		sflags |= PKTSCHEDF_QALG_FLOWCTL;
 
@@ -293,6 +293,7 @@ STUB(ifnet_clone_attach);
 STUB(ifnet_clone_detach);
 STUB(ifnet_dequeue);
 STUB(ifnet_dequeue_multi);
+STUB(ifnet_dequeue_multi_bytes);
 STUB(ifnet_dequeue_service_class);
 STUB(ifnet_dequeue_service_class_multi);
 STUB(ifnet_enqueue);
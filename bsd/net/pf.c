@@ -83,6 +83,8 @@
 
 #include <mach/thread_act.h>
 
+#include <pexpert/pexpert.h>
+
 #include <net/if.h>
 #include <net/if_types.h>
 #include <net/bpf.h>
@@ -155,8 +157,8 @@ lck_mtx_t *pf_lock = &pf_lock_data;
 lck_rw_t *pf_perim_lock = &pf_perim_lock_data;
 
 /* state tables */
-struct pf_state_tree_lan_ext	 pf_statetbl_lan_ext;
-struct pf_state_tree_ext_gwy	 pf_statetbl_ext_gwy;
+struct pf_state_table	 pf_statetbl_lan_ext;
+struct pf_state_table	 pf_statetbl_ext_gwy;
 
 struct pf_palist	 pf_pabuf;
 struct pf_status	 pf_status;
@@ -477,12 +479,9 @@ struct pf_src_tree tree_src_tracking;
 
 struct pf_state_tree_id tree_id;
 struct pf_state_queue state_list;
+struct pf_state_queue pf_state_unlinked;	/* awaiting pf_free_state */
 
 RB_GENERATE(pf_src_tree, pf_src_node, entry, pf_src_compare);
-RB_GENERATE(pf_state_tree_lan_ext, pf_state_key,
-    entry_lan_ext, pf_state_compare_lan_ext);
-RB_GENERATE(pf_state_tree_ext_gwy, pf_state_key,
-    entry_ext_gwy, pf_state_compare_ext_gwy);
 RB_GENERATE(pf_state_tree_id, pf_state,
     entry_id, pf_state_compare_id);
 
@@ -1110,6 +1109,229 @@ pf_addrcpy(struct pf_addr *dst, struct pf_addr *src, sa_family_t af)
 }
 #endif /* INET6 */
 
+/*
+ * The lan_ext and ext_gwy state key tables are hash tables, protected
+ * like the rest of the state by pf_lock.  The hash covers only the
+ * fields that the corresponding compare function always checks for
+ * equality; fields it skips for some keys (the external endpoint under
+ * endpoint-independent filtering, GRE call IDs, application state) are
+ * left to the compare on the chain.
+ */
+#define	PF_STATE_BUCKETS	8192		/* default, per table */
+#define	PF_PURGE_BATCH		64		/* expired states per pass */
+
+struct pf_state_hashkey {
+	struct pf_addr	own;		/* lan or gwy address */
+	struct pf_addr	ext;
+	u_int32_t	xport[2];
+	u_int8_t	af;
+	u_int8_t	proto;
+	u_int8_t	variant;
+	u_int8_t	pad[5];
+};
+
+static u_int32_t pf_state_hash_seed;
+
+#define	PF_STATE_BUCKET(_tbl, _h)	\
+	(&(_tbl)->pst_buckets[(_h) & (_tbl)->pst_mask])
+
+static u_int32_t
+pf_state_hash(struct pf_state_key *sk, u_int dir)
+{
+	struct pf_state_hashkey hk __attribute__((aligned(8)));
+	struct pf_state_host *own = (dir == PF_OUT) ? &sk->lan : &sk->gwy;
+	int extaddr = 1;
+
+	bzero(&hk, sizeof (hk));
+	hk.af = sk->af;
+	hk.proto = sk->proto;
+
+	switch (sk->proto) {
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		hk.xport[0] = own->xport.port;
+		break;
+
+	case IPPROTO_TCP:
+		hk.xport[0] = own->xport.port;
+		hk.xport[1] = sk->ext.xport.port;
+		break;
+
+	case IPPROTO_UDP:
+		hk.variant = sk->proto_variant;
+		hk.xport[0] = own->xport.port;
+		if (sk->proto_variant < PF_EXTFILTER_AD)
+			hk.xport[1] = sk->ext.xport.port;
+		if (sk->proto_variant >= PF_EXTFILTER_EI)
+			extaddr = 0;
+		break;
+
+	case IPPROTO_ESP:
+		hk.xport[0] = (dir == PF_OUT) ?
+		    sk->ext.xport.spi : sk->gwy.xport.spi;
+		break;
+
+	default:
+		break;
+	}
+
+	switch (sk->af) {
+#if INET
+	case AF_INET:
+		hk.own.addr32[0] = own->addr.addr32[0];
+		if (extaddr)
+			hk.ext.addr32[0] = sk->ext.addr.addr32[0];
+		break;
+#endif /* INET */
+#if INET6
+	case AF_INET6:
+		PF_ACPY(&hk.own, &own->addr, AF_INET6);
+		if (extaddr)
+			PF_ACPY(&hk.ext, &sk->ext.addr, AF_INET6);
+		break;
+#endif /* INET6 */
+	}
+
+	return (net_flowhash(&hk, sizeof (hk), pf_state_hash_seed));
+}
+
+static void
+pf_state_table_alloc(struct pf_state_table *tbl, u_int32_t nbuckets)
+{
+	u_int32_t i;
+
+	tbl->pst_buckets = _MALLOC(nbuckets * sizeof (*tbl->pst_buckets),
+	    M_DEVBUF, M_WAITOK | M_ZERO);
+	if (tbl->pst_buckets == NULL)
+		panic("%s: unable to allocate state table", __func__);
+	tbl->pst_mask = nbuckets - 1;
+	for (i = 0; i < nbuckets; i++)
+		TAILQ_INIT(&tbl->pst_buckets[i].psb_keys);
+}
+
+void
+pf_state_table_init(void)
+{
+	u_int32_t nbuckets = PF_STATE_BUCKETS, n;
+
+	/* round the "pf_state_buckets" boot-arg down to a power of 2 */
+	if (PE_parse_boot_argn("pf_state_buckets", &n, sizeof (n)) && n > 0) {
+		for (nbuckets = 1; (nbuckets << 1) <= n && nbuckets < (1 << 24);
+		    nbuckets <<= 1)
+			;
+	}
+
+	pf_state_hash_seed = RandomULong();
+	pf_state_table_alloc(&pf_statetbl_lan_ext, nbuckets);
+	pf_state_table_alloc(&pf_statetbl_ext_gwy, nbuckets);
+}
+
+/*
+ * Find the key equal to the given one in the lan_ext (PF_OUT) or
+ * ext_gwy (PF_IN) table.
+ */
+static struct pf_state_key *
+pf_state_table_find(struct pf_state_key *key, u_int dir)
+{
+	struct pf_state_bucket	*b;
+	struct pf_state_key	*sk;
+	u_int32_t		 h = pf_state_hash(key, dir);
+
+	lck_mtx_assert(pf_lock, LCK_MTX_ASSERT_OWNED);
+
+	switch (dir) {
+	case PF_OUT:
+		b = PF_STATE_BUCKET(&pf_statetbl_lan_ext, h);
+		TAILQ_FOREACH(sk, &b->psb_keys, entry_lan_ext) {
+			if (sk->hash_lan_ext == h &&
+			    pf_state_compare_lan_ext(key, sk) == 0)
+				break;
+		}
+		break;
+	case PF_IN:
+		b = PF_STATE_BUCKET(&pf_statetbl_ext_gwy, h);
+		TAILQ_FOREACH(sk, &b->psb_keys, entry_ext_gwy) {
+			if (sk->hash_ext_gwy == h &&
+			    pf_state_compare_ext_gwy(key, sk) == 0)
+				break;
+		}
+		break;
+	default:
+		panic("%s: bad direction %u", __func__, dir);
+		/* NOTREACHED */
+	}
+
+	return (sk);
+}
+
+/*
+ * Insert a key into the lan_ext (PF_OUT) or ext_gwy (PF_IN) table.
+ * Returns the existing key if an equal one is already there.
+ */
+static struct pf_state_key *
+pf_state_table_insert(struct pf_state_key *sk, u_int dir)
+{
+	struct pf_state_bucket	*b;
+	struct pf_state_key	*cur;
+	u_int32_t		 h = pf_state_hash(sk, dir);
+
+	lck_mtx_assert(pf_lock, LCK_MTX_ASSERT_OWNED);
+
+	switch (dir) {
+	case PF_OUT:
+		b = PF_STATE_BUCKET(&pf_statetbl_lan_ext, h);
+		TAILQ_FOREACH(cur, &b->psb_keys, entry_lan_ext) {
+			if (cur->hash_lan_ext == h &&
+			    pf_state_compare_lan_ext(sk, cur) == 0)
+				break;
+		}
+		if (cur == NULL) {
+			sk->hash_lan_ext = h;
+			TAILQ_INSERT_HEAD(&b->psb_keys, sk, entry_lan_ext);
+		}
+		break;
+	case PF_IN:
+		b = PF_STATE_BUCKET(&pf_statetbl_ext_gwy, h);
+		TAILQ_FOREACH(cur, &b->psb_keys, entry_ext_gwy) {
+			if (cur->hash_ext_gwy == h &&
+			    pf_state_compare_ext_gwy(sk, cur) == 0)
+				break;
+		}
+		if (cur == NULL) {
+			sk->hash_ext_gwy = h;
+			TAILQ_INSERT_HEAD(&b->psb_keys, sk, entry_ext_gwy);
+		}
+		break;
+	default:
+		panic("%s: bad direction %u", __func__, dir);
+		/* NOTREACHED */
+	}
+
+	return (cur);
+}
+
+static void
+pf_state_table_remove(struct pf_state_key *sk, u_int dir)
+{
+	struct pf_state_bucket	*b;
+
+	lck_mtx_assert(pf_lock, LCK_MTX_ASSERT_OWNED);
+
+	switch (dir) {
+	case PF_OUT:
+		b = PF_STATE_BUCKET(&pf_statetbl_lan_ext, sk->hash_lan_ext);
+		TAILQ_REMOVE(&b->psb_keys, sk, entry_lan_ext);
+		break;
+	case PF_IN:
+		b = PF_STATE_BUCKET(&pf_statetbl_ext_gwy, sk->hash_ext_gwy);
+		TAILQ_REMOVE(&b->psb_keys, sk, entry_ext_gwy);
+		break;
+	default:
+		panic("%s: bad direction %u", __func__, dir);
+		/* NOTREACHED */
+	}
+}
+
 struct pf_state *
 pf_find_state_byid(struct pf_state_cmp *key)
 {
@@ -1127,18 +1349,7 @@ pf_find_state(struct pfi_kif *kif, struct pf_state_key_cmp *key, u_int dir)
 
 	pf_status.fcounters[FCNT_STATE_SEARCH]++;
 
-	switch (dir) {
-	case PF_OUT:
-		sk = RB_FIND(pf_state_tree_lan_ext, &pf_statetbl_lan_ext,
-		    (struct pf_state_key *)key);
-		break;
-	case PF_IN:
-		sk = RB_FIND(pf_state_tree_ext_gwy, &pf_statetbl_ext_gwy,
-		    (struct pf_state_key *)key);
-		break;
-	default:
-		panic("pf_find_state");
-	}
+	sk = pf_state_table_find((struct pf_state_key *)key, dir);
 
 	/* list is sorted, if-bound states before floating ones */
 	if (sk != NULL)
@@ -1157,18 +1368,7 @@ pf_find_state_all(struct pf_state_key_cmp *key, u_int dir, int *more)
 
 	pf_status.fcounters[FCNT_STATE_SEARCH]++;
 
-	switch (dir) {
-	case PF_OUT:
-		sk = RB_FIND(pf_state_tree_lan_ext,
-		    &pf_statetbl_lan_ext, (struct pf_state_key *)key);
-		break;
-	case PF_IN:
-		sk = RB_FIND(pf_state_tree_ext_gwy,
-		    &pf_statetbl_ext_gwy, (struct pf_state_key *)key);
-		break;
-	default:
-		panic("pf_find_state_all");
-	}
+	sk = pf_state_table_find((struct pf_state_key *)key, dir);
 
 	if (sk != NULL) {
 		ret = TAILQ_FIRST(&sk->states);
@@ -1425,8 +1625,7 @@ pf_insert_state(struct pfi_kif *kif, struct pf_state *s)
 	VERIFY(s->state_key != NULL);
 	s->kif = kif;
 
-	if ((cur = RB_INSERT(pf_state_tree_lan_ext, &pf_statetbl_lan_ext,
-	    s->state_key)) != NULL) {
+	if ((cur = pf_state_table_insert(s->state_key, PF_OUT)) != NULL) {
 		/* key exists. check for same kif, if none, add to key */
 		TAILQ_FOREACH(sp, &cur->states, next)
 			if (sp->kif == kif) {	/* collision! */
@@ -1440,8 +1639,8 @@ pf_insert_state(struct pfi_kif *kif, struct pf_state *s)
 	}
 
 	/* if cur != NULL, we already found a state key and attached to it */
-	if (cur == NULL && (cur = RB_INSERT(pf_state_tree_ext_gwy,
-	    &pf_statetbl_ext_gwy, s->state_key)) != NULL) {
+	if (cur == NULL &&
+	    (cur = pf_state_table_insert(s->state_key, PF_IN)) != NULL) {
 		/* must not happen. we must have found the sk above! */
 		pf_stateins_err("tree_ext_gwy", s, kif);
 		pf_detach_state(s, PF_DT_SKIP_EXTGWY);
@@ -1672,6 +1871,8 @@ pf_unlink_state(struct pf_state *cur)
 	cur->timeout = PFTM_UNLINKED;
 	pf_src_tree_remove_state(cur);
 	pf_detach_state(cur, 0);
+	TAILQ_REMOVE(&state_list, cur, entry_list);
+	TAILQ_INSERT_TAIL(&pf_state_unlinked, cur, entry_list);
 }
 
 /* callers should be at splpf and hold the
@@ -1704,7 +1905,7 @@ pf_free_state(struct pf_state *cur)
 	}
 	pf_normalize_tcp_cleanup(cur);
 	pfi_kif_unref(cur->kif, PFI_KIF_REF_STATE);
-	TAILQ_REMOVE(&state_list, cur, entry_list);
+	TAILQ_REMOVE(&pf_state_unlinked, cur, entry_list);
 	if (cur->tag)
 		pf_tag_unref(cur->tag);
 	pool_put(&pf_state_pl, cur);
@@ -1716,32 +1917,153 @@ pf_free_state(struct pf_state *cur)
 void
 pf_purge_expired_states(u_int32_t maxcheck)
 {
-	static struct pf_state	*cur = NULL;
-	struct pf_state		*next;
+	static u_int32_t	 cur = 0;	/* next lan_ext bucket */
+	struct pf_state		*expired[PF_PURGE_BATCH];
+	struct pf_state_bucket	*b;
+	struct pf_state_key	*sk;
+	struct pf_state		*s, *next;
+	u_int32_t		 i, n, nb, now;
+	int			 first;
 
 	lck_mtx_assert(pf_lock, LCK_MTX_ASSERT_OWNED);
 
-	while (maxcheck--) {
-		/* wrap to start of list when we hit the end */
-		if (cur == NULL) {
-			cur = TAILQ_FIRST(&state_list);
-			if (cur == NULL)
-				break;	/* list empty */
-		}
+	/* states unlinked elsewhere only need to be freed */
+	for (s = TAILQ_FIRST(&pf_state_unlinked); s != NULL; s = next) {
+		next = TAILQ_NEXT(s, entry_list);
+		pf_free_state(s);
+	}
 
-		/* get next state, as cur may get deleted */
-		next = TAILQ_NEXT(cur, entry_list);
+	/*
+	 * Every linked state hangs off exactly one key in the lan_ext
+	 * table, so walk that a bucket at a time.  Expired states are
+	 * collected first and unlinked afterwards, since unlinking the
+	 * last state of a key takes the key off the chain being walked.
+	 * A bucket with more than PF_PURGE_BATCH expired states is walked
+	 * again until it is drained; only the first walk counts against
+	 * maxcheck, so that a full purge still visits every bucket.
+	 */
+	now = pf_time_second();
+	for (nb = 0; maxcheck > 0 && nb <= pf_statetbl_lan_ext.pst_mask;
+	    nb++) {
+		b = &pf_statetbl_lan_ext.pst_buckets[cur];
+		cur = (cur + 1) & pf_statetbl_lan_ext.pst_mask;
+		first = 1;
+		do {
+			n = 0;
+			TAILQ_FOREACH(sk, &b->psb_keys, entry_lan_ext) {
+				TAILQ_FOREACH(s, &sk->states, next) {
+					if (first && maxcheck > 0)
+						maxcheck--;
+					if (n < PF_PURGE_BATCH &&
+					    pf_state_expires(s) <= now)
+						expired[n++] = s;
+				}
+			}
 
-		if (cur->timeout == PFTM_UNLINKED) {
-			pf_free_state(cur);
-		} else if (pf_state_expires(cur) <= pf_time_second()) {
-			/* unlink and free expired state */
-			pf_unlink_state(cur);
-			pf_free_state(cur);
+			for (i = 0; i < n; i++) {
+				pf_unlink_state(expired[i]);
+				pf_free_state(expired[i]);
+			}
+			first = 0;
+		} while (n == PF_PURGE_BATCH);
+	}
+}
+
+#if CONFIG_IN_KERNEL_TESTS
+/*
+ * Put more than PF_PURGE_BATCH expired states in one lan_ext bucket
+ * and check that a full purge leaves none of them behind.  The keys
+ * are UDP flows from 198.18.0.0/16 to 198.19.0.1 port 9, found by
+ * trying lan ports until they hash to the bucket of the first one.
+ */
+#define	PF_PURGE_TEST_STATES	(4 * PF_PURGE_BATCH)
+
+static int
+pf_purge_test_count(struct pf_state_bucket *b)
+{
+	struct pf_state_key	*sk;
+	struct pf_state		*s;
+	int			 n = 0;
+
+	TAILQ_FOREACH(sk, &b->psb_keys, entry_lan_ext) {
+		if (sk->af != AF_INET || sk->proto != IPPROTO_UDP ||
+		    sk->ext.addr.v4.s_addr != htonl(0xc6130001) ||
+		    (ntohl(sk->lan.addr.v4.s_addr) >> 16) != 0xc612)
+			continue;
+		TAILQ_FOREACH(s, &sk->states, next)
+			n++;
+	}
+	return (n);
+}
+
+int
+pf_purge_test(void)
+{
+	struct pf_state_key	 key, *sk;
+	struct pf_state_bucket	*b;
+	struct pf_state		*s;
+	u_int32_t		 h, i, n;
+	int			 error = 0;
+
+	bzero(&key, sizeof (key));
+	key.af = AF_INET;
+	key.proto = IPPROTO_UDP;
+	key.ext.addr.v4.s_addr = htonl(0xc6130001);
+	key.ext.xport.port = htons(9);
+
+	lck_rw_lock_shared(pf_perim_lock);
+	lck_mtx_lock(pf_lock);
+
+	b = NULL;
+	for (i = 0, n = 0; n < PF_PURGE_TEST_STATES && i < 0x1000000; i++) {
+		key.lan.addr.v4.s_addr = htonl(0xc6120000 | (i >> 16));
+		key.lan.xport.port = htons(i & 0xffff);
+		key.gwy = key.lan;
+		h = pf_state_hash(&key, PF_OUT);
+		if (b == NULL)
+			b = PF_STATE_BUCKET(&pf_statetbl_lan_ext, h);
+		else if (b != PF_STATE_BUCKET(&pf_statetbl_lan_ext, h))
+			continue;
+
+		if ((s = pool_get(&pf_state_pl, PR_WAITOK)) == NULL)
+			break;
+		bzero(s, sizeof (*s));
+		if ((sk = pf_alloc_state_key(s, &key)) == NULL) {
+			pool_put(&pf_state_pl, s);
+			break;
+		}
+		TAILQ_INIT(&s->unlink_hooks);
+		s->rule.ptr = &pf_default_rule;
+		s->timeout = PFTM_PURGE;
+		s->creation = s->expire = pf_time_second();
+		if (pf_insert_state(pfi_all, s)) {
+			pool_put(&pf_state_pl, s);
+			continue;
 		}
-		cur = next;
+		pf_default_rule.states++;
+		VERIFY(pf_default_rule.states != 0);
+		n++;
+	}
+
+	if (n != PF_PURGE_TEST_STATES || pf_purge_test_count(b) != (int)n) {
+		printf("%s: inserted %u of %u states\n", __func__, n,
+		    PF_PURGE_TEST_STATES);
+		error = 1;
 	}
+
+	pf_purge_expired_states(pf_status.states);
+	if ((n = pf_purge_test_count(b)) != 0) {
+		printf("%s: %u expired states left after purge\n",
+		    __func__, n);
+		error = 1;
+	}
+
+	lck_mtx_unlock(pf_lock);
+	lck_rw_done(pf_perim_lock);
+
+	return (error);
 }
+#endif /* CONFIG_IN_KERNEL_TESTS */
 
 int
 pf_tbladdr_setup(struct pf_ruleset *rs, struct pf_addr_wrap *aw)
@@ -3975,11 +4297,9 @@ pf_detach_state(struct pf_state *s, int flags)
 	TAILQ_REMOVE(&sk->states, s, next);
 	if (--sk->refcnt == 0) {
 		if (!(flags & PF_DT_SKIP_EXTGWY))
-			RB_REMOVE(pf_state_tree_ext_gwy,
-			    &pf_statetbl_ext_gwy, sk);
+			pf_state_table_remove(sk, PF_IN);
 		if (!(flags & PF_DT_SKIP_LANEXT))
-			RB_REMOVE(pf_state_tree_lan_ext,
-			    &pf_statetbl_lan_ext, sk);
+			pf_state_table_remove(sk, PF_OUT);
 		if (sk->app_state)
 			pool_put(&pf_app_state_pl, sk->app_state);
 		pool_put(&pf_state_key_pl, sk);
@@ -4056,6 +4376,8 @@ pf_test_rule(struct pf_rule **rm, struct pf_state **sm, int direction,
 	sa_family_t		 af = pd->af;
 	struct pf_rule		*r, *a = NULL;
 	struct pf_ruleset	*ruleset = NULL;
+	struct pf_rule_index	*ri, *rcri = NULL;
+	struct pf_rule_cand	*rc = NULL;
 	struct pf_src_node	*nsn = NULL;
 	struct tcphdr		*th = pd->hdr.tcp;
 	u_short			 reason;
@@ -4343,6 +4665,26 @@ pf_test_rule(struct pf_rule **rm, struct pf_state **sm, int direction,
 		tag = nr->tag;
 
 	while (r != NULL) {
+		/* a NULL ruleset is the main ruleset */
+		ri = (ruleset != NULL ? ruleset : &pf_main_ruleset)->
+		    rules[PF_RULESET_FILTER].index;
+		if (ri != NULL) {
+			/* the packet's candidates, once per ruleset walked */
+			if (ri != rcri) {
+				rc = pf_rule_index_lookup(ri, pd->proto,
+				    (pd->proto == IPPROTO_TCP ||
+				    pd->proto == IPPROTO_UDP) ?
+				    th->th_dport : 0);
+				rcri = ri;
+			}
+			r = pf_rule_index_next(ri, rc, r);
+			if (r == NULL) {
+				if (pf_step_out_of_anchor(&asd, &ruleset,
+				    PF_RULESET_FILTER, &r, &a, &match))
+					break;
+				continue;
+			}
+		}
 		r->evaluations++;
 		if (pfi_kif_match(r->kif, kif) == r->ifnot)
 			r = r->skip[PF_SKIP_IFP].ptr;
@@ -7335,13 +7677,11 @@ pf_test_state_esp(struct pf_state **state, int direction, struct pfi_kif *kif,
 			if (s) {
 				struct pf_state_key *sk = s->state_key;
 
-				RB_REMOVE(pf_state_tree_ext_gwy,
-				    &pf_statetbl_ext_gwy, sk);
+				pf_state_table_remove(sk, PF_IN);
 				sk->lan.xport.spi = sk->gwy.xport.spi =
 				    esp->spi;
 
-				if (RB_INSERT(pf_state_tree_ext_gwy,
-				    &pf_statetbl_ext_gwy, sk))
+				if (pf_state_table_insert(sk, PF_IN) != NULL)
 					pf_detach_state(s, PF_DT_SKIP_EXTGWY);
 				else
 					*state = s;
@@ -7353,12 +7693,10 @@ pf_test_state_esp(struct pf_state **state, int direction, struct pfi_kif *kif,
 			if (s) {
 				struct pf_state_key *sk = s->state_key;
 
-				RB_REMOVE(pf_state_tree_lan_ext,
-				    &pf_statetbl_lan_ext, sk);
+				pf_state_table_remove(sk, PF_OUT);
 				sk->ext.xport.spi = esp->spi;
 
-				if (RB_INSERT(pf_state_tree_lan_ext,
-				    &pf_statetbl_lan_ext, sk))
+				if (pf_state_table_insert(sk, PF_OUT) != NULL)
 					pf_detach_state(s, PF_DT_SKIP_LANEXT);
 				else
 					*state = s;
@@ -7367,14 +7705,7 @@ pf_test_state_esp(struct pf_state **state, int direction, struct pfi_kif *kif,
 
 		if (s) {
 			if (*state == 0) {
-#if NPFSYNC
-				if (s->creatorid == pf_status.hostid)
-					pfsync_delete_state(s);
-#endif
-				s->timeout = PFTM_UNLINKED;
-				hook_runloop(&s->unlink_hooks,
-				    HOOK_REMOVE|HOOK_FREE);
-				pf_src_tree_remove_state(s);
+				pf_unlink_state(s);
 				pf_free_state(s);
 				return (PF_DROP);
 			}
@@ -7787,7 +8118,7 @@ pf_route(struct mbuf **m, struct pf_rule *r, int dir, struct ifnet *oifp,
 	    &sw_csum);
 
 	if (ntohs(ip->ip_len) <= ifp->if_mtu || TSO_IPV4_OK(ifp, m0) ||
-	    (!(ip->ip_off & htons(IP_DF)) &&
+	    GSO_IPV4_OK(ifp, m0) || (!(ip->ip_off & htons(IP_DF)) &&
 	    (ifp->if_hwassist & CSUM_FRAGMENT))) {
 		ip->ip_sum = 0;
 		if (sw_csum & CSUM_DELAY_IP) {
@@ -483,6 +483,8 @@ pfinit(void)
 	pf_init_ruleset(&pf_main_ruleset);
 	TAILQ_INIT(&pf_pabuf);
 	TAILQ_INIT(&state_list);
+	TAILQ_INIT(&pf_state_unlinked);
+	pf_state_table_init();
 #if PF_ALTQ
 	TAILQ_INIT(&pf_altqs[0]);
 	TAILQ_INIT(&pf_altqs[1]);
@@ -1344,7 +1346,7 @@ pf_commit_rules(u_int32_t ticket, int rs_num, char *anchor)
 	rs->rules[rs_num].active.ticket =
 	    rs->rules[rs_num].inactive.ticket;
 	pf_calc_skip_steps(rs->rules[rs_num].active.ptr);
-
+	pf_rule_index_update(rs, rs_num);
 
 	/* Purge the old rule list. */
 	while ((rule = TAILQ_FIRST(old_rules)) != NULL)
@@ -2803,6 +2805,8 @@ pf_delete_rule_from_ruleset(struct pf_ruleset *ruleset, int rs_num,
 
 	pf_expire_states_and_src_nodes(rule);
 
+	/* rebuilt by pf_ruleset_cleanup() */
+	pf_rule_index_free(ruleset, rs_num);
 	pf_rm_rule(ruleset->rules[rs_num].active.ptr, rule);
 	if (ruleset->rules[rs_num].active.rcount-- == 0)
 		panic("%s: rcount value broken!", __func__);
@@ -2819,6 +2823,7 @@ static void
 pf_ruleset_cleanup(struct pf_ruleset *ruleset, int rs)
 {
 	pf_calc_skip_steps(ruleset->rules[rs].active.ptr);
+	pf_rule_index_update(ruleset, rs);
 	ruleset->rules[rs].active.ticket =
 	    ++ruleset->rules[rs].inactive.ticket;
 }
@@ -3463,6 +3468,7 @@ pfioctl_ioc_rule(u_long cmd, int minordev, struct pfioc_rule *pr, struct proc *p
 		ruleset->rules[rs_num].active.ticket++;
 
 		pf_calc_skip_steps(ruleset->rules[rs_num].active.ptr);
+		pf_rule_index_update(ruleset, rs_num);
 		pf_remove_if_empty_ruleset(ruleset);
 
 		break;
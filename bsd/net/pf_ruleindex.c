@@ -0,0 +1,559 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/socket.h>
+#include <kern/locks.h>
+
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+
+#include <net/pfvar.h>
+
+extern lck_mtx_t *pf_lock;
+
+/*
+ * Filter rule index.
+ *
+ * For every protocol, and for TCP and UDP additionally for every range
+ * of destination ports over which no rule changes its verdict, the index
+ * holds the rules of a ruleset that could possibly match such a packet,
+ * in rule order.  pf_test_rule() uses it to step over the rules that
+ * cannot match, before looking at any of their fields.  The candidate
+ * lists are conservative: a rule is left out only if its protocol or
+ * destination port rules it out, so evaluation order, "quick" and
+ * anchors behave exactly as in the linear walk.
+ *
+ * The index is rebuilt under pf_lock wherever the skip steps are
+ * recalculated.  The candidate lists are looked up by rule number, so
+ * the active rules are renumbered in queue order first; no caller has
+ * to keep the numbers dense for the index's sake.  Next to its rules,
+ * every list keeps their numbers, and for every run of
+ * 1 << PF_RULE_INDEX_SHIFT rule numbers where the first candidate at or
+ * after the run's start is; finding the next candidate takes a short
+ * scan from there, without looking at any rule.  Short rulesets, and
+ * rulesets that would need more than PF_RULE_INDEX_MAXENT entries in
+ * all of these, are not indexed.  Neither are rulesets where TCP
+ * packets, most of the traffic, would still step through more than
+ * half of the rules: a step through a list costs about twice what
+ * looking at a rule does, so such an index does not pay for itself.
+ */
+#define	PF_RULE_INDEX_MIN	16
+#define	PF_RULE_INDEX_MAXENT	(1 << 18)
+#define	PF_RULE_INDEX_SHIFT	3
+
+struct pf_rule_cand {
+	u_int32_t		  rc_count;
+	struct pf_rule		**rc_rules;
+	u_int32_t		 *rc_nr;	/* numbers of rc_rules */
+	u_int32_t		 *rc_first;	/* per run of numbers */
+};
+
+struct pf_rule_ports {
+	u_int32_t		  rp_count;	/* # of port ranges */
+	u_int16_t		 *rp_start;	/* first port, host order */
+	struct pf_rule_cand	 *rp_cand;
+};
+
+struct pf_rule_index {
+	struct pf_rule_cand	  ri_proto[256];
+	struct pf_rule_ports	  ri_tcp;
+	struct pf_rule_ports	  ri_udp;
+	struct pf_rule		**ri_pool;
+	u_int32_t		 *ri_nrpool;
+	u_int32_t		 *ri_runpool;
+	u_int32_t		  ri_poolsize;	/* # of rules in lists */
+	u_int32_t		  ri_nlists;
+	u_int32_t		  ri_nruns;	/* # of runs per list */
+};
+
+static u_int32_t
+pf_rule_index_collect(struct pf_rule **rules, u_int32_t n, u_int8_t proto,
+    int useport, u_int16_t port, struct pf_rule **out)
+{
+	struct pf_rule *r;
+	u_int32_t i, cnt = 0;
+
+	for (i = 0; i < n; i++) {
+		r = rules[i];
+		if (r->proto != 0) {
+			if (r->proto != proto)
+				continue;
+			if (useport && r->dst.xport.range.op &&
+			    !pf_match_port(r->dst.xport.range.op,
+			    r->dst.xport.range.port[0],
+			    r->dst.xport.range.port[1], htons(port)))
+				continue;
+		}
+		if (out != NULL)
+			out[cnt] = r;
+		cnt++;
+	}
+	return (cnt);
+}
+
+/*
+ * Split the port space of a protocol into ranges at every port where
+ * one of its rules may change its verdict on the destination port.
+ */
+static u_int32_t
+pf_rule_index_ports(struct pf_rule **rules, u_int32_t n, u_int8_t proto,
+    u_int8_t *map)
+{
+	struct pf_rule *r;
+	u_int32_t i, j, p[4], cnt = 0;
+
+	bzero(map, 65536 / NBBY);
+	setbit(map, 0);
+	for (i = 0; i < n; i++) {
+		r = rules[i];
+		if (r->proto != proto || !r->dst.xport.range.op)
+			continue;
+		p[0] = ntohs(r->dst.xport.range.port[0]);
+		p[1] = p[0] + 1;
+		p[2] = ntohs(r->dst.xport.range.port[1]);
+		p[3] = p[2] + 1;
+		for (j = 0; j < 4; j++)
+			if (p[j] <= 65535)
+				setbit(map, p[j]);
+	}
+	for (i = 0; i < 65536; i++)
+		if (isset(map, i))
+			cnt++;
+	return (cnt);
+}
+
+/*
+ * Set up the i'th candidate list, after used rules in the lists before
+ * it, once its rules are in place.
+ */
+static void
+pf_rule_index_runs(struct pf_rule_index *ri, struct pf_rule_cand *rc,
+    u_int32_t used, u_int32_t i)
+{
+	u_int32_t j, run = 0;
+
+	rc->rc_nr = ri->ri_nrpool + used;
+	rc->rc_first = ri->ri_runpool + i * ri->ri_nruns;
+	for (j = 0; j < rc->rc_count; j++) {
+		rc->rc_nr[j] = rc->rc_rules[j]->nr;
+		while (run <= (rc->rc_nr[j] >> PF_RULE_INDEX_SHIFT))
+			rc->rc_first[run++] = j;
+	}
+	while (run < ri->ri_nruns)
+		rc->rc_first[run++] = rc->rc_count;
+}
+
+static int
+pf_rule_index_fill(struct pf_rule_index *ri, struct pf_rule **rules,
+    u_int32_t n, u_int8_t *map, int sizing)
+{
+	struct pf_rule_ports *rp;
+	struct pf_rule_cand *rc;
+	struct pf_rule **pool = ri->ri_pool;
+	u_int32_t i, used = 0, nlists = 0, want;
+	u_int32_t nruns = (n >> PF_RULE_INDEX_SHIFT) + 1;
+	u_int8_t present[256 / NBBY];
+	u_int8_t proto;
+	int p;
+
+	bzero(present, sizeof (present));
+	for (i = 0; i < n; i++)
+		setbit(present, rules[i]->proto);
+
+	/* proto 0 is the list of wildcard rules, shared by absent protocols */
+	for (p = 0; p < 256; p++) {
+		rc = &ri->ri_proto[p];
+		if (p != 0 && !isset(present, p)) {
+			*rc = ri->ri_proto[0];
+			continue;
+		}
+		rc->rc_rules = sizing ? NULL : pool + used;
+		rc->rc_count = pf_rule_index_collect(rules, n, p, 0, 0,
+		    rc->rc_rules);
+		if (!sizing)
+			pf_rule_index_runs(ri, rc, used, nlists);
+		used += rc->rc_count;
+		nlists++;
+		if (used + nlists * nruns > PF_RULE_INDEX_MAXENT)
+			return (-1);
+	}
+
+	for (p = 0; p < 2; p++) {
+		proto = (p == 0) ? IPPROTO_TCP : IPPROTO_UDP;
+		rp = (p == 0) ? &ri->ri_tcp : &ri->ri_udp;
+		if (!isset(present, proto))
+			continue;
+		want = pf_rule_index_ports(rules, n, proto, map);
+		if (want == 1 || (u_int64_t)want *
+		    (ri->ri_proto[proto].rc_count + nruns) >
+		    PF_RULE_INDEX_MAXENT - used - nlists * nruns)
+			continue;	/* no port constraints, or too large */
+		if (sizing) {
+			for (i = 0; i < 65536; i++)
+				if (isset(map, i))
+					used += pf_rule_index_collect(rules,
+					    n, proto, 1, i, NULL);
+			nlists += want;
+			rp->rp_count = want;
+			continue;
+		}
+		if (rp->rp_count != want)
+			return (-1);
+		want = 0;
+		for (i = 0; i < 65536; i++) {
+			if (!isset(map, i))
+				continue;
+			rc = &rp->rp_cand[want];
+			rp->rp_start[want++] = i;
+			rc->rc_rules = pool + used;
+			rc->rc_count = pf_rule_index_collect(rules, n, proto,
+			    1, i, rc->rc_rules);
+			pf_rule_index_runs(ri, rc, used, nlists);
+			used += rc->rc_count;
+			nlists++;
+		}
+	}
+	if (sizing) {
+		ri->ri_poolsize = used;
+		ri->ri_nlists = nlists;
+		ri->ri_nruns = nruns;
+	}
+	return (used == ri->ri_poolsize && nlists == ri->ri_nlists ? 0 : -1);
+}
+
+static void
+pf_rule_index_destroy(struct pf_rule_index *ri)
+{
+	if (ri->ri_tcp.rp_start != NULL)
+		_FREE(ri->ri_tcp.rp_start, M_TEMP);
+	if (ri->ri_tcp.rp_cand != NULL)
+		_FREE(ri->ri_tcp.rp_cand, M_TEMP);
+	if (ri->ri_udp.rp_start != NULL)
+		_FREE(ri->ri_udp.rp_start, M_TEMP);
+	if (ri->ri_udp.rp_cand != NULL)
+		_FREE(ri->ri_udp.rp_cand, M_TEMP);
+	if (ri->ri_pool != NULL)
+		_FREE(ri->ri_pool, M_TEMP);
+	if (ri->ri_nrpool != NULL)
+		_FREE(ri->ri_nrpool, M_TEMP);
+	if (ri->ri_runpool != NULL)
+		_FREE(ri->ri_runpool, M_TEMP);
+	_FREE(ri, M_TEMP);
+}
+
+static struct pf_rule_index *
+pf_rule_index_build(struct pf_rulequeue *queue, u_int32_t rcount)
+{
+	struct pf_rule_index *ri = NULL;
+	struct pf_rule **rules = NULL, *r;
+	struct pf_rule_ports *rp;
+	u_int8_t *map = NULL;
+	u_int32_t n = 0, i, cnt;
+
+	if (rcount < PF_RULE_INDEX_MIN)
+		return (NULL);
+
+	rules = _MALLOC(rcount * sizeof (*rules), M_TEMP, M_WAITOK);
+	map = _MALLOC(65536 / NBBY, M_TEMP, M_WAITOK);
+	ri = _MALLOC(sizeof (*ri), M_TEMP, M_WAITOK | M_ZERO);
+	if (rules == NULL || map == NULL || ri == NULL)
+		goto fail;
+
+	TAILQ_FOREACH(r, queue, entries) {
+		if (n == rcount || r->nr != n)
+			goto fail;
+		rules[n++] = r;
+	}
+	if (n != rcount)
+		goto fail;
+
+	if (pf_rule_index_fill(ri, rules, n, map, 1) != 0)
+		goto fail;
+	ri->ri_pool = _MALLOC(ri->ri_poolsize * sizeof (*ri->ri_pool),
+	    M_TEMP, M_WAITOK);
+	ri->ri_nrpool = _MALLOC(ri->ri_poolsize * sizeof (*ri->ri_nrpool),
+	    M_TEMP, M_WAITOK);
+	ri->ri_runpool = _MALLOC(ri->ri_nlists * ri->ri_nruns *
+	    sizeof (*ri->ri_runpool), M_TEMP, M_WAITOK);
+	if (ri->ri_pool == NULL || ri->ri_nrpool == NULL ||
+	    ri->ri_runpool == NULL)
+		goto fail;
+	for (rp = &ri->ri_tcp; rp != NULL;
+	    rp = (rp == &ri->ri_tcp) ? &ri->ri_udp : NULL) {
+		if (rp->rp_count == 0)
+			continue;
+		rp->rp_start = _MALLOC(rp->rp_count * sizeof (*rp->rp_start),
+		    M_TEMP, M_WAITOK);
+		rp->rp_cand = _MALLOC(rp->rp_count * sizeof (*rp->rp_cand),
+		    M_TEMP, M_WAITOK);
+		if (rp->rp_start == NULL || rp->rp_cand == NULL)
+			goto fail;
+	}
+	if (pf_rule_index_fill(ri, rules, n, map, 0) != 0)
+		goto fail;
+
+	rp = &ri->ri_tcp;
+	if (rp->rp_count > 0) {
+		for (i = 0, cnt = 0; i < rp->rp_count; i++)
+			cnt += rp->rp_cand[i].rc_count;
+		cnt /= rp->rp_count;
+	} else {
+		cnt = ri->ri_proto[IPPROTO_TCP].rc_count;
+	}
+	if (cnt > n / 2)
+		goto fail;
+
+	_FREE(map, M_TEMP);
+	_FREE(rules, M_TEMP);
+	return (ri);
+
+fail:
+	if (ri != NULL)
+		pf_rule_index_destroy(ri);
+	if (map != NULL)
+		_FREE(map, M_TEMP);
+	if (rules != NULL)
+		_FREE(rules, M_TEMP);
+	return (NULL);
+}
+
+void
+pf_rule_index_free(struct pf_ruleset *rs, int rs_num)
+{
+	lck_mtx_assert(pf_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (rs->rules[rs_num].index != NULL) {
+		pf_rule_index_destroy(rs->rules[rs_num].index);
+		rs->rules[rs_num].index = NULL;
+	}
+}
+
+void
+pf_rule_index_update(struct pf_ruleset *rs, int rs_num)
+{
+	struct pf_rule *r;
+	u_int32_t nr = 0;
+
+	pf_rule_index_free(rs, rs_num);
+	if (rs_num != PF_RULESET_FILTER)
+		return;
+
+	TAILQ_FOREACH(r, rs->rules[rs_num].active.ptr, entries)
+		r->nr = nr++;
+	rs->rules[rs_num].index = pf_rule_index_build(
+	    rs->rules[rs_num].active.ptr, rs->rules[rs_num].active.rcount);
+}
+
+/*
+ * Return the candidate list for a packet of the given protocol and
+ * destination port (network order).
+ */
+struct pf_rule_cand *
+pf_rule_index_lookup(struct pf_rule_index *ri, u_int8_t proto,
+    u_int16_t dport)
+{
+	struct pf_rule_ports *rp = NULL;
+	u_int32_t lo, hi, mid;
+	u_int16_t port;
+
+	if (proto == IPPROTO_TCP)
+		rp = &ri->ri_tcp;
+	else if (proto == IPPROTO_UDP)
+		rp = &ri->ri_udp;
+	if (rp == NULL || rp->rp_count == 0)
+		return (&ri->ri_proto[proto]);
+
+	/* last range starting at or below port; rp_start[0] is 0 */
+	port = ntohs(dport);
+	lo = 0;
+	hi = rp->rp_count;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (rp->rp_start[mid] <= port)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (&rp->rp_cand[lo]);
+}
+
+/*
+ * Return the first rule at or after r on a candidate list of the index.
+ */
+struct pf_rule *
+pf_rule_index_next(struct pf_rule_index *ri, struct pf_rule_cand *rc,
+    struct pf_rule *r)
+{
+	u_int32_t i, nr = r->nr;
+
+	if ((nr >> PF_RULE_INDEX_SHIFT) >= ri->ri_nruns)
+		return (NULL);
+	for (i = rc->rc_first[nr >> PF_RULE_INDEX_SHIFT];
+	    i < rc->rc_count && rc->rc_nr[i] < nr; i++)
+		;
+	return (i < rc->rc_count ? rc->rc_rules[i] : NULL);
+}
+
+#if CONFIG_IN_KERNEL_TESTS
+/*
+ * Build the index of a private ruleset, delete a rule from the middle
+ * of it, and check that stepping through the rules with the index
+ * visits the same rules as the linear walk for a set of probe packets.
+ */
+#define	PF_RULE_INDEX_TEST_RULES	(3 * PF_RULE_INDEX_MIN)
+
+static int
+pf_rule_index_test_match(struct pf_rule *r, u_int8_t proto, u_int16_t port)
+{
+	if (r->proto == 0)
+		return (1);
+	if (r->proto != proto)
+		return (0);
+	if ((proto != IPPROTO_TCP && proto != IPPROTO_UDP) ||
+	    r->dst.xport.range.op == PF_OP_NONE)
+		return (1);
+	return (pf_match_port(r->dst.xport.range.op,
+	    r->dst.xport.range.port[0], r->dst.xport.range.port[1],
+	    htons(port)));
+}
+
+static int
+pf_rule_index_test_walk(struct pf_ruleset *rs)
+{
+	static const u_int8_t protos[] =
+	    { IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP, IPPROTO_GRE };
+	struct pf_rule_index *ri = rs->rules[PF_RULESET_FILTER].index;
+	struct pf_rule_cand *rc;
+	struct pf_rule *r, *x, *l;
+	u_int32_t i, p, port;
+
+	if (ri == NULL) {
+		printf("%s: ruleset of %u rules not indexed\n", __func__,
+		    rs->rules[PF_RULESET_FILTER].active.rcount);
+		return (1);
+	}
+	for (i = 0; i < sizeof (protos); i++) {
+		/* every port up to past the highest rule bound, and 65535 */
+		for (p = 0; p <= 1400; p++) {
+			port = (p == 0) ? 65535 : p;
+			rc = pf_rule_index_lookup(ri, protos[i], htons(port));
+			r = TAILQ_FIRST(rs->rules[PF_RULESET_FILTER].active.ptr);
+			l = r;
+			for (;;) {
+				while (l != NULL &&
+				    !pf_rule_index_test_match(l, protos[i], port))
+					l = TAILQ_NEXT(l, entries);
+				x = (r != NULL) ?
+				    pf_rule_index_next(ri, rc, r) : NULL;
+				if (x != l) {
+					printf("%s: proto %u port %u: rule %d, "
+					    "expected %d\n", __func__, protos[i],
+					    port, x ? (int)x->nr : -1,
+					    l ? (int)l->nr : -1);
+					return (1);
+				}
+				if (l == NULL)
+					break;
+				r = l = TAILQ_NEXT(l, entries);
+			}
+		}
+	}
+	return (0);
+}
+
+int
+pf_rule_index_test(void)
+{
+	static const u_int8_t protos[] = { IPPROTO_TCP, IPPROTO_UDP, 0,
+	    IPPROTO_ICMP };
+	struct pf_rulequeue	 queue;
+	struct pf_ruleset	*rs;
+	struct pf_rule		*rules, *r;
+	u_int32_t		 i;
+	int			 error = 1;
+
+	rs = _MALLOC(sizeof (*rs), M_TEMP, M_WAITOK | M_ZERO);
+	rules = _MALLOC(PF_RULE_INDEX_TEST_RULES * sizeof (*rules), M_TEMP,
+	    M_WAITOK | M_ZERO);
+	if (rs == NULL || rules == NULL)
+		goto done;
+
+	TAILQ_INIT(&queue);
+	for (i = 0; i < PF_RULE_INDEX_TEST_RULES; i++) {
+		r = &rules[i];
+		r->nr = i;
+		r->proto = protos[i % sizeof (protos)];
+		if (r->proto == IPPROTO_TCP || r->proto == IPPROTO_UDP) {
+			switch (i % 3) {
+			case 1:
+				r->dst.xport.range.op = PF_OP_EQ;
+				r->dst.xport.range.port[0] =
+				    htons(1000 + i * 7);
+				break;
+			case 2:
+				r->dst.xport.range.op = PF_OP_RRG;
+				r->dst.xport.range.port[0] =
+				    htons(500 + i * 10);
+				r->dst.xport.range.port[1] =
+				    htons(800 + i * 10);
+				break;
+			}
+		}
+		TAILQ_INSERT_TAIL(&queue, r, entries);
+	}
+	rs->rules[PF_RULESET_FILTER].active.ptr = &queue;
+	rs->rules[PF_RULESET_FILTER].active.rcount = i;
+
+	lck_mtx_lock(pf_lock);
+	pf_rule_index_update(rs, PF_RULESET_FILTER);
+	error = pf_rule_index_test_walk(rs);
+
+	/* delete rules from the middle, leaving holes in the numbering */
+	for (i = PF_RULE_INDEX_TEST_RULES / 2;
+	    error == 0 && i < PF_RULE_INDEX_TEST_RULES / 2 + 3; i++) {
+		TAILQ_REMOVE(&queue, &rules[i], entries);
+		rs->rules[PF_RULESET_FILTER].active.rcount--;
+		pf_rule_index_update(rs, PF_RULESET_FILTER);
+		error = pf_rule_index_test_walk(rs);
+	}
+	pf_rule_index_free(rs, PF_RULESET_FILTER);
+	lck_mtx_unlock(pf_lock);
+
+done:
+	if (rules != NULL)
+		_FREE(rules, M_TEMP);
+	if (rs != NULL)
+		_FREE(rs, M_TEMP);
+	return (error);
+}
+#endif /* CONFIG_IN_KERNEL_TESTS */
@@ -996,8 +996,10 @@ struct pf_state_key {
 	u_int32_t	 flowsrc;
 	u_int32_t	 flowhash;
 
-	RB_ENTRY(pf_state_key)	 entry_lan_ext;
-	RB_ENTRY(pf_state_key)	 entry_ext_gwy;
+	TAILQ_ENTRY(pf_state_key) entry_lan_ext;
+	TAILQ_ENTRY(pf_state_key) entry_ext_gwy;
+	u_int32_t		 hash_lan_ext;
+	u_int32_t		 hash_ext_gwy;
 	struct pf_statelist	 states;
 	u_int32_t	 refcnt;
 };
@@ -1182,6 +1184,8 @@ struct pfsync_state {
 TAILQ_HEAD(pf_rulequeue, pf_rule);
 
 struct pf_anchor;
+struct pf_rule_index;
+struct pf_rule_cand;
 
 struct pf_ruleset {
 	struct {
@@ -1193,6 +1197,7 @@ struct pf_ruleset {
 			u_int32_t		 ticket;
 			int			 open;
 		}			 active, inactive;
+		struct pf_rule_index	*index;	/* of active rules, or NULL */
 	}			 rules[PF_RULESET_MAX];
 	struct pf_anchor	*anchor;
 	u_int32_t		 tticket;
@@ -1335,19 +1340,25 @@ struct pfr_ktable {
 #define pfrkt_nomatch	pfrkt_ts.pfrts_nomatch
 #define pfrkt_tzero	pfrkt_ts.pfrts_tzero
 
-RB_HEAD(pf_state_tree_lan_ext, pf_state_key);
-RB_PROTOTYPE_SC(__private_extern__, pf_state_tree_lan_ext, pf_state_key,
-    entry_lan_ext, pf_state_compare_lan_ext);
+TAILQ_HEAD(pf_state_keyq, pf_state_key);
 
-RB_HEAD(pf_state_tree_ext_gwy, pf_state_key);
-RB_PROTOTYPE_SC(__private_extern__, pf_state_tree_ext_gwy, pf_state_key,
-    entry_ext_gwy, pf_state_compare_ext_gwy);
+/*
+ * State key hash table bucket; protected by pf_lock.
+ */
+struct pf_state_bucket {
+	struct pf_state_keyq	 psb_keys;
+};
+
+struct pf_state_table {
+	struct pf_state_bucket	*pst_buckets;
+	u_int32_t		 pst_mask;
+};
 
 RB_HEAD(pfi_ifhead, pfi_kif);
 
 /* state tables */
-extern struct pf_state_tree_lan_ext	 pf_statetbl_lan_ext;
-extern struct pf_state_tree_ext_gwy	 pf_statetbl_ext_gwy;
+extern struct pf_state_table	 pf_statetbl_lan_ext;
+extern struct pf_state_table	 pf_statetbl_ext_gwy;
 
 /* keep synced with pfi_kif, used in RB_FIND */
 struct pfi_kif_cmp {
@@ -2144,6 +2155,7 @@ RB_PROTOTYPE_SC(__private_extern__, pf_state_tree_id, pf_state,
     entry_id, pf_state_compare_id);
 extern struct pf_state_tree_id tree_id;
 extern struct pf_state_queue state_list;
+extern struct pf_state_queue pf_state_unlinked;
 
 TAILQ_HEAD(pf_poolqueue, pf_pool);
 extern struct pf_poolqueue	pf_pools[2];
@@ -2166,6 +2178,12 @@ __private_extern__ int pf_tbladdr_setup(struct pf_ruleset *,
 __private_extern__ void pf_tbladdr_remove(struct pf_addr_wrap *);
 __private_extern__ void pf_tbladdr_copyout(struct pf_addr_wrap *);
 __private_extern__ void pf_calc_skip_steps(struct pf_rulequeue *);
+__private_extern__ void pf_rule_index_update(struct pf_ruleset *, int);
+__private_extern__ void pf_rule_index_free(struct pf_ruleset *, int);
+__private_extern__ struct pf_rule_cand *pf_rule_index_lookup(
+    struct pf_rule_index *, u_int8_t, u_int16_t);
+__private_extern__ struct pf_rule *pf_rule_index_next(struct pf_rule_index *,
+    struct pf_rule_cand *, struct pf_rule *);
 __private_extern__ u_int32_t pf_calc_state_key_flowhash(struct pf_state_key *);
 
 extern struct pool pf_src_tree_pl, pf_rule_pl;
@@ -2182,6 +2200,7 @@ __private_extern__ void pfinit(void);
 __private_extern__ void pf_purge_thread_fn(void *, wait_result_t);
 __private_extern__ void pf_purge_expired_src_nodes(void);
 __private_extern__ void pf_purge_expired_states(u_int32_t);
+__private_extern__ void pf_state_table_init(void);
 __private_extern__ void pf_unlink_state(struct pf_state *);
 __private_extern__ void pf_free_state(struct pf_state *);
 __private_extern__ int pf_insert_state(struct pfi_kif *, struct pf_state *);
@@ -83,6 +83,9 @@
  */
 static int priq_enqueue_ifclassq(struct ifclassq *, struct mbuf *);
 static struct mbuf *priq_dequeue_ifclassq(struct ifclassq *, cqdq_op_t);
+static struct mbuf *priq_dequeue_multi_ifclassq(struct ifclassq *,
+    mbuf_svc_class_t, u_int32_t, u_int32_t, struct mbuf **, u_int32_t *,
+    u_int32_t *);
 static int priq_request_ifclassq(struct ifclassq *, cqrq_t, void *);
 static int priq_clear_interface(struct priq_if *);
 static struct priq_class *priq_class_create(struct priq_if *, int, u_int32_t,
@@ -993,6 +996,69 @@ priq_dequeue_ifclassq(struct ifclassq *ifq, cqdq_op_t op)
 	return (priq_dequeue(ifq->ifcq_disc, op));
 }
 
+/*
+ * priq_dequeue_multi_ifclassq is a dequeue function to be registered to
+ * (*ifcq_dequeue_multi) in struct ifclassq.
+ *
+ * The highest priority class stays the highest until it is empty, so
+ * it is drained in one go and the class accounting is updated once
+ * per class rather than once per packet.
+ */
+static struct mbuf *
+priq_dequeue_multi_ifclassq(struct ifclassq *ifq, mbuf_svc_class_t sc,
+    u_int32_t pkt_limit, u_int32_t byte_limit, struct mbuf **tail,
+    u_int32_t *cnt, u_int32_t *len)
+{
+#pragma unused(sc)
+	struct priq_if *pif = ifq->ifcq_disc;
+	struct mbuf *head = NULL, **mp = &head, *m;
+	struct priq_class *cl;
+	u_int32_t pri, i = 0, l = 0, n, b;
+
+	IFCQ_LOCK_ASSERT_HELD(ifq);
+
+	*tail = NULL;
+	while (i < pkt_limit && l < byte_limit && pif->pif_bitmap != 0) {
+		VERIFY(!IFCQ_IS_EMPTY(ifq));
+
+		pri = pktsched_fls(pif->pif_bitmap) - 1;	/* zero based */
+		VERIFY(pri < PRIQ_MAXPRI);
+		cl = pif->pif_classes[pri];
+		VERIFY(cl != NULL && !qempty(&cl->cl_q));
+
+		n = b = 0;
+		do {
+			m = priq_getq(cl);
+			VERIFY(m != NULL); /* qalg must be work conserving */
+			m->m_nextpkt = NULL;
+			*mp = m;
+			mp = &m->m_nextpkt;
+			*tail = m;
+			n++;
+			b += m_pktlen(m);
+		} while (!qempty(&cl->cl_q) && (i + n) < pkt_limit &&
+		    (l + b) < byte_limit);
+
+		VERIFY(IFCQ_LEN(ifq) >= n);
+		IFCQ_LEN(ifq) -= n;
+		if (qempty(&cl->cl_q)) {
+			cl->cl_period++;
+			/* class is now inactive; indicate it as such */
+			pktsched_bit_clr(pri, &pif->pif_bitmap);
+		}
+		PKTCNTR_ADD(&cl->cl_xmitcnt, n, b);
+		IFCQ_XMIT_ADD(ifq, n, b);
+
+		i += n;
+		l += b;
+	}
+
+	*cnt = i;
+	*len = l;
+
+	return (head);
+}
+
 static int
 priq_request_ifclassq(struct ifclassq *ifq, cqrq_t req, void *arg)
 {
@@ -1101,7 +1167,7 @@ priq_setup_ifclassq(struct ifclassq *ifq, u_int32_t flags)
 
 	err = ifclassq_attach(ifq, PKTSCHEDT_PRIQ, pif,
 	    priq_enqueue_ifclassq, priq_dequeue_ifclassq, NULL,
-	    priq_request_ifclassq);
+	    priq_dequeue_multi_ifclassq, priq_request_ifclassq);
 
 	/* cache these for faster lookup */
 	if (err == 0) {
@@ -83,6 +83,9 @@
  */
 static int qfq_enqueue_ifclassq(struct ifclassq *, struct mbuf *);
 static struct mbuf *qfq_dequeue_ifclassq(struct ifclassq *, cqdq_op_t);
+static struct mbuf *qfq_dequeue_multi_ifclassq(struct ifclassq *,
+    mbuf_svc_class_t, u_int32_t, u_int32_t, struct mbuf **, u_int32_t *,
+    u_int32_t *);
 static int qfq_request_ifclassq(struct ifclassq *, cqrq_t, void *);
 static int qfq_clear_interface(struct qfq_if *);
 static struct qfq_class *qfq_class_create(struct qfq_if *, u_int32_t,
@@ -463,12 +466,13 @@ qfq_class_create(struct qfq_if *qif, u_int32_t weight, u_int32_t qlimit,
 #endif /* CLASSQ_BLUE */
 
 	/* These are mutually exclusive */
-	if ((flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB)) &&
-	    (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB)) != QFCF_RED &&
-	    (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB)) != QFCF_RIO &&
-	    (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB)) != QFCF_BLUE &&
-	    (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB)) != QFCF_SFB) {
-		log(LOG_ERR, "%s: %s more than one RED|RIO|BLUE|SFB\n",
+	if ((flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB|QFCF_FQ_CODEL)) &&
+	    (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB|QFCF_FQ_CODEL)) != QFCF_RED &&
+	    (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB|QFCF_FQ_CODEL)) != QFCF_RIO &&
+	    (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB|QFCF_FQ_CODEL)) != QFCF_BLUE &&
+	    (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB|QFCF_FQ_CODEL)) != QFCF_SFB &&
+	    (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB|QFCF_FQ_CODEL)) != QFCF_FQ_CODEL) {
+		log(LOG_ERR, "%s: %s more than one RED|RIO|BLUE|SFB|FQ_CODEL\n",
 		    if_name(QFQIF_IFP(qif)), qfq_style(qif));
 		return (NULL);
 	}
@@ -561,7 +565,7 @@ qfq_class_create(struct qfq_if *qif, u_int32_t weight, u_int32_t qlimit,
 	if (flags & QFCF_DEFAULTCLASS)
 		qif->qif_default = cl;
 
-	if (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB)) {
+	if (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB|QFCF_FQ_CODEL)) {
 #if CLASSQ_RED || CLASSQ_RIO
 		u_int64_t ifbandwidth = ifnet_output_linkrate(ifp);
 		int pkttime;
@@ -573,6 +577,8 @@ qfq_class_create(struct qfq_if *qif, u_int32_t weight, u_int32_t qlimit,
 				cl->cl_qflags |= BLUEF_ECN;
 			else if (flags & QFCF_SFB)
 				cl->cl_qflags |= SFBF_ECN;
+			else if (flags & QFCF_FQ_CODEL)
+				cl->cl_qflags |= FQCF_ECN;
 			else if (flags & QFCF_RED)
 				cl->cl_qflags |= REDF_ECN;
 			else if (flags & QFCF_RIO)
@@ -601,7 +607,10 @@ qfq_class_create(struct qfq_if *qif, u_int32_t weight, u_int32_t qlimit,
 			pkttime = (int64_t)ifp->if_mtu * 1000 * 1000 * 1000 /
 			    (ifbandwidth / 8);
 
-		/* Test for exclusivity {RED,RIO,BLUE,SFB} was done above */
+		/*
+		 * Test for exclusivity {RED,RIO,BLUE,SFB,FQ_CODEL} was
+		 * done above
+		 */
 #if CLASSQ_RED
 		if (flags & QFCF_RED) {
 			cl->cl_red = red_alloc(ifp, 0, 0,
@@ -635,6 +644,14 @@ qfq_class_create(struct qfq_if *qif, u_int32_t weight, u_int32_t qlimit,
 			if (cl->cl_sfb != NULL || (cl->cl_flags & QFCF_LAZY))
 				qtype(&cl->cl_q) = Q_SFB;
 		}
+		if (flags & QFCF_FQ_CODEL) {
+			if (!(cl->cl_flags & QFCF_LAZY))
+				cl->cl_fq_codel = fq_codel_alloc(ifp,
+				    cl->cl_handle, cl->cl_qflags);
+			if (cl->cl_fq_codel != NULL ||
+			    (cl->cl_flags & QFCF_LAZY))
+				qtype(&cl->cl_q) = Q_FQ_CODEL;
+		}
 	}
 
 	if (pktsched_verbose) {
@@ -698,6 +715,8 @@ qfq_class_destroy(struct qfq_if *qif, struct qfq_class *cl)
 #endif /* CLASSQ_BLUE */
 		if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 			sfb_destroy(cl->cl_sfb);
+		if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+			fq_codel_destroy(cl->cl_fq_codel);
 		cl->cl_qalg.ptr = NULL;
 		qtype(&cl->cl_q) = Q_DROPTAIL;
 		qstate(&cl->cl_q) = QS_RUNNING;
@@ -911,7 +930,7 @@ qfq_update_class(struct qfq_if *qif, struct qfq_group *grp,
 		u_int32_t len;
 		u_int64_t roundedS;
 
-		len = m_pktlen(qhead(&cl->cl_q));
+		len = m_pktlen(qfq_pollq(cl));
 		cl->cl_F = cl->cl_S + (u_int64_t)len * cl->cl_inv_w;
 		roundedS = qfq_round_down(cl->cl_S, grp->qfg_slot_shift);
 		if (roundedS == grp->qfg_S)
@@ -1367,6 +1386,43 @@ qfq_addq(struct qfq_class *cl, struct mbuf *m, struct pf_mtag *t)
 		}
 		if (cl->cl_sfb != NULL)
 			return (sfb_addq(cl->cl_sfb, &cl->cl_q, m, t));
+	} else if (q_is_fq_codel(&cl->cl_q)) {
+		if (cl->cl_fq_codel == NULL) {
+			struct ifnet *ifp = QFQIF_IFP(qif);
+
+			VERIFY(cl->cl_flags & QFCF_LAZY);
+			cl->cl_flags &= ~QFCF_LAZY;
+			IFCQ_CONVERT_LOCK(ifq);
+
+			cl->cl_fq_codel = fq_codel_alloc(ifp, cl->cl_handle,
+			    cl->cl_qflags);
+			if (cl->cl_fq_codel == NULL) {
+				/* fall back to droptail */
+				qtype(&cl->cl_q) = Q_DROPTAIL;
+				cl->cl_flags &= ~QFCF_FQ_CODEL;
+				cl->cl_qflags &= ~FQCF_ECN;
+
+				log(LOG_ERR, "%s: %s FQ-CoDel lazy allocation "
+				    "failed for qid=%d grp=%d, falling back "
+				    "to DROPTAIL\n", if_name(ifp),
+				    qfq_style(qif), cl->cl_handle,
+				    cl->cl_grp->qfg_index);
+			} else if (qif->qif_throttle != IFNET_THROTTLE_OFF) {
+				/* if there's pending throttling, set it */
+				cqrq_throttle_t tr = { 1, qif->qif_throttle };
+				int err = qfq_throttle(qif, &tr);
+
+				if (err == EALREADY)
+					err = 0;
+				if (err != 0) {
+					tr.level = IFNET_THROTTLE_OFF;
+					(void) qfq_throttle(qif, &tr);
+				}
+			}
+		}
+		if (cl->cl_fq_codel != NULL)
+			return (fq_codel_addq(cl->cl_fq_codel, &cl->cl_q,
+			    m, t));
 	} else if (qlen(&cl->cl_q) >= qlimit(&cl->cl_q)) {
 		IFCQ_CONVERT_LOCK(ifq);
 		m_freem(m);
@@ -1405,6 +1461,8 @@ qfq_getq(struct qfq_class *cl)
 #endif /* CLASSQ_BLUE */
 	if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 		return (sfb_getq(cl->cl_sfb, &cl->cl_q));
+	else if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+		return (fq_codel_getq(cl->cl_fq_codel, &cl->cl_q));
 
 	return (_getq(&cl->cl_q));
 }
@@ -1414,6 +1472,9 @@ qfq_pollq(struct qfq_class *cl)
 {
 	IFCQ_LOCK_ASSERT_HELD(cl->cl_qif->qif_ifq);
 
+	if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+		return (fq_codel_pollq(cl->cl_fq_codel, &cl->cl_q));
+
 	return (qhead(&cl->cl_q));
 }
 
@@ -1449,6 +1510,8 @@ qfq_purgeq(struct qfq_if *qif, struct qfq_class *cl, u_int32_t flow,
 #endif /* CLASSQ_BLUE */
 	if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 		sfb_purgeq(cl->cl_sfb, &cl->cl_q, flow, &cnt, &len);
+	else if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+		fq_codel_purgeq(cl->cl_fq_codel, &cl->cl_q, flow, &cnt, &len);
 	else
 		_flushq_flow(&cl->cl_q, flow, &cnt, &len);
 
@@ -1510,6 +1573,8 @@ qfq_updateq(struct qfq_if *qif, struct qfq_class *cl, cqev_t ev)
 #endif /* CLASSQ_BLUE */
 	if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 		return (sfb_updateq(cl->cl_sfb, ev));
+	if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+		return (fq_codel_updateq(cl->cl_fq_codel, ev));
 }
 
 int
@@ -1549,6 +1614,8 @@ qfq_get_class_stats(struct qfq_if *qif, u_int32_t qid,
 #endif /* CLASSQ_BLUE */
 	if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 		sfb_getstats(cl->cl_sfb, &sp->sfb);
+	if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+		fq_codel_getstats(cl->cl_fq_codel, &sp->fq_codel);
 
 	return (0);
 }
@@ -1761,6 +1828,42 @@ qfq_dequeue_ifclassq(struct ifclassq *ifq, cqdq_op_t op)
 	return (qfq_dequeue(ifq->ifcq_disc, op));
 }
 
+/*
+ * qfq_dequeue_multi_ifclassq is a dequeue function to be registered to
+ * (*ifcq_dequeue_multi) in struct ifclassq.  Each packet still has to go
+ * through the virtual time update, but the chain is built without going
+ * back to ifclassq for every packet.
+ */
+static struct mbuf *
+qfq_dequeue_multi_ifclassq(struct ifclassq *ifq, mbuf_svc_class_t sc,
+    u_int32_t pkt_limit, u_int32_t byte_limit, struct mbuf **tail,
+    u_int32_t *cnt, u_int32_t *len)
+{
+#pragma unused(sc)
+	struct qfq_if *qif = ifq->ifcq_disc;
+	struct mbuf *head = NULL, **mp = &head, *m;
+	u_int32_t i = 0, l = 0;
+
+	IFCQ_LOCK_ASSERT_HELD(ifq);
+
+	*tail = NULL;
+	while (i < pkt_limit && l < byte_limit) {
+		if ((m = qfq_dequeue(qif, CLASSQDQ_REMOVE)) == NULL)
+			break;
+		m->m_nextpkt = NULL;
+		*mp = m;
+		mp = &m->m_nextpkt;
+		*tail = m;
+		i++;
+		l += m_pktlen(m);
+	}
+
+	*cnt = i;
+	*len = l;
+
+	return (head);
+}
+
 static int
 qfq_request_ifclassq(struct ifclassq *ifq, cqrq_t req, void *arg)
 {
@@ -1814,6 +1917,8 @@ qfq_setup_ifclassq(struct ifclassq *ifq, u_int32_t flags)
 		qflags |= QFCF_BLUE;
 	if (flags & PKTSCHEDF_QALG_SFB)
 		qflags |= QFCF_SFB;
+	if (flags & PKTSCHEDF_QALG_FQ_CODEL)
+		qflags |= QFCF_FQ_CODEL;
 	if (flags & PKTSCHEDF_QALG_ECN)
 		qflags |= QFCF_ECN;
 	if (flags & PKTSCHEDF_QALG_FLOWCTL)
@@ -1870,7 +1975,7 @@ qfq_setup_ifclassq(struct ifclassq *ifq, u_int32_t flags)
 
 	err = ifclassq_attach(ifq, PKTSCHEDT_QFQ, qif,
 	    qfq_enqueue_ifclassq, qfq_dequeue_ifclassq, NULL,
-	    qfq_request_ifclassq);
+	    qfq_dequeue_multi_ifclassq, qfq_request_ifclassq);
 
 	/* cache these for faster lookup */
 	if (err == 0) {
@@ -2029,6 +2134,8 @@ qfq_resumeq(struct qfq_if *qif, struct qfq_class *cl)
 #endif /* CLASSQ_BLUE */
 	if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 		err = sfb_suspendq(cl->cl_sfb, &cl->cl_q, FALSE);
+	else if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+		err = fq_codel_suspendq(cl->cl_fq_codel, &cl->cl_q, FALSE);
 
 	if (err == 0)
 		qstate(&cl->cl_q) = QS_RUNNING;
@@ -2066,6 +2173,14 @@ qfq_suspendq(struct qfq_if *qif, struct qfq_class *cl)
 			VERIFY(cl->cl_flags & QFCF_LAZY);
 			err = ENXIO;	/* delayed throttling */
 		}
+	} else if (q_is_fq_codel(&cl->cl_q)) {
+		if (cl->cl_fq_codel != NULL) {
+			err = fq_codel_suspendq(cl->cl_fq_codel, &cl->cl_q,
+			    TRUE);
+		} else {
+			VERIFY(cl->cl_flags & QFCF_LAZY);
+			err = ENXIO;	/* delayed throttling */
+		}
 	}
 
 	if (err == 0 || err == ENXIO)
@@ -62,6 +62,7 @@
 #include <net/classq/classq_rio.h>
 #include <net/classq/classq_blue.h>
 #include <net/classq/classq_sfb.h>
+#include <net/classq/classq_fq_codel.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -77,21 +78,23 @@ extern "C" {
 #define	QFCF_FLOWCTL		0x0400	/* enable flow control advisories */
 #define	QFCF_DEFAULTCLASS	0x1000	/* default class */
 #define	QFCF_DELAYBASED		0x2000	/* queue sizing is delay based */
+#define	QFCF_FQ_CODEL		0x4000	/* use FQ-CoDel */
 #ifdef BSD_KERNEL_PRIVATE
 #define	QFCF_LAZY		0x10000000 /* on-demand resource allocation */
 #endif /* BSD_KERNEL_PRIVATE */
 
 #define	QFCF_USERFLAGS							\
 	(QFCF_RED | QFCF_ECN | QFCF_RIO | QFCF_CLEARDSCP | QFCF_BLUE |	\
-	QFCF_SFB | QFCF_FLOWCTL | QFCF_DEFAULTCLASS)
+	QFCF_SFB | QFCF_FLOWCTL | QFCF_DEFAULTCLASS | QFCF_FQ_CODEL)
 
 #ifdef BSD_KERNEL_PRIVATE
 #define	QFCF_BITS \
 	"\020\1RED\2ECN\3RIO\5CLEARDSCP\11BLUE\12SFB\13FLOWCTL\15DEFAULT" \
-	"\35LAZY"
+	"\17FQ_CODEL\35LAZY"
 #else
 #define	QFCF_BITS \
-	"\020\1RED\2ECN\3RIO\5CLEARDSCP\11BLUE\12SFB\13FLOWCTL\15DEFAULT"
+	"\020\1RED\2ECN\3RIO\5CLEARDSCP\11BLUE\12SFB\13FLOWCTL\15DEFAULT" \
+	"\17FQ_CODEL"
 #endif /* !BSD_KERNEL_PRIVATE */
 
 #define	QFQ_MAX_CLASSES		32
@@ -117,6 +120,7 @@ struct qfq_classstats {
 		struct red_stats	red[RIO_NDROPPREC];
 		struct blue_stats	blue;
 		struct sfb_stats	sfb;
+		struct fq_codel_stats	fq_codel;
 	};
 	classq_state_t		qstate;
 };
@@ -208,6 +212,7 @@ struct qfq_class {
 		struct rio	*rio;	/* RIO state */
 		struct blue	*blue;	/* BLUE state */
 		struct sfb	*sfb;	/* SFB state */
+		struct fq_codel	*fq_codel; /* FQ-CoDel state */
 	} cl_qalg;
 	struct qfq_if	*cl_qif;	/* back pointer to qif */
 	u_int32_t	cl_flags;	/* class flags */
@@ -233,6 +238,7 @@ struct qfq_class {
 #define	cl_rio	cl_qalg.rio
 #define	cl_blue	cl_qalg.blue
 #define	cl_sfb	cl_qalg.sfb
+#define	cl_fq_codel	cl_qalg.fq_codel
 
 /*
  * Group descriptor, see the paper for details.
@@ -36,6 +36,7 @@
 #include <net/classq/classq_rio.h>
 #include <net/classq/classq_blue.h>
 #include <net/classq/classq_sfb.h>
+#include <net/classq/classq_fq_codel.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -53,21 +54,22 @@ extern "C" {
 #define	TQCF_FLOWCTL		0x0400	/* enable flow control advisories */
 #define	TQCF_DEFAULTCLASS	0x1000	/* default class */
 #define TQCF_DELAYBASED		0x2000	/* queue sizing is delay based */
+#define	TQCF_FQ_CODEL		0x4000	/* use FQ-CoDel */
 #ifdef BSD_KERNEL_PRIVATE
 #define	TQCF_LAZY		0x10000000 /* on-demand resource allocation */
 #endif /* BSD_KERNEL_PRIVATE */
 
 #define	TQCF_USERFLAGS							\
 	(TQCF_RED | TQCF_ECN | TQCF_RIO | TQCF_CLEARDSCP | TQCF_BLUE |	\
-	TQCF_SFB | TQCF_FLOWCTL | TQCF_DEFAULTCLASS)
+	TQCF_SFB | TQCF_FLOWCTL | TQCF_DEFAULTCLASS | TQCF_FQ_CODEL)
 
 #ifdef BSD_KERNEL_PRIVATE
 #define	TQCF_BITS \
 	"\020\1RED\2ECN\3RIO\5CLEARDSCP\11BLUE\12SFB\13FLOWCTL\15DEFAULT" \
-	"\35LAZY"
+	"\17FQ_CODEL\35LAZY"
 #else
 #define	TQCF_BITS \
-	"\020\1RED\2ECN\3RIO\5CLEARDSCP\11BLUE\12SFB\13FLOWCTL"
+	"\020\1RED\2ECN\3RIO\5CLEARDSCP\11BLUE\12SFB\13FLOWCTL\17FQ_CODEL"
 #endif /* !BSD_KERNEL_PRIVATE */
 
 struct tcq_classstats {
@@ -87,6 +89,7 @@ struct tcq_classstats {
 		struct red_stats	red[RIO_NDROPPREC];
 		struct blue_stats	blue;
 		struct sfb_stats	sfb;
+		struct fq_codel_stats	fq_codel;
 	};
 	classq_state_t		qstate;
 };
@@ -102,6 +105,7 @@ struct tcq_class {
 		struct rio	*rio;	/* RIO state */
 		struct blue	*blue;	/* BLUE state */
 		struct sfb	*sfb;	/* SFB state */
+		struct fq_codel	*fq_codel; /* FQ-CoDel state */
 	} cl_qalg;
 	int32_t		cl_pri;		/* priority */
 	u_int32_t	cl_flags;	/* class flags */
@@ -117,6 +121,7 @@ struct tcq_class {
 #define	cl_rio	cl_qalg.rio
 #define	cl_blue	cl_qalg.blue
 #define	cl_sfb	cl_qalg.sfb
+#define	cl_fq_codel	cl_qalg.fq_codel
 
 /* tcq_if flags */
 #define	TCQIFF_ALTQ		0x1	/* configured via PF/ALTQ */
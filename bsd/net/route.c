@@ -305,6 +305,8 @@ static struct sockaddr *sa_trim(struct sockaddr *, int);
 static struct radix_node *node_lookup(struct sockaddr *, struct sockaddr *,
     unsigned int);
 static struct radix_node *node_lookup_default(int);
+static struct radix_node *rt_lookup_scoped(boolean_t, struct sockaddr *,
+    struct sockaddr *, unsigned int);
 static struct rtentry *rt_lookup_common(boolean_t, boolean_t, struct sockaddr *,
     struct sockaddr *, struct radix_node_head *, unsigned int);
 static int rn_match_ifscope(struct radix_node *, void *);
@@ -450,6 +452,8 @@ route_init(void)
 	zone_change(rte_zone, Z_NOENCRYPT, TRUE);
 
 	TAILQ_INIT(&rttrash_head);
+
+	rtfib_init();
 }
 
 /*
@@ -469,9 +473,10 @@ rt_primary_default(struct rtentry *rt, struct sockaddr *dst)
 void
 set_primary_ifscope(int af, unsigned int ifscope)
 {
-	if (af == AF_INET)
+	if (af == AF_INET) {
 		primary_ifscope = ifscope;
-	else
+		rtfib_schedule();
+	} else
 		primary6_ifscope = ifscope;
 }
 
@@ -821,6 +826,7 @@ void
 routegenid_inet_update(void)
 {
 	atomic_add_32(&route_genid_inet, 1);
+	rtfib_schedule();
 }
 
 #if INET6
@@ -872,8 +878,11 @@ void
 rtalloc_ign(struct route *ro, uint32_t ignore)
 {
 	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_NOTOWNED);
+	if (rtfib_alloc(ro, ignore, IFSCOPE_NONE))
+		return;
 	lck_mtx_lock(rnh_lock);
 	rtalloc_ign_common_locked(ro, ignore, IFSCOPE_NONE);
+	rtcache_fill(ro, IFSCOPE_NONE);
 	lck_mtx_unlock(rnh_lock);
 }
 
@@ -881,8 +890,11 @@ void
 rtalloc_scoped_ign(struct route *ro, uint32_t ignore, unsigned int ifscope)
 {
 	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_NOTOWNED);
+	if (rtfib_alloc(ro, ignore, ifscope))
+		return;
 	lck_mtx_lock(rnh_lock);
 	rtalloc_ign_common_locked(ro, ignore, ifscope);
+	rtcache_fill(ro, ifscope);
 	lck_mtx_unlock(rnh_lock);
 }
 
@@ -1102,6 +1114,7 @@ rtfree_common(struct rtentry *rt, boolean_t locked)
 	if (!(rt->rt_flags & RTF_UP)) {
 		struct rtentry *rt_parent;
 		struct ifaddr *rt_ifa;
+		int af = rt_key(rt)->sa_family;
 
 		if (rt->rt_nodes->rn_flags & (RNF_ACTIVE | RNF_ROOT)) {
 			panic("rt %p freed while in radix tree\n", rt);
@@ -1163,10 +1176,15 @@ rtfree_common(struct rtentry *rt, boolean_t locked)
 		nstat_route_detach(rt);
 
 		/*
-		 * and the rtentry itself of course
+		 * and the rtentry itself of course; lock-free readers of
+		 * the forwarding table may still be looking at an AF_INET
+		 * entry, so leave it to rtfib to destroy it once they're
+		 * done.
 		 */
-		rte_lock_destroy(rt);
-		rte_free(rt);
+		if (af == AF_INET)
+			rtfib_retire(rt);
+		else
+			rte_destroy(rt);
 	} else {
 		/*
 		 * The "close method" has been called, but the route is
@@ -1756,6 +1774,8 @@ rtrequest_common_locked(int req, struct sockaddr *dst0,
 			/* NOTREACHED */
 		}
 		rt = (struct rtentry *)rn;
+		if (af == AF_INET)
+			rtfib_dirty(rt_key(rt), rt_mask(rt));
 
 		RT_LOCK(rt);
 		rt->rt_flags &= ~RTF_UP;
@@ -2143,8 +2163,15 @@ makeroute:
 			RT_ADDREF_LOCKED(rt);
 		}
 
-		if (af == AF_INET)
+		/*
+		 * Nothing can be holding a route to a host clone that was
+		 * just created, and the forwarding table resolves it to its
+		 * parent; see rtfib_clone().
+		 */
+		if (af == AF_INET && !rtfib_clone(rt)) {
+			rtfib_dirty(rt_key(rt), rt_mask(rt));
 			routegenid_inet_update();
+		}
 #if INET6
 		else if (af == AF_INET6)
 			routegenid_inet6_update();
@@ -2735,83 +2762,18 @@ node_lookup_default(int af)
 }
 
 /*
- * Common routine to lookup/match a route.  It invokes the lookup/matchaddr
- * callback which could be address family-specific.  The main difference
- * between the two (at least for AF_INET/AF_INET6) is that a lookup does
- * not alter the expiring state of a route, whereas a match would unexpire
- * or revalidate the route.
- *
- * The optional scope or interface index property of a route allows for a
- * per-interface route instance.  This permits multiple route entries having
- * the same destination (but not necessarily the same gateway) to exist in
- * the routing table; each of these entries is specific to the corresponding
- * interface.  This is made possible by storing the scope ID value into the
- * radix key, thus making each route entry unique.  These scoped entries
- * exist along with the regular, non-scoped entries in the same radix tree
- * for a given address family (AF_INET/AF_INET6); the scope logically
- * partitions it into multiple per-interface sub-trees.
- *
- * When a scoped route lookup is performed, the routing table is searched for
- * the best match that would result in a route using the same interface as the
- * one associated with the scope (the exception to this are routes that point
- * to the loopback interface).  The search rule follows the longest matching
- * prefix with the additional interface constraint.
+ * Scoped part of rt_lookup_common(): pick the radix node for dst without
+ * taking a reference on it or revalidating it.  Caller holds rnh_lock.
  */
-static struct rtentry *
-rt_lookup_common(boolean_t lookup_only, boolean_t coarse, struct sockaddr *dst,
-    struct sockaddr *netmask, struct radix_node_head *rnh, unsigned int ifscope)
+static struct radix_node *
+rt_lookup_scoped(boolean_t coarse, struct sockaddr *dst,
+    struct sockaddr *netmask, unsigned int ifscope)
 {
 	struct radix_node *rn0, *rn;
 	boolean_t dontcare;
 	int af = dst->sa_family;
 	struct sockaddr_storage dst_ss, mask_ss;
 
-	VERIFY(!coarse || ifscope == IFSCOPE_NONE);
-
-	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_OWNED);
-#if INET6
-	/*
-	 * While we have rnh_lock held, see if we need to schedule the timer.
-	 */
-	if (nd6_sched_timeout_want)
-		nd6_sched_timeout(NULL, NULL);
-#endif /* INET6 */
-
-	if (!lookup_only)
-		netmask = NULL;
-
-	/*
-	 * Non-scoped route lookup.
-	 */
-#if INET6
-	if ((af != AF_INET && af != AF_INET6) ||
-	    (af == AF_INET && !ip_doscopedroute) ||
-	    (af == AF_INET6 && !ip6_doscopedroute)) {
-#else
-	if (af != AF_INET || !ip_doscopedroute) {
-#endif /* !INET6 */
-		rn = rnh->rnh_matchaddr(dst, rnh);
-
-		/*
-		 * Don't return a root node; also, rnh_matchaddr callback
-		 * would have done the necessary work to clear RTPRF_OURS
-		 * for certain protocol families.
-		 */
-		if (rn != NULL && (rn->rn_flags & RNF_ROOT))
-			rn = NULL;
-		if (rn != NULL) {
-			RT_LOCK_SPIN(RT(rn));
-			if (!(RT(rn)->rt_flags & RTF_CONDEMNED)) {
-				RT_ADDREF_LOCKED(RT(rn));
-				RT_UNLOCK(RT(rn));
-			} else {
-				RT_UNLOCK(RT(rn));
-				rn = NULL;
-			}
-		}
-		return (RT(rn));
-	}
-
 	/* Transform dst/netmask into the internal routing table form */
 	dst = sa_copy(dst, &dst_ss, &ifscope);
 	if (netmask != NULL)
@@ -2912,6 +2874,87 @@ rt_lookup_common(boolean_t lookup_only, boolean_t coarse, struct sockaddr *dst,
 	    RT(rn)->rt_ifp->if_index != ifscope)
 		rn = NULL;
 
+	return (rn);
+}
+
+/*
+ * Common routine to lookup/match a route.  It invokes the lookup/matchaddr
+ * callback which could be address family-specific.  The main difference
+ * between the two (at least for AF_INET/AF_INET6) is that a lookup does
+ * not alter the expiring state of a route, whereas a match would unexpire
+ * or revalidate the route.
+ *
+ * The optional scope or interface index property of a route allows for a
+ * per-interface route instance.  This permits multiple route entries having
+ * the same destination (but not necessarily the same gateway) to exist in
+ * the routing table; each of these entries is specific to the corresponding
+ * interface.  This is made possible by storing the scope ID value into the
+ * radix key, thus making each route entry unique.  These scoped entries
+ * exist along with the regular, non-scoped entries in the same radix tree
+ * for a given address family (AF_INET/AF_INET6); the scope logically
+ * partitions it into multiple per-interface sub-trees.
+ *
+ * When a scoped route lookup is performed, the routing table is searched for
+ * the best match that would result in a route using the same interface as the
+ * one associated with the scope (the exception to this are routes that point
+ * to the loopback interface).  The search rule follows the longest matching
+ * prefix with the additional interface constraint.
+ */
+static struct rtentry *
+rt_lookup_common(boolean_t lookup_only, boolean_t coarse, struct sockaddr *dst,
+    struct sockaddr *netmask, struct radix_node_head *rnh, unsigned int ifscope)
+{
+	struct radix_node *rn;
+	int af = dst->sa_family;
+
+	VERIFY(!coarse || ifscope == IFSCOPE_NONE);
+
+	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_OWNED);
+#if INET6
+	/*
+	 * While we have rnh_lock held, see if we need to schedule the timer.
+	 */
+	if (nd6_sched_timeout_want)
+		nd6_sched_timeout(NULL, NULL);
+#endif /* INET6 */
+
+	if (!lookup_only)
+		netmask = NULL;
+
+	/*
+	 * Non-scoped route lookup.
+	 */
+#if INET6
+	if ((af != AF_INET && af != AF_INET6) ||
+	    (af == AF_INET && !ip_doscopedroute) ||
+	    (af == AF_INET6 && !ip6_doscopedroute)) {
+#else
+	if (af != AF_INET || !ip_doscopedroute) {
+#endif /* !INET6 */
+		rn = rnh->rnh_matchaddr(dst, rnh);
+
+		/*
+		 * Don't return a root node; also, rnh_matchaddr callback
+		 * would have done the necessary work to clear RTPRF_OURS
+		 * for certain protocol families.
+		 */
+		if (rn != NULL && (rn->rn_flags & RNF_ROOT))
+			rn = NULL;
+		if (rn != NULL) {
+			RT_LOCK_SPIN(RT(rn));
+			if (!(RT(rn)->rt_flags & RTF_CONDEMNED)) {
+				RT_ADDREF_LOCKED(RT(rn));
+				RT_UNLOCK(RT(rn));
+			} else {
+				RT_UNLOCK(RT(rn));
+				rn = NULL;
+			}
+		}
+		return (RT(rn));
+	}
+
+	rn = rt_lookup_scoped(coarse, dst, netmask, ifscope);
+
 	if (rn != NULL) {
 		/*
 		 * Manually clear RTPRF_OURS using rt_validate() and
@@ -2949,6 +2992,27 @@ rt_lookup_coarse(boolean_t lookup_only, struct sockaddr *dst,
 	    rnh, IFSCOPE_NONE));
 }
 
+/*
+ * Return the route a non-scoped rt_lookup() would pick for an AF_INET
+ * destination, without taking a reference or altering its expiring
+ * state; used to build the forwarding table.  Caller holds rnh_lock.
+ */
+struct rtentry *
+rt_lookup_noref(struct sockaddr *dst)
+{
+	struct radix_node *rn;
+
+	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_OWNED);
+	VERIFY(dst->sa_family == AF_INET);
+
+	if (!ip_doscopedroute)
+		rn = node_lookup(dst, NULL, IFSCOPE_NONE);
+	else
+		rn = rt_lookup_scoped(FALSE, dst, NULL, IFSCOPE_NONE);
+
+	return (RT(rn));
+}
+
 boolean_t
 rt_validate(struct rtentry *rt)
 {
@@ -3421,6 +3485,17 @@ rte_free(struct rtentry *p)
 	zfree(rte_zone, p);
 }
 
+/*
+ * Destroy an rtentry that has been taken out of the tree and has no
+ * references left.
+ */
+void
+rte_destroy(struct rtentry *rt)
+{
+	rte_lock_destroy(rt);
+	rte_free(rt);
+}
+
 static void
 rte_if_ref(struct ifnet *ifp, int cnt)
 {
@@ -524,6 +524,15 @@ extern struct rtentry *rt_lookup(boolean_t, struct sockaddr *,
     struct sockaddr *, struct radix_node_head *, unsigned int);
 extern struct rtentry *rt_lookup_coarse(boolean_t, struct sockaddr *,
     struct sockaddr *, struct radix_node_head *);
+extern struct rtentry *rt_lookup_noref(struct sockaddr *);
+extern void rte_destroy(struct rtentry *);
+extern void rtfib_init(void);
+extern boolean_t rtfib_alloc(struct route *, uint32_t, unsigned int);
+extern void rtfib_dirty(struct sockaddr *, struct sockaddr *);
+extern boolean_t rtfib_clone(struct rtentry *);
+extern void rtfib_schedule(void);
+extern void rtfib_retire(struct rtentry *);
+extern void rtcache_fill(struct route *, unsigned int);
 extern void rtalloc(struct route *);
 extern void rtalloc_scoped(struct route *, unsigned int);
 extern void rtalloc_ign(struct route *, uint32_t);
@@ -0,0 +1,1024 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * IPv4 forwarding table.
+ *
+ * The radix tree remains the authoritative routing table; this module
+ * keeps a read-only copy of it, flattened into a multibit trie with
+ * 16/8/8 strides, that unscoped IPv4 lookups can walk without taking
+ * rnh_lock.
+ *
+ * The address space is first cut into intervals at the first and last+1
+ * address of every prefix in the tree; within an interval the longest
+ * match cannot change, so the radix tree is consulted once per interval
+ * and adjacent intervals with the same result are merged.  That interval
+ * list is kept across rebuilds: route changes made through rtrequest
+ * record the prefix they touched (rtfib_dirty), and only the intervals
+ * covering those prefixes are looked up again.  Anything that bumps the
+ * generation count without saying which prefix it touched forces the
+ * whole list to be recomputed.  Cloned host routes are left out of the
+ * list altogether; the trie resolves their addresses to the parent route,
+ * which sends lookups on to the radix tree, so adding one neither dirties
+ * the table nor bumps the generation count.
+ *
+ * The trie is then built from the interval list, without rnh_lock held,
+ * and published as an immutable snapshot.  A snapshot is only used while
+ * its generation count matches route_genid_inet, so from the moment the
+ * tree changes until the (deferred, coalesced) rebuild runs, lookups
+ * simply fall back to the radix tree.
+ *
+ * Lookups first consult a small per-CPU cache of recent radix results,
+ * keyed by destination and interface scope, so that scoped lookups and
+ * lookups made while the trie is stale can skip rnh_lock as well.  Each
+ * entry is tagged with the generation count it was filled under, which
+ * invalidates it as soon as routegenid_update() is called.
+ *
+ * Neither the trie nor the cache holds references on the routes they
+ * point to.  Instead, IPv4 route entries are not freed when their last
+ * reference goes away but handed to rtfib_retire(), and only destroyed
+ * once lookups that could still see them have drained.  Readers
+ * announce themselves in one of two counters selected by the low bit of
+ * rtfib_epoch, which the rebuild flips after publishing a new snapshot.
+ * What the flip retired (the old snapshot and the routes handed over
+ * until then) is left in limbo, and freed by the next rebuild to find
+ * the previous epoch's counter at zero; a rebuild that finds readers
+ * still there simply reschedules itself instead of waiting for them.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <sys/kernel.h>
+#include <sys/mcache.h>
+#include <kern/clock.h>
+#include <kern/cpu_number.h>
+#include <kern/cpu_data.h>
+#include <kern/locks.h>
+#include <kern/thread_call.h>
+#include <machine/machine_routines.h>
+
+#include <net/if_var.h>
+#include <net/radix.h>
+#include <net/route.h>
+
+#include <netinet/in.h>
+#include <netinet/ip_var.h>
+
+#include <libkern/OSAtomic.h>
+
+/* XXX next prototype should be from libsa/stdlib.h> but conflicts libkern */
+__private_extern__ void qsort(void *, size_t, size_t,
+    int (*)(const void *, const void *));
+
+#define	RTFIB_L1BITS	16			/* first level stride */
+#define	RTFIB_L1SIZE	(1 << RTFIB_L1BITS)
+#define	RTFIB_CBITS	8			/* stride of the other levels */
+#define	RTFIB_CSIZE	(1 << RTFIB_CBITS)
+#define	RTFIB_CHUNK	0x80000000		/* entry refers to a chunk */
+
+#define	RTFIB_MAXDIRTY	8			/* prefixes tracked per rebuild */
+
+#define	RTCACHE_SIZE	256			/* entries per CPU */
+#define	RTCACHE_HASH(dst, ifscope)					\
+	((((dst) ^ ((ifscope) << 24)) * 2654435761U) >> 24)
+
+/*
+ * Slot in the trie: either RTFIB_CHUNK | chunk index, or an index
+ * into f_nh.
+ */
+struct rtfib {
+	u_int32_t	f_genid;		/* route_genid_inet at build */
+	int		f_scoped;		/* ip_doscopedroute at build */
+	unsigned int	f_primary;		/* primary ifscope at build */
+	u_int32_t	f_nchunks;		/* number of 256-entry chunks */
+	u_int32_t	*f_chunks;		/* second and third levels */
+	struct rtentry	**f_nh;			/* route for each interval */
+	u_int32_t	f_l1[RTFIB_L1SIZE];	/* first level */
+};
+
+/*
+ * Interval of the address space [fi_start, next fi_start) that resolves
+ * to fi_rt (NULL if there is no route).
+ */
+struct rtfib_ival {
+	u_int32_t	fi_start;
+	struct rtentry	*fi_rt;
+};
+
+struct rtfib_range {
+	u_int32_t	fr_lo;
+	u_int32_t	fr_hi;
+};
+
+/*
+ * Per-CPU destination cache entry; rc_rt is not referenced.
+ */
+struct rtcache_ent {
+	u_int32_t	rc_dst;			/* destination, host order */
+	unsigned int	rc_ifscope;
+	u_int32_t	rc_genid;		/* route_genid_inet at fill */
+	struct rtentry	*rc_rt;
+};
+
+struct rtcache_cpu {
+	struct rtcache_ent pc_ents[RTCACHE_SIZE];
+	u_int64_t	pc_hits;
+	u_int64_t	pc_misses;
+	u_int64_t	pc_invalidations;	/* stale entries dropped */
+} __attribute__((aligned(MAX_CPU_CACHE_LINE_SIZE)));
+
+struct rtfib_walkarg {
+	u_int32_t	w_lo;
+	u_int32_t	w_hi;
+	u_int32_t	*w_pts;
+	u_int32_t	w_npts;
+	u_int32_t	w_maxpts;
+	int		w_error;
+};
+
+static struct rtfib *rtfib_cur;			/* published snapshot */
+static volatile u_int32_t rtfib_epoch;
+static volatile SInt32 rtfib_readers[2];
+
+/* The following are protected by rnh_lock */
+static struct rtfib_ival *rtfib_ivals;		/* master interval list */
+static u_int32_t rtfib_nivals;
+static u_int32_t rtfib_genid;			/* genid the list reflects */
+static int rtfib_scoped;
+static unsigned int rtfib_primary;
+static u_int32_t rtfib_explained;		/* genid bumps with a prefix */
+static u_int32_t rtfib_ndirty;
+static struct rtfib_range rtfib_dirtyr[RTFIB_MAXDIRTY];
+static struct rtentry *rtfib_dead;		/* retired route entries */
+static struct rtfib *rtfib_limbo;		/* replaced by the last flip */
+static struct rtentry *rtfib_limbo_dead;	/* retired by the last flip */
+static int rtfib_busy;				/* rebuild in progress */
+static int rtfib_again;				/* rebuild wanted meanwhile */
+
+static thread_call_t rtfib_tcall;
+static volatile UInt32 rtfib_pending;
+
+static struct rtcache_cpu *rtcache_pcpu;
+static int rtcache_ncpu;
+
+SYSCTL_DECL(_net_route);
+
+static int rtfib_enable = 1;
+SYSCTL_INT(_net_route, OID_AUTO, fib, CTLFLAG_RW | CTLFLAG_LOCKED,
+	&rtfib_enable, 0, "");
+
+static u_int32_t rtfib_delay = 10;	/* msec */
+SYSCTL_UINT(_net_route, OID_AUTO, fib_delay, CTLFLAG_RW | CTLFLAG_LOCKED,
+	&rtfib_delay, 0, "");
+
+static u_int32_t rtfib_rebuilds;
+SYSCTL_UINT(_net_route, OID_AUTO, fib_rebuilds, CTLFLAG_RD | CTLFLAG_LOCKED,
+	&rtfib_rebuilds, 0, "");
+
+static u_int32_t rtfib_fullbuilds;
+SYSCTL_UINT(_net_route, OID_AUTO, fib_fullbuilds, CTLFLAG_RD | CTLFLAG_LOCKED,
+	&rtfib_fullbuilds, 0, "");
+
+SYSCTL_UINT(_net_route, OID_AUTO, fib_intervals, CTLFLAG_RD | CTLFLAG_LOCKED,
+	&rtfib_nivals, 0, "");
+
+static u_int64_t rtfib_hits;
+SYSCTL_QUAD(_net_route, OID_AUTO, fib_hits, CTLFLAG_RD | CTLFLAG_LOCKED,
+	&rtfib_hits, "");
+
+static u_int64_t rtfib_misses;
+SYSCTL_QUAD(_net_route, OID_AUTO, fib_misses, CTLFLAG_RD | CTLFLAG_LOCKED,
+	&rtfib_misses, "");
+
+static int rtcache_enable = 1;
+SYSCTL_INT(_net_route, OID_AUTO, pcpu_cache, CTLFLAG_RW | CTLFLAG_LOCKED,
+	&rtcache_enable, 0, "");
+
+static int sysctl_rtcache_stats SYSCTL_HANDLER_ARGS;
+SYSCTL_PROC(_net_route, OID_AUTO, pcpu_cache_hits,
+	CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED, (void *)0, 0,
+	sysctl_rtcache_stats, "Q", "");
+SYSCTL_PROC(_net_route, OID_AUTO, pcpu_cache_misses,
+	CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED, (void *)1, 0,
+	sysctl_rtcache_stats, "Q", "");
+SYSCTL_PROC(_net_route, OID_AUTO, pcpu_cache_invalidations,
+	CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED, (void *)2, 0,
+	sysctl_rtcache_stats, "Q", "");
+
+static void rtfib_update(thread_call_param_t, thread_call_param_t);
+static boolean_t rtfib_prefix(struct sockaddr *, struct sockaddr *,
+    u_int32_t *, u_int32_t *);
+static int rtfib_walk(struct radix_node *, void *);
+static int rtfib_addpt(struct rtfib_walkarg *, u_int32_t);
+static int rtfib_ptcmp(const void *, const void *);
+static int rtfib_eval(u_int32_t, u_int32_t);
+static int rtfib_refresh(void);
+static void rtfib_reset(void);
+static u_int32_t rtfib_fill(struct rtfib *, u_int32_t, int, u_int32_t *);
+static struct rtfib *rtfib_build(void);
+static void rtfib_free(struct rtfib *);
+static void rtfib_reap(struct rtfib *, struct rtentry *);
+static u_int32_t rtfib_enter(void);
+static void rtfib_exit(u_int32_t);
+static boolean_t rtfib_ref(struct rtentry *, uint32_t, u_int32_t);
+static struct rtentry *rtfib_lookup(u_int32_t, uint32_t, u_int32_t);
+static struct rtentry *rtcache_lookup(u_int32_t, unsigned int, uint32_t,
+    u_int32_t);
+
+void
+rtfib_init(void)
+{
+	rtfib_tcall = thread_call_allocate(rtfib_update, NULL);
+	if (rtfib_tcall == NULL)
+		panic("%s: couldn't allocate thread call", __func__);
+
+	rtcache_ncpu = ml_get_max_cpus();
+	rtcache_pcpu = _MALLOC(rtcache_ncpu * sizeof (struct rtcache_cpu),
+	    M_RTABLE, M_WAITOK | M_ZERO);
+	if (rtcache_pcpu == NULL)
+		panic("%s: couldn't allocate route cache", __func__);
+}
+
+/*
+ * Request a rebuild.  Requests made before the rebuild runs are
+ * coalesced into one.
+ */
+void
+rtfib_schedule(void)
+{
+	uint64_t deadline;
+
+	if (rtfib_tcall == NULL || !OSCompareAndSwap(0, 1, &rtfib_pending))
+		return;
+
+	clock_interval_to_deadline(rtfib_delay, NSEC_PER_MSEC, &deadline);
+	thread_call_enter_delayed(rtfib_tcall, deadline);
+}
+
+/*
+ * Called with rnh_lock held for every IPv4 route added to or removed
+ * from the tree, ahead of the matching generation count bump.
+ */
+void
+rtfib_dirty(struct sockaddr *key, struct sockaddr *mask)
+{
+	struct rtfib_range *fr;
+	u_int32_t lo, hi, i;
+
+	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_OWNED);
+
+	rtfib_explained++;
+	if (rtfib_ndirty > RTFIB_MAXDIRTY)
+		return;
+	if (!rtfib_prefix(key, mask, &lo, &hi)) {
+		rtfib_ndirty = RTFIB_MAXDIRTY + 1;
+		return;
+	}
+
+	/* Prefixes either nest or don't overlap at all */
+	for (i = 0; i < rtfib_ndirty; i++) {
+		fr = &rtfib_dirtyr[i];
+		if (fr->fr_lo <= lo && hi <= fr->fr_hi)
+			return;
+		if (lo <= fr->fr_lo && fr->fr_hi <= hi) {
+			fr->fr_lo = lo;
+			fr->fr_hi = hi;
+			return;
+		}
+	}
+	if (rtfib_ndirty < RTFIB_MAXDIRTY) {
+		rtfib_dirtyr[rtfib_ndirty].fr_lo = lo;
+		rtfib_dirtyr[rtfib_ndirty].fr_hi = hi;
+	}
+	rtfib_ndirty++;
+}
+
+/*
+ * Cloned host routes stay out of the interval list; the trie resolves
+ * their addresses to the parent route, which lookups have to take to the
+ * radix tree anyway.  rtrequest adds them without dirtying the table or
+ * bumping the generation count.  Removing one still bumps it, since the
+ * per-CPU cache may be pointing at the route.
+ */
+boolean_t
+rtfib_clone(struct rtentry *rt)
+{
+	return ((rt->rt_flags & (RTF_WASCLONED | RTF_HOST)) ==
+	    (RTF_WASCLONED | RTF_HOST) && rt->rt_parent != NULL);
+}
+
+/*
+ * Called by rtfree_common, with rnh_lock held, in place of destroying
+ * an IPv4 route entry that has left the tree and lost its last
+ * reference.  The entry is chained through rt_parent, which is no
+ * longer in use at this point.
+ */
+void
+rtfib_retire(struct rtentry *rt)
+{
+	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_OWNED);
+	VERIFY(rt->rt_parent == NULL);
+
+	if (rtfib_tcall == NULL) {
+		rte_destroy(rt);
+		return;
+	}
+	rt->rt_parent = rtfib_dead;
+	rtfib_dead = rt;
+	rtfib_schedule();
+}
+
+/*
+ * Attempt to satisfy rtalloc_scoped_ign() from the per-CPU destination
+ * cache or, for unscoped lookups, the forwarding table.  Returns FALSE
+ * if the caller needs to go through the radix tree.
+ */
+boolean_t
+rtfib_alloc(struct route *ro, uint32_t ignore, unsigned int ifscope)
+{
+	struct rtentry *rt;
+	u_int32_t dst, gen, epoch;
+
+	if (ro->ro_dst.sa_family != AF_INET ||
+	    (!rtcache_enable && (!rtfib_enable || ifscope != IFSCOPE_NONE)))
+		return (FALSE);
+
+	if ((rt = ro->ro_rt) != NULL) {
+		RT_LOCK_SPIN(rt);
+		if (rt->rt_ifp != NULL && !ROUTE_UNUSABLE(ro)) {
+			RT_UNLOCK(rt);
+			return (TRUE);
+		}
+		RT_UNLOCK(rt);
+	}
+
+	/*
+	 * The generation count must be sampled after entering the epoch;
+	 * see rtcache_lookup().
+	 */
+	dst = ntohl(SIN(&ro->ro_dst)->sin_addr.s_addr);
+	rt = NULL;
+	epoch = rtfib_enter();
+	gen = route_genid_inet;
+	if (rtcache_enable)
+		rt = rtcache_lookup(dst, ifscope, ignore, gen);
+	if (rt == NULL && rtfib_enable && ifscope == IFSCOPE_NONE)
+		rt = rtfib_lookup(dst, ignore, gen);
+	rtfib_exit(epoch);
+
+	if (rt == NULL)
+		return (FALSE);
+
+	ROUTE_RELEASE(ro);
+	ro->ro_rt = rt;
+	return (TRUE);
+}
+
+static u_int32_t
+rtfib_enter(void)
+{
+	u_int32_t epoch;
+
+	for (;;) {
+		epoch = rtfib_epoch;
+		OSIncrementAtomic(&rtfib_readers[epoch & 1]);
+		if (rtfib_epoch == epoch)
+			return (epoch);
+		OSDecrementAtomic(&rtfib_readers[epoch & 1]);
+	}
+}
+
+static void
+rtfib_exit(u_int32_t epoch)
+{
+	OSDecrementAtomic(&rtfib_readers[epoch & 1]);
+}
+
+/*
+ * Take a reference on a route found without rnh_lock.  Leave it to the
+ * radix path if the route needs cloning, if the tree has changed since
+ * the generation count was sampled, or if the route has no references
+ * left: rtfree_common relies on rnh_lock to keep such a route from
+ * being looked up again while it decides whether to delete it.
+ */
+static boolean_t
+rtfib_ref(struct rtentry *rt, uint32_t ignflags, u_int32_t gen)
+{
+	RT_LOCK_SPIN(rt);
+	if (rt->rt_refcnt == 0 || route_genid_inet != gen ||
+	    ((rt->rt_flags & ~ignflags) & (RTF_CLONING | RTF_PRCLONING)) ||
+	    !rt_validate(rt)) {
+		RT_UNLOCK(rt);
+		return (FALSE);
+	}
+	RT_ADDREF_LOCKED(rt);
+	RT_GENID_SYNC(rt);
+	RT_UNLOCK(rt);
+	return (TRUE);
+}
+
+/*
+ * Returns a referenced route, or NULL if the radix tree must be used.
+ * Called within the epoch.
+ */
+static struct rtentry *
+rtfib_lookup(u_int32_t a, uint32_t ignflags, u_int32_t gen)
+{
+	struct rtfib *f;
+	struct rtentry *rt = NULL;
+	u_int32_t e;
+
+	if ((f = rtfib_cur) == NULL || f->f_genid != gen ||
+	    f->f_scoped != ip_doscopedroute ||
+	    f->f_primary != get_primary_ifscope(AF_INET))
+		goto done;
+
+	e = f->f_l1[a >> RTFIB_L1BITS];
+	if (e & RTFIB_CHUNK) {
+		e = f->f_chunks[(e & ~RTFIB_CHUNK) * RTFIB_CSIZE +
+		    ((a >> RTFIB_CBITS) & (RTFIB_CSIZE - 1))];
+		if (e & RTFIB_CHUNK) {
+			e = f->f_chunks[(e & ~RTFIB_CHUNK) * RTFIB_CSIZE +
+			    (a & (RTFIB_CSIZE - 1))];
+		}
+	}
+	if ((rt = f->f_nh[e]) != NULL && !rtfib_ref(rt, ignflags, gen))
+		rt = NULL;
+done:
+	if (rt != NULL)
+		rtfib_hits++;
+	else
+		rtfib_misses++;
+	return (rt);
+}
+
+/*
+ * Look (dst, ifscope) up in this CPU's destination cache.  Called within
+ * the epoch, with gen sampled after entering it: an entry whose route
+ * has since been deleted carries an older generation count, and a route
+ * deleted after that point cannot be destroyed before we leave.  Entries
+ * hold no references, so a stale one is never dereferenced.
+ */
+static struct rtentry *
+rtcache_lookup(u_int32_t dst, unsigned int ifscope, uint32_t ignflags,
+    u_int32_t gen)
+{
+	struct rtcache_cpu *pc;
+	struct rtcache_ent *rc;
+	struct rtentry *rt = NULL;
+	boolean_t stale = FALSE;
+
+	if (rtcache_pcpu == NULL)
+		return (NULL);
+
+	/*
+	 * Entries are only written by their own CPU with preemption
+	 * disabled, so this yields a consistent copy.
+	 */
+	disable_preemption();
+	pc = &rtcache_pcpu[cpu_number()];
+	rc = &pc->pc_ents[RTCACHE_HASH(dst, ifscope)];
+	if (rc->rc_rt != NULL && rc->rc_dst == dst &&
+	    rc->rc_ifscope == ifscope) {
+		if (rc->rc_genid == gen) {
+			rt = rc->rc_rt;
+		} else {
+			rc->rc_rt = NULL;
+			stale = TRUE;
+		}
+	}
+	enable_preemption();
+
+	if (rt != NULL && !rtfib_ref(rt, ignflags, gen)) {
+		rt = NULL;
+		stale = TRUE;
+	}
+
+	disable_preemption();
+	pc = &rtcache_pcpu[cpu_number()];
+	if (rt != NULL)
+		pc->pc_hits++;
+	else
+		pc->pc_misses++;
+	if (stale)
+		pc->pc_invalidations++;
+	enable_preemption();
+
+	return (rt);
+}
+
+/*
+ * Called by rtalloc_scoped_ign() with rnh_lock held once the radix tree
+ * has produced a route for (dst, ifscope).  The route is in the tree for
+ * as long as rnh_lock is held, so the current generation count is a safe
+ * tag for it.  Cloning routes are cached too: in_rmx marks every IPv4
+ * network route, the default route included, RTF_PRCLONING, and
+ * rtfib_ref() only hands one out to callers that ignore the flag.
+ */
+void
+rtcache_fill(struct route *ro, unsigned int ifscope)
+{
+	struct rtentry *rt = ro->ro_rt;
+	struct rtcache_ent *rc;
+	u_int32_t dst, gen;
+
+	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (!rtcache_enable || rtcache_pcpu == NULL || rt == NULL ||
+	    ro->ro_dst.sa_family != AF_INET)
+		return;
+
+	dst = ntohl(SIN(&ro->ro_dst)->sin_addr.s_addr);
+	gen = route_genid_inet;
+
+	disable_preemption();
+	rc = &rtcache_pcpu[cpu_number()].pc_ents[RTCACHE_HASH(dst, ifscope)];
+	rc->rc_dst = dst;
+	rc->rc_ifscope = ifscope;
+	rc->rc_genid = gen;
+	rc->rc_rt = rt;
+	enable_preemption();
+}
+
+static int
+sysctl_rtcache_stats SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg2)
+	u_int64_t sum = 0;
+	int i;
+
+	for (i = 0; rtcache_pcpu != NULL && i < rtcache_ncpu; i++) {
+		struct rtcache_cpu *pc = &rtcache_pcpu[i];
+
+		switch ((intptr_t)arg1) {
+		case 0:
+			sum += pc->pc_hits;
+			break;
+		case 1:
+			sum += pc->pc_misses;
+			break;
+		default:
+			sum += pc->pc_invalidations;
+			break;
+		}
+	}
+	return (SYSCTL_OUT(req, &sum, sizeof (sum)));
+}
+
+/*
+ * Rebuild thread call: free what the previous flip retired once its
+ * readers have drained, bring the interval list up to date under
+ * rnh_lock, build the trie from it without the lock, and then publish
+ * it, retiring the old snapshot along with the route entries handed
+ * over in the meantime.
+ */
+static void
+rtfib_update(thread_call_param_t arg0, thread_call_param_t arg1)
+{
+#pragma unused(arg0, arg1)
+	struct rtfib *new = NULL, *old, *limbo;
+	struct rtentry *dead;
+	boolean_t build = FALSE, resched;
+	u_int32_t epoch;
+
+	lck_mtx_lock(rnh_lock);
+	rtfib_pending = 0;
+	OSMemoryBarrier();
+	if (rtfib_busy) {
+		/* The rebuild in progress will schedule another one */
+		rtfib_again = 1;
+		lck_mtx_unlock(rnh_lock);
+		return;
+	}
+
+	/*
+	 * Readers of the previous epoch may still be looking at what the
+	 * last flip retired, and the next flip will hand their counter to
+	 * new readers; they hold no locks and are short, so come back
+	 * later rather than wait for them.
+	 */
+	epoch = rtfib_epoch;
+	if (rtfib_readers[(epoch + 1) & 1] != 0) {
+		lck_mtx_unlock(rnh_lock);
+		rtfib_schedule();
+		return;
+	}
+	limbo = rtfib_limbo;
+	dead = rtfib_limbo_dead;
+	rtfib_limbo = NULL;
+	rtfib_limbo_dead = NULL;
+
+	old = rtfib_cur;
+	if (!rtfib_enable || rt_tables[AF_INET] == NULL) {
+		rtfib_reset();
+	} else if (old != NULL && old->f_genid == route_genid_inet &&
+	    old->f_scoped == ip_doscopedroute &&
+	    old->f_primary == get_primary_ifscope(AF_INET) &&
+	    rtfib_ndirty == 0) {
+		new = old;
+	} else if (rtfib_refresh() == 0) {
+		build = TRUE;
+	}
+	/* The interval list is left alone until rtfib_busy is cleared */
+	rtfib_busy = 1;
+	lck_mtx_unlock(rnh_lock);
+
+	rtfib_reap(limbo, dead);
+	if (build)
+		new = rtfib_build();
+
+	lck_mtx_lock(rnh_lock);
+	dead = rtfib_dead;
+	rtfib_dead = NULL;
+	if (new != old || dead != NULL) {
+		OSMemoryBarrier();
+		rtfib_cur = new;
+		OSMemoryBarrier();
+		rtfib_epoch = epoch + 1;
+		OSMemoryBarrier();
+		rtfib_limbo = (new != old) ? old : NULL;
+		rtfib_limbo_dead = dead;
+	}
+	if (build)
+		rtfib_rebuilds++;
+	resched = (rtfib_limbo != NULL || rtfib_limbo_dead != NULL ||
+	    rtfib_again);
+	rtfib_again = 0;
+	rtfib_busy = 0;
+	lck_mtx_unlock(rnh_lock);
+
+	if (resched)
+		rtfib_schedule();
+}
+
+static void
+rtfib_reap(struct rtfib *f, struct rtentry *dead)
+{
+	struct rtentry *rt;
+
+	if (f != NULL)
+		rtfib_free(f);
+	while ((rt = dead) != NULL) {
+		dead = rt->rt_parent;
+		rt->rt_parent = NULL;
+		rte_destroy(rt);
+	}
+}
+
+/*
+ * Turn an IPv4 key and (possibly trimmed) netmask into the first and
+ * last address it covers; returns FALSE for a non-contiguous mask.
+ */
+static boolean_t
+rtfib_prefix(struct sockaddr *key, struct sockaddr *mask, u_int32_t *lo,
+    u_int32_t *hi)
+{
+	const u_char *cp;
+	u_int32_t m = 0xffffffff;
+	size_t off;
+	int i;
+
+	if (mask != NULL) {
+		cp = (const u_char *)mask;
+		off = offsetof(struct sockaddr_in, sin_addr);
+		for (m = 0, i = 0; i < 4; i++, off++)
+			m = (m << 8) | (off < mask->sa_len ? cp[off] : 0);
+		if ((~m & (~m + 1)) != 0)
+			return (FALSE);
+	}
+	*lo = ntohl(SIN(key)->sin_addr.s_addr) & m;
+	*hi = *lo | ~m;
+	return (TRUE);
+}
+
+static int
+rtfib_addpt(struct rtfib_walkarg *w, u_int32_t pt)
+{
+	u_int32_t *pts, max;
+
+	if (w->w_npts == w->w_maxpts) {
+		max = (w->w_maxpts == 0) ? 64 : w->w_maxpts * 2;
+		pts = _MALLOC(max * sizeof (*pts), M_RTABLE, M_WAITOK);
+		if (pts == NULL)
+			return (ENOMEM);
+		if (w->w_pts != NULL) {
+			bcopy(w->w_pts, pts, w->w_npts * sizeof (*pts));
+			_FREE(w->w_pts, M_RTABLE);
+		}
+		w->w_pts = pts;
+		w->w_maxpts = max;
+	}
+	w->w_pts[w->w_npts++] = pt;
+	return (0);
+}
+
+/*
+ * rnh_walktree callback: collect the interval boundaries that fall
+ * within (w_lo, w_hi].
+ */
+static int
+rtfib_walk(struct radix_node *rn, void *arg)
+{
+	struct rtfib_walkarg *w = arg;
+	struct rtentry *rt = (struct rtentry *)rn;
+	u_int32_t lo, hi;
+	int error = 0;
+
+	if (rtfib_clone(rt))
+		return (0);
+	if (!rtfib_prefix(rt_key(rt), rt_mask(rt), &lo, &hi)) {
+		w->w_error = EINVAL;
+		return (EINVAL);
+	}
+	if (lo > w->w_lo && lo <= w->w_hi)
+		error = rtfib_addpt(w, lo);
+	if (error == 0 && hi != 0xffffffff && hi + 1 > w->w_lo &&
+	    hi + 1 <= w->w_hi)
+		error = rtfib_addpt(w, hi + 1);
+	if (error != 0)
+		w->w_error = error;
+	return (error);
+}
+
+static int
+rtfib_ptcmp(const void *a, const void *b)
+{
+	u_int32_t x = *(const u_int32_t *)a, y = *(const u_int32_t *)b;
+
+	return ((x < y) ? -1 : (x > y));
+}
+
+/*
+ * Look the intervals within [lo, hi] up again in the radix tree and
+ * splice them into the master list.  Only the routes under the prefix
+ * [lo, hi] can cut it, so the walk starts from there.
+ */
+static int
+rtfib_eval(u_int32_t lo, u_int32_t hi)
+{
+	struct radix_node_head *rnh = rt_tables[AF_INET];
+	struct rtfib_walkarg w;
+	struct rtfib_ival *ivals, *fi;
+	struct sockaddr_in sin, mask;
+	struct rtentry *rt;
+	u_int32_t i, j, n, c, head, next;
+	int error;
+
+	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_OWNED);
+
+	bzero(&w, sizeof (w));
+	w.w_lo = lo;
+	w.w_hi = hi;
+	if (rtfib_addpt(&w, lo) != 0)
+		goto fail;
+	if (lo == 0 && hi == 0xffffffff) {
+		error = rnh->rnh_walktree(rnh, rtfib_walk, &w);
+	} else {
+		bzero(&sin, sizeof (sin));
+		sin.sin_len = sizeof (sin);
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(lo);
+		bzero(&mask, sizeof (mask));
+		mask.sin_len = sizeof (mask);
+		mask.sin_family = AF_INET;
+		mask.sin_addr.s_addr = htonl(~(hi - lo));
+		error = rnh->rnh_walktree_from(rnh, &sin, &mask, rtfib_walk, &w);
+	}
+	if (error != 0 || w.w_error != 0)
+		goto fail;
+
+	qsort(w.w_pts, w.w_npts, sizeof (u_int32_t), rtfib_ptcmp);
+
+	/* Existing intervals wholly before lo, and the one covering hi+1 */
+	for (head = 0; head < rtfib_nivals &&
+	    rtfib_ivals[head].fi_start < lo; head++)
+		;
+	next = head;
+	if (hi != 0xffffffff) {
+		for (; next < rtfib_nivals &&
+		    rtfib_ivals[next].fi_start <= hi + 1; next++)
+			;
+		VERIFY(next > 0);
+	}
+
+	n = head + w.w_npts + 2 + (rtfib_nivals - next);
+	ivals = _MALLOC(n * sizeof (*ivals), M_RTABLE, M_WAITOK);
+	if (ivals == NULL)
+		goto fail;
+
+	bcopy(rtfib_ivals, ivals, head * sizeof (*ivals));
+	n = head;
+	bzero(&sin, sizeof (sin));
+	sin.sin_len = sizeof (sin);
+	sin.sin_family = AF_INET;
+	for (i = 0; i < w.w_npts; i++) {
+		if (i > 0 && w.w_pts[i] == w.w_pts[i - 1])
+			continue;
+		sin.sin_addr.s_addr = htonl(w.w_pts[i]);
+		fi = &ivals[n++];
+		fi->fi_start = w.w_pts[i];
+		rt = rt_lookup_noref((struct sockaddr *)&sin);
+		if (rt != NULL && rtfib_clone(rt))
+			rt = rt->rt_parent;
+		fi->fi_rt = rt;
+	}
+	if (hi != 0xffffffff) {
+		/* Interval covering hi+1 keeps its route past the range */
+		c = next - 1;
+		if (rtfib_ivals[c].fi_start != hi + 1) {
+			fi = &ivals[n++];
+			fi->fi_start = hi + 1;
+			fi->fi_rt = rtfib_ivals[c].fi_rt;
+			c++;
+		}
+		bcopy(&rtfib_ivals[c], &ivals[n],
+		    (rtfib_nivals - c) * sizeof (*ivals));
+		n += rtfib_nivals - c;
+	}
+
+	/* Merge neighbours that resolve to the same route */
+	for (i = 0, j = 0; i < n; i++) {
+		if (j > 0 && ivals[j - 1].fi_rt == ivals[i].fi_rt)
+			continue;
+		ivals[j++] = ivals[i];
+	}
+
+	if (rtfib_ivals != NULL)
+		_FREE(rtfib_ivals, M_RTABLE);
+	rtfib_ivals = ivals;
+	rtfib_nivals = j;
+	_FREE(w.w_pts, M_RTABLE);
+	return (0);
+
+fail:
+	if (w.w_pts != NULL)
+		_FREE(w.w_pts, M_RTABLE);
+	return (w.w_error != 0 ? w.w_error : ENOMEM);
+}
+
+/*
+ * Bring the master interval list in line with the radix tree, looking
+ * up only the prefixes recorded by rtfib_dirty when every generation
+ * count bump since the last refresh is accounted for by one of them.
+ */
+static int
+rtfib_refresh(void)
+{
+	u_int32_t gen = route_genid_inet, i;
+	unsigned int primary = get_primary_ifscope(AF_INET);
+	int error = 0;
+
+	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (rtfib_ivals == NULL || rtfib_ndirty > RTFIB_MAXDIRTY ||
+	    gen - rtfib_genid != rtfib_explained ||
+	    rtfib_scoped != ip_doscopedroute || rtfib_primary != primary) {
+		if (rtfib_ivals != NULL)
+			_FREE(rtfib_ivals, M_RTABLE);
+		rtfib_ivals = NULL;
+		rtfib_nivals = 0;
+		rtfib_fullbuilds++;
+		error = rtfib_eval(0, 0xffffffff);
+	} else {
+		for (i = 0; i < rtfib_ndirty && error == 0; i++)
+			error = rtfib_eval(rtfib_dirtyr[i].fr_lo,
+			    rtfib_dirtyr[i].fr_hi);
+	}
+
+	rtfib_genid = gen;
+	rtfib_scoped = ip_doscopedroute;
+	rtfib_primary = primary;
+	rtfib_explained = 0;
+	rtfib_ndirty = 0;
+	if (error != 0)
+		rtfib_reset();
+	return (error);
+}
+
+/*
+ * Drop the master interval list; the next refresh starts from scratch.
+ */
+static void
+rtfib_reset(void)
+{
+	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (rtfib_ivals != NULL)
+		_FREE(rtfib_ivals, M_RTABLE);
+	rtfib_ivals = NULL;
+	rtfib_nivals = 0;
+	rtfib_explained = 0;
+	rtfib_ndirty = 0;
+}
+
+/*
+ * Return the trie slot for the 2^bits addresses starting at base,
+ * allocating chunks for blocks that span more than one interval.  *cur
+ * tracks the interval containing base; f_chunks is NULL on the first
+ * pass, which only counts chunks.
+ */
+static u_int32_t
+rtfib_fill(struct rtfib *f, u_int32_t base, int bits, u_int32_t *cur)
+{
+	u_int32_t last = base + ((1 << bits) - 1);
+	u_int32_t c, i, e;
+
+	while (*cur + 1 < rtfib_nivals &&
+	    rtfib_ivals[*cur + 1].fi_start <= base)
+		(*cur)++;
+	if (bits == 0 || *cur + 1 == rtfib_nivals ||
+	    rtfib_ivals[*cur + 1].fi_start > last)
+		return (*cur);
+
+	c = f->f_nchunks++;
+	for (i = 0; i < RTFIB_CSIZE; i++) {
+		e = rtfib_fill(f, base + (i << (bits - RTFIB_CBITS)),
+		    bits - RTFIB_CBITS, cur);
+		if (f->f_chunks != NULL)
+			f->f_chunks[c * RTFIB_CSIZE + i] = e;
+	}
+	return (RTFIB_CHUNK | c);
+}
+
+static struct rtfib *
+rtfib_build(void)
+{
+	struct rtfib *f;
+	u_int32_t i, cur, nchunks;
+
+	VERIFY(rtfib_busy);
+	VERIFY(rtfib_nivals > 0 && rtfib_ivals[0].fi_start == 0);
+
+	f = _MALLOC(sizeof (*f), M_RTABLE, M_WAITOK | M_ZERO);
+	if (f == NULL)
+		return (NULL);
+	f->f_nh = _MALLOC(rtfib_nivals * sizeof (struct rtentry *),
+	    M_RTABLE, M_WAITOK);
+	if (f->f_nh == NULL)
+		goto fail;
+	for (i = 0; i < rtfib_nivals; i++)
+		f->f_nh[i] = rtfib_ivals[i].fi_rt;
+
+	for (i = 0, cur = 0; i < RTFIB_L1SIZE; i++)
+		(void) rtfib_fill(f, i << RTFIB_L1BITS,
+		    32 - RTFIB_L1BITS, &cur);
+	nchunks = f->f_nchunks;
+	if (nchunks != 0) {
+		f->f_chunks = _MALLOC(nchunks * RTFIB_CSIZE *
+		    sizeof (u_int32_t), M_RTABLE, M_WAITOK);
+		if (f->f_chunks == NULL)
+			goto fail;
+	}
+	f->f_nchunks = 0;
+	for (i = 0, cur = 0; i < RTFIB_L1SIZE; i++)
+		f->f_l1[i] = rtfib_fill(f, i << RTFIB_L1BITS,
+		    32 - RTFIB_L1BITS, &cur);
+	VERIFY(f->f_nchunks == nchunks);
+
+	f->f_genid = rtfib_genid;
+	f->f_scoped = rtfib_scoped;
+	f->f_primary = rtfib_primary;
+	return (f);
+
+fail:
+	rtfib_free(f);
+	return (NULL);
+}
+
+static void
+rtfib_free(struct rtfib *f)
+{
+	if (f->f_chunks != NULL)
+		_FREE(f->f_chunks, M_RTABLE);
+	if (f->f_nh != NULL)
+		_FREE(f->f_nh, M_RTABLE);
+	_FREE(f, M_RTABLE);
+}
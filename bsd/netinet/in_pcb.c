@@ -209,6 +209,15 @@ SYSCTL_PROC(_net_inet_ip_portrange, OID_AUTO, hilast,
 extern int	udp_use_randomport;
 extern int	tcp_use_randomport;
 
+/*
+ * Spread new flows across the members of SO_REUSEPORT groups; when off,
+ * the first wildcard match gets them all.
+ */
+static int	inp_reuseport_lb = 1;
+SYSCTL_INT(_net_inet_ip, OID_AUTO, reuseport_lb,
+	CTLFLAG_RW | CTLFLAG_LOCKED, &inp_reuseport_lb, 0,
+	"Load-balance flows across SO_REUSEPORT sockets");
+
 /* Structs used for flowhash computation */
 struct inp_flowhash_key_addr {
 	union {
@@ -232,6 +241,11 @@ struct inp_flowhash_key {
 };
 
 static u_int32_t inp_hash_seed = 0;
+static u_int32_t inp_lbgroup_seed = 0;
+
+static boolean_t in_pcblbgroup_eligible(struct inpcb *);
+static void in_pcblbgroup_insert(struct inpcb *);
+static void in_pcblbgroup_remove(struct inpcb *);
 
 static int infc_cmp(const struct inpcb *, const struct inpcb *);
 
@@ -282,6 +296,12 @@ in_pcbinit(void)
 	RB_INIT(&inp_fc_tree);
 	bzero(&key_inp, sizeof(key_inp));
 	lck_mtx_unlock(&inp_fc_lck);
+
+	/*
+	 * Unlike inp_hash_seed this never changes, so that a flow keeps
+	 * going to the same member of a load-balancing group.
+	 */
+	inp_lbgroup_seed = RandomULong();
 }
 
 #define	INPCB_HAVE_TIMER_REQ(req)	(((req).intimer_lazy > 0) || \
@@ -484,6 +504,23 @@ void
 in_pcbinfo_attach(struct inpcbinfo *ipi)
 {
 	struct inpcbinfo *ipi0;
+	u_int32_t i, n;
+
+	/* One lock per shard of the pcb hash, at most one per chain */
+	if (ipi->ipi_hashlocks == NULL) {
+		n = MIN(INPCB_HASHLOCKS_MAX, ipi->ipi_hashmask + 1);
+		ipi->ipi_hashlocks = _MALLOC(n * sizeof (lck_rw_t), M_PCB,
+		    M_WAITOK | M_ZERO);
+		if (ipi->ipi_hashlocks == NULL) {
+			panic("%s: unable to allocate hash locks for ipi %p\n",
+			    __func__, ipi);
+			/* NOTREACHED */
+		}
+		for (i = 0; i < n; i++)
+			lck_rw_init(&ipi->ipi_hashlocks[i], ipi->ipi_lock_grp,
+			    ipi->ipi_lock_attr);
+		ipi->ipi_hashlockmask = n - 1;
+	}
 
 	lck_mtx_lock(&inpcb_lock);
 	TAILQ_FOREACH(ipi0, &inpcb_head, ipi_entry) {
@@ -1918,21 +1955,22 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 	struct inpcb *inp;
 	u_short fport = fport_arg, lport = lport_arg;
 	struct inpcb *local_wild = NULL;
+	u_int32_t hash;
 #if INET6
 	struct inpcb *local_wild_mapped = NULL;
 #endif /* INET6 */
 
 	/*
-	 * We may have found the pcb in the last lookup - check this first.
+	 * First look for an exact match.  This only needs the lock of the
+	 * hash shard, so that packets for established connections don't
+	 * wait for connections being set up or torn down elsewhere in the
+	 * table.  The addresses and ports of a pcb may be seen changing
+	 * ahead of in_pcbrehash(), but until they are all updated one of
+	 * them is still a wildcard, which no packet matches.
 	 */
-
-	lck_rw_lock_shared(pcbinfo->ipi_lock);
-
-	/*
-	 * First look for an exact match.
-	 */
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr.s_addr, lport, fport,
-	    pcbinfo->ipi_hashmask)];
+	hash = INP_PCBHASH(faddr.s_addr, lport, fport, pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[hash];
+	lck_rw_lock_shared(INP_PCBHASHLOCK(pcbinfo, hash));
 	LIST_FOREACH(inp, head, inp_hash) {
 #if INET6
 		if (!(inp->inp_vflag & INP_IPV4))
@@ -1950,24 +1988,38 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 			 */
 			if (in_pcb_checkstate(inp, WNT_ACQUIRE, 0) !=
 			    WNT_STOPUSING) {
-				lck_rw_done(pcbinfo->ipi_lock);
+				lck_rw_done(INP_PCBHASHLOCK(pcbinfo, hash));
 				return (inp);
 			} else {
 				/* it's there but dead, say it isn't found */
-				lck_rw_done(pcbinfo->ipi_lock);
+				lck_rw_done(INP_PCBHASHLOCK(pcbinfo, hash));
 				return (NULL);
 			}
 		}
 	}
+	lck_rw_done(INP_PCBHASHLOCK(pcbinfo, hash));
 
 	if (!wildcard) {
 		/*
 		 * Not found.
 		 */
-		lck_rw_done(pcbinfo->ipi_lock);
 		return (NULL);
 	}
 
+	lck_rw_lock_shared(pcbinfo->ipi_lock);
+
+	/*
+	 * Then let a load-balancing group of SO_REUSEPORT sockets take
+	 * the flow, if there is one for the local address and port.
+	 */
+	inp = in_pcblookup_lbgroup(pcbinfo, PF_INET, &faddr, fport, &laddr,
+	    lport, ifp, FALSE);
+	if (inp != NULL &&
+	    in_pcb_checkstate(inp, WNT_ACQUIRE, 0) != WNT_STOPUSING) {
+		lck_rw_done(pcbinfo->ipi_lock);
+		return (inp);
+	}
+
 	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
 	    pcbinfo->ipi_hashmask)];
 	LIST_FOREACH(inp, head, inp_hash) {
@@ -2000,6 +2052,19 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 			}
 		}
 	}
+
+	/*
+	 * Nothing is bound to the local address itself, so a group bound
+	 * to the wildcard address may take the flow.
+	 */
+	inp = in_pcblookup_lbgroup(pcbinfo, PF_INET, &faddr, fport, &laddr,
+	    lport, ifp, TRUE);
+	if (inp != NULL &&
+	    in_pcb_checkstate(inp, WNT_ACQUIRE, 0) != WNT_STOPUSING) {
+		lck_rw_done(pcbinfo->ipi_lock);
+		return (inp);
+	}
+
 	if (local_wild == NULL) {
 #if INET6
 		if (local_wild_mapped != NULL) {
@@ -2028,6 +2093,204 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 	return (NULL);
 }
 
+/*
+ * Pick the member of the load-balancing group bound to { laddr, lport },
+ * or with wild set to the wildcard address and lport, that should take
+ * the flow from { faddr, fport }.  Callers only try the wildcard group
+ * once no socket is bound to laddr itself, which is the precedence the
+ * regular wildcard lookup gives.  The choice only depends on the 4-tuple
+ * and the group's membership, so every packet of a flow lands on the same
+ * socket.  Returns NULL if there's no such group or the chosen member
+ * can't take the flow.  Called with ipi_lock held; no reference is taken
+ * on the returned pcb.
+ */
+struct inpcb *
+in_pcblookup_lbgroup(struct inpcbinfo *pcbinfo, int af, const void *faddr,
+    u_short fport, const void *laddr, u_short lport, struct ifnet *ifp,
+    boolean_t wild)
+{
+	struct inp_flowhash_key fh __attribute__((aligned(8)));
+	struct inpcbporthead *porthash;
+	struct inpcbport *phd;
+	struct inpcblbgroup *grp;
+	struct inpcb *inp;
+	struct socket *so;
+	size_t alen;
+
+	if (!inp_reuseport_lb)
+		return (NULL);
+
+	porthash = &pcbinfo->ipi_porthashbase[INP_PCBPORTHASH(lport,
+	    pcbinfo->ipi_porthashmask)];
+	LIST_FOREACH(phd, porthash, phd_hash) {
+		if (phd->phd_port == lport)
+			break;
+	}
+	if (phd == NULL || LIST_EMPTY(&phd->phd_lbgroups))
+		return (NULL);
+
+	alen = (af == PF_INET6) ? sizeof (struct in6_addr) :
+	    sizeof (struct in_addr);
+	LIST_FOREACH(grp, &phd->phd_lbgroups, il_link) {
+		if (grp->il_af != (u_int32_t)af)
+			continue;
+		if (!wild && bcmp(&grp->il_laddr, laddr, alen) == 0)
+			break;
+		if (wild && (af == PF_INET6 ?
+		    IN6_IS_ADDR_UNSPECIFIED(&grp->il_laddr.il6_addr) :
+		    grp->il_laddr.il4_addr.s_addr == INADDR_ANY))
+			break;
+	}
+	if (grp == NULL)
+		return (NULL);
+	VERIFY(grp->il_inpcnt > 0);
+
+	bzero(&fh, sizeof (fh));
+	bcopy(laddr, &fh.infh_laddr, alen);
+	bcopy(faddr, &fh.infh_faddr, alen);
+	fh.infh_lport = lport;
+	fh.infh_fport = fport;
+	fh.infh_af = af;
+	inp = grp->il_inp[net_flowhash(&fh, sizeof (fh), inp_lbgroup_seed) %
+	    grp->il_inpcnt];
+
+	/*
+	 * A TCP member that isn't listening (yet), one that has since been
+	 * connected, or one that may not receive on this interface can't
+	 * take the flow.
+	 */
+	so = inp->inp_socket;
+	if ((SOCK_PROTO(so) == IPPROTO_TCP &&
+	    !(so->so_options & SO_ACCEPTCONN)) || !in_pcblbgroup_eligible(inp) ||
+	    inp_restricted_recv(inp, ifp))
+		return (NULL);
+
+	return (inp);
+}
+
+/*
+ * Whether a hashed pcb belongs in a load-balancing group: a TCP or UDP
+ * socket with SO_REUSEPORT that isn't connected.  Membership is settled
+ * when the pcb is hashed at bind time and kept until it is removed from
+ * the lists; it isn't revisited on rehash, as UDP connects and
+ * disconnects around every sendto() on an unconnected socket.
+ */
+static boolean_t
+in_pcblbgroup_eligible(struct inpcb *inp)
+{
+	struct socket *so = inp->inp_socket;
+
+	if (!(so->so_options & SO_REUSEPORT) ||
+	    (SOCK_PROTO(so) != IPPROTO_TCP && SOCK_PROTO(so) != IPPROTO_UDP))
+		return (FALSE);
+#if INET6
+	if (SOCK_DOM(so) == PF_INET6)
+		return (IN6_IS_ADDR_UNSPECIFIED(&inp->in6p_faddr));
+#endif /* INET6 */
+	return (inp->inp_faddr.s_addr == INADDR_ANY);
+}
+
+/*
+ * Add a pcb to the group for its local address and port, creating the
+ * group if needed.  Must be called with ipi_lock held exclusively.  Not
+ * being able to join is harmless; the pcb is still found through the
+ * regular hash lists.
+ */
+static void
+in_pcblbgroup_insert(struct inpcb *inp)
+{
+	struct inpcbport *phd = inp->inp_phd;
+	struct inpcblbgroup *grp;
+	struct inpcb **inps;
+	const void *laddr;
+	size_t alen;
+	int af;
+
+	VERIFY(phd != NULL && !(inp->inp_flags2 & INP2_INLBGROUP));
+
+	af = SOCK_DOM(inp->inp_socket);
+#if INET6
+	if (af == PF_INET6) {
+		laddr = &inp->in6p_laddr;
+		alen = sizeof (struct in6_addr);
+	} else
+#endif /* INET6 */
+	{
+		laddr = &inp->inp_laddr;
+		alen = sizeof (struct in_addr);
+	}
+
+	LIST_FOREACH(grp, &phd->phd_lbgroups, il_link) {
+		if (grp->il_af == (u_int32_t)af &&
+		    bcmp(&grp->il_laddr, laddr, alen) == 0)
+			break;
+	}
+
+	if (grp == NULL) {
+		MALLOC(grp, struct inpcblbgroup *, sizeof (*grp), M_PCB,
+		    M_WAITOK | M_ZERO);
+		if (grp == NULL)
+			return;
+		MALLOC(grp->il_inp, struct inpcb **,
+		    INP_LBGROUP_MIN * sizeof (struct inpcb *), M_PCB, M_WAITOK);
+		if (grp->il_inp == NULL) {
+			FREE(grp, M_PCB);
+			return;
+		}
+		grp->il_af = af;
+		bcopy(laddr, &grp->il_laddr, alen);
+		grp->il_inpsiz = INP_LBGROUP_MIN;
+		LIST_INSERT_HEAD(&phd->phd_lbgroups, grp, il_link);
+	} else if (grp->il_inpcnt == grp->il_inpsiz) {
+		MALLOC(inps, struct inpcb **,
+		    2 * grp->il_inpsiz * sizeof (struct inpcb *), M_PCB,
+		    M_WAITOK);
+		if (inps == NULL)
+			return;
+		bcopy(grp->il_inp, inps,
+		    grp->il_inpcnt * sizeof (struct inpcb *));
+		FREE(grp->il_inp, M_PCB);
+		grp->il_inp = inps;
+		grp->il_inpsiz *= 2;
+	}
+
+	grp->il_inp[grp->il_inpcnt++] = inp;
+	inp->inp_flags2 |= INP2_INLBGROUP;
+}
+
+/*
+ * Take a pcb out of its load-balancing group, freeing the group when it
+ * becomes empty.  Must be called with ipi_lock held exclusively.
+ */
+static void
+in_pcblbgroup_remove(struct inpcb *inp)
+{
+	struct inpcblbgroup *grp;
+	u_int32_t i;
+
+	if (!(inp->inp_flags2 & INP2_INLBGROUP))
+		return;
+
+	LIST_FOREACH(grp, &inp->inp_phd->phd_lbgroups, il_link) {
+		for (i = 0; i < grp->il_inpcnt; i++) {
+			if (grp->il_inp[i] != inp)
+				continue;
+
+			/* Fill the hole with the last member */
+			grp->il_inp[i] = grp->il_inp[--grp->il_inpcnt];
+			if (grp->il_inpcnt == 0) {
+				LIST_REMOVE(grp, il_link);
+				FREE(grp->il_inp, M_PCB);
+				FREE(grp, M_PCB);
+			}
+			inp->inp_flags2 &= ~INP2_INLBGROUP;
+			return;
+		}
+	}
+	panic("%s: inp %p not found in any group\n", __func__, inp);
+	/* NOTREACHED */
+}
+
 /*
  * Insert PCB onto various hash lists.
  */
@@ -2098,15 +2361,21 @@ in_pcbinshash(struct inpcb *inp, int locked)
 		}
 		phd->phd_port = inp->inp_lport;
 		LIST_INIT(&phd->phd_pcblist);
+		LIST_INIT(&phd->phd_lbgroups);
 		LIST_INSERT_HEAD(pcbporthash, phd, phd_hash);
 	}
 
 	VERIFY(!(inp->inp_flags2 & INP2_INHASHLIST));
 	inp->inp_phd = phd;
 	LIST_INSERT_HEAD(&phd->phd_pcblist, inp, inp_portlist);
+	lck_rw_lock_exclusive(INP_PCBHASHLOCK(pcbinfo, inp->inp_hash_element));
 	LIST_INSERT_HEAD(pcbhash, inp, inp_hash);
+	lck_rw_done(INP_PCBHASHLOCK(pcbinfo, inp->inp_hash_element));
 	inp->inp_flags2 |= INP2_INHASHLIST;
 
+	if (in_pcblbgroup_eligible(inp))
+		in_pcblbgroup_insert(inp);
+
 	if (!locked)
 		lck_rw_done(pcbinfo->ipi_lock);
 	
@@ -2127,6 +2396,7 @@ in_pcbinshash(struct inpcb *inp, int locked)
 void
 in_pcbrehash(struct inpcb *inp)
 {
+	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
 	struct inpcbhead *head;
 	u_int32_t hashkey_faddr;
 
@@ -2137,17 +2407,22 @@ in_pcbrehash(struct inpcb *inp)
 #endif /* INET6 */
 		hashkey_faddr = inp->inp_faddr.s_addr;
 
-	inp->inp_hash_element = INP_PCBHASH(hashkey_faddr, inp->inp_lport,
-	    inp->inp_fport, inp->inp_pcbinfo->ipi_hashmask);
-	head = &inp->inp_pcbinfo->ipi_hashbase[inp->inp_hash_element];
-
 	if (inp->inp_flags2 & INP2_INHASHLIST) {
+		lck_rw_lock_exclusive(INP_PCBHASHLOCK(pcbinfo,
+		    inp->inp_hash_element));
 		LIST_REMOVE(inp, inp_hash);
+		lck_rw_done(INP_PCBHASHLOCK(pcbinfo, inp->inp_hash_element));
 		inp->inp_flags2 &= ~INP2_INHASHLIST;
 	}
 
+	inp->inp_hash_element = INP_PCBHASH(hashkey_faddr, inp->inp_lport,
+	    inp->inp_fport, pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[inp->inp_hash_element];
+
 	VERIFY(!(inp->inp_flags2 & INP2_INHASHLIST));
+	lck_rw_lock_exclusive(INP_PCBHASHLOCK(pcbinfo, inp->inp_hash_element));
 	LIST_INSERT_HEAD(head, inp, inp_hash);
+	lck_rw_done(INP_PCBHASHLOCK(pcbinfo, inp->inp_hash_element));
 	inp->inp_flags2 |= INP2_INHASHLIST;
 	
 #if NECP
@@ -2175,14 +2450,21 @@ in_pcbremlists(struct inpcb *inp)
 
 		VERIFY(phd != NULL && inp->inp_lport > 0);
 
+		lck_rw_lock_exclusive(INP_PCBHASHLOCK(inp->inp_pcbinfo,
+		    inp->inp_hash_element));
 		LIST_REMOVE(inp, inp_hash);
+		lck_rw_done(INP_PCBHASHLOCK(inp->inp_pcbinfo,
+		    inp->inp_hash_element));
 		inp->inp_hash.le_next = NULL;
 		inp->inp_hash.le_prev = NULL;
 
+		in_pcblbgroup_remove(inp);
+
 		LIST_REMOVE(inp, inp_portlist);
 		inp->inp_portlist.le_next = NULL;
 		inp->inp_portlist.le_prev = NULL;
 		if (LIST_EMPTY(&phd->phd_pcblist)) {
+			VERIFY(LIST_EMPTY(&phd->phd_lbgroups));
 			LIST_REMOVE(phd, phd_hash);
 			FREE(phd, M_PCB);
 		}
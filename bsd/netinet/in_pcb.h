@@ -495,10 +495,32 @@ struct	xinpgen {
 #define	in6p_sp		inp_sp
 #endif /* IPSEC */
 
+/*
+ * Load-balancing group: the wildcard (unconnected) pcbs bound to the same
+ * local address and port with SO_REUSEPORT.  New flows for that address
+ * and port are spread across the members by a hash of the 4-tuple.  Hangs
+ * off the port's inpcbport and is protected by ipi_lock, as is the rest
+ * of the port list.
+ */
+struct inpcblbgroup {
+	LIST_ENTRY(inpcblbgroup) il_link;	/* link on phd_lbgroups */
+	union {
+		struct in_addr	il4_addr;
+		struct in6_addr	il6_addr;
+	} il_laddr;				/* local address */
+	u_int32_t	il_af;			/* PF_INET or PF_INET6 */
+	u_int32_t	il_inpsiz;		/* size of il_inp[] */
+	u_int32_t	il_inpcnt;		/* number of members */
+	struct inpcb	**il_inp;		/* members */
+};
+
+#define	INP_LBGROUP_MIN		8	/* initial size of il_inp[] */
+
 struct inpcbport {
 	LIST_ENTRY(inpcbport) phd_hash;
 	struct inpcbhead phd_pcblist;
 	u_short phd_port;
+	LIST_HEAD(, inpcblbgroup) phd_lbgroups; /* SO_REUSEPORT groups */
 };
 
 struct intimercount {
@@ -569,6 +591,14 @@ struct inpcbinfo {
 	struct inpcbhead	*ipi_hashbase;
 	u_long			ipi_hashmask;
 
+	/*
+	 * Locks for shards of ipi_hashbase.  The hash chains are changed
+	 * with both ipi_lock held exclusive and the lock of the shard;
+	 * looking up a connected pcb only takes the shard lock.
+	 */
+	lck_rw_t		*ipi_hashlocks;
+	u_int32_t		ipi_hashlockmask;
+
 	/*
 	 * Per-protocol hash of pcbs, hashed by only local port number.
 	 */
@@ -588,6 +618,10 @@ struct inpcbinfo {
 #define	INP_PCBPORTHASH(lport, mask) \
 	(ntohs((lport)) & (mask))
 
+#define	INPCB_HASHLOCKS_MAX	64	/* max shards of the pcb hash */
+#define	INP_PCBHASHLOCK(ipi, hash) \
+	(&(ipi)->ipi_hashlocks[(hash) & (ipi)->ipi_hashlockmask])
+
 #define	INP_IS_FLOW_CONTROLLED(_inp_) \
 	((_inp_)->inp_flags & INP_FLOW_CONTROLLED)
 #define	INP_IS_FLOW_SUSPENDED(_inp_) \
@@ -678,6 +712,7 @@ struct inpcbinfo {
 #define	INP2_NO_IFF_EXPENSIVE	0x00000008 /* do not use expensive interface */
 #define	INP2_INHASHLIST		0x00000010 /* pcb is in inp_hash list */
 #define	INP2_AWDL_UNRESTRICTED	0x00000020 /* AWDL restricted mode allowed */
+#define	INP2_INLBGROUP		0x00000040 /* pcb is in a load-balancing group */
 
 /*
  * Flags passed to in_pcblookup*() functions.
@@ -788,6 +823,8 @@ extern int inp_findinpcb_procinfo(struct inpcbinfo *, uint32_t, struct so_procin
 extern void inp_get_soprocinfo(struct inpcb *, struct so_procinfo *);
 extern int inp_update_policy(struct inpcb *);
 extern boolean_t inp_restricted_recv(struct inpcb *, struct ifnet *);
+extern struct inpcb *in_pcblookup_lbgroup(struct inpcbinfo *, int,
+    const void *, u_short, const void *, u_short, struct ifnet *, boolean_t);
 extern boolean_t inp_restricted_send(struct inpcb *, struct ifnet *);
 #endif /* BSD_KERNEL_PRIVATE */
 #ifdef KERNEL_PRIVATE
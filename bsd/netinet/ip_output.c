@@ -103,6 +103,7 @@
 #include <netinet/in_var.h>
 #include <netinet/ip_var.h>
 #include <netinet/kpi_ipfilter_var.h>
+#include <netinet/tcp.h>
 
 #if CONFIG_MACF_NET
 #include <security/mac_framework.h>
@@ -179,6 +180,11 @@ SYSCTL_INT(_net_inet_ip, OID_AUTO, forge_ce,
 	"Forge ECN CE");
 #endif /* DEBUG */
 
+int ip_gso = 0;
+SYSCTL_INT(_net_inet_ip, OID_AUTO, gso,
+	CTLFLAG_RW | CTLFLAG_LOCKED, &ip_gso, 0,
+	"segment TCP in software for interfaces without TSO");
+
 static int ip_select_srcif_debug = 0;
 SYSCTL_INT(_net_inet_ip, OID_AUTO, select_srcif_debug,
 	CTLFLAG_RW | CTLFLAG_LOCKED, &ip_select_srcif_debug, 0,
@@ -1728,6 +1734,7 @@ pass:
 	 * care of the fragmentation for us, can just send directly.
 	 */
 	if ((u_short)ip->ip_len <= ifp->if_mtu || TSO_IPV4_OK(ifp, m) ||
+	    GSO_IPV4_OK(ifp, m) ||
 	    (!(ip->ip_off & IP_DF) && (ifp->if_hwassist & CSUM_FRAGMENT))) {
 #if BYTE_ORDER != BIG_ENDIAN
 		HTONS(ip->ip_len);
@@ -2034,6 +2041,160 @@ sendorfree:
 	return (error);
 }
 
+/*
+ * Compute or request the checksums of one software generated TCP
+ * segment, the same way ip_output_checksum() would for a packet of
+ * that size.  The IP header is in network byte order.
+ */
+static void
+ip_gso_cksum(struct ifnet *ifp, struct mbuf *m, int hlen, int tcplen)
+{
+	struct ip *ip = mtod(m, struct ip *);
+	struct tcphdr *th = (struct tcphdr *)(void *)((caddr_t)ip + hlen);
+	uint32_t hwcap = (hwcksum_tx ? IF_HWASSIST_CSUM_FLAGS(ifp->if_hwassist) :
+	    0);
+
+	m->m_pkthdr.csum_flags &= ~(IF_HWASSIST_CSUM_MASK | CSUM_TSO_IPV4);
+	m->m_pkthdr.csum_flags |= (CSUM_IP | CSUM_TCP);
+	m->m_pkthdr.csum_data = offsetof(struct tcphdr, th_sum);
+	m->m_pkthdr.tso_segsz = 0;
+
+	th->th_sum = in_pseudo(ip->ip_src.s_addr, ip->ip_dst.s_addr,
+	    htons((u_short)(tcplen + IPPROTO_TCP)));
+	if (!(hwcap & CSUM_TCP) || hlen != sizeof (struct ip))
+		in_delayed_cksum(m);
+
+	ip->ip_sum = 0;
+	if (!(hwcap & CSUM_IP) || hlen != sizeof (struct ip)) {
+		ip->ip_sum = ip_cksum_hdr_out(m, hlen);
+		m->m_pkthdr.csum_flags &= ~CSUM_DELAY_IP;
+	}
+}
+
+/*
+ * Split a TCP packet built for TSO into MSS sized segments, for an
+ * interface which does not do TSO itself.  This lets TCP hand a large
+ * packet to IP and the filters once, and have it cut up only on its
+ * way to the driver.  The IP header is in network byte order.
+ *
+ * Returns the segments linked through m_nextpkt, or NULL if the packet
+ * had to be dropped, in which case it has been freed.
+ */
+struct mbuf *
+ip_gso_segment(struct mbuf *m0, struct ifnet *ifp)
+{
+	struct mbuf *m, **mnext;
+	struct ip *ip, *mhip;
+	struct tcphdr *th, *mth;
+	int hlen, thlen, hdrlen, totlen, mss, off, len, nsegs = 1;
+	u_int32_t seq;
+	u_int16_t id;
+	u_int8_t flags;
+
+	VERIFY(m0->m_flags & M_PKTHDR);
+	VERIFY(m0->m_pkthdr.csum_flags & CSUM_TSO_IPV4);
+
+	if (m0->m_len < (int)sizeof (struct ip) &&
+	    (m0 = m_pullup(m0, sizeof (struct ip))) == NULL)
+		goto drop;
+	ip = mtod(m0, struct ip *);
+	hlen = IP_VHL_HL(ip->ip_vhl) << 2;
+	if (ip->ip_p != IPPROTO_TCP)
+		goto bad;
+	if (m0->m_len < hlen + (int)sizeof (struct tcphdr) &&
+	    (m0 = m_pullup(m0, hlen + sizeof (struct tcphdr))) == NULL)
+		goto drop;
+	ip = mtod(m0, struct ip *);
+	th = (struct tcphdr *)(void *)((caddr_t)ip + hlen);
+	thlen = th->th_off << 2;
+	hdrlen = hlen + thlen;
+	if (thlen < (int)sizeof (struct tcphdr) || hdrlen > MHLEN - max_linkhdr)
+		goto bad;
+	if (m0->m_len < hdrlen && (m0 = m_pullup(m0, hdrlen)) == NULL)
+		goto drop;
+	ip = mtod(m0, struct ip *);
+	th = (struct tcphdr *)(void *)((caddr_t)ip + hlen);
+
+	totlen = ntohs(ip->ip_len);
+	mss = m0->m_pkthdr.tso_segsz;
+	if (totlen != m0->m_pkthdr.len || mss <= 0)
+		goto bad;
+
+	id = ntohs(ip->ip_id);
+	seq = ntohl(th->th_seq);
+	flags = th->th_flags;
+	mnext = &m0->m_nextpkt;
+
+	/*
+	 * Build the segments after the first one out of copies of the
+	 * headers and references to the payload.
+	 */
+	for (off = hdrlen + mss; off < totlen; off += mss) {
+		len = min(mss, totlen - off);
+
+		MGETHDR(m, M_DONTWAIT, MT_HEADER);	/* MAC-OK */
+		if (m == NULL)
+			goto nobufs;
+		m->m_data += max_linkhdr;
+		bcopy(ip, mtod(m, caddr_t), hdrlen);
+		m->m_len = hdrlen;
+		m->m_next = m_copy(m0, off, len);
+		if (m->m_next == NULL) {
+			(void) m_free(m);
+			goto nobufs;
+		}
+		m->m_flags |= (m0->m_flags & (M_BCAST | M_MCAST | M_LOOP));
+		m->m_pkthdr.len = hdrlen + len;
+		m->m_pkthdr.rcvif = NULL;
+		m->m_pkthdr.csum_flags = m0->m_pkthdr.csum_flags;
+
+		M_COPY_CLASSIFIER(m, m0);
+		M_COPY_PFTAG(m, m0);
+
+#if CONFIG_MACF_NET
+		mac_netinet_fragment(m0, m);
+#endif /* CONFIG_MACF_NET */
+
+		mhip = mtod(m, struct ip *);
+		mhip->ip_len = htons((u_short)(hdrlen + len));
+		mhip->ip_id = htons(id + nsegs);
+		mth = (struct tcphdr *)(void *)((caddr_t)mhip + hlen);
+		mth->th_seq = htonl(seq + (off - hdrlen));
+		/* CWR goes out once; FIN and PUSH only on the last one */
+		mth->th_flags = flags & ~TH_CWR;
+		if (off + len < totlen)
+			mth->th_flags &= ~(TH_FIN | TH_PUSH);
+		ip_gso_cksum(ifp, m, hlen, thlen + len);
+
+		*mnext = m;
+		mnext = &m->m_nextpkt;
+		nsegs++;
+	}
+
+	/* what is left of the original packet is the first segment */
+	if (nsegs > 1) {
+		m_adj(m0, hdrlen + mss - totlen);
+		ip->ip_len = htons((u_short)(hdrlen + mss));
+		th->th_flags &= ~(TH_FIN | TH_PUSH);
+	}
+	ip_gso_cksum(ifp, m0, hlen, m0->m_pkthdr.len - hlen);
+
+	OSAddAtomic(1, &ipstat.ips_gso);
+	OSAddAtomic(nsegs, &ipstat.ips_gso_segs);
+
+	return (m0);
+
+bad:
+	m_freem(m0);
+drop:
+	OSAddAtomic(1, &ipstat.ips_odropped);
+	return (NULL);
+
+nobufs:
+	m_freem_list(m0);
+	goto drop;
+}
+
 static void
 ip_out_cksum_stats(int proto, u_int32_t len)
 {
@@ -3392,6 +3553,12 @@ ip_output_checksum(struct ifnet *ifp, struct mbuf *m, int hlen, int ip_len,
 	int tso = TSO_IPV4_OK(ifp, m);
 	uint32_t hwcap = ifp->if_hwassist;
 
+	if (GSO_IPV4_OK(ifp, m)) {
+		/* ip_gso_segment() does it for each segment */
+		*sw_csum = 0;
+		return;
+	}
+
 	m->m_pkthdr.csum_flags |= CSUM_IP;
 
 	if (!hwcksum_tx) {
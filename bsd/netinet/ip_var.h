@@ -221,6 +221,8 @@ struct	ipstat {
 	u_int32_t ips_snd_swcsum_bytes;	/* ip hdr swcksum (outbound), bytes */
 	u_int32_t ips_adj;		/* total packets trimmed/adjusted */
 	u_int32_t ips_adj_hwcsum_clr;	/* hwcksum discarded during adj */
+	u_int32_t ips_gso;		/* TSO packets segmented in software */
+	u_int32_t ips_gso_segs;		/* segments created by the above */
 };
 
 struct ip_linklocal_stat {
@@ -247,6 +249,12 @@ struct ip_moptions;
 
 #define	IP_HDR_ALIGNED_P(_ip)	((((uintptr_t)(_ip)) & ((uintptr_t)3)) == 0)
 
+/*
+ * True for a TSO packet which is to be segmented by ip_gso_segment()
+ * on its way to an interface that cannot do TSO.
+ */
+#define	GSO_IPV4_OK(_ifp, _m)	(ip_gso && TSO_IPV4_NOTOK(_ifp, _m))
+
 /*
  * On platforms which require strict alignment (currently for anything but
  * i386 or x86_64), this macro checks whether the pointer to the IP header
@@ -293,6 +301,7 @@ struct ip_out_args {
 
 extern struct ipstat ipstat;
 extern int ip_use_randomid;
+extern int ip_gso;			/* software TSO */
 extern u_short ip_id;			/* ip packet ctr, for ids */
 extern int ip_defttl;			/* default IP ttl */
 extern int ipforwarding;		/* ip forwarding */
@@ -329,6 +338,7 @@ extern void ip_initid(void);
 extern u_int16_t ip_randomid(void);
 extern void ip_proto_dispatch_in_wrapper(struct mbuf *, int, u_int8_t);
 extern int ip_fragment(struct mbuf *, struct ifnet *, unsigned long, int);
+extern struct mbuf *ip_gso_segment(struct mbuf *, struct ifnet *);
 
 extern void ip_setsrcifaddr_info(struct mbuf *, uint32_t, struct in_ifaddr *);
 extern void ip_setdstifaddr_info(struct mbuf *, uint32_t, struct in_ifaddr *);
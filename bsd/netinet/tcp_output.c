@@ -833,10 +833,16 @@ after_sack_rexmit:
 	if (ipsec_bypass == 0)
 		ipsec_optlen = ipsec_hdrsiz_tcp(tp);
 #endif
+	/*
+	 * IP and interface filters are not shown hardware TSO packets.
+	 * Software TSO packets are fine for IP filters, since they are
+	 * meant to see a super-packet once, and are segmented before
+	 * the interface filters run.
+	 */
 	if (len > tp->t_maxseg) {
 		if ((tp->t_flags & TF_TSO) && tcp_do_tso && hwcksum_tx &&
-		    ip_use_randomid && kipf_count == 0 &&
-		    dlil_filter_disable_tso_count == 0 &&
+		    ip_use_randomid && ((tp->t_flagsext & TF_GSO) ||
+		    (kipf_count == 0 && dlil_filter_disable_tso_count == 0)) &&
 		    tp->rcv_numsacks == 0 && sack_rxmit == 0  &&
 		    sack_bytes_rxmt == 0 &&
 		    inp->inp_options == NULL &&
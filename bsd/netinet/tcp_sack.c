@@ -124,6 +124,46 @@ SYSCTL_INT(_net_inet_tcp, OID_AUTO, sack_globalholes, CTLFLAG_RD | CTLFLAG_LOCKE
 
 extern struct zone *sack_hole_zone;
 
+/*
+ * Besides the ordered list, the scoreboard keeps its holes in a tree
+ * keyed by start so that a SACK block can find the holes it touches
+ * without walking the list.  Holes never overlap and a hole's start
+ * only moves forward within the hole, so trimming one in place never
+ * changes its position in either.
+ */
+static int tcp_sackhole_cmp(const struct sackhole *, const struct sackhole *);
+RB_PROTOTYPE(sackhole_tree, sackhole, scbnode, tcp_sackhole_cmp);
+RB_GENERATE(sackhole_tree, sackhole, scbnode, tcp_sackhole_cmp);
+
+static int
+tcp_sackhole_cmp(const struct sackhole *a, const struct sackhole *b)
+{
+	if (SEQ_LT(a->start, b->start))
+		return (-1);
+	if (SEQ_GT(a->start, b->start))
+		return (1);
+	return (0);
+}
+
+/*
+ * Return the last SACK hole that starts before seq, if any.
+ */
+static struct sackhole *
+tcp_sackhole_lookup(struct tcpcb *tp, tcp_seq seq)
+{
+	struct sackhole *hole = RB_ROOT(&tp->snd_holetree), *last = NULL;
+
+	while (hole != NULL) {
+		if (SEQ_LT(hole->start, seq)) {
+			last = hole;
+			hole = RB_RIGHT(hole, scbnode);
+		} else {
+			hole = RB_LEFT(hole, scbnode);
+		}
+	}
+	return (last);
+}
+
 /*
  * This function is called upon receipt of new valid data (while not in header
  * prediction mode), and it updates the ordered list of sacks.
@@ -289,6 +329,8 @@ tcp_sackhole_insert(struct tcpcb *tp, tcp_seq start, tcp_seq end,
 		TAILQ_INSERT_AFTER(&tp->snd_holes, after, hole, scblink);
 	else
 		TAILQ_INSERT_TAIL(&tp->snd_holes, hole, scblink);
+	RB_INSERT(sackhole_tree, &tp->snd_holetree, hole);
+	tp->sackhint.sack_bytes_holes += (end - start);
 
 	/* Update SACK hint. */
 	if (tp->sackhint.nexthole == NULL)
@@ -309,6 +351,8 @@ tcp_sackhole_remove(struct tcpcb *tp, struct sackhole *hole)
 
 	/* Remove this SACK hole. */
 	TAILQ_REMOVE(&tp->snd_holes, hole, scblink);
+	RB_REMOVE(sackhole_tree, &tp->snd_holetree, hole);
+	tp->sackhint.sack_bytes_holes -= (hole->end - hole->start);
 
 	/* Free this SACK hole. */
 	tcp_sackhole_free(tp, hole);
@@ -508,8 +552,12 @@ tcp_sack_doack(struct tcpcb *tp, struct tcpopt *to, struct tcphdr *th,
 		*newbytes_acked += (sblkp->end - tp->snd_fack);
 		tp->snd_fack = sblkp->end;
 	}
-	/* We must have at least one SACK hole in scoreboard */
-	cur = TAILQ_LAST(&tp->snd_holes, sackhole_head); /* Last SACK hole */
+	/*
+	 * Start from the last hole that the highest remaining SACK block
+	 * can touch, rather than from the tail of the scoreboard.
+	 */
+	cur = (sblkp >= sack_blocks) ?
+	    tcp_sackhole_lookup(tp, sblkp->end) : NULL;
 	/*
 	 * Since the incoming sack blocks are sorted, we can process them
 	 * making one sweep of the scoreboard.
@@ -526,9 +574,13 @@ tcp_sack_doack(struct tcpcb *tp, struct tcpopt *to, struct tcphdr *th,
 		if (SEQ_LEQ(sblkp->end, cur->start)) {
 			/*
 			 * SACKs data before the current hole.
-			 * Go to the previous hole.
+			 * Go to the last hole it can touch; usually that
+			 * is the previous one.
 			 */
-			cur = TAILQ_PREV(cur, sackhole_head, scblink);
+			temp = TAILQ_PREV(cur, sackhole_head, scblink);
+			if (temp != NULL && SEQ_GEQ(temp->start, sblkp->end))
+				temp = tcp_sackhole_lookup(tp, sblkp->end);
+			cur = temp;
 			continue;
 		}
 		tp->sackhint.sack_bytes_rexmit -= (cur->rxmit - cur->start);
@@ -553,6 +605,8 @@ tcp_sack_doack(struct tcpcb *tp, struct tcpopt *to, struct tcphdr *th,
 				*newbytes_acked += (sblkp->end - cur->start);
 				tcp_sack_detect_reordering(tp, cur,
 				    sblkp->end, old_snd_fack);
+				tp->sackhint.sack_bytes_holes -=
+				    (sblkp->end - cur->start);
 				cur->start = sblkp->end;
 				cur->rxmit = SEQ_MAX(cur->rxmit, cur->start);
 			}
@@ -563,6 +617,8 @@ tcp_sack_doack(struct tcpcb *tp, struct tcpopt *to, struct tcphdr *th,
 				*newbytes_acked += (cur->end - sblkp->start);
 				tcp_sack_detect_reordering(tp, cur,
 				    cur->end, old_snd_fack);
+				tp->sackhint.sack_bytes_holes -=
+				    (cur->end - sblkp->start);
 				cur->end = sblkp->start;
 				cur->rxmit = SEQ_MIN(cur->rxmit, cur->end);
 			} else {
@@ -582,6 +638,8 @@ tcp_sack_doack(struct tcpcb *tp, struct tcpopt *to, struct tcphdr *th,
 							+= (temp->rxmit
 							    - temp->start);
 					}
+					tp->sackhint.sack_bytes_holes -=
+					    (cur->end - sblkp->start);
 					cur->end = sblkp->start;
 					cur->rxmit = SEQ_MIN(cur->rxmit,
 							     cur->end);
@@ -618,6 +676,8 @@ tcp_free_sackholes(struct tcpcb *tp)
 
 	while ((q = TAILQ_FIRST(&tp->snd_holes)) != NULL)
 		tcp_sackhole_remove(tp, q);
+	VERIFY(RB_EMPTY(&tp->snd_holetree));
+	VERIFY(tp->sackhint.sack_bytes_holes == 0);
 	tp->sackhint.sack_bytes_rexmit = 0;
 	tp->sackhint.nexthole = NULL;
 	tp->sack_newdata = 0;
@@ -655,9 +715,10 @@ tcp_sack_partialack(tp, th)
 	(void) tcp_output(tp);
 }
 
+#if DEBUG
 /*
- * Debug version of tcp_sack_output() that walks the scoreboard. Used for
- * now to sanity check the hint.
+ * Debug version of tcp_sack_output() that walks the scoreboard. Used to
+ * sanity check the hint.
  */
 static struct sackhole *
 tcp_sack_output_debug(struct tcpcb *tp, int *sack_bytes_rexmt)
@@ -677,6 +738,7 @@ tcp_sack_output_debug(struct tcpcb *tp, int *sack_bytes_rexmt)
 	}
 	return (p);
 }
+#endif /* DEBUG */
 
 /*
  * Returns the next hole to retransmit and the number of retransmitted bytes
@@ -698,10 +760,13 @@ tcp_sack_output_debug(struct tcpcb *tp, int *sack_bytes_rexmt)
 struct sackhole *
 tcp_sack_output(struct tcpcb *tp, int *sack_bytes_rexmt)
 {
-	struct sackhole *hole = NULL, *dbg_hole = NULL;
+	struct sackhole *hole = NULL;
+#if DEBUG
+	struct sackhole *dbg_hole = NULL;
 	int dbg_bytes_rexmt;
 
 	dbg_hole = tcp_sack_output_debug(tp, &dbg_bytes_rexmt);
+#endif /* DEBUG */
 	*sack_bytes_rexmt = tp->sackhint.sack_bytes_rexmit;
 	hole = tp->sackhint.nexthole;
 	if (hole == NULL || SEQ_LT(hole->rxmit, hole->end))
@@ -713,6 +778,7 @@ tcp_sack_output(struct tcpcb *tp, int *sack_bytes_rexmt)
 		}
 	}
 out:
+#if DEBUG
 	if (dbg_hole != hole) {
 		printf("%s: Computed sack hole not the same as cached value\n", __func__);
 		hole = dbg_hole;
@@ -723,6 +789,7 @@ out:
 		       __func__, dbg_bytes_rexmt, *sack_bytes_rexmt);
 		*sack_bytes_rexmt = dbg_bytes_rexmt;
 	}
+#endif /* DEBUG */
 	return (hole);
 }
 
@@ -734,9 +801,9 @@ out:
 void
 tcp_sack_adjust(struct tcpcb *tp)
 {
-	struct sackhole *p, *cur = TAILQ_FIRST(&tp->snd_holes);
+	struct sackhole *p, *cur;
 
-	if (cur == NULL)
+	if (TAILQ_EMPTY(&tp->snd_holes))
 		return; /* No holes */
 	if (SEQ_GEQ(tp->snd_nxt, tp->snd_fack))
 		return; /* We're already beyond any SACKed blocks */
@@ -744,20 +811,15 @@ tcp_sack_adjust(struct tcpcb *tp)
 	 * Two cases for which we want to advance snd_nxt:
 	 * i) snd_nxt lies between end of one hole and beginning of another
 	 * ii) snd_nxt lies between end of last hole and snd_fack
+	 * Either way, cur is the last hole starting at or before snd_nxt.
 	 */
-	while ((p = TAILQ_NEXT(cur, scblink)) != NULL) {
-		if (SEQ_LT(tp->snd_nxt, cur->end))
-			return;
-		if (SEQ_GEQ(tp->snd_nxt, p->start))
-			cur = p;
-		else {
-			tp->snd_nxt = p->start;
-			return;
-		}
-	}
-	if (SEQ_LT(tp->snd_nxt, cur->end))
+	cur = tcp_sackhole_lookup(tp, tp->snd_nxt + 1);
+	if (cur == NULL || SEQ_LT(tp->snd_nxt, cur->end))
 		return;
-	tp->snd_nxt = tp->snd_fack;
+	if ((p = TAILQ_NEXT(cur, scblink)) != NULL)
+		tp->snd_nxt = p->start;
+	else
+		tp->snd_nxt = tp->snd_fack;
 	return;
 }
 
@@ -768,18 +830,15 @@ tcp_sack_adjust(struct tcpcb *tp)
 boolean_t
 tcp_sack_byte_islost(struct tcpcb *tp)
 {
-	u_int32_t unacked_bytes, sndhole_bytes = 0;
-	struct sackhole *sndhole;
+	u_int32_t unacked_bytes, sndhole_bytes;
+
 	if (!SACK_ENABLED(tp) || IN_FASTRECOVERY(tp) ||
 	    TAILQ_EMPTY(&tp->snd_holes) ||
 	    (tp->t_flagsext & TF_PKTS_REORDERED))
 		return (FALSE);
 
 	unacked_bytes = tp->snd_max - tp->snd_una;
-
-	TAILQ_FOREACH(sndhole, &tp->snd_holes, scblink) {
-		sndhole_bytes += (sndhole->end - sndhole->start);
-	}
+	sndhole_bytes = tp->sackhint.sack_bytes_holes;
 
 	VERIFY(unacked_bytes >= sndhole_bytes);
 	return ((unacked_bytes - sndhole_bytes) >
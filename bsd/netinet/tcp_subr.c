@@ -352,6 +352,7 @@ tcp_init(struct protosw *pp, struct domain *dp)
 	static int tcp_initialized = 0;
 	vm_size_t       str_size;
 	struct inpcbinfo *pcbinfo;
+	int i;
 
 	VERIFY((pp->pr_flags & (PR_INITIALIZED|PR_ATTACHED)) == PR_ATTACHED);
 
@@ -470,6 +471,10 @@ tcp_init(struct protosw *pp, struct domain *dp)
 
 	bzero(&tcp_timer_list, sizeof(tcp_timer_list));
 	LIST_INIT(&tcp_timer_list.lhead);
+	for (i = 0; i < TCP_TIMERWHEEL_SLOTS; i++) {
+		LIST_INIT(&tcp_timer_list.l0[i]);
+		LIST_INIT(&tcp_timer_list.l1[i]);
+	}
 	/*
 	 * allocate lock group attribute, group and attribute for the tcp timer list
 	 */
@@ -909,6 +914,7 @@ tcp_newtcpcb(inp)
 		tp->t_flagsext |= TF_SACK_ENABLE;
 
 	TAILQ_INIT(&tp->snd_holes);
+	RB_INIT(&tp->snd_holetree);
 	tp->t_inpcb = inp;	/* XXX */
 	/*
 	 * Init srtt to TCPTV_SRTTBASE (0), so we can tell that we have no
@@ -2690,9 +2696,11 @@ tcp_set_tso(struct tcpcb *tp, struct ifnet *ifp)
 	 */
 	if (tp->t_mpflags & TMPF_MPTCP_TRUE) {
 		tp->t_flags &= ~TF_TSO;
+		tp->t_flagsext &= ~TF_GSO;
 		return;
 	}
 #endif
+	tp->t_flagsext &= ~TF_GSO;
 #if INET6
 	inp = tp->t_inpcb;
 	isipv6 = (inp->inp_vflag & INP_IPV6) != 0;
@@ -2717,6 +2725,11 @@ tcp_set_tso(struct tcpcb *tp, struct ifnet *ifp)
 				tp->tso_max_segment_size = ifp->if_tso_v4_mtu;
 			else
 				tp->tso_max_segment_size = TCP_MAXWIN;
+		} else if (ifp && ip_gso) {
+			/* segmented in software on the way to the driver */
+			tp->t_flags |= TF_TSO;
+			tp->t_flagsext |= TF_GSO;
+			tp->tso_max_segment_size = TCP_MAXWIN;
 		} else
 				tp->t_flags &= ~TF_TSO;
 	}
@@ -275,6 +275,7 @@ int	tcp_jack_rxmt = TCP_RETRANSHZ / 2;
 #endif /* MPTCP */
 
 static void tcp_remove_timer(struct tcpcb *tp);
+static void tcp_timer_refile(struct tcpcb *tp);
 static void tcp_sched_timerlist(uint32_t offset);
 static u_int32_t tcp_run_conn_timer(struct tcpcb *tp, u_int16_t *mode);
 static void tcp_sched_timers(struct tcpcb *tp);
@@ -1256,6 +1257,25 @@ fc_output:
 	return (tp);
 }
 
+/*
+ * Move a connection's timer entry to the wheel slot for its current
+ * deadline, after its timers have been run or rearmed.
+ */
+static void
+tcp_timer_refile(struct tcpcb *tp)
+{
+	struct tcptimerlist *listp = &tcp_timer_list;
+
+	lck_mtx_assert(&tp->t_inpcb->inpcb_mtx, LCK_MTX_ASSERT_OWNED);
+	lck_mtx_lock(listp->mtx);
+	if (TIMER_IS_ON_LIST(tp)) {
+		tcp_timer_unlink(listp, &tp->tentry);
+		tcp_timer_insert(listp, &tp->tentry, tp->tentry.runtime);
+	}
+	lck_mtx_unlock(listp->mtx);
+}
+
+
 /* Remove a timer entry from timer list */
 void
 tcp_remove_timer(struct tcpcb *tp)
@@ -1274,16 +1294,10 @@ tcp_remove_timer(struct tcpcb *tp)
 		return;
 	}
 	
-	if (listp->next_te != NULL && listp->next_te == &tp->tentry)
-		listp->next_te = LIST_NEXT(&tp->tentry, le);
-
-	LIST_REMOVE(&tp->tentry, le);
+	tcp_timer_unlink(listp, &tp->tentry);
 	tp->t_flags &= ~(TF_TIMER_ONLIST);
 
 	listp->entries--;
-
-	tp->tentry.le.le_next = NULL;
-	tp->tentry.le.le_prev = NULL;
 	lck_mtx_unlock(listp->mtx);
 }
 
@@ -1476,6 +1490,8 @@ done:
 	if (tp != NULL && tp->tentry.index == TCPT_NONE) {
 		tcp_remove_timer(tp);
 		offset = 0;
+	} else if (tp != NULL) {
+		tcp_timer_refile(tp);
 	}
 
 	tcp_unlock(so, 1, 0);
@@ -1498,16 +1514,17 @@ tcp_run_timerlist(void * arg1, void * arg2) {
 	lck_mtx_lock(listp->mtx);
 
 	listp->running = TRUE;
-	
+
+	/* Only the entries in the slots that came due need looking at */
+	tcp_timer_collect(listp);
+
 	LIST_FOREACH_SAFE(te, &listp->lhead, le, next_te) {
 		uint32_t offset = 0;
 		uint32_t runtime = te->runtime;
 		if (te->index < TCPT_NONE && TSTMP_GT(runtime, tcp_now)) {
-			offset = timer_diff(runtime, 0, tcp_now, 0);
-			if (next_timer == 0 || offset < next_timer) {
-				next_timer = offset;
-			}
-			list_mode |= te->mode;
+			/* Rearmed for later since it was filed */
+			tcp_timer_unlink(listp, te);
+			tcp_timer_insert(listp, te, runtime);
 			continue;
 		}
 
@@ -1528,11 +1545,8 @@ tcp_run_timerlist(void * arg1, void * arg2) {
 			 */
 			if (TIMER_IS_ON_LIST(tp)) {
 				tp->t_flags &= ~(TF_TIMER_ONLIST);
-				LIST_REMOVE(&tp->tentry, le);
+				tcp_timer_unlink(listp, &tp->tentry);
 				listp->entries--;
-
-				tp->tentry.le.le_next = NULL;
-				tp->tentry.le.le_prev = NULL;
 			}
 			continue;
 		}
@@ -1549,6 +1563,14 @@ tcp_run_timerlist(void * arg1, void * arg2) {
 		VERIFY_NEXT_LINK(&tp->tentry, le);
 		VERIFY_PREV_LINK(&tp->tentry, le);
 
+		/*
+		 * Park the entry on the next slot to run while its timers
+		 * are being run; tcp_run_conn_timer() refiles it for its
+		 * new deadline, or takes it off if it has none.
+		 */
+		tcp_timer_unlink(listp, te);
+		tcp_timer_insert(listp, te, listp->wheeltime);
+
 		lck_mtx_unlock(listp->mtx);
 
 		offset = tcp_run_conn_timer(tp, &te_mode);
@@ -1566,8 +1588,19 @@ tcp_run_timerlist(void * arg1, void * arg2) {
 		}
 	}
 
-	if (!LIST_EMPTY(&listp->lhead)) {
+	VERIFY(LIST_EMPTY(&listp->lhead));
+	if (listp->entries > 0) {
 		u_int16_t next_mode = 0;
+		u_int16_t wheel_mode = 0;
+		uint32_t wheel_timer;
+
+		wheel_timer = tcp_timer_next(listp, &wheel_mode);
+		if (wheel_timer > 0) {
+			list_mode |= wheel_mode;
+			if (next_timer == 0 || wheel_timer < next_timer)
+				next_timer = wheel_timer;
+		}
+
 		if ((list_mode & TCP_TIMERLIST_10MS_MODE) ||
 			(listp->pref_mode & TCP_TIMERLIST_10MS_MODE))
 			next_mode = TCP_TIMERLIST_10MS_MODE;
@@ -1665,7 +1698,7 @@ tcp_sched_timers(struct tcpcb *tp)
 			list_locked = TRUE;
 		}
 
-		LIST_INSERT_HEAD(&listp->lhead, te, le);
+		tcp_timer_insert(listp, te, te->runtime);
 		tp->t_flags |= TF_TIMER_ONLIST;
 
 		listp->entries++;
@@ -1675,6 +1708,21 @@ tcp_sched_timers(struct tcpcb *tp)
 		/* if the list is not scheduled, just schedule it */
 		if (!listp->scheduled)
 			goto schedule;
+	} else if (TSTMP_LT(te->runtime, te->wheeltime)) {
+		/*
+		 * Rearmed for earlier than the wheel slot it is on will
+		 * run; move it.  Entries being run by the timer list are
+		 * left for it to refile.
+		 */
+		if (!list_locked) {
+			lck_mtx_lock(listp->mtx);
+			list_locked = TRUE;
+		}
+		if (te->level != TCP_TIMERWHEEL_RUN &&
+		    TSTMP_LT(te->runtime, te->wheeltime)) {
+			tcp_timer_unlink(listp, te);
+			tcp_timer_insert(listp, te, te->runtime);
+		}
 	}
 
 
@@ -236,12 +236,47 @@ struct tcptimerentry {
 	uint16_t index;		/* index of lowest timer that needs to run first */
 	uint16_t mode;		/* Bit-wise OR of timers that are active */
 	uint32_t runtime;	/* deadline at which the first timer has to fire */
+	uint32_t wheeltime;	/* latest time its wheel slot will be run */
+	uint16_t level;		/* where on the timer list the entry is */
+#define	TCP_TIMERWHEEL_RUN	0	/* being run, on lhead */
+#define	TCP_TIMERWHEEL_L0	1	/* on level 0 of the wheel */
+#define	TCP_TIMERWHEEL_L1	2	/* on level 1 of the wheel */
 };
 
 LIST_HEAD(timerlisthead, tcptimerentry);
 
+/*
+ * Connections with active timers are kept on a two level hashed timing
+ * wheel indexed by the deadline of their first timer.  Level 0 has one
+ * slot per TCP_TIMERWHEEL_L0_TICKS ticks and covers the next couple of
+ * seconds; level 1 has one slot per revolution of level 0.  When the
+ * timer list runs it only looks at the level 0 slots that have come due,
+ * and at a level 1 slot when level 0 wraps, re-filing its entries into
+ * level 0 or, if their deadline is further out than level 1 reaches,
+ * back into level 1.
+ *
+ * Rearming a timer for a later deadline leaves the entry where it is;
+ * it is moved when its slot comes up.  Only an earlier deadline than the
+ * slot's (wheeltime) requires moving the entry right away.
+ */
+#define	TCP_TIMERWHEEL_SHIFT	8
+#define	TCP_TIMERWHEEL_SLOTS	(1 << TCP_TIMERWHEEL_SHIFT)
+#define	TCP_TIMERWHEEL_MASK	(TCP_TIMERWHEEL_SLOTS - 1)
+#define	TCP_TIMERWHEEL_L0_SHIFT	3
+#define	TCP_TIMERWHEEL_L0_TICKS	(1 << TCP_TIMERWHEEL_L0_SHIFT)
+#define	TCP_TIMERWHEEL_L1_SHIFT	(TCP_TIMERWHEEL_L0_SHIFT + TCP_TIMERWHEEL_SHIFT)
+#define	TCP_TIMERWHEEL_L1_TICKS	(1 << TCP_TIMERWHEEL_L1_SHIFT)
+#define	TCP_TIMERWHEEL_L0_SLOT(t) \
+	(((t) >> TCP_TIMERWHEEL_L0_SHIFT) & TCP_TIMERWHEEL_MASK)
+#define	TCP_TIMERWHEEL_L1_SLOT(t) \
+	(((t) >> TCP_TIMERWHEEL_L1_SHIFT) & TCP_TIMERWHEEL_MASK)
+
 struct tcptimerlist {
-	struct timerlisthead lhead;	/* head of the list */
+	struct timerlisthead lhead;	/* entries being run */
+	struct timerlisthead l0[TCP_TIMERWHEEL_SLOTS];	/* wheel, level 0 */
+	struct timerlisthead l1[TCP_TIMERWHEEL_SLOTS];	/* wheel, level 1 */
+	uint32_t wheeltime;	/* start of the next level 0 slot to run */
+	uint32_t l0entries;	/* Number of entries on level 0 */
 	lck_mtx_t *mtx;		/* lock to protect the list */
 	lck_attr_t *mtx_attr;	/* mutex attributes */
 	lck_grp_t *mtx_grp;	/* mutex group definition */
@@ -265,6 +300,13 @@ struct tcptimerlist {
 
 };
 
+/* tcp_timer_wheel.c; called with the timer list lock held */
+extern void tcp_timer_insert(struct tcptimerlist *, struct tcptimerentry *,
+    uint32_t);
+extern void tcp_timer_unlink(struct tcptimerlist *, struct tcptimerentry *);
+extern void tcp_timer_collect(struct tcptimerlist *);
+extern uint32_t tcp_timer_next(struct tcptimerlist *, u_int16_t *);
+
 /* number of idle runs allowed for TCP timer list in fast or quick modes */
 #define TCP_FASTMODE_IDLERUN_MAX 10
 
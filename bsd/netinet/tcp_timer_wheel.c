@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * The hashed timing wheel that the TCP timer list files connections on;
+ * see the description in tcp_timer.h.  These routines only deal with
+ * timer entries and the wheel itself, and leave the connections, the
+ * list lock and the thread call to tcp_timer.c.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/queue.h>
+#include <kern/locks.h>
+
+#include <netinet/tcp_seq.h>
+#include <netinet/tcp_timer.h>
+#include <netinet/tcp_var.h>
+
+/*
+ * File a timer entry on the timing wheel to run at runtime, normally the
+ * deadline of its first timer.  Called with the timer list lock held.
+ */
+void
+tcp_timer_insert(struct tcptimerlist *listp, struct tcptimerentry *te,
+    uint32_t runtime)
+{
+	int32_t diff;
+
+	/* An idle wheel has nothing to catch up on; start it from now */
+	if (listp->entries == 0 && !listp->running)
+		listp->wheeltime = tcp_now & ~(TCP_TIMERWHEEL_L0_TICKS - 1);
+
+	diff = timer_diff(runtime, 0, listp->wheeltime, 0);
+	if (diff < 0) {
+		/* Overdue, run it with the next slot */
+		runtime = listp->wheeltime;
+		diff = 0;
+	}
+
+	if (diff < TCP_TIMERWHEEL_L1_TICKS) {
+		LIST_INSERT_HEAD(&listp->l0[TCP_TIMERWHEEL_L0_SLOT(runtime)],
+		    te, le);
+		te->level = TCP_TIMERWHEEL_L0;
+		te->wheeltime = runtime & ~(TCP_TIMERWHEEL_L0_TICKS - 1);
+		listp->l0entries++;
+	} else {
+		/*
+		 * Deadlines beyond the reach of level 1 share a slot with
+		 * nearer ones and get looked at once every revolution.
+		 */
+		LIST_INSERT_HEAD(&listp->l1[TCP_TIMERWHEEL_L1_SLOT(runtime)],
+		    te, le);
+		te->level = TCP_TIMERWHEEL_L1;
+		te->wheeltime = runtime & ~(TCP_TIMERWHEEL_L1_TICKS - 1);
+	}
+}
+
+/*
+ * Take a timer entry off the wheel or off the list of entries being run.
+ * Called with the timer list lock held.
+ */
+void
+tcp_timer_unlink(struct tcptimerlist *listp, struct tcptimerentry *te)
+{
+	if (listp->next_te != NULL && listp->next_te == te)
+		listp->next_te = LIST_NEXT(te, le);
+
+	LIST_REMOVE(te, le);
+	if (te->level == TCP_TIMERWHEEL_L0) {
+		VERIFY(listp->l0entries > 0);
+		listp->l0entries--;
+	}
+	te->le.le_next = NULL;
+	te->le.le_prev = NULL;
+}
+
+/*
+ * Advance the wheel up to tcp_now, moving the entries of every slot that
+ * has come due onto lhead to be run.  Called with the timer list lock
+ * held.
+ */
+void
+tcp_timer_collect(struct tcptimerlist *listp)
+{
+	struct timerlisthead cascade;
+	struct tcptimerentry *te;
+	uint32_t now = tcp_now, next;
+	int i;
+
+	if (listp->entries == 0) {
+		listp->wheeltime = (now & ~(TCP_TIMERWHEEL_L0_TICKS - 1)) +
+		    TCP_TIMERWHEEL_L0_TICKS;
+		return;
+	}
+
+	/*
+	 * If the list has not run for a whole revolution of level 1,
+	 * every slot is due; just run everything.
+	 */
+	if (timer_diff(now, 0, listp->wheeltime, 0) >=
+	    TCP_TIMERWHEEL_SLOTS * TCP_TIMERWHEEL_L1_TICKS) {
+		for (i = 0; i < TCP_TIMERWHEEL_SLOTS; i++) {
+			while ((te = LIST_FIRST(&listp->l0[i])) != NULL) {
+				tcp_timer_unlink(listp, te);
+				LIST_INSERT_HEAD(&listp->lhead, te, le);
+				te->level = TCP_TIMERWHEEL_RUN;
+			}
+			while ((te = LIST_FIRST(&listp->l1[i])) != NULL) {
+				tcp_timer_unlink(listp, te);
+				LIST_INSERT_HEAD(&listp->lhead, te, le);
+				te->level = TCP_TIMERWHEEL_RUN;
+			}
+		}
+		listp->wheeltime = (now & ~(TCP_TIMERWHEEL_L0_TICKS - 1)) +
+		    TCP_TIMERWHEEL_L0_TICKS;
+		return;
+	}
+
+	while (TSTMP_LEQ(listp->wheeltime, now)) {
+		/* Level 0 wrapped, bring the next level 1 slot down */
+		if ((listp->wheeltime & (TCP_TIMERWHEEL_L1_TICKS - 1)) == 0) {
+			LIST_INIT(&cascade);
+			i = TCP_TIMERWHEEL_L1_SLOT(listp->wheeltime);
+			while ((te = LIST_FIRST(&listp->l1[i])) != NULL) {
+				tcp_timer_unlink(listp, te);
+				LIST_INSERT_HEAD(&cascade, te, le);
+			}
+			while ((te = LIST_FIRST(&cascade)) != NULL) {
+				LIST_REMOVE(te, le);
+				tcp_timer_insert(listp, te, te->runtime);
+			}
+		}
+
+		i = TCP_TIMERWHEEL_L0_SLOT(listp->wheeltime);
+		while ((te = LIST_FIRST(&listp->l0[i])) != NULL) {
+			tcp_timer_unlink(listp, te);
+			LIST_INSERT_HEAD(&listp->lhead, te, le);
+			te->level = TCP_TIMERWHEEL_RUN;
+		}
+		listp->wheeltime += TCP_TIMERWHEEL_L0_TICKS;
+
+		/* Skip ahead to the next cascade if level 0 is empty */
+		if (listp->l0entries == 0) {
+			next = (listp->wheeltime + TCP_TIMERWHEEL_L1_TICKS - 1) &
+			    ~(TCP_TIMERWHEEL_L1_TICKS - 1);
+			if (TSTMP_GT(next, now)) {
+				listp->wheeltime =
+				    (now & ~(TCP_TIMERWHEEL_L0_TICKS - 1)) +
+				    TCP_TIMERWHEEL_L0_TICKS;
+				break;
+			}
+			listp->wheeltime = next;
+		}
+	}
+}
+
+/*
+ * Offset from now of the next wheel slot that has entries, along with
+ * the timer modes of those entries.  Called with the timer list lock
+ * held, after tcp_timer_collect().
+ */
+uint32_t
+tcp_timer_next(struct tcptimerlist *listp, u_int16_t *mode)
+{
+	struct tcptimerentry *te;
+	struct timerlisthead *head;
+	uint32_t t;
+	int i;
+
+	*mode = 0;
+	if (listp->l0entries > 0) {
+		for (i = 0; i < TCP_TIMERWHEEL_SLOTS; i++) {
+			t = listp->wheeltime + i * TCP_TIMERWHEEL_L0_TICKS;
+			head = &listp->l0[TCP_TIMERWHEEL_L0_SLOT(t)];
+			if (!LIST_EMPTY(head))
+				goto found;
+		}
+	}
+
+	t = (listp->wheeltime + TCP_TIMERWHEEL_L1_TICKS - 1) &
+	    ~(TCP_TIMERWHEEL_L1_TICKS - 1);
+	for (i = 0; i < TCP_TIMERWHEEL_SLOTS; i++) {
+		head = &listp->l1[TCP_TIMERWHEEL_L1_SLOT(t)];
+		if (!LIST_EMPTY(head))
+			goto found;
+		t += TCP_TIMERWHEEL_L1_TICKS;
+	}
+	return (0);
+
+found:
+	LIST_FOREACH(te, head, le)
+		*mode |= te->mode;
+	if (TSTMP_LEQ(t, tcp_now))
+		return (1);
+	return (timer_diff(t, 0, tcp_now, 0));
+}
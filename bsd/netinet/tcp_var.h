@@ -65,6 +65,7 @@
 #define _NETINET_TCP_VAR_H_
 #include <sys/appleapiopts.h>
 #include <sys/queue.h>
+#include <sys/tree.h>
 #include <netinet/in_pcb.h>
 #include <netinet/tcp_timer.h>
 
@@ -171,11 +172,13 @@ struct sackhole {
 	tcp_seq rxmit;		/* next seq. no in hole to be retransmitted */
 	u_int32_t rxmit_start;	/* timestamp of first retransmission */
 	TAILQ_ENTRY(sackhole) scblink;	/* scoreboard linkage */
+	RB_ENTRY(sackhole) scbnode;	/* scoreboard lookup by start */
 };
 
 struct sackhint {
 	struct sackhole	*nexthole;
 	int	sack_bytes_rexmit;
+	u_int32_t sack_bytes_holes;	/* total bytes in scoreboard holes */
 };
 
 struct tcptemp {
@@ -391,6 +394,8 @@ struct tcpcb {
 	int16_t	snd_numholes;		/* number of holes seen by sender */
 	TAILQ_HEAD(sackhole_head, sackhole) snd_holes;
 						/* SACK scoreboard (sorted) */
+	RB_HEAD(sackhole_tree, sackhole) snd_holetree;
+						/* same holes, keyed by start */
 	tcp_seq	snd_fack;		/* last seq number(+1) sack'd by rcv'r*/
 	int	rcv_numsacks;		/* # distinct sack blks present */
 	struct sackblk sackblks[MAX_SACK_BLKS]; /* seq nos. of sack blocks */
@@ -445,6 +450,7 @@ struct tcpcb {
 #define TF_FORCE		0x8000		/* force 1 byte out */
 #define	TF_DISABLE_STRETCHACK	0x10000		/* auto-disable stretch ack */
 #define	TF_NOBLACKHOLE_DETECTION 0x20000	/* Disable PMTU blackhole detection */
+#define	TF_GSO			0x40000		/* TSO is done in software (ip_gso) */
 
 #if TRAFFIC_MGT
 	/* Inter-arrival jitter related state */
@@ -187,6 +187,11 @@ SYSCTL_INT(_net_inet_udp, OID_AUTO, randomize_ports,
     CTLFLAG_RW | CTLFLAG_LOCKED, &udp_use_randomport, 0,
     "Randomize UDP port numbers");
 
+static int udp_batch_output = 1;
+SYSCTL_INT(_net_inet_udp, OID_AUTO, batch_output,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &udp_batch_output, 0,
+    "Hand datagram lists from sendmsg_x to IP as one chain");
+
 #if INET6
 struct udp_in6 {
 	struct sockaddr_in6	uin6_sin;
@@ -218,6 +223,10 @@ static void udp_append(struct inpcb *, struct ip *, struct mbuf *, int,
 static int udp_input_checksum(struct mbuf *, struct udphdr *, int, int);
 static int udp_output(struct inpcb *, struct mbuf *, struct sockaddr *,
     struct mbuf *, struct proc *);
+static boolean_t udp_output_list_ok(struct inpcb *, struct mbuf *);
+static int udp_output_list(struct inpcb *, struct mbuf *);
+static int udp_send_list(struct socket *, int, struct mbuf *,
+    struct sockaddr *, struct mbuf *, struct proc *);
 static void ip_2_ip6_hdr(struct ip6_hdr *ip6, struct ip *ip);
 static void udp_gc(struct inpcbinfo *);
 
@@ -237,6 +246,9 @@ struct pr_usrreqs udp_usrreqs = {
 	.pru_sockaddr =		in_getsockaddr,
 	.pru_sosend =		sosend,
 	.pru_soreceive =	soreceive,
+	.pru_send_list =	udp_send_list,
+	.pru_sosend_list =	sosend_list,
+	.pru_soreceive_list =	soreceive_list,
 };
 
 void
@@ -1693,6 +1705,218 @@ release:
 	return (error);
 }
 
+/*
+ * Whether a list of datagrams from sendmsg_x(2) can go to IP as a single
+ * packet chain: the socket must be connected to a unicast destination
+ * with a usable cached route, and every datagram must fit in the path
+ * MTU, since ip_output_list() can't fragment within a chain.  Anything
+ * else goes through udp_output() one datagram at a time.
+ */
+static boolean_t
+udp_output_list_ok(struct inpcb *inp, struct mbuf *m)
+{
+	struct rtentry *rt = inp->inp_route.ro_rt;
+	u_int32_t mtu;
+
+	if (!udp_batch_output)
+		return (FALSE);
+	if (inp->inp_faddr.s_addr == INADDR_ANY ||
+	    inp->inp_laddr.s_addr == INADDR_ANY ||
+	    inp->inp_faddr.s_addr == INADDR_BROADCAST ||
+	    IN_MULTICAST(ntohl(inp->inp_faddr.s_addr)))
+		return (FALSE);
+	if (inp->inp_options != NULL)
+		return (FALSE);
+#if IPSEC
+	if (inp->inp_sp != NULL)
+		return (FALSE);
+#endif /* IPSEC */
+	if (rt == NULL || ROUTE_UNUSABLE(&inp->inp_route) ||
+	    (rt->rt_flags & (RTF_MULTICAST|RTF_BROADCAST)) ||
+	    rt->rt_ifp == NULL)
+		return (FALSE);
+
+	mtu = rt->rt_rmx.rmx_mtu;
+	if (mtu == 0 || mtu > rt->rt_ifp->if_mtu)
+		mtu = rt->rt_ifp->if_mtu;
+	for (; m != NULL; m = m->m_nextpkt) {
+		if (m->m_pkthdr.len + sizeof (struct udpiphdr) > mtu)
+			return (FALSE);
+	}
+	return (TRUE);
+}
+
+/*
+ * Output a list of datagrams, linked by m_nextpkt, on a connected socket
+ * that passed udp_output_list_ok().  The headers are built the way
+ * udp_output() builds them, but the policy checks are done once for the
+ * whole list, and IP gets the list as one chain sharing one route.
+ */
+static int
+udp_output_list(struct inpcb *inp, struct mbuf *m0)
+{
+	struct socket *so = inp->inp_socket;
+	struct udpiphdr *ui;
+	struct mbuf *m, *n, *head = NULL, **tailp = &head;
+	struct route ro;
+	struct ip_out_args ipoa =
+	    { IFSCOPE_NONE, { 0 }, IPOAF_SELECT_SRCIF, 0 };
+	struct flowadv *adv = &ipoa.ipoa_flowadv;
+	u_int32_t pktcnt = 0, bytecnt = 0;
+	int error = 0, len;
+#if NECP
+	necp_kernel_policy_id policy_id;
+#endif /* NECP */
+
+	lck_mtx_assert(&inp->inpcb_mtx, LCK_MTX_ASSERT_OWNED);
+
+	if (INP_WAIT_FOR_IF_FEEDBACK(inp)) {
+		/* Flow-controlled; drop until it isn't, as udp_output() does */
+		error = ENOBUFS;
+		goto release;
+	}
+
+	if (inp->inp_flags & INP_BOUND_IF) {
+		VERIFY(inp->inp_boundifp != NULL);
+		ipoa.ipoa_boundif = inp->inp_boundifp->if_index;
+		ipoa.ipoa_flags |= IPOAF_BOUND_IF;
+	}
+	if (INP_NO_CELLULAR(inp))
+		ipoa.ipoa_flags |=  IPOAF_NO_CELLULAR;
+	if (INP_NO_EXPENSIVE(inp))
+		ipoa.ipoa_flags |=  IPOAF_NO_EXPENSIVE;
+	if (INP_AWDL_UNRESTRICTED(inp))
+		ipoa.ipoa_flags |=  IPOAF_AWDL_UNRESTRICTED;
+	ipoa.ipoa_flags |= IPOAF_BOUND_SRCADDR;
+
+#if NECP
+	if (!necp_socket_is_allowed_to_send_recv_v4(inp, inp->inp_lport,
+	    inp->inp_fport, &inp->inp_laddr, &inp->inp_faddr, NULL,
+	    &policy_id)) {
+		error = EHOSTUNREACH;
+		goto release;
+	}
+#endif /* NECP */
+
+	if (inp->inp_flowhash == 0)
+		inp->inp_flowhash = inp_calc_flowhash(inp);
+
+	for (m = m0; m != NULL; m = n) {
+		n = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		m0 = n;
+		len = m->m_pkthdr.len;
+
+#if CONFIG_MACF_NET
+		mac_mbuf_label_associate_inpcb(inp, m);
+#endif /* CONFIG_MACF_NET */
+
+		M_PREPEND(m, sizeof (struct udpiphdr), M_DONTWAIT);
+		if (m == NULL) {
+			error = ENOBUFS;
+			goto release;
+		}
+
+		ui = mtod(m, struct udpiphdr *);
+		bzero(ui->ui_x1, sizeof (ui->ui_x1));
+		ui->ui_pr = IPPROTO_UDP;
+		ui->ui_src = inp->inp_laddr;
+		ui->ui_dst = inp->inp_faddr;
+		ui->ui_sport = inp->inp_lport;
+		ui->ui_dport = inp->inp_fport;
+		ui->ui_ulen = htons((u_short)len + sizeof (struct udphdr));
+
+		if (udpcksum && !(inp->inp_flags & INP_UDP_NOCKSUM)) {
+			ui->ui_sum = in_pseudo(ui->ui_src.s_addr,
+			    ui->ui_dst.s_addr, htons((u_short)len +
+			    sizeof (struct udphdr) + IPPROTO_UDP));
+			m->m_pkthdr.csum_flags = CSUM_UDP;
+			m->m_pkthdr.csum_data = offsetof(struct udphdr, uh_sum);
+		} else {
+			ui->ui_sum = 0;
+		}
+		((struct ip *)ui)->ip_len = sizeof (struct udpiphdr) + len;
+		((struct ip *)ui)->ip_ttl = inp->inp_ip_ttl;	/* XXX */
+		((struct ip *)ui)->ip_tos = inp->inp_ip_tos;	/* XXX */
+		udpstat.udps_opackets++;
+
+#if NECP
+		necp_mark_packet_from_socket(m, inp, policy_id);
+#endif /* NECP */
+
+		set_packet_service_class(m, so, MBUF_SC_UNSPEC, 0);
+		m->m_pkthdr.pkt_flowsrc = FLOWSRC_INPCB;
+		m->m_pkthdr.pkt_flowid = inp->inp_flowhash;
+		m->m_pkthdr.pkt_proto = IPPROTO_UDP;
+		m->m_pkthdr.pkt_flags |= (PKTF_FLOW_ID | PKTF_FLOW_LOCALSRC |
+		    PKTF_FLOW_ADV);
+
+		*tailp = m;
+		tailp = &m->m_nextpkt;
+		pktcnt++;
+		bytecnt += len;
+	}
+
+	/* Copy the cached route and take an extra reference */
+	inp_route_copyout(inp, &ro);
+
+	inp->inp_sndinprog_cnt++;
+
+	socket_unlock(so, 0);
+	error = ip_output_list(head, 1, NULL, &ro, IP_OUTARGS |
+	    (so->so_options & (SO_DONTROUTE | SO_BROADCAST)), NULL, &ipoa);
+	head = NULL;
+	socket_lock(so, 0);
+
+	if (error == 0 && nstat_collect) {
+		boolean_t cell, wifi, wired;
+
+		if (ro.ro_rt != NULL) {
+			cell = IFNET_IS_CELLULAR(ro.ro_rt->rt_ifp);
+			wifi = (!cell && IFNET_IS_WIFI(ro.ro_rt->rt_ifp));
+			wired = (!wifi && IFNET_IS_WIRED(ro.ro_rt->rt_ifp));
+		} else {
+			cell = wifi = wired = FALSE;
+		}
+		INP_ADD_STAT(inp, cell, wifi, wired, txpackets, pktcnt);
+		INP_ADD_STAT(inp, cell, wifi, wired, txbytes, bytecnt);
+	}
+
+	if (adv->code == FADV_FLOW_CONTROLLED || adv->code == FADV_SUSPENDED) {
+		/* hint to the application that packets were dropped */
+		error = ENOBUFS;
+		inp_set_fc_state(inp, adv->code);
+	}
+
+	VERIFY(inp->inp_sndinprog_cnt > 0);
+	if ( --inp->inp_sndinprog_cnt == 0)
+		inp->inp_flags &= ~(INP_FC_FEEDBACK);
+
+	/* Synchronize PCB cached route */
+	inp_route_copyin(inp, &ro);
+
+	if (inp->inp_route.ro_rt != NULL) {
+		struct rtentry *rt = inp->inp_route.ro_rt;
+
+		if (rt->rt_flags & (RTF_MULTICAST|RTF_BROADCAST))
+			ROUTE_RELEASE(&inp->inp_route);
+		else if (rt->rt_ifp != inp->inp_last_outifp)
+			inp->inp_last_outifp = rt->rt_ifp; /* no ref needed */
+	}
+
+	if (error != 0 && (ipoa.ipoa_retflags & IPOARF_IFDENIED) &&
+	    (INP_NO_CELLULAR(inp) || INP_NO_EXPENSIVE(inp)))
+		soevent(so, (SO_FILT_HINT_LOCKED|SO_FILT_HINT_IFDENIED));
+
+release:
+	if (head != NULL)
+		m_freem_list(head);
+	if (m0 != NULL)
+		m_freem_list(m0);
+
+	return (error);
+}
+
 u_int32_t	udp_sendspace = 9216;		/* really max datagram size */
 /* 187 1K datagrams (approx 192 KB) */
 u_int32_t	udp_recvspace = 187 * (1024 +
@@ -1985,6 +2209,50 @@ udp_send(struct socket *so, int flags, struct mbuf *m,
 	return (udp_output(inp, m, addr, control, p));
 }
 
+/*
+ * Send a list of datagrams, linked by m_nextpkt, for sendmsg_x(2).
+ */
+static int
+udp_send_list(struct socket *so, int flags, struct mbuf *m,
+    struct sockaddr *addr, struct mbuf *control, struct proc *p)
+{
+#pragma unused(flags)
+	struct inpcb *inp;
+	struct mbuf *n;
+	int error = 0;
+
+	inp = sotoinpcb(so);
+	if (inp == NULL
+#if NECP
+		|| (necp_socket_should_use_flow_divert(inp))
+#endif /* NECP */
+		) {
+		if (m != NULL)
+			m_freem_list(m);
+		if (control != NULL)
+			m_freem(control);
+		return (inp == NULL ? EINVAL : EPROTOTYPE);
+	}
+
+	if (addr == NULL && control == NULL && udp_output_list_ok(inp, m))
+		return (udp_output_list(inp, m));
+
+	while (m != NULL) {
+		n = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		error = udp_output(inp, m, addr, NULL, p);
+		m = n;
+		if (error != 0)
+			break;
+	}
+	if (m != NULL)
+		m_freem_list(m);
+	if (control != NULL)
+		m_freem(control);
+
+	return (error);
+}
+
 int
 udp_shutdown(struct socket *so)
 {
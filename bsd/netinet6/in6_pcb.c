@@ -1195,14 +1195,16 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 	struct inpcbhead *head;
 	struct inpcb *inp;
 	u_short fport = fport_arg, lport = lport_arg;
-
-	lck_rw_lock_shared(pcbinfo->ipi_lock);
+	u_int32_t hash;
 
 	/*
-	 * First look for an exact match.
+	 * First look for an exact match, under just the lock of the hash
+	 * shard; see in_pcblookup_hash().
 	 */
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr->s6_addr32[3] /* XXX */,
-	    lport, fport, pcbinfo->ipi_hashmask)];
+	hash = INP_PCBHASH(faddr->s6_addr32[3] /* XXX */, lport, fport,
+	    pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[hash];
+	lck_rw_lock_shared(INP_PCBHASHLOCK(pcbinfo, hash));
 	LIST_FOREACH(inp, head, inp_hash) {
 		if (!(inp->inp_vflag & INP_IPV6))
 			continue;
@@ -1219,18 +1221,34 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 			 */
 			if (in_pcb_checkstate(inp, WNT_ACQUIRE, 0) !=
 			    WNT_STOPUSING) {
-				lck_rw_done(pcbinfo->ipi_lock);
+				lck_rw_done(INP_PCBHASHLOCK(pcbinfo, hash));
 				return (inp);
 			} else {
 				/* it's there but dead, say it isn't found */
-				lck_rw_done(pcbinfo->ipi_lock);
+				lck_rw_done(INP_PCBHASHLOCK(pcbinfo, hash));
 				return (NULL);
 			}
 		}
 	}
+	lck_rw_done(INP_PCBHASHLOCK(pcbinfo, hash));
+
 	if (wildcard) {
 		struct inpcb *local_wild = NULL;
 
+		lck_rw_lock_shared(pcbinfo->ipi_lock);
+
+		/*
+		 * Let a load-balancing group of SO_REUSEPORT sockets take
+		 * the flow, if there is one for the local address and port.
+		 */
+		inp = in_pcblookup_lbgroup(pcbinfo, PF_INET6, faddr, fport,
+		    laddr, lport, ifp, FALSE);
+		if (inp != NULL &&
+		    in_pcb_checkstate(inp, WNT_ACQUIRE, 0) != WNT_STOPUSING) {
+			lck_rw_done(pcbinfo->ipi_lock);
+			return (inp);
+		}
+
 		head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
 		    pcbinfo->ipi_hashmask)];
 		LIST_FOREACH(inp, head, inp_hash) {
@@ -1259,6 +1277,19 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 				}
 			}
 		}
+
+		/*
+		 * Nothing is bound to the local address itself, so a group
+		 * bound to the wildcard address may take the flow.
+		 */
+		inp = in_pcblookup_lbgroup(pcbinfo, PF_INET6, faddr, fport,
+		    laddr, lport, ifp, TRUE);
+		if (inp != NULL &&
+		    in_pcb_checkstate(inp, WNT_ACQUIRE, 0) != WNT_STOPUSING) {
+			lck_rw_done(pcbinfo->ipi_lock);
+			return (inp);
+		}
+
 		if (local_wild && in_pcb_checkstate(local_wild,
 		    WNT_ACQUIRE, 0) != WNT_STOPUSING) {
 			lck_rw_done(pcbinfo->ipi_lock);
@@ -1272,7 +1303,6 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 	/*
 	 * Not found.
 	 */
-	lck_rw_done(pcbinfo->ipi_lock);
 	return (NULL);
 }
 
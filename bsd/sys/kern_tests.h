@@ -1,5 +1,9 @@
 #ifndef _KERN_TESTS_H
 #define _KERN_TESTS_H
 
+#if PF
+extern int pf_purge_test(void);
+extern int pf_rule_index_test(void);
+#endif /* PF */
 
 #endif /* !defined(_KERN_TESTS_H) */
@@ -988,7 +988,15 @@ typedef struct mb_class_stat {
 	u_int32_t	mbcl_mc_wretry_cnt;  /* # of wait retries */
 	u_int32_t	mbcl_mc_nwretry_cnt; /* # of no-wait retry attempts */
 	u_int32_t	mbcl_peak_reported; /* last usage peak reported */
-	u_int32_t	mbcl_reserved[7];    /* for future use */
+	/*
+	 * Per-CPU slab layer statistics
+	 */
+	u_int32_t	mbcl_pc_cached;	/* # of buffers on per-CPU freelists */
+	u_int32_t	mbcl_slab_contended; /* # of contended slab lock acquires */
+	u_int32_t	mbcl_refill_cnt; /* # of refills from the slab layer */
+	u_int32_t	mbcl_refill_avg; /* average refill latency (usec) */
+	u_int32_t	mbcl_refill_max; /* longest refill latency (usec) */
+	u_int32_t	mbcl_reserved[2];    /* for future use */
 } mb_class_stat_t;
 
 #define	MCS_DISABLED	0	/* cache is permanently disabled */
@@ -1268,6 +1276,7 @@ __private_extern__ struct mbuf *m_pulldown(struct mbuf *, int, int, int *);
 __private_extern__ struct mbuf *m_getcl(int, int, int);
 __private_extern__ caddr_t m_mclalloc(int);
 __private_extern__ int m_mclhasreference(struct mbuf *);
+__private_extern__ void m_set_ext_readonly(struct mbuf *);
 __private_extern__ void m_copy_pkthdr(struct mbuf *, struct mbuf *);
 __private_extern__ void m_copy_pftag(struct mbuf *, struct mbuf *);
 __private_extern__ void m_copy_classifier(struct mbuf *, struct mbuf *);
@@ -105,19 +105,6 @@ struct pipebuf {
 };
 
 
-#ifdef PIPE_DIRECT
-/*
- * Information to support direct transfers between processes for pipes.
- */
-struct pipemapping {
-	vm_offset_t	kva;		/* kernel virtual address */
-	vm_size_t	cnt;		/* number of chars in buffer */
-	vm_size_t	pos;		/* current position of transfer */
-	int		npages;		/* number of pages */
-	vm_page_t	ms[PIPENPAGES];	/* pages in source process */
-};
-#endif
-
 /*
  * Bits in pipe_state.
  */
@@ -141,15 +128,26 @@ struct pipemapping {
 
 struct label;
 
+/*
+ * Information to support direct transfers between processes for pipes.
+ * While PIPE_DIRECTW is set, the writer's pages are mapped at kva and
+ * the reader copies straight out of them.
+ */
+struct pipemapping {
+	vm_offset_t	kva;		/* kernel virtual address */
+	vm_size_t	size;		/* size of the mapping */
+	vm_size_t	cnt;		/* number of chars in buffer */
+	vm_size_t	pos;		/* current position of transfer */
+};
+
 /*
  * Per-pipe data structure.
  * Two of these are linked together to produce bi-directional pipes.
  */
 struct pipe {
 	struct	pipebuf pipe_buffer;	/* data storage */
-#ifdef PIPE_DIRECT
 	struct	pipemapping pipe_map;	/* pipe mapping for direct I/O */
-#endif
+	u_int	pipe_lag;		/* decaying peak of buffered chars */
 	struct	selinfo pipe_sel;	/* for compat with select */
 	pid_t	pipe_pgid;		/* information for async I/O */
 	struct	pipe *pipe_peer;	/* link with other direction */
@@ -1227,7 +1227,7 @@ ssize_t recvmsg_x(int s, const struct msghdr_x *msgp, u_int cnt, int flags);
  * The "msg_iov" and "msg_iovlen" are input parameters that specify the
  * data to be sent in a scatter gather locations of buffers -- see sendmsg(2).
  *
- * sendmsg_x() fails with EMSGSIZE if the sum of the length of the datagrams
+ * sendmsg_x() fails with EMSGSIZE if the length of any of the datagrams
  * is greater than the high water mark.
  *
  * Address and ancillary data are not supported so the following fields
@@ -709,6 +709,13 @@ struct so_tcdbg;
 __BEGIN_DECLS
 /* Not exported */
 extern void socketinit(void);
+#if SENDFILE
+extern void sendfile_init(void);
+extern struct mbuf *sf_map_uio(struct uio *, size_t);
+extern int sf_map_uiomove(struct mbuf *, int, int, struct uio *, int,
+    int *);
+extern int sf_map_run(struct mbuf *, struct mbuf **);
+#endif /* SENDFILE */
 extern struct sockaddr *dup_sockaddr(struct sockaddr *sa, int canwait);
 extern int getsock(struct filedesc *fdp, int fd, struct file **fpp);
 extern int sockargs(struct mbuf **mp, user_addr_t data, int buflen, int type);
@@ -905,6 +912,7 @@ extern void evsofree(struct socket *);
 extern int tcp_notsent_lowat_check(struct socket *so);
 
 extern user_ssize_t uio_array_resid(struct uio **, u_int);
+extern user_ssize_t uio_array_maxresid(struct uio **, u_int);
 
 void sotoxsocket_n(struct socket *, struct xsocket_n *);
 void sbtoxsockbuf_n(struct sockbuf *, struct xsockbuf_n *);
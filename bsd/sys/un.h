@@ -90,6 +90,7 @@ struct	sockaddr_un {
 #define LOCAL_PEEREPID		0x003		/* retrieve eff. peer pid */
 #define LOCAL_PEERUUID		0x004		/* retrieve peer UUID */
 #define LOCAL_PEEREUUID		0x005		/* retrieve eff. peer UUID */
+#define LOCAL_SINGLECOPY	0x006		/* map large stream writes */
 
 #endif	/* (!_POSIX_C_SOURCE || _DARWIN_C_SOURCE) */
 
@@ -101,6 +102,7 @@ __BEGIN_DECLS
 struct mbuf;
 struct socket;
 struct sockopt;
+struct uio;
 
 int	uipc_usrreq(struct socket *so, int req, struct mbuf *m,
 		struct mbuf *nam, struct mbuf *control);
@@ -109,6 +111,7 @@ int	unp_connect2(struct socket *so, struct socket *so2);
 void	unp_dispose(struct mbuf *m);
 int	unp_externalize(struct mbuf *rights);
 void	unp_init(void);
+struct mbuf *unp_sosend_map(struct socket *, struct uio *, int);
 extern	struct pr_usrreqs uipc_usrreqs;
 int     unp_lock(struct socket *, int, void *);
 int     unp_unlock(struct socket *, int, void *);
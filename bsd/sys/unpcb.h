@@ -151,10 +151,15 @@ struct	unpcb {
  * in, but does *not* contain the credentials of the connected peer
  * (there may not even be a peer).  This is set in unp_listen() when
  * it fills in unp_peercred for later consumption by unp_connect().
+ *
+ * UNP_SINGLECOPY - set by LOCAL_SINGLECOPY; large writes on a stream
+ * socket hand the sender's pages to the receiver instead of copying
+ * them into mbuf clusters (see unp_sosend_map()).
  */
 #define UNP_HAVEPC			0x0001
 #define UNP_HAVEPCCACHED		0x0002
 #define UNP_DONTDISCONNECT		0x0004
+#define UNP_SINGLECOPY			0x0008
 #define	UNP_TRACE_MDNS			0x1000
 
 #ifdef KERNEL
@@ -54,10 +54,12 @@
 #include <kern/task.h>
 #include <kern/thread.h>
 #include <kern/kalloc.h>
+#include <kern/clock.h>
 #include <sys/disk.h>
 #include <sys/kdebug.h>
 #include <miscfs/specfs/specdev.h>
 #include <libkern/OSAtomic.h>	/* OSAddAtomic */
+#include <libkern/tree.h>
 
 kern_return_t	thread_terminate(thread_t);
 
@@ -81,6 +83,7 @@ SYSCTL_INT(_vfs_generic_jnl_kdebug, OID_AUTO, trim, CTLFLAG_RW|CTLFLAG_LOCKED, &
 #define DBG_JOURNAL_TRIM_REALLOC	FSDBG_CODE(DBG_JOURNAL, 5)
 #define DBG_JOURNAL_TRIM_FLUSH		FSDBG_CODE(DBG_JOURNAL, 6)
 #define DBG_JOURNAL_TRIM_UNMAP		FSDBG_CODE(DBG_JOURNAL, 7)
+#define DBG_JOURNAL_REPLAY		FSDBG_CODE(DBG_JOURNAL, 8)
 
 /* 
  * Cap the journal max size to 2GB.  On HFS, it will attempt to occupy
@@ -173,19 +176,50 @@ static __inline__ void  unlock_flush(journal *jnl);
 //
 
 typedef struct bucket {
+	RB_ENTRY(bucket) link;
+	struct bucket *free_next;
 	off_t     block_num;
 	uint32_t  jnl_offset;
 	uint32_t  block_size;
 	int32_t   cksum;
 } bucket;
 
-#define STARTING_BUCKETS 256
+RB_HEAD(bucket_tree, bucket);
 
-static int add_block(journal *jnl, struct bucket **buf_ptr, off_t block_num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr);
-static int grow_table(struct bucket **buf_ptr, int num_buckets, int new_size);
-static int lookup_bucket(struct bucket **buf_ptr, off_t block_num, int num_full);
-static int do_overlap(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t block_num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr);
-static int insert_block(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr, int overwriting);
+//
+// The coalesce table is kept as a red-black tree keyed by block_num so that
+// adding a block to a large journal is O(log n) instead of shifting a sorted
+// array.  Buckets are carved out of chunks to avoid an allocation per block.
+//
+#define BUCKETS_PER_CHUNK 256
+
+typedef struct bucket_chunk {
+	struct bucket_chunk *next;
+	struct bucket        buckets[BUCKETS_PER_CHUNK];
+} bucket_chunk;
+
+typedef struct coalesce_table {
+	struct bucket_tree  tree;
+	struct bucket      *free_list;
+	struct bucket_chunk *chunks;
+	int                 chunk_used;
+	int                 num_full;
+} coalesce_table;
+
+static int bucket_cmp(struct bucket *a, struct bucket *b);
+RB_PROTOTYPE_SC(static, bucket_tree, bucket, link, bucket_cmp);
+
+static int add_block(journal *jnl, coalesce_table *ct, off_t block_num, size_t size, size_t offset, int32_t cksum);
+static void init_coalesce_table(coalesce_table *ct);
+static void free_coalesce_table(coalesce_table *ct);
+
+//
+// Replay writes contiguous runs of coalesced blocks with a single i/o of
+// at most JNL_REPLAY_MAX_IOSIZE bytes and keeps up to JNL_REPLAY_MAX_INFLIGHT
+// of those outstanding at once.
+//
+#define JNL_REPLAY_MAX_IOSIZE   (1024*1024)
+#define JNL_REPLAY_MAX_INFLIGHT 8
 
 #define CHECK_JOURNAL(jnl) \
 	do {		   \
@@ -781,170 +815,77 @@ swap_block_list_header(journal *jnl, block_list_header *blhdr)
 
 
 static int
-update_fs_block(journal *jnl, void *block_ptr, off_t fs_block, size_t bsize)
+bucket_cmp(struct bucket *a, struct bucket *b)
 {
-	int		ret;
-	struct buf *oblock_bp=NULL;
-    
-	// first read the block we want.
-	ret = buf_meta_bread(jnl->fsdev, (daddr64_t)fs_block, bsize, NOCRED, &oblock_bp);
-	if (ret != 0) {
-		printf("jnl: %s: update_fs_block: error reading fs block # %lld! (ret %d)\n", jnl->jdev_name, fs_block, ret);
-
-		if (oblock_bp) {
-			buf_brelse(oblock_bp);
-			oblock_bp = NULL;
-		}
-
-		// let's try to be aggressive here and just re-write the block
-		oblock_bp = buf_getblk(jnl->fsdev, (daddr64_t)fs_block, bsize, 0, 0, BLK_META);
-		if (oblock_bp == NULL) {
-			printf("jnl: %s: update_fs_block: buf_getblk() for %lld failed! failing update.\n", jnl->jdev_name, fs_block);
-			return -1;
-		}
-	}
-	    
-	// make sure it's the correct size.
-	if (buf_size(oblock_bp) != bsize) {
-		buf_brelse(oblock_bp);
+	if (a->block_num < b->block_num)
 		return -1;
-	}
-
-	// copy the journal data over top of it
-	memcpy((char *)buf_dataptr(oblock_bp), block_ptr, bsize);
+	if (a->block_num > b->block_num)
+		return 1;
+	return 0;
+}
 
-	if ((ret = VNOP_BWRITE(oblock_bp)) != 0) {
-		printf("jnl: %s: update_fs_block: failed to update block %lld (ret %d)\n", jnl->jdev_name, fs_block,ret);
-		return ret;
-	}
+RB_GENERATE(bucket_tree, bucket, link, bucket_cmp);
 
-	// and now invalidate it so that if someone else wants to read
-	// it in a different size they'll be able to do it.
-	ret = buf_meta_bread(jnl->fsdev, (daddr64_t)fs_block, bsize, NOCRED, &oblock_bp);
-	if (oblock_bp) {
-                buf_markinvalid(oblock_bp);
-		buf_brelse(oblock_bp);
-	}
-	    
-	return 0;
+static void
+init_coalesce_table(coalesce_table *ct)
+{
+	RB_INIT(&ct->tree);
+	ct->free_list  = NULL;
+	ct->chunks     = NULL;
+	ct->chunk_used = BUCKETS_PER_CHUNK;
+	ct->num_full   = 0;
 }
 
-static int
-grow_table(struct bucket **buf_ptr, int num_buckets, int new_size)
+static void
+free_coalesce_table(coalesce_table *ct)
 {
-	struct bucket *newBuf;
-	int current_size = num_buckets, i;
-    
-	// return if newsize is less than the current size
-	if (new_size < num_buckets) {
-		return current_size;
-	}
-    
-	if ((MALLOC(newBuf, struct bucket *, new_size*sizeof(struct bucket), M_TEMP, M_WAITOK)) == NULL) {
-		printf("jnl: grow_table: no memory to expand coalesce buffer!\n");
-		return -1;
-	}
-    
-	//  printf("jnl: lookup_bucket: expanded co_buf to %d elems\n", new_size);
-    
-	// copy existing elements 
-	bcopy(*buf_ptr, newBuf, num_buckets*sizeof(struct bucket));
-    
-	// initialize the new ones
-	for(i = num_buckets; i < new_size; i++) {
-		newBuf[i].block_num = (off_t)-1;
+	bucket_chunk *chunk;
+
+	while ((chunk = ct->chunks) != NULL) {
+		ct->chunks = chunk->next;
+		FREE(chunk, M_TEMP);
 	}
-    
-	// free the old container
-	FREE(*buf_ptr, M_TEMP);
-    
-	// reset the buf_ptr
-	*buf_ptr = newBuf;
-    
-	return new_size;
+	init_coalesce_table(ct);
 }
 
-static int
-lookup_bucket(struct bucket **buf_ptr, off_t block_num, int num_full)
+static struct bucket *
+alloc_bucket(coalesce_table *ct)
 {
-	int lo, hi, index, matches, i;
-    
-	if (num_full == 0) {
-		return 0; // table is empty, so insert at index=0
+	struct bucket *b;
+
+	if ((b = ct->free_list) != NULL) {
+		ct->free_list = b->free_next;
+		return b;
 	}
-    
-	lo = 0;
-	hi = num_full - 1;
-	index = -1;
-    
-	// perform binary search for block_num
-	do {
-		int mid = (hi - lo)/2 + lo;
-		off_t this_num = (*buf_ptr)[mid].block_num;
-	
-		if (block_num == this_num) {
-			index = mid;
-			break;
-		}
-	
-		if (block_num < this_num) {
-			hi = mid;
-			continue;
-		}
-	
-		if (block_num > this_num) {
-			lo = mid + 1;
-			continue;
+
+	if (ct->chunk_used >= BUCKETS_PER_CHUNK) {
+		bucket_chunk *chunk;
+
+		if ((MALLOC(chunk, bucket_chunk *, sizeof(bucket_chunk), M_TEMP, M_WAITOK)) == NULL) {
+			printf("jnl: alloc_bucket: no memory to expand coalesce table!\n");
+			return NULL;
 		}
-	} while (lo < hi);
-    
-	// check if lo and hi converged on the match
-	if (block_num == (*buf_ptr)[hi].block_num) {
-		index = hi;
+		chunk->next = ct->chunks;
+		ct->chunks = chunk;
+		ct->chunk_used = 0;
 	}
-    
-	// if no existing entry found, find index for new one
-	if (index == -1) {
-		index = (block_num < (*buf_ptr)[hi].block_num) ? hi : hi + 1;
-	} else {
-		// make sure that we return the right-most index in the case of multiple matches
-		matches = 0;
-		i = index + 1;
-		while (i < num_full && block_num == (*buf_ptr)[i].block_num) {
-			matches++;
-			i++;
-		}
 
-		index += matches;
-	}
-    
-	return index;
+	return &ct->chunks->buckets[ct->chunk_used++];
+}
+
+static void
+remove_bucket(coalesce_table *ct, struct bucket *b)
+{
+	RB_REMOVE(bucket_tree, &ct->tree, b);
+	b->free_next = ct->free_list;
+	ct->free_list = b;
+	ct->num_full--;
 }
 
 static int
-insert_block(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr, int overwriting)
+insert_block(journal *jnl, coalesce_table *ct, off_t num, size_t size, size_t offset, int32_t cksum)
 {
-	if (!overwriting) {
-		// grow the table if we're out of space
-		if (*num_full_ptr >= *num_buckets_ptr) {
-			int new_size = *num_buckets_ptr * 2;
-			int grow_size = grow_table(buf_ptr, *num_buckets_ptr, new_size);
-	    
-			if (grow_size < new_size) {
-				printf("jnl: %s: add_block: grow_table returned an error!\n", jnl->jdev_name);
-				return -1;
-			}
-	    
-			*num_buckets_ptr = grow_size; //update num_buckets to reflect the new size
-		}
-	
-		// if we're not inserting at the end, we need to bcopy
-		if (blk_index != *num_full_ptr) {
-			bcopy( (*buf_ptr)+(blk_index), (*buf_ptr)+(blk_index+1), (*num_full_ptr-blk_index)*sizeof(struct bucket) );
-		}
-	
-		(*num_full_ptr)++; // increment only if we're not overwriting
-	}
+	struct bucket *b;
 
 	// sanity check the values we're about to add
 	if ((off_t)offset >= jnl->jhdr->size) {
@@ -954,29 +895,58 @@ insert_block(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t num, si
 		panic("jnl: insert_block: bad size in insert_block (%zd)\n", size);
 	}	 
 
-	(*buf_ptr)[blk_index].block_num = num;
-	(*buf_ptr)[blk_index].block_size = size;
-	(*buf_ptr)[blk_index].jnl_offset = offset;
-	(*buf_ptr)[blk_index].cksum = cksum;
-    
-	return blk_index;
+	if ((b = alloc_bucket(ct)) == NULL) {
+		return -1;
+	}
+	b->block_num = num;
+	b->block_size = size;
+	b->jnl_offset = offset;
+	b->cksum = cksum;
+
+	if (RB_INSERT(bucket_tree, &ct->tree, b) != NULL) {
+		panic("jnl: insert_block: duplicate entry for block %lld\n", num);
+	}
+	ct->num_full++;
+
+	return 0;
 }
 
+// PR-3105942: Coalesce writes to the same block in journal replay
+// We coalesce writes by maintaining a tree of non-overlapping physical disk
+// extents to be replayed and the corresponding location in the journal which
+// contains the most recent data for those blocks. The tree is "played" once
+// all the blocks in the journal have been coalesced. A newer write wins over
+// any part of an older extent that it overlaps: the older extent is truncated,
+// split in two, trimmed at the front or dropped entirely so that the tree
+// stays consistent.
 static int
-do_overlap(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t block_num, size_t size, __unused size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr)
+add_block(journal *jnl, coalesce_table *ct, off_t block_num, size_t size, size_t offset, int32_t cksum)
 {
-	int	num_to_remove, index, i, overwrite, err;
 	size_t	jhdr_size = jnl->jhdr->jhdr_size, new_offset;
 	off_t	overlap, block_start, block_end;
+	struct bucket *prev, *cur, *next;
 
 	block_start = block_num*jhdr_size;
 	block_end = block_start + size;
-	overwrite = (block_num == (*buf_ptr)[blk_index].block_num && size >= (*buf_ptr)[blk_index].block_size);
+
+	// find the last entry that starts before this block
+	prev = NULL;
+	cur = RB_ROOT(&ct->tree);
+	while (cur != NULL) {
+		if (cur->block_num < block_num) {
+			prev = cur;
+			cur = RB_RIGHT(cur, link);
+		} else {
+			cur = RB_LEFT(cur, link);
+		}
+	}
+	next = prev ? RB_NEXT(bucket_tree, &ct->tree, prev) : RB_MIN(bucket_tree, &ct->tree);
 
 	// first, eliminate any overlap with the previous entry
-	if (blk_index != 0 && !overwrite) {
-		off_t prev_block_start = (*buf_ptr)[blk_index-1].block_num*jhdr_size;
-		off_t prev_block_end = prev_block_start + (*buf_ptr)[blk_index-1].block_size;
+	if (prev != NULL) {
+		off_t prev_block_start = prev->block_num*jhdr_size;
+		off_t prev_block_end = prev_block_start + prev->block_size;
+
 		overlap = prev_block_end - block_start;
 		if (overlap > 0) {
 			if (overlap % jhdr_size != 0) {
@@ -985,127 +955,197 @@ do_overlap(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t block_num
 
 			// if the previous entry completely overlaps this one, we need to break it into two pieces.
 			if (prev_block_end > block_end) {
-				off_t new_num = block_end / jhdr_size;
-				size_t new_size = prev_block_end - block_end;
+				new_offset = prev->jnl_offset + (block_end - prev_block_start);
 
-				new_offset = (*buf_ptr)[blk_index-1].jnl_offset + (block_end - prev_block_start);
-		
-				err = insert_block(jnl, buf_ptr, blk_index, new_num, new_size, new_offset, cksum, num_buckets_ptr, num_full_ptr, 0);
-				if (err < 0) {
-					panic("jnl: do_overlap: error inserting during pre-overlap\n");
+				if (insert_block(jnl, ct, block_end / jhdr_size, prev_block_end - block_end, new_offset, 0) < 0) {
+					return -1;
 				}
 			}
-	    
+
 			// Regardless, we need to truncate the previous entry to the beginning of the overlap
-			(*buf_ptr)[blk_index-1].block_size = block_start - prev_block_start;
-			(*buf_ptr)[blk_index-1].cksum = 0;   // have to blow it away because there's no way to check it
+			prev->block_size = block_start - prev_block_start;
+			prev->cksum = 0;   // have to blow it away because there's no way to check it
 		}
 	}
 
-	// then, bail out fast if there's no overlap with the entries that follow
-	if (!overwrite && block_end <= (off_t)((*buf_ptr)[blk_index].block_num*jhdr_size)) {
-		return 0; // no overlap, no overwrite
-	} else if (overwrite && (blk_index + 1 >= *num_full_ptr || block_end <= (off_t)((*buf_ptr)[blk_index+1].block_num*jhdr_size))) {
+	// then drop or trim every following entry that this one overlaps.  an
+	// entry that is only partially covered keeps its place in the tree since
+	// moving its start forward can't reorder it relative to its neighbours.
+	while ((cur = next) != NULL && (off_t)(cur->block_num*jhdr_size) < block_end) {
+		next = RB_NEXT(bucket_tree, &ct->tree, cur);
 
-		(*buf_ptr)[blk_index].cksum = cksum;   // update this
-		return 1; // simple overwrite
+		if (block_end >= (off_t)(cur->block_num*jhdr_size + cur->block_size)) {
+			remove_bucket(ct, cur);
+			continue;
+		}
+
+		overlap = block_end - cur->block_num*jhdr_size;
+		if (overlap % jhdr_size != 0) {
+			panic("jnl: do_overlap: overlap of %lld is not multiple of %zd\n", overlap, jhdr_size);
+		}
+
+		// if we partially overlap this entry, adjust its block number, jnl offset, and size
+		cur->block_num += (overlap / jhdr_size);
+		cur->cksum = 0;
+
+		new_offset = cur->jnl_offset + overlap; // check for wrap-around
+		if ((off_t)new_offset >= jnl->jhdr->size) {
+			new_offset = jhdr_size + (new_offset - jnl->jhdr->size);
+		}
+		cur->jnl_offset = new_offset;
+		cur->block_size -= overlap;
+		break;
 	}
-    
-	// Otherwise, find all cases of total and partial overlap. We use the special
-	// block_num of -2 to designate entries that are completely overlapped and must
-	// be eliminated. The block_num, size, and jnl_offset of partially overlapped
-	// entries must be adjusted to keep the array consistent.
-	index = blk_index;
-	num_to_remove = 0;
-	while (index < *num_full_ptr && block_end > (off_t)((*buf_ptr)[index].block_num*jhdr_size)) {
-		if (block_end >= (off_t)(((*buf_ptr)[index].block_num*jhdr_size + (*buf_ptr)[index].block_size))) {
-			(*buf_ptr)[index].block_num = -2; // mark this for deletion
-			num_to_remove++;
-		} else {
-			overlap = block_end - (*buf_ptr)[index].block_num*jhdr_size;
-			if (overlap > 0) {
-				if (overlap % jhdr_size != 0) {
-					panic("jnl: do_overlap: overlap of %lld is not multiple of %zd\n", overlap, jhdr_size);
-				}
-				
-				// if we partially overlap this entry, adjust its block number, jnl offset, and size
-				(*buf_ptr)[index].block_num += (overlap / jhdr_size); // make sure overlap is multiple of jhdr_size, or round up
-				(*buf_ptr)[index].cksum = 0;
-		
-				new_offset = (*buf_ptr)[index].jnl_offset + overlap; // check for wrap-around
-				if ((off_t)new_offset >= jnl->jhdr->size) {
-					new_offset = jhdr_size + (new_offset - jnl->jhdr->size);
-				}
-				(*buf_ptr)[index].jnl_offset = new_offset;
-		
-				(*buf_ptr)[index].block_size -= overlap; // sanity check for negative value
-				if ((*buf_ptr)[index].block_size <= 0) {
-					panic("jnl: do_overlap: after overlap, new block size is invalid (%u)\n", (*buf_ptr)[index].block_size);
-					// return -1; // if above panic is removed, return -1 for error
-				}
-			}
-			
+
+	return insert_block(jnl, ct, block_num, size, offset, cksum);
+}
+
+//
+// State shared between replay_journal() and the completion routine of the
+// async writes it issues while playing the coalesce table.
+//
+struct replay_io_slot {
+	char		*data;
+	int		 busy;
+};
+
+struct replay_io {
+	lck_mtx_t	*lock;
+	int		 inflight;
+	int		 error;
+	struct replay_io_slot slots[JNL_REPLAY_MAX_INFLIGHT];
+};
+
+static void
+replay_write_done(buf_t bp, void *arg)
+{
+	struct replay_io_slot *slot = NULL;
+	struct replay_io *rio = (struct replay_io *)arg;
+	int error = buf_error(bp);
+	int i;
+
+	lck_mtx_lock(rio->lock);
+	for (i = 0; i < JNL_REPLAY_MAX_INFLIGHT; i++) {
+		if ((uintptr_t)rio->slots[i].data == buf_dataptr(bp)) {
+			slot = &rio->slots[i];
+			break;
+		}
+	}
+	if (slot == NULL) {
+		panic("jnl: replay_write_done: unknown buffer %p\n", bp);
+	}
+	if (error && rio->error == 0) {
+		rio->error = error;
+	}
+	slot->busy = 0;
+	rio->inflight--;
+	wakeup(rio);
+	lck_mtx_unlock(rio->lock);
+
+	free_io_buf(bp);
+}
+
+//
+// Write one contiguous run of fs blocks straight to the device.  The
+// buffer cache is bypassed the same way do_journal_io() does it, so any
+// stale cached copy of the blocks is invalidated first.
+//
+static int
+replay_write_run(journal *jnl, struct replay_io *rio, struct replay_io_slot *slot, off_t fs_block, size_t len)
+{
+	buf_t	bp;
+	daddr64_t blkno;
+	int	err;
+
+	for (blkno = fs_block; blkno < fs_block + (daddr64_t)(len / jnl->jhdr->jhdr_size); blkno++) {
+		buf_invalblkno(jnl->fsdev, blkno, BUF_WAIT);
+	}
+
+	bp = alloc_io_buf(jnl->fsdev, 1);
+	bp->b_attr.ba_flags |= BA_META;
+
+	vnode_startwrite(jnl->fsdev);
+
+	buf_setsize(bp, len);
+	buf_setcount(bp, len);
+	buf_setdataptr(bp, (uintptr_t)slot->data);
+	buf_setblkno(bp, (daddr64_t)fs_block);
+	buf_setlblkno(bp, (daddr64_t)fs_block);
+	buf_setcallback(bp, replay_write_done, rio);
+
+	lck_mtx_lock(rio->lock);
+	slot->busy = 1;
+	rio->inflight++;
+	lck_mtx_unlock(rio->lock);
+
+	err = VNOP_STRATEGY(bp);
+	if (err) {
+		//
+		// as in do_journal_io(), a strategy error means the buf
+		// was never started, so the completion routine won't run.
+		// undo the accounting here or replay_wait_all() would
+		// wait for it forever.
+		//
+		lck_mtx_lock(rio->lock);
+		slot->busy = 0;
+		rio->inflight--;
+		if (rio->error == 0) {
+			rio->error = err;
 		}
+		wakeup(rio);
+		lck_mtx_unlock(rio->lock);
 
-		index++;
+		vnode_writedone(jnl->fsdev);
+		free_io_buf(bp);
 	}
+	return err;
+}
 
-	// bcopy over any completely overlapped entries, starting at the right (where the above loop broke out)
-	index--; // start with the last index used within the above loop
-	while (index >= blk_index) {
-		if ((*buf_ptr)[index].block_num == -2) {
-			if (index == *num_full_ptr-1) {
-				(*buf_ptr)[index].block_num = -1; // it's the last item in the table... just mark as free
-			} else {
-				bcopy( (*buf_ptr)+(index+1), (*buf_ptr)+(index), (*num_full_ptr - (index + 1)) * sizeof(struct bucket) );
+static struct replay_io_slot *
+replay_get_slot(struct replay_io *rio)
+{
+	int i;
+
+	lck_mtx_lock(rio->lock);
+	for (;;) {
+		for (i = 0; i < JNL_REPLAY_MAX_INFLIGHT; i++) {
+			if (!rio->slots[i].busy) {
+				lck_mtx_unlock(rio->lock);
+				return &rio->slots[i];
 			}
-			(*num_full_ptr)--;
 		}
-		index--;
+		msleep(rio, rio->lock, PRIBIO, "jnl_replay", NULL);
 	}
+}
 
-	// eliminate any stale entries at the end of the table
-	for(i = *num_full_ptr; i < (*num_full_ptr + num_to_remove); i++) {
-		(*buf_ptr)[i].block_num = -1;
+static void
+replay_free_slots(struct replay_io *rio, size_t size)
+{
+	int i;
+
+	for (i = 0; i < JNL_REPLAY_MAX_INFLIGHT; i++) {
+		if (rio->slots[i].data) {
+			kmem_free(kernel_map, (vm_offset_t)rio->slots[i].data, size);
+			rio->slots[i].data = NULL;
+		}
 	}
-    
-	return 0; // if we got this far, we need to insert the entry into the table (rather than overwrite) 
+	lck_mtx_free(rio->lock, jnl_mutex_group);
+	rio->lock = NULL;
 }
 
-// PR-3105942: Coalesce writes to the same block in journal replay
-// We coalesce writes by maintaining a dynamic sorted array of physical disk blocks
-// to be replayed and the corresponding location in the journal which contains
-// the most recent data for those blocks. The array is "played" once the all the
-// blocks in the journal have been coalesced. The code for the case of conflicting/
-// overlapping writes to a single block is the most dense. Because coalescing can
-// disrupt the existing time-ordering of blocks in the journal playback, care
-// is taken to catch any overlaps and keep the array consistent. 
 static int
-add_block(journal *jnl, struct bucket **buf_ptr, off_t block_num, size_t size, __unused size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr)
+replay_wait_all(struct replay_io *rio)
 {
-	int	blk_index, overwriting;
-    
-	// on return from lookup_bucket(), blk_index is the index into the table where block_num should be
-	// inserted (or the index of the elem to overwrite). 
-	blk_index = lookup_bucket( buf_ptr, block_num, *num_full_ptr);
-    
-	// check if the index is within bounds (if we're adding this block to the end of
-	// the table, blk_index will be equal to num_full)
-	if (blk_index < 0 || blk_index > *num_full_ptr) {
-		//printf("jnl: add_block: trouble adding block to co_buf\n");
-		return -1;
-	} // else printf("jnl: add_block: adding block 0x%llx at i=%d\n", block_num, blk_index);
-    
-	// Determine whether we're overwriting an existing entry by checking for overlap
-	overwriting = do_overlap(jnl, buf_ptr, blk_index, block_num, size, offset, cksum, num_buckets_ptr, num_full_ptr);
-	if (overwriting < 0) {
-		return -1; // if we got an error, pass it along
-	}
-        
-	// returns the index, or -1 on error
-	blk_index = insert_block(jnl, buf_ptr, blk_index, block_num, size, offset, cksum, num_buckets_ptr, num_full_ptr, overwriting);
-    
-	return blk_index;
+	int error;
+
+	lck_mtx_lock(rio->lock);
+	while (rio->inflight > 0) {
+		msleep(rio, rio->lock, PRIBIO, "jnl_replay", NULL);
+	}
+	error = rio->error;
+	lck_mtx_unlock(rio->lock);
+
+	return error;
 }
 
 static int
@@ -1118,10 +1158,17 @@ replay_journal(journal *jnl)
 	block_list_header *blhdr;
 	off_t		offset, txn_start_offset=0, blhdr_offset, orig_jnl_start;
 	char		*buff, *block_ptr=NULL;
-	struct bucket	*co_buf;
-	int		num_buckets = STARTING_BUCKETS, num_full, check_past_jnl_end = 1, in_uncharted_territory=0;
+	coalesce_table	co_table;
+	struct bucket	*b, *run_end;
+	struct replay_io rio;
+	struct replay_io_slot *slot;
+	int		check_past_jnl_end = 1, in_uncharted_territory=0;
 	uint32_t	last_sequence_num = 0;
 	int 		replay_retry_count = 0;
+	int		num_blocks = 0, num_ios = 0, io_error;
+	uint64_t	replay_start, elapsed_us;
+	clock_sec_t	secs;
+	clock_usec_t	usecs;
     
 	// wrap the start ptr if it points to the very end of the journal
 	if (jnl->jhdr->start == jnl->jhdr->size) {
@@ -1136,27 +1183,24 @@ replay_journal(journal *jnl)
 	}
 
 	orig_jnl_start = jnl->jhdr->start;
+	replay_start = mach_absolute_time();
+	bzero(&rio, sizeof(rio));
+	init_coalesce_table(&co_table);
+
+	KERNEL_DEBUG_CONSTANT(DBG_JOURNAL_REPLAY | DBG_FUNC_START, VM_KERNEL_ADDRPERM(jnl), jnl->jhdr->start, jnl->jhdr->end, 0, 0);
 
 	// allocate memory for the header_block.  we'll read each blhdr into this
 	if (kmem_alloc_kobject(kernel_map, (vm_offset_t *)&buff, jnl->jhdr->blhdr_size)) {
 		printf("jnl: %s: replay_journal: no memory for block buffer! (%d bytes)\n",
 		       jnl->jdev_name, jnl->jhdr->blhdr_size);
-		return -1;
-	}
-
-	// allocate memory for the coalesce buffer
-	if ((MALLOC(co_buf, struct bucket *, num_buckets*sizeof(struct bucket), M_TEMP, M_WAITOK)) == NULL) {
-		printf("jnl: %s: replay_journal: no memory for coalesce buffer!\n", jnl->jdev_name);
+		KERNEL_DEBUG_CONSTANT(DBG_JOURNAL_REPLAY | DBG_FUNC_END, ENOMEM, 0, 0, 0, 0);
 		return -1;
 	}
 
 restart_replay:
 
-	// initialize entries
-	for(i = 0; i < num_buckets; i++) {
-		co_buf[i].block_num = -1;
-	}
-	num_full = 0; // empty at first
+	// start over with an empty coalesce table
+	free_coalesce_table(&co_table);
 
 
 	printf("jnl: %s: replay_journal: from: %lld to: %lld (joffset 0x%llx)\n",
@@ -1284,7 +1328,7 @@ restart_replay:
 			txn_start_offset = blhdr_offset;
 		}
 
-		//printf("jnl: replay_journal: adding %d blocks in journal entry @ 0x%llx to co_buf\n", 
+		//printf("jnl: replay_journal: adding %d blocks in journal entry @ 0x%llx to the coalesce table\n", 
 		//       blhdr->num_blocks-1, jnl->jhdr->start);
 		bad_blocks = 0;
 		for (i = 1; i < blhdr->num_blocks; i++) {
@@ -1330,12 +1374,12 @@ restart_replay:
 				}
 
 
-				// add this bucket to co_buf, coalescing where possible
+				// add this bucket to the coalesce table, coalescing where possible
 				// printf("jnl: replay_journal: adding block 0x%llx\n", number);
-				ret_val = add_block(jnl, &co_buf, number, size, (size_t) offset, blhdr->binfo[i].u.bi.b.cksum, &num_buckets, &num_full);
+				ret_val = add_block(jnl, &co_table, number, size, (size_t) offset, blhdr->binfo[i].u.bi.b.cksum);
 			    
 				if (ret_val == -1) {
-					printf("jnl: %s: replay_journal: trouble adding block to co_buf\n", jnl->jdev_name);
+					printf("jnl: %s: replay_journal: trouble adding block to coalesce table\n", jnl->jdev_name);
 					goto bad_replay;
 				} // else printf("jnl: replay_journal: added block 0x%llx at i=%d\n", number);
 			}
@@ -1402,19 +1446,18 @@ bad_txn_handling:
 		jnl->jhdr->end = jnl->jhdr->start;
 	}
 
-	//printf("jnl: replay_journal: replaying %d blocks\n", num_full);
-    
+	//printf("jnl: replay_journal: replaying %d blocks\n", co_table.num_full);
+
 	/*
-	 * make sure it's at least one page in size, so
-	 * start max_bsize at PAGE_SIZE
+	 * Replay the coalesced entries in block order.  Physically contiguous
+	 * entries are gathered into a single write of up to max_bsize bytes
+	 * (at least one page, and large enough for the biggest single entry),
+	 * with several writes in flight at once.
 	 */
-	for (i = 0, max_bsize = PAGE_SIZE; i < num_full; i++) {
-
-		if (co_buf[i].block_num == (off_t)-1)
-			continue;
-
-		if (co_buf[i].block_size > max_bsize)
-			max_bsize = co_buf[i].block_size;
+	max_bsize = JNL_REPLAY_MAX_IOSIZE;
+	RB_FOREACH(b, bucket_tree, &co_table.tree) {
+		if (b->block_size > max_bsize)
+			max_bsize = b->block_size;
 	}
 	/*
 	 * round max_bsize up to the nearest PAGE_SIZE multiple
@@ -1423,55 +1466,70 @@ bad_txn_handling:
 		max_bsize = (max_bsize + PAGE_SIZE) & ~(PAGE_SIZE - 1);
 	}
 
-	if (kmem_alloc(kernel_map, (vm_offset_t *)&block_ptr, max_bsize)) {
-		goto bad_replay;
+	rio.lock = lck_mtx_alloc_init(jnl_mutex_group, jnl_lock_attr);
+	for (i = 0; i < JNL_REPLAY_MAX_INFLIGHT; i++) {
+		if (kmem_alloc(kernel_map, (vm_offset_t *)&rio.slots[i].data, max_bsize)) {
+			goto bad_replay;
+		}
 	}
-    
-	// Replay the coalesced entries in the co-buf
-	for(i = 0; i < num_full; i++) {
-		size_t size = co_buf[i].block_size;
-		off_t jnl_offset = (off_t) co_buf[i].jnl_offset;
-		off_t number = co_buf[i].block_num;
-	
-	
-		// printf("replaying co_buf[%d]: block 0x%llx, size 0x%x, jnl_offset 0x%llx\n", i, co_buf[i].block_num,
-		//      co_buf[i].block_size, co_buf[i].jnl_offset);
-	
-		if (number == (off_t)-1) {
-			// printf("jnl: replay_journal: skipping killed fs block\n");
-		} else {
-	    
-			// do journal read, and set the phys. block 
-			ret = read_journal_data(jnl, &jnl_offset, block_ptr, size);
+
+	b = RB_MIN(bucket_tree, &co_table.tree);
+	while (b != NULL) {
+		off_t	fs_block = b->block_num;
+		size_t	run_len = 0;
+
+		slot = replay_get_slot(&rio);
+
+		// gather every entry that continues this run into the slot's buffer
+		run_end = b;
+		do {
+			size_t size = b->block_size;
+			off_t jnl_offset = (off_t) b->jnl_offset;
+
+			// printf("replaying block 0x%llx, size 0x%x, jnl_offset 0x%llx\n", b->block_num,
+			//      b->block_size, b->jnl_offset);
+
+			// do journal read into the run buffer
+			ret = read_journal_data(jnl, &jnl_offset, slot->data + run_len, size);
 			if (ret != size) {
-				printf("jnl: %s: replay_journal: Could not read journal entry data @ offset 0x%llx!\n", jnl->jdev_name, offset);
-				goto bad_replay;
-			}
-	    	    
-			if (update_fs_block(jnl, block_ptr, number, size) != 0) {
+				printf("jnl: %s: replay_journal: Could not read journal entry data @ offset 0x%llx!\n", jnl->jdev_name, jnl_offset);
 				goto bad_replay;
 			}
+			run_len += size;
+			num_blocks++;
+
+			run_end = b;
+			b = RB_NEXT(bucket_tree, &co_table.tree, b);
+		} while (b != NULL
+			 && b->block_num * (off_t)jnl->jhdr->jhdr_size == run_end->block_num * (off_t)jnl->jhdr->jhdr_size + run_end->block_size
+			 && run_len + b->block_size <= max_bsize);
+
+		if (replay_write_run(jnl, &rio, slot, fs_block, run_len) != 0) {
+			printf("jnl: %s: replay_journal: failed to update blocks %lld - %lld\n", jnl->jdev_name, fs_block, run_end->block_num);
+			goto bad_replay;
 		}
+		num_ios++;
+	}
+
+	if ((io_error = replay_wait_all(&rio)) != 0) {
+		printf("jnl: %s: replay_journal: failed to update fs blocks (ret %d)\n", jnl->jdev_name, io_error);
+		goto bad_replay;
 	}
-    
 	
 	// done replaying; update jnl header
 	if (write_journal_header(jnl, 1, jnl->jhdr->sequence_num) != 0) {
 		goto bad_replay;
 	}
 
-	printf("jnl: %s: journal replay done.\n", jnl->jdev_name);
-    
-	// free block_ptr
-	if (block_ptr) {
-		kmem_free(kernel_map, (vm_offset_t)block_ptr, max_bsize);
-		block_ptr = NULL;
-	}
-    
-	// free the coalesce buffer
-	FREE(co_buf, M_TEMP);
-	co_buf = NULL;
-  
+	absolutetime_to_microtime(mach_absolute_time() - replay_start, &secs, &usecs);
+	elapsed_us = (uint64_t)secs * USEC_PER_SEC + usecs;
+
+	printf("jnl: %s: journal replay done (%d blocks in %d i/os, %llu us).\n",
+	       jnl->jdev_name, num_blocks, num_ios, elapsed_us);
+	KERNEL_DEBUG_CONSTANT(DBG_JOURNAL_REPLAY | DBG_FUNC_END, 0, num_blocks, num_ios, elapsed_us, 0);
+
+	replay_free_slots(&rio, max_bsize);
+	free_coalesce_table(&co_table);
 	kmem_free(kernel_map, (vm_offset_t)buff, jnl->jhdr->blhdr_size);
 	return 0;
 
@@ -1479,11 +1537,14 @@ bad_replay:
 	if (block_ptr) {
 		kmem_free(kernel_map, (vm_offset_t)block_ptr, max_bsize);
 	}
-	if (co_buf) {
-		FREE(co_buf, M_TEMP);
+	if (rio.lock) {
+		(void) replay_wait_all(&rio);
+		replay_free_slots(&rio, max_bsize);
 	}
+	free_coalesce_table(&co_table);
 	kmem_free(kernel_map, (vm_offset_t)buff, jnl->jhdr->blhdr_size);
 
+	KERNEL_DEBUG_CONSTANT(DBG_JOURNAL_REPLAY | DBG_FUNC_END, EIO, num_blocks, num_ios, 0, 0);
 	return -1;
 }
 
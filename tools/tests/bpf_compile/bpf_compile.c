@@ -0,0 +1,404 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Differential test of the BPF filter compiler.
+ *
+ * Links against bsd/net/bpf_filter.c built for user space and runs every
+ * program in a corpus through both bpf_filter() and bpf_compile() +
+ * bpf_cfilter(), over a set of packets and every truncation of them.
+ * The corpus is a handful of filters of the kind tcpdump generates plus
+ * random valid programs.  Any difference in the accept length is a bug
+ * in the compiler.
+ *
+ * Then the tcpdump-style filters are timed over the fixed packets, -i
+ * times each, interpreted and compiled, and the packets/sec printed.
+ *
+ * usage: bpf_compile [-i iterations] [-n programs] [-s seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <net/bpf.h>
+
+/* from bsd/net/bpf_filter.c */
+struct bpf_cprog;
+extern u_int bpf_filter(const struct bpf_insn *, u_char *, u_int, u_int);
+extern struct bpf_cprog *bpf_compile(const struct bpf_insn *, int);
+extern u_int bpf_cfilter(const struct bpf_cprog *, u_char *, u_int, u_int);
+extern void bpf_cfree(struct bpf_cprog *);
+
+#define MAX_PROG_LEN	64
+#define MAX_PKT_LEN	128
+
+/* tcpdump -d "tcp port 80" */
+static struct bpf_insn tcp_port_80[] = {
+	BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x86dd, 0, 6),
+	BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 20),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 6, 0, 15),
+	BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 54),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 80, 12, 0),
+	BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 56),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 80, 10, 11),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x0800, 0, 10),
+	BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 23),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 6, 0, 8),
+	BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 20),
+	BPF_JUMP(BPF_JMP+BPF_JSET+BPF_K, 0x1fff, 6, 0),
+	BPF_STMT(BPF_LDX+BPF_B+BPF_MSH, 14),
+	BPF_STMT(BPF_LD+BPF_H+BPF_IND, 14),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 80, 2, 0),
+	BPF_STMT(BPF_LD+BPF_H+BPF_IND, 16),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 80, 0, 1),
+	BPF_STMT(BPF_RET+BPF_K, 65535),
+	BPF_STMT(BPF_RET+BPF_K, 0),
+};
+
+/* tcpdump -d "udp and ip[8] < 64" */
+static struct bpf_insn udp_ttl[] = {
+	BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x0800, 0, 5),
+	BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 23),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 17, 0, 3),
+	BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 22),
+	BPF_JUMP(BPF_JMP+BPF_JGE+BPF_K, 64, 1, 0),
+	BPF_STMT(BPF_RET+BPF_K, 96),
+	BPF_STMT(BPF_RET+BPF_K, 0),
+};
+
+/* Scratch memory, arithmetic and accept length from A */
+static struct bpf_insn ip_len[] = {
+	BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 16),
+	BPF_STMT(BPF_ST, 3),
+	BPF_STMT(BPF_LDX+BPF_B+BPF_MSH, 14),
+	BPF_STMT(BPF_LD+BPF_MEM, 3),
+	BPF_STMT(BPF_ALU+BPF_SUB+BPF_X, 0),
+	BPF_STMT(BPF_ALU+BPF_ADD+BPF_K, 14),
+	BPF_STMT(BPF_MISC+BPF_TAX, 0),
+	BPF_STMT(BPF_LD+BPF_W+BPF_LEN, 0),
+	BPF_JUMP(BPF_JMP+BPF_JGT+BPF_X, 0, 0, 1),
+	BPF_STMT(BPF_MISC+BPF_TXA, 0),
+	BPF_STMT(BPF_RET+BPF_A, 0),
+};
+
+/* Jumps to jumps, which the compiler threads through */
+static struct bpf_insn ja_chain[] = {
+	BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 26),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x0a000001, 0, 2),
+	BPF_STMT(BPF_JMP+BPF_JA, 2),
+	BPF_STMT(BPF_RET+BPF_K, 1),
+	BPF_STMT(BPF_JMP+BPF_JA, 1),
+	BPF_STMT(BPF_JMP+BPF_JA, 0),
+	BPF_STMT(BPF_LD+BPF_B+BPF_IND, 40),
+	BPF_STMT(BPF_RET+BPF_A, 0),
+};
+
+static struct {
+	const char	*name;
+	struct bpf_insn	*insns;
+	int		len;
+} fixed_progs[] = {
+	{ "tcp_port_80", tcp_port_80,
+	    sizeof (tcp_port_80) / sizeof (struct bpf_insn) },
+	{ "udp_ttl",	udp_ttl,	sizeof (udp_ttl) / sizeof (struct bpf_insn) },
+	{ "ip_len",	ip_len,		sizeof (ip_len) / sizeof (struct bpf_insn) },
+	{ "ja_chain",	ja_chain,	sizeof (ja_chain) / sizeof (struct bpf_insn) },
+};
+#define N_FIXED_PROGS	(sizeof (fixed_progs) / sizeof (fixed_progs[0]))
+
+/* Every instruction bpf_filter() knows, apart from the returns */
+static u_short body_codes[] = {
+	BPF_LD+BPF_W+BPF_ABS, BPF_LD+BPF_H+BPF_ABS, BPF_LD+BPF_B+BPF_ABS,
+	BPF_LD+BPF_W+BPF_IND, BPF_LD+BPF_H+BPF_IND, BPF_LD+BPF_B+BPF_IND,
+	BPF_LD+BPF_W+BPF_LEN, BPF_LDX+BPF_W+BPF_LEN, BPF_LDX+BPF_MSH+BPF_B,
+	BPF_LD+BPF_IMM, BPF_LDX+BPF_IMM, BPF_LD+BPF_MEM, BPF_LDX+BPF_MEM,
+	BPF_ST, BPF_STX, BPF_JMP+BPF_JA,
+	BPF_JMP+BPF_JGT+BPF_K, BPF_JMP+BPF_JGE+BPF_K, BPF_JMP+BPF_JEQ+BPF_K,
+	BPF_JMP+BPF_JSET+BPF_K, BPF_JMP+BPF_JGT+BPF_X, BPF_JMP+BPF_JGE+BPF_X,
+	BPF_JMP+BPF_JEQ+BPF_X, BPF_JMP+BPF_JSET+BPF_X,
+	BPF_ALU+BPF_ADD+BPF_X, BPF_ALU+BPF_SUB+BPF_X, BPF_ALU+BPF_MUL+BPF_X,
+	BPF_ALU+BPF_DIV+BPF_X, BPF_ALU+BPF_AND+BPF_X, BPF_ALU+BPF_OR+BPF_X,
+	BPF_ALU+BPF_LSH+BPF_X, BPF_ALU+BPF_RSH+BPF_X,
+	BPF_ALU+BPF_ADD+BPF_K, BPF_ALU+BPF_SUB+BPF_K, BPF_ALU+BPF_MUL+BPF_K,
+	BPF_ALU+BPF_DIV+BPF_K, BPF_ALU+BPF_AND+BPF_K, BPF_ALU+BPF_OR+BPF_K,
+	BPF_ALU+BPF_LSH+BPF_K, BPF_ALU+BPF_RSH+BPF_K, BPF_ALU+BPF_NEG,
+	BPF_MISC+BPF_TAX, BPF_MISC+BPF_TXA,
+	/* load-and-compare is common enough to deserve extra weight */
+	BPF_LD+BPF_H+BPF_ABS, BPF_LD+BPF_B+BPF_ABS, BPF_JMP+BPF_JEQ+BPF_K,
+	BPF_JMP+BPF_JEQ+BPF_K,
+};
+#define N_BODY_CODES	(sizeof (body_codes) / sizeof (body_codes[0]))
+
+/*
+ * Build a random program that bpf_validate() would accept: jumps stay
+ * forward and in range, memory indexes are in range, there is no
+ * division by a constant 0, and the last instruction is a return.
+ */
+static int
+random_prog(struct bpf_insn *p)
+{
+	int len, i, left;
+
+	len = 1 + random() % MAX_PROG_LEN;
+	for (i = 0; i < len - 1; i++) {
+		p[i].code = body_codes[random() % N_BODY_CODES];
+		p[i].jt = p[i].jf = 0;
+		left = len - i - 2;	/* insns after the next one */
+
+		switch (BPF_CLASS(p[i].code)) {
+		case BPF_LD:
+		case BPF_LDX:
+			if (BPF_MODE(p[i].code) == BPF_MEM)
+				p[i].k = random() % BPF_MEMWORDS;
+			else if (random() % 16 == 0)
+				p[i].k = (bpf_u_int32)random();
+			else
+				p[i].k = random() % (MAX_PKT_LEN + 8);
+			break;
+		case BPF_ST:
+		case BPF_STX:
+			p[i].k = random() % BPF_MEMWORDS;
+			break;
+		case BPF_ALU:
+			if (BPF_OP(p[i].code) == BPF_LSH ||
+			    BPF_OP(p[i].code) == BPF_RSH)
+				p[i].k = random() % 32;
+			else if (BPF_OP(p[i].code) == BPF_DIV)
+				p[i].k = 1 + random() % 1000;
+			else
+				p[i].k = (random() % 2) ? random() % 256 :
+				    (bpf_u_int32)random();
+			break;
+		case BPF_JMP:
+			if (BPF_OP(p[i].code) == BPF_JA) {
+				p[i].k = random() % (left + 1);
+			} else {
+				p[i].jt = random() % (MIN(left, 255) + 1);
+				p[i].jf = random() % (MIN(left, 255) + 1);
+				p[i].k = (random() % 2) ? random() % 256 :
+				    (bpf_u_int32)random();
+			}
+			break;
+		default:
+			p[i].k = (bpf_u_int32)random();
+			break;
+		}
+	}
+
+	p[i].code = (random() % 2) ? BPF_RET+BPF_A : BPF_RET+BPF_K;
+	p[i].jt = p[i].jf = 0;
+	p[i].k = (bpf_u_int32)random() % 0x10000;
+
+	return (len);
+}
+
+static u_char pkts[][MAX_PKT_LEN] = {
+	/* Ethernet, IPv4, TCP 10.0.0.1:1234 -> 10.0.0.2:80 */
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0x08, 0x00,
+	  0x45, 0x00, 0x00, 0x28, 0x12, 0x34, 0x40, 0x00, 0x40, 0x06, 0, 0,
+	  10, 0, 0, 1, 10, 0, 0, 2,
+	  0x04, 0xd2, 0x00, 0x50, 0, 0, 0, 1, 0, 0, 0, 0, 0x50, 0x02,
+	  0xff, 0xff, 0, 0, 0, 0 },
+	/* Ethernet, IPv4 with options, fragment, UDP */
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0x08, 0x00,
+	  0x46, 0x00, 0x00, 0x24, 0x12, 0x34, 0x20, 0x10, 0x20, 0x11, 0, 0,
+	  10, 0, 0, 1, 10, 0, 0, 2, 1, 1, 1, 0,
+	  0x00, 0x35, 0x00, 0x50, 0x00, 0x0c, 0, 0, 'a', 'b', 'c', 'd' },
+	/* Ethernet, IPv6, TCP to port 80 */
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0x86, 0xdd,
+	  0x60, 0, 0, 0, 0x00, 0x14, 0x06, 0x40,
+	  0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+	  0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2,
+	  0x04, 0xd2, 0x00, 0x50, 0, 0, 0, 1, 0, 0, 0, 0, 0x50, 0x02,
+	  0xff, 0xff, 0, 0, 0, 0 },
+	/* Ethernet, ARP */
+	{ 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 6, 7, 8, 9, 10, 11, 0x08, 0x06,
+	  0, 1, 0x08, 0x00, 6, 4, 0, 1 },
+};
+#define N_PKTS		(sizeof (pkts) / sizeof (pkts[0]))
+#define N_RANDOM_PKTS	4
+
+static u_char random_pkts[N_RANDOM_PKTS][MAX_PKT_LEN];
+
+static void
+dump_prog(const struct bpf_insn *p, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		fprintf(stderr, "\t{ 0x%02x, %3u, %3u, 0x%08x },\n",
+		    p[i].code, p[i].jt, p[i].jf, p[i].k);
+}
+
+/*
+ * Run one program over every packet and every truncation of it.
+ * Returns the number of mismatches.
+ */
+static int
+check_prog(const struct bpf_insn *p, int len)
+{
+	struct bpf_cprog *prog;
+	u_char *pkt;
+	u_int buflen, want, got;
+	int n, errors = 0;
+
+	prog = bpf_compile(p, len);
+	if (prog == NULL) {
+		fprintf(stderr, "bpf_compile failed\n");
+		dump_prog(p, len);
+		return (1);
+	}
+
+	for (n = 0; n < (int)(N_PKTS + N_RANDOM_PKTS); n++) {
+		pkt = (n < (int)N_PKTS) ? pkts[n] : random_pkts[n - N_PKTS];
+		for (buflen = 0; buflen <= MAX_PKT_LEN; buflen++) {
+			want = bpf_filter(p, pkt, MAX_PKT_LEN, buflen);
+			got = bpf_cfilter(prog, pkt, MAX_PKT_LEN, buflen);
+			if (want != got) {
+				if (errors++ == 0) {
+					fprintf(stderr, "packet %d, buflen %u: "
+					    "bpf_filter %u, bpf_cfilter %u\n",
+					    n, buflen, want, got);
+					dump_prog(p, len);
+				}
+			}
+		}
+	}
+
+	bpf_cfree(prog);
+	return (errors);
+}
+
+static double
+secs_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return ((now.tv_sec - start->tv_sec) +
+	    (now.tv_usec - start->tv_usec) / 1e6);
+}
+
+/*
+ * Time one program over the fixed packets, interpreted and compiled.
+ */
+static void
+time_prog(const char *name, const struct bpf_insn *p, int len,
+    unsigned long iters)
+{
+	struct bpf_cprog *prog;
+	struct timeval start;
+	volatile u_int sink = 0;
+	double interp, comp;
+	unsigned long i;
+	int n;
+
+	if ((prog = bpf_compile(p, len)) == NULL)
+		return;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < iters; i++) {
+		for (n = 0; n < (int)N_PKTS; n++)
+			sink += bpf_filter(p, pkts[n], MAX_PKT_LEN,
+			    MAX_PKT_LEN);
+	}
+	interp = secs_since(&start);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < iters; i++) {
+		for (n = 0; n < (int)N_PKTS; n++)
+			sink += bpf_cfilter(prog, pkts[n], MAX_PKT_LEN,
+			    MAX_PKT_LEN);
+	}
+	comp = secs_since(&start);
+
+	bpf_cfree(prog);
+	printf("%-12s interpreted %6.2f Mpkts/s, compiled %6.2f Mpkts/s "
+	    "(%.2fx)\n", name, iters * N_PKTS / interp / 1e6,
+	    iters * N_PKTS / comp / 1e6, comp > 0 ? interp / comp : 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bpf_insn p[MAX_PROG_LEN];
+	unsigned long nprogs = 100000, iters = 1000000, i;
+	unsigned int seed = (unsigned int)getpid();
+	int ch, len, failed = 0;
+
+	while ((ch = getopt(argc, argv, "i:n:s:")) != -1) {
+		switch (ch) {
+		case 'i':
+			iters = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			nprogs = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = (unsigned int)strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-i iterations] "
+			    "[-n programs] [-s seed]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	printf("seed %u\n", seed);
+	srandom(seed);
+	for (i = 0; i < N_RANDOM_PKTS; i++) {
+		for (len = 0; len < MAX_PKT_LEN; len++)
+			random_pkts[i][len] = random() & 0xff;
+	}
+
+	for (i = 0; i < N_FIXED_PROGS; i++) {
+		if (check_prog(fixed_progs[i].insns, fixed_progs[i].len) != 0)
+			failed++;
+	}
+	for (i = 0; i < nprogs; i++) {
+		len = random_prog(p);
+		if (check_prog(p, len) != 0)
+			failed++;
+	}
+
+	printf("%lu programs, %d failed\n", nprogs + N_FIXED_PROGS, failed);
+	if (failed)
+		return (1);
+
+	for (i = 0; iters > 0 && i < N_FIXED_PROGS; i++) {
+		time_prog(fixed_progs[i].name, fixed_progs[i].insns,
+		    fixed_progs[i].len, iters);
+	}
+	return (0);
+}
@@ -0,0 +1,669 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Simulator for the FQ-CoDel class queue algorithm.
+ *
+ * Builds bsd/net/classq/classq_fq_codel.c for user space and puts it in
+ * front of a simulated link, next to a drop-tail FIFO holding the same
+ * number of packets.  Time is simulated; the clock the algorithm reads
+ * advances in steps of -t microseconds.  The traffic is a mix of
+ *
+ *   bulk flows: window based senders that open their window by one
+ *   packet per round trip and halve it on a loss.  A sender learns
+ *   that a packet was sent or dropped one round trip after the fact.
+ *
+ *   request flows: small packets at a fixed aggregate rate, spread
+ *   over a number of flows, sent whatever happens to them.
+ *
+ * For both kinds of traffic, the time every packet spent queued is
+ * recorded, and the percentiles, the throughput and the drops are
+ * reported for each queue.  The packet and byte counts of the class
+ * queue are checked against the simulator's own after every step; the
+ * simulator exits non-zero if they ever disagree.
+ *
+ * usage: fq_codel_sim [-b Mbit/s] [-d seconds] [-f bulk flows]
+ *     [-l queue limit] [-r requests/s] [-R rtt ms] [-s seed] [-t usec]
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <mach/boolean.h>
+#include <sys/cdefs.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+
+/*
+ * The kernel interfaces classq_fq_codel.c uses.  Its kernel headers are
+ * skipped by defining their guards; everything it needs from them is
+ * provided here.
+ */
+#define _SYS_MBUF_H_
+#define _SYS_SYSTM_H_
+#define _SYS_SYSCTL_H_
+#define _SYS_KERNEL_H_
+#define _KERN_ZALLOC_H_
+#define _NET_IF_VAR_H_
+#define DLIL_H
+#define __NET_NET_OSDEP_H_DEFINED_
+#define __DEV_RANDOMDEV_H__
+#define _NET_CLASSQ_IF_CLASSQ_H_
+
+#define log(pri, ...)	fprintf(stderr, __VA_ARGS__)
+#define panic(...)	abort()
+#define VERIFY(e)	do { if (!(e)) abort(); } while (0)
+#define _CASSERT(e)	((void)sizeof (char[(e) ? 1 : -1]))
+
+#define SYSCTL_NODE(...)
+#define SYSCTL_QUAD(...)
+#define SYSCTL_UINT(...)
+
+/* packets */
+struct pkthdr {
+	int32_t			len;
+	u_int32_t		pkt_flowid;
+	u_int64_t		pkt_enqueue_ts;
+};
+
+struct mbuf {
+	struct mbuf		*m_nextpkt;
+	struct pkthdr		m_pkthdr;
+	/* used by the simulator */
+	struct sim_flow		*m_flow;
+	u_int64_t		m_ts;		/* queued at, or due at */
+	int			m_lost;
+};
+
+#define m_pktlen(m)	((m)->m_pkthdr.len)
+
+static void m_freem(struct mbuf *);
+
+#define MBUFQ_HEAD(name)					\
+struct name {							\
+	struct mbuf *mq_first;					\
+	struct mbuf **mq_last;					\
+}
+#define MBUFQ_INIT(q)		do {				\
+	MBUFQ_FIRST(q) = NULL;					\
+	(q)->mq_last = &MBUFQ_FIRST(q);				\
+} while (0)
+#define MBUFQ_ENQUEUE(q, m)	do {				\
+	MBUFQ_NEXT(m) = NULL;					\
+	*(q)->mq_last = (m);					\
+	(q)->mq_last = &MBUFQ_NEXT(m);				\
+} while (0)
+#define MBUFQ_DEQUEUE(q, m)	do {				\
+	if (((m) = MBUFQ_FIRST(q)) != NULL) {			\
+		if ((MBUFQ_FIRST(q) = MBUFQ_NEXT(m)) == NULL)	\
+			(q)->mq_last = &MBUFQ_FIRST(q);		\
+		else						\
+			MBUFQ_NEXT(m) = NULL;			\
+	}							\
+} while (0)
+#define MBUFQ_REMOVE(q, m)	do {				\
+	if (MBUFQ_FIRST(q) == (m)) {				\
+		MBUFQ_DEQUEUE(q, m);				\
+	} else {						\
+		struct mbuf *_m = MBUFQ_FIRST(q);		\
+		while (MBUFQ_NEXT(_m) != (m))			\
+			_m = MBUFQ_NEXT(_m);			\
+		if ((MBUFQ_NEXT(_m) =				\
+		    MBUFQ_NEXT(MBUFQ_NEXT(_m))) == NULL)	\
+			(q)->mq_last = &MBUFQ_NEXT(_m);		\
+	}							\
+} while (0)
+#define MBUFQ_FOREACH_SAFE(m, q, tvar)				\
+	for ((m) = MBUFQ_FIRST(q);				\
+	    (m) && ((tvar) = MBUFQ_NEXT(m), 1);			\
+	    (m) = (tvar))
+#define MBUFQ_FIRST(q)		((q)->mq_first)
+#define MBUFQ_NEXT(m)		((m)->m_nextpkt)
+
+MBUFQ_HEAD(sim_mq);
+
+/* the class queue and interface send queue, as the schedulers keep them */
+typedef struct {
+	u_int32_t		qlen;
+	u_int32_t		qlim;
+	u_int64_t		qsize;
+} class_queue_t;
+
+#define qlimit(q)	(q)->qlim
+#define qlen(q)		(q)->qlen
+#define qsize(q)	(q)->qsize
+
+typedef enum cqev {
+	CLASSQ_EV_LINK_BANDWIDTH = 1,
+	CLASSQ_EV_LINK_LATENCY = 2,
+	CLASSQ_EV_LINK_MTU = 3,
+	CLASSQ_EV_LINK_UP = 4,
+	CLASSQ_EV_LINK_DOWN = 5,
+} cqev_t;
+
+#define CLASSQEQ_SUCCESS	0
+#define CLASSQEQ_DROPPED_SP	3
+#define CLASSQF_ECN4		0x01
+#define CLASSQF_ECN6		0x02
+
+struct ifclassq {
+	u_int32_t		ifcq_len;
+	u_int64_t		ifcq_dropcnt;
+};
+
+#define IFCQ_LEN(ifq)		((ifq)->ifcq_len)
+#define IFCQ_DEC_LEN(ifq)	((ifq)->ifcq_len--)
+#define IFCQ_DROP_ADD(ifq, p, b)	((ifq)->ifcq_dropcnt += (p))
+#define IFCQ_CONVERT_LOCK(ifq)	(void)(ifq)
+
+struct ifnet {
+	struct ifclassq		if_snd;
+	u_int32_t		if_mtu;
+	u_int32_t		if_hdrlen;
+};
+
+#define if_name(ifp)		"sim0"
+
+static int classq_verbose;
+
+static const char *
+ifclassq_ev2str(cqev_t ev)
+{
+#pragma unused(ev)
+	return ("");
+}
+
+struct pf_mtag;
+
+/* zones */
+struct zone {
+	size_t			z_size;
+};
+
+#define Z_EXPAND		0
+#define Z_CALLERACCT		1
+#define zone_change(z, i, v)	(void)(z)
+
+static struct zone *
+zinit(size_t size, size_t max, size_t alloc, const char *name)
+{
+#pragma unused(max, alloc, name)
+	struct zone *z;
+
+	if ((z = malloc(sizeof (*z))) != NULL)
+		z->z_size = size;
+	return (z);
+}
+
+#define zalloc(z)	malloc((z)->z_size)
+#define zfree(z, p)	free(p)
+
+/* the simulated clock */
+static u_int64_t now;
+
+static void
+nanouptime(struct timespec *ts)
+{
+	ts->tv_sec = now / 1000000000ULL;
+	ts->tv_nsec = now % 1000000000ULL;
+}
+
+static void
+net_timernsec(struct timespec *ts, u_int64_t *ns)
+{
+	*ns = (u_int64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+#define RandomULong()	((u_int32_t)random())
+
+#define PRIVATE
+#define BSD_KERNEL_PRIVATE
+#include "../../../bsd/net/flowhash.c"
+#include "../../../bsd/net/classq/classq_fq_codel.c"
+
+#define NSEC_PER_MSEC	1000000ULL
+#define NSEC_PER_USEC	1000ULL
+
+#define BULK_PKTLEN	1500
+#define REQ_PKTLEN	200
+#define REQ_FLOWS	16
+
+struct sim_flow {
+	u_int32_t		f_id;
+	int			f_bulk;
+	double			f_cwnd;		/* packets */
+	int			f_inflight;
+	u_int64_t		f_recover;	/* no halving before */
+};
+
+struct sim_stats {
+	u_int64_t		s_pkts;
+	u_int64_t		s_bytes;
+	u_int64_t		s_drops;
+	u_int64_t		*s_lat;		/* queueing delay, nsec */
+	size_t			s_nlat;
+	size_t			s_maxlat;
+};
+
+struct sim_queue {
+	const char		*q_name;
+	int			(*q_enqueue)(struct mbuf *);
+	struct mbuf		*(*q_dequeue)(void);
+	int			(*q_check)(void);
+	void			(*q_fini)(void);
+};
+
+static u_int32_t link_mbps = 10;
+static u_int32_t duration = 20;
+static int nbulk = 4;
+static u_int32_t queue_limit = 128;
+static u_int32_t req_rate = 100;
+static u_int64_t rtt = 20 * NSEC_PER_MSEC;
+static u_int64_t tick = 100 * NSEC_PER_USEC;
+
+static struct sim_flow *flows;		/* nbulk bulk flows, then requests */
+static struct sim_stats stats[2];	/* request, bulk */
+static struct sim_mq wire;		/* sent or lost, waiting for the rtt */
+static u_int32_t queued_pkts, queued_bytes;
+static int draining;
+
+/*
+ * Everything the queue frees is a drop.  A bulk sender hears about it
+ * a round trip later, like about a packet that made it.
+ */
+static void
+m_freem(struct mbuf *m)
+{
+	struct sim_flow *f = m->m_flow;
+
+	if (draining) {
+		free(m);
+		return;
+	}
+	VERIFY(queued_pkts > 0 && queued_bytes >= (u_int32_t)m_pktlen(m));
+	queued_pkts--;
+	queued_bytes -= m_pktlen(m);
+	stats[f->f_bulk].s_drops++;
+	if (!f->f_bulk) {
+		free(m);
+		return;
+	}
+	m->m_lost = 1;
+	m->m_ts = now + rtt;
+	MBUFQ_ENQUEUE(&wire, m);
+}
+
+/* drop-tail FIFO */
+static struct sim_mq fifo;
+static u_int32_t fifo_len;
+
+static int
+fifo_enqueue(struct mbuf *m)
+{
+	if (fifo_len >= queue_limit) {
+		m_freem(m);
+		return (-1);
+	}
+	MBUFQ_ENQUEUE(&fifo, m);
+	fifo_len++;
+	return (0);
+}
+
+static struct mbuf *
+fifo_dequeue(void)
+{
+	struct mbuf *m;
+
+	MBUFQ_DEQUEUE(&fifo, m);
+	if (m != NULL)
+		fifo_len--;
+	return (m);
+}
+
+static int
+fifo_check(void)
+{
+	return (fifo_len == queued_pkts);
+}
+
+static void
+fifo_fini(void)
+{
+	struct mbuf *m;
+
+	while ((m = fifo_dequeue()) != NULL)
+		free(m);
+}
+
+/* FQ-CoDel, with the accounting a scheduler does around it */
+static struct ifnet sim_if;
+static class_queue_t sim_cq;
+static struct fq_codel *fqc;
+
+static int
+fqc_enqueue(struct mbuf *m)
+{
+	if (fq_codel_addq(fqc, &sim_cq, m, NULL) != CLASSQEQ_SUCCESS)
+		return (-1);
+	sim_if.if_snd.ifcq_len++;
+	return (0);
+}
+
+static struct mbuf *
+fqc_dequeue(void)
+{
+	struct mbuf *m;
+
+	if ((m = fq_codel_getq(fqc, &sim_cq)) != NULL) {
+		VERIFY(IFCQ_LEN(&sim_if.if_snd) > 0);
+		IFCQ_DEC_LEN(&sim_if.if_snd);
+	}
+	return (m);
+}
+
+static int
+fqc_check(void)
+{
+	return (qlen(&sim_cq) == queued_pkts &&
+	    IFCQ_LEN(&sim_if.if_snd) == queued_pkts &&
+	    fqc->fqc_backlog == queued_bytes);
+}
+
+static void
+fqc_fini(void)
+{
+	struct fq_codel_stats st;
+
+	fq_codel_getstats(fqc, &st);
+	printf("%-9s codel drops %llu, overlimit drops %llu, "
+	    "max sojourn %.1f ms, %llu new flows\n", "",
+	    (unsigned long long)st.fqcodelstats.drop_codel,
+	    (unsigned long long)st.fqcodelstats.drop_overlimit,
+	    (double)st.fqcodelstats.max_sojourn / NSEC_PER_MSEC,
+	    (unsigned long long)st.fqcodelstats.new_flows);
+	fq_codel_purgeq(fqc, &sim_cq, 0, NULL, NULL);
+	sim_if.if_snd.ifcq_len = 0;
+	fq_codel_destroy(fqc);
+	fqc = NULL;
+}
+
+static struct sim_queue queues[] = {
+	{ "fifo", fifo_enqueue, fifo_dequeue, fifo_check, fifo_fini },
+	{ "fq_codel", fqc_enqueue, fqc_dequeue, fqc_check, fqc_fini },
+};
+
+static struct mbuf *
+pkt_alloc(struct sim_flow *f, int len)
+{
+	struct mbuf *m;
+
+	if ((m = calloc(1, sizeof (*m))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	m->m_pkthdr.len = len;
+	m->m_pkthdr.pkt_flowid = f->f_id;
+	m->m_flow = f;
+	m->m_ts = now;
+	return (m);
+}
+
+static void
+send_pkt(struct sim_queue *q, struct sim_flow *f, int len)
+{
+	struct mbuf *m = pkt_alloc(f, len);
+
+	/* counted first; a packet dropped on the way in is taken off again */
+	queued_pkts++;
+	queued_bytes += len;
+	if (f->f_bulk)
+		f->f_inflight++;
+	(void) q->q_enqueue(m);
+}
+
+static void
+record(struct sim_stats *s, u_int64_t lat)
+{
+	if (s->s_nlat == s->s_maxlat) {
+		s->s_maxlat = s->s_maxlat ? 2 * s->s_maxlat : 4096;
+		s->s_lat = realloc(s->s_lat, s->s_maxlat * sizeof (*s->s_lat));
+		if (s->s_lat == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	s->s_lat[s->s_nlat++] = lat;
+}
+
+static int
+latcmp(const void *a, const void *b)
+{
+	u_int64_t x = *(const u_int64_t *)a, y = *(const u_int64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static double
+pctl(struct sim_stats *s, int p)
+{
+	if (s->s_nlat == 0)
+		return (0);
+	return ((double)s->s_lat[(s->s_nlat - 1) * p / 100] / NSEC_PER_MSEC);
+}
+
+static int
+simulate(struct sim_queue *q)
+{
+	static const char *kind[] = { "requests", "bulk" };
+	u_int64_t end = (u_int64_t)duration * 1000000000ULL;
+	double credit = 0, reqs = 0;
+	struct sim_flow *f;
+	struct mbuf *m;
+	int i, req = 0, bad = 0;
+
+	now = 0;
+	queued_pkts = queued_bytes = 0;
+	MBUFQ_INIT(&wire);
+	for (i = 0; i < nbulk + REQ_FLOWS; i++) {
+		f = &flows[i];
+		f->f_id = i + 1;
+		f->f_bulk = (i < nbulk);
+		f->f_cwnd = 2;
+		f->f_inflight = 0;
+		f->f_recover = 0;
+	}
+	for (i = 0; i < 2; i++) {
+		free(stats[i].s_lat);
+		bzero(&stats[i], sizeof (stats[i]));
+	}
+
+	while (now < end) {
+		now += tick;
+
+		/* news of packets sent or lost a round trip ago */
+		while ((m = MBUFQ_FIRST(&wire)) != NULL && m->m_ts <= now) {
+			MBUFQ_DEQUEUE(&wire, m);
+			f = m->m_flow;
+			f->f_inflight--;
+			if (!m->m_lost) {
+				f->f_cwnd += 1 / f->f_cwnd;
+			} else if (now >= f->f_recover) {
+				f->f_cwnd = MAX(f->f_cwnd / 2, 2);
+				f->f_recover = now + rtt;
+			}
+			free(m);
+		}
+
+		for (i = 0; i < nbulk; i++) {
+			f = &flows[i];
+			while (f->f_inflight < (int)f->f_cwnd)
+				send_pkt(q, f, BULK_PKTLEN);
+		}
+		for (reqs += (double)req_rate * tick / 1e9; reqs >= 1; reqs--) {
+			send_pkt(q, &flows[nbulk + req], REQ_PKTLEN);
+			req = (req + 1) % REQ_FLOWS;
+		}
+
+		/* the link sends what it has time for; idle time is not saved */
+		credit += (double)link_mbps * 1e6 / 8 * tick / 1e9;
+		while (credit > 0) {
+			if ((m = q->q_dequeue()) == NULL) {
+				credit = 0;
+				break;
+			}
+			credit -= m_pktlen(m);
+			queued_pkts--;
+			queued_bytes -= m_pktlen(m);
+			f = m->m_flow;
+			record(&stats[f->f_bulk], now - m->m_ts);
+			stats[f->f_bulk].s_pkts++;
+			stats[f->f_bulk].s_bytes += m_pktlen(m);
+			if (!f->f_bulk) {
+				free(m);
+				continue;
+			}
+			m->m_ts = now + rtt;
+			MBUFQ_ENQUEUE(&wire, m);
+		}
+
+		if (!q->q_check()) {
+			printf("%s: %u packets, %u bytes queued, queue "
+			    "disagrees at %llu us\n", q->q_name, queued_pkts,
+			    queued_bytes, (unsigned long long)(now / 1000));
+			bad = 1;
+			break;
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		struct sim_stats *s = &stats[1 - i];
+
+		if (s->s_nlat > 0)
+			qsort(s->s_lat, s->s_nlat, sizeof (*s->s_lat),
+			    latcmp);
+		printf("%-9s %-8s %8llu %8.2f %7llu %7.1f %7.1f %7.1f %7.1f\n",
+		    q->q_name, kind[1 - i], (unsigned long long)s->s_pkts,
+		    (double)s->s_bytes * 8 / 1e6 / duration,
+		    (unsigned long long)s->s_drops, pctl(s, 50), pctl(s, 90),
+		    pctl(s, 99), pctl(s, 100));
+	}
+
+	draining = 1;
+	q->q_fini();
+	while ((m = MBUFQ_FIRST(&wire)) != NULL) {
+		MBUFQ_DEQUEUE(&wire, m);
+		free(m);
+	}
+	draining = 0;
+	return (bad);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned int seed = (unsigned int)getpid();
+	size_t i;
+	int ch, failed = 0;
+
+	while ((ch = getopt(argc, argv, "b:d:f:l:r:R:s:t:")) != -1) {
+		switch (ch) {
+		case 'b':
+			link_mbps = (u_int32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			duration = (u_int32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			nbulk = (int)strtol(optarg, NULL, 0);
+			break;
+		case 'l':
+			queue_limit = (u_int32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			req_rate = (u_int32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			rtt = strtoull(optarg, NULL, 0) * NSEC_PER_MSEC;
+			break;
+		case 's':
+			seed = (unsigned int)strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			tick = strtoull(optarg, NULL, 0) * NSEC_PER_USEC;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b Mbit/s] [-d seconds] "
+			    "[-f bulk flows] [-l queue limit] [-r requests/s] "
+			    "[-R rtt ms] [-s seed] [-t usec]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (link_mbps == 0 || duration == 0 || nbulk < 0 ||
+	    queue_limit == 0 || tick == 0) {
+		fprintf(stderr, "bad link, duration, flow count, limit "
+		    "or step\n");
+		exit(1);
+	}
+	if ((flows = calloc(nbulk + REQ_FLOWS, sizeof (*flows))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	printf("seed %u\n", seed);
+	printf("%u Mbit/s, %u packets, %d bulk flows, %u requests/s, "
+	    "%llu ms rtt, %u s\n", link_mbps, queue_limit, nbulk, req_rate,
+	    (unsigned long long)(rtt / NSEC_PER_MSEC), duration);
+	printf("%-9s %-8s %8s %8s %7s %7s %7s %7s %7s\n", "queue", "traffic",
+	    "packets", "Mbit/s", "drops", "p50 ms", "p90 ms", "p99 ms",
+	    "max ms");
+
+	fq_codel_init();
+	sim_if.if_mtu = ETHERMTU;
+	sim_if.if_hdrlen = sizeof (struct ether_header);
+	sim_cq.qlim = queue_limit;
+	for (i = 0; i < sizeof (queues) / sizeof (queues[0]); i++) {
+		srandom(seed);
+		MBUFQ_INIT(&fifo);
+		if (queues[i].q_enqueue == fqc_enqueue &&
+		    (fqc = fq_codel_alloc(&sim_if, 0, 0)) == NULL) {
+			fprintf(stderr, "fq_codel_alloc failed\n");
+			exit(1);
+		}
+		failed |= simulate(&queues[i]);
+	}
+	return (failed);
+}
@@ -0,0 +1,447 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+/*
+ * Catalog lookup and directory enumeration benchmark.
+ *
+ * Creates a journaled HFS+ volume in a sparse disk image and fills one
+ * directory with a synthetic set of files.  The names share a handful
+ * of common leading strings, as real directories do, so some catalog
+ * key comparisons are decided by the first few characters and some are
+ * not.  The volume is then remounted several times with a cold cache.
+ * Each round times lookups of random names and a full readdir of the
+ * directory, which reads the catalog leaf chain in order.
+ *
+ * Each round also times a searchfs(2) of the whole catalog for a partial
+ * name, once for each vfs.generic.hfs.search_threads setting given with
+ * -t.  The search returns a few matches at a time, so it is resumed from
+ * its searchstate many times, and the total must equal the number of
+ * names created that match.
+ *
+ * usage: hfs_catalog [-n files] [-l lookups] [-r rounds] [-t threads,...]
+ *
+ * Must be run as root.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+#include <sys/attr.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+
+#define NAME_LEN	32
+#define MAX_RUNS	16
+#define SEARCH_NAME	"77"
+#define SEARCH_BATCH	64		/* matches per searchfs() call */
+#define UTF8_SCRIPT	0x08000103	/* see searchfs(2) */
+
+struct packed_name_attr {
+	u_int32_t	size;
+	attrreference_t	ref;
+	char		name[NAME_LEN];
+};
+
+struct packed_attr_ref {
+	u_int32_t	size;
+	attrreference_t	ref;
+};
+
+static char	dir[] = "/tmp/hfs_catalog.XXXXXX";
+static char	image[MAXPATHLEN];
+static char	disk[MAXPATHLEN];
+static char	mntpt[MAXPATHLEN];
+static char	bigdir[MAXPATHLEN];
+
+static const char *leads[] = {
+	"IMG_", "file", "Document ", "a", "Screen Shot ", "", "x-", "IMG_1"
+};
+#define NLEADS	(sizeof (leads) / sizeof (leads[0]))
+
+static int
+run(const char *cmd, char *out, size_t outlen)
+{
+	FILE *fp;
+	int status;
+
+	if ((fp = popen(cmd, "r")) == NULL) {
+		perror(cmd);
+		return (-1);
+	}
+	if (out != NULL) {
+		if (fgets(out, outlen, fp) == NULL)
+			out[0] = '\0';
+		out[strcspn(out, " \t\n")] = '\0';
+	}
+	status = pclose(fp);
+	if (status != 0) {
+		fprintf(stderr, "'%s' failed (status %d)\n", cmd, status);
+		return (-1);
+	}
+	return (0);
+}
+
+static double
+ms_since(uint64_t start)
+{
+	static mach_timebase_info_data_t tb;
+
+	if (tb.denom == 0)
+		mach_timebase_info(&tb);
+	return ((mach_absolute_time() - start) * tb.numer / tb.denom / 1e6);
+}
+
+static int
+mount_volume(void)
+{
+	char cmd[2 * MAXPATHLEN];
+
+	snprintf(cmd, sizeof (cmd), "mount -t hfs %s %s", disk, mntpt);
+	return (run(cmd, NULL, 0));
+}
+
+static int
+unmount_volume(void)
+{
+	char cmd[2 * MAXPATHLEN];
+
+	snprintf(cmd, sizeof (cmd), "umount %s", mntpt);
+	return (run(cmd, NULL, 0));
+}
+
+/* Remount with nothing of the catalog cached */
+static int
+remount_cold(void)
+{
+	if (unmount_volume() != 0)
+		return (-1);
+	/* the disk image's backing file is cached too */
+	(void) run("purge", NULL, 0);
+	return (mount_volume());
+}
+
+static int
+populate(char *names, int nfiles)
+{
+	char path[MAXPATHLEN];
+	uint64_t start = mach_absolute_time();
+	int i, fd;
+
+	for (i = 0; i < nfiles; i++) {
+		/* unique, since 7919 is prime to 10^7, but out of order */
+		snprintf(names + i * NAME_LEN, NAME_LEN, "%s%07d",
+		    leads[random() % NLEADS], (int)((i * 7919LL) % 10000000));
+		snprintf(path, sizeof (path), "%s/%s", bigdir,
+		    names + i * NAME_LEN);
+		if ((fd = open(path, O_CREAT | O_WRONLY, 0644)) < 0) {
+			perror(path);
+			return (-1);
+		}
+		close(fd);
+	}
+	printf("created %d files in %.0f ms\n", nfiles, ms_since(start));
+	return (0);
+}
+
+static int
+lookups(const char *names, int nfiles, int nlookups)
+{
+	char path[MAXPATHLEN];
+	struct stat st;
+	uint64_t start = mach_absolute_time();
+	double ms;
+	int i;
+
+	for (i = 0; i < nlookups; i++) {
+		snprintf(path, sizeof (path), "%s/%s", bigdir,
+		    names + (random() % nfiles) * NAME_LEN);
+		if (stat(path, &st) < 0) {
+			perror(path);
+			return (-1);
+		}
+	}
+	ms = ms_since(start);
+	printf("  %d lookups in %.1f ms (%.0f/s)\n", nlookups, ms,
+	    nlookups * 1000.0 / ms);
+	return (0);
+}
+
+static int
+enumerate(int nfiles)
+{
+	struct dirent *dp;
+	uint64_t start = mach_absolute_time();
+	double ms;
+	DIR *dirp;
+	int n = 0;
+
+	if ((dirp = opendir(bigdir)) == NULL) {
+		perror(bigdir);
+		return (-1);
+	}
+	while ((dp = readdir(dirp)) != NULL)
+		n++;
+	closedir(dirp);
+	ms = ms_since(start);
+	/* "." and ".." */
+	if (n < nfiles + 2) {
+		fprintf(stderr, "readdir returned %d of %d entries\n", n,
+		    nfiles + 2);
+		return (-1);
+	}
+	printf("  readdir of %d entries in %.1f ms (%.0f/s)\n", n, ms,
+	    n * 1000.0 / ms);
+	return (0);
+}
+
+/*
+ * Search the volume for files whose names contain SEARCH_NAME, resuming
+ * after every SEARCH_BATCH matches, and check the number found.
+ */
+static int
+search(const char *names, int nfiles, int threads)
+{
+	struct fssearchblock sb;
+	struct searchstate state;
+	struct attrlist retattrs;
+	struct packed_name_attr info1;
+	struct packed_attr_ref info2;
+	char *buf;
+	unsigned long nmatches, total = 0, expect = 0;
+	unsigned int options;
+	uint64_t start;
+	double ms;
+	int i, error;
+
+	for (i = 0; i < nfiles; i++) {
+		if (strstr(names + i * NAME_LEN, SEARCH_NAME) != NULL)
+			expect++;
+	}
+	if (sysctlbyname("vfs.generic.hfs.search_threads", NULL, NULL,
+	    &threads, sizeof (threads)) < 0) {
+		perror("vfs.generic.hfs.search_threads");
+		return (-1);
+	}
+	if ((buf = malloc(64 * 1024)) == NULL) {
+		perror("malloc");
+		return (-1);
+	}
+
+	memset(&retattrs, 0, sizeof (retattrs));
+	retattrs.bitmapcount = ATTR_BIT_MAP_COUNT;
+	retattrs.commonattr = ATTR_CMN_NAME | ATTR_CMN_PAROBJID;
+
+	memset(&info1, 0, sizeof (info1));
+	info1.size = sizeof (info1);
+	info1.ref.attr_dataoffset = sizeof (attrreference_t);
+	info1.ref.attr_length = (u_int32_t)strlen(SEARCH_NAME) + 1;
+	strlcpy(info1.name, SEARCH_NAME, sizeof (info1.name));
+	memset(&info2, 0, sizeof (info2));
+	info2.size = sizeof (info2);
+	info2.ref.attr_dataoffset = sizeof (attrreference_t);
+
+	memset(&sb, 0, sizeof (sb));
+	sb.returnattrs = &retattrs;
+	sb.returnbuffer = buf;
+	sb.returnbuffersize = 64 * 1024;
+	sb.maxmatches = SEARCH_BATCH;
+	sb.timelimit.tv_sec = 1;
+	sb.searchparams1 = &info1;
+	sb.sizeofsearchparams1 = sizeof (info1);
+	sb.searchparams2 = &info2;
+	sb.sizeofsearchparams2 = sizeof (info2);
+	sb.searchattrs.bitmapcount = ATTR_BIT_MAP_COUNT;
+	sb.searchattrs.commonattr = ATTR_CMN_NAME;
+
+	options = SRCHFS_START | SRCHFS_MATCHPARTIALNAMES | SRCHFS_MATCHFILES;
+	start = mach_absolute_time();
+	do {
+		nmatches = 0;
+		error = searchfs(mntpt, &sb, &nmatches, UTF8_SCRIPT, options,
+		    &state);
+		if (error < 0 && errno != EAGAIN) {
+			perror("searchfs");
+			free(buf);
+			return (-1);
+		}
+		total += nmatches;
+		options &= ~SRCHFS_START;
+	} while (error < 0);
+	ms = ms_since(start);
+	free(buf);
+
+	if (total != expect) {
+		fprintf(stderr, "searchfs with %d threads found %lu of %lu "
+		    "files\n", threads, total, expect);
+		return (-1);
+	}
+	printf("  searchfs, %d threads: %lu matches in %.1f ms\n", threads,
+	    total, ms);
+	return (0);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n files] [-l lookups] [-r rounds] "
+	    "[-t threads,...]\n", prog);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char cmd[2 * MAXPATHLEN], *names = NULL;
+	char deflist[] = "1,4", *list = deflist, *t;
+	int ch, nfiles = 100000, nlookups = 10000, rounds = 3, r, i;
+	int threads[MAX_RUNS], nruns = 0, oldthreads;
+	int error = 1, mounted = 0;
+	size_t len;
+
+	while ((ch = getopt(argc, argv, "l:n:r:t:")) != -1) {
+		switch (ch) {
+		case 'l':
+			nlookups = atoi(optarg);
+			break;
+		case 'n':
+			nfiles = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 't':
+			list = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nfiles <= 0 || nfiles > 10000000 || nlookups <= 0 || rounds <= 0)
+		usage(argv[0]);
+	for (t = strtok(list, ","); t != NULL; t = strtok(NULL, ",")) {
+		if (nruns == MAX_RUNS || (threads[nruns++] = atoi(t)) <= 0)
+			usage(argv[0]);
+	}
+	if (geteuid() != 0) {
+		fprintf(stderr, "%s must be run as root\n", argv[0]);
+		return (1);
+	}
+	len = sizeof (oldthreads);
+	if (sysctlbyname("vfs.generic.hfs.search_threads", &oldthreads, &len,
+	    NULL, 0) < 0) {
+		perror("vfs.generic.hfs.search_threads");
+		return (1);
+	}
+	if ((names = calloc(nfiles, NAME_LEN)) == NULL) {
+		perror("calloc");
+		return (1);
+	}
+	srandom(1);
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		goto out;
+	}
+	snprintf(image, sizeof (image), "%s/catalog.sparseimage", dir);
+	snprintf(mntpt, sizeof (mntpt), "%s/mnt", dir);
+	snprintf(bigdir, sizeof (bigdir), "%s/big", mntpt);
+	if (mkdir(mntpt, 0755) < 0) {
+		perror(mntpt);
+		goto rmdir;
+	}
+	snprintf(cmd, sizeof (cmd), "hdiutil create -quiet -size 8g "
+	    "-type SPARSE -layout NONE -fs 'Journaled HFS+' "
+	    "-volname hfs_catalog %s", image);
+	if (run(cmd, NULL, 0) != 0)
+		goto rmdir;
+	snprintf(cmd, sizeof (cmd), "hdiutil attach -nomount %s", image);
+	if (run(cmd, disk, sizeof (disk)) != 0 || disk[0] == '\0')
+		goto unlink;
+	if (mount_volume() != 0)
+		goto detach;
+	mounted = 1;
+
+	if (mkdir(bigdir, 0755) < 0) {
+		perror(bigdir);
+		goto unmount;
+	}
+	if (populate(names, nfiles) != 0)
+		goto unmount;
+
+	for (r = 0; r < rounds; r++) {
+		printf("round %d\n", r + 1);
+		if (remount_cold() != 0) {
+			mounted = 0;
+			goto detach;
+		}
+		if (lookups(names, nfiles, nlookups) != 0)
+			goto unmount;
+		if (remount_cold() != 0) {
+			mounted = 0;
+			goto detach;
+		}
+		if (enumerate(nfiles) != 0)
+			goto unmount;
+		for (i = 0; i < nruns; i++) {
+			if (remount_cold() != 0) {
+				mounted = 0;
+				goto detach;
+			}
+			if (search(names, nfiles, threads[i]) != 0)
+				goto unmount;
+		}
+	}
+	error = 0;
+
+unmount:
+	if (mounted)
+		(void) unmount_volume();
+detach:
+	snprintf(cmd, sizeof (cmd), "hdiutil detach %s", disk);
+	(void) run(cmd, NULL, 0);
+unlink:
+	(void) unlink(image);
+rmdir:
+	(void) rmdir(mntpt);
+	(void) rmdir(dir);
+out:
+	(void) sysctlbyname("vfs.generic.hfs.search_threads", NULL, NULL,
+	    &oldthreads, sizeof (oldthreads));
+	free(names);
+	if (error)
+		printf("hfs_catalog: FAIL\n");
+	return (error);
+}
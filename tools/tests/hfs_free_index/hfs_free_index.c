@@ -0,0 +1,747 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Test and benchmark of the HFS+ free extent index.
+ *
+ * Builds bsd/hfs/hfscommon/Misc/FreeExtentIndex.c for user space and
+ * drives it with a trace of allocations and frees against a volume
+ * bitmap kept alongside.  After every operation the index must
+ * describe exactly the maximal free runs of the bitmap, and every
+ * hfs_free_index_find() must return blocks that are free, within the
+ * limits, of an allowed length, and the first fit from the hint when the
+ * bitmap has one within the probe limit.
+ *
+ * The trace is read from a file (-f), or made up from -n random
+ * allocations of 1 to 64 blocks, a third of them followed by a free,
+ * and saved with -o.  It is a line "blocks <volume size>" followed by
+ * one line per operation:
+ *
+ *	alloc <hint> <min> <max>
+ *	free <n>
+ *
+ * where a free returns the extent the n'th allocation of the trace got,
+ * counting from 0.  Allocations that did not fit are not freed.
+ *
+ * The trace leaves the volume fragmented.  The same contiguous
+ * allocation requests are then timed against the index and against a
+ * first-fit scan of the bitmap, which is what BlockAllocateContig()
+ * falls back to without the index.  Last, the whole trace is replayed
+ * -r times from an empty volume with each of the two.
+ *
+ * usage: hfs_free_index [-b blocks] [-f trace] [-n ops] [-o trace]
+ *     [-r replays] [-s seed]
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+/*
+ * The kernel interfaces FreeExtentIndex.c uses.  Its kernel headers are
+ * skipped by defining their guards; everything it needs from them is
+ * provided here.
+ */
+#define _SYS_SYSTM_H_
+#define _SYS_MALLOC_H_
+#define _KERN_ZALLOC_H_
+
+typedef struct zone {
+	size_t	size;
+	size_t	max;
+	size_t	count;
+} *zone_t;
+
+#define Z_EXHAUST	1
+#define Z_CALLERACCT	2
+#define M_TEMP		0
+#define M_WAITOK	0
+#define M_ZERO		0
+#define TRUE		1
+#define FALSE		0
+#ifndef PAGE_SIZE
+#define PAGE_SIZE	4096
+#endif
+
+#define MALLOC(p, t, s, type, flags)	((p) = (t)calloc(1, (s)))
+#define FREE(p, type)			free(p)
+#define panic(...)			abort()
+
+static zone_t
+zinit(size_t size, size_t max, size_t alloc, const char *name)
+{
+	zone_t z;
+
+	(void)alloc, (void)name;
+	if ((z = calloc(1, sizeof (*z))) == NULL)
+		return (NULL);
+	z->size = size;
+	z->max = max / size;
+	return (z);
+}
+
+static void
+zone_change(zone_t z, int item, int value)
+{
+	(void)z, (void)item, (void)value;
+}
+
+/* Exhaustible, like the kernel zone */
+static void *
+zalloc(zone_t z)
+{
+	if (z->count == z->max)
+		return (NULL);
+	z->count++;
+	return (malloc(z->size));
+}
+
+static void
+zfree(zone_t z, void *elem)
+{
+	z->count--;
+	free(elem);
+}
+
+#define KERNEL
+#include "../../../bsd/hfs/hfscommon/Misc/FreeExtentIndex.c"
+#undef KERNEL
+
+static u_int32_t	nblocks = 1024 * 1024;
+static u_int8_t		*bitmap;		/* set bit: allocated */
+
+#define ISSET(b)	(bitmap[(b) >> 3] & (1 << ((b) & 7)))
+
+static void
+mark(u_int32_t start, u_int32_t count, int alloc)
+{
+	u_int32_t b;
+
+	for (b = start; b < start + count; b++) {
+		if (alloc)
+			bitmap[b >> 3] |= 1 << (b & 7);
+		else
+			bitmap[b >> 3] &= ~(1 << (b & 7));
+	}
+}
+
+/* Length of the free run starting at b */
+static u_int32_t
+free_run(u_int32_t b)
+{
+	u_int32_t e;
+
+	for (e = b; e < nblocks && !ISSET(e); e++)
+		;
+	return (e - b);
+}
+
+/* Check that the index holds exactly the maximal free runs */
+static int
+check_index(struct hfs_free_index *fip)
+{
+	struct free_extent_node *node;
+	u_int32_t b = 0, len, n = 0, sized = 0;
+	u_int64_t total = 0;
+
+	node = RB_MIN(free_extent_offset_tree, &fip->fi_offset_tree);
+	while (b < nblocks) {
+		if (ISSET(b)) {
+			b++;
+			continue;
+		}
+		len = free_run(b);
+		if (node == NULL || node->fen_start != b ||
+		    node->fen_count != len) {
+			fprintf(stderr, "free run %u+%u: index has %u+%u\n",
+			    b, len, node ? node->fen_start : 0,
+			    node ? node->fen_count : 0);
+			return (-1);
+		}
+		node = RB_NEXT(free_extent_offset_tree, &fip->fi_offset_tree,
+		    node);
+		total += len;
+		n++;
+		b += len;
+	}
+	if (node != NULL) {
+		fprintf(stderr, "index has extra extent %u+%u\n",
+		    node->fen_start, node->fen_count);
+		return (-1);
+	}
+	RB_FOREACH(node, free_extent_size_tree, &fip->fi_size_tree)
+		sized++;
+	if (n != fip->fi_extents || sized != n ||
+	    total != fip->fi_free_blocks) {
+		fprintf(stderr, "%u runs, %u blocks free; index counts %u/%u "
+		    "extents, %llu blocks\n", n, (u_int32_t)total,
+		    fip->fi_extents, sized,
+		    (unsigned long long)fip->fi_free_blocks);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * The first free run at or after hint, wrapping once, whose part that
+ * the limits allow holds want blocks; the run holding the hint is only
+ * used from the hint on.  Returns the number of runs looked at, or -1.
+ */
+static int
+first_fit(u_int32_t hint, u_int32_t want,
+    const struct free_extent_limits *limits, u_int32_t *startp)
+{
+	struct free_extent_node n;
+	u_int32_t b, floor = hint, first = nblocks, len, start;
+	int runs = 0, wrapped = 0;
+
+	/* back up to the start of the run holding the hint */
+	for (b = hint; b > 0 && !ISSET(b - 1) && !ISSET(b); b--)
+		;
+	for (;;) {
+		if (b >= nblocks) {
+			if (wrapped)
+				return (-1);
+			b = 0;
+			wrapped = 1;
+			continue;
+		}
+		if (ISSET(b)) {
+			b++;
+			continue;
+		}
+		if (wrapped && b >= first) {
+			/* the run holding the hint, in full this time */
+			if (b != first)
+				return (-1);
+		}
+		n.fen_start = b;
+		n.fen_count = free_run(b);
+		if (first == nblocks) {
+			if (b + n.fen_count <= hint) {
+				b += n.fen_count;
+				continue;
+			}
+			first = b;
+		}
+		runs++;
+		len = free_extent_clip(&n, limits, floor, &start);
+		floor = 0;
+		if (len >= want) {
+			*startp = start;
+			return (runs);
+		}
+		if (wrapped && b == first)
+			return (-1);
+		b += n.fen_count;
+	}
+}
+
+/* Whether any free run has an allowed part of at least want blocks */
+static int
+any_fit(u_int32_t want, const struct free_extent_limits *limits)
+{
+	struct free_extent_node n;
+	u_int32_t b = 0, start;
+
+	while (b < nblocks) {
+		if (ISSET(b)) {
+			b++;
+			continue;
+		}
+		n.fen_start = b;
+		n.fen_count = free_run(b);
+		if (free_extent_clip(&n, limits, 0, &start) >= want)
+			return (1);
+		b += n.fen_count;
+	}
+	return (0);
+}
+
+static int
+check_find(struct hfs_free_index *fip, u_int32_t hint, u_int32_t min,
+    u_int32_t max, const struct free_extent_limits *limits)
+{
+	u_int32_t start = 0, count = 0, expect, b;
+	int error, runs;
+
+	error = hfs_free_index_find(fip, hint, min, max, limits, &start,
+	    &count);
+	if (error == EAGAIN)
+		return (0);
+	if (error == ENOSPC) {
+		if (any_fit(min, limits)) {
+			fprintf(stderr, "find(%u, %u, %u): ENOSPC but the "
+			    "bitmap has room\n", hint, min, max);
+			return (-1);
+		}
+		return (0);
+	}
+	if (error != 0 || count < min || count > max ||
+	    start + count > limits->fel_alloc_limit ||
+	    (limits->fel_exclude_end != 0 &&
+	    start <= limits->fel_exclude_end &&
+	    start + count > limits->fel_exclude_start)) {
+		fprintf(stderr, "find(%u, %u, %u): error %d, %u+%u\n",
+		    hint, min, max, error, start, count);
+		return (-1);
+	}
+	for (b = start; b < start + count; b++) {
+		if (ISSET(b)) {
+			fprintf(stderr, "find(%u, %u, %u): block %u of %u+%u "
+			    "is allocated\n", hint, min, max, b, start, count);
+			return (-1);
+		}
+	}
+	runs = first_fit(hint, max, limits, &expect);
+	if (runs > 0 && runs <= FREE_EXTENT_MAX_PROBES && start != expect) {
+		fprintf(stderr, "find(%u, %u, %u): %u, first fit from the "
+		    "hint is %u\n", hint, min, max, start, expect);
+		return (-1);
+	}
+	return (0);
+}
+
+/* First fit by scanning the bitmap from the hint, a word at a time */
+static int
+scan_find(u_int32_t hint, u_int32_t want, u_int32_t *startp)
+{
+	const u_int64_t *words = (const u_int64_t *)(const void *)bitmap;
+	u_int32_t b = hint, run = 0, scanned = 0;
+
+	while (scanned < nblocks + want) {
+		if (b >= nblocks) {
+			b = 0;
+			run = 0;
+		}
+		if ((b & 63) == 0 && words[b >> 6] == ~0ULL) {
+			b += 64;
+			scanned += 64;
+			run = 0;
+			continue;
+		}
+		if (ISSET(b)) {
+			run = 0;
+		} else if (++run == want) {
+			*startp = b + 1 - want;
+			return (0);
+		}
+		b++;
+		scanned++;
+	}
+	return (ENOSPC);
+}
+
+static double
+elapsed_us(struct timeval *start, struct timeval *end)
+{
+	return ((end->tv_sec - start->tv_sec) * 1e6 +
+	    (end->tv_usec - start->tv_usec));
+}
+
+/*
+ * The trace: allocations of min to max blocks near a hint, and frees of
+ * the extent an earlier allocation got, by its number.
+ */
+struct trace_op {
+	int		to_free;
+	u_int32_t	to_hint;	/* or the allocation to free */
+	u_int32_t	to_min;
+	u_int32_t	to_max;
+};
+
+static struct trace_op	*trace;
+static u_int32_t	ntrace, maxtrace, nallocs;
+static u_int32_t	*ext_start, *ext_count;
+
+#define REPLAY_CHECK	0	/* against the index, with checks */
+#define REPLAY_INDEX	1	/* against the index */
+#define REPLAY_SCAN	2	/* against the bitmap alone */
+
+static struct trace_op *
+trace_add(void)
+{
+	if (ntrace == maxtrace) {
+		maxtrace = maxtrace ? maxtrace * 2 : 4096;
+		if ((trace = realloc(trace, maxtrace * sizeof (*trace))) ==
+		    NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memset(&trace[ntrace], 0, sizeof (trace[ntrace]));
+	return (&trace[ntrace++]);
+}
+
+/*
+ * Make up a trace: extents of 1 to 64 blocks are allocated near random
+ * hints, and a third of the time a random earlier one is freed, which
+ * leaves the volume fragmented into thousands of free extents.
+ */
+static void
+generate(int nops)
+{
+	struct trace_op *op;
+	u_int32_t *live, nlive = 0, victim;
+	int i;
+
+	if ((live = calloc(nops, sizeof (u_int32_t))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < nops; i++) {
+		op = trace_add();
+		op->to_hint = (u_int32_t)random() % nblocks;
+		op->to_max = op->to_min = 1 + (u_int32_t)random() % 64;
+		live[nlive++] = nallocs++;
+		if (random() % 3 == 0) {
+			victim = (u_int32_t)random() % nlive;
+			op = trace_add();
+			op->to_free = 1;
+			op->to_hint = live[victim];
+			live[victim] = live[--nlive];
+		}
+	}
+	free(live);
+}
+
+static void
+trace_write(const char *path)
+{
+	struct trace_op *op;
+	FILE *fp;
+	u_int32_t k;
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fprintf(fp, "blocks %u\n", nblocks);
+	for (k = 0; k < ntrace; k++) {
+		op = &trace[k];
+		if (op->to_free)
+			fprintf(fp, "free %u\n", op->to_hint);
+		else
+			fprintf(fp, "alloc %u %u %u\n", op->to_hint,
+			    op->to_min, op->to_max);
+	}
+	fclose(fp);
+}
+
+static void
+trace_read(const char *path)
+{
+	struct trace_op *op;
+	char line[256];
+	FILE *fp;
+	int lineno = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		lineno++;
+		if (strncmp(line, "blocks ", 7) == 0 && ntrace == 0) {
+			nblocks = (u_int32_t)strtoul(line + 7, NULL, 0);
+			if (nblocks < 4096)
+				goto bad;
+			nblocks = roundup(nblocks, 64);
+		} else if (strncmp(line, "alloc ", 6) == 0) {
+			op = trace_add();
+			if (sscanf(line + 6, "%u %u %u", &op->to_hint,
+			    &op->to_min, &op->to_max) != 3 ||
+			    op->to_hint >= nblocks || op->to_min == 0 ||
+			    op->to_min > op->to_max)
+				goto bad;
+			nallocs++;
+		} else if (strncmp(line, "free ", 5) == 0) {
+			op = trace_add();
+			op->to_free = 1;
+			if (sscanf(line + 5, "%u", &op->to_hint) != 1 ||
+			    op->to_hint >= nallocs)
+				goto bad;
+		} else if (line[0] != '#' && line[0] != '\n') {
+			goto bad;
+		}
+	}
+	fclose(fp);
+	return;
+bad:
+	fprintf(stderr, "%s:%d: bad line\n", path, lineno);
+	exit(1);
+}
+
+/*
+ * Allocate min to max blocks near the hint.  Without the index, or when
+ * it gives up, this is a first-fit scan of the bitmap for max blocks and
+ * then for min, as in BlockAllocateContig().
+ */
+static int
+allocate(struct hfs_free_index *fip, u_int32_t hint, u_int32_t min,
+    u_int32_t max, u_int32_t *startp, u_int32_t *countp)
+{
+	struct free_extent_limits limits;
+	int error = EAGAIN;
+
+	if (fip != NULL) {
+		limits.fel_exclude_start = limits.fel_exclude_end = 0;
+		limits.fel_alloc_limit = nblocks;
+		error = hfs_free_index_find(fip, hint, min, max, &limits,
+		    startp, countp);
+	}
+	if (error == EAGAIN) {
+		*countp = max;
+		if ((error = scan_find(hint, max, startp)) == ENOSPC &&
+		    min < max) {
+			*countp = min;
+			error = scan_find(hint, min, startp);
+		}
+	}
+	if (error == 0)
+		mark(*startp, *countp, 1);
+	return (error);
+}
+
+/*
+ * Replay the trace from an empty volume.  With checks, before every
+ * allocation another request near the same hint, with limits a quarter
+ * of the time, is checked against the bitmap, and the index is checked
+ * after every operation.  Checking the whole bitmap every time would be
+ * quadratic, so that is done for the first few hundred operations and
+ * then every 100th.  Returns the number of checks that failed, or -1 if
+ * the index could not be set up.
+ */
+static int
+replay(struct hfs_free_index **fipp, int mode)
+{
+	struct hfs_free_index *fip = NULL;
+	struct free_extent_limits limits;
+	struct trace_op *op;
+	u_int32_t k, a = 0, start, count, max;
+	int failed = 0;
+
+	memset(bitmap, 0, nblocks / 8);
+	memset(ext_count, 0, nallocs * sizeof (u_int32_t));
+	hfs_free_index_destroy(*fipp);
+	*fipp = NULL;
+	if (mode != REPLAY_SCAN) {
+		if ((fip = hfs_free_index_create()) == NULL ||
+		    hfs_free_index_add(fip, 0, nblocks) != 0)
+			return (-1);
+		*fipp = fip;
+	}
+
+	for (k = 0; k < ntrace && failed == 0; k++) {
+		op = &trace[k];
+		if (op->to_free) {
+			count = ext_count[op->to_hint];
+			start = ext_start[op->to_hint];
+			ext_count[op->to_hint] = 0;
+			if (count == 0)
+				continue;	/* it did not fit */
+			mark(start, count, 0);
+			if (fip != NULL &&
+			    hfs_free_index_add(fip, start, count) != 0) {
+				fprintf(stderr, "add %u+%u failed\n", start,
+				    count);
+				failed++;
+			}
+		} else {
+			if (mode == REPLAY_CHECK) {
+				max = op->to_max;
+				limits.fel_exclude_start = 0;
+				limits.fel_exclude_end = 0;
+				limits.fel_alloc_limit = nblocks;
+				if (random() % 4 == 0) {
+					limits.fel_exclude_start =
+					    (u_int32_t)random() % (nblocks / 2);
+					limits.fel_exclude_end =
+					    limits.fel_exclude_start +
+					    (u_int32_t)random() % (nblocks / 8);
+					limits.fel_alloc_limit = nblocks -
+					    (u_int32_t)random() % (nblocks / 8);
+				}
+				if (check_find(fip, op->to_hint,
+				    1 + (max - 1) / 2, max, &limits) != 0)
+					failed++;
+			}
+			if (allocate(fip, op->to_hint, op->to_min, op->to_max,
+			    &start, &count) == 0) {
+				if (fip != NULL &&
+				    hfs_free_index_remove(fip, start,
+				    count) != 0) {
+					fprintf(stderr, "remove %u+%u failed\n",
+					    start, count);
+					failed++;
+				}
+				ext_start[a] = start;
+				ext_count[a] = count;
+			}
+			a++;
+		}
+		if (mode == REPLAY_CHECK && (k < 500 || k % 100 == 0) &&
+		    check_index(fip) != 0)
+			failed++;
+	}
+	if (mode == REPLAY_CHECK && failed == 0 && check_index(fip) != 0)
+		failed++;
+	return (failed);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-b blocks] [-f trace] [-n ops] "
+	    "[-o trace] [-r replays] [-s seed]\n", prog);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct hfs_free_index *fip = NULL;
+	struct free_extent_limits nolimits;
+	struct timeval t0, t1;
+	const char *in = NULL, *out = NULL;
+	u_int32_t start, count, hint, max, found, i;
+	double index_us, scan_us;
+	int ch, nops = 20000, nfinds = 2000, nreplays = 5, failed;
+	unsigned int seed = 1;
+
+	while ((ch = getopt(argc, argv, "b:f:n:o:r:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			nblocks = (u_int32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			in = optarg;
+			break;
+		case 'n':
+			nops = atoi(optarg);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'r':
+			nreplays = atoi(optarg);
+			break;
+		case 's':
+			seed = (unsigned int)strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nblocks < 4096 || nops <= 0 || nreplays <= 0)
+		usage(argv[0]);
+	nblocks = roundup(nblocks, 64);
+	srandom(seed);
+
+	if (in != NULL) {
+		trace_read(in);
+	} else {
+		generate(nops);
+		if (out != NULL)
+			trace_write(out);
+	}
+	if (ntrace == 0) {
+		fprintf(stderr, "empty trace\n");
+		return (1);
+	}
+
+	bitmap = calloc(nblocks / 8, 1);
+	ext_start = calloc(nallocs + 1, sizeof (u_int32_t));
+	ext_count = calloc(nallocs + 1, sizeof (u_int32_t));
+	hfs_free_index_init();
+	if (bitmap == NULL || ext_start == NULL || ext_count == NULL ||
+	    (failed = replay(&fip, REPLAY_CHECK)) < 0) {
+		perror("setup");
+		return (1);
+	}
+	printf("%u operations, %u allocations, %u extents, %llu of %u blocks "
+	    "free, %d failed\n", ntrace, nallocs, fip->fi_extents,
+	    (unsigned long long)fip->fi_free_blocks, nblocks, failed);
+	if (failed)
+		return (1);
+
+	/* Time the same requests against the index and the bitmap */
+	nolimits.fel_exclude_start = nolimits.fel_exclude_end = 0;
+	nolimits.fel_alloc_limit = nblocks;
+	index_us = scan_us = 0;
+	for (i = 0; i < (u_int32_t)nfinds; i++) {
+		hint = (u_int32_t)random() % nblocks;
+		max = 16 << (random() % 6);	/* 16 to 512 blocks */
+
+		gettimeofday(&t0, NULL);
+		(void) hfs_free_index_find(fip, hint, max, max, &nolimits,
+		    &start, &count);
+		gettimeofday(&t1, NULL);
+		index_us += elapsed_us(&t0, &t1);
+
+		gettimeofday(&t0, NULL);
+		(void) scan_find(hint, max, &found);
+		gettimeofday(&t1, NULL);
+		scan_us += elapsed_us(&t0, &t1);
+	}
+	printf("%d contiguous allocations of 16-512 blocks: index %.2f us, "
+	    "bitmap scan %.2f us each\n", nfinds, index_us / nfinds,
+	    scan_us / nfinds);
+
+	/* Then the whole trace, with and without the index */
+	gettimeofday(&t0, NULL);
+	for (i = 0; i < (u_int32_t)nreplays; i++) {
+		if (replay(&fip, REPLAY_INDEX) != 0) {
+			fprintf(stderr, "replay against the index failed\n");
+			return (1);
+		}
+	}
+	gettimeofday(&t1, NULL);
+	index_us = elapsed_us(&t0, &t1);
+	gettimeofday(&t0, NULL);
+	for (i = 0; i < (u_int32_t)nreplays; i++)
+		(void) replay(&fip, REPLAY_SCAN);
+	gettimeofday(&t1, NULL);
+	scan_us = elapsed_us(&t0, &t1);
+	printf("trace replayed %d times: index %.2f us, bitmap scan %.2f us "
+	    "per operation\n", nreplays, index_us / nreplays / ntrace,
+	    scan_us / nreplays / ntrace);
+
+	hfs_free_index_destroy(fip);
+	free(bitmap);
+	free(ext_start);
+	free(ext_count);
+	free(trace);
+	return (0);
+}
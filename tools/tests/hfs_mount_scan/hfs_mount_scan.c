@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+/*
+ * Mount-time bitmap scan benchmark.
+ *
+ * Creates a large journaled HFS+ volume in a sparse disk image and
+ * mounts it once for each vfs.generic.hfs.scan_threads setting given.
+ * The allocation bitmap is scanned by a thread started at mount, which
+ * holds the bitmap lock until it is done, so the first allocation on the
+ * new mount completes when the scan does.  For each mount the test
+ * reports how long mount(8) took and how long after it started the
+ * first allocation completed.
+ *
+ * The HFSDBG_UNMAP_SCAN_RANGE and HFSDBG_UNMAP_SCAN_STATS kdebug events
+ * are traced during each mount, which gives the kernel's own breakdown:
+ * read and scan time per slice, total scan time and unmap time.
+ *
+ * With -f, part of the bitmap is marked allocated in a random pattern
+ * before the first mount, so the scan finds many small free extents.
+ * Bits are only ever set, never cleared, so no block in use can appear
+ * free.
+ *
+ * usage: hfs_mount_scan [-f] [-s size] [-t threads,...]
+ *
+ * Must be run as root.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libkern/OSByteOrder.h>
+#include <mach/mach_time.h>
+#include <sys/kdebug.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+
+/* big-endian HFS+ volume header offsets */
+#define VH_OFFSET		1024
+#define VH_BLOCK_SIZE		40
+#define VH_TOTAL_BLOCKS		44
+#define VH_ALLOC_EXTENT		(112 + 16)	/* allocationFile.extents[0] */
+
+/* from bsd/hfs/hfs_kdebug.h and VolumeAllocation.c */
+#define DBG_HFS			8
+#define HFSDBG_UNMAP_SCAN_RANGE	FSDBG_CODE(DBG_HFS, 25)
+#define HFSDBG_UNMAP_SCAN_STATS	FSDBG_CODE(DBG_HFS, 26)
+#define HFSDBG_UNMAP_ENABLED	4
+
+#define TRACE_EVENTS		100000
+#define MAX_RUNS		16
+
+static char	dir[] = "/tmp/hfs_mount_scan.XXXXXX";
+static char	image[MAXPATHLEN];
+static char	disk[MAXPATHLEN];
+static char	mntpt[MAXPATHLEN];
+static kd_buf	*trace;
+
+static int
+run(const char *cmd, char *out, size_t outlen)
+{
+	FILE *fp;
+	int status;
+
+	if ((fp = popen(cmd, "r")) == NULL) {
+		perror(cmd);
+		return (-1);
+	}
+	if (out != NULL) {
+		if (fgets(out, outlen, fp) == NULL)
+			out[0] = '\0';
+		out[strcspn(out, " \t\n")] = '\0';
+	}
+	status = pclose(fp);
+	if (status != 0) {
+		fprintf(stderr, "'%s' failed (status %d)\n", cmd, status);
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+kdebug_ctl(int op, int value, void *buf, size_t *len)
+{
+	int mib[4] = { CTL_KERN, KERN_KDEBUG, op, value };
+
+	if (sysctl(mib, 4, buf, len, NULL, 0) < 0) {
+		perror("kdebug sysctl");
+		return (-1);
+	}
+	return (0);
+}
+
+/* Trace HFS events only, into a buffer of TRACE_EVENTS */
+static int
+trace_start(void)
+{
+	kd_regtype kr;
+	size_t len;
+
+	len = 0;
+	(void) kdebug_ctl(KERN_KDREMOVE, 0, NULL, &len);
+	len = 0;
+	if (kdebug_ctl(KERN_KDSETBUF, TRACE_EVENTS, NULL, &len) != 0 ||
+	    kdebug_ctl(KERN_KDSETUP, 0, NULL, &len) != 0)
+		return (-1);
+	memset(&kr, 0, sizeof (kr));
+	kr.type = KDBG_SUBCLSTYPE;
+	kr.value1 = DBG_FSYSTEM;
+	kr.value2 = DBG_HFS;
+	len = sizeof (kr);
+	if (kdebug_ctl(KERN_KDSETREG, 0, &kr, &len) != 0)
+		return (-1);
+	len = 0;
+	return (kdebug_ctl(KERN_KDENABLE, 1, NULL, &len));
+}
+
+/* Stop tracing and print the scan events collected */
+static void
+trace_report(void)
+{
+	size_t len = 0, n, i;
+	double read_ms = 0, scan_ms = 0;
+	int ranges = 0;
+
+	(void) kdebug_ctl(KERN_KDENABLE, 0, NULL, &len);
+	len = TRACE_EVENTS * sizeof (kd_buf);
+	if (kdebug_ctl(KERN_KDREADTR, 0, trace, &len) != 0)
+		return;
+	n = len;
+	len = 0;
+	(void) kdebug_ctl(KERN_KDREMOVE, 0, NULL, &len);
+
+	for (i = 0; i < n; i++) {
+		kd_buf *kd = &trace[i];
+
+		switch (kd->debugid) {
+		case HFSDBG_UNMAP_SCAN_RANGE | DBG_FUNC_END:
+			/* error, free extents, read usecs, scan usecs */
+			ranges++;
+			read_ms = MAX(read_ms, kd->arg3 / 1000.0);
+			scan_ms = MAX(scan_ms, kd->arg4 / 1000.0);
+			break;
+		case HFSDBG_UNMAP_SCAN_STATS:
+			/* dev, threads, scan usecs, unmap usecs, extents */
+			printf("    kdebug: %d slices (slowest read %.1f ms, "
+			    "scan %.1f ms), scan %.1f ms, unmap %.1f ms, "
+			    "%lu free extents\n", ranges, read_ms, scan_ms,
+			    kd->arg3 / 1000.0, kd->arg4 / 1000.0,
+			    (unsigned long)kd->arg5);
+			break;
+		}
+	}
+}
+
+/*
+ * Mark a random part of the middle of the bitmap allocated.  Bits are
+ * only ever set.
+ */
+static int
+fragment(void)
+{
+	char rdisk[MAXPATHLEN];
+	uint8_t vh[512], *bitmap;
+	uint32_t block_size, start, count;
+	size_t len, i;
+	int fd, error = -1;
+
+	snprintf(rdisk, sizeof (rdisk), "/dev/r%s", disk + strlen("/dev/"));
+	if ((fd = open(rdisk, O_RDWR)) < 0) {
+		perror(rdisk);
+		return (-1);
+	}
+	if (pread(fd, vh, sizeof (vh), VH_OFFSET) != sizeof (vh)) {
+		perror("pread");
+		goto out;
+	}
+	block_size = OSReadBigInt32(vh, VH_BLOCK_SIZE);
+	start = OSReadBigInt32(vh, VH_ALLOC_EXTENT);
+	count = OSReadBigInt32(vh, VH_ALLOC_EXTENT + 4);
+	len = (size_t)count * block_size;
+	if ((bitmap = malloc(len)) == NULL) {
+		perror("malloc");
+		goto out;
+	}
+	if (pread(fd, bitmap, len, (off_t)start * block_size) != (ssize_t)len) {
+		perror("pread");
+		goto free;
+	}
+	/* about a quarter of the blocks in the middle half */
+	srandom(1);
+	for (i = len / 4; i < len * 3 / 4; i++)
+		bitmap[i] |= (uint8_t)(random() & random());
+	if (pwrite(fd, bitmap, len, (off_t)start * block_size) !=
+	    (ssize_t)len) {
+		perror("pwrite");
+		goto free;
+	}
+	error = 0;
+free:
+	free(bitmap);
+out:
+	close(fd);
+	return (error);
+}
+
+/*
+ * Mount with the given number of scan threads and time the mount and
+ * the first allocation.
+ */
+static int
+mount_once(int threads, int quiet)
+{
+	mach_timebase_info_data_t tb;
+	char cmd[2 * MAXPATHLEN], path[MAXPATHLEN];
+	uint64_t t0, t1, t2;
+	fstore_t fst;
+	size_t len = sizeof (threads);
+	int fd, error = -1, traced;
+
+	if (sysctlbyname("vfs.generic.hfs.scan_threads", NULL, NULL,
+	    &threads, len) < 0) {
+		perror("vfs.generic.hfs.scan_threads");
+		return (-1);
+	}
+	traced = !quiet && trace_start() == 0;
+
+	snprintf(cmd, sizeof (cmd), "mount -t hfs %s %s", disk, mntpt);
+	t0 = mach_absolute_time();
+	if (run(cmd, NULL, 0) != 0)
+		goto out;
+	t1 = mach_absolute_time();
+
+	snprintf(path, sizeof (path), "%s/alloc", mntpt);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror(path);
+	} else {
+		memset(&fst, 0, sizeof (fst));
+		fst.fst_flags = F_ALLOCATEALL;
+		fst.fst_posmode = F_PEOFPOSMODE;
+		fst.fst_length = 1024 * 1024;
+		if (fcntl(fd, F_PREALLOCATE, &fst) < 0)
+			perror("F_PREALLOCATE");
+		else
+			error = 0;
+		close(fd);
+		(void) unlink(path);
+	}
+	t2 = mach_absolute_time();
+
+	snprintf(cmd, sizeof (cmd), "umount %s", mntpt);
+	if (run(cmd, NULL, 0) != 0)
+		error = -1;
+
+	if (error == 0 && !quiet) {
+		mach_timebase_info(&tb);
+		printf("scan_threads %d: mount %.1f ms, first allocation "
+		    "after %.1f ms\n", threads,
+		    (t1 - t0) * tb.numer / tb.denom / 1e6,
+		    (t2 - t0) * tb.numer / tb.denom / 1e6);
+	}
+out:
+	if (traced) {
+		if (error == 0)
+			trace_report();
+		else
+			(void) kdebug_ctl(KERN_KDREMOVE, 0, NULL, &len);
+	}
+	return (error);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-f] [-s size] [-t threads,...]\n", prog);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char cmd[2 * MAXPATHLEN], deflist[] = "1,2,4,8", *list = deflist;
+	char *size = "1t", *t;
+	int threads[MAX_RUNS], nruns = 0, i;
+	int ch, frag = 0, error = 1, oldthreads, alloc, oldalloc;
+	size_t len;
+
+	while ((ch = getopt(argc, argv, "fs:t:")) != -1) {
+		switch (ch) {
+		case 'f':
+			frag = 1;
+			break;
+		case 's':
+			size = optarg;
+			break;
+		case 't':
+			list = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	for (t = strtok(list, ","); t != NULL; t = strtok(NULL, ",")) {
+		if (nruns == MAX_RUNS || (threads[nruns++] = atoi(t)) <= 0)
+			usage(argv[0]);
+	}
+	if (geteuid() != 0) {
+		fprintf(stderr, "%s must be run as root\n", argv[0]);
+		return (1);
+	}
+
+	len = sizeof (oldthreads);
+	if (sysctlbyname("vfs.generic.hfs.scan_threads", &oldthreads, &len,
+	    NULL, 0) < 0) {
+		perror("vfs.generic.hfs.scan_threads");
+		return (1);
+	}
+	len = sizeof (oldalloc);
+	if (sysctlbyname("vfs.generic.hfs.kdebug.allocation", &oldalloc, &len,
+	    NULL, 0) < 0) {
+		perror("vfs.generic.hfs.kdebug.allocation");
+		return (1);
+	}
+	alloc = oldalloc | HFSDBG_UNMAP_ENABLED;
+	(void) sysctlbyname("vfs.generic.hfs.kdebug.allocation", NULL, NULL,
+	    &alloc, sizeof (alloc));
+	if ((trace = malloc(TRACE_EVENTS * sizeof (kd_buf))) == NULL) {
+		perror("malloc");
+		goto restore;
+	}
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		goto restore;
+	}
+	snprintf(image, sizeof (image), "%s/scan.sparseimage", dir);
+	snprintf(mntpt, sizeof (mntpt), "%s/mnt", dir);
+	if (mkdir(mntpt, 0755) < 0) {
+		perror(mntpt);
+		goto rmdir;
+	}
+	snprintf(cmd, sizeof (cmd), "hdiutil create -quiet -size %s "
+	    "-type SPARSE -layout NONE -fs 'Journaled HFS+' "
+	    "-volname hfs_mount_scan %s", size, image);
+	if (run(cmd, NULL, 0) != 0)
+		goto rmdir;
+	snprintf(cmd, sizeof (cmd), "hdiutil attach -nomount %s", image);
+	if (run(cmd, disk, sizeof (disk)) != 0 || disk[0] == '\0')
+		goto unlink;
+
+	if (frag && fragment() != 0)
+		goto detach;
+
+	/* The first mount pulls the bitmap into the cache; don't report it */
+	if (mount_once(oldthreads, 1) != 0)
+		goto detach;
+	for (i = 0; i < nruns; i++) {
+		if (mount_once(threads[i], 0) != 0)
+			goto detach;
+	}
+	error = 0;
+
+detach:
+	snprintf(cmd, sizeof (cmd), "hdiutil detach %s", disk);
+	(void) run(cmd, NULL, 0);
+unlink:
+	(void) unlink(image);
+rmdir:
+	(void) rmdir(mntpt);
+	(void) rmdir(dir);
+restore:
+	(void) sysctlbyname("vfs.generic.hfs.scan_threads", NULL, NULL,
+	    &oldthreads, sizeof (oldthreads));
+	(void) sysctlbyname("vfs.generic.hfs.kdebug.allocation", NULL, NULL,
+	    &oldalloc, sizeof (oldalloc));
+	free(trace);
+	if (error)
+		printf("hfs_mount_scan: FAIL\n");
+	return (error);
+}
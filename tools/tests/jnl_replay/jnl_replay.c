@@ -0,0 +1,484 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Synthetic journal replay test.
+ *
+ * Creates a journaled HFS+ volume on a RAM disk, writes a hand-built set
+ * of transactions into its journal and marks the journal dirty, then
+ * mounts the volume so the kernel replays it.  The target blocks are
+ * read back from the raw device and compared with the result of applying
+ * the same transactions in order in memory.  The transactions overlap,
+ * abut and scatter so that the coalesce tree, the merging of adjacent
+ * blocks into one write and the limit on writes in flight all get used.
+ *
+ * With -b nblocks, the journal instead holds nblocks single-block writes
+ * to random places in a region twice that size, in transactions as large
+ * as a block list header allows, and the time the mount takes to replay
+ * it is reported.  Run it on kernels with and without a replay change to
+ * compare them; the kernel logs its own replay time as well.
+ *
+ * Must be run as root.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libkern/OSByteOrder.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+/* on-disk layout, from bsd/vfs/vfs_journal.h */
+#define JOURNAL_HEADER_MAGIC	0x4a4e4c78
+#define ENDIAN_MAGIC		0x12345678
+#define BLHDR_CHECKSUM_SIZE	32
+#define BLHDR_FIRST_HEADER	0x0002
+
+typedef struct block_info {
+	off_t		bnum;
+	int32_t		bsize;
+	uint32_t	sequence_num;
+} __attribute__((__packed__)) block_info;
+
+typedef struct block_list_header {
+	uint16_t	max_blocks;
+	uint16_t	num_blocks;
+	int32_t		bytes_used;
+	uint32_t	checksum;
+	int32_t		flags;
+	block_info	binfo[1];
+} block_list_header;
+
+typedef struct journal_header {
+	int32_t		magic;
+	int32_t		endian;
+	off_t		start;
+	off_t		end;
+	off_t		size;
+	int32_t		blhdr_size;
+	uint32_t	checksum;
+	int32_t		jhdr_size;
+	uint32_t	sequence_num;
+} journal_header;
+
+#define JOURNAL_HEADER_CKSUM_SIZE	(offsetof(journal_header, sequence_num))
+
+/* big-endian HFS+ volume header and journal info block offsets */
+#define VH_OFFSET		1024
+#define VH_JIB_BLOCK		12
+#define VH_BLOCK_SIZE		40
+#define VH_TOTAL_BLOCKS		44
+#define JIB_OFFSET		36
+
+#define RAMDISK_SECTORS		(128 * 1024)	/* 64MB */
+#define BENCH_RAMDISK_SECTORS	(2 * 1024 * 1024)	/* 1GB */
+#define BENCH_JOURNAL_SIZE	"256m"
+#define FILL_BYTE		0xee
+
+/*
+ * One journaled block write.  first and count are in journal blocks
+ * (jhdr_size units) relative to the start of the target region.
+ */
+struct jblk {
+	int	first;
+	int	count;
+};
+
+struct txn {
+	int		nblocks;
+	struct jblk	*blocks;
+};
+
+static struct jblk txn1_blocks[] = {
+	{ 0, 16 },	/* a run */
+	{ 32, 8 },	/* a separate run */
+	{ 64, 1 },
+};
+
+static struct jblk txn2_blocks[] = {
+	{ 4, 4 },	/* overwrites the middle of txn1's first run */
+	{ 16, 4 },	/* abuts it */
+	{ 30, 4 },	/* straddles the start of txn1's second run */
+	{ 64, 1 },	/* replaces a whole block */
+	{ 4, 2 },	/* overwrites a block from earlier in this txn */
+};
+
+#define TXN3_NBLOCKS	100
+static struct jblk txn3_blocks[TXN3_NBLOCKS];	/* scattered, filled in main */
+
+static struct txn test_txns[] = {
+	{ sizeof (txn1_blocks) / sizeof (txn1_blocks[0]), txn1_blocks },
+	{ sizeof (txn2_blocks) / sizeof (txn2_blocks[0]), txn2_blocks },
+	{ TXN3_NBLOCKS, txn3_blocks },
+};
+
+static struct txn	*txns = test_txns;
+static int		ntxns = sizeof (test_txns) / sizeof (test_txns[0]);
+static int		bench_blocks;	/* -b */
+
+static char	disk[MAXPATHLEN];
+static char	rdisk[MAXPATHLEN];
+static char	mntpt[] = "/tmp/jnl_replay.XXXXXX";
+
+static uint32_t
+calc_checksum(const char *ptr, int len)
+{
+	uint32_t cksum = 0;
+	int i;
+
+	for (i = 0; i < len; i++, ptr++)
+		cksum = (cksum << 8) ^ (cksum + *(const unsigned char *)ptr);
+
+	return (~cksum);
+}
+
+static int
+run(const char *cmd, char *out, size_t outlen)
+{
+	FILE *fp;
+	int status;
+
+	if ((fp = popen(cmd, "r")) == NULL) {
+		perror(cmd);
+		return (-1);
+	}
+	if (out != NULL) {
+		if (fgets(out, outlen, fp) == NULL)
+			out[0] = '\0';
+		out[strcspn(out, " \t\n")] = '\0';
+	}
+	status = pclose(fp);
+	if (status != 0) {
+		fprintf(stderr, "'%s' failed (status %d)\n", cmd, status);
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+pread_full(int fd, void *buf, size_t len, off_t off)
+{
+	if (pread(fd, buf, len, off) != (ssize_t)len) {
+		perror("pread");
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+	if (pwrite(fd, buf, len, off) != (ssize_t)len) {
+		perror("pwrite");
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Fill one journal block with a pattern naming the transaction and the
+ * block it was written to, so misplaced or stale data is easy to spot.
+ */
+static void
+pattern(char *buf, int jhdr_size, int txn, int blk)
+{
+	int i;
+
+	for (i = 0; i < jhdr_size; i++)
+		buf[i] = (char)((txn * 37) ^ (blk * 11) ^ i);
+}
+
+/*
+ * Spread bench_blocks single-block writes at random over a region of
+ * region_blocks, at most per_txn of them to a transaction.  Random order
+ * is the worst case for building the replay's block map.
+ */
+static int
+bench_txns(int region_blocks, int per_txn)
+{
+	struct jblk *jb;
+	int i;
+
+	ntxns = (bench_blocks + per_txn - 1) / per_txn;
+	txns = calloc(ntxns, sizeof (*txns));
+	jb = calloc(bench_blocks, sizeof (*jb));
+	if (txns == NULL || jb == NULL) {
+		perror("calloc");
+		return (-1);
+	}
+	srandom(1);
+	for (i = 0; i < bench_blocks; i++) {
+		jb[i].first = (int)(random() % region_blocks);
+		jb[i].count = 1;
+	}
+	for (i = 0; i < ntxns; i++) {
+		txns[i].blocks = jb + i * per_txn;
+		txns[i].nblocks = MIN(per_txn, bench_blocks - i * per_txn);
+	}
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	journal_header jhdr;
+	block_list_header *blhdr;
+	char cmd[2 * MAXPATHLEN], *region = NULL, *expect = NULL, *buf = NULL;
+	uint8_t vh[512], jib[512], jsect[512];
+	uint32_t block_size, total_blocks, jib_block;
+	off_t jnl_off, target, joff;
+	int fd = -1, error = 1, mounted = 0, region_blocks;
+	int jhdr_size, t, i, j, k, ch, nblocks;
+	uint32_t seq;
+	struct timeval start, end;
+	double ms;
+
+	while ((ch = getopt(argc, argv, "b:")) != -1) {
+		switch (ch) {
+		case 'b':
+			bench_blocks = atoi(optarg);
+			if (bench_blocks > 0)
+				break;
+			/* FALLTHROUGH */
+		default:
+			fprintf(stderr, "usage: %s [-b nblocks]\n", argv[0]);
+			return (1);
+		}
+	}
+
+	if (geteuid() != 0) {
+		fprintf(stderr, "%s must be run as root\n", argv[0]);
+		return (1);
+	}
+
+	for (i = 0; i < TXN3_NBLOCKS; i++) {
+		txn3_blocks[i].first = 80 + 2 * i;
+		txn3_blocks[i].count = 1;
+	}
+
+	snprintf(cmd, sizeof (cmd), "hdiutil attach -nomount ram://%d",
+	    bench_blocks ? BENCH_RAMDISK_SECTORS : RAMDISK_SECTORS);
+	if (run(cmd, disk, sizeof (disk)) != 0 || disk[0] == '\0')
+		return (1);
+	snprintf(rdisk, sizeof (rdisk), "/dev/r%s", disk + strlen("/dev/"));
+
+	snprintf(cmd, sizeof (cmd), "newfs_hfs -J %s -v jnl_replay %s",
+	    bench_blocks ? BENCH_JOURNAL_SIZE : "", disk);
+	if (run(cmd, NULL, 0) != 0)
+		goto out;
+
+	if ((fd = open(rdisk, O_RDWR)) < 0) {
+		perror(rdisk);
+		goto out;
+	}
+
+	if (pread_full(fd, vh, sizeof (vh), VH_OFFSET) != 0)
+		goto out;
+	block_size = OSReadBigInt32(vh, VH_BLOCK_SIZE);
+	total_blocks = OSReadBigInt32(vh, VH_TOTAL_BLOCKS);
+	jib_block = OSReadBigInt32(vh, VH_JIB_BLOCK);
+	if (jib_block == 0) {
+		fprintf(stderr, "volume is not journaled\n");
+		goto out;
+	}
+	if (pread_full(fd, jib, sizeof (jib),
+	    (off_t)jib_block * block_size) != 0)
+		goto out;
+	jnl_off = OSReadBigInt64(jib, JIB_OFFSET);
+	/* the raw device only does whole-sector i/o */
+	if (pread_full(fd, jsect, sizeof (jsect), jnl_off) != 0)
+		goto out;
+	memcpy(&jhdr, jsect, sizeof (jhdr));
+	if (jhdr.magic != JOURNAL_HEADER_MAGIC || jhdr.endian != ENDIAN_MAGIC) {
+		fprintf(stderr, "unexpected journal header (magic 0x%x)\n",
+		    jhdr.magic);
+		goto out;
+	}
+	jhdr_size = jhdr.jhdr_size;
+
+	/* a free area three quarters of the way into the volume */
+	target = ((off_t)total_blocks * 3 / 4) * block_size;
+	region_blocks = 80 + 2 * TXN3_NBLOCKS;
+	if (bench_blocks) {
+		region_blocks = 2 * bench_blocks;
+		if (target + (off_t)region_blocks * jhdr_size >
+		    (off_t)total_blocks * block_size) {
+			fprintf(stderr, "volume too small for %d blocks\n",
+			    bench_blocks);
+			goto out;
+		}
+		if (bench_txns(region_blocks, MIN(1000,
+		    (int)(jhdr.blhdr_size / sizeof (block_info)) - 1)) != 0)
+			goto out;
+	}
+	region = malloc(region_blocks * jhdr_size);
+	expect = malloc(region_blocks * jhdr_size);
+	buf = malloc(jhdr.blhdr_size);
+	if (region == NULL || expect == NULL || buf == NULL) {
+		perror("malloc");
+		goto out;
+	}
+	memset(expect, FILL_BYTE, region_blocks * jhdr_size);
+	if (pwrite_full(fd, expect, region_blocks * jhdr_size, target) != 0)
+		goto out;
+
+	/*
+	 * Lay the transactions out back to back right after the journal
+	 * header, and apply each one to the expected image as we go.
+	 */
+	joff = jhdr_size;
+	jhdr.start = joff;
+	seq = jhdr.sequence_num;
+	nblocks = 0;
+	for (t = 0; t < ntxns; t++) {
+		off_t dataoff;
+
+		memset(buf, 0, jhdr.blhdr_size);
+		blhdr = (block_list_header *)buf;
+		blhdr->max_blocks = (jhdr.blhdr_size / sizeof (block_info)) - 1;
+		blhdr->num_blocks = txns[t].nblocks + 1;
+		blhdr->bytes_used = jhdr.blhdr_size;
+		blhdr->flags = BLHDR_FIRST_HEADER;
+		blhdr->binfo[0].sequence_num = ++seq;
+
+		dataoff = joff + jhdr.blhdr_size;
+		for (i = 0; i < txns[t].nblocks; i++) {
+			struct jblk *jb = &txns[t].blocks[i];
+			char *data = malloc(jb->count * jhdr_size);
+
+			if (data == NULL) {
+				perror("malloc");
+				goto out;
+			}
+			for (k = 0; k < jb->count; k++) {
+				j = jb->first + k;
+				pattern(data + k * jhdr_size, jhdr_size,
+				    t + 1, j);
+				memcpy(expect + j * jhdr_size,
+				    data + k * jhdr_size, jhdr_size);
+			}
+			blhdr->binfo[i + 1].bnum =
+			    target / jhdr_size + jb->first;
+			blhdr->binfo[i + 1].bsize = jb->count * jhdr_size;
+			if (pwrite_full(fd, data, jb->count * jhdr_size,
+			    jnl_off + dataoff) != 0) {
+				free(data);
+				goto out;
+			}
+			free(data);
+			dataoff += jb->count * jhdr_size;
+			blhdr->bytes_used += jb->count * jhdr_size;
+			nblocks += jb->count;
+		}
+		if (dataoff >= jhdr.size) {
+			fprintf(stderr, "journal too small for test\n");
+			goto out;
+		}
+		blhdr->checksum = 0;
+		blhdr->checksum = calc_checksum(buf, BLHDR_CHECKSUM_SIZE);
+		if (pwrite_full(fd, buf, jhdr.blhdr_size, jnl_off + joff) != 0)
+			goto out;
+		joff = dataoff;
+	}
+
+	/* make sure replay stops at our end instead of running on */
+	memset(buf, 0, jhdr.blhdr_size);
+	if (joff + jhdr.blhdr_size <= jhdr.size &&
+	    pwrite_full(fd, buf, jhdr.blhdr_size, jnl_off + joff) != 0)
+		goto out;
+
+	jhdr.end = joff;
+	jhdr.checksum = 0;
+	jhdr.checksum = calc_checksum((char *)&jhdr, JOURNAL_HEADER_CKSUM_SIZE);
+	memcpy(jsect, &jhdr, sizeof (jhdr));
+	if (pwrite_full(fd, jsect, sizeof (jsect), jnl_off) != 0)
+		goto out;
+	close(fd);
+	fd = -1;
+
+	/* mounting replays the journal */
+	if (mkdtemp(mntpt) == NULL) {
+		perror("mkdtemp");
+		goto out;
+	}
+	snprintf(cmd, sizeof (cmd), "mount -t hfs %s %s", disk, mntpt);
+	gettimeofday(&start, NULL);
+	if (run(cmd, NULL, 0) != 0)
+		goto out;
+	gettimeofday(&end, NULL);
+	mounted = 1;
+	ms = (end.tv_sec - start.tv_sec) * 1000.0 +
+	    (end.tv_usec - start.tv_usec) / 1000.0;
+	snprintf(cmd, sizeof (cmd), "umount %s", mntpt);
+	if (run(cmd, NULL, 0) != 0)
+		goto out;
+	mounted = 0;
+
+	if ((fd = open(rdisk, O_RDONLY)) < 0) {
+		perror(rdisk);
+		goto out;
+	}
+	if (pread_full(fd, region, region_blocks * jhdr_size, target) != 0)
+		goto out;
+	for (j = 0; j < region_blocks; j++) {
+		if (memcmp(region + j * jhdr_size, expect + j * jhdr_size,
+		    jhdr_size) != 0) {
+			fprintf(stderr, "block %d of the target region differs "
+			    "after replay\n", j);
+			goto out;
+		}
+	}
+	error = 0;
+	printf("jnl_replay: PASS (%d transactions, %d journal blocks)\n",
+	    ntxns, region_blocks);
+	if (bench_blocks)
+		printf("jnl_replay: replayed %d blocks in %.1f ms "
+		    "(%.0f blocks/s)\n", nblocks, ms, nblocks * 1000.0 / ms);
+
+out:
+	if (fd >= 0)
+		close(fd);
+	if (mounted) {
+		snprintf(cmd, sizeof (cmd), "umount -f %s", mntpt);
+		(void) run(cmd, NULL, 0);
+	}
+	(void) rmdir(mntpt);
+	snprintf(cmd, sizeof (cmd), "hdiutil detach %s", disk);
+	(void) run(cmd, NULL, 0);
+	free(region);
+	free(expect);
+	free(buf);
+	if (error)
+		printf("jnl_replay: FAIL\n");
+	return (error);
+}
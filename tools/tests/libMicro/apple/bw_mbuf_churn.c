@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2014 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * mbuf and cluster allocator churn.  Each thread (-T) owns an AF_UNIX
+ * datagram socket pair and, per iteration, sends a burst of -b datagrams
+ * of -s bytes and reads them back, so every datagram allocates an mbuf
+ * and a cluster on send and frees them on receive.  With -c, a forked
+ * consumer per thread reads the burst instead and acknowledges it, so
+ * buffers are allocated on one CPU and freed on another, which drives
+ * the per-CPU slab freelists through their cross-CPU rebalancing.
+ *
+ * Run with -T 1, 2, 4, ... to see how the allocator scales.  The result
+ * columns come from kern.ipc.mb_stat over the run: contended slab lock
+ * acquisitions per 1000 datagrams, summed over all classes, and the
+ * longest slab layer refill the kernel has recorded for any class, in
+ * usecs.
+ */
+
+#ifdef	__sun
+#pragma ident	"@(#)bw_mbuf_churn.c	1.0	14/10/14 Apple Inc."
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <sys/mbuf.h>
+#include <sys/wait.h>
+
+#include "../libmicro.h"
+
+typedef struct {
+	int	pid;
+	char	*buf;
+	int	sock;
+	int	peer;
+	int	initerr;
+} tsd_t;
+
+#define	MAXDGRAM	(16*1024)
+#define	MAXBURST	1024
+
+static int	optb = 64;
+static int	optc = 0;
+static int	opts = 2048;
+
+static long long	dgrams;
+static u_int64_t	contended0;
+
+static void	consumer(int sock, char *buf);
+
+/*
+ * Sum the contended slab lock acquisitions of all classes, and return
+ * the worst refill latency through *maxp.
+ */
+static u_int64_t
+get_contended(u_int32_t *maxp)
+{
+	mb_stat_t	*st;
+	size_t		len = 0;
+	u_int64_t	sum = 0;
+	u_int32_t	i;
+
+	*maxp = 0;
+	if (sysctlbyname("kern.ipc.mb_stat", NULL, &len, NULL, 0) == -1 ||
+	    (st = malloc(len)) == NULL)
+		return (0);
+	if (sysctlbyname("kern.ipc.mb_stat", st, &len, NULL, 0) == 0) {
+		for (i = 0; i < st->mbs_cnt; i++) {
+			sum += st->mbs_class[i].mbcl_slab_contended;
+			if (st->mbs_class[i].mbcl_refill_max > *maxp)
+				*maxp = st->mbs_class[i].mbcl_refill_max;
+		}
+	}
+	free(st);
+	return (sum);
+}
+
+int
+benchmark_init()
+{
+	(void) sprintf(lm_optstr, "b:cs:");
+
+	lm_tsdsize = sizeof (tsd_t);
+
+	(void) sprintf(lm_usage,
+	    "		[-b <datagrams per burst>]\n"
+	    "		[-c] (free the datagrams in a consumer process)\n"
+	    "		[-s <datagram size>]\n"
+	    "notes: measures mbuf allocator churn\n");
+
+	(void) sprintf(lm_header, "%8s %6s %10s %10s", "size", "cross",
+	    "cont/1k", "refillmax");
+
+	return (0);
+}
+
+int
+benchmark_optswitch(int opt, char *optarg)
+{
+	switch (opt) {
+	case 'b':
+		optb = atoi(optarg);
+		break;
+	case 'c':
+		optc = 1;
+		break;
+	case 's':
+		opts = sizetoint(optarg);
+		break;
+	default:
+		return (-1);
+	}
+	return (0);
+}
+
+int
+benchmark_initrun()
+{
+	u_int32_t	max;
+
+	if (opts <= 0 || opts > MAXDGRAM)
+		opts = MAXDGRAM;
+	if (optb <= 0 || optb > MAXBURST)
+		optb = MAXBURST;
+	dgrams = 0;
+	contended0 = get_contended(&max);
+	return (0);
+}
+
+int
+benchmark_initbatch(void *tsd)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+	int	sv[2], bufsize, pid;
+
+	ts->initerr = 0;
+	ts->pid = 0;
+	ts->sock = ts->peer = -1;
+	if (ts->buf == NULL && (ts->buf = malloc(MAXDGRAM)) == NULL) {
+		ts->initerr = 1;
+		return (0);
+	}
+	memset(ts->buf, 1, MAXDGRAM);
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == -1) {
+		perror("socketpair");
+		ts->initerr = 2;
+		return (0);
+	}
+	/* room for a whole burst, counting the mbuf headers */
+	bufsize = optb * (opts + 2 * MSIZE);
+	if (setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &bufsize,
+	    sizeof (bufsize)) == -1 ||
+	    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &bufsize,
+	    sizeof (bufsize)) == -1) {
+		perror("setsockopt");
+		ts->initerr = 3;
+		return (0);
+	}
+	ts->sock = sv[0];
+	ts->peer = sv[1];
+
+	if (!optc)
+		return (0);
+	/* the tsd is shared with the child, so only the parent sets pid */
+	switch (pid = fork()) {
+	case 0:
+		(void) close(sv[0]);
+		consumer(sv[1], ts->buf);
+		exit(0);
+		/*NOTREACHED*/
+	case -1:
+		perror("fork");
+		ts->initerr = 4;
+		return (0);
+	default:
+		ts->pid = pid;
+		break;
+	}
+	(void) close(ts->peer);
+	ts->peer = -1;
+	return (0);
+}
+
+int
+benchmark(void *tsd, result_t *res)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+	int	i, j;
+	char	ack;
+
+	if (ts->initerr) {
+		res->re_errors = lm_optB;
+		return (0);
+	}
+
+	for (i = 0; i < lm_optB; i++) {
+		for (j = 0; j < optb; j++) {
+			if (send(ts->sock, ts->buf, opts, 0) != opts) {
+				res->re_errors++;
+				return (0);
+			}
+		}
+		if (optc) {
+			if (recv(ts->sock, &ack, 1, 0) != 1) {
+				res->re_errors++;
+				return (0);
+			}
+		} else {
+			for (j = 0; j < optb; j++) {
+				if (recv(ts->peer, ts->buf, opts, 0) != opts) {
+					res->re_errors++;
+					return (0);
+				}
+			}
+		}
+		(void) __sync_fetch_and_add(&dgrams, optb);
+	}
+	res->re_count = i;
+
+	return (0);
+}
+
+int
+benchmark_finibatch(void *tsd)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+
+	(void) close(ts->sock);
+	if (ts->peer != -1)
+		(void) close(ts->peer);
+	if (ts->pid > 0) {
+		(void) kill(ts->pid, SIGKILL);
+		(void) waitpid(ts->pid, NULL, 0);
+	}
+	ts->pid = 0;
+	return (0);
+}
+
+char *
+benchmark_result()
+{
+	static char	result[256];
+	u_int64_t	contended;
+	u_int32_t	max;
+
+	contended = get_contended(&max) - contended0;
+
+	(void) sprintf(result, "%8d %6s %10.2f %10u", opts,
+	    optc ? "yes" : "no",
+	    dgrams ? 1000.0 * contended / dgrams : 0.0, max);
+
+	return (result);
+}
+
+static void
+consumer(int sock, char *buf)
+{
+	int	i;
+	char	ack = 0;
+
+	for (;;) {
+		for (i = 0; i < optb; i++) {
+			if (recv(sock, buf, opts, 0) <= 0)
+				exit(0);
+		}
+		if (send(sock, &ack, 1, 0) != 1)
+			exit(1);
+	}
+}
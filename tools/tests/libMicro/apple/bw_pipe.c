@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2014 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Pipe throughput.  Every worker (-P, -T) forks a writer process that
+ * sends it -s bytes down a pipe per operation, in writes of -m bytes,
+ * and reads them in reads of -r bytes.  Blocking writes of at least
+ * kern.ipc.pipe_mindirect bytes skip the pipe buffer and are copied by
+ * the reader straight from the writer's pages; the threshold is
+ * printed with the result, along with the throughput of all the
+ * workers together.
+ */
+
+#ifdef	__sun
+#pragma ident	"@(#)bw_pipe.c	1.0	14/10/14 Apple Inc."
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "../libmicro.h"
+
+typedef struct {
+	int		data;		/* read end of the data pipe */
+	int		control;	/* write end of the control pipe */
+	pid_t		pid;
+	char		*buf;
+	u_int64_t	bytes;
+	u_int64_t	first;		/* usecs, start of first batch */
+	u_int64_t	last;		/* usecs, end of last batch */
+	int		initerr;
+} tsd_t;
+
+static int	optm = 64 * 1024;
+static int	optr = 64 * 1024;
+static int	opts = 8 * 1024 * 1024;
+
+int
+benchmark_init()
+{
+	lm_defB = 10;
+	lm_tsdsize = sizeof (tsd_t);
+
+	(void) sprintf(lm_optstr, "m:r:s:");
+
+	(void) sprintf(lm_usage,
+	    "		[-m <write size>]\n"
+	    "		[-r <read size>]\n"
+	    "		[-s <bytes per operation>]\n"
+	    "notes: measures pipe throughput\n");
+
+	(void) sprintf(lm_header, "%8s %8s %8s %8s", "write", "read",
+	    "mindir", "MB/s");
+
+	return (0);
+}
+
+int
+benchmark_optswitch(int opt, char *optarg)
+{
+	switch (opt) {
+	case 'm':
+		optm = sizetoint(optarg);
+		break;
+	case 'r':
+		optr = sizetoint(optarg);
+		break;
+	case 's':
+		opts = sizetoint(optarg);
+		break;
+	default:
+		return (-1);
+	}
+	return (0);
+}
+
+int
+benchmark_initrun()
+{
+	if (optm <= 0 || optr <= 0 || opts <= 0) {
+		(void) printf("sizes must be positive\n");
+		return (-1);
+	}
+	(void) setfdlimit(4 * lm_optT + 10);
+	return (0);
+}
+
+static u_int64_t
+usecs(void)
+{
+	struct timeval	tv;
+
+	(void) gettimeofday(&tv, NULL);
+	return (tv.tv_sec * 1000000ULL + tv.tv_usec);
+}
+
+/*
+ * The writer: for every byte count that comes in on the control pipe,
+ * write that many bytes in optm sized writes.
+ */
+static void
+writer(int control, int data)
+{
+	char		*buf;
+	u_int64_t	todo;
+	ssize_t		n;
+	int		len;
+
+	if ((buf = valloc(optm)) == NULL)
+		_exit(1);
+	memset(buf, 'x', optm);
+	while (read(control, &todo, sizeof (todo)) == sizeof (todo)) {
+		while (todo > 0) {
+			len = todo < (u_int64_t)optm ? (int)todo : optm;
+			if ((n = write(data, buf, len)) <= 0)
+				_exit(1);
+			todo -= n;
+		}
+	}
+	_exit(0);
+}
+
+int
+benchmark_initworker(void *tsd)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+	int	data[2], control[2];
+	pid_t	pid;
+
+	ts->initerr = 0;
+	ts->pid = -1;
+	ts->data = ts->control = -1;
+	ts->bytes = ts->first = ts->last = 0;
+
+	if ((ts->buf = valloc(optr)) == NULL) {
+		perror("valloc");
+		ts->initerr = 1;
+		return (0);
+	}
+	if (pipe(data) == -1 || pipe(control) == -1) {
+		perror("pipe");
+		ts->initerr = 1;
+		return (0);
+	}
+	if ((pid = fork()) == 0) {
+		(void) close(data[0]);
+		(void) close(control[1]);
+		writer(control[0], data[1]);
+		/* NOTREACHED */
+	}
+	(void) close(data[1]);
+	(void) close(control[0]);
+	ts->data = data[0];
+	ts->control = control[1];
+	if (pid == -1) {
+		perror("fork");
+		ts->initerr = 1;
+		return (0);
+	}
+	ts->pid = pid;
+	return (0);
+}
+
+int
+benchmark(void *tsd, result_t *res)
+{
+	tsd_t		*ts = (tsd_t *)tsd;
+	u_int64_t	todo = opts;
+	u_int64_t	done;
+	ssize_t		n;
+	int		i;
+
+	if (ts->initerr) {
+		res->re_errors = lm_optB;
+		return (0);
+	}
+
+	if (ts->first == 0)
+		ts->first = usecs();
+	for (i = 0; i < lm_optB; i++) {
+		if (write(ts->control, &todo, sizeof (todo)) != sizeof (todo)) {
+			res->re_errors++;
+			continue;
+		}
+		for (done = 0; done < todo; done += n) {
+			if ((n = read(ts->data, ts->buf, optr)) <= 0) {
+				/* The writer is gone; so is the pipe */
+				res->re_errors += lm_optB - i;
+				ts->initerr = 1;
+				res->re_count = lm_optB;
+				return (0);
+			}
+		}
+		ts->bytes += done;
+	}
+	res->re_count = i;
+	ts->last = usecs();
+
+	return (0);
+}
+
+int
+benchmark_finiworker(void *tsd)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+
+	if (ts->control != -1)
+		(void) close(ts->control);
+	if (ts->data != -1)
+		(void) close(ts->data);
+	if (ts->pid > 0) {
+		(void) kill(ts->pid, SIGKILL);
+		(void) waitpid(ts->pid, NULL, 0);
+	}
+	return (0);
+}
+
+char *
+benchmark_result()
+{
+	static char	result[256];
+	u_int64_t	bytes = 0, first = 0, last = 0;
+	u_int32_t	mindirect;
+	size_t		len = sizeof (mindirect);
+	tsd_t		*ts;
+	int		p, t;
+
+	if (sysctlbyname("kern.ipc.pipe_mindirect", &mindirect, &len,
+	    NULL, 0) == -1)
+		mindirect = 0;
+
+	for (p = 0; p < lm_optP; p++) {
+		for (t = 0; t < lm_optT; t++) {
+			ts = (tsd_t *)gettsd(p, t);
+			bytes += ts->bytes;
+			if (ts->first != 0 && (first == 0 || ts->first < first))
+				first = ts->first;
+			if (ts->last > last)
+				last = ts->last;
+		}
+	}
+
+	(void) sprintf(result, "%8d %8d %8u %8.0f", optm, optr, mindirect,
+	    last > first ? (double)bytes / (last - first) : 0.0);
+
+	return (result);
+}
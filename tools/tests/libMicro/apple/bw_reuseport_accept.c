@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2014 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * TCP accept rate over SO_REUSEPORT listeners.  Every worker (-P, -T)
+ * owns a listener bound with SO_REUSEPORT to the same port on
+ * 127.0.0.1, drained by an accept thread of its own that closes each
+ * connection it accepts.  The worker itself connects to the port and
+ * waits for the close, so one operation is a connection accepted by
+ * whichever listener the kernel picked.
+ *
+ * The result columns give the number of listeners and how evenly the
+ * connections were spread over them: the least and the most any one
+ * listener accepted, as a percentage of the mean.
+ */
+
+#ifdef	__sun
+#pragma ident	"@(#)bw_reuseport_accept.c	1.0	14/10/14 Apple Inc."
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../libmicro.h"
+
+typedef struct {
+	int			ls;
+	volatile int		stop;
+	volatile u_int64_t	accepted;
+	pthread_t		thread;
+	int			initerr;
+} tsd_t;
+
+static struct sockaddr_in	addr;
+
+int
+benchmark_init()
+{
+	lm_defB = 100;
+	lm_tsdsize = sizeof (tsd_t);
+
+	(void) sprintf(lm_usage,
+	    "notes: measures accept() over SO_REUSEPORT listeners,\n"
+	    "       one per worker\n");
+
+	(void) sprintf(lm_header, "%9s %6s %6s", "listeners", "min%",
+	    "max%");
+
+	return (0);
+}
+
+int
+benchmark_initrun()
+{
+	socklen_t	len = sizeof (addr);
+	int		s;
+
+	(void) setfdlimit(4 * lm_optT + 10);
+
+	/* pick a free port for all the listeners */
+	memset(&addr, 0, sizeof (addr));
+	addr.sin_len = sizeof (addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	    bind(s, (struct sockaddr *)&addr, sizeof (addr)) == -1 ||
+	    getsockname(s, (struct sockaddr *)&addr, &len) == -1) {
+		perror("bind");
+		return (-1);
+	}
+	(void) close(s);
+	return (0);
+}
+
+static void *
+acceptor(void *arg)
+{
+	tsd_t		*ts = (tsd_t *)arg;
+	struct pollfd	pfd;
+	int		s;
+
+	pfd.fd = ts->ls;
+	pfd.events = POLLIN;
+	while (!ts->stop) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		while ((s = accept(ts->ls, NULL, NULL)) != -1) {
+			ts->accepted++;
+			(void) close(s);
+		}
+	}
+	return (NULL);
+}
+
+int
+benchmark_initworker(void *tsd)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+	int	on = 1;
+
+	ts->initerr = 0;
+	ts->stop = 0;
+	ts->accepted = 0;
+
+	if ((ts->ls = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	    setsockopt(ts->ls, SOL_SOCKET, SO_REUSEPORT, &on,
+	    sizeof (on)) == -1 ||
+	    bind(ts->ls, (struct sockaddr *)&addr, sizeof (addr)) == -1 ||
+	    listen(ts->ls, 128) == -1 ||
+	    fcntl(ts->ls, F_SETFL, O_NONBLOCK) == -1) {
+		perror("listen");
+		ts->initerr = 1;
+		return (0);
+	}
+	if (pthread_create(&ts->thread, NULL, acceptor, ts) != 0) {
+		perror("pthread_create");
+		ts->initerr = 1;
+	}
+	return (0);
+}
+
+int
+benchmark(void *tsd, result_t *res)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+	char	c;
+	int	i, s;
+
+	if (ts->initerr) {
+		res->re_errors = lm_optB;
+		return (0);
+	}
+
+	for (i = 0; i < lm_optB; i++) {
+		if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+			res->re_errors++;
+			continue;
+		}
+		/* the acceptor closes first, so the client leaves no TIME_WAIT */
+		if (connect(s, (struct sockaddr *)&addr, sizeof (addr)) == -1 ||
+		    read(s, &c, 1) != 0)
+			res->re_errors++;
+		(void) close(s);
+	}
+	res->re_count = i;
+
+	return (0);
+}
+
+int
+benchmark_finiworker(void *tsd)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+
+	if (ts->ls == -1)
+		return (0);
+	if (!ts->initerr) {
+		ts->stop = 1;
+		(void) pthread_join(ts->thread, NULL);
+	}
+	(void) close(ts->ls);
+	return (0);
+}
+
+char *
+benchmark_result()
+{
+	static char	result[256];
+	u_int64_t	n, min = 0, max = 0, sum = 0;
+	double		mean;
+	tsd_t		*ts;
+	int		p, t;
+
+	for (p = 0; p < lm_optP; p++) {
+		for (t = 0; t < lm_optT; t++) {
+			ts = (tsd_t *)gettsd(p, t);
+			n = ts->accepted;
+			if ((p == 0 && t == 0) || n < min)
+				min = n;
+			if (n > max)
+				max = n;
+			sum += n;
+		}
+	}
+	mean = (double)sum / (lm_optP * lm_optT);
+
+	(void) sprintf(result, "%9d %6.1f %6.1f", lm_optP * lm_optT,
+	    mean > 0 ? 100.0 * min / mean : 0.0,
+	    mean > 0 ? 100.0 * max / mean : 0.0);
+
+	return (result);
+}
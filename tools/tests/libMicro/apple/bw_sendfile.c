@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2014 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * sendfile() of a cached file over a loopback TCP connection.  Each
+ * iteration sends the whole -s byte file, which a forked reader drains
+ * in -m byte reads.
+ *
+ * Compare runs with kern.ipc.sendfile_zerocopy set to 0 (file data
+ * copied into mbuf clusters) and 1 (file pages attached to mbufs).
+ */
+
+#ifdef	__sun
+#pragma ident	"@(#)bw_sendfile.c	1.0	14/10/14 Apple Inc."
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../libmicro.h"
+
+#define	XFERSIZE	(64*1024)
+
+typedef struct {
+	int	pid;
+	int	sock;
+	int	initerr;
+} tsd_t;
+
+static int	optm = XFERSIZE;
+static long long opts = 8*1024*1024;
+static char	*optf = "/private/var/tmp/libmicro_sendfile";
+
+static int	filefd = -1;
+
+static void	reader(int sock, long long todo);
+
+int
+benchmark_init()
+{
+	(void) sprintf(lm_optstr, "f:m:s:");
+
+	lm_tsdsize = sizeof (tsd_t);
+
+	(void) sprintf(lm_usage,
+	    "		[-f <scratch file>]\n"
+	    "		[-m <read size>]\n"
+	    "		[-s <file size>]\n"
+	    "notes: measures sendfile() bandwidth over lo0\n");
+
+	(void) sprintf(lm_header, "%8s", "size");
+
+	return (0);
+}
+
+int
+benchmark_optswitch(int opt, char *optarg)
+{
+	switch (opt) {
+	case 'f':
+		optf = optarg;
+		break;
+	case 'm':
+		optm = sizetoint(optarg);
+		break;
+	case 's':
+		opts = sizetoll(optarg);
+		break;
+	default:
+		return (-1);
+	}
+	return (0);
+}
+
+int
+benchmark_initrun()
+{
+	char		*buf;
+	long long	done;
+
+	if (optm <= 0 || optm > XFERSIZE)
+		optm = XFERSIZE;
+
+	if ((buf = valloc(XFERSIZE)) == NULL)
+		return (1);
+	memset(buf, 'a', XFERSIZE);
+
+	/* Write the file once and read it back so that it is cached */
+	filefd = open(optf, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (filefd == -1) {
+		perror("open");
+		free(buf);
+		return (1);
+	}
+	for (done = 0; done < opts; done += XFERSIZE) {
+		if (write(filefd, buf, XFERSIZE) != XFERSIZE) {
+			perror("write");
+			free(buf);
+			return (1);
+		}
+	}
+	(void) lseek(filefd, 0, SEEK_SET);
+	while (read(filefd, buf, XFERSIZE) > 0)
+		;
+	free(buf);
+	opts = done;
+
+	return (0);
+}
+
+int
+benchmark_initbatch(void *tsd)
+{
+	tsd_t			*ts = (tsd_t *)tsd;
+	struct sockaddr_in	sin;
+	socklen_t		len = sizeof (sin);
+	int			lsock, rsock;
+
+	ts->initerr = 0;
+	ts->pid = 0;
+	ts->sock = -1;
+
+	memset(&sin, 0, sizeof (sin));
+	sin.sin_len = sizeof (sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((lsock = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	    bind(lsock, (struct sockaddr *)&sin, sizeof (sin)) == -1 ||
+	    getsockname(lsock, (struct sockaddr *)&sin, &len) == -1 ||
+	    listen(lsock, 1) == -1) {
+		perror("listen");
+		ts->initerr = 1;
+		return (0);
+	}
+	if ((rsock = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	    connect(rsock, (struct sockaddr *)&sin, sizeof (sin)) == -1 ||
+	    (ts->sock = accept(lsock, NULL, NULL)) == -1) {
+		perror("connect");
+		ts->initerr = 2;
+		return (0);
+	}
+	(void) close(lsock);
+
+	switch (ts->pid = fork()) {
+	case 0:
+		(void) close(ts->sock);
+		reader(rsock, opts * lm_optB);
+		exit(0);
+		/*NOTREACHED*/
+	case -1:
+		perror("fork");
+		ts->initerr = 3;
+		return (0);
+	default:
+		break;
+	}
+	(void) close(rsock);
+	return (0);
+}
+
+int
+benchmark(void *tsd, result_t *res)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+	off_t	off, len;
+	int	i;
+
+	if (ts->initerr) {
+		res->re_errors = lm_optB;
+		return (0);
+	}
+
+	for (i = 0; i < lm_optB; i++) {
+		for (off = 0; off < opts; off += len) {
+			len = opts - off;
+			if (sendfile(filefd, ts->sock, off, &len, NULL, 0) == -1 &&
+			    len == 0) {
+				res->re_errors++;
+				return (0);
+			}
+		}
+	}
+	res->re_count = i;
+
+	return (0);
+}
+
+int
+benchmark_finibatch(void *tsd)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+
+	(void) close(ts->sock);
+	if (ts->pid > 0) {
+		(void) kill(ts->pid, SIGKILL);
+		(void) waitpid(ts->pid, NULL, 0);
+	}
+	ts->pid = 0;
+	return (0);
+}
+
+int
+benchmark_finirun()
+{
+	if (filefd != -1) {
+		(void) close(filefd);
+		(void) unlink(optf);
+		filefd = -1;
+	}
+	return (0);
+}
+
+char *
+benchmark_result()
+{
+	static char	result[256];
+
+	(void) sprintf(result, "%8lld", opts);
+
+	return (result);
+}
+
+static void
+reader(int sock, long long todo)
+{
+	char		*buf;
+	long long	done;
+	ssize_t		n;
+
+	if ((buf = valloc(XFERSIZE)) == NULL)
+		exit(1);
+	for (done = 0; done < todo; done += n) {
+		if ((n = read(sock, buf, optm)) <= 0)
+			exit(1);
+	}
+}
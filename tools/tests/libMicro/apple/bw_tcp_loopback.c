@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2014 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * TCP bulk transfer over the loopback interface, in the style of
+ * lmbench_bw_unix.  A forked writer sends -s bytes per iteration to
+ * 127.0.0.1 in -m byte writes.
+ *
+ * The result columns give the CPU time (user and system, this process
+ * and the writer) spent per byte moved, and the number of segments the
+ * IP layer cut each software TSO packet into (net.inet.ip.gso); the
+ * latter is 0 when software TSO is off.
+ */
+
+#ifdef	__sun
+#pragma ident	"@(#)bw_tcp_loopback.c	1.0	14/10/14 Apple Inc."
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/ip_var.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../libmicro.h"
+
+#if DEBUG
+# define debug(fmt, args...)	(void) fprintf(stderr, fmt "\n" , ##args)
+#else
+# define debug(fmt, args...)
+#endif
+
+typedef struct {
+	int	pid;
+	char	*buf;
+	int	sock;
+	int	control[2];
+	int	initerr;
+} tsd_t;
+
+#define	XFERSIZE	(64*1024)
+
+static int	optm = XFERSIZE;
+static long long opts = 10*1024*1024;
+
+static long long	bytes_moved;
+static struct rusage	ru_self0, ru_child0;
+static struct ipstat	ips0;
+
+static void	writer(int controlfd, int writefd, char *buf);
+
+static void
+get_ipstat(struct ipstat *ips)
+{
+	size_t len = sizeof (*ips);
+
+	if (sysctlbyname("net.inet.ip.stats", ips, &len, NULL, 0) == -1)
+		memset(ips, 0, sizeof (*ips));
+}
+
+static long long
+ru_nsecs(struct rusage *ru)
+{
+	return ((ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000000LL +
+	    (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1000LL);
+}
+
+int
+benchmark_init()
+{
+	(void) sprintf(lm_optstr, "m:s:");
+
+	lm_tsdsize = sizeof (tsd_t);
+
+	(void) sprintf(lm_usage,
+	    "		[-m <message size>]\n"
+	    "		[-s <total bytes>]\n"
+	    "notes: measures TCP bandwidth over lo0\n");
+
+	(void) sprintf(lm_header, "%8s %10s %9s", "size", "ns/KB", "segs/pkt");
+
+	return (0);
+}
+
+int
+benchmark_optswitch(int opt, char *optarg)
+{
+	switch (opt) {
+	case 'm':
+		optm = sizetoint(optarg);
+		break;
+	case 's':
+		opts = sizetoll(optarg);
+		break;
+	default:
+		return (-1);
+	}
+	return (0);
+}
+
+int
+benchmark_initrun()
+{
+	if (optm <= 0 || optm > XFERSIZE)
+		optm = XFERSIZE;
+	bytes_moved = 0;
+	(void) getrusage(RUSAGE_SELF, &ru_self0);
+	(void) getrusage(RUSAGE_CHILDREN, &ru_child0);
+	get_ipstat(&ips0);
+	return (0);
+}
+
+int
+benchmark_initbatch(void *tsd)
+{
+	tsd_t			*ts = (tsd_t *)tsd;
+	struct sockaddr_in	sin;
+	socklen_t		len = sizeof (sin);
+	int			lsock, wsock, one = 1;
+
+	ts->initerr = 0;
+	ts->pid = 0;
+	ts->sock = -1;
+	if (ts->buf == NULL && (ts->buf = valloc(XFERSIZE)) == NULL) {
+		ts->initerr = 1;
+		return (0);
+	}
+	memset(ts->buf, 1, XFERSIZE);
+
+	memset(&sin, 0, sizeof (sin));
+	sin.sin_len = sizeof (sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((lsock = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	    bind(lsock, (struct sockaddr *)&sin, sizeof (sin)) == -1 ||
+	    getsockname(lsock, (struct sockaddr *)&sin, &len) == -1 ||
+	    listen(lsock, 1) == -1) {
+		perror("listen");
+		ts->initerr = 2;
+		return (0);
+	}
+	if ((wsock = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	    connect(wsock, (struct sockaddr *)&sin, sizeof (sin)) == -1 ||
+	    (ts->sock = accept(lsock, NULL, NULL)) == -1) {
+		perror("connect");
+		ts->initerr = 3;
+		return (0);
+	}
+	(void) close(lsock);
+	(void) setsockopt(wsock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+	if (pipe(ts->control) == -1) {
+		perror("pipe");
+		ts->initerr = 4;
+		return (0);
+	}
+	switch (ts->pid = fork()) {
+	case 0:
+		(void) close(ts->control[1]);
+		(void) close(ts->sock);
+		writer(ts->control[0], wsock, ts->buf);
+		exit(0);
+		/*NOTREACHED*/
+	case -1:
+		perror("fork");
+		ts->initerr = 5;
+		return (0);
+	default:
+		break;
+	}
+	(void) close(ts->control[0]);
+	(void) close(wsock);
+	return (0);
+}
+
+int
+benchmark(void *tsd, result_t *res)
+{
+	tsd_t		*ts = (tsd_t *)tsd;
+	long long	done, todo = opts;
+	ssize_t		n;
+	int		i;
+
+	if (ts->initerr) {
+		res->re_errors = lm_optB;
+		return (0);
+	}
+
+	for (i = 0; i < lm_optB; i++) {
+		if (write(ts->control[1], &todo, sizeof (todo)) !=
+		    sizeof (todo)) {
+			res->re_errors++;
+			break;
+		}
+		for (done = 0; done < todo; done += n) {
+			if ((n = read(ts->sock, ts->buf, optm)) <= 0) {
+				res->re_errors++;
+				return (0);
+			}
+		}
+		bytes_moved += done;
+	}
+	res->re_count = i;
+
+	return (0);
+}
+
+int
+benchmark_finibatch(void *tsd)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+
+	(void) close(ts->control[1]);
+	(void) close(ts->sock);
+	if (ts->pid > 0) {
+		(void) kill(ts->pid, SIGKILL);
+		(void) waitpid(ts->pid, NULL, 0);
+	}
+	ts->pid = 0;
+	return (0);
+}
+
+char *
+benchmark_result()
+{
+	static char	result[256];
+	struct rusage	ru_self, ru_child;
+	struct ipstat	ips;
+	long long	cpu;
+	double		segs = 0.0;
+
+	(void) getrusage(RUSAGE_SELF, &ru_self);
+	(void) getrusage(RUSAGE_CHILDREN, &ru_child);
+	get_ipstat(&ips);
+
+	cpu = ru_nsecs(&ru_self) - ru_nsecs(&ru_self0) +
+	    ru_nsecs(&ru_child) - ru_nsecs(&ru_child0);
+	if (ips.ips_gso != ips0.ips_gso)
+		segs = (double)(ips.ips_gso_segs - ips0.ips_gso_segs) /
+		    (ips.ips_gso - ips0.ips_gso);
+
+	(void) sprintf(result, "%8d %10.1f %9.2f", optm,
+	    bytes_moved ? (double)cpu * 1024 / bytes_moved : 0.0, segs);
+
+	return (result);
+}
+
+static void
+writer(int controlfd, int writefd, char *buf)
+{
+	long long	todo, done;
+	ssize_t		n;
+
+	for (;;) {
+		if (read(controlfd, &todo, sizeof (todo)) != sizeof (todo))
+			exit(0);
+		for (done = 0; done < todo; done += n) {
+			if ((n = write(writefd, buf, optm)) <= 0)
+				exit(1);
+		}
+	}
+}
@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2014 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * AF_UNIX stream bulk transfer, in the style of lmbench_bw_unix, with
+ * the writer's socket optionally marked LOCAL_SINGLECOPY (-c).  A forked
+ * writer sends -s bytes per iteration from a page-aligned buffer in -m
+ * byte writes, which the benchmark reads back in -m byte reads.
+ *
+ * Run with -m from 4k to 1m, with and without -c, to see where mapping
+ * the writer's pages copy on write beats copying them into mbufs.  With
+ * -c, soreceive() also maps the pages on into the reader's buffer where
+ * the two line up; -a reads into a buffer one byte past a page boundary
+ * instead, so that the receive side always copies.  The ns/KB column
+ * gives the CPU time (user and system, this process and the writer)
+ * spent per byte moved, and mapped% the share of the data received that
+ * was mapped rather than copied (kern.ipc.soreceive_mapped).
+ */
+
+#ifdef	__sun
+#pragma ident	"@(#)bw_unix_singlecopy.c	1.0	14/10/14 Apple Inc."
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../libmicro.h"
+
+#ifndef LOCAL_SINGLECOPY
+#define	LOCAL_SINGLECOPY	0x006
+#endif
+
+typedef struct {
+	int	pid;
+	char	*buf;
+	char	*rbuf;
+	int	sock;
+	int	control[2];
+	int	initerr;
+} tsd_t;
+
+#define	MAXXFER	(1024*1024)
+
+static int	opta = 0;
+static int	optc = 0;
+static int	optm = 64*1024;
+static long long opts = 16*1024*1024;
+
+static long long	bytes_moved;
+static struct rusage	ru_self0, ru_child0;
+static u_int64_t	mapped0;
+
+static void	writer(int controlfd, int writefd, char *buf);
+
+static u_int64_t
+get_mapped(void)
+{
+	u_int64_t	mapped;
+	size_t		len = sizeof (mapped);
+
+	if (sysctlbyname("kern.ipc.soreceive_mapped", &mapped, &len,
+	    NULL, 0) == -1)
+		mapped = 0;
+	return (mapped);
+}
+
+static long long
+ru_nsecs(struct rusage *ru)
+{
+	return ((ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000000LL +
+	    (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1000LL);
+}
+
+int
+benchmark_init()
+{
+	(void) sprintf(lm_optstr, "acm:s:");
+
+	lm_tsdsize = sizeof (tsd_t);
+
+	(void) sprintf(lm_usage,
+	    "		[-a] (misalign the reader's buffer)\n"
+	    "		[-c] (set LOCAL_SINGLECOPY on the writer)\n"
+	    "		[-m <message size>]\n"
+	    "		[-s <total bytes>]\n"
+	    "notes: measures AF_UNIX stream bandwidth\n");
+
+	(void) sprintf(lm_header, "%8s %6s %10s %8s", "size", "single", "ns/KB",
+	    "mapped%");
+
+	return (0);
+}
+
+int
+benchmark_optswitch(int opt, char *optarg)
+{
+	switch (opt) {
+	case 'a':
+		opta = 1;
+		break;
+	case 'c':
+		optc = 1;
+		break;
+	case 'm':
+		optm = sizetoint(optarg);
+		break;
+	case 's':
+		opts = sizetoll(optarg);
+		break;
+	default:
+		return (-1);
+	}
+	return (0);
+}
+
+int
+benchmark_initrun()
+{
+	if (optm <= 0 || optm > MAXXFER)
+		optm = MAXXFER;
+	bytes_moved = 0;
+	(void) getrusage(RUSAGE_SELF, &ru_self0);
+	(void) getrusage(RUSAGE_CHILDREN, &ru_child0);
+	mapped0 = get_mapped();
+	return (0);
+}
+
+int
+benchmark_initbatch(void *tsd)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+	int	sv[2];
+
+	ts->initerr = 0;
+	ts->pid = 0;
+	ts->sock = -1;
+	if (ts->buf == NULL && (ts->buf = valloc(MAXXFER)) == NULL) {
+		ts->initerr = 1;
+		return (0);
+	}
+	memset(ts->buf, 1, MAXXFER);
+	if (ts->rbuf == NULL &&
+	    (ts->rbuf = valloc(MAXXFER + getpagesize())) == NULL) {
+		ts->initerr = 1;
+		return (0);
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		perror("socketpair");
+		ts->initerr = 2;
+		return (0);
+	}
+	if (optc && setsockopt(sv[1], SOL_LOCAL, LOCAL_SINGLECOPY, &optc,
+	    sizeof (optc)) == -1) {
+		perror("LOCAL_SINGLECOPY");
+		ts->initerr = 3;
+		return (0);
+	}
+	ts->sock = sv[0];
+
+	if (pipe(ts->control) == -1) {
+		perror("pipe");
+		ts->initerr = 4;
+		return (0);
+	}
+	switch (ts->pid = fork()) {
+	case 0:
+		(void) close(ts->control[1]);
+		(void) close(ts->sock);
+		writer(ts->control[0], sv[1], ts->buf);
+		exit(0);
+		/*NOTREACHED*/
+	case -1:
+		perror("fork");
+		ts->initerr = 5;
+		return (0);
+	default:
+		break;
+	}
+	(void) close(ts->control[0]);
+	(void) close(sv[1]);
+	return (0);
+}
+
+int
+benchmark(void *tsd, result_t *res)
+{
+	tsd_t		*ts = (tsd_t *)tsd;
+	long long	done, todo = opts;
+	ssize_t		n;
+	int		i;
+
+	if (ts->initerr) {
+		res->re_errors = lm_optB;
+		return (0);
+	}
+
+	for (i = 0; i < lm_optB; i++) {
+		if (write(ts->control[1], &todo, sizeof (todo)) !=
+		    sizeof (todo)) {
+			res->re_errors++;
+			break;
+		}
+		for (done = 0; done < todo; done += n) {
+			if ((n = read(ts->sock, ts->rbuf + opta,
+			    optm)) <= 0) {
+				res->re_errors++;
+				return (0);
+			}
+		}
+		bytes_moved += done;
+	}
+	res->re_count = i;
+
+	return (0);
+}
+
+int
+benchmark_finibatch(void *tsd)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+
+	(void) close(ts->control[1]);
+	(void) close(ts->sock);
+	if (ts->pid > 0) {
+		(void) kill(ts->pid, SIGKILL);
+		(void) waitpid(ts->pid, NULL, 0);
+	}
+	ts->pid = 0;
+	return (0);
+}
+
+char *
+benchmark_result()
+{
+	static char	result[256];
+	struct rusage	ru_self, ru_child;
+	long long	cpu, mapped;
+
+	(void) getrusage(RUSAGE_SELF, &ru_self);
+	(void) getrusage(RUSAGE_CHILDREN, &ru_child);
+	mapped = (long long)(get_mapped() - mapped0);
+
+	cpu = ru_nsecs(&ru_self) - ru_nsecs(&ru_self0) +
+	    ru_nsecs(&ru_child) - ru_nsecs(&ru_child0);
+
+	(void) sprintf(result, "%8d %6s %10.1f %8.1f", optm,
+	    optc ? "yes" : "no",
+	    bytes_moved ? (double)cpu * 1024 / bytes_moved : 0.0,
+	    bytes_moved ? 100.0 * mapped / bytes_moved : 0.0);
+
+	return (result);
+}
+
+static void
+writer(int controlfd, int writefd, char *buf)
+{
+	long long	todo, done;
+	ssize_t		n;
+
+	for (;;) {
+		if (read(controlfd, &todo, sizeof (todo)) != sizeof (todo))
+			exit(0);
+		for (done = 0; done < todo; done += n) {
+			if ((n = write(writefd, buf, optm)) <= 0)
+				exit(1);
+		}
+	}
+}
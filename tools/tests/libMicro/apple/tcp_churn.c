@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2014 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * TCP connection churn over loopback, in the manner of short HTTP
+ * requests.  Every worker (-P, -T) has a listener of its own on
+ * 127.0.0.1; one operation is a connection to it, accepted, a -s byte
+ * request and response, and a close, server side first.  Each
+ * connection adds its pcbs to the TCP pcb hash and takes them out
+ * again, and every segment looks one up, so with several workers the
+ * operations contend on whatever serializes those.
+ *
+ * With -r, the client resets the connection rather than closing it, so
+ * that no TIME_WAIT pcbs pile up in the hash.
+ *
+ * The result columns give the number of workers and the connections
+ * per second all of them completed together.
+ */
+
+#ifdef	__sun
+#pragma ident	"@(#)tcp_churn.c	1.0	14/10/14 Apple Inc."
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../libmicro.h"
+
+typedef struct {
+	int			ls;
+	struct sockaddr_in	addr;
+	u_int64_t		conns;
+	u_int64_t		first;		/* usecs, start of first batch */
+	u_int64_t		last;		/* usecs, end of last batch */
+	int			initerr;
+} tsd_t;
+
+#define	MAXMSG		4096
+
+static int	optr = 0;
+static int	opts = 64;
+
+int
+benchmark_init()
+{
+	lm_defB = 100;
+	lm_tsdsize = sizeof (tsd_t);
+
+	(void) sprintf(lm_optstr, "rs:");
+
+	(void) sprintf(lm_usage,
+	    "		[-r] (reset instead of closing)\n"
+	    "		[-s <request and response size>]\n"
+	    "notes: measures TCP connections/sec over lo0\n");
+
+	(void) sprintf(lm_header, "%7s %10s", "workers", "conns/s");
+
+	return (0);
+}
+
+int
+benchmark_optswitch(int opt, char *optarg)
+{
+	switch (opt) {
+	case 'r':
+		optr = 1;
+		break;
+	case 's':
+		opts = sizetoint(optarg);
+		break;
+	default:
+		return (-1);
+	}
+	return (0);
+}
+
+int
+benchmark_initrun()
+{
+	if (opts <= 0 || opts > MAXMSG)
+		opts = MAXMSG;
+	(void) setfdlimit(4 * lm_optT + 10);
+	return (0);
+}
+
+int
+benchmark_initworker(void *tsd)
+{
+	tsd_t		*ts = (tsd_t *)tsd;
+	socklen_t	len = sizeof (ts->addr);
+
+	ts->initerr = 0;
+	ts->conns = 0;
+	ts->first = ts->last = 0;
+
+	memset(&ts->addr, 0, sizeof (ts->addr));
+	ts->addr.sin_len = sizeof (ts->addr);
+	ts->addr.sin_family = AF_INET;
+	ts->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((ts->ls = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	    bind(ts->ls, (struct sockaddr *)&ts->addr,
+	    sizeof (ts->addr)) == -1 ||
+	    getsockname(ts->ls, (struct sockaddr *)&ts->addr, &len) == -1 ||
+	    listen(ts->ls, 16) == -1) {
+		perror("listen");
+		ts->initerr = 1;
+	}
+	return (0);
+}
+
+static u_int64_t
+usecs(void)
+{
+	struct timeval	tv;
+
+	(void) gettimeofday(&tv, NULL);
+	return (tv.tv_sec * 1000000ULL + tv.tv_usec);
+}
+
+/* Read n bytes, or fail */
+static int
+readn(int s, char *buf, int n)
+{
+	int	r, got;
+
+	for (got = 0; got < n; got += r) {
+		if ((r = read(s, buf + got, n - got)) <= 0)
+			return (-1);
+	}
+	return (0);
+}
+
+int
+benchmark(void *tsd, result_t *res)
+{
+	tsd_t		*ts = (tsd_t *)tsd;
+	struct linger	l = { 1, 0 };
+	char		buf[MAXMSG];
+	int		i, s, as;
+
+	if (ts->initerr) {
+		res->re_errors = lm_optB;
+		return (0);
+	}
+
+	memset(buf, 'x', opts);
+	if (ts->first == 0)
+		ts->first = usecs();
+	for (i = 0; i < lm_optB; i++) {
+		if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+			res->re_errors++;
+			continue;
+		}
+		if (connect(s, (struct sockaddr *)&ts->addr,
+		    sizeof (ts->addr)) == -1 ||
+		    (as = accept(ts->ls, NULL, NULL)) == -1) {
+			res->re_errors++;
+			(void) close(s);
+			continue;
+		}
+		if (write(s, buf, opts) != opts ||
+		    readn(as, buf, opts) == -1 ||
+		    write(as, buf, opts) != opts ||
+		    readn(s, buf, opts) == -1)
+			res->re_errors++;
+		if (optr) {
+			(void) setsockopt(s, SOL_SOCKET, SO_LINGER, &l,
+			    sizeof (l));
+			(void) close(s);
+			(void) close(as);
+		} else {
+			(void) close(as);
+			(void) close(s);
+		}
+	}
+	res->re_count = i;
+
+	ts->conns += i - res->re_errors;
+	ts->last = usecs();
+
+	return (0);
+}
+
+int
+benchmark_finiworker(void *tsd)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+
+	if (ts->ls != -1)
+		(void) close(ts->ls);
+	return (0);
+}
+
+char *
+benchmark_result()
+{
+	static char	result[256];
+	u_int64_t	conns = 0, first = 0, last = 0;
+	tsd_t		*ts;
+	int		p, t;
+
+	/* Every connection, from the first worker's start to the last end */
+	for (p = 0; p < lm_optP; p++) {
+		for (t = 0; t < lm_optT; t++) {
+			ts = (tsd_t *)gettsd(p, t);
+			conns += ts->conns;
+			if (ts->first != 0 && (first == 0 || ts->first < first))
+				first = ts->first;
+			if (ts->last > last)
+				last = ts->last;
+		}
+	}
+
+	(void) sprintf(result, "%7d %10.0f", lm_optP * lm_optT,
+	    last > first ? conns * 1e6 / (last - first) : 0.0);
+
+	return (result);
+}
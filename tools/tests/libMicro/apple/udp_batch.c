@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2014 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Batched UDP datagrams over loopback.  Each thread (-T) sends -b
+ * datagrams of -s bytes at a time with one sendmsg_x() call, from a
+ * connected socket to a socket of its own on 127.0.0.1, and reads the
+ * batch back with recvmsg_x() before sending the next one.  One
+ * operation is one datagram, so the time per operation is the cost of
+ * a datagram through the batched send and receive paths.  With -n,
+ * the same batches are sent and received one datagram per send() and
+ * recv() call instead, for comparison.
+ *
+ * Datagrams that are not back within 100ms count as errors.
+ */
+
+#ifdef	__sun
+#pragma ident	"@(#)udp_batch.c	1.0	14/10/14 Apple Inc."
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../libmicro.h"
+
+/*
+ * From the PRIVATE section of <sys/socket.h>; the calls are not in the
+ * public headers.
+ */
+struct msghdr_x {
+	void		*msg_name;
+	socklen_t	msg_namelen;
+	struct iovec	*msg_iov;
+	int		msg_iovlen;
+	void		*msg_control;
+	socklen_t	msg_controllen;
+	int		msg_flags;
+	size_t		msg_datalen;
+};
+
+ssize_t recvmsg_x(int s, const struct msghdr_x *msgp, u_int cnt, int flags);
+ssize_t sendmsg_x(int s, const struct msghdr_x *msgp, u_int cnt, int flags);
+
+#define	MAXBATCH	64
+#define	MAXSIZE		1472
+
+typedef struct {
+	int		tx;
+	int		rx;
+	struct iovec	txiov[MAXBATCH];
+	struct iovec	rxiov[MAXBATCH];
+	struct msghdr_x	txmsg[MAXBATCH];
+	struct msghdr_x	rxmsg[MAXBATCH];
+	char		rxbuf[MAXBATCH][MAXSIZE];
+	int		initerr;
+} tsd_t;
+
+static int	optb = 16;
+static int	optn = 0;
+static int	opts = 64;
+
+static char	txbuf[MAXSIZE];
+
+int
+benchmark_init()
+{
+	(void) sprintf(lm_optstr, "b:ns:");
+
+	lm_tsdsize = sizeof (tsd_t);
+
+	(void) sprintf(lm_usage,
+	    "		[-b <datagrams per batch (1-64)>]\n"
+	    "		[-n] (one send()/recv() per datagram)\n"
+	    "		[-s <datagram size>]\n"
+	    "notes: measures UDP datagrams/sec through sendmsg_x and "
+	    "recvmsg_x\n");
+
+	(void) sprintf(lm_header, "%6s %6s %10s", "size", "batch", "calls");
+
+	return (0);
+}
+
+int
+benchmark_optswitch(int opt, char *optarg)
+{
+	switch (opt) {
+	case 'b':
+		optb = sizetoint(optarg);
+		break;
+	case 'n':
+		optn = 1;
+		break;
+	case 's':
+		opts = sizetoint(optarg);
+		break;
+	default:
+		return (-1);
+	}
+	return (0);
+}
+
+int
+benchmark_initrun()
+{
+	if (optb <= 0 || optb > MAXBATCH)
+		optb = MAXBATCH;
+	if (opts <= 0 || opts > MAXSIZE)
+		opts = MAXSIZE;
+	return (0);
+}
+
+int
+benchmark_initworker(void *tsd)
+{
+	tsd_t			*ts = (tsd_t *)tsd;
+	struct sockaddr_in	sin;
+	socklen_t		len = sizeof (sin);
+	struct timeval		tv = { 0, 100000 };
+	int			bufsize = MAXBATCH * 4096;
+	int			i;
+
+	ts->initerr = 0;
+	ts->tx = ts->rx = -1;
+
+	for (i = 0; i < MAXBATCH; i++) {
+		ts->txiov[i].iov_base = txbuf;
+		ts->txiov[i].iov_len = opts;
+		ts->rxiov[i].iov_base = ts->rxbuf[i];
+		ts->rxiov[i].iov_len = MAXSIZE;
+	}
+
+	memset(&sin, 0, sizeof (sin));
+	sin.sin_len = sizeof (sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((ts->rx = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+	    (ts->tx = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		perror("socket");
+		ts->initerr = 1;
+		return (0);
+	}
+	(void) setsockopt(ts->tx, SOL_SOCKET, SO_SNDBUF, &bufsize,
+	    sizeof (bufsize));
+	(void) setsockopt(ts->rx, SOL_SOCKET, SO_RCVBUF, &bufsize,
+	    sizeof (bufsize));
+	(void) setsockopt(ts->rx, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+	if (bind(ts->rx, (struct sockaddr *)&sin, sizeof (sin)) == -1 ||
+	    getsockname(ts->rx, (struct sockaddr *)&sin, &len) == -1 ||
+	    connect(ts->tx, (struct sockaddr *)&sin, sizeof (sin)) == -1) {
+		perror("bind/connect");
+		ts->initerr = 1;
+	}
+	return (0);
+}
+
+/* Send a batch of n datagrams; returns how many went out */
+static int
+send_batch(tsd_t *ts, int n)
+{
+	ssize_t	r;
+	int	i;
+
+	if (optn) {
+		for (i = 0; i < n; i++) {
+			if (send(ts->tx, txbuf, opts, 0) != opts)
+				break;
+		}
+		return (i);
+	}
+
+	/* msg_flags and msg_datalen must be zero on input */
+	memset(ts->txmsg, 0, n * sizeof (struct msghdr_x));
+	for (i = 0; i < n; i++) {
+		ts->txmsg[i].msg_iov = &ts->txiov[i];
+		ts->txmsg[i].msg_iovlen = 1;
+	}
+	r = sendmsg_x(ts->tx, ts->txmsg, n, 0);
+	return (r < 0 ? 0 : (int)r);
+}
+
+/*
+ * Receive n datagrams; recvmsg_x() may return fewer than asked for, so
+ * it is called until all of them are in or the receive times out.
+ */
+static int
+recv_batch(tsd_t *ts, int n)
+{
+	ssize_t	r;
+	int	i, got;
+
+	if (optn) {
+		for (i = 0; i < n; i++) {
+			if (recv(ts->rx, ts->rxbuf[0], MAXSIZE, 0) != opts)
+				break;
+		}
+		return (i);
+	}
+
+	for (got = 0; got < n; got += r) {
+		memset(ts->rxmsg, 0, (n - got) * sizeof (struct msghdr_x));
+		for (i = 0; i < n - got; i++) {
+			ts->rxmsg[i].msg_iov = &ts->rxiov[i];
+			ts->rxmsg[i].msg_iovlen = 1;
+		}
+		if ((r = recvmsg_x(ts->rx, ts->rxmsg, n - got, 0)) <= 0)
+			break;
+		for (i = 0; i < r; i++) {
+			if (ts->rxmsg[i].msg_datalen != (size_t)opts)
+				return (got + i);
+		}
+	}
+	return (got);
+}
+
+int
+benchmark(void *tsd, result_t *res)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+	int	i, n, sent;
+
+	if (ts->initerr) {
+		res->re_errors = lm_optB;
+		return (0);
+	}
+
+	for (i = 0; i < lm_optB; i += n) {
+		n = lm_optB - i < optb ? lm_optB - i : optb;
+		sent = send_batch(ts, n);
+		res->re_errors += n - recv_batch(ts, sent);
+	}
+	res->re_count = lm_optB;
+
+	return (0);
+}
+
+int
+benchmark_finiworker(void *tsd)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+
+	if (ts->tx != -1)
+		(void) close(ts->tx);
+	if (ts->rx != -1)
+		(void) close(ts->rx);
+	return (0);
+}
+
+char *
+benchmark_result()
+{
+	static char	result[256];
+
+	(void) sprintf(result, "%6d %6d %10s", opts, optb,
+	    optn ? "send/recv" : "sendmsg_x");
+
+	return (result);
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2014 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Small UDP datagrams through the loopback interface.  Each thread (-T)
+ * sends bursts of -b datagrams of -s bytes from a connected socket to a
+ * socket of its own on 127.0.0.1, and reads each burst back before
+ * sending the next, so the time per operation is the cost of taking
+ * one packet through lo0's output and input paths.
+ *
+ * With the lo_txstart boot-arg, lo0 queues its output on the interface
+ * send queue and its start thread dequeues it in chains of up to
+ * net.link.loopback.max_dequeue packets; the value is printed with the
+ * result.  Datagrams that are not back within 100ms count as errors.
+ */
+
+#ifdef	__sun
+#pragma ident	"@(#)udp_lo_pps.c	1.0	14/10/14 Apple Inc."
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../libmicro.h"
+
+typedef struct {
+	int	tx;
+	int	rx;
+	int	initerr;
+} tsd_t;
+
+#define	MAXBURST	1024
+
+static int	optb = 32;
+static int	opts = 64;
+
+static char	buf[1500];
+
+int
+benchmark_init()
+{
+	(void) sprintf(lm_optstr, "b:s:");
+
+	lm_tsdsize = sizeof (tsd_t);
+
+	(void) sprintf(lm_usage,
+	    "		[-b <datagrams per burst>]\n"
+	    "		[-s <datagram size>]\n"
+	    "notes: measures UDP datagrams/sec over lo0\n");
+
+	(void) sprintf(lm_header, "%6s %6s %8s", "size", "burst", "maxdeq");
+
+	return (0);
+}
+
+int
+benchmark_optswitch(int opt, char *optarg)
+{
+	switch (opt) {
+	case 'b':
+		optb = sizetoint(optarg);
+		break;
+	case 's':
+		opts = sizetoint(optarg);
+		break;
+	default:
+		return (-1);
+	}
+	return (0);
+}
+
+int
+benchmark_initrun()
+{
+	if (optb <= 0 || optb > MAXBURST)
+		optb = MAXBURST;
+	if (opts <= 0 || opts > (int)sizeof (buf))
+		opts = sizeof (buf);
+	return (0);
+}
+
+int
+benchmark_initworker(void *tsd)
+{
+	tsd_t			*ts = (tsd_t *)tsd;
+	struct sockaddr_in	sin;
+	socklen_t		len = sizeof (sin);
+	struct timeval		tv = { 0, 100000 };
+	int			rcvbuf = MAXBURST * 2048;
+
+	ts->initerr = 0;
+	ts->tx = ts->rx = -1;
+
+	memset(&sin, 0, sizeof (sin));
+	sin.sin_len = sizeof (sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((ts->rx = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+	    (ts->tx = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		perror("socket");
+		ts->initerr = 1;
+		return (0);
+	}
+	(void) setsockopt(ts->rx, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+	    sizeof (rcvbuf));
+	(void) setsockopt(ts->rx, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+	if (bind(ts->rx, (struct sockaddr *)&sin, sizeof (sin)) == -1 ||
+	    getsockname(ts->rx, (struct sockaddr *)&sin, &len) == -1 ||
+	    connect(ts->tx, (struct sockaddr *)&sin, sizeof (sin)) == -1) {
+		perror("bind/connect");
+		ts->initerr = 1;
+	}
+	return (0);
+}
+
+int
+benchmark(void *tsd, result_t *res)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+	char	rbuf[1500];
+	int	i, n, burst, sent;
+
+	if (ts->initerr) {
+		res->re_errors = lm_optB;
+		return (0);
+	}
+
+	for (i = 0; i < lm_optB; i += burst) {
+		burst = lm_optB - i < optb ? lm_optB - i : optb;
+		for (sent = 0; sent < burst; sent++) {
+			if (send(ts->tx, buf, opts, 0) != opts)
+				break;
+		}
+		for (n = 0; n < sent; n++) {
+			if (recv(ts->rx, rbuf, sizeof (rbuf), 0) != opts)
+				break;
+		}
+		res->re_errors += burst - n;
+	}
+	res->re_count = lm_optB;
+
+	return (0);
+}
+
+int
+benchmark_finiworker(void *tsd)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+
+	if (ts->tx != -1)
+		(void) close(ts->tx);
+	if (ts->rx != -1)
+		(void) close(ts->rx);
+	return (0);
+}
+
+char *
+benchmark_result()
+{
+	static char	result[256];
+	u_int32_t	maxdeq;
+	size_t		len = sizeof (maxdeq);
+
+	if (sysctlbyname("net.link.loopback.max_dequeue", &maxdeq, &len,
+	    NULL, 0) == -1)
+		maxdeq = 0;
+	(void) sprintf(result, "%6d %6d %8u", opts, optb, maxdeq);
+
+	return (result);
+}
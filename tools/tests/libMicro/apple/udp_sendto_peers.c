@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2014 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * UDP sends to many distinct peers.  Each thread (-T) owns an
+ * unconnected UDP socket and sends -s byte datagrams round robin to -p
+ * destinations in 127/8, so that every send looks the destination up in
+ * the routing table.  The datagrams are dropped by ip_input, as none of
+ * the addresses but 127.0.0.1 is local.
+ *
+ * The result columns come from the per-CPU destination cache counters
+ * (net.route.pcpu_cache_*) over the run: the share of lookups it
+ * answered, and the entries it dropped because the routing table had
+ * changed since they were filled.  The first send to each peer clones a
+ * host route, which bumps the generation count, so the first batches
+ * mostly miss.
+ */
+
+#ifdef	__sun
+#pragma ident	"@(#)udp_sendto_peers.c	1.0	14/10/14 Apple Inc."
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../libmicro.h"
+
+typedef struct {
+	int	sock;
+	int	next;
+	int	initerr;
+} tsd_t;
+
+#define	MAXPEERS	(1 << 22)
+
+static int	optp = 10000;
+static int	opts = 64;
+
+static char		buf[1500];
+static u_int64_t	hits0, misses0, inval0;
+
+static u_int64_t
+get_counter(const char *name)
+{
+	u_int64_t	val;
+	size_t		len = sizeof (val);
+
+	if (sysctlbyname(name, &val, &len, NULL, 0) == -1)
+		val = 0;
+	return (val);
+}
+
+int
+benchmark_init()
+{
+	(void) sprintf(lm_optstr, "p:s:");
+
+	lm_tsdsize = sizeof (tsd_t);
+
+	(void) sprintf(lm_usage,
+	    "		[-p <number of peers>]\n"
+	    "		[-s <datagram size>]\n"
+	    "notes: measures UDP sendto() to many destinations\n");
+
+	(void) sprintf(lm_header, "%8s %8s %10s", "peers", "hit%",
+	    "invalid");
+
+	return (0);
+}
+
+int
+benchmark_optswitch(int opt, char *optarg)
+{
+	switch (opt) {
+	case 'p':
+		optp = sizetoint(optarg);
+		break;
+	case 's':
+		opts = sizetoint(optarg);
+		break;
+	default:
+		return (-1);
+	}
+	return (0);
+}
+
+int
+benchmark_initrun()
+{
+	if (optp <= 0 || optp > MAXPEERS)
+		optp = MAXPEERS;
+	if (opts <= 0 || opts > (int)sizeof (buf))
+		opts = sizeof (buf);
+	hits0 = get_counter("net.route.pcpu_cache_hits");
+	misses0 = get_counter("net.route.pcpu_cache_misses");
+	inval0 = get_counter("net.route.pcpu_cache_invalidations");
+	return (0);
+}
+
+int
+benchmark_initworker(void *tsd)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+
+	ts->initerr = 0;
+	ts->next = 0;
+	if ((ts->sock = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		perror("socket");
+		ts->initerr = 1;
+	}
+	return (0);
+}
+
+int
+benchmark(void *tsd, result_t *res)
+{
+	tsd_t			*ts = (tsd_t *)tsd;
+	struct sockaddr_in	sin;
+	int			i;
+
+	if (ts->initerr) {
+		res->re_errors = lm_optB;
+		return (0);
+	}
+
+	memset(&sin, 0, sizeof (sin));
+	sin.sin_len = sizeof (sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(9);		/* discard */
+
+	for (i = 0; i < lm_optB; i++) {
+		/* 127.0.0.2 onwards */
+		sin.sin_addr.s_addr = htonl(0x7f000002 + ts->next);
+		if (++ts->next == optp)
+			ts->next = 0;
+		if (sendto(ts->sock, buf, opts, 0, (struct sockaddr *)&sin,
+		    sizeof (sin)) != opts)
+			res->re_errors++;
+	}
+	res->re_count = i;
+
+	return (0);
+}
+
+int
+benchmark_finiworker(void *tsd)
+{
+	tsd_t	*ts = (tsd_t *)tsd;
+
+	if (ts->sock != -1)
+		(void) close(ts->sock);
+	return (0);
+}
+
+char *
+benchmark_result()
+{
+	static char	result[256];
+	u_int64_t	hits, lookups;
+
+	hits = get_counter("net.route.pcpu_cache_hits") - hits0;
+	lookups = hits + get_counter("net.route.pcpu_cache_misses") - misses0;
+
+	(void) sprintf(result, "%8d %8.1f %10llu", optp,
+	    lookups ? 100.0 * hits / lookups : 0.0,
+	    (unsigned long long)(get_counter(
+	    "net.route.pcpu_cache_invalidations") - inval0));
+
+	return (result);
+}
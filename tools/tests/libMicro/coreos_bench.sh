@@ -703,6 +703,38 @@ pipe		$OPTS -N "pipe_tmp4k"	-s 4k	-I 8000	-x tcp  -m mp
 #connection	$OPTS -N "conn_accept"		-B 256      -a
 
 lmbench_bw_unix -B 11 -L -W
+bw_tcp_loopback -B 11 -L -W
+bw_sendfile -B 11 -L -W
+bw_unix_singlecopy -B 11 -L -W -N bw_unix_4k -m 4k
+bw_unix_singlecopy -B 11 -L -W -N bw_unix_4k_singlecopy -m 4k -c
+bw_unix_singlecopy -B 11 -L -W -N bw_unix_64k -m 64k
+bw_unix_singlecopy -B 11 -L -W -N bw_unix_64k_singlecopy -m 64k -c
+bw_unix_singlecopy -B 11 -L -W -N bw_unix_1m -m 1m
+bw_unix_singlecopy -B 11 -L -W -N bw_unix_1m_singlecopy -m 1m -c
+bw_unix_singlecopy -B 11 -L -W -N bw_unix_1m_singlecopy_unaligned -m 1m -c -a
+bw_mbuf_churn -B 100 -L -W -N bw_mbuf_churn_1 -T 1
+bw_mbuf_churn -B 100 -L -W -N bw_mbuf_churn_4 -T 4
+bw_mbuf_churn -B 100 -L -W -N bw_mbuf_churn_4_cross -T 4 -c
+udp_sendto_peers -B 10000 -L -W -N udp_sendto_1k_peers -p 1k
+udp_sendto_peers -B 10000 -L -W -N udp_sendto_100k_peers -p 100k
+udp_sendto_peers -B 10000 -L -W -N udp_sendto_100k_peers_4 -p 100k -T 4
+udp_lo_pps -B 10000 -L -W -N udp_lo_pps_64
+udp_lo_pps -B 10000 -L -W -N udp_lo_pps_64_4 -T 4
+udp_lo_pps -B 10000 -L -W -N udp_lo_pps_1k -s 1k
+bw_reuseport_accept -B 100 -L -W -N bw_reuseport_accept_1 -P 1
+bw_reuseport_accept -B 100 -L -W -N bw_reuseport_accept_4 -P 4
+bw_reuseport_accept -B 100 -L -W -N bw_reuseport_accept_32 -P 32
+tcp_churn -B 100 -L -W -N tcp_churn_1 -T 1
+tcp_churn -B 100 -L -W -N tcp_churn_4 -T 4
+tcp_churn -B 100 -L -W -N tcp_churn_16 -T 16
+tcp_churn -B 100 -L -W -N tcp_churn_16_rst -T 16 -r
+udp_batch -B 1024 -L -W -N udp_batch_1 -b 1
+udp_batch -B 1024 -L -W -N udp_batch_8 -b 8
+udp_batch -B 1024 -L -W -N udp_batch_64 -b 64
+udp_batch -B 1024 -L -W -N udp_batch_64_send -b 64 -n
+bw_pipe -B 10 -L -W -N bw_pipe_4k -m 4k
+bw_pipe -B 10 -L -W -N bw_pipe_64k -m 64k
+bw_pipe -B 10 -L -W -N bw_pipe_1m -m 1m
 
 lmbench_bw_mem $OPTS -N lmbench_bcopy_512 -s 512 -x bcopy
 lmbench_bw_mem $OPTS -N lmbench_bcopy_1k -s 1k -x bcopy
@@ -0,0 +1,501 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Benchmark for the pf filter rule index.
+ *
+ * Builds bsd/net/pf_ruleindex.c for user space, indexes a synthetic
+ * filter ruleset of -n rules and evaluates -c first packets of new
+ * connections against it, the way pf_test_rule() does: once walking
+ * the rules with their skip steps only, and once stepping through them
+ * with pf_rule_index_next() first.  The rules match on protocol,
+ * destination address and destination port.  A rule is for TCP, UDP,
+ * ICMP or GRE, or for any protocol with probability -w percent; its
+ * port is one of -P services, a range or a comparison, and -q percent
+ * of the rules are "quick".  The packets go to the same services most
+ * of the time.
+ *
+ * Both walks must end on the same rule as a plain walk of every rule,
+ * for every packet, and pf_rule_index_test(), the index's in-kernel
+ * test, must pass; the benchmark exits non-zero otherwise.  The number
+ * of rules each walk looked at and the packets per second it evaluated
+ * are reported.
+ *
+ * usage: pf_ruleindex [-c packets] [-n rules] [-P services] [-q quick %]
+ *     [-s seed] [-w any protocol %]
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * The parts of <net/pfvar.h> that pf_ruleindex.c uses, and the fields
+ * pf_test_rule() looks at before the destination port besides, bar the
+ * source address and port.  The kernel headers it includes are skipped
+ * by defining their guards.
+ */
+enum	{ PF_OP_NONE, PF_OP_IRG, PF_OP_EQ, PF_OP_NE, PF_OP_LT,
+	  PF_OP_LE, PF_OP_GT, PF_OP_GE, PF_OP_XRG, PF_OP_RRG };
+enum	{ PF_RULESET_SCRUB, PF_RULESET_FILTER, PF_RULESET_NAT,
+	  PF_RULESET_BINAT, PF_RULESET_RDR, PF_RULESET_DUMMYNET,
+	  PF_RULESET_MAX };
+
+struct pf_port_range {
+	u_int16_t	port[2];
+	u_int8_t	op;
+};
+
+union pf_rule_xport {
+	struct pf_port_range	range;
+};
+
+struct pf_rule_addr {
+	in_addr_t		addr;
+	in_addr_t		mask;
+	union pf_rule_xport	xport;
+};
+
+/*
+ * The kernel's struct pf_rule is close to 1KB, and the fields a walk
+ * reads are spread over it; the padding keeps them about as far apart.
+ */
+struct pf_rule {
+	struct pf_rule_addr	dst;
+	/* the skip steps of the fields matched on, as pf_calc_skip_steps() */
+	struct pf_rule		*skip_proto;
+	struct pf_rule		*skip_dst_addr;
+	struct pf_rule		*skip_dst_port;
+	char			names[432];
+	TAILQ_ENTRY(pf_rule)	entries;
+	char			rpool[88];
+	u_int64_t		evaluations;
+	char			counters[120];
+	void			*kif;
+	char			limits[192];
+	u_int32_t		nr;
+	u_int8_t		direction;
+	u_int8_t		quick;
+	u_int8_t		ifnot;
+	sa_family_t		af;
+	u_int8_t		proto;
+};
+
+TAILQ_HEAD(pf_rulequeue, pf_rule);
+
+struct pf_rule_index;
+
+struct pf_ruleset {
+	struct {
+		struct {
+			struct pf_rulequeue	*ptr;
+			u_int32_t		 rcount;
+		}			 active;
+		struct pf_rule_index	*index;
+	}			 rules[PF_RULESET_MAX];
+};
+
+#define _SYS_SYSTM_H_
+#define _SYS_MALLOC_H_
+#define _KERN_LOCKS_H_
+#define _NET_PFVAR_H_
+
+#define M_TEMP			0
+#define M_WAITOK		0
+#define M_ZERO			0
+#define _MALLOC(size, type, flags)	calloc(1, (size))
+#define _FREE(addr, type)	free(addr)
+
+typedef int	lck_mtx_t;
+#define LCK_MTX_ASSERT_OWNED	0
+#define lck_mtx_assert(l, t)
+#define lck_mtx_lock(l)
+#define lck_mtx_unlock(l)
+
+#define CONFIG_IN_KERNEL_TESTS	1
+
+static int
+pf_match_port(u_int8_t op, u_int16_t a1, u_int16_t a2, u_int16_t p)
+{
+	a1 = ntohs(a1);
+	a2 = ntohs(a2);
+	p = ntohs(p);
+	switch (op) {
+	case PF_OP_IRG:
+		return ((p > a1) && (p < a2));
+	case PF_OP_XRG:
+		return ((p < a1) || (p > a2));
+	case PF_OP_RRG:
+		return ((p >= a1) && (p <= a2));
+	case PF_OP_EQ:
+		return (p == a1);
+	case PF_OP_NE:
+		return (p != a1);
+	case PF_OP_LT:
+		return (p < a1);
+	case PF_OP_LE:
+		return (p <= a1);
+	case PF_OP_GT:
+		return (p > a1);
+	case PF_OP_GE:
+		return (p >= a1);
+	}
+	return (0);
+}
+
+#include "../../../bsd/net/pf_ruleindex.c"
+
+lck_mtx_t *pf_lock;
+
+#define PF_IN		1
+
+/* pfi_kif_match() */
+static int
+kif_match(void *rule_kif, void *packet_kif)
+{
+	return (rule_kif == NULL || rule_kif == packet_kif);
+}
+
+struct pkt {
+	void		*kif;
+	in_addr_t	daddr;
+	u_int16_t	dport;		/* network order */
+	u_int8_t	proto;
+};
+
+static struct pf_rulequeue queue;
+static struct pf_ruleset ruleset;
+static struct pf_rule *rules;
+static struct pkt *pkts;
+static u_int16_t *services;
+
+static u_int32_t
+rnd32(void)
+{
+	return (((u_int32_t)random() << 16) ^ (u_int32_t)random());
+}
+
+static double
+secs_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return ((now.tv_sec - start->tv_sec) +
+	    (now.tv_usec - start->tv_usec) / 1e6);
+}
+
+static u_int8_t
+rnd_proto(int anypct)
+{
+	u_int32_t x = rnd32() % 100;
+
+	if ((int)x < anypct)
+		return (0);
+	x = rnd32() % 100;
+	if (x < 55)
+		return (IPPROTO_TCP);
+	if (x < 90)
+		return (IPPROTO_UDP);
+	if (x < 97)
+		return (IPPROTO_ICMP);
+	return (IPPROTO_GRE);
+}
+
+static void
+make_rules(int nrules, int nservices, int anypct, int quickpct)
+{
+	struct pf_port_range *pr;
+	struct pf_rule *r, *n;
+	int i;
+
+	TAILQ_INIT(&queue);
+	for (i = 0; i < nrules; i++) {
+		r = &rules[i];
+		r->nr = i;
+		r->direction = PF_IN;
+		r->af = AF_INET;
+		r->proto = rnd_proto(anypct);
+		r->quick = ((int)(rnd32() % 100) < quickpct);
+		if (rnd32() % 4 != 0) {
+			r->dst.addr = htonl(0x0a000000 |
+			    (rnd32() % (16 * 256)) << 8);
+			r->dst.mask = htonl(0xffffff00);
+		}
+		pr = &r->dst.xport.range;
+		if (r->proto != IPPROTO_TCP && r->proto != IPPROTO_UDP)
+			goto next;
+		switch (rnd32() % 10) {
+		case 0: case 1: case 2: case 3: case 4: case 5:
+			pr->op = PF_OP_EQ;
+			pr->port[0] = htons(services[rnd32() % nservices]);
+			break;
+		case 6: case 7:
+			pr->op = PF_OP_RRG;
+			pr->port[0] = 1024 + rnd32() % 60000;
+			pr->port[1] = htons(pr->port[0] + rnd32() % 500);
+			pr->port[0] = htons(pr->port[0]);
+			break;
+		case 8:
+			pr->op = (rnd32() % 2) ? PF_OP_GE : PF_OP_LT;
+			pr->port[0] = htons(1024);
+			break;
+		}
+next:
+		TAILQ_INSERT_TAIL(&queue, r, entries);
+	}
+
+	/* Each skip step goes to the next rule that differs in its field */
+	for (i = nrules - 1; i >= 0; i--) {
+		r = &rules[i];
+		n = (i + 1 < nrules) ? &rules[i + 1] : NULL;
+		r->skip_proto = (n != NULL && n->proto == r->proto) ?
+		    n->skip_proto : n;
+		r->skip_dst_addr = (n != NULL && n->dst.addr == r->dst.addr &&
+		    n->dst.mask == r->dst.mask) ? n->skip_dst_addr : n;
+		r->skip_dst_port = (n != NULL && n->proto == r->proto &&
+		    !bcmp(&n->dst.xport.range, &r->dst.xport.range,
+		    sizeof (r->dst.xport.range))) ? n->skip_dst_port : n;
+	}
+
+	ruleset.rules[PF_RULESET_FILTER].active.ptr = &queue;
+	ruleset.rules[PF_RULESET_FILTER].active.rcount = nrules;
+	pf_rule_index_update(&ruleset, PF_RULESET_FILTER);
+}
+
+static void
+make_pkts(int npkts, int nservices)
+{
+	struct pkt *pk;
+	int i;
+
+	for (i = 0; i < npkts; i++) {
+		pk = &pkts[i];
+		pk->kif = &pkts[0];
+		pk->proto = rnd_proto(0);
+		pk->daddr = htonl(0x0a000000 | (rnd32() % (16 * 256 * 256)));
+		if (pk->proto == IPPROTO_TCP || pk->proto == IPPROTO_UDP)
+			pk->dport = htons((rnd32() % 10 < 7) ?
+			    services[rnd32() % nservices] :
+			    1 + rnd32() % 65535);
+		else
+			pk->dport = 0;
+	}
+}
+
+static int
+rule_match(struct pf_rule *r, const struct pkt *pk)
+{
+	if (kif_match(r->kif, pk->kif) == r->ifnot ||
+	    (r->direction && r->direction != PF_IN) ||
+	    (r->af && r->af != AF_INET))
+		return (0);
+	if (r->proto && r->proto != pk->proto)
+		return (0);
+	if ((pk->daddr & r->dst.mask) != r->dst.addr)
+		return (0);
+	if ((pk->proto == IPPROTO_TCP || pk->proto == IPPROTO_UDP) &&
+	    r->dst.xport.range.op && !pf_match_port(r->dst.xport.range.op,
+	    r->dst.xport.range.port[0], r->dst.xport.range.port[1], pk->dport))
+		return (0);
+	return (1);
+}
+
+/* The last matching rule, or the first quick one; no skip steps */
+static struct pf_rule *
+eval_plain(const struct pkt *pk)
+{
+	struct pf_rule *r, *last = NULL;
+
+	TAILQ_FOREACH(r, &queue, entries) {
+		if (!rule_match(r, pk))
+			continue;
+		last = r;
+		if (r->quick)
+			break;
+	}
+	return (last);
+}
+
+/*
+ * As pf_test_rule() walks the filter rules, with or without the index;
+ * the direction and address family have no skip steps of their own
+ * here, as every rule has the same.
+ */
+static struct pf_rule *
+eval(struct pf_rule_index *ri, const struct pkt *pk, u_int64_t *looked)
+{
+	struct pf_rule *r = TAILQ_FIRST(&queue), *last = NULL;
+	struct pf_rule_cand *rc = NULL;
+	u_int64_t n = 0;
+
+	if (ri != NULL)
+		rc = pf_rule_index_lookup(ri, pk->proto, pk->dport);
+	while (r != NULL) {
+		if (ri != NULL && (r = pf_rule_index_next(ri, rc, r)) == NULL)
+			break;
+		n++;
+		r->evaluations++;
+		if (kif_match(r->kif, pk->kif) == r->ifnot ||
+		    (r->direction && r->direction != PF_IN) ||
+		    (r->af && r->af != AF_INET))
+			r = TAILQ_NEXT(r, entries);
+		else if (r->proto && r->proto != pk->proto)
+			r = r->skip_proto;
+		else if ((pk->daddr & r->dst.mask) != r->dst.addr)
+			r = r->skip_dst_addr;
+		else if ((pk->proto == IPPROTO_TCP ||
+		    pk->proto == IPPROTO_UDP) && r->dst.xport.range.op &&
+		    !pf_match_port(r->dst.xport.range.op,
+		    r->dst.xport.range.port[0], r->dst.xport.range.port[1],
+		    pk->dport))
+			r = r->skip_dst_port;
+		else {
+			last = r;
+			if (r->quick)
+				break;
+			r = TAILQ_NEXT(r, entries);
+		}
+	}
+	*looked += n;
+	return (last);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned int seed = (unsigned int)getpid();
+	struct pf_rule_index *ri;
+	struct pf_rule *want, *got;
+	struct timeval start;
+	u_int64_t looked[2] = { 0, 0 }, dummy = 0;
+	double secs[2];
+	int ch, npkts = 200000, nrules = 5000, nservices = 40;
+	int quickpct = 2, anypct = 2, failed = 0, i, k;
+
+	while ((ch = getopt(argc, argv, "c:n:P:q:s:w:")) != -1) {
+		switch (ch) {
+		case 'c':
+			npkts = (int)strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			nrules = (int)strtol(optarg, NULL, 0);
+			break;
+		case 'P':
+			nservices = (int)strtol(optarg, NULL, 0);
+			break;
+		case 'q':
+			quickpct = (int)strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = (unsigned int)strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			anypct = (int)strtol(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c packets] [-n rules] "
+			    "[-P services] [-q quick %%] [-s seed] "
+			    "[-w any protocol %%]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (npkts <= 0 || nrules <= 0 || nservices <= 0 ||
+	    quickpct < 0 || quickpct > 100 || anypct < 0 || anypct > 100) {
+		fprintf(stderr, "bad count or percentage\n");
+		exit(1);
+	}
+
+	printf("seed %u\n", seed);
+	srandom(seed);
+	if ((rules = calloc(nrules, sizeof (*rules))) == NULL ||
+	    (pkts = calloc(npkts, sizeof (*pkts))) == NULL ||
+	    (services = calloc(nservices, sizeof (*services))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < nservices; i++)
+		services[i] = 1 + rnd32() % 65535;
+	make_rules(nrules, nservices, anypct, quickpct);
+	make_pkts(npkts, nservices);
+
+	if (pf_rule_index_test() != 0) {
+		printf("pf_rule_index_test failed\n");
+		failed++;
+	}
+
+	ri = ruleset.rules[PF_RULESET_FILTER].index;
+	if (ri == NULL)
+		printf("%d rules, not indexed\n", nrules);
+	else
+		printf("%d rules, index of %u rules, %u TCP and %u UDP port "
+		    "ranges\n", nrules, ri->ri_poolsize, ri->ri_tcp.rp_count,
+		    ri->ri_udp.rp_count);
+
+	for (i = 0; i < npkts; i++) {
+		want = eval_plain(&pkts[i]);
+		for (k = 0; k < 2; k++) {
+			got = eval(k ? ri : NULL, &pkts[i], &dummy);
+			if (got != want && failed++ < 10)
+				printf("packet %d (proto %u port %u): %s walk "
+				    "ends on rule %d, expected %d\n", i,
+				    pkts[i].proto, ntohs(pkts[i].dport),
+				    k ? "indexed" : "linear",
+				    got ? (int)got->nr : -1,
+				    want ? (int)want->nr : -1);
+		}
+	}
+
+	for (k = 0; k < 2; k++) {
+		gettimeofday(&start, NULL);
+		for (i = 0; i < npkts; i++)
+			(void) eval(k ? ri : NULL, &pkts[i], &looked[k]);
+		secs[k] = secs_since(&start);
+		printf("%-8s %8.1f rules/packet %10.0f packets/s\n",
+		    k ? "indexed" : "linear", (double)looked[k] / npkts,
+		    secs[k] > 0 ? npkts / secs[k] : 0.0);
+	}
+
+	pf_rule_index_free(&ruleset, PF_RULESET_FILTER);
+	if (failed) {
+		printf("%d packets evaluated wrongly\n", failed);
+		return (1);
+	}
+	return (0);
+}
@@ -0,0 +1,620 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Test and benchmark of the IPv4 forwarding table.
+ *
+ * Builds bsd/net/route_fib.c and bsd/net/radix.c for user space and
+ * drives them the way rtrequest does: routes are added to and deleted
+ * from a radix tree, each change is reported through rtfib_dirty() and
+ * a generation count bump, and the table is rebuilt after a random
+ * number of changes, so that both the incremental and the full rebuild
+ * are exercised.  Host clones are added and removed behind the table's
+ * back, as rtrequest does.  After every rebuild, lookups at the edges
+ * of the routes changed last, of other routes and of random addresses
+ * must agree with a linear longest prefix match over the routes.
+ * Entries handed to rtfib_retire() must outlive the table that could
+ * still point at them.
+ *
+ * Then a table of -r routes is built, and lookups of random addresses
+ * are timed through the trie and through the radix tree, along with a
+ * full rebuild and an incremental one.
+ *
+ * usage: route_fib [-l lookups] [-n ops] [-r routes] [-s seed]
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <mach/boolean.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * The radix tree builds for user space once <net/radix.h> is in.  All
+ * it needs from the kernel is the longest key of any domain.
+ */
+#define PRIVATE
+#include "../../../bsd/net/radix.h"
+
+typedef struct lck_grp	lck_grp_t;
+typedef struct lck_attr	lck_attr_t;
+
+struct domain {
+	int			dom_maxrtkey;
+	TAILQ_ENTRY(domain)	dom_entry;
+};
+
+static TAILQ_HEAD(, domain) domains = TAILQ_HEAD_INITIALIZER(domains);
+static struct domain inetdomain = { sizeof (struct sockaddr_in) };
+
+#define log(pri, ...)	fprintf(stderr, __VA_ARGS__)
+#define panic(...)	abort()
+#define VM_KERNEL_ADDRPERM(a)	((uintptr_t)(a))
+
+static inline u_int
+min(u_int a, u_int b)
+{
+	return (a < b ? a : b);
+}
+
+#include "../../../bsd/net/radix.c"
+
+/*
+ * The kernel interfaces route_fib.c uses.  Its kernel headers are
+ * skipped by defining their guards; everything it needs from them, and
+ * from route.c, is provided here.
+ */
+#define _SYS_SYSTM_H_
+#define _SYS_MALLOC_H_
+#define _SYS_SYSCTL_H_
+#define _SYS_KERNEL_H_
+#define _SYS_MCACHE_H
+#define _KERN_CLOCK_H_
+#define _KERN_CPU_NUMBER_H_
+#define _KERN_CPU_DATA_H_
+#define _KERN_LOCKS_H_
+#define _KERN_THREAD_CALL_H_
+#define _MACHINE_MACHINE_ROUTINES_H
+#define _NET_IF_VAR_H_
+#define _NET_ROUTE_H_
+#define _NETINET_IP_VAR_H_
+#define _OS_OSATOMIC_H
+
+#define M_RTABLE	0
+#define M_WAITOK	0
+#define M_ZERO		1
+#define _MALLOC(s, t, f)	(((f) & M_ZERO) ? calloc(1, (s)) : malloc(s))
+#define _FREE(p, t)		free(p)
+#define VERIFY(e)	do { if (!(e)) abort(); } while (0)
+
+#define SYSCTL_DECL(name)
+#define SYSCTL_INT(...)
+#define SYSCTL_UINT(...)
+#define SYSCTL_QUAD(...)
+#define SYSCTL_PROC(...)
+#define SYSCTL_HANDLER_ARGS						\
+	(void *oidp, void *arg1, int arg2, void *req)
+#define SYSCTL_OUT(req, p, l)	0
+
+typedef int		lck_mtx_t;
+#define LCK_MTX_ASSERT_OWNED	1
+#define lck_mtx_lock(m)		(void)(m)
+#define lck_mtx_unlock(m)	(void)(m)
+#define lck_mtx_assert(m, t)	(void)(m)
+
+typedef void		*thread_call_t;
+typedef void		*thread_call_param_t;
+#define NSEC_PER_MSEC	1000000ull
+#define thread_call_allocate(f, p)		((thread_call_t)&rtfib_tcall)
+#define thread_call_enter_delayed(c, d)		(void)(d)
+#define clock_interval_to_deadline(i, s, d)	(*(d) = (i) * (s))
+
+#define MAX_CPU_CACHE_LINE_SIZE	64
+#define ml_get_max_cpus()	1
+#define cpu_number()		0
+#define disable_preemption()
+#define enable_preemption()
+
+typedef int32_t		SInt32;
+typedef uint32_t	UInt32;
+#define OSIncrementAtomic(p)		__sync_fetch_and_add((p), 1)
+#define OSDecrementAtomic(p)		__sync_fetch_and_sub((p), 1)
+#define OSCompareAndSwap(o, n, p)	__sync_bool_compare_and_swap((p), (o), (n))
+#define OSMemoryBarrier()		__sync_synchronize()
+
+#ifndef SIN
+#define SIN(s)		((struct sockaddr_in *)(void *)s)
+#endif
+
+#define RTF_UP		0x1
+#define RTF_HOST	0x4
+#define RTF_CLONING	0x100
+#define RTF_WASCLONED	0x20000
+#define RTF_PRCLONING	0x10000
+#define IFSCOPE_NONE	0
+
+struct rtentry {
+	struct radix_node	rt_nodes[2];	/* tree glue, must be first */
+	struct sockaddr_in	rt_dst;
+	struct sockaddr_in	rt_netmask;
+	u_int32_t		rt_flags;
+	int32_t			rt_refcnt;
+	struct rtentry		*rt_parent;
+	void			*rt_ifp;
+	/* used by the harness */
+	u_int32_t		rt_lo;
+	u_int32_t		rt_hi;
+	int			rt_live;
+};
+
+struct route {
+	struct rtentry		*ro_rt;
+	struct sockaddr		ro_dst;
+};
+
+#define rt_key(r)	((struct sockaddr *)(void *)((r)->rt_nodes->rn_key))
+#define rt_mask(r)	((struct sockaddr *)(void *)((r)->rt_nodes->rn_mask))
+#define RT_LOCK_SPIN(r)
+#define RT_UNLOCK(r)
+#define RT_ADDREF_LOCKED(r)	((r)->rt_refcnt++)
+#define RT_GENID_SYNC(r)
+#define rt_validate(r)		TRUE
+#define ROUTE_UNUSABLE(ro)	TRUE
+#define ROUTE_RELEASE(ro)	((ro)->ro_rt = NULL)
+
+static lck_mtx_t rnh_lock_data;
+static lck_mtx_t *rnh_lock = &rnh_lock_data;
+static struct radix_node_head *rt_tables[AF_MAX + 1];
+static uint32_t route_genid_inet;
+static int ip_doscopedroute;
+static int ndestroyed;
+
+#define get_primary_ifscope(af)	IFSCOPE_NONE
+
+static void
+rte_destroy(struct rtentry *rt)
+{
+	VERIFY(!rt->rt_live);
+	ndestroyed++;
+	free(rt);
+}
+
+static struct rtentry *
+rt_lookup_noref(struct sockaddr *dst)
+{
+	struct radix_node_head *rnh = rt_tables[AF_INET];
+	struct radix_node *rn;
+
+	rn = rnh->rnh_matchaddr(dst, rnh);
+	if (rn == NULL || (rn->rn_flags & RNF_ROOT))
+		return (NULL);
+	return ((struct rtentry *)rn);
+}
+
+/* route_fib.c declares the kernel's qsort itself; hand it libc's */
+#define qsort		rtfib_qsort
+
+#define KERNEL
+#include "../../../bsd/net/route_fib.c"
+#undef KERNEL
+#undef qsort
+
+void
+rtfib_qsort(void *base, size_t n, size_t size,
+    int (*cmp)(const void *, const void *))
+{
+	qsort(base, n, size, cmp);
+}
+
+#define MAX_ROUTES	(1024 * 1024)
+#define MAX_TEST_ROUTES	1000
+
+static struct rtentry	**routes;	/* live routes, clones included */
+static int		nroutes;
+static int		nclones;
+static int		failed;
+
+static u_int32_t
+rnd32(void)
+{
+	return (((u_int32_t)random() << 16) ^ (u_int32_t)random());
+}
+
+static double
+secs_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return ((now.tv_sec - start->tv_sec) +
+	    (now.tv_usec - start->tv_usec) / 1e6);
+}
+
+static void
+set_sin(struct sockaddr_in *sin, u_int32_t a)
+{
+	memset(sin, 0, sizeof (*sin));
+	sin->sin_len = sizeof (*sin);
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(a);
+}
+
+/* Longest match over the routes that are not clones */
+static struct rtentry *
+linear_match(u_int32_t a)
+{
+	struct rtentry *rt, *best = NULL;
+	int i;
+
+	for (i = 0; i < nroutes; i++) {
+		rt = routes[i];
+		if (rtfib_clone(rt) || a < rt->rt_lo || a > rt->rt_hi)
+			continue;
+		if (best == NULL || rt->rt_hi - rt->rt_lo <
+		    best->rt_hi - best->rt_lo)
+			best = rt;
+	}
+	return (best);
+}
+
+/*
+ * Delete routes[i] the way rtrequest does: clones do not dirty the
+ * table but still bump the generation count, and the entry is handed
+ * to rtfib_retire() rather than freed.  The clones of a route go with
+ * it, as they would through rt_fixdelete.
+ */
+static void
+del_route(int i)
+{
+	struct radix_node_head *rnh = rt_tables[AF_INET];
+	struct rtentry *rt = routes[i];
+	struct radix_node *rn;
+	int j;
+
+	for (j = nroutes - 1; nclones > 0 && !rtfib_clone(rt) && j >= 0; j--) {
+		if (routes[j]->rt_parent == rt) {
+			del_route(j);
+			if (j < i)
+				i--;
+		}
+	}
+
+	rn = rnh->rnh_deladdr(&rt->rt_dst,
+	    (rt->rt_flags & RTF_HOST) ? NULL : &rt->rt_netmask, rnh);
+	VERIFY(rn == rt->rt_nodes && routes[i] == rt);
+	if (rtfib_clone(rt))
+		nclones--;
+	else
+		rtfib_dirty(rt_key(rt), rt_mask(rt));
+	route_genid_inet++;
+
+	/* Keep the order, so that the indexes of the caller's loop hold */
+	rt->rt_live = 0;
+	memmove(&routes[i], &routes[i + 1], (nroutes - i - 1) * sizeof (*routes));
+	nroutes--;
+	rt->rt_refcnt = 0;
+	rt->rt_parent = NULL;
+	rtfib_retire(rt);
+}
+
+/*
+ * Add a route for a/plen, or a host clone of parent for a.  Adding a
+ * route deletes the clones it now covers, as rt_fixchange would.
+ */
+static struct rtentry *
+add_route(u_int32_t a, int plen, struct rtentry *parent)
+{
+	struct radix_node_head *rnh = rt_tables[AF_INET];
+	struct rtentry *rt;
+	u_int32_t m = plen ? 0xffffffff << (32 - plen) : 0;
+	int i;
+
+	if (nroutes == MAX_ROUTES || (rt = calloc(1, sizeof (*rt))) == NULL)
+		return (NULL);
+	a &= m;
+	set_sin(&rt->rt_dst, a);
+	set_sin(&rt->rt_netmask, m);
+	rt->rt_lo = a;
+	rt->rt_hi = a | ~m;
+	rt->rt_flags = RTF_UP | (plen == 32 ? RTF_HOST : 0);
+	rt->rt_refcnt = 1;
+	if (parent != NULL) {
+		rt->rt_flags |= RTF_WASCLONED;
+		rt->rt_parent = parent;
+	}
+	if (rnh->rnh_addaddr(&rt->rt_dst, plen == 32 ? NULL :
+	    &rt->rt_netmask, rnh, rt->rt_nodes) == NULL) {
+		free(rt);		/* already there */
+		return (NULL);
+	}
+	rt->rt_live = 1;
+
+	if (parent != NULL) {
+		nclones++;
+	} else {
+		for (i = nroutes - 1; nclones > 0 && i >= 0; i--) {
+			if (rtfib_clone(routes[i]) && routes[i]->rt_lo >= a &&
+			    routes[i]->rt_lo <= rt->rt_hi)
+				del_route(i);
+		}
+		rtfib_dirty(rt_key(rt), rt_mask(rt));
+		route_genid_inet++;
+	}
+	routes[nroutes++] = rt;
+	return (rt);
+}
+
+/* Mostly /16 to /24, with some short and host routes */
+static int
+random_plen(void)
+{
+	int r = random() % 16;
+
+	if (r == 0)
+		return (random() % 8);
+	if (r == 1)
+		return (32);
+	return (16 + random() % 9);
+}
+
+static void
+check_addr(u_int32_t a)
+{
+	struct rtentry *want, *got;
+
+	want = linear_match(a);
+	got = rtfib_lookup(a, 0, route_genid_inet);
+	if (got != NULL)
+		got->rt_refcnt--;
+	if (got != want) {
+		if (failed++ < 10)
+			fprintf(stderr, "lookup of %08x: got %p, want %p\n",
+			    a, (void *)got, (void *)want);
+	}
+}
+
+static void
+check_fib(int nrandom)
+{
+	struct rtentry *rt;
+	int i, n;
+
+	if (rtfib_cur == NULL || rtfib_cur->f_genid != route_genid_inet) {
+		if (failed++ < 10)
+			fprintf(stderr, "no current table after rebuild\n");
+		return;
+	}
+	/* The edges of some routes, and of those changed last */
+	for (n = 0; n < 64 && n < nroutes; n++) {
+		i = (n < 16) ? nroutes - 1 - n : random() % nroutes;
+		rt = routes[i];
+		check_addr(rt->rt_lo - 1);
+		check_addr(rt->rt_lo);
+		check_addr(rt->rt_hi);
+		check_addr(rt->rt_hi + 1);
+	}
+	for (i = 0; i < nrandom; i++)
+		check_addr(rnd32());
+}
+
+/* rtfib_update() as the thread call would run it */
+static void
+rebuild(void)
+{
+	rtfib_update(NULL, NULL);
+}
+
+static void
+test(int nops)
+{
+	struct rtentry *rt;
+	u_int32_t a;
+	int i, changes = 0, until = 1;
+
+	for (i = 0; i < nops; i++) {
+		switch (nroutes > MAX_TEST_ROUTES ? 0 : random() % 8) {
+		case 0:
+		case 1:
+		case 2:
+			if (nroutes > 0) {
+				del_route(random() % nroutes);
+				break;
+			}
+			/* FALLTHROUGH */
+		case 3:
+			/* Host clone under whatever covers a random address */
+			a = rnd32();
+			if ((rt = linear_match(a)) != NULL && rt->rt_hi > rt->rt_lo) {
+				(void) add_route(a, 32, rt);
+				break;
+			}
+			/* FALLTHROUGH */
+		default:
+			/* Nest within an existing route half the time */
+			a = (nroutes > 0 && random() % 2) ?
+			    routes[random() % nroutes]->rt_lo | (rnd32() & 0xffff) :
+			    rnd32();
+			(void) add_route(a, random_plen(), NULL);
+			break;
+		}
+
+		if (++changes < until) {
+			/*
+			 * The table must not be used once the generation
+			 * count has moved on; adding a clone leaves it be.
+			 */
+			a = rnd32();
+			if (rtfib_cur != NULL &&
+			    rtfib_cur->f_genid != route_genid_inet &&
+			    linear_match(a) != NULL &&
+			    rtfib_lookup(a, 0, route_genid_inet) != NULL) {
+				if (failed++ < 10)
+					fprintf(stderr, "stale table used\n");
+			}
+			continue;
+		}
+		rebuild();
+		check_fib(64);
+		changes = 0;
+		until = 1 + random() % 12;
+	}
+	rebuild();
+	rebuild();
+
+	printf("%d ops, %d routes: %u rebuilds, %u full, %d entries freed, "
+	    "%u intervals\n", nops, nroutes, rtfib_rebuilds, rtfib_fullbuilds,
+	    ndestroyed, rtfib_nivals);
+}
+
+static void
+bench(int nroute, long nlookups)
+{
+	struct sockaddr_in sin;
+	struct timeval start;
+	struct rtentry *rt;
+	u_int32_t *addrs, sum = 0;
+	double secs;
+	long i;
+
+	while (nroutes > 0)
+		del_route(nroutes - 1);
+	rebuild();
+	rebuild();
+	while (nroutes < nroute)
+		(void) add_route(rnd32(), random_plen(), NULL);
+	(void) add_route(0, 0, NULL);
+
+	/* A full rebuild, as after a primary interface change */
+	rtfib_ndirty = RTFIB_MAXDIRTY + 1;
+	gettimeofday(&start, NULL);
+	rebuild();
+	secs = secs_since(&start);
+	printf("%d routes, %u intervals, %u chunks: full rebuild %.1f ms\n",
+	    nroutes, rtfib_nivals, rtfib_cur->f_nchunks, secs * 1e3);
+
+	(void) add_route(rnd32(), 24, NULL);
+	gettimeofday(&start, NULL);
+	rebuild();
+	secs = secs_since(&start);
+	printf("incremental rebuild after one add %.1f ms\n", secs * 1e3);
+
+	if ((addrs = malloc(65536 * sizeof (*addrs))) == NULL)
+		return;
+	for (i = 0; i < 65536; i++)
+		addrs[i] = rnd32();
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nlookups; i++) {
+		rt = rtfib_lookup(addrs[i & 65535], 0, route_genid_inet);
+		if (rt != NULL) {
+			rt->rt_refcnt--;
+			sum += rt->rt_lo;
+		}
+	}
+	secs = secs_since(&start);
+	printf("trie:  %.1f ns per lookup\n", secs * 1e9 / nlookups);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nlookups; i++) {
+		set_sin(&sin, addrs[i & 65535]);
+		rt = rt_lookup_noref((struct sockaddr *)&sin);
+		if (rt != NULL)
+			sum += rt->rt_lo;
+	}
+	secs = secs_since(&start);
+	printf("radix: %.1f ns per lookup (%08x)\n", secs * 1e9 / nlookups,
+	    sum);
+	free(addrs);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned int seed = (unsigned int)getpid();
+	long nlookups = 10000000;
+	int ch, nops = 10000, nroute = 100000;
+
+	while ((ch = getopt(argc, argv, "l:n:r:s:")) != -1) {
+		switch (ch) {
+		case 'l':
+			nlookups = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			nops = (int)strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			nroute = (int)strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = (unsigned int)strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-l lookups] [-n ops] "
+			    "[-r routes] [-s seed]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (nroute <= 0 || nroute >= MAX_ROUTES / 2 || nlookups <= 0) {
+		fprintf(stderr, "bad route or lookup count\n");
+		exit(1);
+	}
+
+	printf("seed %u\n", seed);
+	srandom(seed);
+	if ((routes = calloc(MAX_ROUTES, sizeof (*routes))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	TAILQ_INSERT_TAIL(&domains, &inetdomain, dom_entry);
+	rn_init();
+	if (!rn_inithead((void **)&rt_tables[AF_INET],
+	    offsetof(struct sockaddr_in, sin_addr) << 3)) {
+		fprintf(stderr, "rn_inithead failed\n");
+		exit(1);
+	}
+	rtfib_init();
+
+	test(nops);
+	if (failed) {
+		printf("%d lookups failed\n", failed);
+		return (1);
+	}
+	bench(nroute, nlookups);
+	return (0);
+}
@@ -0,0 +1,764 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * ACK replay for the TCP SACK scoreboard.
+ *
+ * Builds bsd/netinet/tcp_sack.c for user space and feeds it a sequence
+ * of ACKs with SACK blocks, the way tcp_input() does: each ACK goes to
+ * tcp_sack_doack() before snd_una moves, and the sender then asks
+ * tcp_sack_output() for the next hole and retransmits one segment
+ * from it, as tcp_output() would.
+ *
+ * The ACKs are read from a trace file (-f), or made up: -r windows of
+ * -w segments are sent with bursts of losses (a burst starts at a
+ * segment with probability -l percent and is up to -b segments long),
+ * with -d percent of the segments held back until the rest of the
+ * window is in.  A receiver builds its SACK blocks with
+ * tcp_update_sack_list() as the segments and the retransmissions come
+ * in.  The trace made up can
+ * be saved with -o.  It is a line "mss <bytes>", then for each window a
+ * line "window <bytes>" followed by one line per ACK:
+ *
+ *	ack <ack> [<start>-<end> ...]
+ *
+ * with the sequence numbers given as offsets from the first one.
+ *
+ * The trace is replayed once with checks: after every ACK the
+ * scoreboard must hold exactly the ranges below snd_fack that no ACK
+ * has covered, its tree must agree with its list, its byte counts must
+ * add up, and tcp_sack_output() must pick the first hole that still
+ * has data to retransmit.  The replay exits non-zero if any of this
+ * fails.  It is then replayed -n more times to measure the time per
+ * ACK.
+ *
+ * By default a connection may have up to 65536 holes, rather than the
+ * 128 of net.inet.tcp.sack_maxholes, so that large windows with many
+ * losses keep their whole scoreboard; -m sets the limit.  While the
+ * scoreboard is short of holes it does not have to match the ACKs.
+ *
+ * usage: tcp_sack_replay [-b burst] [-d late %] [-f trace] [-l loss %]
+ *     [-m holes] [-n replays] [-o trace] [-r windows] [-s seed]
+ *     [-w segments]
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <mach/boolean.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include "../../../bsd/netinet/tcp_seq.h"
+
+#ifndef TCPOLEN_SACK
+#define TCPOLEN_SACK	8
+#endif
+#ifndef MAX_SACK_BLKS
+#define MAX_SACK_BLKS	6
+#endif
+#ifndef TCP_MAX_SACK
+#define TCP_MAX_SACK	4
+#endif
+
+/*
+ * The parts of <netinet/tcp_var.h> that tcp_sack.c uses.  The kernel
+ * headers it includes are skipped by defining their guards.
+ */
+struct sackblk {
+	tcp_seq start;
+	tcp_seq end;
+};
+
+struct sackhole {
+	tcp_seq start;
+	tcp_seq end;
+	tcp_seq rxmit;
+	u_int32_t rxmit_start;
+	TAILQ_ENTRY(sackhole) scblink;
+	RB_ENTRY(sackhole) scbnode;
+};
+
+struct sackhint {
+	struct sackhole	*nexthole;
+	int	sack_bytes_rexmit;
+	u_int32_t sack_bytes_holes;
+};
+
+#define TCPT_REXMT	2
+#define TCPT_NTIMERS	7
+
+struct tcpcb {
+	uint32_t	t_timer[TCPT_NTIMERS];
+	uint32_t	t_flags;
+	tcp_seq		snd_una;
+	tcp_seq		snd_max;
+	tcp_seq		snd_nxt;
+	tcp_seq		rcv_nxt;
+	u_int32_t	snd_cwnd;
+	u_int32_t	snd_ssthresh;
+	int		t_rtttime;
+	u_int		t_maxseg;
+	int		t_srtt;
+	u_int16_t	t_rxtshift;
+	u_int16_t	t_reorderwin;
+	TAILQ_HEAD(sackhole_head, sackhole) snd_holes;
+	RB_HEAD(sackhole_tree, sackhole) snd_holetree;
+	int16_t		snd_numholes;
+	tcp_seq		snd_fack;
+	int		rcv_numsacks;
+	struct sackblk	sackblks[MAX_SACK_BLKS];
+	tcp_seq		sack_newdata;
+	struct sackhint	sackhint;
+	uint32_t	t_flagsext;
+};
+
+struct tcpopt {
+	u_int8_t	to_nsacks;
+	u_char		*to_sacks;
+};
+
+#define TF_ACKNOW		0x00001
+#define TF_FASTRECOVERY		0x200000
+#define TF_STRETCHACK		0x80000000
+#define TF_SACK_ENABLE		0x20
+#define TF_PKTS_REORDERED	0x2000
+#define TCP_RTT_SHIFT		5
+#define IN_FASTRECOVERY(tp)	(tp->t_flags & TF_FASTRECOVERY)
+#define SACK_ENABLED(tp)	(tp->t_flagsext & TF_SACK_ENABLE)
+#define BYTES_ACKED(_th_, _tp_)	((_th_)->th_ack - (_tp_)->snd_una)
+
+struct {
+	u_int32_t	tcps_sack_sboverflow;
+	u_int32_t	tcps_reordered_pkts;
+	u_int32_t	tcps_detect_reordering;
+	u_int32_t	tcps_avoid_rxmt;
+} tcpstat;
+
+static u_int32_t tcp_now;
+static int tcprexmtthresh = 3;
+struct zone *sack_hole_zone;
+
+typedef int32_t	SInt32;
+
+#define _SYS_SYSTM_H_
+#define _SYS_KERNEL_H_
+#define _SYS_SYSCTL_H_
+#define _SYS_MBUF_H_
+#define _SYS_DOMAIN_H_
+#define _SYS_PROTOSW_H_
+#define _SYS_SOCKETVAR_H_
+#define _KERN_ZALLOC_H_
+#define _NET_ROUTE_H_
+#define _NETINET_IN_PCB_H_
+#define _NETINET_IP_VAR_H_
+#define _NETINET_TCP_FSM_H_
+#define _NETINET_TCP_TIMER_H_
+#define _NETINET_TCP_VAR_H_
+#define _NETINET_TCPIP_H_
+#define BSD_SYS_KDEBUG_H
+#define _OS_OSATOMIC_H
+
+#define SYSCTL_INT(...)
+#define VERIFY(e)	do {						\
+	if (!(e)) {							\
+		printf("%s:%d: VERIFY(%s) failed\n",			\
+		    __FILE__, __LINE__, #e);				\
+		abort();						\
+	}								\
+} while (0)
+#define zalloc(z)	malloc(sizeof (struct sackhole))
+#define zfree(z, p)	free(p)
+#define OSIncrementAtomic(p)	((*(p))++)
+#define OSDecrementAtomic(p)	((*(p))--)
+
+static inline u_int
+max(u_int a, u_int b)
+{
+	return (a > b ? a : b);
+}
+
+static inline u_int
+min(u_int a, u_int b)
+{
+	return (a < b ? a : b);
+}
+
+static int32_t
+timer_diff(uint32_t t1, uint32_t toff1, uint32_t t2, uint32_t toff2)
+{
+	return ((int32_t)((t1 + toff1) - (t2 + toff2)));
+}
+
+static void
+tcp_reset_stretch_ack(struct tcpcb *tp)
+{
+	tp->t_flags &= ~TF_STRETCHACK;
+}
+
+/* Nothing is sent from tcp_sack_partialack(); the replay does that */
+#define tcp_output(tp)	(0)
+
+#include "../../../bsd/netinet/tcp_sack.c"
+
+/*
+ * The trace: one record per ACK, or per window when nsacks is -1, with
+ * sequence numbers as offsets from iss.
+ */
+struct ackrec {
+	int		nsacks;
+	tcp_seq		ack;		/* or the window size */
+	struct sackblk	sacks[TCP_MAX_SACK];
+};
+
+static struct ackrec *trace;
+static int ntrace, maxtrace;
+static u_int32_t mss = 1448;
+static tcp_seq iss;
+
+static struct tcpcb sender;
+static u_int64_t nacks, nholes, nblocks;
+static int maxholes;
+static int failed;
+
+/* What the ACKs have covered so far, one bit per byte would be too much */
+static u_int8_t *covered;
+static tcp_seq covered_base;
+static u_int32_t covered_len;
+
+static u_int32_t
+rnd32(void)
+{
+	return (((u_int32_t)random() << 16) ^ (u_int32_t)random());
+}
+
+static double
+secs_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return ((now.tv_sec - start->tv_sec) +
+	    (now.tv_usec - start->tv_usec) / 1e6);
+}
+
+static struct ackrec *
+trace_add(void)
+{
+	if (ntrace == maxtrace) {
+		maxtrace = maxtrace ? maxtrace * 2 : 4096;
+		if ((trace = realloc(trace, maxtrace * sizeof (*trace))) ==
+		    NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memset(&trace[ntrace], 0, sizeof (trace[ntrace]));
+	return (&trace[ntrace++]);
+}
+
+static void
+sender_reset(void)
+{
+	tcp_free_sackholes(&sender);
+	memset(&sender, 0, sizeof (sender));
+	TAILQ_INIT(&sender.snd_holes);
+	RB_INIT(&sender.snd_holetree);
+	sender.t_maxseg = mss;
+	sender.t_flagsext = TF_SACK_ENABLE;
+	sender.t_srtt = 100 << TCP_RTT_SHIFT;
+	sender.snd_una = sender.snd_nxt = sender.snd_max = iss;
+}
+
+/*
+ * The sender's side of an ACK: the scoreboard is updated, snd_una
+ * moves, and one segment is retransmitted from the next hole, if any.
+ * Returns the sequence number retransmitted, or snd_max if none was.
+ */
+static tcp_seq
+sender_ack(const struct ackrec *a)
+{
+	struct sackblk blks[TCP_MAX_SACK];
+	struct sackhole *p;
+	struct tcphdr th;
+	struct tcpopt to;
+	u_int32_t newbytes = 0;
+	tcp_seq seq;
+	int i, len, rexmt;
+
+	for (i = 0; i < a->nsacks; i++) {
+		blks[i].start = htonl(iss + a->sacks[i].start);
+		blks[i].end = htonl(iss + a->sacks[i].end);
+	}
+	memset(&th, 0, sizeof (th));
+	th.th_ack = iss + a->ack;
+	to.to_nsacks = a->nsacks;
+	to.to_sacks = (u_char *)blks;
+
+	tcp_now++;
+	if (to.to_nsacks > 0 || !TAILQ_EMPTY(&sender.snd_holes))
+		tcp_sack_doack(&sender, &to, &th, &newbytes);
+	if (SEQ_GT(th.th_ack, sender.snd_una))
+		sender.snd_una = th.th_ack;
+	if (sender.snd_una == sender.snd_max) {
+		tcp_free_sackholes(&sender);
+		return (sender.snd_max);
+	}
+
+	if ((p = tcp_sack_output(&sender, &rexmt)) == NULL)
+		return (sender.snd_max);
+	seq = p->rxmit;
+	len = min(mss, p->end - p->rxmit);
+	p->rxmit += len;
+	sender.sackhint.sack_bytes_rexmit += len;
+	return (seq);
+}
+
+static void
+check_fail(const char *what, tcp_seq seq)
+{
+	if (failed++ < 10)
+		printf("ACK %llu: %s at %u\n", (unsigned long long)nacks,
+		    what, seq - iss);
+}
+
+static int
+is_covered(tcp_seq seq)
+{
+	u_int32_t i = (seq - covered_base) / mss;
+
+	return (i < covered_len && covered[i]);
+}
+
+/*
+ * Check the scoreboard against the ranges the ACKs have covered, and
+ * against itself.
+ */
+static void
+check(int exact)
+{
+	struct sackhole *p, *t, *first = NULL;
+	u_int32_t bytes = 0;
+	tcp_seq seq;
+	int n = 0, rexmt, sum = 0, found = 0;
+
+	t = RB_MIN(sackhole_tree, &sender.snd_holetree);
+	TAILQ_FOREACH(p, &sender.snd_holes, scblink) {
+		if (p != t)
+			check_fail("tree and list disagree", p->start);
+		t = (t != NULL) ? RB_NEXT(sackhole_tree,
+		    &sender.snd_holetree, t) : NULL;
+		if (SEQ_GEQ(p->start, p->end) ||
+		    SEQ_LT(p->rxmit, p->start) || SEQ_GT(p->rxmit, p->end))
+			check_fail("bad hole", p->start);
+		if (SEQ_LT(p->start, sender.snd_una) ||
+		    SEQ_GT(p->end, sender.snd_fack))
+			check_fail("hole out of range", p->start);
+		if (TAILQ_NEXT(p, scblink) != NULL &&
+		    SEQ_GEQ(p->end, TAILQ_NEXT(p, scblink)->start))
+			check_fail("holes overlap or touch", p->end);
+		bytes += p->end - p->start;
+		sum += p->rxmit - p->start;
+		if (first == NULL && SEQ_LT(p->rxmit, p->end))
+			first = p;
+		n++;
+	}
+	if (t != NULL)
+		check_fail("tree has more holes than list", t->start);
+	if (n != sender.snd_numholes)
+		check_fail("hole count", sender.snd_una);
+	if (bytes != sender.sackhint.sack_bytes_holes)
+		check_fail("bytes in holes", sender.snd_una);
+	if (sum != sender.sackhint.sack_bytes_rexmit)
+		check_fail("bytes retransmitted", sender.snd_una);
+	if (tcp_sack_output(&sender, &rexmt) != first)
+		check_fail("next hole", first != NULL ?
+		    first->rxmit : sender.snd_una);
+
+	nholes += n;
+	if (n > maxholes)
+		maxholes = n;
+	if (!exact || TAILQ_EMPTY(&sender.snd_holes))
+		return;
+
+	/* Every hole is a maximal uncovered range below snd_fack */
+	p = TAILQ_FIRST(&sender.snd_holes);
+	for (seq = sender.snd_una; SEQ_LT(seq, sender.snd_fack); seq += mss) {
+		if (is_covered(seq)) {
+			if (p != NULL && SEQ_LEQ(p->start, seq) &&
+			    SEQ_LT(seq, p->end))
+				check_fail("covered range in hole", seq);
+			continue;
+		}
+		if (p == NULL || SEQ_LT(seq, p->start) ||
+		    SEQ_GEQ(seq, p->end)) {
+			check_fail("uncovered range not in hole", seq);
+			break;
+		}
+		found = 1;
+		if (seq + mss == p->end)
+			p = TAILQ_NEXT(p, scblink);
+	}
+	if (!found || p != NULL)
+		check_fail("holes beyond snd_fack", sender.snd_fack);
+}
+
+/*
+ * Replay the trace once; with checks, every ACK is also applied to the
+ * covered map and the scoreboard checked against it.
+ */
+static void
+replay(int checked)
+{
+	struct ackrec *a;
+	u_int32_t overflow = 0, i, j;
+	int k;
+
+	sender_reset();
+	for (k = 0; k < ntrace; k++) {
+		a = &trace[k];
+		if (a->nsacks < 0) {
+			sender.snd_max = sender.snd_una + a->ack;
+			sender.snd_nxt = sender.snd_max;
+			if (!checked)
+				continue;
+			covered_base = sender.snd_una;
+			covered_len = a->ack / mss;
+			memset(covered, 0, covered_len);
+			overflow = tcpstat.tcps_sack_sboverflow;
+			continue;
+		}
+		(void) sender_ack(a);
+		if (!checked)
+			continue;
+		nacks++;
+		nblocks += a->nsacks;
+		for (i = 0; i < covered_len &&
+		    SEQ_LT(covered_base + i * mss, iss + a->ack); i++)
+			covered[i] = 1;
+		for (j = 0; j < (u_int32_t)a->nsacks; j++) {
+			for (i = (iss + a->sacks[j].start - covered_base) / mss;
+			    i < covered_len && SEQ_LT(covered_base + i * mss,
+			    iss + a->sacks[j].end); i++)
+				covered[i] = 1;
+		}
+		check(tcpstat.tcps_sack_sboverflow == overflow);
+	}
+	if (sender.snd_una != sender.snd_max || sender.snd_numholes != 0)
+		check_fail("trace does not end acked", sender.snd_una);
+	tcp_free_sackholes(&sender);
+}
+
+/*
+ * Make up a trace: each window is sent with bursts of losses, and the
+ * receiver answers every segment and retransmission with an ACK that
+ * carries its SACK blocks.  The segments held back arrive after the
+ * rest of the window, and the retransmissions after those, about a
+ * round trip later; neither is lost.
+ */
+static void
+generate(int nwin, int wsegs, double loss, int burst, double late)
+{
+	struct tcpcb rcv;
+	struct ackrec *a;
+	tcp_seq base, seq, *queue;
+	u_int8_t *lost, *rcvd;
+	int w, i, head, tail, b, n;
+
+	if ((queue = malloc(4 * wsegs * sizeof (*queue))) == NULL ||
+	    (lost = malloc(wsegs)) == NULL || (rcvd = malloc(wsegs)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	a = trace_add();
+	sender_reset();
+	memset(&rcv, 0, sizeof (rcv));
+	rcv.rcv_nxt = iss;
+
+	for (w = 0; w < nwin; w++) {
+		base = sender.snd_una;
+		memset(lost, 0, wsegs);
+		memset(rcvd, 0, wsegs);
+		/*
+		 * 1 is lost, 2 is late.  The last segment always makes it
+		 * on time; there is no RTO here.
+		 */
+		for (i = 0; i < wsegs - 1; ) {
+			if (rnd32() % 100000 < loss * 1000) {
+				for (b = 1 + rnd32() % burst;
+				    b > 0 && i < wsegs - 1; b--)
+					lost[i++] = 1;
+				continue;
+			}
+			if (rnd32() % 100000 < late * 1000)
+				lost[i] = 2;
+			i++;
+		}
+		a = trace_add();
+		a->nsacks = -1;
+		a->ack = wsegs * mss;
+		sender.snd_max = sender.snd_nxt = base + wsegs * mss;
+
+		head = tail = 0;
+		for (i = 0; i < wsegs; i++) {
+			if (!lost[i])
+				queue[tail++] = base + i * mss;
+		}
+		for (i = 0; i < wsegs; i++) {
+			if (lost[i] == 2)
+				queue[tail++] = base + i * mss;
+		}
+		while (head < tail) {
+			seq = queue[head++];
+			i = (seq - base) / mss;
+			if (!rcvd[i]) {
+				rcvd[i] = 1;
+				if (seq == rcv.rcv_nxt) {
+					while (i < wsegs && rcvd[i]) {
+						rcv.rcv_nxt += mss;
+						i++;
+					}
+				} else {
+					tcp_update_sack_list(&rcv, seq,
+					    seq + mss);
+				}
+			}
+
+			a = trace_add();
+			a->ack = rcv.rcv_nxt - iss;
+			for (n = 0; n < rcv.rcv_numsacks &&
+			    a->nsacks < TCP_MAX_SACK; n++) {
+				if (SEQ_LEQ(rcv.sackblks[n].start, rcv.rcv_nxt))
+					continue;
+				a->sacks[a->nsacks].start =
+				    rcv.sackblks[n].start - iss;
+				a->sacks[a->nsacks++].end =
+				    rcv.sackblks[n].end - iss;
+			}
+
+			seq = sender_ack(a);
+			if (seq != sender.snd_max && tail < 4 * wsegs)
+				queue[tail++] = seq;
+		}
+		if (sender.snd_una != sender.snd_max) {
+			printf("window %d stalled at %u\n", w,
+			    sender.snd_una - base);
+			failed++;
+			break;
+		}
+	}
+	/* The first record was a placeholder for the mss */
+	trace[0].nsacks = -2;
+	free(queue);
+	free(lost);
+	free(rcvd);
+}
+
+static void
+trace_write(const char *path)
+{
+	struct ackrec *a;
+	FILE *fp;
+	int k, i;
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fprintf(fp, "mss %u\n", mss);
+	for (k = 0; k < ntrace; k++) {
+		a = &trace[k];
+		if (a->nsacks == -2)
+			continue;
+		if (a->nsacks == -1) {
+			fprintf(fp, "window %u\n", a->ack);
+			continue;
+		}
+		fprintf(fp, "ack %u", a->ack);
+		for (i = 0; i < a->nsacks; i++)
+			fprintf(fp, " %u-%u", a->sacks[i].start,
+			    a->sacks[i].end);
+		fprintf(fp, "\n");
+	}
+	fclose(fp);
+}
+
+static void
+trace_read(const char *path)
+{
+	struct ackrec *a;
+	char line[256], *p, *end;
+	FILE *fp;
+	int lineno = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		lineno++;
+		if (strncmp(line, "mss ", 4) == 0) {
+			mss = (u_int32_t)strtoul(line + 4, NULL, 0);
+		} else if (strncmp(line, "window ", 7) == 0) {
+			a = trace_add();
+			a->nsacks = -1;
+			a->ack = (tcp_seq)strtoul(line + 7, NULL, 0);
+		} else if (strncmp(line, "ack ", 4) == 0) {
+			a = trace_add();
+			a->ack = (tcp_seq)strtoul(line + 4, &p, 0);
+			while (a->nsacks < TCP_MAX_SACK) {
+				a->sacks[a->nsacks].start =
+				    (tcp_seq)strtoul(p, &end, 0);
+				if (end == p || *end != '-')
+					break;
+				p = end + 1;
+				a->sacks[a->nsacks++].end =
+				    (tcp_seq)strtoul(p, &p, 0);
+			}
+		} else if (line[0] != '#' && line[0] != '\n') {
+			fprintf(stderr, "%s:%d: bad line\n", path, lineno);
+			exit(1);
+		}
+	}
+	fclose(fp);
+	if (mss == 0) {
+		fprintf(stderr, "%s: bad mss\n", path);
+		exit(1);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned int seed = (unsigned int)getpid();
+	const char *in = NULL, *out = NULL;
+	struct timeval start;
+	double loss = 1.0, late = 1.0, secs;
+	int ch, burst = 8, nwin = 20, wsegs = 4096, nreplays = 20, i;
+	u_int32_t window = 0;
+
+	tcp_sack_maxholes = 65536;
+	while ((ch = getopt(argc, argv, "b:d:f:l:m:n:o:r:s:w:")) != -1) {
+		switch (ch) {
+		case 'b':
+			burst = (int)strtol(optarg, NULL, 0);
+			break;
+		case 'd':
+			late = strtod(optarg, NULL);
+			break;
+		case 'f':
+			in = optarg;
+			break;
+		case 'l':
+			loss = strtod(optarg, NULL);
+			break;
+		case 'm':
+			tcp_sack_maxholes = (int)strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			nreplays = (int)strtol(optarg, NULL, 0);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'r':
+			nwin = (int)strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = (unsigned int)strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			wsegs = (int)strtol(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b burst] [-d late %%] "
+			    "[-f trace] [-l loss %%] [-m holes] [-n replays] "
+			    "[-o trace] [-r windows] [-s seed] [-w segments]\n",
+			    argv[0]);
+			exit(1);
+		}
+	}
+	if (burst <= 0 || nwin <= 0 || wsegs < 2 || nreplays <= 0 ||
+	    loss < 0 || loss > 100 || late < 0 || late > 100) {
+		fprintf(stderr, "bad burst, percentage, window or count\n");
+		exit(1);
+	}
+	tcp_sack_globalmaxholes = tcp_sack_maxholes;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	printf("seed %u\n", seed);
+	srandom(seed);
+	iss = rnd32();
+
+	if (in != NULL) {
+		trace_read(in);
+	} else {
+		generate(nwin, wsegs, loss, burst, late);
+		if (out != NULL)
+			trace_write(out);
+	}
+	for (i = 0; i < ntrace; i++) {
+		if (trace[i].nsacks == -1 && trace[i].ack > window)
+			window = trace[i].ack;
+	}
+	if ((covered = malloc(window / mss + 1)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	replay(1);
+	printf("%llu ACKs, %llu SACK blocks, %.1f holes per ACK, at most %d, "
+	    "%u overflows\n", (unsigned long long)nacks,
+	    (unsigned long long)nblocks,
+	    nacks > 0 ? (double)nholes / nacks : 0.0, maxholes,
+	    tcpstat.tcps_sack_sboverflow);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nreplays; i++)
+		replay(0);
+	secs = secs_since(&start);
+	printf("%.1f ns per ACK\n", nacks > 0 ?
+	    secs * 1e9 / ((double)nacks * nreplays) : 0.0);
+
+	if (failed) {
+		printf("%d checks failed\n", failed);
+		return (1);
+	}
+	return (0);
+}
@@ -0,0 +1,476 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Benchmark for the TCP timer wheel.
+ *
+ * Builds bsd/netinet/tcp_timer_wheel.c for user space and drives it the
+ * way tcp_sched_timers() and tcp_run_timerlist() do, on -n simulated
+ * connections.  Time is simulated in tcp_now ticks of 1ms.  Most of the
+ * connections are idle, with a keepalive deadline up to two hours out;
+ * -a percent of them are active.  Every tick, -r segments on random
+ * active connections push their retransmit deadline out (one in eight
+ * pulls it in, as a delayed ACK would), and -c random connections are
+ * closed and replaced by new ones.  Every -p ticks the timer list runs:
+ * it collects the slots that have come due, fires the connections whose
+ * deadline has passed, which then arm their next timer, and refiles the
+ * rest.
+ *
+ * Every timer must fire on the first run at or after its deadline.
+ * Every thousand runs, and at the end, the wheel is also checked against
+ * the connections: its entry counts must match, no armed connection may
+ * be overdue, and the next run tcp_timer_next() asks for must not be
+ * later than the earliest deadline, or than the next slot if the wheel
+ * is already past that deadline's.  The benchmark exits non-zero if any
+ * of this fails.
+ *
+ * The time spent arming, cancelling and running the list is reported,
+ * next to the time a walk of every connection with a timer, as the
+ * timer list did before the wheel, takes.
+ *
+ * usage: tcp_timerwheel [-a active %] [-c closes/tick] [-d seconds]
+ *     [-n connections] [-p ticks] [-r segments/tick] [-s seed]
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/boolean.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+/*
+ * <netinet/tcp_timer.h> is used as is, for the wheel's layout; only the
+ * lock and thread call types its timer list refers to are needed.
+ */
+typedef struct lck_mtx		lck_mtx_t;
+typedef struct lck_attr		lck_attr_t;
+typedef struct lck_grp		lck_grp_t;
+typedef struct lck_grp_attr	lck_grp_attr_t;
+typedef struct thread_call	*thread_call_t;
+
+#define _KERN_THREAD_CALL_H_
+#define BSD_KERNEL_PRIVATE
+#include "../../../bsd/netinet/tcp_seq.h"
+#include "../../../bsd/netinet/tcp_timer.h"
+
+/*
+ * The kernel interfaces tcp_timer_wheel.c uses.  Its kernel headers are
+ * skipped by defining their guards.
+ */
+#define _SYS_SYSTM_H_
+#define _KERN_LOCKS_H_
+#define _NETINET_TCP_VAR_H_
+
+#define VERIFY(e)	do { if (!(e)) abort(); } while (0)
+
+static u_int32_t tcp_now;
+
+static int32_t
+timer_diff(uint32_t t1, uint32_t toff1, uint32_t t2, uint32_t toff2)
+{
+	return ((int32_t)((t1 + toff1) - (t2 + toff2)));
+}
+
+#include "../../../bsd/netinet/tcp_timer_wheel.c"
+
+#define TCP_RETRANSHZ	1000		/* tcp_now ticks per second */
+#define KEEPIDLE	(120 * 60 * TCP_RETRANSHZ)
+#define KEEPINIT	(75 * TCP_RETRANSHZ)
+#define DELACK		(TCP_RETRANSHZ / 10)
+
+struct conn {
+	struct tcptimerentry	te;		/* first, see run() */
+	struct conn		*scan_next;	/* for the list walk */
+	int			onlist;
+	int			active;
+};
+
+static struct tcptimerlist list;
+static struct conn *conns;
+static int nconns = 1000000;
+static int pct_active = 1;
+static int period = 10;
+
+static u_int64_t narmed, nmoved, ncancelled, nfired, nrefiled, nruns;
+static u_int32_t maxlate;
+static int failed;
+
+static volatile u_int64_t scan_due;
+
+static u_int32_t
+rnd32(void)
+{
+	return (((u_int32_t)random() << 16) ^ (u_int32_t)random());
+}
+
+static double
+secs_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return ((now.tv_sec - start->tv_sec) +
+	    (now.tv_usec - start->tv_usec) / 1e6);
+}
+
+/* A retransmit timeout between 200ms and 1s */
+static u_int32_t
+rto(void)
+{
+	return (TCP_RETRANSHZ / 5 + rnd32() % (TCP_RETRANSHZ * 4 / 5));
+}
+
+/*
+ * Arm a connection's timer for runtime, as tcp_sched_timers() does: a
+ * new entry is filed, and one already on the wheel only moves if its
+ * deadline is now earlier than its slot.
+ */
+static void
+arm(struct conn *c, u_int32_t runtime)
+{
+	struct tcptimerentry *te = &c->te;
+
+	te->runtime = runtime;
+	narmed++;
+	if (!c->onlist) {
+		tcp_timer_insert(&list, te, runtime);
+		c->onlist = 1;
+		list.entries++;
+	} else if (te->level != TCP_TIMERWHEEL_RUN &&
+	    TSTMP_LT(runtime, te->wheeltime)) {
+		tcp_timer_unlink(&list, te);
+		tcp_timer_insert(&list, te, runtime);
+		nmoved++;
+	}
+}
+
+static void
+cancel(struct conn *c)
+{
+	if (!c->onlist)
+		return;
+	tcp_timer_unlink(&list, &c->te);
+	c->onlist = 0;
+	list.entries--;
+	ncancelled++;
+}
+
+static void
+open_conn(struct conn *c)
+{
+	c->active = (int)(rnd32() % 100) < pct_active;
+	if (c->active)
+		arm(c, tcp_now + rto());
+	else
+		arm(c, tcp_now + 1 + rnd32() % KEEPIDLE);
+}
+
+/*
+ * A timer has fired; it must not have waited past the first run after
+ * its deadline.  The connection then arms its next timer.
+ */
+static void
+fire(struct conn *c)
+{
+	u_int32_t late = tcp_now - c->te.runtime;
+
+	if (late > maxlate)
+		maxlate = late;
+	if (late >= (u_int32_t)period) {
+		if (failed++ < 10)
+			printf("connection %ld fired %u ticks late\n",
+			    (long)(c - conns), late);
+	}
+	nfired++;
+	if (c->active)
+		arm(c, tcp_now + rto());
+	else
+		arm(c, tcp_now + KEEPIDLE);
+}
+
+/*
+ * Run the timer list, as tcp_run_timerlist() does: the slots that have
+ * come due are collected onto lhead, and their entries either fire or,
+ * when collected ahead of their deadline, are refiled.
+ */
+static void
+run(void)
+{
+	struct tcptimerentry *te;
+
+	list.running = TRUE;
+	tcp_timer_collect(&list);
+	while ((te = LIST_FIRST(&list.lhead)) != NULL) {
+		tcp_timer_unlink(&list, te);
+		if (TSTMP_GT(te->runtime, tcp_now)) {
+			tcp_timer_insert(&list, te, te->runtime);
+			nrefiled++;
+			continue;
+		}
+		/* Off the list while it runs, as tcp_run_conn_timer() */
+		((struct conn *)(void *)te)->onlist = 0;
+		list.entries--;
+		fire((struct conn *)(void *)te);
+	}
+	list.running = FALSE;
+	nruns++;
+}
+
+static void
+check(void)
+{
+	struct tcptimerentry *te;
+	u_int32_t l0 = 0, total = 0, minrt = 0, t;
+	u_int16_t mode;
+	int i, have_min = 0;
+
+	for (i = 0; i < TCP_TIMERWHEEL_SLOTS; i++) {
+		LIST_FOREACH(te, &list.l0[i], le) {
+			l0++;
+			total++;
+		}
+		LIST_FOREACH(te, &list.l1[i], le)
+			total++;
+	}
+	if (l0 != list.l0entries || total != list.entries) {
+		printf("at %u: %u/%u entries on level 0, %u/%u in all\n",
+		    tcp_now, l0, list.l0entries, total, list.entries);
+		failed++;
+	}
+
+	for (i = 0; i < nconns; i++) {
+		if (!conns[i].onlist)
+			continue;
+		t = conns[i].te.runtime;
+		if (TSTMP_LEQ(t, tcp_now)) {
+			if (failed++ < 10)
+				printf("at %u: connection %d overdue since "
+				    "%u\n", tcp_now, i, t);
+		}
+		if (!have_min || TSTMP_LT(t, minrt)) {
+			minrt = t;
+			have_min = 1;
+		}
+	}
+
+	t = tcp_timer_next(&list, &mode);
+	if (have_min && (t == 0 || (TSTMP_GT(tcp_now + t, minrt) &&
+	    TSTMP_GT(tcp_now + t, list.wheeltime)))) {
+		printf("at %u: next run in %u ticks, first deadline at %u\n",
+		    tcp_now, t, minrt);
+		failed++;
+	}
+}
+
+/*
+ * The walk the timer list used to make on every run: every connection
+ * with a timer, in no particular order, to find the ones that are due.
+ */
+static double
+scan(struct conn *head, int nscans)
+{
+	struct timeval start;
+	struct conn *c;
+	int i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nscans; i++) {
+		for (c = head; c != NULL; c = c->scan_next) {
+			if (c->onlist && TSTMP_LEQ(c->te.runtime, tcp_now))
+				scan_due++;
+		}
+	}
+	return (secs_since(&start) / nscans);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned int seed = (unsigned int)getpid();
+	struct timeval start;
+	struct conn *c, *head = NULL, **closed, **segs;
+	u_int32_t *when;
+	u_int64_t arms = 0, cancels = 0;
+	int ch, duration = 60, nsegs = 1000, ncloses = 10;
+	int *order, i, j, k, tick, nactive;
+	double secs, t_arm = 0, t_cancel = 0, t_run = 0;
+
+	while ((ch = getopt(argc, argv, "a:c:d:n:p:r:s:")) != -1) {
+		switch (ch) {
+		case 'a':
+			pct_active = (int)strtol(optarg, NULL, 0);
+			break;
+		case 'c':
+			ncloses = (int)strtol(optarg, NULL, 0);
+			break;
+		case 'd':
+			duration = (int)strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			nconns = (int)strtol(optarg, NULL, 0);
+			break;
+		case 'p':
+			period = (int)strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			nsegs = (int)strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = (unsigned int)strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-a active %%] "
+			    "[-c closes/tick] [-d seconds] [-n connections] "
+			    "[-p ticks] [-r segments/tick] [-s seed]\n",
+			    argv[0]);
+			exit(1);
+		}
+	}
+	if (nconns <= 0 || period <= 0 || duration <= 0 || nsegs < 0 ||
+	    ncloses < 0 || pct_active < 0 || pct_active > 100) {
+		fprintf(stderr, "bad connection count, rate or duration\n");
+		exit(1);
+	}
+
+	printf("seed %u\n", seed);
+	srandom(seed);
+	if ((conns = calloc(nconns, sizeof (*conns))) == NULL ||
+	    (order = malloc(nconns * sizeof (*order))) == NULL ||
+	    (closed = malloc((ncloses + 1) * sizeof (*closed))) == NULL ||
+	    (segs = malloc((nsegs + 1) * sizeof (*segs))) == NULL ||
+	    (when = malloc((nsegs + 1) * sizeof (*when))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	LIST_INIT(&list.lhead);
+	for (i = 0; i < TCP_TIMERWHEEL_SLOTS; i++) {
+		LIST_INIT(&list.l0[i]);
+		LIST_INIT(&list.l1[i]);
+	}
+	tcp_now = rnd32();
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nconns; i++)
+		open_conn(&conns[i]);
+	secs = secs_since(&start);
+	printf("%d connections filed in %.1f ms\n", nconns, secs * 1e3);
+
+	/* The active connections, for the segments to pick from */
+	for (i = 0, nactive = 0; i < nconns; i++) {
+		if (conns[i].active)
+			order[nactive++] = i;
+	}
+
+	for (tick = 1; tick <= duration * TCP_RETRANSHZ; tick++) {
+		tcp_now++;
+
+		/*
+		 * Segments go to connections that were active when the
+		 * run started; ones that have been replaced since by idle
+		 * ones are skipped.
+		 */
+		for (i = 0, j = 0; nactive > 0 && i < nsegs; i++) {
+			c = &conns[order[rnd32() % nactive]];
+			if (!c->active || !c->onlist)
+				continue;
+			segs[j] = c;
+			if ((rnd32() & 7) == 0)
+				when[j++] = tcp_now + DELACK;
+			else
+				when[j++] = tcp_now + rto();
+		}
+		gettimeofday(&start, NULL);
+		for (i = 0; i < j; i++)
+			arm(segs[i], when[i]);
+		t_arm += secs_since(&start);
+		arms += j;
+
+		for (i = 0; i < ncloses; i++)
+			closed[i] = &conns[rnd32() % nconns];
+		gettimeofday(&start, NULL);
+		for (i = 0; i < ncloses; i++) {
+			if (closed[i]->onlist) {
+				cancel(closed[i]);
+				cancels++;
+			}
+		}
+		t_cancel += secs_since(&start);
+		for (i = 0; i < ncloses; i++) {
+			if (!closed[i]->onlist)
+				open_conn(closed[i]);
+		}
+
+		if (tick % period == 0) {
+			gettimeofday(&start, NULL);
+			run();
+			t_run += secs_since(&start);
+			if (nruns % 1000 == 0)
+				check();
+		}
+	}
+	run();
+	check();
+
+	printf("%d connections (%d active), %d s: %llu arms (%llu moved), "
+	    "%llu cancels, %llu fired, %llu refiled\n", nconns, nactive,
+	    duration, (unsigned long long)narmed, (unsigned long long)nmoved,
+	    (unsigned long long)ncancelled, (unsigned long long)nfired,
+	    (unsigned long long)nrefiled);
+	printf("%llu runs every %d ms, timers fired up to %u ms late\n",
+	    (unsigned long long)nruns, period, maxlate);
+
+	/* The old list walk, over the connections in random order */
+	for (i = 0; i < nconns; i++)
+		order[i] = i;
+	for (i = nconns - 1; i > 0; i--) {
+		j = (int)(rnd32() % (i + 1));
+		k = order[i];
+		order[i] = order[j];
+		order[j] = k;
+	}
+	for (i = 0; i < nconns; i++) {
+		conns[order[i]].scan_next = head;
+		head = &conns[order[i]];
+	}
+	printf("wheel: %.1f ns per arm, %.1f ns per cancel, %.1f us per run\n",
+	    t_arm * 1e9 / MAX(arms, 1), t_cancel * 1e9 / MAX(cancels, 1),
+	    t_run * 1e6 / MAX(nruns, 1));
+	printf("list:  %.1f us per run\n", scan(head, 10) * 1e6);
+
+	if (failed) {
+		printf("%d checks failed\n", failed);
+		return (1);
+	}
+	return (0);
+}
@@ -79,6 +79,7 @@ struct test_entry   g_tests[] =
 	{1, &mknod_sync_test, NULL, "mknod, sync"},
 	{1, &socket2_tests, NULL, "fsync, getsockopt, poll, select, setsockopt, socketpair"},
 	{1, &socket_tests, NULL, "accept, bind, connect, getpeername, getsockname, listen, socket, recvmsg, sendmsg, sendto, sendfile"},
+	{1, &bpf_ring_test, NULL, "bpf capture ring (BIOCSRING)"},
 	{1, &chflags_fchflags_test, NULL, "chflags, fchflags"},
 	{1, &execve_kill_vfork_test, NULL, "kill, vfork, execve, posix_spawn"},
 	{1, &groups_test, NULL, "getegid, getgid, getgroups, setegid, setgid, setgroups"},
@@ -10,6 +10,31 @@
 #include "tests.h"
 #include <poll.h>
 #include <mach/mach.h>
+#include <sys/ioctl.h>
+#include <net/bpf.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifndef BIOCSRING
+/* from bsd/net/bpf.h */
+struct bpf_ring {
+	bpf_u_int32	br_blksize;
+	bpf_u_int32	br_nblocks;
+	u_int64_t	br_addr;
+};
+struct bpf_block_hdr {
+	volatile bpf_u_int32 bbh_status;
+#define	BPF_BLOCK_KERNEL	0
+#define	BPF_BLOCK_USER		1
+	bpf_u_int32	bbh_len;
+	bpf_u_int32	bbh_npkts;
+	bpf_u_int32	bbh_drops;
+	u_int64_t	bbh_seq;
+};
+#define	BPF_RING_HDRLEN		BPF_WORDALIGN(sizeof (struct bpf_block_hdr))
+#define	BIOCSRING	_IOWR('B', 128, struct bpf_ring)
+#endif
 
 extern char  g_target_path[ PATH_MAX ];
 
@@ -601,3 +626,187 @@ test_passed_exit:
 	return( my_err );
 }
 
+
+/*  **************************************************************************************************************
+ *	Test the bpf capture ring set up by BIOCSRING: packets sent over lo0 show up in a block handed to us,
+ *	FIONREAD only reports (doesn't hand over) blocks, read() is refused, and blocks can be given back.
+ *  **************************************************************************************************************
+ */
+int bpf_ring_test( void * the_argp )
+{
+	int						my_err, my_fd = -1, my_sock = -1;
+	int						i, my_avail, my_found = 0;
+	u_int					my_on = 1;
+	char					my_path[ 32 ];
+	char					my_marker[] = "xnu_quick_test bpf ring";
+	char *					my_ringp;
+	struct bpf_ring			my_ring, my_ring2;
+	struct bpf_program		my_prog;
+	struct bpf_block_hdr *	my_bhp;
+	struct bpf_hdr *		my_hp;
+	struct ifreq			my_ifr;
+	struct sockaddr_in		my_addr;
+	struct pollfd			my_pollfd;
+	ssize_t					my_result;
+	char					my_buffer[ 64 ];
+	u_int32_t				my_off, my_npkts = 0;
+	/* lo0 (DLT_NULL): accept UDP to the discard port only, assuming no IP options */
+	struct bpf_insn			my_insns[] = {
+		BPF_STMT( BPF_LD+BPF_B+BPF_ABS, 4 + 9 ),
+		BPF_JUMP( BPF_JMP+BPF_JEQ+BPF_K, IPPROTO_UDP, 0, 3 ),
+		BPF_STMT( BPF_LD+BPF_H+BPF_ABS, 4 + 20 + 2 ),
+		BPF_JUMP( BPF_JMP+BPF_JEQ+BPF_K, 9, 0, 1 ),
+		BPF_STMT( BPF_RET+BPF_K, (u_int)-1 ),
+		BPF_STMT( BPF_RET+BPF_K, 0 ),
+	};
+
+	for ( i = 0; i < 256; i++ ) {
+		snprintf( my_path, sizeof( my_path ), "/dev/bpf%d", i );
+		my_fd = open( my_path, O_RDWR );
+		if ( my_fd != -1 || errno != EBUSY )
+			break;
+	}
+	if ( my_fd == -1 ) {
+		printf( "open of bpf device failed with errno %d - %s \n", errno, strerror( errno ) );
+		goto test_failed_exit;
+	}
+
+	bzero( &my_ring, sizeof( my_ring ) );
+	my_ring.br_blksize = 8192;
+	my_ring.br_nblocks = 4;
+	my_err = ioctl( my_fd, BIOCSRING, &my_ring );
+	if ( my_err == -1 ) {
+		printf( "ioctl BIOCSRING failed with errno %d - %s \n", errno, strerror( errno ) );
+		goto test_failed_exit;
+	}
+	if ( my_ring.br_addr == 0 || my_ring.br_nblocks < 2 || my_ring.br_blksize < BPF_RING_HDRLEN ) {
+		printf( "BIOCSRING returned a bad ring: addr 0x%llx, %u blocks of %u bytes \n",
+			(unsigned long long)my_ring.br_addr, my_ring.br_nblocks, my_ring.br_blksize );
+		goto test_failed_exit;
+	}
+	my_ringp = (char *)(uintptr_t)my_ring.br_addr;
+
+	/* a descriptor only gets one ring */
+	my_ring2 = my_ring;
+	my_err = ioctl( my_fd, BIOCSRING, &my_ring2 );
+	if ( my_err != -1 || errno != EINVAL ) {
+		printf( "second BIOCSRING should have failed with EINVAL \n" );
+		goto test_failed_exit;
+	}
+
+	my_err = ioctl( my_fd, BIOCIMMEDIATE, &my_on );
+	if ( my_err == -1 ) {
+		printf( "ioctl BIOCIMMEDIATE failed with errno %d - %s \n", errno, strerror( errno ) );
+		goto test_failed_exit;
+	}
+	my_prog.bf_len = sizeof( my_insns ) / sizeof( my_insns[0] );
+	my_prog.bf_insns = my_insns;
+	my_err = ioctl( my_fd, BIOCSETF, &my_prog );
+	if ( my_err == -1 ) {
+		printf( "ioctl BIOCSETF failed with errno %d - %s \n", errno, strerror( errno ) );
+		goto test_failed_exit;
+	}
+	bzero( &my_ifr, sizeof( my_ifr ) );
+	strlcpy( my_ifr.ifr_name, "lo0", sizeof( my_ifr.ifr_name ) );
+	my_err = ioctl( my_fd, BIOCSETIF, &my_ifr );
+	if ( my_err == -1 ) {
+		printf( "ioctl BIOCSETIF failed with errno %d - %s \n", errno, strerror( errno ) );
+		goto test_failed_exit;
+	}
+
+	/* the ring replaces read() */
+	my_result = read( my_fd, my_buffer, sizeof( my_buffer ) );
+	if ( my_result != -1 || errno != EOPNOTSUPP ) {
+		printf( "read should have failed with EOPNOTSUPP \n" );
+		goto test_failed_exit;
+	}
+
+	my_sock = socket( AF_INET, SOCK_DGRAM, 0 );
+	if ( my_sock == -1 ) {
+		printf( "socket failed with errno %d - %s \n", errno, strerror( errno ) );
+		goto test_failed_exit;
+	}
+	bzero( &my_addr, sizeof( my_addr ) );
+	my_addr.sin_len = sizeof( my_addr );
+	my_addr.sin_family = AF_INET;
+	my_addr.sin_port = htons( 9 );	/* discard */
+	my_addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	my_result = sendto( my_sock, my_marker, sizeof( my_marker ), 0,
+						(struct sockaddr *)&my_addr, sizeof( my_addr ) );
+	if ( my_result != sizeof( my_marker ) ) {
+		printf( "sendto failed with errno %d - %s \n", errno, strerror( errno ) );
+		goto test_failed_exit;
+	}
+
+	my_pollfd.fd = my_fd;
+	my_pollfd.events = POLLIN;
+	my_pollfd.revents = 0;
+	my_err = poll( &my_pollfd, 1, 5000 );
+	if ( my_err != 1 || (my_pollfd.revents & POLLIN) == 0 ) {
+		printf( "poll did not report a ring block (returned %d, errno %d) \n", my_err, errno );
+		goto test_failed_exit;
+	}
+
+	/* FIONREAD reports the length of the block just handed over, and asking again changes nothing */
+	my_err = ioctl( my_fd, FIONREAD, &my_avail );
+	if ( my_err == -1 || my_avail <= 0 ) {
+		printf( "FIONREAD returned %d (errno %d) with a block handed over \n", my_avail, errno );
+		goto test_failed_exit;
+	}
+	my_err = ioctl( my_fd, FIONREAD, &i );
+	if ( my_err == -1 || i != my_avail ) {
+		printf( "second FIONREAD returned %d, first returned %d \n", i, my_avail );
+		goto test_failed_exit;
+	}
+
+	/* walk the blocks we own looking for our datagram */
+	for ( i = 0; i < (int)my_ring.br_nblocks; i++ ) {
+		my_bhp = (struct bpf_block_hdr *)(void *)(my_ringp + (size_t)i * my_ring.br_blksize);
+		if ( my_bhp->bbh_status != BPF_BLOCK_USER )
+			break;
+		if ( my_bhp->bbh_len > my_ring.br_blksize - BPF_RING_HDRLEN ) {
+			printf( "ring block %d has bad length %u \n", i, my_bhp->bbh_len );
+			goto test_failed_exit;
+		}
+		for ( my_off = 0; my_off < my_bhp->bbh_len;
+			  my_off += BPF_WORDALIGN( my_hp->bh_hdrlen + my_hp->bh_caplen ) ) {
+			my_hp = (struct bpf_hdr *)(void *)((char *)my_bhp + BPF_RING_HDRLEN + my_off);
+			if ( my_hp->bh_caplen == 0 || my_hp->bh_caplen > my_hp->bh_datalen ) {
+				printf( "ring block %d has a bad record at offset %u \n", i, my_off );
+				goto test_failed_exit;
+			}
+			if ( my_hp->bh_caplen >= sizeof( my_marker ) &&
+				 memcmp( (char *)my_hp + my_hp->bh_hdrlen + my_hp->bh_caplen - sizeof( my_marker ),
+						 my_marker, sizeof( my_marker ) ) == 0 )
+				my_found = 1;
+		}
+		my_npkts += my_bhp->bbh_npkts;
+		/* give it back */
+		my_bhp->bbh_status = BPF_BLOCK_KERNEL;
+	}
+	if ( my_found == 0 || my_npkts != 1 ) {
+		printf( "expected our datagram alone in the capture ring, found %u packets (marker %s) \n",
+				my_npkts, my_found ? "found" : "not found" );
+		goto test_failed_exit;
+	}
+
+	/* with every block given back there is nothing left to report */
+	my_err = ioctl( my_fd, FIONREAD, &my_avail );
+	if ( my_err == -1 || my_avail != 0 ) {
+		printf( "FIONREAD returned %d (errno %d) after the blocks were given back \n", my_avail, errno );
+		goto test_failed_exit;
+	}
+
+	my_err = 0;
+	goto test_passed_exit;
+
+test_failed_exit:
+	my_err = -1;
+
+test_passed_exit:
+	if ( my_sock != -1 )
+		close( my_sock );
+	if ( my_fd != -1 )
+		close( my_fd );
+	return( my_err );
+}
@@ -109,6 +109,7 @@ int shm_tests( void * the_argp );
 int signals_test( void * the_argp );
 int socket_tests( void * the_argp );
 int socket2_tests( void * the_argp );
+int bpf_ring_test( void * the_argp );
 int syscall_test( void * the_argp );
 int time_tests( void * the_argp );
 int uid_tests( void * the_argp );